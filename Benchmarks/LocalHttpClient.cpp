@@ -0,0 +1,607 @@
+// LocalHttpClient.cpp : Downloads maps from a LocalHttpServer.
+//
+#include "LocalHttpClient.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    // poll's timeout for a wait of nMs, 0 being no limit
+    int PollTimeout(unsigned nMs)
+    {
+        return (nMs > 0) ? (int)nMs : -1;
+    }
+
+    // the longest response header accepted
+    const size_t kMaxHeaderBytes = 16 * 1024;
+
+    double Milliseconds(Clock::time_point start, Clock::time_point end)
+    {
+        return std::chrono::duration<double, std::milli>(end - start).count();
+    }
+
+    bool SendAll(int nSocket, const char* p, size_t nBytes)
+    {
+        while (nBytes > 0)
+        {
+            ssize_t nSent = send(nSocket, p, nBytes, MSG_NOSIGNAL);
+
+            if (nSent <= 0)
+            {
+                return false;
+            }
+
+            p += nSent;
+            nBytes -= (size_t)nSent;
+        }
+
+        return true;
+    }
+
+    // true if strText starts with pszPrefix, ignoring case
+    bool StartsWithNoCase(std::string_view strText, const char* pszPrefix)
+    {
+        size_t i = 0;
+
+        for (; pszPrefix[i]; i++)
+        {
+            if (i >= strText.size() || tolower((unsigned char)strText[i]) != tolower((unsigned char)pszPrefix[i]))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // the value of a header, or an empty view.  pszName is lower case.
+    std::string_view HeaderValue(std::string_view strHeaders, const char* pszName)
+    {
+        // each header follows the CRLF that ends the line before it
+        for (size_t nLine = strHeaders.find("\r\n"); nLine != std::string_view::npos;
+            nLine = strHeaders.find("\r\n", nLine + 2))
+        {
+            std::string_view strLine = strHeaders.substr(nLine + 2);
+            strLine = strLine.substr(0, strLine.find("\r\n"));
+
+            size_t nNameLength = strlen(pszName);
+
+            if (strLine.size() > nNameLength && ':' == strLine[nNameLength] && StartsWithNoCase(strLine, pszName))
+            {
+                std::string_view strValue = strLine.substr(nNameLength + 1);
+                size_t nStart = strValue.find_first_not_of(" \t");
+
+                return (nStart == std::string_view::npos) ? std::string_view() : strValue.substr(nStart);
+            }
+        }
+
+        return std::string_view();
+    }
+
+    // true if the header's value contains pszToken, ignoring case.
+    // pszToken is lower case.
+    bool HeaderHas(std::string_view strHeaders, const char* pszName, const char* pszToken)
+    {
+        std::string_view strValue = HeaderValue(strHeaders, pszName);
+
+        for (size_t i = 0; i < strValue.size(); i++)
+        {
+            if (StartsWithNoCase(strValue.substr(i), pszToken))
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // copy nBytes into body the way the read loop does
+    bool AppendBytes(StreamingBuffer& body, const char* p, size_t nBytes)
+    {
+        while (nBytes > 0)
+        {
+            size_t nAvailable = 0;
+            uint8_t* pWrite = body.PrepareWrite(1, &nAvailable);
+
+            if (!pWrite)
+            {
+                return false;
+            }
+
+            size_t nCopy = std::min(nAvailable, nBytes);
+            memcpy(pWrite, p, nCopy);
+            body.CommitWrite(nCopy);
+
+            p += nCopy;
+            nBytes -= nCopy;
+        }
+
+        return true;
+    }
+}
+
+LocalHttpClient::LocalHttpClient()
+    : m_nSocket(-1), m_nPort(0),
+      m_nConnectTimeoutMs(0), m_nReadTimeoutMs(0), m_nTotalTimeoutMs(0),
+      m_bTimedOut(false), m_bInterrupted(false)
+{
+}
+
+LocalHttpClient::~LocalHttpClient()
+{
+    Close();
+}
+
+void LocalHttpClient::SetTimeouts(unsigned nConnectMs, unsigned nReadMs, unsigned nTotalMs)
+{
+    m_nConnectTimeoutMs = nConnectMs;
+    m_nReadTimeoutMs = nReadMs;
+    m_nTotalTimeoutMs = nTotalMs;
+}
+
+void LocalHttpClient::Close()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (m_nSocket >= 0)
+    {
+        close(m_nSocket);
+        m_nSocket = -1;
+    }
+}
+
+void LocalHttpClient::Interrupt()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_bInterrupted = true;
+
+    // wakes a blocked connect, poll or recv.  The socket is closed by the
+    // thread using it.
+    if (m_nSocket >= 0)
+    {
+        shutdown(m_nSocket, SHUT_RDWR);
+    }
+}
+
+void LocalHttpClient::ResetInterrupt()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_bInterrupted = false;
+}
+
+bool LocalHttpClient::Connect(uint16_t nPort)
+{
+    Close();
+
+    int nSocket = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (nSocket < 0)
+    {
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (m_bInterrupted)
+        {
+            close(nSocket);
+            return false;
+        }
+
+        m_nSocket = nSocket;
+    }
+
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(nPort);
+
+    // connect without blocking, so the wait for it can time out
+    int nFlags = fcntl(nSocket, F_GETFL, 0);
+    fcntl(nSocket, F_SETFL, nFlags | O_NONBLOCK);
+
+    if (connect(nSocket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0)
+    {
+        if (EINPROGRESS != errno)
+        {
+            Close();
+            return false;
+        }
+
+        pollfd waitFor = { nSocket, POLLOUT, 0 };
+        int nReady = poll(&waitFor, 1, PollTimeout(m_nConnectTimeoutMs));
+
+        int nError = 0;
+        socklen_t nErrorSize = sizeof(nError);
+
+        if (nReady <= 0 || getsockopt(nSocket, SOL_SOCKET, SO_ERROR, &nError, &nErrorSize) < 0 || nError != 0)
+        {
+            m_bTimedOut = (0 == nReady);
+            Close();
+            return false;
+        }
+    }
+
+    fcntl(nSocket, F_SETFL, nFlags);
+
+    int nNoDelay = 1;
+    setsockopt(m_nSocket, IPPROTO_TCP, TCP_NODELAY, &nNoDelay, sizeof(nNoDelay));
+
+    m_nPort = nPort;
+
+    return true;
+}
+
+ssize_t LocalHttpClient::Receive(void* pBuffer, size_t nBytes)
+{
+    unsigned nWaitMs = m_nReadTimeoutMs;
+
+    if (m_nTotalTimeoutMs > 0)
+    {
+        int64_t nLeftMs = std::chrono::duration_cast<std::chrono::milliseconds>(m_deadline - Clock::now()).count();
+
+        if (nLeftMs <= 0)
+        {
+            m_bTimedOut = true;
+            return -1;
+        }
+
+        nWaitMs = (0 == nWaitMs) ? (unsigned)nLeftMs : std::min(nWaitMs, (unsigned)nLeftMs);
+    }
+
+    if (nWaitMs > 0)
+    {
+        pollfd waitFor = { m_nSocket, POLLIN, 0 };
+
+        if (0 == poll(&waitFor, 1, (int)nWaitMs))
+        {
+            m_bTimedOut = true;
+            return -1;
+        }
+    }
+
+    return recv(m_nSocket, pBuffer, nBytes, 0);
+}
+
+int LocalHttpClient::Get(uint16_t nPort, std::string_view strPath, StreamingBuffer& body,
+    LocalHttpTiming* pTiming, std::pmr::memory_resource* pResource,
+    std::string_view strRequestHeaders, std::pmr::string* pResponseHeadersOut)
+{
+    LocalHttpTiming timing;
+
+    m_bTimedOut = false;
+    m_deadline = Clock::now() + std::chrono::milliseconds(m_nTotalTimeoutMs);
+
+    if (!pResource)
+    {
+        pResource = std::pmr::get_default_resource();
+    }
+
+    std::pmr::string strRequest(pResource);
+    strRequest.append("GET ").append(strPath).append(" HTTP/1.1\r\nHost: 127.0.0.1\r\nConnection: keep-alive\r\n");
+    strRequest.append(strRequestHeaders).append("\r\n");
+
+    std::pmr::string strHeaders(pResource);
+    char buffer[4096];
+
+    // a kept-alive connection the server has since closed fails on the
+    // first send or read, so try once more on a new one
+    for (int nAttempt = 0; nAttempt < 2 && strHeaders.empty(); nAttempt++)
+    {
+        timing.reusedConnection = (m_nSocket >= 0 && m_nPort == nPort && 0 == nAttempt);
+
+        if (!timing.reusedConnection)
+        {
+            Clock::time_point connecting = Clock::now();
+
+            if (!Connect(nPort))
+            {
+                return Fail(body, pTiming);
+            }
+
+            timing.connectMs = Milliseconds(connecting, Clock::now());
+        }
+
+        Clock::time_point sending = Clock::now();
+
+        if (!SendAll(m_nSocket, strRequest.data(), strRequest.size()))
+        {
+            Close();
+            continue;
+        }
+
+        while (strHeaders.find("\r\n\r\n") == std::string::npos && strHeaders.size() < kMaxHeaderBytes)
+        {
+            ssize_t nRead = Receive(buffer, sizeof(buffer));
+
+            if (nRead <= 0)
+            {
+                Close();
+                break;
+            }
+
+            strHeaders.append(buffer, (size_t)nRead);
+        }
+
+        if (strHeaders.find("\r\n\r\n") == std::string::npos)
+        {
+            // only a connection that was reused gets another try
+            bool bRetry = timing.reusedConnection && strHeaders.empty() && !m_bTimedOut;
+
+            strHeaders.clear();
+
+            if (!bRetry)
+            {
+                break;
+            }
+
+            continue;
+        }
+
+        timing.firstByteMs = Milliseconds(sending, Clock::now());
+    }
+
+    size_t nHeaderEnd = strHeaders.find("\r\n\r\n");
+
+    if (nHeaderEnd == std::string::npos || strHeaders.compare(0, 5, "HTTP/") != 0)
+    {
+        return Fail(body, pTiming);
+    }
+
+    Clock::time_point headers = Clock::now();
+
+    // "HTTP/1.1 200 OK"
+    int nStatus = atoi(strHeaders.c_str() + strHeaders.find(' ') + 1);
+
+    std::string_view strResponseHeaders = std::string_view(strHeaders).substr(0, nHeaderEnd + 2);
+    std::string_view strLength = HeaderValue(strResponseHeaders, "content-length");
+    bool bClose = HeaderHas(strResponseHeaders, "connection", "close");
+    bool bChunked = HeaderHas(strResponseHeaders, "transfer-encoding", "chunked");
+
+    if (pResponseHeadersOut)
+    {
+        pResponseHeadersOut->assign(strResponseHeaders);
+    }
+
+    if (304 == nStatus || 204 == nStatus || (nStatus >= 100 && nStatus < 200))
+    {
+        // these never have a body, whatever their headers say
+    }
+    else if (bChunked)
+    {
+        // whatever came with the headers is the start of the first chunk
+        strHeaders.erase(0, nHeaderEnd + 4);
+
+        if (!ReadChunkedBody(strHeaders, body, timing))
+        {
+            return Fail(body, pTiming);
+        }
+    }
+    else if (!ReadBody(std::string_view(strHeaders).substr(nHeaderEnd + 4), strLength, body, timing))
+    {
+        return Fail(body, pTiming);
+    }
+
+    timing.transferMs = Milliseconds(headers, Clock::now());
+
+    if (bClose)
+    {
+        Close();
+    }
+
+    body.Finish();
+
+    if (pTiming)
+    {
+        *pTiming = timing;
+    }
+
+    return nStatus;
+}
+
+int LocalHttpClient::Fail(StreamingBuffer& body, LocalHttpTiming* pTiming)
+{
+    Close();
+    body.Abort();
+
+    if (pTiming)
+    {
+        *pTiming = LocalHttpTiming();
+        pTiming->timedOut = m_bTimedOut;
+    }
+
+    return 0;
+}
+
+bool LocalHttpClient::ReadBody(std::string_view strStart, std::string_view strLength,
+    StreamingBuffer& body, LocalHttpTiming& timing)
+{
+    bool bHaveLength = !strLength.empty();
+    size_t nLength = 0;
+
+    for (size_t i = 0; i < strLength.size() && isdigit((unsigned char)strLength[i]); i++)
+    {
+        nLength = nLength * 10 + (size_t)(strLength[i] - '0');
+    }
+
+    if (bHaveLength)
+    {
+        // room for the whole body, as GetBingMap reserves from Content-Length
+        if (!body.Reserve(nLength + 1))
+        {
+            return false;
+        }
+
+        body.SetExpectedSize(nLength);
+    }
+
+    size_t nExtra = strStart.size();
+
+    if (bHaveLength && nExtra > nLength)
+    {
+        nExtra = nLength;
+    }
+
+    if (!AppendBytes(body, strStart.data(), nExtra))
+    {
+        return false;
+    }
+
+    // the read loop
+    while (!bHaveLength || body.Size() < nLength)
+    {
+        size_t nAvailable = 0;
+        uint8_t* pWrite = body.PrepareWrite(1, &nAvailable);
+
+        if (!pWrite)
+        {
+            return false;
+        }
+
+        size_t nToRead = std::min(nAvailable, kMaxReadSize);
+
+        if (bHaveLength)
+        {
+            nToRead = std::min(nToRead, nLength - body.Size());
+        }
+
+        ssize_t nRead = Receive(pWrite, nToRead);
+
+        timing.nReads++;
+
+        if (nRead <= 0)
+        {
+            Close();
+
+            // without a length, the end of the connection is the end of
+            // the body, unless it was cut short
+            return !bHaveLength && 0 == nRead && !m_bTimedOut && !m_bInterrupted;
+        }
+
+        body.CommitWrite((size_t)nRead);
+    }
+
+    return true;
+}
+
+bool LocalHttpClient::ReadChunkedBody(std::pmr::string& strPending, StreamingBuffer& body, LocalHttpTiming& timing)
+{
+    for (;;)
+    {
+        // "1a2b;extension\r\n"
+        if (!ReadLine(strPending))
+        {
+            return false;
+        }
+
+        size_t nChunk = (size_t)strtoull(strPending.c_str(), nullptr, 16);
+        strPending.erase(0, strPending.find("\r\n") + 2);
+
+        if (0 == nChunk)
+        {
+            break;
+        }
+
+        // the start of the chunk may have come with the size line
+        size_t nBuffered = std::min(nChunk, strPending.size());
+
+        if (!AppendBytes(body, strPending.data(), nBuffered))
+        {
+            return false;
+        }
+
+        strPending.erase(0, nBuffered);
+        nChunk -= nBuffered;
+
+        // the rest is read straight into the body
+        while (nChunk > 0)
+        {
+            size_t nAvailable = 0;
+            uint8_t* pWrite = body.PrepareWrite(1, &nAvailable);
+
+            if (!pWrite)
+            {
+                return false;
+            }
+
+            ssize_t nRead = Receive(pWrite, std::min(std::min(nAvailable, kMaxReadSize), nChunk));
+
+            timing.nReads++;
+
+            if (nRead <= 0)
+            {
+                return false;
+            }
+
+            body.CommitWrite((size_t)nRead);
+            nChunk -= (size_t)nRead;
+        }
+
+        // the CRLF after the data
+        if (!ReadLine(strPending) || strPending.compare(0, 2, "\r\n") != 0)
+        {
+            return false;
+        }
+
+        strPending.erase(0, 2);
+    }
+
+    // trailers, if any, up to the blank line
+    for (;;)
+    {
+        if (!ReadLine(strPending))
+        {
+            return false;
+        }
+
+        size_t nLineEnd = strPending.find("\r\n");
+        strPending.erase(0, nLineEnd + 2);
+
+        if (0 == nLineEnd)
+        {
+            return true;
+        }
+    }
+}
+
+bool LocalHttpClient::ReadLine(std::pmr::string& strPending)
+{
+    char buffer[4096];
+
+    while (strPending.find("\r\n") == std::string::npos)
+    {
+        if (strPending.size() > kMaxHeaderBytes)
+        {
+            return false;
+        }
+
+        ssize_t nRead = Receive(buffer, sizeof(buffer));
+
+        if (nRead <= 0)
+        {
+            return false;
+        }
+
+        strPending.append(buffer, (size_t)nRead);
+    }
+
+    return true;
+}
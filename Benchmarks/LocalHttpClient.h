@@ -0,0 +1,117 @@
+// LocalHttpClient.h : Downloads maps from a LocalHttpServer.
+//
+// The POSIX counterpart of the read loop in GetBingMap: the body is read
+// straight into a StreamingBuffer with PrepareWrite and CommitWrite, at
+// most kMaxReadSize bytes a read, with the buffer reserved up front from
+// the Content-Length.  The connection is kept alive between requests, as
+// HttpSessionPool keeps its WinInet connections alive.  Chunked bodies,
+// which have no Content-Length, are read chunk by chunk into the same
+// buffer, as WinInet does for GetBingMap.
+//
+// A request can carry extra headers, such as the If-None-Match of a
+// conditional request, and the response headers can be kept, for the
+// validators of the map.  A 304 has no body.
+//
+// Like HttpSessionPool, it can be given a connect timeout, a read timeout
+// and a limit on the whole request, and a request that is stuck can be
+// interrupted from another thread, for MapRetrier's hedged requests.
+//
+// POSIX sockets only.
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory_resource>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#include <sys/types.h>
+
+#include "StreamingBuffer.h"
+
+// where the time went in one request, as HttpRequestTiming
+struct LocalHttpTiming
+{
+    bool        reusedConnection = false;
+    double      connectMs = 0;
+    double      firstByteMs = 0;    // request sent until the response headers arrived
+    double      transferMs = 0;     // headers until the last byte of the body
+    unsigned    nReads = 0;         // reads into the body buffer
+    bool        timedOut = false;   // a timeout ended the request
+};
+
+class LocalHttpClient
+{
+public:
+    // the most read at once, as g_nMaxReadSize
+    static constexpr size_t kMaxReadSize = 64 * 1024;
+
+    LocalHttpClient();
+    ~LocalHttpClient();
+
+    LocalHttpClient(const LocalHttpClient&) = delete;
+    LocalHttpClient& operator=(const LocalHttpClient&) = delete;
+
+    // as MapRetryPolicy's, in milliseconds, 0 for no limit.  The read
+    // timeout applies to each read, and the total is checked between them.
+    void SetTimeouts(unsigned nConnectMs, unsigned nReadMs, unsigned nTotalMs);
+
+    // GET strPath from 127.0.0.1:nPort into body, connecting first if
+    // there is no open connection.  body is finished once the whole
+    // response has arrived and aborted if it doesn't.  Returns the HTTP
+    // status, or 0 if the connection failed.  The request and response
+    // headers are held in memory from pResource, such as a
+    // MapRequestArena, or from the heap if it is null.  strRequestHeaders
+    // are added to the request, each line ending in CRLF, and the response
+    // headers, from the status line to the blank line, are copied to
+    // pResponseHeadersOut if it is given.
+    int Get(uint16_t nPort, std::string_view strPath, StreamingBuffer& body,
+        LocalHttpTiming* pTiming = nullptr, std::pmr::memory_resource* pResource = nullptr,
+        std::string_view strRequestHeaders = std::string_view(), std::pmr::string* pResponseHeadersOut = nullptr);
+
+    void Close();
+
+    // make the request in progress fail at once, and any more until
+    // ResetInterrupt.  Safe to call from any thread.
+    void Interrupt();
+    void ResetInterrupt();
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    bool Connect(uint16_t nPort);
+
+    // recv, noting whether it timed out or is past the deadline
+    ssize_t Receive(void* pBuffer, size_t nBytes);
+
+    // close the connection and abort body after a failed request.
+    // Returns 0, Get's status for no response.
+    int Fail(StreamingBuffer& body, LocalHttpTiming* pTiming);
+
+    // read a body of strLength bytes, or up to the end of the connection if
+    // strLength is empty, after strStart, which came with the headers
+    bool ReadBody(std::string_view strStart, std::string_view strLength,
+        StreamingBuffer& body, LocalHttpTiming& timing);
+
+    // read a chunked body.  strPending holds what has been received but
+    // not used yet.
+    bool ReadChunkedBody(std::pmr::string& strPending, StreamingBuffer& body, LocalHttpTiming& timing);
+
+    // receive into strPending until it holds a whole line
+    bool ReadLine(std::pmr::string& strPending);
+
+    int                 m_nSocket;
+    uint16_t            m_nPort;
+
+    unsigned            m_nConnectTimeoutMs;
+    unsigned            m_nReadTimeoutMs;
+    unsigned            m_nTotalTimeoutMs;
+    Clock::time_point   m_deadline;         // of the request in progress, if there is a total timeout
+    bool                m_bTimedOut;
+
+    // protects m_nSocket against Interrupt
+    std::mutex          m_mutex;
+    std::atomic<bool>   m_bInterrupted;
+};
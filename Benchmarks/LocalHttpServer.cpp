@@ -0,0 +1,681 @@
+// LocalHttpServer.cpp : A tiny HTTP/1.1 server on the loopback interface.
+//
+#include "LocalHttpServer.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iterator>
+#include <random>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    // the longest request header accepted
+    const size_t kMaxRequestBytes = 16 * 1024;
+
+    // the most sent at once by a throttled connection, so that its rate is
+    // smooth rather than a burst every second
+    const size_t kThrottleSliceBytes = 4 * 1024;
+
+    // the longest Pause sleeps before looking to see if the server is stopping
+    const std::chrono::milliseconds kStopPollInterval(20);
+
+    bool SendAll(int nSocket, const void* pData, size_t nBytes)
+    {
+        const char* p = static_cast<const char*>(pData);
+
+        while (nBytes > 0)
+        {
+            ssize_t nSent = send(nSocket, p, nBytes, MSG_NOSIGNAL);
+
+            if (nSent <= 0)
+            {
+                return false;
+            }
+
+            p += nSent;
+            nBytes -= (size_t)nSent;
+        }
+
+        return true;
+    }
+
+    // true if the request asks for the connection to be closed afterwards
+    bool WantsClose(const std::string& strRequest)
+    {
+        std::string strLower(strRequest);
+        std::transform(strLower.begin(), strLower.end(), strLower.begin(),
+            [](unsigned char c) { return (char)tolower(c); });
+
+        if (strLower.find("\r\nconnection: close") != std::string::npos)
+        {
+            return true;
+        }
+
+        // HTTP/1.0 closes unless asked not to
+        return strLower.find(" http/1.0\r\n") != std::string::npos &&
+            strLower.find("\r\nconnection: keep-alive") == std::string::npos;
+    }
+
+    // the value of a request header, or an empty string.  pszName is
+    // lower case.
+    std::string RequestHeader(const std::string& strRequest, const char* pszName)
+    {
+        size_t nNameLength = strlen(pszName);
+
+        for (size_t nLine = strRequest.find("\r\n"); nLine != std::string::npos;
+            nLine = strRequest.find("\r\n", nLine + 2))
+        {
+            size_t nStart = nLine + 2;
+            size_t nEnd = strRequest.find("\r\n", nStart);
+
+            if (nEnd == std::string::npos || nEnd - nStart <= nNameLength || ':' != strRequest[nStart + nNameLength])
+            {
+                continue;
+            }
+
+            bool bMatches = true;
+
+            for (size_t i = 0; i < nNameLength && bMatches; i++)
+            {
+                bMatches = (tolower((unsigned char)strRequest[nStart + i]) == pszName[i]);
+            }
+
+            if (bMatches)
+            {
+                size_t nValue = strRequest.find_first_not_of(" \t", nStart + nNameLength + 1);
+
+                return (nValue == std::string::npos || nValue >= nEnd) ? std::string() :
+                    strRequest.substr(nValue, strRequest.find_last_not_of(" \t", nEnd - 1) + 1 - nValue);
+            }
+        }
+
+        return std::string();
+    }
+
+    // an HTTP date in seconds since 1970, or -1 if it isn't one
+    time_t ParseHttpDate(const std::string& strDate)
+    {
+        struct tm date = {};
+
+        if (strDate.empty() || !strptime(strDate.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &date))
+        {
+            return (time_t)-1;
+        }
+
+        return timegm(&date);
+    }
+}
+
+// a connection and its own random numbers, so that faults don't need a lock
+struct LocalHttpServer::Connection
+{
+    int             nSocket;
+    std::mt19937    random;
+
+    // true with probability fRate
+    bool Chance(double fRate)
+    {
+        return fRate > 0 && std::uniform_real_distribution<double>(0.0, 1.0)(random) < fRate;
+    }
+};
+
+LocalHttpServer::LocalHttpServer()
+    : m_nMaxAgeSeconds(-1), m_nListenSocket(-1), m_nPort(0), m_bStopping(false), m_nRequests(0),
+      m_nNotFound(0), m_nErrors(0), m_nTruncated(0), m_nStalled(0), m_nConditional(0), m_nNotModified(0),
+      m_nBodyBytes(0), m_nConnections(0)
+{
+}
+
+std::string LocalHttpServer::HttpDate(time_t tTime)
+{
+    struct tm date = {};
+    char szDate[64];
+
+    gmtime_r(&tTime, &date);
+    strftime(szDate, sizeof(szDate), "%a, %d %b %Y %H:%M:%S GMT", &date);
+
+    return szDate;
+}
+
+bool LocalHttpServer::IsConditional(const std::string& strRequest, const LocalHttpFile& file, bool* pbMatches)
+{
+    std::string strIfNoneMatch = RequestHeader(strRequest, "if-none-match");
+    std::string strIfModifiedSince = RequestHeader(strRequest, "if-modified-since");
+
+    *pbMatches = false;
+
+    // If-None-Match wins when there are both
+    if (!strIfNoneMatch.empty())
+    {
+        for (size_t nStart = 0; nStart < strIfNoneMatch.size(); )
+        {
+            size_t nComma = strIfNoneMatch.find(',', nStart);
+
+            if (nComma == std::string::npos)
+            {
+                nComma = strIfNoneMatch.size();
+            }
+
+            std::string strTag = strIfNoneMatch.substr(nStart, nComma - nStart);
+            size_t nTagStart = strTag.find_first_not_of(" \t");
+            size_t nTagEnd = strTag.find_last_not_of(" \t");
+
+            strTag = (nTagStart == std::string::npos) ? std::string() : strTag.substr(nTagStart, nTagEnd + 1 - nTagStart);
+
+            // a weak tag matches its strong twin, for a GET
+            if (0 == strTag.compare(0, 2, "W/"))
+            {
+                strTag.erase(0, 2);
+            }
+
+            if ("*" == strTag || (!file.strETag.empty() && strTag == file.strETag))
+            {
+                *pbMatches = true;
+                break;
+            }
+
+            nStart = nComma + 1;
+        }
+
+        return true;
+    }
+
+    if (!strIfModifiedSince.empty())
+    {
+        time_t tSince = ParseHttpDate(strIfModifiedSince);
+        time_t tModified = ParseHttpDate(file.strLastModified);
+
+        *pbMatches = (tSince != (time_t)-1 && tModified != (time_t)-1 && tModified <= tSince);
+
+        return true;
+    }
+
+    return false;
+}
+
+LocalHttpServer::~LocalHttpServer()
+{
+    Stop();
+}
+
+void LocalHttpServer::AddFile(const std::string& strPath, std::vector<uint8_t> body,
+    const std::string& strContentType)
+{
+    LocalHttpFile& file = m_files[strPath];
+
+    file.body = std::move(body);
+    file.strContentType = strContentType;
+}
+
+bool LocalHttpServer::Start(uint16_t nPort)
+{
+    m_nListenSocket = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (m_nListenSocket < 0)
+    {
+        return false;
+    }
+
+    int nReuse = 1;
+    setsockopt(m_nListenSocket, SOL_SOCKET, SO_REUSEADDR, &nReuse, sizeof(nReuse));
+
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(nPort);
+
+    socklen_t nLength = sizeof(address);
+
+    if (bind(m_nListenSocket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 ||
+        listen(m_nListenSocket, SOMAXCONN) < 0 ||
+        getsockname(m_nListenSocket, reinterpret_cast<sockaddr*>(&address), &nLength) < 0)
+    {
+        close(m_nListenSocket);
+        m_nListenSocket = -1;
+        return false;
+    }
+
+    m_nPort = ntohs(address.sin_port);
+    m_bStopping = false;
+
+    m_acceptThread = std::thread(&LocalHttpServer::AcceptLoop, this);
+
+    return true;
+}
+
+LocalHttpServer::Stats LocalHttpServer::GetStats() const
+{
+    Stats stats;
+
+    stats.nRequests = m_nRequests.load(std::memory_order_relaxed);
+    stats.nNotFound = m_nNotFound.load(std::memory_order_relaxed);
+    stats.nErrors = m_nErrors.load(std::memory_order_relaxed);
+    stats.nTruncated = m_nTruncated.load(std::memory_order_relaxed);
+    stats.nStalled = m_nStalled.load(std::memory_order_relaxed);
+    stats.nConditional = m_nConditional.load(std::memory_order_relaxed);
+    stats.nNotModified = m_nNotModified.load(std::memory_order_relaxed);
+    stats.nBodyBytes = m_nBodyBytes.load(std::memory_order_relaxed);
+
+    return stats;
+}
+
+void LocalHttpServer::Stop()
+{
+    if (m_nListenSocket < 0)
+    {
+        return;
+    }
+
+    m_bStopping = true;
+
+    // wakes accept
+    shutdown(m_nListenSocket, SHUT_RDWR);
+
+    if (m_acceptThread.joinable())
+    {
+        m_acceptThread.join();
+    }
+
+    close(m_nListenSocket);
+    m_nListenSocket = -1;
+
+    std::vector<std::thread> threads;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        // wakes every connection waiting in recv.  Each closes its own socket.
+        for (int nSocket : m_connections)
+        {
+            shutdown(nSocket, SHUT_RDWR);
+        }
+
+        threads.swap(m_connectionThreads);
+        m_finishedThreads.clear();
+    }
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+}
+
+void LocalHttpServer::AcceptLoop()
+{
+    while (!m_bStopping)
+    {
+        int nSocket = accept(m_nListenSocket, nullptr, nullptr);
+
+        if (nSocket < 0)
+        {
+            if (m_bStopping)
+            {
+                break;
+            }
+
+            continue;
+        }
+
+        // responses are written whole, don't hold back the last segment
+        int nNoDelay = 1;
+        setsockopt(nSocket, IPPROTO_TCP, TCP_NODELAY, &nNoDelay, sizeof(nNoDelay));
+
+        // the threads of connections that have closed since the last one
+        std::vector<std::thread> finished;
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            if (m_bStopping)
+            {
+                close(nSocket);
+                break;
+            }
+
+            auto itFinished = std::partition(m_connectionThreads.begin(), m_connectionThreads.end(),
+                [this](const std::thread& thread)
+                {
+                    return std::find(m_finishedThreads.begin(), m_finishedThreads.end(), thread.get_id()) ==
+                        m_finishedThreads.end();
+                });
+
+            std::move(itFinished, m_connectionThreads.end(), std::back_inserter(finished));
+            m_connectionThreads.erase(itFinished, m_connectionThreads.end());
+            m_finishedThreads.clear();
+
+            // each connection's random numbers differ, but are the same from run to run
+            uint32_t nSeed = m_faults.nSeed + m_nConnections++;
+
+            m_connections.push_back(nSocket);
+            m_connectionThreads.emplace_back(&LocalHttpServer::ServeConnection, this, nSocket, nSeed);
+        }
+
+        // they have returned already, or are about to
+        for (std::thread& thread : finished)
+        {
+            thread.join();
+        }
+    }
+}
+
+void LocalHttpServer::ServeConnection(int nSocket, uint32_t nSeed)
+{
+    Connection connection = { nSocket, std::mt19937(nSeed) };
+
+    std::string strPending;
+    char buffer[4096];
+
+    for (;;)
+    {
+        size_t nEnd = strPending.find("\r\n\r\n");
+
+        if (nEnd == std::string::npos)
+        {
+            if (strPending.size() > kMaxRequestBytes)
+            {
+                break;
+            }
+
+            ssize_t nRead = recv(nSocket, buffer, sizeof(buffer), 0);
+
+            if (nRead <= 0)
+            {
+                break;
+            }
+
+            strPending.append(buffer, (size_t)nRead);
+            continue;
+        }
+
+        // GET requests have no body, so the request ends at the blank line
+        std::string strRequest = strPending.substr(0, nEnd + 4);
+        strPending.erase(0, nEnd + 4);
+
+        if (!Respond(connection, strRequest))
+        {
+            break;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_connections.erase(std::remove(m_connections.begin(), m_connections.end(), nSocket),
+            m_connections.end());
+        m_finishedThreads.push_back(std::this_thread::get_id());
+    }
+
+    close(nSocket);
+}
+
+bool LocalHttpServer::Respond(Connection& connection, const std::string& strRequest)
+{
+    int nSocket = connection.nSocket;
+
+    m_nRequests.fetch_add(1, std::memory_order_relaxed);
+
+    // "GET /path?query HTTP/1.1"
+    size_t nPathStart = strRequest.find(' ');
+    size_t nPathEnd = (nPathStart == std::string::npos) ? nPathStart : strRequest.find(' ', nPathStart + 1);
+
+    if (nPathEnd == std::string::npos || strRequest.compare(0, nPathStart, "GET") != 0)
+    {
+        static const char kBadRequest[] = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        SendAll(nSocket, kBadRequest, sizeof(kBadRequest) - 1);
+        return false;
+    }
+
+    std::string strPath = strRequest.substr(nPathStart + 1, nPathEnd - nPathStart - 1);
+    size_t nQuery = strPath.find('?');
+    std::string strQuery = (nQuery == std::string::npos) ? std::string() : strPath.substr(nQuery + 1);
+
+    strPath = strPath.substr(0, nQuery);
+
+    bool bClose = WantsClose(strRequest);
+    const char* pszConnection = bClose ? "close" : "keep-alive";
+
+    // every response is late, errors and 404s included
+    if (m_faults.nLatencyMs > 0 || m_faults.nJitterMs > 0)
+    {
+        unsigned nDelayMs = m_faults.nLatencyMs;
+
+        if (m_faults.nJitterMs > 0)
+        {
+            nDelayMs += std::uniform_int_distribution<unsigned>(0, m_faults.nJitterMs)(connection.random);
+        }
+
+        if (!Pause(std::chrono::milliseconds(nDelayMs)))
+        {
+            return false;
+        }
+    }
+
+    if (connection.Chance(m_faults.fErrorRate))
+    {
+        m_nErrors.fetch_add(1, std::memory_order_relaxed);
+
+        char szHeader[256];
+        int nLength = snprintf(szHeader, sizeof(szHeader),
+            "HTTP/1.1 %d Injected Error\r\nContent-Length: 0\r\nConnection: %s\r\n\r\n",
+            m_faults.nErrorStatus, pszConnection);
+
+        return SendAll(nSocket, szHeader, (size_t)nLength) && !bClose;
+    }
+
+    const LocalHttpFile* pFile = nullptr;
+    auto it = m_files.find(strPath);
+
+    if (it != m_files.end())
+    {
+        pFile = &it->second;
+    }
+    else if (m_resolver)
+    {
+        pFile = m_resolver(strPath, strQuery);
+    }
+
+    if (!pFile)
+    {
+        m_nNotFound.fetch_add(1, std::memory_order_relaxed);
+
+        char szHeader[256];
+        int nLength = snprintf(szHeader, sizeof(szHeader),
+            "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: %s\r\n\r\n", pszConnection);
+
+        return SendAll(nSocket, szHeader, (size_t)nLength) && !bClose;
+    }
+
+    const LocalHttpFile& file = *pFile;
+
+    // the validators and freshness, sent with a 304 as well as a 200
+    std::string strCacheHeaders;
+
+    if (!file.strETag.empty())
+    {
+        strCacheHeaders.append("ETag: ").append(file.strETag).append("\r\n");
+    }
+
+    if (!file.strLastModified.empty())
+    {
+        strCacheHeaders.append("Last-Modified: ").append(file.strLastModified).append("\r\n");
+    }
+
+    if (m_nMaxAgeSeconds >= 0)
+    {
+        strCacheHeaders.append("Cache-Control: max-age=").append(std::to_string(m_nMaxAgeSeconds)).append("\r\n");
+    }
+
+    bool bMatches = false;
+
+    if (IsConditional(strRequest, file, &bMatches))
+    {
+        m_nConditional.fetch_add(1, std::memory_order_relaxed);
+
+        // unless it is to look as though the map has changed, the client
+        // already has it
+        if (bMatches && !connection.Chance(m_faults.fChangeRate))
+        {
+            m_nNotModified.fetch_add(1, std::memory_order_relaxed);
+
+            std::string strNotModified = "HTTP/1.1 304 Not Modified\r\n" + strCacheHeaders +
+                "Connection: " + pszConnection + "\r\n\r\n";
+
+            return SendAll(nSocket, strNotModified.data(), strNotModified.size()) && !bClose;
+        }
+    }
+
+    char szHeader[1024];
+    int nLength = 0;
+
+    if (m_faults.bChunked)
+    {
+        nLength = snprintf(szHeader, sizeof(szHeader),
+            "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nTransfer-Encoding: chunked\r\n%sConnection: %s\r\n\r\n",
+            file.strContentType.c_str(), strCacheHeaders.c_str(), pszConnection);
+    }
+    else
+    {
+        nLength = snprintf(szHeader, sizeof(szHeader),
+            "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\n%sConnection: %s\r\n\r\n",
+            file.strContentType.c_str(), file.body.size(), strCacheHeaders.c_str(), pszConnection);
+    }
+
+    if (nLength < 0 || (size_t)nLength >= sizeof(szHeader) || !SendAll(nSocket, szHeader, (size_t)nLength))
+    {
+        return false;
+    }
+
+    // a truncated body stops half way, and the connection closes with the
+    // response unfinished, as when a server or proxy goes away mid-transfer
+    if (connection.Chance(m_faults.fTruncateRate))
+    {
+        m_nTruncated.fetch_add(1, std::memory_order_relaxed);
+
+        SendBody(connection, file, 0, file.body.size() / 2);
+        return false;
+    }
+
+    size_t nSent = 0;
+
+    // a stalled body stops half way and then carries on, as one does when
+    // a connection is congested.  The client decides whether to wait.
+    if (connection.Chance(m_faults.fStallRate))
+    {
+        m_nStalled.fetch_add(1, std::memory_order_relaxed);
+
+        nSent = file.body.size() / 2;
+
+        if (!SendBody(connection, file, 0, nSent) || !Pause(std::chrono::milliseconds(m_faults.nStallMs)))
+        {
+            return false;
+        }
+    }
+
+    if (!SendBody(connection, file, nSent, file.body.size()))
+    {
+        return false;
+    }
+
+    // the last chunk
+    if (m_faults.bChunked && !SendAll(nSocket, "0\r\n\r\n", 5))
+    {
+        return false;
+    }
+
+    return !bClose;
+}
+
+bool LocalHttpServer::SendBody(Connection& connection, const LocalHttpFile& file, size_t nFrom, size_t nTo)
+{
+    const uint8_t* pBody = file.body.data() + nFrom;
+    size_t nBytes = nTo - nFrom;
+
+    // with no limit, each chunk is sent at once
+    size_t nSliceBytes = (m_faults.nBytesPerSecond > 0) ? kThrottleSliceBytes : nBytes;
+    size_t nChunkBytes = m_faults.bChunked ? std::max<size_t>(m_faults.nChunkBytes, 1) : nBytes;
+
+    Clock::time_point start = Clock::now();
+    size_t nSent = 0;
+
+    while (nSent < nBytes)
+    {
+        size_t nChunk = std::min(nChunkBytes, nBytes - nSent);
+
+        if (m_faults.bChunked)
+        {
+            char szSize[32];
+            int nLength = snprintf(szSize, sizeof(szSize), "%zx\r\n", nChunk);
+
+            if (!SendAll(connection.nSocket, szSize, (size_t)nLength))
+            {
+                return false;
+            }
+        }
+
+        for (size_t nChunkSent = 0; nChunkSent < nChunk; )
+        {
+            size_t nSlice = std::min(nSliceBytes, nChunk - nChunkSent);
+
+            if (!SendAll(connection.nSocket, pBody + nSent, nSlice))
+            {
+                return false;
+            }
+
+            nSent += nSlice;
+            nChunkSent += nSlice;
+
+            m_nBodyBytes.fetch_add(nSlice, std::memory_order_relaxed);
+
+            // wait until the bytes so far are due
+            if (m_faults.nBytesPerSecond > 0)
+            {
+                Clock::time_point due = start + std::chrono::duration_cast<Clock::duration>(
+                    std::chrono::duration<double>((double)nSent / (double)m_faults.nBytesPerSecond));
+
+                if (!Pause(due - Clock::now()))
+                {
+                    return false;
+                }
+            }
+        }
+
+        if (m_faults.bChunked && !SendAll(connection.nSocket, "\r\n", 2))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool LocalHttpServer::Pause(Clock::duration duration) const
+{
+    Clock::time_point end = Clock::now() + duration;
+
+    for (;;)
+    {
+        if (m_bStopping)
+        {
+            return false;
+        }
+
+        Clock::time_point now = Clock::now();
+
+        if (now >= end)
+        {
+            return true;
+        }
+
+        std::this_thread::sleep_for(std::min<Clock::duration>(end - now, kStopPollInterval));
+    }
+}
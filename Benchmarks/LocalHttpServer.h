@@ -0,0 +1,166 @@
+// LocalHttpServer.h : A tiny HTTP/1.1 server on the loopback interface.
+//
+// Stands in for Bing Maps so the download half of GetBingMap can be run
+// and measured without a network or a Bing Maps key.  It serves files
+// held in memory, by path, with a Content-Length and keep-alive, which is
+// how Bing Maps sends maps and tiles.  Each connection gets a thread.
+//
+// For load tests it can also be made to behave worse than Bing Maps: to
+// wait before answering, to send bodies at a limited rate or in chunks,
+// to answer some requests with an error or cut them off part way, and to
+// stall part way through some bodies, as a congested connection does.
+//
+// A file can be given an ETag and a Last-Modified date, which are sent
+// with it, and then a conditional request for it, with If-None-Match or
+// If-Modified-Since, is answered with a 304 Not Modified and no body,
+// unless the faults say to pretend it has changed.
+//
+// POSIX sockets only; the Windows program talks to the real Bing Maps
+// through WinInet.
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// one response body
+struct LocalHttpFile
+{
+    std::vector<uint8_t>    body;
+    std::string             strContentType;
+    std::string             strETag;            // quotes and all, or empty for none
+    std::string             strLastModified;    // an HTTP date, or empty for none
+};
+
+// how much worse than Bing Maps to be.  The defaults are not at all.
+struct LocalHttpFaults
+{
+    unsigned    nLatencyMs = 0;         // wait this long before each response
+    unsigned    nJitterMs = 0;          // and up to this much longer, at random
+    uint64_t    nBytesPerSecond = 0;    // each connection's body rate, 0 for no limit
+    bool        bChunked = false;       // Transfer-Encoding: chunked, no Content-Length
+    size_t      nChunkBytes = 16 * 1024;
+    double      fErrorRate = 0;         // the fraction of requests answered with nErrorStatus
+    int         nErrorStatus = 503;
+    double      fTruncateRate = 0;      // the fraction of bodies cut off half way
+    double      fStallRate = 0;         // the fraction of bodies that stop half way for a while
+    unsigned    nStallMs = 5000;        // and how long for
+    double      fChangeRate = 0;        // the fraction of conditional requests answered in full
+    uint32_t    nSeed = 1;              // for the random choices, per connection
+};
+
+class LocalHttpServer
+{
+public:
+    // finds the file for a path that wasn't added with AddFile, or returns
+    // nullptr for a 404.  strQuery is what followed the '?', if anything.
+    // Called on connection threads, at the same time.
+    typedef std::function<const LocalHttpFile*(const std::string& strPath, const std::string& strQuery)> Resolver;
+
+    // what it has done so far
+    struct Stats
+    {
+        uint64_t    nRequests = 0;
+        uint64_t    nNotFound = 0;
+        uint64_t    nErrors = 0;        // answered with LocalHttpFaults::nErrorStatus
+        uint64_t    nTruncated = 0;
+        uint64_t    nStalled = 0;
+        uint64_t    nConditional = 0;   // with If-None-Match or If-Modified-Since
+        uint64_t    nNotModified = 0;   // answered with a 304
+        uint64_t    nBodyBytes = 0;
+    };
+
+    LocalHttpServer();
+    ~LocalHttpServer();
+
+    LocalHttpServer(const LocalHttpServer&) = delete;
+    LocalHttpServer& operator=(const LocalHttpServer&) = delete;
+
+    // serve body at path, which starts with a '/'.  Any query string on a
+    // request is ignored when finding its file.  Call before Start.
+    void AddFile(const std::string& strPath, std::vector<uint8_t> body,
+        const std::string& strContentType = "image/jpeg");
+
+    // look up paths that weren't added with AddFile.  Call before Start.
+    void SetResolver(Resolver resolver) { m_resolver = std::move(resolver); }
+
+    // misbehave as faults says.  Call before Start.
+    void SetFaults(const LocalHttpFaults& faults) { m_faults = faults; }
+
+    // send Cache-Control: max-age=nSeconds with every file, or no
+    // Cache-Control if nSeconds is negative, as by default.  Call before Start.
+    void SetMaxAge(int nSeconds) { m_nMaxAgeSeconds = nSeconds; }
+
+    // the HTTP date for tTime, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+    static std::string HttpDate(time_t tTime);
+
+    // listen on 127.0.0.1:nPort, or on a free port if nPort is 0.
+    // Returns false if the socket couldn't be opened.
+    bool Start(uint16_t nPort = 0);
+
+    // close the listening socket and every connection, and wait for
+    // their threads
+    void Stop();
+
+    // the port it is listening on, once started
+    uint16_t Port() const { return m_nPort; }
+
+    // how many requests have been answered
+    uint64_t RequestCount() const { return m_nRequests.load(std::memory_order_relaxed); }
+
+    Stats GetStats() const;
+
+private:
+    struct Connection;
+
+    void AcceptLoop();
+    void ServeConnection(int nSocket, uint32_t nSeed);
+
+    // answer one request, already read up to its blank line.  Returns
+    // false if the connection should be closed.
+    bool Respond(Connection& connection, const std::string& strRequest);
+
+    // true if strRequest is conditional, and *pbMatches is set if file
+    // hasn't changed since the version it names
+    static bool IsConditional(const std::string& strRequest, const LocalHttpFile& file, bool* pbMatches);
+
+    // send bytes nFrom up to nTo of the body of a response, throttled and
+    // chunked as m_faults says
+    bool SendBody(Connection& connection, const LocalHttpFile& file, size_t nFrom, size_t nTo);
+
+    // sleep, unless the server is stopping.  Returns false if it is.
+    bool Pause(std::chrono::steady_clock::duration duration) const;
+
+    std::map<std::string, LocalHttpFile>    m_files;
+    Resolver                        m_resolver;
+    LocalHttpFaults                 m_faults;
+    int                             m_nMaxAgeSeconds;
+
+    int                             m_nListenSocket;
+    uint16_t                        m_nPort;
+    std::atomic<bool>               m_bStopping;
+    std::atomic<uint64_t>           m_nRequests;
+    std::atomic<uint64_t>           m_nNotFound;
+    std::atomic<uint64_t>           m_nErrors;
+    std::atomic<uint64_t>           m_nTruncated;
+    std::atomic<uint64_t>           m_nStalled;
+    std::atomic<uint64_t>           m_nConditional;
+    std::atomic<uint64_t>           m_nNotModified;
+    std::atomic<uint64_t>           m_nBodyBytes;
+    uint32_t                        m_nConnections;
+
+    std::thread                     m_acceptThread;
+
+    std::mutex                      m_mutex;
+    std::vector<int>                m_connections;
+    std::vector<std::thread>        m_connectionThreads;
+    std::vector<std::thread::id>    m_finishedThreads;     // to be joined by AcceptLoop
+};
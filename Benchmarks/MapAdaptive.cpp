@@ -0,0 +1,364 @@
+// MapAdaptive.cpp : Measures how soon a map is on screen over a slow link.
+//
+// A static map used to be downloaded at the size its location asks for,
+// however slow the link, with nothing to show until it had arrived.  Now
+// MapBandwidthEstimator learns the link from each download, and when
+// PlanMapFetch predicts the map would take longer than the policy's
+// target, a map a half or a quarter of the size is downloaded first and
+// shown scaled up while the full map follows.  This selects the same maps
+// one after another, as a user going down the City menu does, both ways:
+//
+//      fixed       every map at full size, as before
+//      adaptive    as the program does now, a preview first when the link
+//                  is slow
+//
+// and reports how long each selection took until there was a map on
+// screen, and until the full map was.  It does it over two links: a slow
+// one, a MockMapServer sending at --bandwidth, where the previews should
+// put something on screen sooner, and a fast one, the same server with no
+// limit, where nothing should change.  The run fails if the previews don't
+// help on the slow link, or if any are taken on the fast one.
+//
+// The servers scale their maps to the mapSize asked for, so a preview is
+// smaller, as it would be from Bing Maps.  Run with --help for the options.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+
+#include "ImageDecoder.h"
+#include "JpegDecoder.h"
+#include "LocalHttpClient.h"
+#include "MapAdaptiveFetch.h"
+#include "MapMetrics.h"
+#include "MapRequestArena.h"
+#include "MapUrl.h"
+#include "MockMapServer.h"
+#include "StreamingBuffer.h"
+
+#ifndef MAPBENCH_FIXTURES_DIR
+#define MAPBENCH_FIXTURES_DIR "Fixtures"
+#endif
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    const wchar_t* const kPlaces[] = { L"Seattle", L"San Francisco", L"Portland", L"Vancouver",
+        L"Los Angeles", L"Denver", L"Chicago", L"New York" };
+
+    struct Options
+    {
+        std::string         strFixtures = MAPBENCH_FIXTURES_DIR;
+        unsigned            nMaps = 8;
+        int                 nWidth = 800;
+        int                 nHeight = 500;
+        MapAdaptivePolicy   policy;
+        LocalHttpFaults     faults;                 // the slow link's
+    };
+
+    // how one way of selecting maps went over one link
+    struct Run
+    {
+        const char*         pszName;
+        unsigned            nMaps = 0;
+        unsigned            nFailed = 0;
+        unsigned            nPreviews = 0;
+        uint64_t            nBytes = 0;             // response bodies, previews and all
+        MetricHistogram     firstUs;                // until there was a map on screen
+        MetricHistogram     fullUs;                 // until the full map was
+        double              fSeconds = 0;
+
+        explicit Run(const char* pszRunName) : pszName(pszRunName) {}
+    };
+
+    // the path part of one of BuildMapUrl's URLs, which are ASCII, with
+    // the spaces in place names escaped as WinInet escapes them.  Sent as
+    // they are they would end the request line, query and all.
+    std::pmr::string PathOfUrl(const std::pmr::wstring& strUrl, std::pmr::memory_resource* pResource)
+    {
+        size_t nScheme = strUrl.find(L"://");
+        size_t nPath = strUrl.find(L'/', (nScheme == std::wstring::npos) ? 0 : nScheme + 3);
+
+        std::pmr::string strPath(pResource);
+
+        if (nPath == std::wstring::npos)
+        {
+            strPath = "/";
+        }
+        else
+        {
+            for (size_t i = nPath; i < strUrl.size(); i++)
+            {
+                if (L' ' == strUrl[i])
+                {
+                    strPath += "%20";
+                }
+                else
+                {
+                    strPath += (char)strUrl[i];
+                }
+            }
+        }
+
+        return strPath;
+    }
+
+    // download and decode one map as DownloadBingMap does, telling the
+    // estimator about the download.  Returns the map, or an empty handle
+    // if it failed.
+    MapImageHandle FetchMap(const MapRequestKey& key, const std::wstring& strBaseUrl, uint16_t nPort,
+        LocalHttpClient& client, ImageDecoder& decoder, MapBandwidthEstimator& estimator, Run& run)
+    {
+        MapRequestArena arena;
+        std::pmr::wstring strUrl(arena.Resource());
+        StreamingBuffer body(arena.Resource());
+        LocalHttpTiming timing;
+        MapImageHandle hImage;
+
+        if (!BuildMapUrl(key, strBaseUrl, L"MapAdaptiveKey", strUrl))
+        {
+            return hImage;
+        }
+
+        int nStatus = client.Get(nPort, PathOfUrl(strUrl, arena.Resource()), body, &timing, arena.Resource());
+
+        run.nBytes += body.Size();
+
+        if (200 != nStatus)
+        {
+            return hImage;
+        }
+
+        estimator.Record(body.Size(), (uint64_t)(timing.transferMs * 1000.0),
+            (uint64_t)(timing.firstByteMs * 1000.0), (uint64_t)key.width * (uint64_t)key.height);
+
+        if (!DecodeToMapImage(decoder, body.Data(), body.Size(), hImage))
+        {
+            hImage.reset();
+        }
+
+        return hImage;
+    }
+
+    // select every map in turn, with previews if bAdaptive.  Each run
+    // starts with a link it knows nothing about, as the program does.
+    void RunSelections(const Options& options, const MockMapServer& server, bool bAdaptive, Run& run)
+    {
+        std::wstring strBaseUrl = L"http://127.0.0.1:" + std::to_wstring(server.Port());
+        LocalHttpClient client;
+        std::unique_ptr<ImageDecoder> pDecoder = CreateJpegDecoder();
+        MapBandwidthEstimator estimator;
+        MapAdaptivePolicy policy = options.policy;
+
+        policy.bEnabled = bAdaptive;
+
+        Clock::time_point runStart = Clock::now();
+
+        for (unsigned i = 0; i < options.nMaps; i++)
+        {
+            const wchar_t* pszPlace = kPlaces[i % (sizeof(kPlaces) / sizeof(kPlaces[0]))];
+            MapRequestKey key(L"AerialWithLabels", pszPlace, options.nWidth, options.nHeight);
+
+            Clock::time_point start = Clock::now();
+            MapFetchPlan plan = PlanMapFetch(key, estimator.Estimate(), policy);
+
+            run.nMaps++;
+
+            if (plan.bPreview)
+            {
+                MapImageHandle hPreview = FetchMap(plan.previewKey, strBaseUrl, server.Port(), client,
+                    *pDecoder, estimator, run);
+
+                // as the fetch queue does, the preview stands in for the
+                // map until it comes
+                if (ScaleMapPreview(hPreview, key.width, key.height))
+                {
+                    run.nPreviews++;
+                    run.firstUs.Record(MapMetrics::MicrosecondsBetween(start, Clock::now()));
+                }
+                else
+                {
+                    plan.bPreview = false;
+                }
+            }
+
+            MapImageHandle hImage = FetchMap(key, strBaseUrl, server.Port(), client, *pDecoder, estimator, run);
+
+            uint64_t nFullUs = MapMetrics::MicrosecondsBetween(start, Clock::now());
+
+            if (!hImage)
+            {
+                run.nFailed++;
+                continue;
+            }
+
+            run.fullUs.Record(nFullUs);
+
+            if (!plan.bPreview)
+            {
+                run.firstUs.Record(nFullUs);
+            }
+        }
+
+        run.fSeconds = std::chrono::duration<double>(Clock::now() - runStart).count();
+
+        printf("%-9s %s", run.pszName, FormatBandwidthEstimate(estimator.Estimate()).c_str());
+    }
+
+    void PrintRun(const char* pszLink, const Run& run)
+    {
+        MetricHistogram::Snapshot first = run.firstUs.TakeSnapshot();
+        MetricHistogram::Snapshot full = run.fullUs.TakeSnapshot();
+
+        printf("%-5s %-9s %5u %6u %8u %8.1f %10.1f %10.1f %10.1f %9.1f %9.1f %9.1f %7.2f\n", pszLink,
+            run.pszName, run.nMaps, run.nFailed, run.nPreviews, run.nBytes / 1024.0,
+            first.Mean() / 1000.0, first.ValueAtPercentile(50) / 1000.0, first.ValueAtPercentile(99) / 1000.0,
+            full.Mean() / 1000.0, full.ValueAtPercentile(50) / 1000.0, full.ValueAtPercentile(99) / 1000.0,
+            run.fSeconds);
+    }
+
+    bool StartServer(const Options& options, const LocalHttpFaults& faults, MockMapServer& server)
+    {
+        if (!server.LoadFixtures(options.strFixtures))
+        {
+            fprintf(stderr, "MapAdaptive: no static maps or tiles in %s\n", options.strFixtures.c_str());
+            return false;
+        }
+
+        server.SetFaults(faults);
+        server.SetScaleToMapSize(true);
+
+        if (!server.Start())
+        {
+            fprintf(stderr, "MapAdaptive: could not start the mock map server\n");
+            return false;
+        }
+
+        return true;
+    }
+
+    void PrintUsage()
+    {
+        printf(
+            "usage: MapAdaptive [options]\n"
+            "  --maps N                how many maps to select, one after another (default 8)\n"
+            "  --size W,H              the size of each map (default 800,500)\n"
+            "  --target MS             have a map on screen within MS milliseconds (default 300)\n"
+            "  --fixtures DIR          the recorded JPEGs (default %s)\n"
+            "the slow link takes these too, and is --bandwidth 96 --latency 40 unless told otherwise:\n"
+            "%s",
+            MAPBENCH_FIXTURES_DIR, kFaultOptionsUsage);
+    }
+
+    bool ParseOptions(int argc, char** argv, Options& options)
+    {
+        options.faults.nBytesPerSecond = 96 * 1024;
+        options.faults.nLatencyMs = 40;
+
+        for (int i = 1; i < argc; i++)
+        {
+            std::string strArg = argv[i];
+            bool bHasValue = i + 1 < argc;
+
+            if ("--maps" == strArg && bHasValue)
+            {
+                options.nMaps = std::max(1u, (unsigned)strtoul(argv[++i], nullptr, 10));
+            }
+            else if ("--size" == strArg && bHasValue &&
+                2 == sscanf(argv[++i], "%d,%d", &options.nWidth, &options.nHeight) &&
+                options.nWidth >= 80 && options.nHeight >= 80)
+            {
+            }
+            else if ("--target" == strArg && bHasValue)
+            {
+                options.policy.nTargetFirstMapMs = (unsigned)strtoul(argv[++i], nullptr, 10);
+            }
+            else if ("--fixtures" == strArg && bHasValue)
+            {
+                options.strFixtures = argv[++i];
+            }
+            else if (!ParseFaultOption(argc, argv, i, options.faults))
+            {
+                PrintUsage();
+                return false;
+            }
+        }
+
+        return true;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+
+    if (!ParseOptions(argc, argv, options))
+    {
+        return 2;
+    }
+
+    MockMapServer slowServer;
+    MockMapServer fastServer;
+
+    if (!StartServer(options, options.faults, slowServer) || !StartServer(options, LocalHttpFaults(), fastServer))
+    {
+        return 2;
+    }
+
+    printf("MapAdaptive: %u maps of %dx%d, slow link %.0f KB/s with %u ms latency, target %u ms\n\n",
+        options.nMaps, options.nWidth, options.nHeight, options.faults.nBytesPerSecond / 1024.0,
+        options.faults.nLatencyMs, options.policy.nTargetFirstMapMs);
+
+    // each server scales a map to a new size the first time it is asked
+    // for it, so the fixed runs go first and the adaptive runs' previews
+    // are the ones that pay for it
+    Run slowFixed("fixed");
+    Run slowAdaptive("adaptive");
+    Run fastFixed("fixed");
+    Run fastAdaptive("adaptive");
+
+    printf("slow link\n");
+    RunSelections(options, slowServer, false, slowFixed);
+    RunSelections(options, slowServer, true, slowAdaptive);
+
+    printf("fast link\n");
+    RunSelections(options, fastServer, false, fastFixed);
+    RunSelections(options, fastServer, true, fastAdaptive);
+
+    slowServer.Stop();
+    fastServer.Stop();
+
+    printf("\n%-5s %-9s %5s %6s %8s %8s %10s %10s %10s %9s %9s %9s %7s\n", "link", "run", "maps", "failed",
+        "previews", "KB", "first ms", "first p50", "first p99", "full ms", "full p50", "full p99", "s");
+    PrintRun("slow", slowFixed);
+    PrintRun("slow", slowAdaptive);
+    PrintRun("fast", fastFixed);
+    PrintRun("fast", fastAdaptive);
+
+    double fFixedFirstMs = slowFixed.firstUs.TakeSnapshot().Mean() / 1000.0;
+    double fAdaptiveFirstMs = slowAdaptive.firstUs.TakeSnapshot().Mean() / 1000.0;
+
+    printf("\nslow link: a map on screen in %.1f ms instead of %.1f ms, %u of %u selections previewed\n",
+        fAdaptiveFirstMs, fFixedFirstMs, slowAdaptive.nPreviews, slowAdaptive.nMaps);
+
+    bool bFaults = options.faults.fErrorRate > 0 || options.faults.fTruncateRate > 0 ||
+        options.faults.fStallRate > 0;
+
+    if (fastAdaptive.nPreviews != 0)
+    {
+        fprintf(stderr, "MapAdaptive: %u previews were taken on the fast link\n", fastAdaptive.nPreviews);
+        return 1;
+    }
+
+    // the first selection has nothing to go on, so it takes two to tell
+    if (!bFaults && options.nMaps > 1 && (0 == slowAdaptive.nPreviews || fAdaptiveFirstMs >= fFixedFirstMs))
+    {
+        fprintf(stderr, "MapAdaptive: the previews didn't put a map on screen any sooner on the slow link\n");
+        return 1;
+    }
+
+    return 0;
+}
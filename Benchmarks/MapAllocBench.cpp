@@ -0,0 +1,371 @@
+// MapAllocBench.cpp : Counts the heap allocations of the fetch path.
+//
+// Runs the same downloads twice on several threads against an in-process
+// MockMapServer: once with every transient allocation of a request (the
+// URL, the request and response headers and the download buffer) taken
+// from the heap, and once with them carved from a MapRequestArena, as
+// GetBingMap does.  For each it reports requests per second and how many
+// heap allocations, and how many bytes, each request made.  --decode also
+// decodes each download with JpegDecoder, whose own allocations are the
+// same either way.
+//
+// The allocations are counted by replacing malloc and its relatives with
+// ones that count, per thread, and pass through to glibc.  Under the
+// address or thread sanitizers, which replace malloc themselves, and on
+// other C libraries only the throughput is reported.  Run with --help for
+// the options.
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <memory_resource>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ImageDecoder.h"
+#include "JpegDecoder.h"
+#include "LocalHttpClient.h"
+#include "MapRequest.h"
+#include "MapRequestArena.h"
+#include "MapUrl.h"
+#include "MockMapServer.h"
+#include "StreamingBuffer.h"
+#include "TileSystem.h"
+
+#ifndef MAPBENCH_FIXTURES_DIR
+#define MAPBENCH_FIXTURES_DIR "Fixtures"
+#endif
+
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+#define MAPALLOCBENCH_COUNTS_ALLOCATIONS 1
+#endif
+
+// what this thread has asked of the heap.  Plain thread_locals in the
+// executable need no allocation of their own.
+static thread_local uint64_t t_nAllocations = 0;
+static thread_local uint64_t t_nAllocatedBytes = 0;
+
+#ifdef MAPALLOCBENCH_COUNTS_ALLOCATIONS
+
+extern "C"
+{
+    void* __libc_malloc(size_t nBytes);
+    void* __libc_calloc(size_t nCount, size_t nBytes);
+    void* __libc_realloc(void* p, size_t nBytes);
+    void* __libc_memalign(size_t nAlignment, size_t nBytes);
+    void __libc_free(void* p);
+
+    void* malloc(size_t nBytes)
+    {
+        t_nAllocations++;
+        t_nAllocatedBytes += nBytes;
+        return __libc_malloc(nBytes);
+    }
+
+    void* calloc(size_t nCount, size_t nBytes)
+    {
+        t_nAllocations++;
+        t_nAllocatedBytes += nCount * nBytes;
+        return __libc_calloc(nCount, nBytes);
+    }
+
+    void* realloc(void* p, size_t nBytes)
+    {
+        t_nAllocations++;
+        t_nAllocatedBytes += nBytes;
+        return __libc_realloc(p, nBytes);
+    }
+
+    void* memalign(size_t nAlignment, size_t nBytes)
+    {
+        t_nAllocations++;
+        t_nAllocatedBytes += nBytes;
+        return __libc_memalign(nAlignment, nBytes);
+    }
+
+    void* aligned_alloc(size_t nAlignment, size_t nBytes)
+    {
+        return memalign(nAlignment, nBytes);
+    }
+
+    int posix_memalign(void** pp, size_t nAlignment, size_t nBytes)
+    {
+        void* p = memalign(nAlignment, nBytes);
+
+        if (!p)
+        {
+            return ENOMEM;
+        }
+
+        *pp = p;
+        return 0;
+    }
+
+    void free(void* p)
+    {
+        __libc_free(p);
+    }
+}
+
+#endif
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    const int kTileLevel = 14;
+
+    struct Options
+    {
+        std::string strFixtures = MAPBENCH_FIXTURES_DIR;
+        unsigned    nRequests = 20000;
+        unsigned    nThreads = 8;
+        bool        bDecode = false;
+    };
+
+    struct Result
+    {
+        double      fSeconds = 0;
+        uint64_t    nAllocations = 0;
+        uint64_t    nAllocatedBytes = 0;
+        uint64_t    nFailed = 0;
+    };
+
+    // the part of GetBingMap from the URL to the end of the download, with
+    // its transient memory from pResource
+    bool Fetch(LocalHttpClient& client, uint16_t nPort, const std::wstring& strBaseUrl,
+        const MapRequestKey& key, std::pmr::memory_resource* pResource, ImageDecoder* pDecoder)
+    {
+        std::pmr::wstring strUrl(pResource);
+
+        if (!BuildMapUrl(key, strBaseUrl, L"AllocBenchKey", strUrl))
+        {
+            return false;
+        }
+
+        // BuildMapUrl's URLs are ASCII
+        size_t nScheme = strUrl.find(L"://");
+        size_t nPath = strUrl.find(L'/', (nScheme == std::wstring::npos) ? 0 : nScheme + 3);
+        std::pmr::string strPath(strUrl.begin() + nPath, strUrl.end(), pResource);
+
+        StreamingBuffer body(pResource);
+
+        if (200 != client.Get(nPort, strPath, body, nullptr, pResource))
+        {
+            return false;
+        }
+
+        if (pDecoder)
+        {
+            MapImageHandle hImage;
+            return DecodeToMapImage(*pDecoder, body.Data(), body.Size(), hImage);
+        }
+
+        return true;
+    }
+
+    Result Run(const Options& options, uint16_t nPort, const std::vector<MapRequestKey>& keys, bool bArena)
+    {
+        std::wstring strBaseUrl = L"http://127.0.0.1:" + std::to_wstring(nPort);
+
+        std::atomic<uint64_t> nAllocations{ 0 };
+        std::atomic<uint64_t> nAllocatedBytes{ 0 };
+        std::atomic<uint64_t> nFailed{ 0 };
+
+        auto worker = [&](unsigned nThread)
+        {
+            LocalHttpClient client;
+            std::unique_ptr<ImageDecoder> pDecoder;
+
+            if (options.bDecode)
+            {
+                pDecoder = CreateJpegDecoder();
+            }
+
+            // connect, and let the decoder set itself up, before counting
+            Fetch(client, nPort, strBaseUrl, keys[nThread % keys.size()], std::pmr::new_delete_resource(),
+                pDecoder.get());
+
+            uint64_t nStartAllocations = t_nAllocations;
+            uint64_t nStartBytes = t_nAllocatedBytes;
+            uint64_t nThreadFailed = 0;
+
+            for (unsigned i = nThread; i < options.nRequests; i += options.nThreads)
+            {
+                const MapRequestKey& key = keys[i % keys.size()];
+                bool bSucceeded;
+
+                if (bArena)
+                {
+                    MapRequestArena arena;
+                    bSucceeded = Fetch(client, nPort, strBaseUrl, key, arena.Resource(), pDecoder.get());
+                }
+                else
+                {
+                    bSucceeded = Fetch(client, nPort, strBaseUrl, key, std::pmr::new_delete_resource(),
+                        pDecoder.get());
+                }
+
+                if (!bSucceeded)
+                {
+                    nThreadFailed++;
+                }
+            }
+
+            nAllocations.fetch_add(t_nAllocations - nStartAllocations);
+            nAllocatedBytes.fetch_add(t_nAllocatedBytes - nStartBytes);
+            nFailed.fetch_add(nThreadFailed);
+        };
+
+        Clock::time_point start = Clock::now();
+
+        std::vector<std::thread> threads;
+
+        for (unsigned nThread = 0; nThread < options.nThreads; nThread++)
+        {
+            threads.emplace_back(worker, nThread);
+        }
+
+        for (std::thread& thread : threads)
+        {
+            thread.join();
+        }
+
+        Result result;
+        result.fSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+        result.nAllocations = nAllocations.load();
+        result.nAllocatedBytes = nAllocatedBytes.load();
+        result.nFailed = nFailed.load();
+
+        return result;
+    }
+
+    void PrintResult(const char* pszName, const Options& options, const Result& result)
+    {
+        printf("%-8s %10.0f", pszName, options.nRequests / result.fSeconds);
+
+#ifdef MAPALLOCBENCH_COUNTS_ALLOCATIONS
+        printf(" %12.2f %14.0f", (double)result.nAllocations / options.nRequests,
+            (double)result.nAllocatedBytes / options.nRequests);
+#endif
+
+        printf("\n");
+    }
+
+    void PrintUsage()
+    {
+        printf(
+            "usage: MapAllocBench [options]\n"
+            "  --requests N    how many downloads to make with each allocator (default 20000)\n"
+            "  --threads N     how many threads make them (default 8)\n"
+            "  --decode        decode each download too\n"
+            "  --fixtures DIR  the recorded JPEGs (default %s)\n",
+            MAPBENCH_FIXTURES_DIR);
+    }
+
+    bool ParseOptions(int argc, char** argv, Options& options)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            std::string strArg = argv[i];
+            bool bHasValue = i + 1 < argc;
+
+            if ("--requests" == strArg && bHasValue)
+            {
+                options.nRequests = std::max(1u, (unsigned)strtoul(argv[++i], nullptr, 10));
+            }
+            else if ("--threads" == strArg && bHasValue)
+            {
+                options.nThreads = std::max(1u, (unsigned)strtoul(argv[++i], nullptr, 10));
+            }
+            else if ("--decode" == strArg)
+            {
+                options.bDecode = true;
+            }
+            else if ("--fixtures" == strArg && bHasValue)
+            {
+                options.strFixtures = argv[++i];
+            }
+            else
+            {
+                PrintUsage();
+                return false;
+            }
+        }
+
+        return true;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+
+    if (!ParseOptions(argc, argv, options))
+    {
+        return 2;
+    }
+
+    MockMapServer server;
+
+    if (!server.LoadFixtures(options.strFixtures))
+    {
+        fprintf(stderr, "MapAllocBench: no static maps or tiles in %s\n", options.strFixtures.c_str());
+        return 2;
+    }
+
+    if (!server.Start())
+    {
+        fprintf(stderr, "MapAllocBench: could not start the mock map server\n");
+        return 2;
+    }
+
+    // a static map for every ten tiles, as MapLoadTest asks for
+    std::mt19937 random(1);
+    std::uniform_int_distribution<int> tileXY(0, (1 << kTileLevel) - 1);
+    std::vector<MapRequestKey> keys;
+
+    for (unsigned i = 0; i < 256; i++)
+    {
+        if (0 == i % 10)
+        {
+            keys.emplace_back(L"AerialWithLabels", L"Seattle", 800, 500);
+        }
+        else
+        {
+            keys.push_back(MapRequestKey::ForTile(L"Aerial",
+                TileSystem::TileXYToQuadKey(tileXY(random), tileXY(random), kTileLevel)));
+        }
+    }
+
+    printf("MapAllocBench: %u requests on %u threads%s\n\n", options.nRequests, options.nThreads,
+        options.bDecode ? ", decoded" : "");
+
+#ifdef MAPALLOCBENCH_COUNTS_ALLOCATIONS
+    printf("%-8s %10s %12s %14s\n", "", "requests/s", "allocs/req", "bytes/req");
+#else
+    printf("%-8s %10s   (allocations aren't counted in this build)\n", "", "requests/s");
+#endif
+
+    Result heap = Run(options, server.Port(), keys, false);
+    PrintResult("heap", options, heap);
+
+    Result arena = Run(options, server.Port(), keys, true);
+    PrintResult("arena", options, arena);
+
+    server.Stop();
+
+    if (heap.nFailed + arena.nFailed > 0)
+    {
+        fprintf(stderr, "MapAllocBench: %llu downloads failed\n", (unsigned long long)(heap.nFailed + arena.nFailed));
+        return 1;
+    }
+
+    return 0;
+}
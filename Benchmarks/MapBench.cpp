@@ -0,0 +1,1066 @@
+// MapBench.cpp : Headless benchmarks of the map pipeline.
+//
+// Runs the parts of getting a map on screen that don't need Windows, on
+// the recorded JPEGs in Fixtures, and reports each stage's throughput and
+// its latency percentiles per iteration:
+//
+//      http_fetch_*        GET over loopback from a LocalHttpServer into a
+//                          StreamingBuffer, as GetBingMap's read loop does
+//      buffer_assembly*    the read loop's PrepareWrite/CommitWrite alone,
+//                          with and without a Content-Length to reserve from
+//      buffer_iovec        the read loop GetBingMap had before DownloadBuffer:
+//                          512-byte reads, each copied into its own heap
+//                          block, then all copied into one buffer
+//      buffer_download*    the same 512-byte reads into a DownloadBuffer,
+//                          with and without a Content-Length
+//      decode_*            JPEG to 32bpp BGRX with JpegDecoder
+//      throttled_*         the static map over a link limited to --link-rate,
+//                          downloaded and then decoded, and decoded by
+//                          DecodeJpegStream while it downloads
+//      convert_ycbcr*      YCbCr to BGRX conversion, SIMD and scalar
+//      scale_*             ImageScaler, fitting the static map to a window
+//      blit_map            ComposeMap's background fill and copy
+//      compose_*           TileLayer composing a full view, from tiles and
+//                          from scaled stand-ins
+//      pan_scroll          PanView's scroll and strip compose
+//      visible_tiles       working out the tiles and quadkeys of a view
+//      single_flight       MapSingleFlight under contention
+//      histogram_record    MapMetrics recording from many threads
+//      cache_*             MapTieredCache: a decoded hit, a decode from the
+//                          compressed tier, and a working set of tiles
+//                          ten times the size of the decoded tier
+//      pipeline_map        fetch, decode, fit and blit a static map
+//
+// A baseline file records throughput and latency from an earlier run, and
+// each stage is compared against it.  Run with --help for the options.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ColorConvert.h"
+#include "DownloadBuffer.h"
+#include "ImageScaler.h"
+#include "JpegDecoder.h"
+#include "LocalHttpClient.h"
+#include "LocalHttpServer.h"
+#include "MapBitmapStore.h"
+#include "MapMetrics.h"
+#include "MapSingleFlight.h"
+#include "MapTieredCache.h"
+#include "PixelBlit.h"
+#include "StreamingBuffer.h"
+#include "TileLayer.h"
+#include "TileSystem.h"
+#include "ViewScroll.h"
+
+#ifndef MAPBENCH_FIXTURES_DIR
+#define MAPBENCH_FIXTURES_DIR "Fixtures"
+#endif
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    // the window the maps are drawn into
+    const int kViewWidth = 1280;
+    const int kViewHeight = 800;
+
+    // the tiled view is of Seattle, at a level where the map fills it
+    const double kSeattleLatitude = 47.6062;
+    const double kSeattleLongitude = -122.3321;
+    const int kTileLevel = 12;
+
+    // the size of each read in the buffer assembly stages, about what a
+    // slow connection delivers at a time
+    const size_t kAssemblyReadSize = 8 * 1024;
+
+    // the size of each read in the buffer_iovec and buffer_download stages,
+    // the g_nPacketSize GetBingMap used to read with
+    const size_t kPacketSize = 512;
+
+    // threads in the contention stages
+    const int kContentionThreads = 8;
+
+    // the stages that move something measure it in these
+    const double kMega = 1e6;
+
+    struct Fixture
+    {
+        std::string             strName;
+        std::vector<uint8_t>    bytes;
+    };
+
+    struct BenchResult
+    {
+        std::string     strName;
+        std::string     strUnit;
+        double          fThroughput;    // strUnit per second
+        uint64_t        nIterations;
+        double          fP50Us;
+        double          fP90Us;
+        double          fP99Us;
+    };
+
+    struct Options
+    {
+        std::string     strFixtures = MAPBENCH_FIXTURES_DIR;
+        std::string     strFilter;
+        std::string     strBaseline;
+        std::string     strWriteBaseline;
+        double          fMinSeconds = 0.5;
+        uint64_t        nMinIterations = 10;
+        double          fTolerance = 25.0;
+        bool            bCheck = false;
+        double          fLinkRate = 20.0;       // MB/s of the throttled_* stages' link
+    };
+
+    // runs each stage until it has done enough iterations for long enough,
+    // timing every iteration
+    class BenchRunner
+    {
+    public:
+        explicit BenchRunner(const Options& options)
+            : m_options(options)
+        {
+        }
+
+        bool Wants(const char* pszName) const
+        {
+            return m_options.strFilter.empty() || strstr(pszName, m_options.strFilter.c_str()) != nullptr;
+        }
+
+        // fWork is how much of strUnit one call of fn does: megapixels,
+        // megabytes or operations
+        void Run(const char* pszName, const char* pszUnit, double fWork, const std::function<void()>& fn)
+        {
+            if (!Wants(pszName))
+            {
+                return;
+            }
+
+            // the first call warms the caches and allocates what it keeps
+            fn();
+
+            MetricHistogram latency;
+            uint64_t nIterations = 0;
+
+            Clock::time_point start = Clock::now();
+            Clock::time_point now = start;
+
+            const uint64_t kMaxIterations = 1000000;
+
+            while ((nIterations < m_options.nMinIterations ||
+                std::chrono::duration<double>(now - start).count() < m_options.fMinSeconds) &&
+                nIterations < kMaxIterations)
+            {
+                Clock::time_point before = now;
+
+                fn();
+
+                now = Clock::now();
+                latency.Record((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(now - before).count());
+                nIterations++;
+            }
+
+            double fSeconds = std::chrono::duration<double>(now - start).count();
+            MetricHistogram::Snapshot snapshot = latency.TakeSnapshot();
+
+            BenchResult result;
+            result.strName = pszName;
+            result.strUnit = pszUnit;
+            result.fThroughput = (fSeconds > 0) ? fWork * (double)nIterations / fSeconds : 0;
+            result.nIterations = nIterations;
+            result.fP50Us = snapshot.ValueAtPercentile(50.0) / 1000.0;
+            result.fP90Us = snapshot.ValueAtPercentile(90.0) / 1000.0;
+            result.fP99Us = snapshot.ValueAtPercentile(99.0) / 1000.0;
+
+            printf("%-24s %12.1f %-6s %10.1f %10.1f %10.1f %9llu\n", result.strName.c_str(),
+                result.fThroughput, result.strUnit.c_str(), result.fP50Us, result.fP90Us, result.fP99Us,
+                (unsigned long long)result.nIterations);
+            fflush(stdout);
+
+            m_results.push_back(result);
+        }
+
+        const std::vector<BenchResult>& Results() const { return m_results; }
+
+    private:
+        const Options&              m_options;
+        std::vector<BenchResult>    m_results;
+    };
+
+    bool ReadFile(const std::filesystem::path& path, std::vector<uint8_t>& bytesOut)
+    {
+        std::ifstream in(path, std::ios::binary);
+
+        if (!in)
+        {
+            return false;
+        }
+
+        bytesOut.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+
+        return !bytesOut.empty();
+    }
+
+    // every .jpg in the fixtures folder, sorted by name
+    std::vector<Fixture> LoadFixtures(const std::string& strDirectory)
+    {
+        std::vector<Fixture> fixtures;
+        std::error_code error;
+
+        for (const auto& entry : std::filesystem::directory_iterator(strDirectory, error))
+        {
+            if (entry.path().extension() != ".jpg")
+            {
+                continue;
+            }
+
+            Fixture fixture;
+            fixture.strName = entry.path().filename().string();
+
+            if (ReadFile(entry.path(), fixture.bytes))
+            {
+                fixtures.push_back(std::move(fixture));
+            }
+        }
+
+        std::sort(fixtures.begin(), fixtures.end(),
+            [](const Fixture& a, const Fixture& b) { return a.strName < b.strName; });
+
+        return fixtures;
+    }
+
+    const Fixture* FindFixture(const std::vector<Fixture>& fixtures, const char* pszName)
+    {
+        for (const Fixture& fixture : fixtures)
+        {
+            if (fixture.strName == pszName)
+            {
+                return &fixture;
+            }
+        }
+
+        return nullptr;
+    }
+
+    MapImageHandle Decode(ImageDecoder& decoder, const Fixture& fixture)
+    {
+        MapImageHandle hImage;
+
+        if (!DecodeToMapImage(decoder, fixture.bytes.data(), fixture.bytes.size(), hImage))
+        {
+            fprintf(stderr, "MapBench: could not decode %s\n", fixture.strName.c_str());
+            exit(1);
+        }
+
+        return hImage;
+    }
+
+    double Megapixels(int nWidth, int nHeight)
+    {
+        return (double)nWidth * (double)nHeight / kMega;
+    }
+
+    // read bytes into body in nReadSize pieces, as the read loop does
+    void AssembleBuffer(const std::vector<uint8_t>& bytes, size_t nReadSize, bool bReserve)
+    {
+        StreamingBuffer body;
+
+        if (bReserve)
+        {
+            body.Reserve(bytes.size() + 1);
+            body.SetExpectedSize(bytes.size());
+        }
+
+        size_t nOffset = 0;
+
+        while (nOffset < bytes.size())
+        {
+            size_t nAvailable = 0;
+            uint8_t* pWrite = body.PrepareWrite(1, &nAvailable);
+
+            size_t nRead = std::min(std::min(nAvailable, nReadSize), bytes.size() - nOffset);
+            memcpy(pWrite, bytes.data() + nOffset, nRead);
+
+            body.CommitWrite(nRead);
+            nOffset += nRead;
+        }
+
+        body.Finish();
+    }
+
+    // one chunk of a download, as GetBingMap used to keep them
+    struct IoVec
+    {
+        uint8_t*    pBytes;
+        size_t      nBytes;
+    };
+
+    // the read loop GetBingMap had before DownloadBuffer: each read into a
+    // stack buffer, copied into a new heap block, then every block copied
+    // into one contiguous buffer for the decoder.  Returns that buffer's
+    // first byte, so the copies can't be optimized away.
+    uint8_t AssembleIoVecs(const std::vector<uint8_t>& bytes)
+    {
+        uint8_t packet[kPacketSize];
+        std::vector<IoVec> chunks;
+        size_t nOffset = 0;
+
+        while (nOffset < bytes.size())
+        {
+            size_t nRead = std::min(kPacketSize, bytes.size() - nOffset);
+            memcpy(packet, bytes.data() + nOffset, nRead);
+
+            IoVec chunk = { new uint8_t[nRead], nRead };
+            memcpy(chunk.pBytes, packet, nRead);
+            chunks.push_back(chunk);
+
+            nOffset += nRead;
+        }
+
+        uint8_t* pBuffer = new uint8_t[nOffset];
+        size_t nCopied = 0;
+
+        for (const IoVec& chunk : chunks)
+        {
+            memcpy(pBuffer + nCopied, chunk.pBytes, chunk.nBytes);
+            nCopied += chunk.nBytes;
+            delete[] chunk.pBytes;
+        }
+
+        uint8_t nFirst = pBuffer[0];
+        delete[] pBuffer;
+
+        return nFirst;
+    }
+
+    // the same reads straight into a DownloadBuffer, as GetBingMap's
+    // read loop does now when it isn't streaming
+    uint8_t AssembleDownloadBuffer(const std::vector<uint8_t>& bytes, bool bReserve)
+    {
+        DownloadBuffer buffer;
+
+        if (bReserve)
+        {
+            buffer.Reserve(bytes.size() + 1);
+        }
+
+        size_t nOffset = 0;
+
+        while (nOffset < bytes.size())
+        {
+            size_t nAvailable = 0;
+            uint8_t* pWrite = buffer.PrepareWrite(kPacketSize, &nAvailable);
+
+            size_t nRead = std::min(std::min(nAvailable, kPacketSize), bytes.size() - nOffset);
+            memcpy(pWrite, bytes.data() + nOffset, nRead);
+
+            buffer.CommitWrite(nRead);
+            nOffset += nRead;
+        }
+
+        return buffer.Data()[0];
+    }
+
+    // the view ComposeTiledMap draws, with the store holding every tile it
+    // shows, cycling through the tile fixtures
+    void FillTileStore(TileLayer& layer, MapBitmapStore& store, const std::vector<MapImageHandle>& tiles,
+        const PixelBuffer& target)
+    {
+        std::vector<MapRequestKey> missing;
+        PixelRect view = { 0, 0, target.width, target.height };
+
+        layer.Compose(store, target, view, missing);
+
+        for (size_t i = 0; i < missing.size(); i++)
+        {
+            store.Insert(missing[i], tiles[i % tiles.size()]);
+        }
+    }
+
+    // run fn on kContentionThreads threads at once, and wait for them all
+    void RunOnThreads(const std::function<void(int)>& fn)
+    {
+        std::vector<std::thread> threads;
+
+        for (int i = 0; i < kContentionThreads; i++)
+        {
+            threads.emplace_back(fn, i);
+        }
+
+        for (std::thread& thread : threads)
+        {
+            thread.join();
+        }
+    }
+
+    // baseline files: one stage a line, "name unit throughput p50 p90 p99",
+    // with # starting a comment
+    std::map<std::string, BenchResult> ReadBaseline(const std::string& strPath)
+    {
+        std::map<std::string, BenchResult> baseline;
+        std::ifstream in(strPath);
+        std::string strLine;
+
+        while (std::getline(in, strLine))
+        {
+            if (strLine.empty() || '#' == strLine[0])
+            {
+                continue;
+            }
+
+            std::istringstream fields(strLine);
+            BenchResult result = {};
+
+            if (fields >> result.strName >> result.strUnit >> result.fThroughput >>
+                result.fP50Us >> result.fP90Us >> result.fP99Us)
+            {
+                baseline[result.strName] = result;
+            }
+        }
+
+        return baseline;
+    }
+
+    bool WriteBaseline(const std::string& strPath, const std::vector<BenchResult>& results)
+    {
+        FILE* pFile = fopen(strPath.c_str(), "w");
+
+        if (!pFile)
+        {
+            return false;
+        }
+
+        fprintf(pFile, "# MapBench baseline.  Regenerate with MapBench --write-baseline <this file>\n");
+        fprintf(pFile, "# on the machine the comparisons will run on.\n");
+        fprintf(pFile, "# stage unit throughput p50_us p90_us p99_us\n");
+
+        for (const BenchResult& result : results)
+        {
+            fprintf(pFile, "%s %s %.2f %.2f %.2f %.2f\n", result.strName.c_str(), result.strUnit.c_str(),
+                result.fThroughput, result.fP50Us, result.fP90Us, result.fP99Us);
+        }
+
+        return 0 == fclose(pFile);
+    }
+
+    // print how each stage compares with the baseline.  Returns the number
+    // of stages that are slower than the baseline by more than the tolerance.
+    int CompareWithBaseline(const std::vector<BenchResult>& results,
+        const std::map<std::string, BenchResult>& baseline, double fTolerance)
+    {
+        int nRegressions = 0;
+
+        printf("\n%-24s %12s %12s %9s %11s\n", "stage", "throughput", "baseline", "change", "p99 change");
+
+        for (const BenchResult& result : results)
+        {
+            auto it = baseline.find(result.strName);
+
+            if (it == baseline.end() || it->second.fThroughput <= 0)
+            {
+                printf("%-24s %12.1f %12s\n", result.strName.c_str(), result.fThroughput, "-");
+                continue;
+            }
+
+            double fChange = (result.fThroughput / it->second.fThroughput - 1.0) * 100.0;
+            double fP99Change = (it->second.fP99Us > 0) ? (result.fP99Us / it->second.fP99Us - 1.0) * 100.0 : 0.0;
+
+            bool bRegressed = fChange < -fTolerance;
+
+            if (bRegressed)
+            {
+                nRegressions++;
+            }
+
+            printf("%-24s %12.1f %12.1f %+8.1f%% %+10.1f%%%s\n", result.strName.c_str(), result.fThroughput,
+                it->second.fThroughput, fChange, fP99Change, bRegressed ? "  SLOWER" : "");
+        }
+
+        return nRegressions;
+    }
+
+    void PrintUsage()
+    {
+        printf(
+            "usage: MapBench [options]\n"
+            "  --fixtures DIR          the recorded JPEGs (default %s)\n"
+            "  --filter TEXT           only run stages whose names contain TEXT\n"
+            "  --seconds S             run each stage for at least S seconds (default 0.5)\n"
+            "  --quick                 --seconds 0.05, for a smoke test\n"
+            "  --baseline FILE         compare with a baseline\n"
+            "  --write-baseline FILE   save this run as a baseline\n"
+            "  --tolerance PERCENT     how much slower than the baseline is a regression (default 25)\n"
+            "  --check                 exit with 1 if any stage regressed\n"
+            "  --link-rate MBPS        the throttled_* stages' link speed in MB/s (default 20)\n",
+            MAPBENCH_FIXTURES_DIR);
+    }
+
+    bool ParseOptions(int argc, char** argv, Options& options)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            std::string strArg = argv[i];
+            bool bHasValue = i + 1 < argc;
+
+            if ("--fixtures" == strArg && bHasValue)
+            {
+                options.strFixtures = argv[++i];
+            }
+            else if ("--filter" == strArg && bHasValue)
+            {
+                options.strFilter = argv[++i];
+            }
+            else if ("--seconds" == strArg && bHasValue)
+            {
+                options.fMinSeconds = atof(argv[++i]);
+            }
+            else if ("--quick" == strArg)
+            {
+                options.fMinSeconds = 0.05;
+                options.nMinIterations = 3;
+            }
+            else if ("--baseline" == strArg && bHasValue)
+            {
+                options.strBaseline = argv[++i];
+            }
+            else if ("--write-baseline" == strArg && bHasValue)
+            {
+                options.strWriteBaseline = argv[++i];
+            }
+            else if ("--tolerance" == strArg && bHasValue)
+            {
+                options.fTolerance = atof(argv[++i]);
+            }
+            else if ("--check" == strArg)
+            {
+                options.bCheck = true;
+            }
+            else if ("--link-rate" == strArg && bHasValue)
+            {
+                options.fLinkRate = atof(argv[++i]);
+            }
+            else
+            {
+                PrintUsage();
+                return false;
+            }
+        }
+
+        return true;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+
+    if (!ParseOptions(argc, argv, options))
+    {
+        return 2;
+    }
+
+    std::vector<Fixture> fixtures = LoadFixtures(options.strFixtures);
+
+    const Fixture* pStaticMap = FindFixture(fixtures, "seattle_800x500.jpg");
+    const Fixture* pTile = FindFixture(fixtures, "seattle_tile0.jpg");
+
+    if (!pStaticMap || !pTile)
+    {
+        fprintf(stderr, "MapBench: no fixtures in %s\n", options.strFixtures.c_str());
+        return 2;
+    }
+
+    std::unique_ptr<ImageDecoder> pDecoder = CreateJpegDecoder();
+
+    MapImageHandle hStaticMap = Decode(*pDecoder, *pStaticMap);
+    MapImageHandle hTile = Decode(*pDecoder, *pTile);
+
+    std::vector<MapImageHandle> tiles;
+
+    for (const Fixture& fixture : fixtures)
+    {
+        if (fixture.strName.find("_tile") != std::string::npos)
+        {
+            tiles.push_back(Decode(*pDecoder, fixture));
+        }
+    }
+
+    // the local stand-in for Bing Maps serves every fixture
+    LocalHttpServer server;
+
+    for (const Fixture& fixture : fixtures)
+    {
+        server.AddFile("/fixtures/" + fixture.strName, fixture.bytes);
+    }
+
+    if (!server.Start())
+    {
+        fprintf(stderr, "MapBench: could not start the local HTTP server\n");
+        return 2;
+    }
+
+    // the window's back buffer
+    std::shared_ptr<MapImage> pBackBuffer = MapImage::Create(kViewWidth, kViewHeight);
+    PixelBuffer backBuffer = PixelBufferOf(*pBackBuffer);
+    PixelRect view = { 0, 0, kViewWidth, kViewHeight };
+
+    printf("MapBench: %zu fixtures, color conversion %s, scaler %s\n\n", fixtures.size(),
+        ColorConvertHasSimd() ? "SIMD" : "scalar", ImageScalerHasSimd() ? "SIMD" : "scalar");
+    printf("%-24s %19s %10s %10s %10s %9s\n", "stage", "throughput", "p50 us", "p90 us", "p99 us", "iters");
+
+    BenchRunner bench(options);
+
+    // download
+    LocalHttpClient client;
+
+    for (const Fixture* pFixture : { pStaticMap, pTile })
+    {
+        std::string strName = (pFixture == pStaticMap) ? "http_fetch_map" : "http_fetch_tile";
+        std::string strPath = "/fixtures/" + pFixture->strName;
+
+        bench.Run(strName.c_str(), "MB/s", pFixture->bytes.size() / kMega, [&]()
+        {
+            StreamingBuffer body;
+
+            if (200 != client.Get(server.Port(), strPath, body) || body.Size() != pFixture->bytes.size())
+            {
+                fprintf(stderr, "MapBench: download of %s failed\n", strPath.c_str());
+                exit(1);
+            }
+        });
+    }
+
+    bench.Run("buffer_assembly", "MB/s", pStaticMap->bytes.size() / kMega, [&]()
+    {
+        AssembleBuffer(pStaticMap->bytes, kAssemblyReadSize, true);
+    });
+
+    bench.Run("buffer_assembly_grow", "MB/s", pStaticMap->bytes.size() / kMega, [&]()
+    {
+        AssembleBuffer(pStaticMap->bytes, kAssemblyReadSize, false);
+    });
+
+    // the old chunk list against DownloadBuffer, a byte at a time going
+    // into the checksum so neither loop is optimized away
+    std::atomic<unsigned> nAssemblyChecksum(0);
+
+    bench.Run("buffer_iovec", "MB/s", pStaticMap->bytes.size() / kMega, [&]()
+    {
+        nAssemblyChecksum += AssembleIoVecs(pStaticMap->bytes);
+    });
+
+    bench.Run("buffer_download", "MB/s", pStaticMap->bytes.size() / kMega, [&]()
+    {
+        nAssemblyChecksum += AssembleDownloadBuffer(pStaticMap->bytes, true);
+    });
+
+    bench.Run("buffer_download_grow", "MB/s", pStaticMap->bytes.size() / kMega, [&]()
+    {
+        nAssemblyChecksum += AssembleDownloadBuffer(pStaticMap->bytes, false);
+    });
+
+    // decode
+    bench.Run("decode_map", "MP/s", Megapixels(hStaticMap->Width(), hStaticMap->Height()), [&]()
+    {
+        Decode(*pDecoder, *pStaticMap);
+    });
+
+    bench.Run("decode_tile", "MP/s", Megapixels(hTile->Width(), hTile->Height()), [&]()
+    {
+        Decode(*pDecoder, *pTile);
+    });
+
+    // a static map over a slow link, decoded after the download as
+    // /nostream does, and while it downloads as GetBingMap does
+    if (options.fLinkRate > 0 && (bench.Wants("throttled_sequential") || bench.Wants("throttled_streaming")))
+    {
+        LocalHttpFaults faults;
+        faults.nBytesPerSecond = (uint64_t)(options.fLinkRate * kMega);
+
+        LocalHttpServer slowServer;
+        slowServer.AddFile("/fixtures/" + pStaticMap->strName, pStaticMap->bytes);
+        slowServer.SetFaults(faults);
+
+        if (!slowServer.Start())
+        {
+            fprintf(stderr, "MapBench: could not start the throttled HTTP server\n");
+            return 2;
+        }
+
+        LocalHttpClient slowClient;
+        std::string strPath = "/fixtures/" + pStaticMap->strName;
+
+        bench.Run("throttled_sequential", "maps/s", 1.0, [&]()
+        {
+            StreamingBuffer body;
+            MapImageHandle hMap;
+
+            if (200 != slowClient.Get(slowServer.Port(), strPath, body) ||
+                !DecodeToMapImage(*pDecoder, body.Data(), body.Size(), hMap))
+            {
+                fprintf(stderr, "MapBench: throttled download failed\n");
+                exit(1);
+            }
+        });
+
+        bench.Run("throttled_streaming", "maps/s", 1.0, [&]()
+        {
+            StreamingBuffer body;
+            MapImageHandle hMap;
+            bool bDecoded = false;
+
+            // the decode thread waits for each piece as it arrives
+            std::thread decoder([&]() { bDecoded = DecodeJpegStream(body, hMap); });
+
+            int nStatus = slowClient.Get(slowServer.Port(), strPath, body);
+
+            decoder.join();
+
+            if (200 != nStatus || !bDecoded)
+            {
+                fprintf(stderr, "MapBench: throttled streaming download failed\n");
+                exit(1);
+            }
+        });
+
+        slowServer.Stop();
+    }
+
+    // color conversion, a 4:2:0 image the size of the static map
+    {
+        int nWidth = hStaticMap->Width();
+        int nHeight = hStaticMap->Height();
+        int nChromaWidth = (nWidth + 1) / 2;
+
+        std::vector<uint8_t> luma((size_t)nWidth * nHeight);
+        std::vector<uint8_t> cb((size_t)nChromaWidth * ((nHeight + 1) / 2));
+        std::vector<uint8_t> cr(cb.size());
+
+        for (size_t i = 0; i < luma.size(); i++)
+        {
+            luma[i] = (uint8_t)(i * 7);
+        }
+
+        for (size_t i = 0; i < cb.size(); i++)
+        {
+            cb[i] = (uint8_t)(i * 3);
+            cr[i] = (uint8_t)(255 - i * 5);
+        }
+
+        std::shared_ptr<MapImage> pConverted = MapImage::Create(nWidth, nHeight);
+
+        for (bool bScalar : { false, true })
+        {
+            bench.Run(bScalar ? "convert_ycbcr_scalar" : "convert_ycbcr", "MP/s", Megapixels(nWidth, nHeight), [&]()
+            {
+                for (int y = 0; y < nHeight; y++)
+                {
+                    const uint8_t* pY = &luma[(size_t)y * nWidth];
+                    const uint8_t* pCb = &cb[(size_t)(y / 2) * nChromaWidth];
+                    const uint8_t* pCr = &cr[(size_t)(y / 2) * nChromaWidth];
+
+                    if (bScalar)
+                    {
+                        YCbCrRowToBgrxScalar(pY, pCb, pCr, 1, pConverted->Row(y), nWidth);
+                    }
+                    else
+                    {
+                        YCbCrRowToBgrx(pY, pCb, pCr, 1, pConverted->Row(y), nWidth);
+                    }
+                }
+            });
+        }
+    }
+
+    // scaling the static map to fill the window
+    {
+        int nFitWidth = 0;
+        int nFitHeight = 0;
+
+        FitImageSize(hStaticMap->Width(), hStaticMap->Height(), kViewWidth, kViewHeight, &nFitWidth, &nFitHeight);
+
+        std::shared_ptr<MapImage> pScaled = MapImage::Create(nFitWidth, nFitHeight);
+        double fWork = Megapixels(nFitWidth, nFitHeight);
+
+        for (ScaleFilter filter : { ScaleFilter::NEAREST, ScaleFilter::BILINEAR, ScaleFilter::LANCZOS3 })
+        {
+            std::string strName = std::string("scale_") + ScaleFilterName(filter);
+
+            bench.Run(strName.c_str(), "MP/s", fWork, [&]()
+            {
+                ScaleImage(PixelBufferOf(*hStaticMap), PixelBufferOf(*pScaled), filter);
+            });
+        }
+
+        bench.Run("scale_lanczos3_scalar", "MP/s", fWork, [&]()
+        {
+            ScaleImageScalar(PixelBufferOf(*hStaticMap), PixelBufferOf(*pScaled), ScaleFilter::LANCZOS3);
+        });
+    }
+
+    // ComposeMap: the background around the map, then the map
+    bench.Run("blit_map", "MP/s", Megapixels(kViewWidth, kViewHeight), [&]()
+    {
+        int x = (kViewWidth - hStaticMap->Width()) / 2;
+        int y = (kViewHeight - hStaticMap->Height()) / 2;
+        PixelRect mapRect = { x, y, x + hStaticMap->Width(), y + hStaticMap->Height() };
+
+        FillPixelsAround(backBuffer, view, mapRect, TileLayer::kBackgroundColor);
+        BlitPixels(backBuffer, view, x, y, PixelBufferOf(*hStaticMap));
+    });
+
+    // the tiled map
+    {
+        MapBitmapStore store;
+        std::vector<MapRequestKey> missing;
+
+        TileLayer layer;
+        layer.Resize(kViewWidth, kViewHeight);
+        layer.CenterOn(kSeattleLatitude, kSeattleLongitude, kTileLevel);
+
+        FillTileStore(layer, store, tiles, backBuffer);
+
+        bench.Run("compose_tiles", "MP/s", Megapixels(kViewWidth, kViewHeight), [&]()
+        {
+            layer.Compose(store, backBuffer, view, missing);
+        });
+
+        // zoomed in a level with none of its tiles yet, so every tile is a
+        // stand-in scaled up from the level above
+        TileLayer zoomed;
+        zoomed.Resize(kViewWidth, kViewHeight);
+        zoomed.CenterOn(kSeattleLatitude, kSeattleLongitude, kTileLevel + 1);
+
+        bench.Run("compose_standin", "MP/s", Megapixels(kViewWidth, kViewHeight), [&]()
+        {
+            zoomed.Compose(store, backBuffer, view, missing);
+        });
+
+        // a drag: move what's on screen and compose what scrolls into view.
+        // Back and forth, so the view stays over the tiles in the store.
+        int nDirection = 1;
+
+        bench.Run("pan_scroll", "MP/s", Megapixels(kViewWidth, kViewHeight), [&]()
+        {
+            int dx = 7 * nDirection;
+            int dy = 5 * nDirection;
+            int nMovedX = 0;
+            int nMovedY = 0;
+
+            nDirection = -nDirection;
+
+            layer.PanBy(-dx, -dy, &nMovedX, &nMovedY);
+
+            ScrollDamage damage = ComputeScrollDamage(kViewWidth, kViewHeight, -nMovedX, -nMovedY);
+            ScrollPixels(backBuffer, -nMovedX, -nMovedY);
+
+            for (int i = 0; i < damage.nExposed; i++)
+            {
+                layer.Compose(store, backBuffer, damage.exposed[i], missing);
+            }
+        });
+
+        bench.Run("visible_tiles", "kop/s", 1e-3, [&]()
+        {
+            std::vector<VisibleTile> visible = ComputeVisibleTiles(layer.Viewport());
+
+            for (const VisibleTile& tile : visible)
+            {
+                layer.TileKey(tile);
+            }
+        });
+    }
+
+    // every thread asking for the same few maps at once
+    {
+        MapSingleFlight<MapImageHandle> flights;
+        std::vector<MapRequestKey> keys;
+
+        const int kKeys = 64;
+        const int kRunsPerThread = 1000;
+
+        for (int i = 0; i < kKeys; i++)
+        {
+            keys.push_back(MapRequestKey::ForTile(DEFAULT_IMAGERY_SET, TileSystem::TileXYToQuadKey(i, 0, kTileLevel)));
+        }
+
+        bench.Run("single_flight", "kop/s", kContentionThreads * kRunsPerThread * 1e-3, [&]()
+        {
+            RunOnThreads([&](int nThread)
+            {
+                for (int i = 0; i < kRunsPerThread; i++)
+                {
+                    MapImageHandle hMap;
+
+                    flights.Run(keys[(i + nThread * 7) % kKeys], nullptr,
+                        [&](MapImageHandle& mapOut) { mapOut = hTile; return true; }, hMap);
+                }
+            });
+        });
+    }
+
+    {
+        MapMetrics metrics;
+
+        const int kRecordsPerThread = 100000;
+
+        bench.Run("histogram_record", "Mop/s", kContentionThreads * kRecordsPerThread / kMega, [&]()
+        {
+            RunOnThreads([&](int nThread)
+            {
+                for (int i = 0; i < kRecordsPerThread; i++)
+                {
+                    metrics.Record(MapMetric::DOWNLOAD, (uint64_t)(i * 37 + nThread));
+                }
+            });
+        });
+    }
+
+    // the two tier cache, with every tile kept as a JPEG and a tenth of
+    // them decoded
+    {
+        const int kCachedTiles = 2000;
+        const int kLookups = 1000;
+
+        std::vector<MapRequestKey> keys;
+
+        for (int i = 0; i < kCachedTiles; i++)
+        {
+            keys.push_back(MapRequestKey::ForTile(DEFAULT_IMAGERY_SET, TileSystem::TileXYToQuadKey(i, 1, kTileLevel)));
+        }
+
+        MapTieredCache cache(hTile->ByteSize() * (kCachedTiles / 10), MapCompressedStore::kDefaultBudgetBytes);
+
+        cache.SetDecoder([&](const uint8_t* pData, size_t nSize, MapImageHandle& hImageOut)
+        {
+            return DecodeToMapImage(*pDecoder, pData, nSize, hImageOut);
+        });
+
+        for (int i = 0; i < kCachedTiles; i++)
+        {
+            cache.Insert(keys[i], pTile->bytes.data(), pTile->bytes.size(), MapImageHandle());
+        }
+
+        cache.Find(keys[0]);
+
+        bench.Run("cache_find_decoded", "kop/s", kLookups * 1e-3, [&]()
+        {
+            for (int i = 0; i < kLookups; i++)
+            {
+                cache.Find(keys[0]);
+            }
+        });
+
+        bench.Run("cache_decode_compressed", "maps/s", 1.0, [&]()
+        {
+            cache.Decoded().Remove(keys[1]);
+
+            if (!cache.Find(keys[1]))
+            {
+                fprintf(stderr, "MapBench: tiered cache decode failed\n");
+                exit(1);
+            }
+        });
+
+        // most lookups are for a few tiles, as when panning about one place
+        std::mt19937 random(1);
+        std::geometric_distribution<int> nearby(0.02);
+
+        bench.Run("cache_working_set", "kop/s", kLookups * 1e-3, [&]()
+        {
+            for (int i = 0; i < kLookups; i++)
+            {
+                cache.Find(keys[std::min(nearby(random), kCachedTiles - 1)]);
+            }
+        });
+    }
+
+    // a static map from request to screen
+    {
+        int nFitWidth = 0;
+        int nFitHeight = 0;
+
+        FitImageSize(hStaticMap->Width(), hStaticMap->Height(), kViewWidth, kViewHeight, &nFitWidth, &nFitHeight);
+
+        std::shared_ptr<MapImage> pScaled = MapImage::Create(nFitWidth, nFitHeight);
+        MapImageHandle hScaled = pScaled;
+        std::string strPath = "/fixtures/" + pStaticMap->strName;
+
+        bench.Run("pipeline_map", "maps/s", 1.0, [&]()
+        {
+            StreamingBuffer body;
+            MapImageHandle hMap;
+
+            if (200 != client.Get(server.Port(), strPath, body) ||
+                !DecodeToMapImage(*pDecoder, body.Data(), body.Size(), hMap))
+            {
+                fprintf(stderr, "MapBench: pipeline download failed\n");
+                exit(1);
+            }
+
+            ScaleImage(PixelBufferOf(*hMap), PixelBufferOf(*pScaled), ScaleFilter::LANCZOS3);
+
+            int x = (kViewWidth - nFitWidth) / 2;
+            int y = (kViewHeight - nFitHeight) / 2;
+            PixelRect mapRect = { x, y, x + nFitWidth, y + nFitHeight };
+
+            FillPixelsAround(backBuffer, view, mapRect, TileLayer::kBackgroundColor);
+            BlitPixels(backBuffer, view, x, y, PixelBufferOf(*hScaled));
+        });
+    }
+
+    server.Stop();
+
+    int nResult = 0;
+
+    if (!options.strBaseline.empty())
+    {
+        std::map<std::string, BenchResult> baseline = ReadBaseline(options.strBaseline);
+
+        if (baseline.empty())
+        {
+            fprintf(stderr, "MapBench: no baseline in %s\n", options.strBaseline.c_str());
+        }
+        else
+        {
+            int nRegressions = CompareWithBaseline(bench.Results(), baseline, options.fTolerance);
+
+            if (nRegressions > 0)
+            {
+                printf("\n%d stage(s) more than %.0f%% slower than the baseline\n", nRegressions, options.fTolerance);
+
+                if (options.bCheck)
+                {
+                    nResult = 1;
+                }
+            }
+        }
+    }
+
+    if (!options.strWriteBaseline.empty())
+    {
+        if (!WriteBaseline(options.strWriteBaseline, bench.Results()))
+        {
+            fprintf(stderr, "MapBench: could not write %s\n", options.strWriteBaseline.c_str());
+            nResult = 2;
+        }
+    }
+
+    return nResult;
+}
@@ -0,0 +1,479 @@
+// MapLoadTest.cpp : Drives the concurrent fetch path against a MockMapServer.
+//
+// Submits thousands of map and tile requests to a MapFetchQueue, whose
+// workers do what the Windows program's do for each one: route it through
+// MapSingleFlight, and through MapRetrier, which times out, retries and
+// hedges its attempts, build its URL with BuildMapUrl, download it into a
+// StreamingBuffer and decode it with JpegDecoder.  Only the WinInet half
+// of GetBingMap is replaced, by LocalHttpClient.
+//
+// The requests are drawn at random, with repeats, from a fixed set of
+// distinct keys, so some arrive while the same key is already in flight
+// and are shared.  A few are kept queued ahead of the workers so they are
+// never idle.  At the end it reports throughput, how the requests ended,
+// and the latency of each from submission to completion.
+//
+// The MockMapServer runs in process unless --port names one already
+// running.  Run with --help for the options.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "ImageDecoder.h"
+#include "JpegDecoder.h"
+#include "LocalHttpClient.h"
+#include "MapFetchQueue.h"
+#include "MapMetrics.h"
+#include "MapRequestArena.h"
+#include "MapRetry.h"
+#include "MapSingleFlight.h"
+#include "MapUrl.h"
+#include "MockMapServer.h"
+#include "StreamingBuffer.h"
+#include "TileSystem.h"
+
+#ifndef MAPBENCH_FIXTURES_DIR
+#define MAPBENCH_FIXTURES_DIR "Fixtures"
+#endif
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    // the level of the random tiles, about a city's worth
+    const int kTileLevel = 14;
+
+    // one key in this many is a static map, the rest are tiles
+    const unsigned kStaticMapEvery = 10;
+
+    const wchar_t* const kImagerySets[] = { L"AerialWithLabels", L"Aerial", L"Road" };
+
+    const wchar_t* const kPlaces[] = { L"Seattle", L"San Francisco", L"Portland", L"Vancouver",
+        L"Los Angeles", L"Denver", L"Chicago", L"New York" };
+
+    struct Options
+    {
+        std::string     strFixtures = MAPBENCH_FIXTURES_DIR;
+        unsigned        nRequests = 5000;
+        unsigned        nDistinct = 2000;
+        unsigned        nWorkers = 16;
+        unsigned        nAhead = 0;         // queued ahead of the workers, 0 for as many as there are workers
+        uint16_t        nPort = 0;          // an already running MockMapServer, or 0 to start one
+        LocalHttpFaults faults;
+        MapRetryPolicy  retry;
+    };
+
+    // what became of the requests, and of the attempts at them
+    struct Counts
+    {
+        std::atomic<uint64_t>   nSucceeded{ 0 };
+        std::atomic<uint64_t>   nFailed{ 0 };
+        std::atomic<uint64_t>   nCancelled{ 0 };
+        std::atomic<uint64_t>   nHttpErrors{ 0 };       // answered, but not with 200
+        std::atomic<uint64_t>   nBrokenResponses{ 0 };  // no answer, or cut off
+        std::atomic<uint64_t>   nTimeouts{ 0 };
+        std::atomic<uint64_t>   nUndecodable{ 0 };
+        std::atomic<uint64_t>   nBytes{ 0 };
+    };
+
+    // the distinct keys the requests are drawn from
+    std::vector<MapRequestKey> MakeKeys(unsigned nDistinct, std::mt19937& random)
+    {
+        std::vector<MapRequestKey> keys;
+        std::uniform_int_distribution<int> tileXY(0, (1 << kTileLevel) - 1);
+
+        for (unsigned i = 0; i < nDistinct; i++)
+        {
+            const wchar_t* pszImagerySet = kImagerySets[i % (sizeof(kImagerySets) / sizeof(kImagerySets[0]))];
+
+            if (0 == i % kStaticMapEvery)
+            {
+                // the size makes each one distinct, as resizing the window does
+                const wchar_t* pszPlace = kPlaces[(i / kStaticMapEvery) % (sizeof(kPlaces) / sizeof(kPlaces[0]))];
+                keys.emplace_back(pszImagerySet, pszPlace, 800 + (int)(i / kStaticMapEvery), 500);
+            }
+            else
+            {
+                std::string quadKey = TileSystem::TileXYToQuadKey(tileXY(random), tileXY(random), kTileLevel);
+                keys.push_back(MapRequestKey::ForTile(pszImagerySet, quadKey));
+            }
+        }
+
+        return keys;
+    }
+
+    // the path and query of a URL, without its scheme and host.  URLs
+    // from BuildMapUrl are ASCII.
+    std::pmr::string PathOfUrl(const std::pmr::wstring& strUrl, std::pmr::memory_resource* pResource)
+    {
+        size_t nScheme = strUrl.find(L"://");
+        size_t nPath = strUrl.find(L'/', (nScheme == std::wstring::npos) ? 0 : nScheme + 3);
+
+        std::pmr::string strPath(pResource);
+
+        if (nPath == std::wstring::npos)
+        {
+            strPath = "/";
+        }
+        else
+        {
+            strPath.assign(strUrl.begin() + nPath, strUrl.end());
+        }
+
+        return strPath;
+    }
+
+    // one attempt at the part of GetBingMap after the URL is built, and
+    // DecodeMapStream
+    MapAttemptResult DownloadMap(const MapRequestKey& key, const std::wstring& strBaseUrl, uint16_t nPort,
+        const MapRetryPolicy& policy, MapAttemptToken& token, Counts& counts, MapImageHandle& hImageOut)
+    {
+        // each worker keeps its connection alive, as HttpSessionPool does.
+        // A hedge runs on a thread of its own, and gets its own connection.
+        thread_local LocalHttpClient client;
+        thread_local std::unique_ptr<ImageDecoder> pDecoder = CreateJpegDecoder();
+
+        client.SetTimeouts(policy.nConnectTimeoutMs, policy.nReadTimeoutMs, policy.nTotalTimeoutMs);
+
+        // the URL, headers and body are freed together on return
+        MapRequestArena arena;
+
+        std::pmr::wstring strUrl(arena.Resource());
+
+        if (!BuildMapUrl(key, strBaseUrl, L"LoadTestKey", strUrl))
+        {
+            return MapAttemptResult::FAIL;
+        }
+
+        StreamingBuffer body(arena.Resource());
+        LocalHttpTiming timing;
+
+        // a hedge that wins interrupts this download if it is stuck.  It
+        // does so from its own thread, so it needs this thread's client.
+        LocalHttpClient* pClient = &client;
+
+        client.ResetInterrupt();
+        token.SetInterrupt([pClient]() { pClient->Interrupt(); });
+
+        int nStatus = client.Get(nPort, PathOfUrl(strUrl, arena.Resource()), body, &timing, arena.Resource());
+
+        token.ClearInterrupt();
+
+        // the other attempt won, this one doesn't count
+        if (token.IsCancelled())
+        {
+            return MapAttemptResult::RETRY;
+        }
+
+        MapAttemptResult result = MapAttemptResultForHttpStatus(nStatus);
+
+        if (timing.timedOut)
+        {
+            counts.nTimeouts.fetch_add(1, std::memory_order_relaxed);
+        }
+        else if (0 == nStatus)
+        {
+            counts.nBrokenResponses.fetch_add(1, std::memory_order_relaxed);
+        }
+        else if (200 != nStatus)
+        {
+            counts.nHttpErrors.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        if (MapAttemptResult::SUCCEEDED != result)
+        {
+            return result;
+        }
+
+        counts.nBytes.fetch_add(body.Size(), std::memory_order_relaxed);
+
+        // the same bytes would decode no better a second time
+        if (!DecodeToMapImage(*pDecoder, body.Data(), body.Size(), hImageOut))
+        {
+            counts.nUndecodable.fetch_add(1, std::memory_order_relaxed);
+            return MapAttemptResult::FAIL;
+        }
+
+        return MapAttemptResult::SUCCEEDED;
+    }
+
+    void PrintUsage()
+    {
+        MapRetryPolicy defaults;
+
+        printf(
+            "usage: MapLoadTest [options]\n"
+            "  --requests N            how many requests to make (default 5000)\n"
+            "  --distinct N            how many different maps and tiles they ask for (default 2000)\n"
+            "  --workers N             fetch queue worker threads (default 16)\n"
+            "  --ahead N               requests kept queued ahead of the workers (default the workers)\n"
+            "  --port N                use the MockMapServer on 127.0.0.1:N instead of starting one\n"
+            "  --fixtures DIR          the recorded JPEGs (default %s)\n"
+            "  --attempts N            tries at each download, the first included (default %u)\n"
+            "  --connect-timeout MS    to connect, 0 for no limit (default %u)\n"
+            "  --read-timeout MS       waiting for more of a response, 0 for no limit (default %u)\n"
+            "  --total-timeout MS      for a whole attempt, 0 for no limit (default %u)\n"
+            "  --hedge                 race attempts slower than most with a second one\n"
+            "  --hedge-percentile P    how slow is slower than most (default %.0f)\n"
+            "the server started in process takes these too:\n"
+            "%s",
+            MAPBENCH_FIXTURES_DIR, defaults.nMaxAttempts, defaults.nConnectTimeoutMs, defaults.nReadTimeoutMs,
+            defaults.nTotalTimeoutMs, defaults.fHedgePercentile, kFaultOptionsUsage);
+    }
+
+    bool ParseOptions(int argc, char** argv, Options& options)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            std::string strArg = argv[i];
+            bool bHasValue = i + 1 < argc;
+
+            if ("--requests" == strArg && bHasValue)
+            {
+                options.nRequests = (unsigned)strtoul(argv[++i], nullptr, 10);
+            }
+            else if ("--distinct" == strArg && bHasValue)
+            {
+                options.nDistinct = std::max(1u, (unsigned)strtoul(argv[++i], nullptr, 10));
+            }
+            else if ("--workers" == strArg && bHasValue)
+            {
+                options.nWorkers = std::max(1u, (unsigned)strtoul(argv[++i], nullptr, 10));
+            }
+            else if ("--ahead" == strArg && bHasValue)
+            {
+                options.nAhead = (unsigned)strtoul(argv[++i], nullptr, 10);
+            }
+            else if ("--port" == strArg && bHasValue)
+            {
+                options.nPort = (uint16_t)atoi(argv[++i]);
+            }
+            else if ("--fixtures" == strArg && bHasValue)
+            {
+                options.strFixtures = argv[++i];
+            }
+            else if ("--attempts" == strArg && bHasValue)
+            {
+                options.retry.nMaxAttempts = std::max(1u, (unsigned)strtoul(argv[++i], nullptr, 10));
+            }
+            else if ("--connect-timeout" == strArg && bHasValue)
+            {
+                options.retry.nConnectTimeoutMs = (unsigned)strtoul(argv[++i], nullptr, 10);
+            }
+            else if ("--read-timeout" == strArg && bHasValue)
+            {
+                options.retry.nReadTimeoutMs = (unsigned)strtoul(argv[++i], nullptr, 10);
+            }
+            else if ("--total-timeout" == strArg && bHasValue)
+            {
+                options.retry.nTotalTimeoutMs = (unsigned)strtoul(argv[++i], nullptr, 10);
+            }
+            else if ("--hedge" == strArg)
+            {
+                options.retry.bHedge = true;
+            }
+            else if ("--hedge-percentile" == strArg && bHasValue)
+            {
+                options.retry.fHedgePercentile = atof(argv[++i]);
+            }
+            else if (!ParseFaultOption(argc, argv, i, options.faults))
+            {
+                PrintUsage();
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool HasFaults(const LocalHttpFaults& faults)
+    {
+        return faults.fErrorRate > 0 || faults.fTruncateRate > 0 || faults.fStallRate > 0;
+    }
+
+    void PrintLatency(const char* pszName, const MetricHistogram::Snapshot& snapshot)
+    {
+        printf("%-12s %9.2f %9.2f %9.2f %9.2f %9.2f\n", pszName, snapshot.Mean() / 1000.0,
+            snapshot.ValueAtPercentile(50) / 1000.0, snapshot.ValueAtPercentile(90) / 1000.0,
+            snapshot.ValueAtPercentile(99) / 1000.0, snapshot.nMax / 1000.0);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+
+    if (!ParseOptions(argc, argv, options))
+    {
+        return 2;
+    }
+
+    std::unique_ptr<MockMapServer> pServer;
+    uint16_t nPort = options.nPort;
+
+    if (0 == nPort)
+    {
+        pServer.reset(new MockMapServer());
+
+        if (!pServer->LoadFixtures(options.strFixtures))
+        {
+            fprintf(stderr, "MapLoadTest: no static maps or tiles in %s\n", options.strFixtures.c_str());
+            return 2;
+        }
+
+        pServer->SetFaults(options.faults);
+
+        if (!pServer->Start())
+        {
+            fprintf(stderr, "MapLoadTest: could not start the mock map server\n");
+            return 2;
+        }
+
+        nPort = pServer->Port();
+    }
+
+    std::wstring strBaseUrl = L"http://127.0.0.1:" + std::to_wstring(nPort);
+
+    // the same requests every run
+    std::mt19937 random(options.faults.nSeed);
+    std::vector<MapRequestKey> keys = MakeKeys(options.nDistinct, random);
+
+    std::vector<size_t> requests(options.nRequests);
+    std::uniform_int_distribution<size_t> pick(0, keys.size() - 1);
+
+    for (size_t& nKey : requests)
+    {
+        nKey = pick(random);
+    }
+
+    Counts counts;
+
+    // latency in microseconds, from submission to completion and in the fetcher
+    MetricHistogram latency;
+    MetricHistogram fetchLatency;
+
+    // failures aren't remembered, so that every injected error is seen
+    MapSingleFlight<MapImageHandle> flights(Clock::duration::zero());
+    MapRetrier retrier(options.retry);
+
+    std::vector<Clock::time_point> submitted(options.nRequests);
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    unsigned nCompleted = 0;
+
+    auto fetcher = [&](const MapRequestKey& key, const MapFetchCancelToken& token, MapImageHandle& hImageOut)
+    {
+        Clock::time_point start = Clock::now();
+
+        MapRetrier::Attempt<MapImageHandle> attempt = [&](MapAttemptToken& attemptToken, MapImageHandle& hImage)
+        {
+            return DownloadMap(key, strBaseUrl, nPort, options.retry, attemptToken, counts, hImage);
+        };
+
+        MapSingleFlightStatus status = flights.Run(key, token.Flag(),
+            [&](MapImageHandle& hImage) { return MapRetryStatus::SUCCEEDED == retrier.Run(token.Flag(), attempt, hImage); },
+            hImageOut);
+
+        fetchLatency.Record(MapMetrics::MicrosecondsBetween(start, Clock::now()));
+
+        return MapSingleFlightSucceeded(status);
+    };
+
+    auto onComplete = [&](MapFetchCompletion<MapImageHandle>&& completion)
+    {
+        // request ids start at 1 and go up by one for each Submit
+        latency.Record(MapMetrics::MicrosecondsBetween(submitted[completion.requestId - 1], Clock::now()));
+
+        switch (completion.status)
+        {
+        case MapFetchStatus::SUCCEEDED: counts.nSucceeded.fetch_add(1, std::memory_order_relaxed); break;
+        case MapFetchStatus::FAILED:    counts.nFailed.fetch_add(1, std::memory_order_relaxed); break;
+        case MapFetchStatus::CANCELLED: counts.nCancelled.fetch_add(1, std::memory_order_relaxed); break;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        nCompleted++;
+        cv.notify_one();
+    };
+
+    unsigned nAhead = (options.nAhead > 0) ? options.nAhead : options.nWorkers;
+
+    printf("MapLoadTest: %u requests for %zu maps and tiles, %u workers, from %s\n", options.nRequests,
+        keys.size(), options.nWorkers, WideToUtf8(strBaseUrl).c_str());
+
+    Clock::time_point start = Clock::now();
+
+    {
+        MapFetchQueue<MapImageHandle> queue(fetcher, onComplete, options.nWorkers);
+
+        for (unsigned i = 0; i < options.nRequests; i++)
+        {
+            {
+                // keep the workers busy and nAhead more waiting
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&] { return i - nCompleted < options.nWorkers + nAhead; });
+            }
+
+            submitted[i] = Clock::now();
+            queue.Submit(keys[requests[i]]);
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return nCompleted == options.nRequests; });
+    }
+
+    double fSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    MapSingleFlight<MapImageHandle>::Stats flightStats = flights.GetStats();
+
+    printf("\n%.0f requests/s, %.1f MB/s, %.2f s\n", options.nRequests / fSeconds,
+        counts.nBytes.load() / 1e6 / fSeconds, fSeconds);
+    printf("%llu succeeded (%llu downloaded, %llu shared), %llu failed, %llu cancelled\n",
+        (unsigned long long)counts.nSucceeded.load(), (unsigned long long)flightStats.nFetched,
+        (unsigned long long)flightStats.nShared, (unsigned long long)counts.nFailed.load(),
+        (unsigned long long)counts.nCancelled.load());
+    MapRetrier::Stats retryStats = retrier.GetStats();
+
+    printf("attempts: %llu, %llu retries, %llu hedges (%llu won), %llu gave up, %llu failed for good\n",
+        (unsigned long long)retryStats.nAttempts, (unsigned long long)retryStats.nRetries,
+        (unsigned long long)retryStats.nHedges, (unsigned long long)retryStats.nHedgeWins,
+        (unsigned long long)retryStats.nGaveUp, (unsigned long long)retryStats.nFailed);
+    printf("failed attempts: %llu HTTP errors, %llu broken responses, %llu timeouts, %llu undecodable\n",
+        (unsigned long long)counts.nHttpErrors.load(), (unsigned long long)counts.nBrokenResponses.load(),
+        (unsigned long long)counts.nTimeouts.load(), (unsigned long long)counts.nUndecodable.load());
+
+    printf("\n%-12s %9s %9s %9s %9s %9s\n", "ms", "mean", "p50", "p90", "p99", "max");
+    PrintLatency("request", latency.TakeSnapshot());
+    PrintLatency("fetch", fetchLatency.TakeSnapshot());
+
+    if (pServer)
+    {
+        pServer->Stop();
+
+        LocalHttpServer::Stats stats = pServer->GetStats();
+
+        printf("\nserver: %llu requests, %llu not found, %llu errors, %llu truncated, %llu stalled, %.1f MB sent\n",
+            (unsigned long long)stats.nRequests, (unsigned long long)stats.nNotFound,
+            (unsigned long long)stats.nErrors, (unsigned long long)stats.nTruncated,
+            (unsigned long long)stats.nStalled, stats.nBodyBytes / 1e6);
+    }
+
+    // with nothing injected, every request should have succeeded
+    if (!HasFaults(options.faults) && counts.nSucceeded.load() != options.nRequests)
+    {
+        fprintf(stderr, "MapLoadTest: %llu requests didn't succeed\n",
+            (unsigned long long)(options.nRequests - counts.nSucceeded.load()));
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,420 @@
+// MapRender.cpp : Renders a manifest of maps to image files, headless.
+//
+// The Linux counterpart of GraphicsTestWin32's /batch.  It reads a
+// manifest in the locations file format (see MapLocations.h), or makes up
+// --thumbnails N small maps, and renders each to a PNG, JPEG or BMP in the
+// output directory with RunMapBatch.  Each worker fetches its map through
+// MapRetrier, as GetBingMap does, with BuildMapUrl and LocalHttpClient in
+// place of WinInet, decodes it with JpegDecoder and encodes it with the
+// encoder for the format.  At the end it prints how many maps a second it
+// wrote and the percentiles of each stage, and --report writes the same as
+// JSON for CI to keep.
+//
+// LocalHttpClient only speaks plain HTTP to 127.0.0.1, so the maps come
+// from a MockMapServer: one started in process, or one already running
+// with --port.  Run with --help for the options.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "ImageDecoder.h"
+#include "ImageEncoder.h"
+#include "JpegDecoder.h"
+#include "JpegEncoder.h"
+#include "LocalHttpClient.h"
+#include "MapBatch.h"
+#include "MapLocations.h"
+#include "MapRequestArena.h"
+#include "MapRetry.h"
+#include "MapUrl.h"
+#include "MockMapServer.h"
+#include "PngEncoder.h"
+#include "StreamingBuffer.h"
+
+#ifndef MAPBENCH_FIXTURES_DIR
+#define MAPBENCH_FIXTURES_DIR "Fixtures"
+#endif
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    const wchar_t* const kImagerySets[] = { L"AerialWithLabels", L"Aerial", L"Road" };
+
+    const wchar_t* const kPlaces[] = { L"Seattle", L"San Francisco", L"Portland", L"Vancouver",
+        L"Los Angeles", L"Denver", L"Chicago", L"New York" };
+
+    // thumbnail sizes, all at least the 80 x 80 Bing Maps will make
+    const int kThumbnailSizes[][2] = { { 160, 120 }, { 200, 150 }, { 256, 256 }, { 320, 240 } };
+
+    struct Options
+    {
+        std::string     strManifest;
+        unsigned        nThumbnails = 0;        // made-up maps, if there is no manifest
+        std::string     strOutput = "maps";
+        MapImageFormat  format = MapImageFormat::PNG;
+        int             nJpegQuality = 85;
+        int             nPngLevel = 1;
+        unsigned        nWorkers = std::max(4u, 2 * std::thread::hardware_concurrency());
+        std::string     strReport;              // JSON report, if wanted
+        uint16_t        nPort = 0;              // an already running MockMapServer, or 0 to start one
+        std::string     strFixtures = MAPBENCH_FIXTURES_DIR;
+        LocalHttpFaults faults;
+        MapRetryPolicy  retry;
+    };
+
+    // what one attempt hands back: the decoded map, and how long decoding
+    // it took, since the download buffer is gone once the attempt returns
+    struct FetchedMap
+    {
+        MapImageHandle  hImage;
+        double          fDecodeMs = 0;
+        uint64_t        nBytes = 0;
+        bool            bUndecodable = false;
+    };
+
+    // the path part of one of BuildMapUrl's URLs, which are ASCII
+    std::pmr::string PathOfUrl(const std::pmr::wstring& strUrl, std::pmr::memory_resource* pResource)
+    {
+        size_t nScheme = strUrl.find(L"://");
+        size_t nPath = strUrl.find(L'/', (nScheme == std::wstring::npos) ? 0 : nScheme + 3);
+
+        std::pmr::string strPath(pResource);
+
+        if (nPath == std::wstring::npos)
+        {
+            strPath = "/";
+        }
+        else
+        {
+            strPath.assign(strUrl.begin() + nPath, strUrl.end());
+        }
+
+        return strPath;
+    }
+
+    // one attempt at downloading and decoding a map, as DownloadMap in
+    // MapLoadTest
+    MapAttemptResult DownloadMap(const MapRequestKey& key, const std::wstring& strBaseUrl, uint16_t nPort,
+        const MapRetryPolicy& policy, MapAttemptToken& token, FetchedMap& mapOut)
+    {
+        thread_local LocalHttpClient client;
+        thread_local std::unique_ptr<ImageDecoder> pDecoder = CreateJpegDecoder();
+
+        client.SetTimeouts(policy.nConnectTimeoutMs, policy.nReadTimeoutMs, policy.nTotalTimeoutMs);
+
+        MapRequestArena arena;
+
+        std::pmr::wstring strUrl(arena.Resource());
+
+        if (!BuildMapUrl(key, strBaseUrl, L"MapRenderKey", strUrl))
+        {
+            return MapAttemptResult::FAIL;
+        }
+
+        StreamingBuffer body(arena.Resource());
+        LocalHttpClient* pClient = &client;
+
+        client.ResetInterrupt();
+        token.SetInterrupt([pClient]() { pClient->Interrupt(); });
+
+        int nStatus = client.Get(nPort, PathOfUrl(strUrl, arena.Resource()), body, nullptr, arena.Resource());
+
+        token.ClearInterrupt();
+
+        if (token.IsCancelled())
+        {
+            return MapAttemptResult::RETRY;
+        }
+
+        MapAttemptResult result = MapAttemptResultForHttpStatus(nStatus);
+
+        if (MapAttemptResult::SUCCEEDED != result)
+        {
+            return result;
+        }
+
+        Clock::time_point start = Clock::now();
+
+        mapOut.nBytes = body.Size();
+        mapOut.bUndecodable = !DecodeToMapImage(*pDecoder, body.Data(), body.Size(), mapOut.hImage);
+        mapOut.fDecodeMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+        return mapOut.bUndecodable ? MapAttemptResult::FAIL : MapAttemptResult::SUCCEEDED;
+    }
+
+    // nCount distinct small maps, cycling through the places, sizes and
+    // imagery sets
+    std::vector<MapLocation> MakeThumbnails(unsigned nCount)
+    {
+        std::vector<MapLocation> locations;
+        size_t nPlaces = sizeof(kPlaces) / sizeof(kPlaces[0]);
+        size_t nSizes = sizeof(kThumbnailSizes) / sizeof(kThumbnailSizes[0]);
+        size_t nImagerySets = sizeof(kImagerySets) / sizeof(kImagerySets[0]);
+
+        for (unsigned i = 0; i < nCount; i++)
+        {
+            MapLocation location;
+            location.displayName = std::wstring(kPlaces[i % nPlaces]) + L" " + std::to_wstring(i / nPlaces + 1);
+            location.key = MapRequestKey(kImagerySets[i % nImagerySets], location.displayName,
+                kThumbnailSizes[i % nSizes][0], kThumbnailSizes[i % nSizes][1]);
+
+            locations.push_back(location);
+        }
+
+        return locations;
+    }
+
+    std::unique_ptr<ImageEncoder> CreateEncoder(const Options& options)
+    {
+        switch (options.format)
+        {
+        case MapImageFormat::JPEG:  return CreateJpegEncoder(options.nJpegQuality);
+        case MapImageFormat::BMP:   return CreateBmpEncoder();
+        default:                    return CreatePngEncoder(options.nPngLevel);
+        }
+    }
+
+    void PrintUsage()
+    {
+        MapRetryPolicy defaults;
+
+        printf(
+            "usage: MapRender (--manifest FILE | --thumbnails N) [options]\n"
+            "  --manifest FILE         the maps to render, in the locations file format\n"
+            "  --thumbnails N          render N made-up small maps instead\n"
+            "  --out DIR               where to write them (default maps)\n"
+            "  --format F              png, jpeg or bmp (default png)\n"
+            "  --quality N             JPEG quality, 1 to 100 (default 85)\n"
+            "  --png-level N           PNG compression level, 0 to 9 (default 1)\n"
+            "  --workers N             worker threads (default twice the processors)\n"
+            "  --report FILE           also write the timings to FILE as JSON\n"
+            "  --port N                use the MockMapServer on 127.0.0.1:N instead of starting one\n"
+            "  --fixtures DIR          the recorded JPEGs (default %s)\n"
+            "  --attempts N            tries at each download, the first included (default %u)\n"
+            "  --read-timeout MS       waiting for more of a response, 0 for no limit (default %u)\n"
+            "the server started in process takes these too:\n"
+            "%s",
+            MAPBENCH_FIXTURES_DIR, defaults.nMaxAttempts, defaults.nReadTimeoutMs, kFaultOptionsUsage);
+    }
+
+    bool ParseOptions(int argc, char** argv, Options& options)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            std::string strArg = argv[i];
+            bool bHasValue = i + 1 < argc;
+
+            if ("--manifest" == strArg && bHasValue)
+            {
+                options.strManifest = argv[++i];
+            }
+            else if ("--thumbnails" == strArg && bHasValue)
+            {
+                options.nThumbnails = (unsigned)std::min<unsigned long>(strtoul(argv[++i], nullptr, 10),
+                    kMaxMapBatchItems);
+            }
+            else if ("--out" == strArg && bHasValue)
+            {
+                options.strOutput = argv[++i];
+            }
+            else if ("--format" == strArg && bHasValue && ParseMapImageFormat(argv[i + 1], options.format))
+            {
+                i++;
+            }
+            else if ("--quality" == strArg && bHasValue)
+            {
+                options.nJpegQuality = atoi(argv[++i]);
+            }
+            else if ("--png-level" == strArg && bHasValue)
+            {
+                options.nPngLevel = atoi(argv[++i]);
+            }
+            else if ("--workers" == strArg && bHasValue)
+            {
+                options.nWorkers = std::max(1u, (unsigned)strtoul(argv[++i], nullptr, 10));
+            }
+            else if ("--report" == strArg && bHasValue)
+            {
+                options.strReport = argv[++i];
+            }
+            else if ("--port" == strArg && bHasValue)
+            {
+                options.nPort = (uint16_t)atoi(argv[++i]);
+            }
+            else if ("--fixtures" == strArg && bHasValue)
+            {
+                options.strFixtures = argv[++i];
+            }
+            else if ("--attempts" == strArg && bHasValue)
+            {
+                options.retry.nMaxAttempts = std::max(1u, (unsigned)strtoul(argv[++i], nullptr, 10));
+            }
+            else if ("--read-timeout" == strArg && bHasValue)
+            {
+                options.retry.nReadTimeoutMs = (unsigned)strtoul(argv[++i], nullptr, 10);
+            }
+            else if (!ParseFaultOption(argc, argv, i, options.faults))
+            {
+                PrintUsage();
+                return false;
+            }
+        }
+
+        // one or the other
+        if (options.strManifest.empty() == (0 == options.nThumbnails))
+        {
+            PrintUsage();
+            return false;
+        }
+
+        return true;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+
+    if (!ParseOptions(argc, argv, options))
+    {
+        return 2;
+    }
+
+    std::vector<MapLocation> locations;
+
+    if (!options.strManifest.empty())
+    {
+        if (!LoadMapLocations(options.strManifest, locations, kMaxMapBatchItems))
+        {
+            fprintf(stderr, "MapRender: no maps in %s\n", options.strManifest.c_str());
+            return 2;
+        }
+    }
+    else
+    {
+        locations = MakeThumbnails(options.nThumbnails);
+    }
+
+    std::error_code error;
+    std::filesystem::create_directories(options.strOutput, error);
+
+    if (!std::filesystem::is_directory(options.strOutput))
+    {
+        fprintf(stderr, "MapRender: could not create %s\n", options.strOutput.c_str());
+        return 2;
+    }
+
+    std::vector<MapBatchItem> items = PlanMapBatch(locations, options.strOutput, options.format);
+
+    std::unique_ptr<MockMapServer> pServer;
+    uint16_t nPort = options.nPort;
+
+    if (0 == nPort)
+    {
+        pServer.reset(new MockMapServer());
+
+        if (!pServer->LoadFixtures(options.strFixtures))
+        {
+            fprintf(stderr, "MapRender: no static maps or tiles in %s\n", options.strFixtures.c_str());
+            return 2;
+        }
+
+        pServer->SetFaults(options.faults);
+
+        if (!pServer->Start())
+        {
+            fprintf(stderr, "MapRender: could not start the mock map server\n");
+            return 2;
+        }
+
+        nPort = pServer->Port();
+    }
+
+    std::wstring strBaseUrl = L"http://127.0.0.1:" + std::to_wstring(nPort);
+    MapRetrier retrier(options.retry);
+
+    // runs on a worker thread: download and decode one map
+    MapBatchLoader loader = [&](const MapRequestKey& key, const MapFetchCancelToken& token,
+        MapImageHandle& hImageOut, MapBatchTimes& timesOut)
+    {
+        Clock::time_point start = Clock::now();
+
+        MapRetrier::Attempt<FetchedMap> attempt = [&](MapAttemptToken& attemptToken, FetchedMap& mapOut)
+        {
+            return DownloadMap(key, strBaseUrl, nPort, options.retry, attemptToken, mapOut);
+        };
+
+        FetchedMap map;
+        bool bFetched = MapRetryStatus::SUCCEEDED == retrier.Run(token.Flag(), attempt, map);
+        double fMilliseconds = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+        timesOut.milliseconds[(size_t)MapBatchStage::FETCH] = fMilliseconds - map.fDecodeMs;
+        timesOut.milliseconds[(size_t)MapBatchStage::DECODE] = map.fDecodeMs;
+        timesOut.nDownloadBytes = map.nBytes;
+        timesOut.failedStage = map.bUndecodable ? MapBatchStage::DECODE : MapBatchStage::FETCH;
+
+        hImageOut = map.hImage;
+
+        return bFetched;
+    };
+
+    // runs on a worker thread: each has an encoder of its own
+    MapBatchEncoder encoder = [&](const MapImage& image, std::vector<uint8_t>& dataOut)
+    {
+        thread_local std::unique_ptr<ImageEncoder> pEncoder;
+
+        if (!pEncoder || pEncoder->Format() != options.format)
+        {
+            pEncoder = CreateEncoder(options);
+        }
+
+        return pEncoder->Encode(image, dataOut);
+    };
+
+    printf("MapRender: %zu maps to %s in %s, %u workers, from %s\n\n", items.size(),
+        MapImageFormatName(options.format), options.strOutput.c_str(), options.nWorkers,
+        WideToUtf8(strBaseUrl).c_str());
+
+    MapBatchReport report;
+
+    RunMapBatch(items, loader, options.format, encoder, options.nWorkers, report);
+
+    if (pServer)
+    {
+        pServer->Stop();
+    }
+
+    printf("%s", report.Format().c_str());
+
+    MapRetrier::Stats retryStats = retrier.GetStats();
+
+    printf("\nattempts: %llu, %llu retries, %llu gave up, %llu failed for good\n",
+        (unsigned long long)retryStats.nAttempts, (unsigned long long)retryStats.nRetries,
+        (unsigned long long)retryStats.nGaveUp, (unsigned long long)retryStats.nFailed);
+
+    if (!options.strReport.empty())
+    {
+        std::string strJson = report.ToJson();
+        std::ofstream reportFile(options.strReport, std::ios::binary | std::ios::trunc);
+
+        reportFile.write(strJson.data(), (std::streamsize)strJson.size());
+
+        if (!reportFile)
+        {
+            fprintf(stderr, "MapRender: could not write %s\n", options.strReport.c_str());
+            return 2;
+        }
+    }
+
+    return (report.Failed() > 0) ? 1 : 0;
+}
@@ -0,0 +1,641 @@
+// MapRevalidate.cpp : Measures what conditional requests save over reloading.
+//
+// GetBingMap used to get a map again with INTERNET_FLAG_RELOAD, the whole
+// JPEG downloaded and decoded, even when it hadn't changed.  Now it sends
+// the ETag and Last-Modified it kept with the map, and a 304 means the map
+// it already has is still right.  This runs the same maps both ways
+// against a MockMapServer, which answers conditional requests, and
+// reports what each costs:
+//
+//      download    every map once, keeping its JPEG and decoded map in a
+//                  MapTieredCache and its validators in a MapRevalidationTable
+//      reload      every map again in full, and decoded again, as before
+//      revalidate  every map with a conditional request.  A 304 reuses the
+//                  decoded map; a map that has changed is decoded.
+//      stale       every map shown from the cache at once while a
+//                  background queue revalidates it, as the UI does with
+//                  stale-while-revalidate
+//      sweep       every stale map revalidated in the background by one
+//                  sweep of the schedule, MapRevalidationTable::TakeDue
+//
+// With --disk, the maps are also kept in a DiskMapCache there, and before
+// revalidating, the validators are read back from it as a restarted
+// program would.
+//
+// The server sends max-age=0, so every map is stale as soon as it has
+// arrived.  Its --change-rate makes a fraction of conditional requests
+// come back in full, as if the imagery had changed.  Without that, every
+// conditional request should get a 304 and nothing should be decoded
+// again, and the run fails if not.
+//
+// The MockMapServer runs in process unless --port names one already
+// running.  Run with --help for the options.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "DiskMapCache.h"
+#include "ImageDecoder.h"
+#include "JpegDecoder.h"
+#include "LocalHttpClient.h"
+#include "MapFetchQueue.h"
+#include "MapMetrics.h"
+#include "MapRequestArena.h"
+#include "MapRevalidation.h"
+#include "MapTieredCache.h"
+#include "MapUrl.h"
+#include "MockMapServer.h"
+#include "StreamingBuffer.h"
+#include "TileSystem.h"
+
+#ifndef MAPBENCH_FIXTURES_DIR
+#define MAPBENCH_FIXTURES_DIR "Fixtures"
+#endif
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    // the level of the random tiles, as in MapLoadTest
+    const int kTileLevel = 14;
+
+    // one map in this many is a static map, the rest are tiles
+    const unsigned kStaticMapEvery = 10;
+
+    const wchar_t* const kImagerySets[] = { L"AerialWithLabels", L"Aerial", L"Road" };
+
+    const wchar_t* const kPlaces[] = { L"Seattle", L"San Francisco", L"Portland", L"Vancouver",
+        L"Los Angeles", L"Denver", L"Chicago", L"New York" };
+
+    struct Options
+    {
+        std::string     strFixtures = MAPBENCH_FIXTURES_DIR;
+        unsigned        nMaps = 500;
+        unsigned        nWorkers = 8;
+        unsigned        nBackgroundWorkers = 2;     // revalidating stale maps, as the program's queue
+        uint16_t        nPort = 0;                  // an already running MockMapServer, or 0 to start one
+        std::string     strDisk;                    // a DiskMapCache directory, if wanted
+        LocalHttpFaults faults;
+    };
+
+    // how a phase went
+    struct Phase
+    {
+        const char*             pszName;
+        std::atomic<uint64_t>   nRequests{ 0 };
+        std::atomic<uint64_t>   nFailed{ 0 };
+        std::atomic<uint64_t>   nNotModified{ 0 };
+        std::atomic<uint64_t>   nBytes{ 0 };        // response bodies
+        std::atomic<uint64_t>   nDecodes{ 0 };
+        MetricHistogram         latencyUs;          // until the map could be shown
+        MetricHistogram         decodeUs;
+        double                  fSeconds = 0;
+
+        explicit Phase(const char* pszPhaseName) : pszName(pszPhaseName) {}
+    };
+
+    // what every phase shares
+    struct Context
+    {
+        std::wstring            strBaseUrl;
+        uint16_t                nPort = 0;
+        MapTieredCache&         cache;
+        MapRevalidationTable&   table;
+        DiskMapCache*           pDiskCache = nullptr;
+    };
+
+    // how to ask for a map
+    enum class FetchMode
+    {
+        DOWNLOAD,       // in full, whatever we have
+        REVALIDATE,     // conditionally, if we have validators for it
+    };
+
+    // the distinct maps, as MapLoadTest makes them
+    std::vector<MapRequestKey> MakeKeys(unsigned nMaps, std::mt19937& random)
+    {
+        std::vector<MapRequestKey> keys;
+        std::uniform_int_distribution<int> tileXY(0, (1 << kTileLevel) - 1);
+
+        for (unsigned i = 0; i < nMaps; i++)
+        {
+            const wchar_t* pszImagerySet = kImagerySets[i % (sizeof(kImagerySets) / sizeof(kImagerySets[0]))];
+
+            if (0 == i % kStaticMapEvery)
+            {
+                const wchar_t* pszPlace = kPlaces[(i / kStaticMapEvery) % (sizeof(kPlaces) / sizeof(kPlaces[0]))];
+                keys.emplace_back(pszImagerySet, pszPlace, 800 + (int)(i / kStaticMapEvery), 500);
+            }
+            else
+            {
+                std::string quadKey = TileSystem::TileXYToQuadKey(tileXY(random), tileXY(random), kTileLevel);
+                keys.push_back(MapRequestKey::ForTile(pszImagerySet, quadKey));
+            }
+        }
+
+        return keys;
+    }
+
+    // the path part of one of BuildMapUrl's URLs, which are ASCII
+    std::pmr::string PathOfUrl(const std::pmr::wstring& strUrl, std::pmr::memory_resource* pResource)
+    {
+        size_t nScheme = strUrl.find(L"://");
+        size_t nPath = strUrl.find(L'/', (nScheme == std::wstring::npos) ? 0 : nScheme + 3);
+
+        std::pmr::string strPath(pResource);
+
+        if (nPath == std::wstring::npos)
+        {
+            strPath = "/";
+        }
+        else
+        {
+            strPath.assign(strUrl.begin() + nPath, strUrl.end());
+        }
+
+        return strPath;
+    }
+
+    // get one map as GetBingMap does, and keep it and its validators.
+    // Revalidating, a 304 takes the map from the cache, decoded if it
+    // still is.  Returns the map, or an empty handle if it failed.
+    MapImageHandle FetchMap(const MapRequestKey& key, FetchMode mode, Context& context, Phase& phase)
+    {
+        thread_local LocalHttpClient client;
+        thread_local std::unique_ptr<ImageDecoder> pDecoder = CreateJpegDecoder();
+
+        MapRequestArena arena;
+        std::pmr::wstring strUrl(arena.Resource());
+        StreamingBuffer body(arena.Resource());
+        std::pmr::string strHeaders(arena.Resource());
+        MapImageHandle hImage;
+        MapValidators validators;
+
+        if (!BuildMapUrl(key, context.strBaseUrl, L"MapRevalidateKey", strUrl))
+        {
+            phase.nFailed.fetch_add(1, std::memory_order_relaxed);
+            return hImage;
+        }
+
+        bool bConditional = FetchMode::REVALIDATE == mode && context.table.Get(key, validators) &&
+            validators.CanRevalidate();
+
+        std::string strConditional = bConditional ? ConditionalRequestHeaders(validators) : std::string();
+
+        int nStatus = client.Get(context.nPort, PathOfUrl(strUrl, arena.Resource()), body, nullptr,
+            arena.Resource(), strConditional, &strHeaders);
+
+        int64_t nNow = MapRevalidationNow();
+
+        phase.nRequests.fetch_add(1, std::memory_order_relaxed);
+        phase.nBytes.fetch_add(body.Size(), std::memory_order_relaxed);
+
+        if (304 == nStatus && bConditional)
+        {
+            phase.nNotModified.fetch_add(1, std::memory_order_relaxed);
+
+            UpdateMapValidators(validators, strHeaders, nNow);
+            context.table.Set(key, validators);
+
+            if (context.pDiskCache)
+            {
+                context.pDiskCache->UpdateValidators(key, validators);
+            }
+
+            // the map we have is still right.  If it is still decoded it
+            // is used as it is, otherwise it is decoded from its JPEG.
+            MapCacheTier tier = MapCacheTier::NONE;
+            MapBytesHandle hBytes = context.cache.Compressed().Find(key);
+
+            hImage = context.cache.Find(key, &tier);
+
+            if (MapCacheTier::COMPRESSED == tier)
+            {
+                phase.nDecodes.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            context.table.RecordNotModified(hBytes ? hBytes->size() : 0, MapCacheTier::DECODED == tier);
+
+            if (!hImage)
+            {
+                phase.nFailed.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            return hImage;
+        }
+
+        if (200 != nStatus)
+        {
+            phase.nFailed.fetch_add(1, std::memory_order_relaxed);
+            return hImage;
+        }
+
+        Clock::time_point decodeStart = Clock::now();
+
+        if (!DecodeToMapImage(*pDecoder, body.Data(), body.Size(), hImage))
+        {
+            phase.nFailed.fetch_add(1, std::memory_order_relaxed);
+            return MapImageHandle();
+        }
+
+        phase.decodeUs.Record(MapMetrics::MicrosecondsBetween(decodeStart, Clock::now()));
+        phase.nDecodes.fetch_add(1, std::memory_order_relaxed);
+
+        if (bConditional)
+        {
+            context.table.RecordModified(body.Size());
+        }
+
+        validators = ParseMapValidators(strHeaders, context.table.Policy(), nNow);
+
+        context.cache.Insert(key, body.Data(), body.Size(), hImage);
+        context.table.Set(key, validators);
+
+        if (context.pDiskCache)
+        {
+            context.pDiskCache->Store(key, body.Data(), body.Size(), &validators);
+        }
+
+        return hImage;
+    }
+
+    // fetch every key on nWorkers threads
+    void RunPhase(const std::vector<MapRequestKey>& keys, FetchMode mode, unsigned nWorkers,
+        Context& context, Phase& phase)
+    {
+        std::atomic<size_t> nNext(0);
+        std::vector<std::thread> workers;
+
+        Clock::time_point start = Clock::now();
+
+        for (unsigned i = 0; i < nWorkers; i++)
+        {
+            workers.emplace_back([&]()
+            {
+                for (size_t n = nNext++; n < keys.size(); n = nNext++)
+                {
+                    Clock::time_point mapStart = Clock::now();
+
+                    FetchMap(keys[n], mode, context, phase);
+
+                    phase.latencyUs.Record(MapMetrics::MicrosecondsBetween(mapStart, Clock::now()));
+                }
+            });
+        }
+
+        for (std::thread& worker : workers)
+        {
+            worker.join();
+        }
+
+        phase.fSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    // revalidates maps on a background queue, as the program's
+    // revalidation queue does, and waits for them all
+    class BackgroundRevalidator
+    {
+    public:
+        BackgroundRevalidator(Context& context, Phase& phase, unsigned nWorkers)
+            : m_context(context), m_phase(phase), m_nQueued(0), m_nRevalidated(0),
+              m_queue(
+                [this](const MapRequestKey& key, const MapFetchCancelToken&, MapImageHandle& hImageOut)
+                {
+                    Clock::time_point start = Clock::now();
+
+                    hImageOut = FetchMap(key, FetchMode::REVALIDATE, m_context, m_phase);
+
+                    m_phase.latencyUs.Record(MapMetrics::MicrosecondsBetween(start, Clock::now()));
+
+                    return (bool)hImageOut;
+                },
+                [this](MapFetchCompletion<MapImageHandle>&& completion)
+                {
+                    m_context.table.EndRevalidation(completion.key);
+
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_nRevalidated++;
+                    m_cv.notify_one();
+                },
+                nWorkers)
+        {
+        }
+
+        // key must have been claimed with BeginRevalidation or TakeDue
+        void Submit(const MapRequestKey& key)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_nQueued++;
+            }
+
+            m_queue.Submit(key);
+        }
+
+        void Wait()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this] { return m_nRevalidated == m_nQueued; });
+        }
+
+    private:
+        Context&                        m_context;
+        Phase&                          m_phase;
+        std::mutex                      m_mutex;
+        std::condition_variable         m_cv;
+        size_t                          m_nQueued;
+        size_t                          m_nRevalidated;
+        MapFetchQueue<MapImageHandle>   m_queue;    // last, so it stops before the rest go
+    };
+
+    // show every key from the cache, as SelectLocation does, with the maps
+    // that are no longer fresh revalidated in the background.  The
+    // latency is how long each took to show.
+    void RunStalePhase(const std::vector<MapRequestKey>& keys, unsigned nBackgroundWorkers,
+        Context& context, Phase& phase, Phase& background)
+    {
+        Clock::time_point start = Clock::now();
+
+        {
+            BackgroundRevalidator revalidator(context, background, nBackgroundWorkers);
+
+            for (const MapRequestKey& key : keys)
+            {
+                Clock::time_point mapStart = Clock::now();
+
+                MapFreshness freshness = context.table.Classify(key, MapRevalidationNow());
+                MapImageHandle hImage = context.cache.Decoded().Find(key);
+
+                if (!hImage || MapFreshness::EXPIRED == freshness)
+                {
+                    // nothing to show yet, so wait for it
+                    FetchMap(key, FetchMode::REVALIDATE, context, phase);
+                }
+                else if (MapFreshness::STALE == freshness && context.table.BeginRevalidation(key))
+                {
+                    revalidator.Submit(key);
+                }
+
+                phase.nRequests.fetch_add(1, std::memory_order_relaxed);
+                phase.latencyUs.Record(MapMetrics::MicrosecondsBetween(mapStart, Clock::now()));
+            }
+
+            revalidator.Wait();
+        }
+
+        phase.fSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+        background.fSeconds = phase.fSeconds;
+    }
+
+    // one sweep of the background schedule, as the program's timer makes,
+    // taking every map that is due
+    void RunSweepPhase(size_t nMaps, unsigned nBackgroundWorkers, Context& context, Phase& phase)
+    {
+        Clock::time_point start = Clock::now();
+
+        {
+            BackgroundRevalidator revalidator(context, phase, nBackgroundWorkers);
+
+            for (const MapRequestKey& key : context.table.TakeDue(MapRevalidationNow(), nMaps))
+            {
+                revalidator.Submit(key);
+            }
+
+            revalidator.Wait();
+        }
+
+        phase.fSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    void PrintPhase(const Phase& phase)
+    {
+        MetricHistogram::Snapshot latency = phase.latencyUs.TakeSnapshot();
+        MetricHistogram::Snapshot decode = phase.decodeUs.TakeSnapshot();
+
+        printf("%-11s %8llu %8llu %8llu %10.2f %8llu %9.1f %9.3f %9.3f %9.3f %7.2f\n", phase.pszName,
+            (unsigned long long)phase.nRequests.load(), (unsigned long long)phase.nFailed.load(),
+            (unsigned long long)phase.nNotModified.load(), phase.nBytes.load() / 1e6,
+            (unsigned long long)phase.nDecodes.load(), decode.Mean() * decode.nCount / 1000.0,
+            latency.Mean() / 1000.0, latency.ValueAtPercentile(50) / 1000.0,
+            latency.ValueAtPercentile(99) / 1000.0, phase.fSeconds);
+    }
+
+    void PrintUsage()
+    {
+        printf(
+            "usage: MapRevalidate [options]\n"
+            "  --maps N                how many different maps and tiles (default 500)\n"
+            "  --workers N             fetching threads (default 8)\n"
+            "  --background N          threads revalidating stale maps (default 2)\n"
+            "  --port N                use the MockMapServer on 127.0.0.1:N instead of starting one\n"
+            "  --fixtures DIR          the recorded JPEGs (default %s)\n"
+            "  --disk DIR              keep the maps in a disk cache in DIR too, and revalidate from it\n"
+            "the server started in process takes these too:\n"
+            "%s",
+            MAPBENCH_FIXTURES_DIR, kFaultOptionsUsage);
+    }
+
+    bool ParseOptions(int argc, char** argv, Options& options)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            std::string strArg = argv[i];
+            bool bHasValue = i + 1 < argc;
+
+            if ("--maps" == strArg && bHasValue)
+            {
+                options.nMaps = std::max(1u, (unsigned)strtoul(argv[++i], nullptr, 10));
+            }
+            else if ("--workers" == strArg && bHasValue)
+            {
+                options.nWorkers = std::max(1u, (unsigned)strtoul(argv[++i], nullptr, 10));
+            }
+            else if ("--background" == strArg && bHasValue)
+            {
+                options.nBackgroundWorkers = std::max(1u, (unsigned)strtoul(argv[++i], nullptr, 10));
+            }
+            else if ("--port" == strArg && bHasValue)
+            {
+                options.nPort = (uint16_t)atoi(argv[++i]);
+            }
+            else if ("--fixtures" == strArg && bHasValue)
+            {
+                options.strFixtures = argv[++i];
+            }
+            else if ("--disk" == strArg && bHasValue)
+            {
+                options.strDisk = argv[++i];
+            }
+            else if (!ParseFaultOption(argc, argv, i, options.faults))
+            {
+                PrintUsage();
+                return false;
+            }
+        }
+
+        return true;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+
+    if (!ParseOptions(argc, argv, options))
+    {
+        return 2;
+    }
+
+    std::unique_ptr<MockMapServer> pServer;
+    uint16_t nPort = options.nPort;
+
+    if (0 == nPort)
+    {
+        pServer.reset(new MockMapServer());
+
+        if (!pServer->LoadFixtures(options.strFixtures))
+        {
+            fprintf(stderr, "MapRevalidate: no static maps or tiles in %s\n", options.strFixtures.c_str());
+            return 2;
+        }
+
+        // every map is stale as soon as it arrives
+        pServer->SetFaults(options.faults);
+        pServer->SetMaxAge(0);
+
+        if (!pServer->Start())
+        {
+            fprintf(stderr, "MapRevalidate: could not start the mock map server\n");
+            return 2;
+        }
+
+        nPort = pServer->Port();
+    }
+
+    std::mt19937 random(options.faults.nSeed);
+    std::vector<MapRequestKey> keys = MakeKeys(options.nMaps, random);
+
+    // room for every map, decoded and not, so that a 304 always finds the
+    // map it says is still right
+    MapTieredCache cache(4096ULL * 1024 * 1024, 1024ULL * 1024 * 1024);
+    std::unique_ptr<ImageDecoder> pCacheDecoder = CreateJpegDecoder();
+    std::mutex decoderMutex;
+
+    cache.SetDecoder([&](const uint8_t* pData, size_t nSize, MapImageHandle& hImageOut)
+    {
+        std::lock_guard<std::mutex> lock(decoderMutex);
+        return DecodeToMapImage(*pCacheDecoder, pData, nSize, hImageOut);
+    });
+
+    MapRevalidationTable table;
+    Context context{ L"http://127.0.0.1:" + std::to_wstring(nPort), nPort, cache, table };
+
+    std::unique_ptr<DiskMapCache> pDiskCache;
+
+    if (!options.strDisk.empty())
+    {
+        pDiskCache.reset(new DiskMapCache(options.strDisk));
+
+        if (!pDiskCache->Open())
+        {
+            fprintf(stderr, "MapRevalidate: could not open the disk cache in %s\n", options.strDisk.c_str());
+            return 2;
+        }
+
+        context.pDiskCache = pDiskCache.get();
+    }
+
+    printf("MapRevalidate: %zu maps and tiles, %u workers, from %s\n", keys.size(), options.nWorkers,
+        WideToUtf8(context.strBaseUrl).c_str());
+
+    Phase download("download");
+    Phase reload("reload");
+    Phase revalidate("revalidate");
+    Phase stale("stale");
+    Phase background("background");
+    Phase sweep("sweep");
+
+    RunPhase(keys, FetchMode::DOWNLOAD, options.nWorkers, context, download);
+    RunPhase(keys, FetchMode::DOWNLOAD, options.nWorkers, context, reload);
+
+    // start again from what is on disk, as the next run of the program would
+    if (pDiskCache)
+    {
+        size_t nFromDisk = 0;
+
+        table.Clear();
+
+        for (const MapRequestKey& key : keys)
+        {
+            MapCacheView cachedMap;
+
+            if (pDiskCache->Lookup(key, cachedMap) && cachedMap.validators.CanRevalidate())
+            {
+                table.Set(key, cachedMap.validators);
+                nFromDisk++;
+            }
+        }
+
+        printf("%zu of %zu maps' validators read back from %s\n", nFromDisk, keys.size(), options.strDisk.c_str());
+    }
+
+    MapRevalidationTable::Stats before = table.GetStats();
+
+    RunPhase(keys, FetchMode::REVALIDATE, options.nWorkers, context, revalidate);
+
+    MapRevalidationTable::Stats after = table.GetStats();
+
+    RunStalePhase(keys, options.nBackgroundWorkers, context, stale, background);
+    RunSweepPhase(keys.size(), options.nBackgroundWorkers, context, sweep);
+
+    printf("\n%-11s %8s %8s %8s %10s %8s %9s %9s %9s %9s %7s\n", "phase", "requests", "failed", "304s",
+        "MB", "decodes", "decode ms", "mean ms", "p50 ms", "p99 ms", "s");
+    PrintPhase(download);
+    PrintPhase(reload);
+    PrintPhase(revalidate);
+    PrintPhase(stale);
+    PrintPhase(background);
+    PrintPhase(sweep);
+
+    printf("\nrevalidating instead of reloading: %.1f of %.1f MB not downloaded, %llu of %llu decodes saved\n",
+        (after.nBytesSaved - before.nBytesSaved) / 1e6, reload.nBytes.load() / 1e6,
+        (unsigned long long)(after.nDecodesSaved - before.nDecodesSaved),
+        (unsigned long long)reload.nDecodes.load());
+    printf("%s", table.FormatStats().c_str());
+
+    if (pServer)
+    {
+        pServer->Stop();
+
+        LocalHttpServer::Stats stats = pServer->GetStats();
+
+        printf("server: %llu requests, %llu conditional, %llu not modified, %.1f MB sent\n",
+            (unsigned long long)stats.nRequests, (unsigned long long)stats.nConditional,
+            (unsigned long long)stats.nNotModified, stats.nBodyBytes / 1e6);
+    }
+
+    // with nothing changing, every conditional request is a 304 and
+    // nothing is decoded again
+    bool bFaults = options.faults.fErrorRate > 0 || options.faults.fTruncateRate > 0 || options.faults.fChangeRate > 0;
+
+    if (!bFaults && (revalidate.nNotModified.load() != keys.size() || revalidate.nDecodes.load() != 0 ||
+        background.nNotModified.load() != background.nRequests.load() ||
+        sweep.nNotModified.load() != keys.size()))
+    {
+        fprintf(stderr, "MapRevalidate: %llu of %zu conditional requests weren't 304s, %llu maps were decoded again\n",
+            (unsigned long long)(keys.size() - revalidate.nNotModified.load()), keys.size(),
+            (unsigned long long)revalidate.nDecodes.load());
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,411 @@
+// MapSchedulerBench.cpp : Measures how long each priority of job waits
+// for a MapScheduler thread when there are more jobs than threads.
+//
+// A submitting thread offers jobs faster than the workers can run them,
+// --load times what they can manage, in a mix of the four priorities.
+// Each job stands in for a download: it sleeps for --job-us, as a fetch
+// waits on the network.  The same jobs are run twice:
+//
+//      fifo        every job at the same priority, first come first
+//                  served, as separate queues with their own threads
+//                  were to each other
+//      priority    every job at its own priority
+//
+// and for each priority the time from submitting a job to its start is
+// reported.  In the priority run the jobs the user is waiting for should
+// wait about as long as a job takes, however far behind the prefetches
+// and revalidations fall.
+//
+// A third run moves and cancels queued jobs, as the program does when
+// the user selects a map that is still waiting to be prefetched, or moves
+// on from one: near-visible and prefetch jobs are submitted, and soon
+// after, half of the prefetches are moved to visible and a quarter
+// cancelled.  A moved job's wait is counted from when it was submitted.
+// The run checks that no cancelled job ran, and every job either ran or
+// was cancelled, exactly once.
+//
+// Revalidation is limited to one running job, as in the program, and the
+// priority run fails if more ever ran at once.  Run with --help for the options.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "MapMetrics.h"
+#include "MapScheduler.h"
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    struct Options
+    {
+        unsigned    nWorkers = 8;
+        unsigned    nJobs = 20000;
+        unsigned    nJobUs = 200;               // how long each job takes
+        double      fLoad = 1.25;               // jobs offered, over what the workers can run
+        unsigned    mix[kMapPriorityCount] = { 10, 20, 50, 20 };    // percent of each priority
+        uint32_t    nSeed = 1;
+    };
+
+    // what one job needs to report itself
+    struct JobRecord
+    {
+        Clock::time_point   submittedAt;
+        std::atomic<MapPriority> priority{ MapPriority::VISIBLE };  // what it is, whatever it was submitted at
+        std::atomic<int>    nRuns{ 0 };
+        std::atomic<int>    nCancels{ 0 };
+    };
+
+    // how one run went
+    struct Run
+    {
+        const char*             pszName;
+        MetricHistogram         queuedUs[kMapPriorityCount];    // by what each job is
+        std::atomic<unsigned>   nRevalidating{ 0 };
+        std::atomic<unsigned>   nMaxRevalidating{ 0 };
+        double                  fSeconds = 0;
+        MapScheduler::Stats     stats;
+
+        explicit Run(const char* pszRunName) : pszName(pszRunName) {}
+    };
+
+    // the priority of each job, drawn from the mix
+    std::vector<MapPriority> MakePriorities(const Options& options)
+    {
+        std::mt19937 random(options.nSeed);
+        unsigned nTotal = 0;
+
+        for (unsigned nPercent : options.mix)
+        {
+            nTotal += nPercent;
+        }
+
+        std::uniform_int_distribution<unsigned> pick(0, std::max(1u, nTotal) - 1);
+        std::vector<MapPriority> priorities;
+
+        for (unsigned i = 0; i < options.nJobs; i++)
+        {
+            unsigned nPick = pick(random);
+            size_t nPriority = 0;
+
+            while (nPriority + 1 < kMapPriorityCount && nPick >= options.mix[nPriority])
+            {
+                nPick -= options.mix[nPriority];
+                nPriority++;
+            }
+
+            priorities.push_back((MapPriority)nPriority);
+        }
+
+        return priorities;
+    }
+
+    // the job: note the wait, and take as long as a download
+    MapScheduler::Job MakeJob(JobRecord& record, Run& run, unsigned nJobUs)
+    {
+        return [&record, &run, nJobUs](uint64_t, const MapFetchCancelToken&)
+        {
+            MapPriority priority = record.priority.load();
+
+            run.queuedUs[(size_t)priority].Record(MapMetrics::MicrosecondsBetween(record.submittedAt, Clock::now()));
+
+            record.nRuns.fetch_add(1, std::memory_order_relaxed);
+
+            bool bRevalidation = MapPriority::REVALIDATE == priority;
+
+            if (bRevalidation)
+            {
+                unsigned nRunning = run.nRevalidating.fetch_add(1) + 1;
+                unsigned nMax = run.nMaxRevalidating.load();
+
+                while (nRunning > nMax && !run.nMaxRevalidating.compare_exchange_weak(nMax, nRunning))
+                {
+                }
+            }
+
+            std::this_thread::sleep_for(std::chrono::microseconds(nJobUs));
+
+            if (bRevalidation)
+            {
+                run.nRevalidating.fetch_sub(1);
+            }
+        };
+    }
+
+    // sleep until the time the next job is offered
+    void Pace(Clock::time_point start, unsigned nJob, double fJobsPerSecond)
+    {
+        std::this_thread::sleep_until(start + std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(nJob / fJobsPerSecond)));
+    }
+
+    MapScheduler* CreateScheduler(const Options& options)
+    {
+        MapScheduler* pScheduler = new MapScheduler(options.nWorkers);
+
+        pScheduler->SetMaxRunning(MapPriority::REVALIDATE, 1);
+
+        return pScheduler;
+    }
+
+    // offer every job, at its own priority or all at one, and wait for
+    // them all to run
+    void RunJobs(const Options& options, const std::vector<MapPriority>& priorities, bool bPriorities, Run& run)
+    {
+        std::unique_ptr<MapScheduler> pScheduler(CreateScheduler(options));
+        std::vector<JobRecord> records(priorities.size());
+        double fJobsPerSecond = options.fLoad * options.nWorkers * 1e6 / std::max(1u, options.nJobUs);
+
+        Clock::time_point start = Clock::now();
+
+        for (size_t i = 0; i < priorities.size(); i++)
+        {
+            Pace(start, (unsigned)i, fJobsPerSecond);
+
+            records[i].priority = priorities[i];
+            records[i].submittedAt = Clock::now();
+
+            pScheduler->Submit(bPriorities ? priorities[i] : MapPriority::VISIBLE,
+                MakeJob(records[i], run, options.nJobUs));
+        }
+
+        while (pScheduler->QueuedCount() > 0)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        pScheduler->Shutdown();
+
+        run.fSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+        run.stats = pScheduler->GetStats();
+    }
+
+    // prefetches moved and cancelled while queued.  Returns false if a job ran when it shouldn't have,
+    // or didn't when it should.
+    bool RunMoves(const Options& options, Run& run)
+    {
+        std::unique_ptr<MapScheduler> pScheduler(CreateScheduler(options));
+        std::vector<JobRecord> records(options.nJobs);
+        std::vector<uint64_t> jobIds(options.nJobs, 0);
+        std::vector<bool> cancelled(options.nJobs, false);
+        double fJobsPerSecond = options.fLoad * options.nWorkers * 1e6 / std::max(1u, options.nJobUs);
+        std::mt19937 random(options.nSeed);
+
+        Clock::time_point start = Clock::now();
+
+        // every fourth job is a tile just off screen, the rest prefetches
+        for (unsigned i = 0; i < options.nJobs; i++)
+        {
+            Pace(start, i, fJobsPerSecond);
+
+            bool bNear = (0 == i % 4);
+
+            records[i].priority = bNear ? MapPriority::NEAR_VISIBLE : MapPriority::PREFETCH;
+            records[i].submittedAt = Clock::now();
+
+            JobRecord& record = records[i];
+
+            jobIds[i] = pScheduler->Submit(record.priority.load(), MakeJob(record, run, options.nJobUs),
+                [&record](uint64_t) { record.nCancels.fetch_add(1, std::memory_order_relaxed); });
+
+            // a few jobs later, the user has selected a map being
+            // prefetched, or has moved on from it
+            if (i >= 32 && 0 == (i - 32) % 4)
+            {
+                unsigned nEarlier = i - 31;
+
+                switch (random() % 4)
+                {
+                case 0:
+                case 1:
+                    if (pScheduler->Reprioritize(jobIds[nEarlier], MapPriority::VISIBLE))
+                    {
+                        records[nEarlier].priority = MapPriority::VISIBLE;
+                    }
+                    break;
+
+                case 2:
+                    cancelled[nEarlier] = pScheduler->Cancel(jobIds[nEarlier]);
+                    break;
+                }
+            }
+        }
+
+        while (pScheduler->QueuedCount() > 0)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        pScheduler->Shutdown();
+
+        run.fSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+        run.stats = pScheduler->GetStats();
+
+        // a job cancelled while it ran has run once and been cancelled
+        // never; one cancelled while queued the other way round
+        unsigned nWrong = 0;
+
+        for (unsigned i = 0; i < options.nJobs; i++)
+        {
+            int nRuns = records[i].nRuns.load();
+            int nCancels = records[i].nCancels.load();
+
+            if (nRuns + nCancels != 1 || (nCancels > 0 && !cancelled[i]))
+            {
+                nWrong++;
+            }
+        }
+
+        if (nWrong > 0)
+        {
+            fprintf(stderr, "MapSchedulerBench: %u jobs ran or were cancelled other than once\n", nWrong);
+            return false;
+        }
+
+        return true;
+    }
+
+    void PrintRun(const Run& run)
+    {
+        for (size_t i = 0; i < kMapPriorityCount; i++)
+        {
+            MetricHistogram::Snapshot queued = run.queuedUs[i].TakeSnapshot();
+            const MapScheduler::ClassStats& stats = run.stats.classes[i];
+
+            if (0 == queued.nCount && 0 == stats.nSubmitted && 0 == stats.nMovedIn)
+            {
+                continue;
+            }
+
+            printf("%-9s %-13s %7llu %7llu %7llu %7llu %7llu %10.2f %10.2f %10.2f %10.2f %7.2f\n", run.pszName,
+                MapPriorityName((MapPriority)i), (unsigned long long)queued.nCount,
+                (unsigned long long)stats.nMovedIn, (unsigned long long)stats.nCancelled,
+                (unsigned long long)stats.nStolen, (unsigned long long)stats.nStarted,
+                queued.Mean() / 1000.0, queued.ValueAtPercentile(50) / 1000.0,
+                queued.ValueAtPercentile(99) / 1000.0, queued.nMax / 1000.0, run.fSeconds);
+        }
+    }
+
+    void PrintUsage()
+    {
+        printf(
+            "usage: MapSchedulerBench [options]\n"
+            "  --workers N             scheduler threads (default 8)\n"
+            "  --jobs N                jobs in each run (default 20000)\n"
+            "  --job-us US             how long each job takes, in microseconds (default 200)\n"
+            "  --load X                jobs offered, over what the workers can run (default 1.25)\n"
+            "  --mix V,N,P,R           percent of visible, near-visible, prefetch and revalidate\n"
+            "                          jobs (default 10,20,50,20)\n"
+            "  --seed N                for the mix and the moves (default 1)\n");
+    }
+
+    bool ParseOptions(int argc, char** argv, Options& options)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            std::string strArg = argv[i];
+            bool bHasValue = i + 1 < argc;
+
+            if ("--workers" == strArg && bHasValue)
+            {
+                options.nWorkers = std::max(1u, (unsigned)strtoul(argv[++i], nullptr, 10));
+            }
+            else if ("--jobs" == strArg && bHasValue)
+            {
+                options.nJobs = std::max(64u, (unsigned)strtoul(argv[++i], nullptr, 10));
+            }
+            else if ("--job-us" == strArg && bHasValue)
+            {
+                options.nJobUs = std::max(1u, (unsigned)strtoul(argv[++i], nullptr, 10));
+            }
+            else if ("--load" == strArg && bHasValue)
+            {
+                options.fLoad = std::max(0.01, atof(argv[++i]));
+            }
+            else if ("--mix" == strArg && bHasValue &&
+                4 == sscanf(argv[++i], "%u,%u,%u,%u", &options.mix[0], &options.mix[1], &options.mix[2], &options.mix[3]))
+            {
+            }
+            else if ("--seed" == strArg && bHasValue)
+            {
+                options.nSeed = (uint32_t)strtoul(argv[++i], nullptr, 10);
+            }
+            else
+            {
+                PrintUsage();
+                return false;
+            }
+        }
+
+        return true;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+
+    if (!ParseOptions(argc, argv, options))
+    {
+        return 2;
+    }
+
+    printf("MapSchedulerBench: %u jobs of %u us on %u workers, offered at %.2f times what they can run\n\n",
+        options.nJobs, options.nJobUs, options.nWorkers, options.fLoad);
+
+    std::vector<MapPriority> priorities = MakePriorities(options);
+
+    Run fifo("fifo");
+    Run priority("priority");
+    Run moves("moves");
+
+    RunJobs(options, priorities, false, fifo);
+    RunJobs(options, priorities, true, priority);
+
+    bool bMovesRight = RunMoves(options, moves);
+
+    printf("%-9s %-13s %7s %7s %7s %7s %7s %10s %10s %10s %10s %7s\n", "run", "priority", "jobs", "moved",
+        "cancel", "stolen", "started", "mean ms", "p50 ms", "p99 ms", "max ms", "s");
+    PrintRun(fifo);
+    PrintRun(priority);
+    PrintRun(moves);
+
+    // what is on screen should wait about a job, not behind the backlog
+    uint64_t nFifoVisibleUs = fifo.queuedUs[(size_t)MapPriority::VISIBLE].TakeSnapshot().ValueAtPercentile(99);
+    uint64_t nVisibleUs = priority.queuedUs[(size_t)MapPriority::VISIBLE].TakeSnapshot().ValueAtPercentile(99);
+    uint64_t nPrefetchUs = priority.queuedUs[(size_t)MapPriority::PREFETCH].TakeSnapshot().ValueAtPercentile(99);
+
+    printf("\nvisible p99 queued %.2f ms with priorities, %.2f ms without; prefetch p99 %.2f ms\n",
+        nVisibleUs / 1000.0, nFifoVisibleUs / 1000.0, nPrefetchUs / 1000.0);
+
+    // the fifo run submits revalidation as visible, so it isn't limited there
+    unsigned nMaxRevalidating = priority.nMaxRevalidating.load();
+
+    if (nMaxRevalidating > 1)
+    {
+        fprintf(stderr, "MapSchedulerBench: %u revalidations ran at once, over the limit of 1\n", nMaxRevalidating);
+        return 1;
+    }
+
+    if (!bMovesRight)
+    {
+        return 1;
+    }
+
+    // only under saturation does priority have anything to reorder
+    if (options.fLoad > 1.0 && options.mix[(size_t)MapPriority::VISIBLE] > 0 &&
+        options.mix[(size_t)MapPriority::PREFETCH] > 0 && (nVisibleUs >= nFifoVisibleUs || nVisibleUs >= nPrefetchUs))
+    {
+        fprintf(stderr, "MapSchedulerBench: visible jobs didn't go ahead of the rest\n");
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,850 @@
+// MapSharedCacheBench.cpp : Runs a MapSharedCache across several processes.
+//
+// Every process this starts is this program again, with a --role, so each
+// has its own address space and opens the segment by name as another
+// instance of GraphicsTestWin32 would.  It runs:
+//
+//      first       one instance gets a set of maps and tiles from a
+//                  MockMapServer, decoding each, and puts them in the
+//                  shared cache
+//      second      another instance gets the same maps.  Each should come
+//                  from the shared cache, with no request and no decode.
+//      verify      a third gets them from the shared cache and from the
+//                  server too, and checks the pixels are the same
+//      stress      writers insert made-up maps as fast as they can, more
+//                  than the segment holds, while readers look them up and
+//                  check every pixel of every map they find, so a read that
+//                  was torn by a writer and not caught would show
+//      crash       a writer is killed with SIGKILL while inserting, and
+//                  another writer, with readers checking, must carry on
+//
+// The run fails if the second instance made a request or decoded a map
+// the first had put in the cache, if any map read back differs from what
+// was put in, or if the writers stop being able to insert.
+//
+// Run with --help for the options.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "ImageDecoder.h"
+#include "JpegDecoder.h"
+#include "LocalHttpClient.h"
+#include "MapMetrics.h"
+#include "MapRequestArena.h"
+#include "MapRevalidation.h"
+#include "MapSharedCache.h"
+#include "MapUrl.h"
+#include "MockMapServer.h"
+#include "StreamingBuffer.h"
+#include "TileSystem.h"
+
+#ifndef MAPBENCH_FIXTURES_DIR
+#define MAPBENCH_FIXTURES_DIR "Fixtures"
+#endif
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    // the level of the random tiles, as in MapLoadTest
+    const int kTileLevel = 14;
+
+    // one map in this many is a static map, the rest are tiles
+    const unsigned kStaticMapEvery = 10;
+
+    const wchar_t* const kImagerySets[] = { L"AerialWithLabels", L"Aerial", L"Road" };
+
+    const wchar_t* const kPlaces[] = { L"Seattle", L"San Francisco", L"Portland", L"Vancouver",
+        L"Los Angeles", L"Denver", L"Chicago", L"New York" };
+
+    // the made-up maps of the stress run are tiles of this size
+    const int kStressMapSize = 256;
+
+    struct Options
+    {
+        std::string     strRole;                    // empty for the process that runs the rest
+        std::string     strFixtures = MAPBENCH_FIXTURES_DIR;
+        std::string     strName;                    // the segment
+        unsigned        nMaps = 100;
+        unsigned        nStressMaps = 512;
+        unsigned        nReaders = 4;
+        unsigned        nWriters = 2;
+        double          fSeconds = 2.0;
+        size_t          nSegmentMB = 64;
+        uint16_t        nPort = 0;
+        unsigned        nSeed = 1;
+        bool            bVerify = false;
+        std::string     strSelf;                    // argv[0]
+    };
+
+    // what a child process printed, its RESULT line as names and values
+    typedef std::map<std::string, double> ChildResult;
+
+    // a child process and the pipe its standard output comes down
+    struct Child
+    {
+        pid_t   pid = -1;
+        FILE*   pOutput = nullptr;
+    };
+
+    // the distinct maps, as MapLoadTest makes them
+    std::vector<MapRequestKey> MakeKeys(unsigned nMaps, unsigned nSeed)
+    {
+        std::mt19937 random(nSeed);
+        std::uniform_int_distribution<int> tileXY(0, (1 << kTileLevel) - 1);
+        std::unordered_set<std::string> quadKeys;
+        std::vector<MapRequestKey> keys;
+
+        for (unsigned i = 0; keys.size() < nMaps; i++)
+        {
+            const wchar_t* pszImagerySet = kImagerySets[i % (sizeof(kImagerySets) / sizeof(kImagerySets[0]))];
+
+            if (0 == i % kStaticMapEvery)
+            {
+                const wchar_t* pszPlace = kPlaces[(i / kStaticMapEvery) % (sizeof(kPlaces) / sizeof(kPlaces[0]))];
+                keys.emplace_back(pszImagerySet, pszPlace, 800 + (int)(i / kStaticMapEvery), 500);
+            }
+            else
+            {
+                std::string quadKey = TileSystem::TileXYToQuadKey(tileXY(random), tileXY(random), kTileLevel);
+
+                if (quadKeys.insert(quadKey).second)
+                {
+                    keys.push_back(MapRequestKey::ForTile(pszImagerySet, quadKey));
+                }
+            }
+        }
+
+        return keys;
+    }
+
+    // the path part of one of BuildMapUrl's URLs, which are ASCII but for
+    // the spaces in place names
+    std::pmr::string PathOfUrl(const std::pmr::wstring& strUrl, std::pmr::memory_resource* pResource)
+    {
+        size_t nScheme = strUrl.find(L"://");
+        size_t nPath = strUrl.find(L'/', (nScheme == std::wstring::npos) ? 0 : nScheme + 3);
+
+        std::pmr::string strPath(pResource);
+
+        if (nPath == std::wstring::npos)
+        {
+            strPath = "/";
+        }
+        else
+        {
+            for (size_t i = nPath; i < strUrl.size(); i++)
+            {
+                if (L' ' == strUrl[i])
+                {
+                    strPath += "%20";
+                }
+                else
+                {
+                    strPath += (char)strUrl[i];
+                }
+            }
+        }
+
+        return strPath;
+    }
+
+    // download and decode one map, as GetBingMap does when no cache has it
+    MapImageHandle DownloadMap(const MapRequestKey& key, uint16_t nPort, LocalHttpClient& client,
+        ImageDecoder& decoder, MapValidators& validatorsOut)
+    {
+        MapRequestArena arena;
+        std::pmr::wstring strUrl(arena.Resource());
+        StreamingBuffer body(arena.Resource());
+        std::pmr::string strHeaders(arena.Resource());
+        MapImageHandle hImage;
+
+        if (!BuildMapUrl(key, L"http://127.0.0.1:" + std::to_wstring(nPort), L"MapSharedCacheKey", strUrl))
+        {
+            return hImage;
+        }
+
+        int nStatus = client.Get(nPort, PathOfUrl(strUrl, arena.Resource()), body, nullptr, arena.Resource(),
+            std::string(), &strHeaders);
+
+        if (200 != nStatus || !DecodeToMapImage(decoder, body.Data(), body.Size(), hImage))
+        {
+            return MapImageHandle();
+        }
+
+        validatorsOut = ParseMapValidators(strHeaders, MapRevalidationPolicy(), MapRevalidationNow());
+
+        return hImage;
+    }
+
+    bool SameMap(const MapImage& a, const MapImage& b)
+    {
+        if (a.Width() != b.Width() || a.Height() != b.Height())
+        {
+            return false;
+        }
+
+        for (int y = 0; y < a.Height(); y++)
+        {
+            if (0 != memcmp(a.Row(y), b.Row(y), (size_t)a.Width() * 4))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    void PrintResult(const std::vector<std::pair<const char*, double>>& values)
+    {
+        printf("RESULT");
+
+        for (const auto& value : values)
+        {
+            printf(" %s=%.6g", value.first, value.second);
+        }
+
+        printf("\n");
+        fflush(stdout);
+    }
+
+    // --role instance: get every map as the program would with a shared
+    // cache, from it if it's there, otherwise from the server, decoded and
+    // put in it.  With --verify, maps found in the cache are downloaded
+    // and decoded too, and compared.
+    int RunInstance(const Options& options)
+    {
+        MapSharedCache cache;
+
+        if (!cache.Open(options.strName, options.nSegmentMB * 1024 * 1024))
+        {
+            fprintf(stderr, "MapSharedCacheBench: could not open the shared cache %s\n", options.strName.c_str());
+            return 2;
+        }
+
+        std::vector<MapRequestKey> keys = MakeKeys(options.nMaps, options.nSeed);
+        LocalHttpClient client;
+        std::unique_ptr<ImageDecoder> pDecoder = CreateJpegDecoder();
+        MetricHistogram latencyUs;
+        uint64_t nRequests = 0;
+        uint64_t nDecodes = 0;
+        uint64_t nFailed = 0;
+        uint64_t nMismatched = 0;
+
+        Clock::time_point start = Clock::now();
+
+        for (const MapRequestKey& key : keys)
+        {
+            Clock::time_point mapStart = Clock::now();
+
+            MapValidators validators;
+            MapImageHandle hImage = cache.Find(key, &validators);
+
+            if (!hImage)
+            {
+                hImage = DownloadMap(key, options.nPort, client, *pDecoder, validators);
+                nRequests++;
+
+                if (!hImage)
+                {
+                    nFailed++;
+                    continue;
+                }
+
+                nDecodes++;
+                cache.Insert(key, *hImage, &validators);
+            }
+
+            latencyUs.Record(MapMetrics::MicrosecondsBetween(mapStart, Clock::now()));
+
+            if (options.bVerify)
+            {
+                MapValidators downloadedValidators;
+                MapImageHandle hDownloaded = DownloadMap(key, options.nPort, client, *pDecoder, downloadedValidators);
+
+                if (!hDownloaded || !SameMap(*hImage, *hDownloaded) ||
+                    validators.strETag != downloadedValidators.strETag)
+                {
+                    nMismatched++;
+                }
+            }
+        }
+
+        double fSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+        MetricHistogram::Snapshot latency = latencyUs.TakeSnapshot();
+        MapSharedCache::Stats stats = cache.GetStats();
+
+        PrintResult({ { "maps", (double)keys.size() }, { "hits", (double)stats.nHits },
+            { "misses", (double)stats.nMisses }, { "requests", (double)nRequests }, { "decodes", (double)nDecodes },
+            { "failed", (double)nFailed }, { "mismatched", (double)nMismatched },
+            { "inserts", (double)stats.nInserts }, { "skipped", (double)stats.nInsertsSkipped },
+            { "evictions", (double)stats.nEvictions }, { "retries", (double)stats.nRetries },
+            { "mean_us", latency.Mean() }, { "p50_us", (double)latency.ValueAtPercentile(50) },
+            { "p99_us", (double)latency.ValueAtPercentile(99) }, { "seconds", fSeconds } });
+
+        return 0;
+    }
+
+    // the made-up stress maps.  Every pixel is a function of the map, the
+    // version of it and where the pixel is, and the first two say which
+    // map and version they are, so a reader can check every pixel of what
+    // it read against what should be there.
+    uint32_t StressPixel(uint32_t nMap, uint32_t nVersion, uint32_t nPixel)
+    {
+        return (nMap * 0x9E3779B1u) ^ (nVersion * 0x85EBCA77u) ^ (nPixel * 0xC2B2AE3Du);
+    }
+
+    MapRequestKey StressKey(uint32_t nMap)
+    {
+        return MapRequestKey::ForTile(L"Aerial", TileSystem::TileXYToQuadKey((int)nMap, 0, kTileLevel));
+    }
+
+    void FillStressMap(MapImage& image, uint32_t nMap, uint32_t nVersion)
+    {
+        uint32_t* pPixels = reinterpret_cast<uint32_t*>(image.Pixels());
+        uint32_t nPixels = (uint32_t)(image.ByteSize() / 4);
+
+        pPixels[0] = nMap;
+        pPixels[1] = nVersion;
+
+        for (uint32_t i = 2; i < nPixels; i++)
+        {
+            pPixels[i] = StressPixel(nMap, nVersion, i);
+        }
+    }
+
+    bool CheckStressMap(const MapImage& image, uint32_t nMap)
+    {
+        const uint32_t* pPixels = reinterpret_cast<const uint32_t*>(image.Pixels());
+        uint32_t nPixels = (uint32_t)(image.ByteSize() / 4);
+
+        if (image.Width() != kStressMapSize || image.Height() != kStressMapSize || pPixels[0] != nMap)
+        {
+            return false;
+        }
+
+        uint32_t nVersion = pPixels[1];
+
+        for (uint32_t i = 2; i < nPixels; i++)
+        {
+            if (pPixels[i] != StressPixel(nMap, nVersion, i))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // --role writer: insert new versions of random stress maps until the time is up
+    int RunWriter(const Options& options)
+    {
+        MapSharedCache cache;
+
+        if (!cache.Open(options.strName, options.nSegmentMB * 1024 * 1024))
+        {
+            fprintf(stderr, "MapSharedCacheBench: could not open the shared cache %s\n", options.strName.c_str());
+            return 2;
+        }
+
+        std::mt19937 random(options.nSeed ^ (unsigned)getpid());
+        std::uniform_int_distribution<uint32_t> pickMap(0, options.nStressMaps - 1);
+        std::shared_ptr<MapImage> pImage = MapImage::Create(kStressMapSize, kStressMapSize);
+        MetricHistogram insertUs;
+        uint32_t nVersion = (uint32_t)getpid() << 12;
+
+        Clock::time_point tEnd = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(options.fSeconds));
+
+        while (Clock::now() < tEnd)
+        {
+            uint32_t nMap = pickMap(random);
+
+            FillStressMap(*pImage, nMap, ++nVersion);
+
+            Clock::time_point insertStart = Clock::now();
+
+            if (cache.Insert(StressKey(nMap), *pImage))
+            {
+                insertUs.Record(MapMetrics::MicrosecondsBetween(insertStart, Clock::now()));
+            }
+        }
+
+        MetricHistogram::Snapshot insert = insertUs.TakeSnapshot();
+        MapSharedCache::Stats stats = cache.GetStats();
+
+        PrintResult({ { "inserts", (double)stats.nInserts }, { "skipped", (double)stats.nInsertsSkipped },
+            { "evictions", (double)stats.nEvictions }, { "locks_taken", (double)stats.nLocksTaken },
+            { "insert_p50_us", (double)insert.ValueAtPercentile(50) },
+            { "insert_p99_us", (double)insert.ValueAtPercentile(99) } });
+
+        return 0;
+    }
+
+    // --role reader: look up random stress maps until the time is up, and
+    // check every one found
+    int RunReader(const Options& options)
+    {
+        MapSharedCache cache;
+
+        if (!cache.Open(options.strName, options.nSegmentMB * 1024 * 1024))
+        {
+            fprintf(stderr, "MapSharedCacheBench: could not open the shared cache %s\n", options.strName.c_str());
+            return 2;
+        }
+
+        std::mt19937 random(options.nSeed ^ (unsigned)getpid());
+        std::uniform_int_distribution<uint32_t> pickMap(0, options.nStressMaps - 1);
+        MetricHistogram findUs;
+        uint64_t nBad = 0;
+
+        Clock::time_point tEnd = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(options.fSeconds));
+
+        while (Clock::now() < tEnd)
+        {
+            uint32_t nMap = pickMap(random);
+
+            Clock::time_point findStart = Clock::now();
+
+            MapImageHandle hImage = cache.Find(StressKey(nMap));
+
+            if (hImage)
+            {
+                findUs.Record(MapMetrics::MicrosecondsBetween(findStart, Clock::now()));
+
+                if (!CheckStressMap(*hImage, nMap))
+                {
+                    nBad++;
+                }
+            }
+        }
+
+        MetricHistogram::Snapshot find = findUs.TakeSnapshot();
+        MapSharedCache::Stats stats = cache.GetStats();
+
+        PrintResult({ { "hits", (double)stats.nHits }, { "misses", (double)stats.nMisses },
+            { "retries", (double)stats.nRetries }, { "bad", (double)nBad },
+            { "find_p50_us", (double)find.ValueAtPercentile(50) },
+            { "find_p99_us", (double)find.ValueAtPercentile(99) } });
+
+        return 0;
+    }
+
+    // start this program again in another role, its output coming back down a pipe
+    Child StartChild(const Options& options, const std::string& strRole, const std::vector<std::string>& extraArgs)
+    {
+        std::vector<std::string> args = { options.strSelf, "--role", strRole, "--name", options.strName,
+            "--port", std::to_string(options.nPort), "--maps", std::to_string(options.nMaps),
+            "--stress-maps", std::to_string(options.nStressMaps), "--seconds", std::to_string(options.fSeconds),
+            "--segment-mb", std::to_string(options.nSegmentMB), "--seed", std::to_string(options.nSeed) };
+
+        args.insert(args.end(), extraArgs.begin(), extraArgs.end());
+
+        std::vector<char*> argv;
+
+        for (std::string& strArg : args)
+        {
+            argv.push_back(&strArg[0]);
+        }
+
+        argv.push_back(nullptr);
+
+        Child child;
+        int fds[2];
+
+        if (0 != pipe(fds))
+        {
+            return child;
+        }
+
+        fflush(stdout);
+
+        // the server's threads are running, so the child does nothing but exec
+        child.pid = fork();
+
+        if (0 == child.pid)
+        {
+            dup2(fds[1], STDOUT_FILENO);
+            close(fds[0]);
+            close(fds[1]);
+            execv(argv[0], argv.data());
+            _exit(127);
+        }
+
+        close(fds[1]);
+
+        if (child.pid < 0)
+        {
+            close(fds[0]);
+            return child;
+        }
+
+        child.pOutput = fdopen(fds[0], "r");
+
+        return child;
+    }
+
+    // wait for a child to exit and read its RESULT line.  Returns false if
+    // it failed or didn't print one.
+    bool FinishChild(Child& child, ChildResult& resultOut)
+    {
+        bool bResult = false;
+        char szLine[1024];
+
+        while (child.pOutput && fgets(szLine, sizeof(szLine), child.pOutput))
+        {
+            if (0 != strncmp(szLine, "RESULT ", 7))
+            {
+                continue;
+            }
+
+            resultOut.clear();
+
+            for (char* pszField = strtok(szLine + 7, " \n"); pszField; pszField = strtok(nullptr, " \n"))
+            {
+                char* pszEquals = strchr(pszField, '=');
+
+                if (pszEquals)
+                {
+                    *pszEquals = '\0';
+                    resultOut[pszField] = atof(pszEquals + 1);
+                }
+            }
+
+            bResult = true;
+        }
+
+        if (child.pOutput)
+        {
+            fclose(child.pOutput);
+            child.pOutput = nullptr;
+        }
+
+        int nStatus = 0;
+
+        if (child.pid > 0 && waitpid(child.pid, &nStatus, 0) == child.pid)
+        {
+            bResult = bResult && WIFEXITED(nStatus) && 0 == WEXITSTATUS(nStatus);
+        }
+
+        child.pid = -1;
+
+        return bResult;
+    }
+
+    bool RunChild(const Options& options, const std::string& strRole, const std::vector<std::string>& extraArgs,
+        ChildResult& resultOut)
+    {
+        Child child = StartChild(options, strRole, extraArgs);
+
+        return FinishChild(child, resultOut);
+    }
+
+    // run writers and readers together, and add up what they did
+    bool RunStress(const Options& options, unsigned nWriters, unsigned nReaders,
+        ChildResult& writersOut, ChildResult& readersOut)
+    {
+        std::vector<Child> writers;
+        std::vector<Child> readers;
+        bool bOk = true;
+
+        for (unsigned i = 0; i < nWriters; i++)
+        {
+            writers.push_back(StartChild(options, "writer", {}));
+        }
+
+        for (unsigned i = 0; i < nReaders; i++)
+        {
+            readers.push_back(StartChild(options, "reader", {}));
+        }
+
+        writersOut.clear();
+        readersOut.clear();
+
+        for (Child& writer : writers)
+        {
+            ChildResult result;
+
+            bOk = FinishChild(writer, result) && bOk;
+
+            for (const auto& value : result)
+            {
+                // the worst of the percentiles, the sum of the rest
+                double& fTotal = writersOut[value.first];
+                fTotal = (value.first.find("_us") != std::string::npos) ? std::max(fTotal, value.second) : fTotal + value.second;
+            }
+        }
+
+        for (Child& reader : readers)
+        {
+            ChildResult result;
+
+            bOk = FinishChild(reader, result) && bOk;
+
+            for (const auto& value : result)
+            {
+                double& fTotal = readersOut[value.first];
+                fTotal = (value.first.find("_us") != std::string::npos) ? std::max(fTotal, value.second) : fTotal + value.second;
+            }
+        }
+
+        return bOk;
+    }
+
+    uint64_t ServerRequests(const MockMapServer& server)
+    {
+        return server.GetStats().nRequests;
+    }
+
+    void PrintInstance(const char* pszName, ChildResult& result, uint64_t nServerRequests)
+    {
+        printf("%-8s %6.0f %6.0f %6.0f %9.0f %8.0f %8llu %9.3f %9.3f %9.3f %7.2f\n", pszName, result["maps"],
+            result["hits"], result["misses"], result["requests"], result["decodes"],
+            (unsigned long long)nServerRequests, result["mean_us"] / 1000.0, result["p50_us"] / 1000.0,
+            result["p99_us"] / 1000.0, result["seconds"]);
+    }
+
+    void PrintUsage()
+    {
+        printf(
+            "usage: MapSharedCacheBench [options]\n"
+            "  --maps N                maps and tiles each instance gets (default 100)\n"
+            "  --stress-maps N         made-up 256 x 256 maps the stress writers insert (default 512)\n"
+            "  --writers N             stress writer processes (default 2)\n"
+            "  --readers N             stress reader processes (default 4)\n"
+            "  --seconds S             how long the stress run lasts (default 2)\n"
+            "  --segment-mb N          the shared memory segment's size (default 64)\n"
+            "  --seed N                which tiles are asked for (default 1)\n"
+            "  --fixtures DIR          the recorded JPEGs (default %s)\n",
+            MAPBENCH_FIXTURES_DIR);
+    }
+
+    bool ParseOptions(int argc, char** argv, Options& options)
+    {
+        options.strSelf = argv[0];
+
+        for (int i = 1; i < argc; i++)
+        {
+            std::string strArg = argv[i];
+            bool bHasValue = i + 1 < argc;
+
+            if ("--role" == strArg && bHasValue)
+            {
+                options.strRole = argv[++i];
+            }
+            else if ("--name" == strArg && bHasValue)
+            {
+                options.strName = argv[++i];
+            }
+            else if ("--port" == strArg && bHasValue)
+            {
+                options.nPort = (uint16_t)atoi(argv[++i]);
+            }
+            else if ("--verify" == strArg)
+            {
+                options.bVerify = true;
+            }
+            else if ("--maps" == strArg && bHasValue)
+            {
+                options.nMaps = std::max(1u, (unsigned)strtoul(argv[++i], nullptr, 10));
+            }
+            else if ("--stress-maps" == strArg && bHasValue)
+            {
+                options.nStressMaps = std::max(1u, (unsigned)strtoul(argv[++i], nullptr, 10));
+            }
+            else if ("--writers" == strArg && bHasValue)
+            {
+                options.nWriters = std::max(1u, (unsigned)strtoul(argv[++i], nullptr, 10));
+            }
+            else if ("--readers" == strArg && bHasValue)
+            {
+                options.nReaders = std::max(1u, (unsigned)strtoul(argv[++i], nullptr, 10));
+            }
+            else if ("--seconds" == strArg && bHasValue)
+            {
+                options.fSeconds = std::max(0.1, atof(argv[++i]));
+            }
+            else if ("--segment-mb" == strArg && bHasValue)
+            {
+                options.nSegmentMB = std::max<size_t>(1, strtoul(argv[++i], nullptr, 10));
+            }
+            else if ("--seed" == strArg && bHasValue)
+            {
+                options.nSeed = (unsigned)strtoul(argv[++i], nullptr, 10);
+            }
+            else if ("--fixtures" == strArg && bHasValue)
+            {
+                options.strFixtures = argv[++i];
+            }
+            else
+            {
+                PrintUsage();
+                return false;
+            }
+        }
+
+        return true;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+
+    if (!ParseOptions(argc, argv, options))
+    {
+        return 2;
+    }
+
+    if ("instance" == options.strRole)
+    {
+        return RunInstance(options);
+    }
+    else if ("writer" == options.strRole)
+    {
+        return RunWriter(options);
+    }
+    else if ("reader" == options.strRole)
+    {
+        return RunReader(options);
+    }
+
+    MockMapServer server;
+
+    if (!server.LoadFixtures(options.strFixtures))
+    {
+        fprintf(stderr, "MapSharedCacheBench: no static maps or tiles in %s\n", options.strFixtures.c_str());
+        return 2;
+    }
+
+    if (!server.Start())
+    {
+        fprintf(stderr, "MapSharedCacheBench: could not start the mock map server\n");
+        return 2;
+    }
+
+    options.nPort = server.Port();
+
+    // a segment of our own, and another for the made-up maps, gone when we are
+    std::string strMapsName = "MapSharedCacheBench." + std::to_string(getpid());
+    std::string strStressName = strMapsName + ".stress";
+
+    MapSharedCache::Remove(strMapsName);
+    MapSharedCache::Remove(strStressName);
+
+    printf("MapSharedCacheBench: %u maps and tiles, a %zu MB segment, from http://127.0.0.1:%u\n",
+        options.nMaps, options.nSegmentMB, (unsigned)options.nPort);
+
+    bool bPassed = true;
+    ChildResult first;
+    ChildResult second;
+    ChildResult verify;
+    uint64_t nServerRequests[3] = { 0, 0, 0 };
+
+    options.strName = strMapsName;
+
+    uint64_t nRequestsBefore = ServerRequests(server);
+    bool bInstancesOk = RunChild(options, "instance", {}, first);
+    nServerRequests[0] = ServerRequests(server) - nRequestsBefore;
+
+    nRequestsBefore = ServerRequests(server);
+    bInstancesOk = RunChild(options, "instance", {}, second) && bInstancesOk;
+    nServerRequests[1] = ServerRequests(server) - nRequestsBefore;
+
+    nRequestsBefore = ServerRequests(server);
+    bInstancesOk = RunChild(options, "instance", { "--verify" }, verify) && bInstancesOk;
+    nServerRequests[2] = ServerRequests(server) - nRequestsBefore;
+
+    printf("\n%-8s %6s %6s %6s %9s %8s %8s %9s %9s %9s %7s\n", "instance", "maps", "hits", "misses", "requests",
+        "decodes", "server", "mean ms", "p50 ms", "p99 ms", "s");
+    PrintInstance("first", first, nServerRequests[0]);
+    PrintInstance("second", second, nServerRequests[1]);
+    PrintInstance("verify", verify, nServerRequests[2]);
+
+    // every map the first instance put in the cache and didn't push out
+    // again should have been found there, and nothing else asked for
+    double fKept = first["inserts"] - first["evictions"];
+
+    if (!bInstancesOk || first["failed"] > 0 || second["hits"] != fKept ||
+        (double)nServerRequests[1] != second["misses"] || second["decodes"] != second["misses"])
+    {
+        fprintf(stderr, "MapSharedCacheBench: the second instance found %.0f of the %.0f maps the first kept, "
+            "and made %llu requests for %.0f misses\n", second["hits"], fKept,
+            (unsigned long long)nServerRequests[1], second["misses"]);
+        bPassed = false;
+    }
+
+    if (verify["mismatched"] > 0 || verify["hits"] != fKept)
+    {
+        fprintf(stderr, "MapSharedCacheBench: %.0f maps from the shared cache differ from the server's\n",
+            verify["mismatched"]);
+        bPassed = false;
+    }
+
+    // writers and readers at once, with far more maps than fit
+    options.strName = strStressName;
+
+    ChildResult writers;
+    ChildResult readers;
+    bool bStressOk = RunStress(options, options.nWriters, options.nReaders, writers, readers);
+
+    printf("\nstress: %u writers, %.0f inserts (%.0f skipped while another wrote), %.0f evictions, insert p99 %.3f ms\n",
+        options.nWriters, writers["inserts"], writers["skipped"], writers["evictions"], writers["insert_p99_us"] / 1000.0);
+    printf("        %u readers, %.0f hits, %.0f misses, %.0f reads retried, %.0f bad, find p50 %.3f ms p99 %.3f ms\n",
+        options.nReaders, readers["hits"], readers["misses"], readers["retries"], readers["bad"],
+        readers["find_p50_us"] / 1000.0, readers["find_p99_us"] / 1000.0);
+
+    if (!bStressOk || readers["bad"] > 0 || 0 == readers["hits"] || 0 == writers["inserts"])
+    {
+        fprintf(stderr, "MapSharedCacheBench: the stress run failed, %.0f bad maps read\n", readers["bad"]);
+        bPassed = false;
+    }
+
+    // a writer killed part way, then a writer and readers carrying on
+    Options crashOptions = options;
+    crashOptions.fSeconds = 60;
+
+    Child victim = StartChild(crashOptions, "writer", {});
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    kill(victim.pid, SIGKILL);
+
+    ChildResult unused;
+    FinishChild(victim, unused);
+
+    Options afterOptions = options;
+    afterOptions.fSeconds = std::min(options.fSeconds, 1.0);
+
+    ChildResult afterWriters;
+    ChildResult afterReaders;
+    bool bCrashOk = RunStress(afterOptions, 1, options.nReaders, afterWriters, afterReaders);
+
+    printf("\ncrash: after a writer was killed, %.0f inserts, %.0f skipped, the writer lock taken over %.0f times; "
+        "%.0f hits, %.0f bad\n", afterWriters["inserts"], afterWriters["skipped"], afterWriters["locks_taken"],
+        afterReaders["hits"], afterReaders["bad"]);
+
+    if (!bCrashOk || 0 == afterWriters["inserts"] || afterReaders["bad"] > 0)
+    {
+        fprintf(stderr, "MapSharedCacheBench: the cache didn't recover from a writer being killed\n");
+        bPassed = false;
+    }
+
+    server.Stop();
+
+    MapSharedCache::Remove(strMapsName);
+    MapSharedCache::Remove(strStressName);
+
+    return bPassed ? 0 : 1;
+}
@@ -0,0 +1,695 @@
+// MapWarmStart.cpp : How quickly a new instance shows maps it cached before.
+//
+// Fills a DiskMapCache and a DecodedMapCache with the same maps, made from
+// the recorded JPEGs, then starts this program again, once per run for
+// each way of getting a map back, with a --role, so each run is a process
+// that has never touched the maps, as a new instance of GraphicsTestWin32
+// would be.  The ways are:
+//
+//      jpeg        the DiskMapCache, each map decoded from its JPEG into a
+//                  new MapImage, as the program did before there was a
+//                  DecodedMapCache
+//      copy        the DecodedMapCache, each map's pixels copied out of
+//                  the mapped file into a new MapImage: no decode, but
+//                  every page touched and allocated again
+//      decoded     the DecodedMapCache, each map's MapImage being the
+//                  mapped file itself: no decode and no copy
+//
+// Each run opens the cache, gets the first map and paints it into a back
+// buffer as big as the window, then gets and paints the rest.  It reports
+// the time and the page faults to the first paint and to the last, and the
+// most memory it had resident.  With --cold the cache files are dropped
+// from the page cache before each run, so the maps come from the disk.
+//
+// The run fails if the decoded maps don't reach the first paint sooner
+// than the JPEGs, or fault in fewer pages than the copies.
+//
+// Run with --help for the options.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "DecodedMapCache.h"
+#include "DiskMapCache.h"
+#include "ImageDecoder.h"
+#include "JpegDecoder.h"
+#include "MapImage.h"
+#include "MapRequest.h"
+#include "PixelBlit.h"
+#include "TileSystem.h"
+
+#ifndef MAPBENCH_FIXTURES_DIR
+#define MAPBENCH_FIXTURES_DIR "Fixtures"
+#endif
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    // the level of the made-up tile keys the maps are cached under
+    const int kTileLevel = 14;
+
+    // the back buffer the maps are painted into, the size of the window
+    const int kBackBufferWidth = 1024;
+    const int kBackBufferHeight = 768;
+
+    const char* const kSources[] = { "jpeg", "copy", "decoded" };
+
+    struct Options
+    {
+        std::string     strRole;                    // empty for the process that runs the rest
+        std::string     strSource;
+        std::string     strFixtures = MAPBENCH_FIXTURES_DIR;
+        std::string     strDirectory;               // the caches, a temporary one if not given
+        unsigned        nMaps = 40;
+        unsigned        nRuns = 5;
+        bool            bCold = false;
+        std::string     strSelf;                    // argv[0]
+    };
+
+    // what a child process printed, its RESULT line as names and values
+    typedef std::map<std::string, double> ChildResult;
+
+    struct Fixture
+    {
+        std::string             strName;
+        std::vector<uint8_t>    bytes;
+    };
+
+    bool ReadFile(const std::filesystem::path& path, std::vector<uint8_t>& bytesOut)
+    {
+        std::ifstream in(path, std::ios::binary);
+
+        if (!in)
+        {
+            return false;
+        }
+
+        bytesOut.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+
+        return !bytesOut.empty();
+    }
+
+    // every .jpg in the fixtures folder, sorted by name
+    std::vector<Fixture> LoadFixtures(const std::string& strDirectory)
+    {
+        std::vector<Fixture> fixtures;
+        std::error_code error;
+
+        for (const auto& entry : std::filesystem::directory_iterator(strDirectory, error))
+        {
+            if (entry.path().extension() != ".jpg")
+            {
+                continue;
+            }
+
+            Fixture fixture;
+            fixture.strName = entry.path().filename().string();
+
+            if (ReadFile(entry.path(), fixture.bytes))
+            {
+                fixtures.push_back(std::move(fixture));
+            }
+        }
+
+        std::sort(fixtures.begin(), fixtures.end(),
+            [](const Fixture& a, const Fixture& b) { return a.strName < b.strName; });
+
+        return fixtures;
+    }
+
+    // a distinct key for each map, the same in every process
+    std::vector<MapRequestKey> MakeKeys(unsigned nMaps)
+    {
+        std::vector<MapRequestKey> keys;
+
+        for (unsigned i = 0; i < nMaps; i++)
+        {
+            keys.push_back(MapRequestKey::ForTile(DEFAULT_IMAGERY_SET, TileSystem::TileXYToQuadKey((int)i, 0, kTileLevel)));
+        }
+
+        return keys;
+    }
+
+    std::filesystem::path JpegDirectory(const Options& options)
+    {
+        return std::filesystem::path(options.strDirectory) / "jpeg";
+    }
+
+    std::filesystem::path DecodedDirectory(const Options& options)
+    {
+        return std::filesystem::path(options.strDirectory) / "decoded";
+    }
+
+    // the faults and resident memory of this process so far
+    struct Usage
+    {
+        long    nMinorFaults = 0;
+        long    nMajorFaults = 0;
+        long    nMaxResidentKB = 0;
+    };
+
+    Usage GetUsage()
+    {
+        struct rusage usage;
+        Usage result;
+
+        if (0 == getrusage(RUSAGE_SELF, &usage))
+        {
+            result.nMinorFaults = usage.ru_minflt;
+            result.nMajorFaults = usage.ru_majflt;
+            result.nMaxResidentKB = usage.ru_maxrss;
+        }
+
+        return result;
+    }
+
+    void PrintResult(const std::vector<std::pair<const char*, double>>& values)
+    {
+        printf("RESULT");
+
+        for (const auto& value : values)
+        {
+            printf(" %s=%.6g", value.first, value.second);
+        }
+
+        printf("\n");
+        fflush(stdout);
+    }
+
+    // fill both caches with nMaps maps, the fixtures over and over
+    bool FillCaches(const Options& options, const std::vector<Fixture>& fixtures)
+    {
+        DiskMapCache jpegCache(JpegDirectory(options));
+        DecodedMapCache decodedCache(DecodedDirectory(options));
+
+        if (!jpegCache.Open() || !decodedCache.Open())
+        {
+            return false;
+        }
+
+        std::unique_ptr<ImageDecoder> pDecoder = CreateJpegDecoder();
+        std::vector<MapImageHandle> decoded;
+
+        for (const Fixture& fixture : fixtures)
+        {
+            MapImageHandle hImage;
+
+            if (!DecodeToMapImage(*pDecoder, fixture.bytes.data(), fixture.bytes.size(), hImage))
+            {
+                fprintf(stderr, "MapWarmStart: could not decode %s\n", fixture.strName.c_str());
+                return false;
+            }
+
+            decoded.push_back(hImage);
+        }
+
+        std::vector<MapRequestKey> keys = MakeKeys(options.nMaps);
+
+        for (size_t i = 0; i < keys.size(); i++)
+        {
+            const Fixture& fixture = fixtures[i % fixtures.size()];
+
+            if (!jpegCache.Store(keys[i], fixture.bytes.data(), fixture.bytes.size()) ||
+                !decodedCache.Store(keys[i], *decoded[i % decoded.size()]))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // drop the cache files from the page cache, so the next run reads them
+    // from the disk.  Only pages no process has mapped are dropped.
+    void DropFromPageCache(const Options& options)
+    {
+        std::error_code error;
+
+        for (const std::filesystem::path& directory : { JpegDirectory(options), DecodedDirectory(options) })
+        {
+            for (const auto& entry : std::filesystem::directory_iterator(directory, error))
+            {
+                int fd = open(entry.path().c_str(), O_RDONLY);
+
+                if (fd >= 0)
+                {
+                    fdatasync(fd);
+                    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+                    close(fd);
+                }
+            }
+        }
+    }
+
+    // get the map for key the way source says
+    MapImageHandle GetMap(const std::string& strSource, const MapRequestKey& key, DiskMapCache& jpegCache,
+        DecodedMapCache& decodedCache, ImageDecoder& decoder)
+    {
+        MapImageHandle hImage;
+
+        if ("jpeg" == strSource)
+        {
+            MapCacheView cachedMap;
+
+            if (jpegCache.Lookup(key, cachedMap))
+            {
+                DecodeToMapImage(decoder, cachedMap.pData, cachedMap.nSize, hImage);
+            }
+        }
+        else if ("copy" == strSource)
+        {
+            MapImageHandle hMapped = decodedCache.Lookup(key);
+            std::shared_ptr<MapImage> pCopy = hMapped ? MapImage::Create(hMapped->Width(), hMapped->Height()) : nullptr;
+
+            if (pCopy)
+            {
+                memcpy(pCopy->Pixels(), hMapped->Pixels(), hMapped->ByteSize());
+                hImage = pCopy;
+            }
+        }
+        else
+        {
+            hImage = decodedCache.Lookup(key);
+        }
+
+        return hImage;
+    }
+
+    // --role start: open the cache, get and paint the first map, then the
+    // rest, as a new instance would
+    int RunStart(const Options& options)
+    {
+        // the back buffer is the window's, there before any map is, so its
+        // pages are faulted in before the clock starts
+        std::shared_ptr<MapImage> pBackBuffer = MapImage::Create(kBackBufferWidth, kBackBufferHeight);
+
+        if (!pBackBuffer)
+        {
+            return 2;
+        }
+
+        memset(pBackBuffer->Pixels(), 0, pBackBuffer->ByteSize());
+
+        PixelBuffer dest = PixelBufferOf(*pBackBuffer);
+        std::vector<MapRequestKey> keys = MakeKeys(options.nMaps);
+        std::unique_ptr<ImageDecoder> pDecoder = CreateJpegDecoder();
+
+        Usage before = GetUsage();
+        Clock::time_point start = Clock::now();
+
+        DiskMapCache jpegCache(JpegDirectory(options));
+        DecodedMapCache decodedCache(DecodedDirectory(options));
+
+        bool bOpened = ("jpeg" == options.strSource) ? jpegCache.Open() : decodedCache.Open();
+
+        if (!bOpened)
+        {
+            fprintf(stderr, "MapWarmStart: could not open the %s cache\n", options.strSource.c_str());
+            return 2;
+        }
+
+        std::vector<MapImageHandle> maps;
+        double fFirstPaintMs = 0;
+        Usage firstPaint;
+        uint64_t nChecksum = 0;
+
+        for (size_t i = 0; i < keys.size(); i++)
+        {
+            MapImageHandle hImage = GetMap(options.strSource, keys[i], jpegCache, decodedCache, *pDecoder);
+
+            if (!hImage)
+            {
+                fprintf(stderr, "MapWarmStart: map %zu is missing from the %s cache\n", i, options.strSource.c_str());
+                return 2;
+            }
+
+            BlitPixels(dest, dest.Bounds(), 0, 0, PixelBufferOf(*hImage));
+            nChecksum += dest.Row(kBackBufferHeight / 2)[kBackBufferWidth * 2];
+
+            // the program keeps every map it has shown
+            maps.push_back(hImage);
+
+            if (0 == i)
+            {
+                fFirstPaintMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+                firstPaint = GetUsage();
+            }
+        }
+
+        double fAllMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        Usage after = GetUsage();
+
+        PrintResult({ { "maps", (double)maps.size() }, { "first_ms", fFirstPaintMs },
+            { "first_minflt", (double)(firstPaint.nMinorFaults - before.nMinorFaults) },
+            { "first_majflt", (double)(firstPaint.nMajorFaults - before.nMajorFaults) },
+            { "all_ms", fAllMs }, { "all_minflt", (double)(after.nMinorFaults - before.nMinorFaults) },
+            { "all_majflt", (double)(after.nMajorFaults - before.nMajorFaults) },
+            { "maxrss_kb", (double)after.nMaxResidentKB }, { "checksum", (double)nChecksum } });
+
+        return 0;
+    }
+
+    // run this program again as --role start, and read its RESULT line.
+    // Returns false if it failed or didn't print one.
+    bool RunChild(const Options& options, const std::string& strSource, ChildResult& resultOut,
+        double& fProcessMsOut)
+    {
+        std::vector<std::string> args = { options.strSelf, "--role", "start", "--source", strSource,
+            "--dir", options.strDirectory, "--maps", std::to_string(options.nMaps) };
+
+        std::vector<char*> argv;
+
+        for (std::string& strArg : args)
+        {
+            argv.push_back(&strArg[0]);
+        }
+
+        argv.push_back(nullptr);
+
+        int fds[2];
+
+        if (0 != pipe(fds))
+        {
+            return false;
+        }
+
+        fflush(stdout);
+
+        Clock::time_point start = Clock::now();
+        pid_t pid = fork();
+
+        if (0 == pid)
+        {
+            dup2(fds[1], STDOUT_FILENO);
+            close(fds[0]);
+            close(fds[1]);
+            execv(argv[0], argv.data());
+            _exit(127);
+        }
+
+        close(fds[1]);
+
+        if (pid < 0)
+        {
+            close(fds[0]);
+            return false;
+        }
+
+        FILE* pOutput = fdopen(fds[0], "r");
+        bool bResult = false;
+        char szLine[1024];
+
+        while (pOutput && fgets(szLine, sizeof(szLine), pOutput))
+        {
+            if (0 != strncmp(szLine, "RESULT ", 7))
+            {
+                continue;
+            }
+
+            resultOut.clear();
+
+            for (char* pszField = strtok(szLine + 7, " \n"); pszField; pszField = strtok(nullptr, " \n"))
+            {
+                char* pszEquals = strchr(pszField, '=');
+
+                if (pszEquals)
+                {
+                    *pszEquals = '\0';
+                    resultOut[pszField] = atof(pszEquals + 1);
+                }
+            }
+
+            bResult = true;
+        }
+
+        if (pOutput)
+        {
+            fclose(pOutput);
+        }
+
+        int nStatus = 0;
+
+        if (waitpid(pid, &nStatus, 0) == pid)
+        {
+            bResult = bResult && WIFEXITED(nStatus) && 0 == WEXITSTATUS(nStatus);
+        }
+
+        fProcessMsOut = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+        return bResult;
+    }
+
+    double Median(std::vector<double> values)
+    {
+        if (values.empty())
+        {
+            return 0;
+        }
+
+        std::sort(values.begin(), values.end());
+
+        return values[values.size() / 2];
+    }
+
+    // the median of each value over the runs of one source
+    ChildResult MedianOf(const std::vector<ChildResult>& runs)
+    {
+        ChildResult result;
+
+        if (runs.empty())
+        {
+            return result;
+        }
+
+        for (const auto& value : runs[0])
+        {
+            std::vector<double> values;
+
+            for (const ChildResult& run : runs)
+            {
+                auto found = run.find(value.first);
+                values.push_back((found != run.end()) ? found->second : 0);
+            }
+
+            result[value.first] = Median(values);
+        }
+
+        return result;
+    }
+
+    uint64_t DirectoryBytes(const std::filesystem::path& directory)
+    {
+        uint64_t nBytes = 0;
+        std::error_code error;
+
+        for (const auto& entry : std::filesystem::directory_iterator(directory, error))
+        {
+            nBytes += entry.file_size(error);
+        }
+
+        return nBytes;
+    }
+
+    void PrintUsage()
+    {
+        printf(
+            "usage: MapWarmStart [options]\n"
+            "  --maps N                maps in each cache (default 40)\n"
+            "  --runs N                new processes started for each source (default 5)\n"
+            "  --cold                  drop the cache files from the page cache before each run\n"
+            "  --dir DIR               where to put the caches (default a temporary directory)\n"
+            "  --fixtures DIR          the recorded JPEGs (default %s)\n",
+            MAPBENCH_FIXTURES_DIR);
+    }
+
+    bool ParseOptions(int argc, char** argv, Options& options)
+    {
+        options.strSelf = argv[0];
+
+        for (int i = 1; i < argc; i++)
+        {
+            std::string strArg = argv[i];
+            bool bHasValue = i + 1 < argc;
+
+            if ("--role" == strArg && bHasValue)
+            {
+                options.strRole = argv[++i];
+            }
+            else if ("--source" == strArg && bHasValue)
+            {
+                options.strSource = argv[++i];
+            }
+            else if ("--maps" == strArg && bHasValue)
+            {
+                options.nMaps = std::max(1u, (unsigned)strtoul(argv[++i], nullptr, 10));
+            }
+            else if ("--runs" == strArg && bHasValue)
+            {
+                options.nRuns = std::max(1u, (unsigned)strtoul(argv[++i], nullptr, 10));
+            }
+            else if ("--cold" == strArg)
+            {
+                options.bCold = true;
+            }
+            else if ("--dir" == strArg && bHasValue)
+            {
+                options.strDirectory = argv[++i];
+            }
+            else if ("--fixtures" == strArg && bHasValue)
+            {
+                options.strFixtures = argv[++i];
+            }
+            else
+            {
+                PrintUsage();
+                return false;
+            }
+        }
+
+        return true;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+
+    if (!ParseOptions(argc, argv, options))
+    {
+        return 2;
+    }
+
+    if ("start" == options.strRole)
+    {
+        return RunStart(options);
+    }
+
+    std::vector<Fixture> fixtures = LoadFixtures(options.strFixtures);
+
+    if (fixtures.empty())
+    {
+        fprintf(stderr, "MapWarmStart: no JPEGs in %s\n", options.strFixtures.c_str());
+        return 2;
+    }
+
+    // a directory of our own, gone when we are, unless one was given
+    bool bTemporary = options.strDirectory.empty();
+    std::error_code error;
+
+    if (bTemporary)
+    {
+        options.strDirectory = (std::filesystem::temp_directory_path(error) /
+            ("MapWarmStart." + std::to_string(getpid()))).string();
+    }
+
+    std::filesystem::remove_all(JpegDirectory(options), error);
+    std::filesystem::remove_all(DecodedDirectory(options), error);
+
+    if (!FillCaches(options, fixtures))
+    {
+        fprintf(stderr, "MapWarmStart: could not fill the caches in %s\n", options.strDirectory.c_str());
+        return 2;
+    }
+
+    printf("MapWarmStart: %u maps, %.1f MB of JPEG, %.1f MB of pixels, %u %s runs each, in %s\n",
+        options.nMaps, DirectoryBytes(JpegDirectory(options)) / 1048576.0,
+        DirectoryBytes(DecodedDirectory(options)) / 1048576.0, options.nRuns, options.bCold ? "cold" : "warm",
+        options.strDirectory.c_str());
+
+    bool bPassed = true;
+    std::map<std::string, ChildResult> results;
+
+    // take turns, so whatever else the machine is doing is spread over
+    // every source alike
+    std::map<std::string, std::vector<ChildResult>> runs;
+
+    for (unsigned nRun = 0; nRun < options.nRuns && bPassed; nRun++)
+    {
+        for (const char* pszSource : kSources)
+        {
+            if (options.bCold)
+            {
+                DropFromPageCache(options);
+            }
+
+            ChildResult result;
+            double fProcessMs = 0;
+
+            if (!RunChild(options, pszSource, result, fProcessMs))
+            {
+                fprintf(stderr, "MapWarmStart: the %s run failed\n", pszSource);
+                bPassed = false;
+                break;
+            }
+
+            result["process_ms"] = fProcessMs;
+            runs[pszSource].push_back(result);
+        }
+    }
+
+    printf("\n%-8s %10s %10s %10s %10s %10s %10s %11s %10s\n", "source", "first ms", "first flt", "all ms",
+        "all flt", "major flt", "process ms", "max rss MB", "checksum");
+
+    for (const char* pszSource : kSources)
+    {
+        ChildResult& result = results[pszSource] = MedianOf(runs[pszSource]);
+
+        printf("%-8s %10.3f %10.0f %10.3f %10.0f %10.0f %10.3f %11.1f %10.0f\n", pszSource, result["first_ms"],
+            result["first_minflt"] + result["first_majflt"], result["all_ms"],
+            result["all_minflt"] + result["all_majflt"], result["all_majflt"], result["process_ms"],
+            result["maxrss_kb"] / 1024.0, result["checksum"]);
+    }
+
+    if (bPassed)
+    {
+        ChildResult& jpeg = results["jpeg"];
+        ChildResult& copy = results["copy"];
+        ChildResult& decoded = results["decoded"];
+
+        // every source painted the same maps
+        if (jpeg["checksum"] != decoded["checksum"] || copy["checksum"] != decoded["checksum"])
+        {
+            fprintf(stderr, "MapWarmStart: the maps painted differ between sources\n");
+            bPassed = false;
+        }
+
+        if (decoded["first_ms"] >= jpeg["first_ms"])
+        {
+            fprintf(stderr, "MapWarmStart: the decoded cache reached the first paint in %.3f ms, the JPEGs in %.3f ms\n",
+                decoded["first_ms"], jpeg["first_ms"]);
+            bPassed = false;
+        }
+
+        double fDecodedFaults = decoded["all_minflt"] + decoded["all_majflt"];
+        double fCopyFaults = copy["all_minflt"] + copy["all_majflt"];
+
+        if (fDecodedFaults >= fCopyFaults)
+        {
+            fprintf(stderr, "MapWarmStart: mapping the decoded maps faulted %.0f pages, copying them %.0f\n",
+                fDecodedFaults, fCopyFaults);
+            bPassed = false;
+        }
+    }
+
+    if (bTemporary)
+    {
+        std::filesystem::remove_all(options.strDirectory, error);
+    }
+
+    return bPassed ? 0 : 1;
+}
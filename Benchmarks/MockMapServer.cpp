@@ -0,0 +1,386 @@
+// MockMapServer.cpp : A stand-in for the Bing Maps servers, for load tests.
+//
+#include "MockMapServer.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <filesystem>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#include <strings.h>
+#include <sys/stat.h>
+
+#include "ImageScaler.h"
+#include "JpegDecoder.h"
+#include "JpegEncoder.h"
+#include "PixelBlit.h"
+
+namespace
+{
+    const char kStaticMapPrefix[] = "/REST/v1/Imagery/Map/";
+    const char kTilePrefix[] = "/tiles/";
+
+    // FNV-1a, which unlike std::hash is the same everywhere
+    uint64_t HashString(const std::string& str)
+    {
+        uint64_t nHash = 14695981039346656037ull;
+
+        for (unsigned char c : str)
+        {
+            nHash = (nHash ^ c) * 1099511628211ull;
+        }
+
+        return nHash;
+    }
+
+    // "San%20Francisco" and "san francisco" are both "sanfrancisco"
+    std::string NormalizePlace(const std::string& strLocation)
+    {
+        std::string strPlace;
+
+        for (size_t i = 0; i < strLocation.size(); i++)
+        {
+            unsigned char c = (unsigned char)strLocation[i];
+
+            if ('%' == c && i + 2 < strLocation.size() && isxdigit((unsigned char)strLocation[i + 1]) &&
+                isxdigit((unsigned char)strLocation[i + 2]))
+            {
+                c = (unsigned char)strtoul(strLocation.substr(i + 1, 2).c_str(), nullptr, 16);
+                i += 2;
+            }
+
+            if (isalnum(c))
+            {
+                strPlace += (char)tolower(c);
+            }
+        }
+
+        return strPlace;
+    }
+
+    // the "<w>,<h>" of a mapSize in a query string.  The comma may be
+    // escaped.
+    bool ParseMapSize(const std::string& strQuery, int& nWidthOut, int& nHeightOut)
+    {
+        size_t nStart = strQuery.find("mapSize=");
+
+        if (nStart == std::string::npos || (nStart > 0 && '&' != strQuery[nStart - 1]))
+        {
+            return false;
+        }
+
+        const char* pszSize = strQuery.c_str() + nStart + sizeof("mapSize=") - 1;
+        char* pszEnd = nullptr;
+
+        long nWidth = strtol(pszSize, &pszEnd, 10);
+
+        if (0 == strncmp(pszEnd, ",", 1))
+        {
+            pszEnd += 1;
+        }
+        else if (0 == strncasecmp(pszEnd, "%2C", 3))
+        {
+            pszEnd += 3;
+        }
+        else
+        {
+            return false;
+        }
+
+        long nHeight = strtol(pszEnd, nullptr, 10);
+
+        // Bing Maps' own limits
+        if (nWidth < 80 || nHeight < 80 || nWidth > 2000 || nHeight > 1500)
+        {
+            return false;
+        }
+
+        nWidthOut = (int)nWidth;
+        nHeightOut = (int)nHeight;
+
+        return true;
+    }
+
+    // the ETag of a map, a hash of it, so it changes when the map does
+    std::string ETagOf(const std::vector<uint8_t>& body)
+    {
+        char szETag[32];
+
+        snprintf(szETag, sizeof(szETag), "\"%016llx\"", (unsigned long long)HashString(
+            std::string(body.begin(), body.end())));
+
+        return szETag;
+    }
+
+    bool ReadFile(const std::filesystem::path& path, std::vector<uint8_t>& bytes)
+    {
+        std::ifstream file(path, std::ios::binary);
+
+        if (!file)
+        {
+            return false;
+        }
+
+        bytes.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+
+        return !bytes.empty();
+    }
+}
+
+MockMapServer::MockMapServer()
+{
+    m_server.SetResolver([this](const std::string& strPath, const std::string& strQuery)
+    {
+        return Resolve(strPath, strQuery);
+    });
+}
+
+bool MockMapServer::LoadFixtures(const std::string& strDirectory)
+{
+    std::vector<std::filesystem::path> paths;
+    std::error_code error;
+
+    for (const auto& entry : std::filesystem::directory_iterator(strDirectory, error))
+    {
+        if (entry.path().extension() == ".jpg")
+        {
+            paths.push_back(entry.path());
+        }
+    }
+
+    // in the same order whatever order the directory lists them in
+    std::sort(paths.begin(), paths.end());
+
+    for (const std::filesystem::path& path : paths)
+    {
+        std::string strStem = path.stem().string();
+        size_t nUnderscore = strStem.rfind('_');
+
+        LocalHttpFile file;
+        file.strContentType = "image/jpeg";
+
+        if (nUnderscore == std::string::npos || !ReadFile(path, file.body))
+        {
+            continue;
+        }
+
+        // the Last-Modified date is the file's
+        file.strETag = ETagOf(file.body);
+
+        struct stat status;
+
+        if (0 == stat(path.c_str(), &status))
+        {
+            file.strLastModified = LocalHttpServer::HttpDate(status.st_mtime);
+        }
+
+        std::string strKind = strStem.substr(nUnderscore + 1);
+
+        if (0 == strKind.compare(0, 4, "tile"))
+        {
+            m_tiles.push_back(std::move(file));
+        }
+        else if (strKind.find('x') != std::string::npos)
+        {
+            m_maps.push_back(StaticMap{ NormalizePlace(strStem.substr(0, nUnderscore)), std::move(file) });
+        }
+    }
+
+    return !m_maps.empty() && !m_tiles.empty();
+}
+
+std::string MockMapServer::BaseUrl() const
+{
+    return "http://127.0.0.1:" + std::to_string(Port());
+}
+
+const LocalHttpFile* MockMapServer::Resolve(const std::string& strPath, const std::string& strQuery) const
+{
+    if (0 == strPath.compare(0, sizeof(kStaticMapPrefix) - 1, kStaticMapPrefix))
+    {
+        // "<imagery set>/<location>"
+        std::string strRest = strPath.substr(sizeof(kStaticMapPrefix) - 1);
+        size_t nSlash = strRest.find('/');
+
+        if (nSlash == std::string::npos || nSlash + 1 == strRest.size())
+        {
+            return nullptr;
+        }
+
+        std::string strPlace = NormalizePlace(strRest.substr(nSlash + 1));
+        size_t nMap = 0;
+
+        while (nMap < m_maps.size() && m_maps[nMap].strPlace != strPlace)
+        {
+            nMap++;
+        }
+
+        if (nMap == m_maps.size())
+        {
+            nMap = HashString(strPlace) % m_maps.size();
+        }
+
+        int nWidth = 0;
+        int nHeight = 0;
+
+        if (m_bScaleToMapSize && ParseMapSize(strQuery, nWidth, nHeight))
+        {
+            return ScaledMap(nMap, nWidth, nHeight);
+        }
+
+        return &m_maps[nMap].file;
+    }
+
+    if (0 == strPath.compare(0, sizeof(kTilePrefix) - 1, kTilePrefix))
+    {
+        // "<imagery letter><quadkey>.jpeg"
+        std::string strName = strPath.substr(sizeof(kTilePrefix) - 1);
+        size_t nDot = strName.find('.');
+
+        if (nDot == std::string::npos || nDot < 2 || strName.substr(nDot) != ".jpeg" ||
+            strName.find_first_not_of("0123", 1) != nDot)
+        {
+            return nullptr;
+        }
+
+        return &m_tiles[HashString(strName.substr(1, nDot - 1)) % m_tiles.size()];
+    }
+
+    return nullptr;
+}
+
+const LocalHttpFile* MockMapServer::ScaledMap(size_t nMap, int nWidth, int nHeight) const
+{
+    const LocalHttpFile& original = m_maps[nMap].file;
+
+    // one connection scales each size while the others wait for it, which
+    // only happens once a size
+    std::lock_guard<std::mutex> lock(m_scaledMutex);
+
+    std::unique_ptr<LocalHttpFile>& pScaled = m_scaledMaps[ScaledMapKey(nMap, nWidth, nHeight)];
+
+    if (pScaled)
+    {
+        return pScaled.get();
+    }
+
+    std::unique_ptr<ImageDecoder> pDecoder = CreateJpegDecoder();
+    std::unique_ptr<ImageEncoder> pEncoder = CreateJpegEncoder();
+    MapImageHandle hOriginal;
+
+    pScaled.reset(new LocalHttpFile(original));
+
+    if (!DecodeToMapImage(*pDecoder, original.body.data(), original.body.size(), hOriginal) ||
+        (hOriginal->Width() == nWidth && hOriginal->Height() == nHeight))
+    {
+        return pScaled.get();
+    }
+
+    std::shared_ptr<MapImage> pImage = MapImage::Create(nWidth, nHeight);
+    std::vector<uint8_t> body;
+
+    if (!pImage)
+    {
+        return pScaled.get();
+    }
+
+    ScaleImage(PixelBufferOf(*hOriginal), PixelBufferOf(*pImage), ScaleFilter::LANCZOS3);
+
+    if (pEncoder->Encode(*pImage, body))
+    {
+        pScaled->body = std::move(body);
+        pScaled->strETag = ETagOf(pScaled->body);
+    }
+
+    return pScaled.get();
+}
+
+const char kFaultOptionsUsage[] =
+    "  --latency MS            wait MS before each response (default 0)\n"
+    "  --jitter MS             and up to MS longer, at random (default 0)\n"
+    "  --bandwidth KBPS        send each connection's bodies at KBPS kilobytes a second\n"
+    "  --chunked               send bodies with Transfer-Encoding: chunked\n"
+    "  --chunk-size BYTES      the size of each chunk (default 16384)\n"
+    "  --error-rate FRACTION   answer this fraction of requests with an error\n"
+    "  --error-status CODE     the error's HTTP status (default 503)\n"
+    "  --truncate-rate FRACTION  cut this fraction of bodies off half way\n"
+    "  --stall-rate FRACTION   stop this fraction of bodies half way for a while\n"
+    "  --stall-ms MS           and for how long (default 5000)\n"
+    "  --change-rate FRACTION  answer this fraction of conditional requests in full, as if the map had changed\n"
+    "  --seed N                for the random latency, errors, truncation and stalls (default 1)\n";
+
+bool ParseFaultOption(int argc, char** argv, int& i, LocalHttpFaults& faults)
+{
+    std::string strArg = argv[i];
+    bool bHasValue = i + 1 < argc;
+
+    if ("--chunked" == strArg)
+    {
+        faults.bChunked = true;
+        return true;
+    }
+
+    if (!bHasValue)
+    {
+        return false;
+    }
+
+    const char* pszValue = argv[i + 1];
+
+    if ("--latency" == strArg)
+    {
+        faults.nLatencyMs = (unsigned)strtoul(pszValue, nullptr, 10);
+    }
+    else if ("--jitter" == strArg)
+    {
+        faults.nJitterMs = (unsigned)strtoul(pszValue, nullptr, 10);
+    }
+    else if ("--bandwidth" == strArg)
+    {
+        faults.nBytesPerSecond = strtoull(pszValue, nullptr, 10) * 1024;
+    }
+    else if ("--chunk-size" == strArg)
+    {
+        faults.nChunkBytes = (size_t)strtoull(pszValue, nullptr, 10);
+    }
+    else if ("--error-rate" == strArg)
+    {
+        faults.fErrorRate = atof(pszValue);
+    }
+    else if ("--error-status" == strArg)
+    {
+        faults.nErrorStatus = atoi(pszValue);
+    }
+    else if ("--truncate-rate" == strArg)
+    {
+        faults.fTruncateRate = atof(pszValue);
+    }
+    else if ("--stall-rate" == strArg)
+    {
+        faults.fStallRate = atof(pszValue);
+    }
+    else if ("--stall-ms" == strArg)
+    {
+        faults.nStallMs = (unsigned)strtoul(pszValue, nullptr, 10);
+    }
+    else if ("--change-rate" == strArg)
+    {
+        faults.fChangeRate = atof(pszValue);
+    }
+    else if ("--seed" == strArg)
+    {
+        faults.nSeed = (uint32_t)strtoul(pszValue, nullptr, 10);
+    }
+    else
+    {
+        return false;
+    }
+
+    i++;
+
+    return true;
+}
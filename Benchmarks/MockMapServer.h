@@ -0,0 +1,116 @@
+// MockMapServer.h : A stand-in for the Bing Maps servers, for load tests.
+//
+// Serves the two kinds of request GraphicsTestWin32 makes, at the paths
+// BuildMapUrl gives them when it is pointed at a base URL:
+//
+//      /REST/v1/Imagery/Map/<imagery set>/<location>   a static map
+//      /tiles/<imagery letter><quadkey>.jpeg            a tile
+//
+// from the recorded JPEGs in a fixtures directory.  A file named
+// <place>_<w>x<h>.jpg is a static map and <place>_tile<n>.jpg is a tile.
+// A static map request gets the map whose place matches its location,
+// ignoring case, spaces and punctuation, or else one picked by a hash of
+// the location; a tile request gets a tile picked by a hash of its
+// quadkey.  The same request always gets the same answer, so runs can be
+// compared, but every imagery set and quadkey has a map.
+//
+// Bing Maps fits a location to the map size it is asked for, so a smaller
+// map shows the same place with less detail.  With SetScaleToMapSize, a
+// static map request gets its map scaled to its mapSize like that, so a
+// small map is fewer bytes, as it would be from Bing Maps.  Each size is
+// scaled and encoded once, the first time it is asked for.  Otherwise the
+// map is sent at the size it was recorded, whatever the size asked for.
+//
+// Each map is sent with an ETag, a hash of the map, and a Last-Modified
+// date, the fixture file's, and a conditional request for a map that
+// hasn't changed is answered with a 304.  SetMaxAge adds a Cache-Control
+// max-age.
+//
+// Latency, throttling, chunking and errors are set with LocalHttpFaults.
+// MockMapServerMain runs it on its own, and MapLoadTest runs it in process.
+//
+// POSIX sockets only.
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "LocalHttpServer.h"
+
+class MockMapServer
+{
+public:
+    MockMapServer();
+
+    MockMapServer(const MockMapServer&) = delete;
+    MockMapServer& operator=(const MockMapServer&) = delete;
+
+    // load the static maps and tiles in strDirectory.  Returns false if
+    // there isn't at least one of each.  Call before Start.
+    bool LoadFixtures(const std::string& strDirectory);
+
+    // misbehave as faults says.  Call before Start.
+    void SetFaults(const LocalHttpFaults& faults) { m_server.SetFaults(faults); }
+
+    // send Cache-Control: max-age=nSeconds, or none if it is negative.
+    // Call before Start.
+    void SetMaxAge(int nSeconds) { m_server.SetMaxAge(nSeconds); }
+
+    // send static maps scaled to the mapSize asked for.  Call before Start.
+    void SetScaleToMapSize(bool bScale) { m_bScaleToMapSize = bScale; }
+
+    // listen on 127.0.0.1:nPort, or on a free port if nPort is 0
+    bool Start(uint16_t nPort = 0) { return m_server.Start(nPort); }
+    void Stop() { m_server.Stop(); }
+
+    uint16_t Port() const { return m_server.Port(); }
+
+    // http://127.0.0.1:<port>, for BuildMapUrl or GraphicsTestWin32's /server
+    std::string BaseUrl() const;
+
+    LocalHttpServer::Stats GetStats() const { return m_server.GetStats(); }
+
+    size_t MapCount() const { return m_maps.size(); }
+    size_t TileCount() const { return m_tiles.size(); }
+
+private:
+    struct StaticMap
+    {
+        std::string     strPlace;       // "seattle", from seattle_800x500.jpg
+        LocalHttpFile   file;
+    };
+
+    // the index of a static map in m_maps, and the size it is scaled to
+    typedef std::tuple<size_t, int, int> ScaledMapKey;
+
+    const LocalHttpFile* Resolve(const std::string& strPath, const std::string& strQuery) const;
+
+    // m_maps[nMap] at nWidth x nHeight, scaled the first time it is asked for.
+    // Returns the map as it is if it can't be scaled.
+    const LocalHttpFile* ScaledMap(size_t nMap, int nWidth, int nHeight) const;
+
+    std::vector<StaticMap>      m_maps;
+    std::vector<LocalHttpFile>  m_tiles;
+
+    bool                        m_bScaleToMapSize = false;
+
+    // the scaled maps.  They are never removed, so the server can hold on
+    // to one while it is sent.
+    mutable std::mutex          m_scaledMutex;
+    mutable std::map<ScaledMapKey, std::unique_ptr<LocalHttpFile>> m_scaledMaps;
+
+    LocalHttpServer             m_server;
+};
+
+// the fault options shared by MockMapServer and MapLoadTest, e.g.
+// "--latency 20".  Returns true, and moves i past the value, if argv[i]
+// is one of them.
+bool ParseFaultOption(int argc, char** argv, int& i, LocalHttpFaults& faults);
+
+// the help text for ParseFaultOption's options
+extern const char kFaultOptionsUsage[];
@@ -0,0 +1,115 @@
+// MockMapServerMain.cpp : Runs a MockMapServer until it is interrupted.
+//
+// Point GraphicsTestWin32 at it with /server, e.g.
+//
+//      MockMapServer --port 8080 --latency 50 --jitter 50
+//      GraphicsTestWin32.exe /server http://127.0.0.1:8080
+//
+// Run with --help for the options.
+#include <csignal>
+#include <pthread.h>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "MockMapServer.h"
+
+#ifndef MAPBENCH_FIXTURES_DIR
+#define MAPBENCH_FIXTURES_DIR "Fixtures"
+#endif
+
+namespace
+{
+    void PrintUsage()
+    {
+        printf(
+            "usage: MockMapServer [options]\n"
+            "  --port N                listen on 127.0.0.1:N (default 8080, 0 for any)\n"
+            "  --fixtures DIR          the recorded JPEGs (default %s)\n"
+            "  --max-age SECONDS       send Cache-Control: max-age=SECONDS (default none)\n"
+            "  --scale-maps            send static maps scaled to the mapSize asked for\n"
+            "%s",
+            MAPBENCH_FIXTURES_DIR, kFaultOptionsUsage);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::string strFixtures = MAPBENCH_FIXTURES_DIR;
+    uint16_t nPort = 8080;
+    int nMaxAgeSeconds = -1;
+    bool bScaleMaps = false;
+    LocalHttpFaults faults;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string strArg = argv[i];
+
+        if ("--port" == strArg && i + 1 < argc)
+        {
+            nPort = (uint16_t)atoi(argv[++i]);
+        }
+        else if ("--fixtures" == strArg && i + 1 < argc)
+        {
+            strFixtures = argv[++i];
+        }
+        else if ("--max-age" == strArg && i + 1 < argc)
+        {
+            nMaxAgeSeconds = atoi(argv[++i]);
+        }
+        else if ("--scale-maps" == strArg)
+        {
+            bScaleMaps = true;
+        }
+        else if (!ParseFaultOption(argc, argv, i, faults))
+        {
+            PrintUsage();
+            return 2;
+        }
+    }
+
+    // wait for ^C or a kill with the signals blocked, so that sigwait gets
+    // them rather than the connection threads
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    MockMapServer server;
+
+    if (!server.LoadFixtures(strFixtures))
+    {
+        fprintf(stderr, "MockMapServer: no static maps or tiles in %s\n", strFixtures.c_str());
+        return 2;
+    }
+
+    server.SetFaults(faults);
+    server.SetMaxAge(nMaxAgeSeconds);
+    server.SetScaleToMapSize(bScaleMaps);
+
+    if (!server.Start(nPort))
+    {
+        fprintf(stderr, "MockMapServer: could not listen on port %u\n", (unsigned)nPort);
+        return 2;
+    }
+
+    printf("MockMapServer: %zu maps and %zu tiles at %s\n", server.MapCount(), server.TileCount(),
+        server.BaseUrl().c_str());
+    fflush(stdout);
+
+    int nSignal = 0;
+    sigwait(&signals, &nSignal);
+
+    server.Stop();
+
+    LocalHttpServer::Stats stats = server.GetStats();
+
+    printf("MockMapServer: %llu requests, %llu not found, %llu errors, %llu truncated, %llu stalled, "
+        "%llu not modified, %.1f MB sent\n",
+        (unsigned long long)stats.nRequests, (unsigned long long)stats.nNotFound,
+        (unsigned long long)stats.nErrors, (unsigned long long)stats.nTruncated,
+        (unsigned long long)stats.nStalled, (unsigned long long)stats.nNotModified, stats.nBodyBytes / 1e6);
+
+    return 0;
+}
@@ -0,0 +1,205 @@
+// ColorConvert.cpp : JPEG YCbCr to 32bpp BGRX pixel conversion.
+//
+#include "ColorConvert.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define COLORCONVERT_SSE2 1
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+    // libjpeg's 16.16 fixed point constants for the JFIF conversion
+    //      R = Y                + 1.40200 * Cr
+    //      G = Y - 0.34414 * Cb - 0.71414 * Cr
+    //      B = Y + 1.77200 * Cb
+    // with Cb and Cr centered on zero
+    const int kScaleBits = 16;
+    const int kOneHalf = 1 << (kScaleBits - 1);
+    const int kCrToR = 91881;       // 1.40200 * 65536
+    const int kCbToG = 22554;       // 0.34414 * 65536
+    const int kCrToG = 46802;       // 0.71414 * 65536
+    const int kCbToB = 116130;      // 1.77200 * 65536
+
+    inline uint8_t Clamp(int n)
+    {
+        return (uint8_t)((n < 0) ? 0 : ((n > 255) ? 255 : n));
+    }
+
+    inline void ConvertPixel(int y, int cb, int cr, uint8_t* pBgrx)
+    {
+        cb -= 128;
+        cr -= 128;
+
+        pBgrx[0] = Clamp(y + ((kCbToB * cb + kOneHalf) >> kScaleBits));
+        pBgrx[1] = Clamp(y + ((-kCbToG * cb - kCrToG * cr + kOneHalf) >> kScaleBits));
+        pBgrx[2] = Clamp(y + ((kCrToR * cr + kOneHalf) >> kScaleBits));
+        pBgrx[3] = 0xFF;
+    }
+
+#ifdef COLORCONVERT_SSE2
+
+    // The vector code multiplies 16 bit chroma by 15 bit fixed point
+    // constants with _mm_madd_epi16, which multiplies pairs of lanes and
+    // adds each pair into 32 bits.  G takes Cb and Cr as a pair.  The R and
+    // B constants are too big for 16 bits, so each is split in two halves
+    // and the chroma value is paired with itself.
+    const short kCrToR15a = 22970;  // 1.40200 * 32768, in two halves
+    const short kCrToR15b = 22971;
+    const short kCbToG15 = -11277;  // 0.34414 * 32768
+    const short kCrToG15 = -23401;  // 0.71414 * 32768
+    const short kCbToB15a = 29032;  // 1.77200 * 32768, in two halves
+    const short kCbToB15b = 29033;
+
+    // two 16 bit constants, low lane first, for _mm_madd_epi16
+    inline __m128i Pair(short lo, short hi)
+    {
+        return _mm_set1_epi32((int)((unsigned int)(unsigned short)lo | ((unsigned int)(unsigned short)hi << 16)));
+    }
+
+    // multiply-add two interleaved halves and scale back down, rounding
+    inline __m128i MulAdd(__m128i lo, __m128i hi, __m128i coefficients)
+    {
+        const __m128i round = _mm_set1_epi32(1 << 14);
+
+        __m128i productLo = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(lo, coefficients), round), 15);
+        __m128i productHi = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(hi, coefficients), round), 15);
+
+        return _mm_packs_epi32(productLo, productHi);
+    }
+
+    // convert 8 pixels, held as 16 bit lanes, and return B, G and R
+    inline void Convert8(__m128i y, __m128i cb, __m128i cr,
+        __m128i& b, __m128i& g, __m128i& r)
+    {
+        const __m128i bias = _mm_set1_epi16(128);
+
+        cb = _mm_sub_epi16(cb, bias);
+        cr = _mm_sub_epi16(cr, bias);
+
+        r = _mm_add_epi16(y, MulAdd(_mm_unpacklo_epi16(cr, cr), _mm_unpackhi_epi16(cr, cr),
+            Pair(kCrToR15a, kCrToR15b)));
+        g = _mm_add_epi16(y, MulAdd(_mm_unpacklo_epi16(cb, cr), _mm_unpackhi_epi16(cb, cr),
+            Pair(kCbToG15, kCrToG15)));
+        b = _mm_add_epi16(y, MulAdd(_mm_unpacklo_epi16(cb, cb), _mm_unpackhi_epi16(cb, cb),
+            Pair(kCbToB15a, kCbToB15b)));
+    }
+
+    // convert 16 pixels whose Y, Cb and Cr are in the 16 bytes of each
+    // register, and store them as 64 bytes of BGRX
+    inline void Convert16(__m128i y, __m128i cb, __m128i cr, uint8_t* pBgrx)
+    {
+        const __m128i zero = _mm_setzero_si128();
+
+        __m128i bLo, gLo, rLo, bHi, gHi, rHi;
+
+        Convert8(_mm_unpacklo_epi8(y, zero), _mm_unpacklo_epi8(cb, zero), _mm_unpacklo_epi8(cr, zero),
+            bLo, gLo, rLo);
+        Convert8(_mm_unpackhi_epi8(y, zero), _mm_unpackhi_epi8(cb, zero), _mm_unpackhi_epi8(cr, zero),
+            bHi, gHi, rHi);
+
+        // saturate back to bytes, which is the clamp to 0..255
+        __m128i b = _mm_packus_epi16(bLo, bHi);
+        __m128i g = _mm_packus_epi16(gLo, gHi);
+        __m128i r = _mm_packus_epi16(rLo, rHi);
+        __m128i x = _mm_set1_epi8((char)0xFF);
+
+        // interleave into B G R X
+        __m128i bgLo = _mm_unpacklo_epi8(b, g);
+        __m128i bgHi = _mm_unpackhi_epi8(b, g);
+        __m128i rxLo = _mm_unpacklo_epi8(r, x);
+        __m128i rxHi = _mm_unpackhi_epi8(r, x);
+
+        __m128i* pOut = reinterpret_cast<__m128i*>(pBgrx);
+
+        _mm_storeu_si128(pOut + 0, _mm_unpacklo_epi16(bgLo, rxLo));
+        _mm_storeu_si128(pOut + 1, _mm_unpackhi_epi16(bgLo, rxLo));
+        _mm_storeu_si128(pOut + 2, _mm_unpacklo_epi16(bgHi, rxHi));
+        _mm_storeu_si128(pOut + 3, _mm_unpackhi_epi16(bgHi, rxHi));
+    }
+
+#endif // COLORCONVERT_SSE2
+}
+
+void YCbCrRowToBgrxScalar(const uint8_t* pY, const uint8_t* pCb, const uint8_t* pCr,
+    int nChromaShift, uint8_t* pBgrx, int nWidth)
+{
+    for (int x = 0; x < nWidth; x++)
+    {
+        int c = x >> nChromaShift;
+
+        ConvertPixel(pY[x], pCb[c], pCr[c], pBgrx + (size_t)x * 4);
+    }
+}
+
+void YCbCrRowToBgrx(const uint8_t* pY, const uint8_t* pCb, const uint8_t* pCr,
+    int nChromaShift, uint8_t* pBgrx, int nWidth)
+{
+    int x = 0;
+
+#ifdef COLORCONVERT_SSE2
+    for (; x + 16 <= nWidth; x += 16)
+    {
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pY + x));
+        __m128i cb, cr;
+
+        if (nChromaShift)
+        {
+            // 8 chroma samples, each doubled to cover two pixels
+            cb = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(pCb + x / 2));
+            cr = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(pCr + x / 2));
+            cb = _mm_unpacklo_epi8(cb, cb);
+            cr = _mm_unpacklo_epi8(cr, cr);
+        }
+        else
+        {
+            cb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pCb + x));
+            cr = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pCr + x));
+        }
+
+        Convert16(y, cb, cr, pBgrx + (size_t)x * 4);
+    }
+#endif
+
+    // the last few pixels, or all of them without SSE2
+    for (; x < nWidth; x++)
+    {
+        int c = x >> nChromaShift;
+
+        ConvertPixel(pY[x], pCb[c], pCr[c], pBgrx + (size_t)x * 4);
+    }
+}
+
+void GrayRowToBgrx(const uint8_t* pGray, uint8_t* pBgrx, int nWidth)
+{
+    for (int x = 0; x < nWidth; x++)
+    {
+        uint8_t* pPixel = pBgrx + (size_t)x * 4;
+
+        pPixel[0] = pPixel[1] = pPixel[2] = pGray[x];
+        pPixel[3] = 0xFF;
+    }
+}
+
+void RgbRowToBgrx(const uint8_t* pRgb, uint8_t* pBgrx, int nWidth)
+{
+    for (int x = 0; x < nWidth; x++)
+    {
+        const uint8_t* pIn = pRgb + (size_t)x * 3;
+        uint8_t* pPixel = pBgrx + (size_t)x * 4;
+
+        pPixel[0] = pIn[2];
+        pPixel[1] = pIn[1];
+        pPixel[2] = pIn[0];
+        pPixel[3] = 0xFF;
+    }
+}
+
+bool ColorConvertHasSimd()
+{
+#ifdef COLORCONVERT_SSE2
+    return true;
+#else
+    return false;
+#endif
+}
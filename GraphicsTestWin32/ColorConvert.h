@@ -0,0 +1,35 @@
+// ColorConvert.h : JPEG YCbCr to 32bpp BGRX pixel conversion.
+//
+// A JPEG stores its pixels as luma (Y) and two chroma planes (Cb, Cr),
+// with the chroma usually at half the horizontal and vertical resolution.
+// These functions turn one row of planes into one row of the 32bpp BGRX
+// pixels MapImage and the DIB functions use, blue first, the fourth
+// byte 0xFF.
+//
+// The conversion is the JFIF one libjpeg uses.  YCbCrRowToBgrx uses SSE2
+// when the compiler targets it and falls back to the scalar reference,
+// YCbCrRowToBgrxScalar, everywhere else.  The two agree to within one
+// step of each color channel.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// convert nWidth pixels.  When nChromaShift is 1 the chroma rows are half
+// as wide as the luma row, each chroma sample covering two pixels; when it
+// is 0 they are the same width.
+void YCbCrRowToBgrx(const uint8_t* pY, const uint8_t* pCb, const uint8_t* pCr,
+    int nChromaShift, uint8_t* pBgrx, int nWidth);
+
+// the portable reference for YCbCrRowToBgrx
+void YCbCrRowToBgrxScalar(const uint8_t* pY, const uint8_t* pCb, const uint8_t* pCr,
+    int nChromaShift, uint8_t* pBgrx, int nWidth);
+
+// a grayscale row, each gray value becoming B, G and R
+void GrayRowToBgrx(const uint8_t* pGray, uint8_t* pBgrx, int nWidth);
+
+// an RGB row, 3 bytes a pixel, as libjpeg writes when it converts colors itself
+void RgbRowToBgrx(const uint8_t* pRgb, uint8_t* pBgrx, int nWidth);
+
+// true if YCbCrRowToBgrx is vectorized in this build
+bool ColorConvertHasSimd();
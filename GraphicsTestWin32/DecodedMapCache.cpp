@@ -0,0 +1,468 @@
+// DecodedMapCache.cpp : A persistent cache of decoded maps, as raw pixels.
+//
+#include "DecodedMapCache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <system_error>
+#include <vector>
+
+#include "MapImage.h"
+#include "MappedFile.h"
+
+namespace fs = std::filesystem;
+
+namespace
+{
+    // every cache file starts with this header, followed by the canonical
+    // request key (so hash collisions can be detected), the ETag and the
+    // Last-Modified date, then zeros up to pixelOffset, then the rows of
+    // the map, top first, exactly as MapImage holds them
+    struct DecodedFileHeader
+    {
+        uint32_t    magic;          // kDecodedFileMagic
+        uint32_t    version;        // kDecodedFileVersion
+        uint32_t    pixelOffset;    // offset of the first row from the start of the file
+        uint32_t    keyLength;      // bytes of canonical key following this header
+        uint32_t    eTagLength;     // bytes of ETag following the key
+        uint32_t    lastModifiedLength; // bytes of Last-Modified following the ETag
+        uint32_t    maxAgeSeconds;  // MapValidators::nMaxAgeSeconds
+        uint32_t    width;
+        uint32_t    height;
+        uint32_t    stride;         // always width * 4, but checked rather than assumed
+        int64_t     fetchedAt;      // MapValidators::nFetchedAt
+    };
+
+    const uint32_t kDecodedFileMagic = 0x4D445447;    // "GTDM"
+    const uint32_t kDecodedFileVersion = 1;
+
+    // the rows start on a page boundary, so the pages of a map hold only
+    // pixels and the first row is as aligned as a heap MapImage's
+    const uint32_t kPixelAlignment = 4096;
+
+    // the longest ETag or Last-Modified kept; anything longer isn't one
+    const size_t kMaxValidatorLength = 1024;
+
+    const char* const kDecodedFileExtension = ".bgrx";
+    const char* const kTempFileExtension = ".tmp";
+}
+
+DecodedMapCache::DecodedMapCache(const fs::path& directory, uint64_t nMaxBytes)
+    : m_directory(directory),
+      m_nMaxBytes(nMaxBytes),
+      m_nTotalBytes(0)
+{
+}
+
+bool DecodedMapCache::Open()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    std::error_code ec;
+
+    fs::create_directories(m_directory, ec);
+
+    if (!fs::is_directory(m_directory, ec))
+    {
+        return false;
+    }
+
+    struct FoundFile
+    {
+        std::string         fileName;
+        uint64_t            nBytes;
+        fs::file_time_type  lastUsed;
+    };
+
+    std::vector<FoundFile> found;
+
+    for (fs::directory_iterator it(m_directory, ec), end; !ec && it != end; it.increment(ec))
+    {
+        const fs::path& path = it->path();
+
+        if (path.extension() == kTempFileExtension)
+        {
+            // left behind by a Store that never finished
+            fs::remove(path, ec);
+            continue;
+        }
+
+        if (path.extension() != kDecodedFileExtension || !it->is_regular_file(ec))
+        {
+            continue;
+        }
+
+        FoundFile file;
+        file.fileName = path.filename().string();
+        file.nBytes = it->file_size(ec);
+        file.lastUsed = it->last_write_time(ec);
+
+        if (!ec)
+        {
+            found.push_back(file);
+        }
+
+        ec.clear();
+    }
+
+    // the write time of each file is bumped when it is used, so sorting
+    // newest first rebuilds the LRU order from the previous run
+    std::sort(found.begin(), found.end(),
+        [](const FoundFile& a, const FoundFile& b) { return a.lastUsed > b.lastUsed; });
+
+    m_lru.clear();
+    m_index.clear();
+    m_nTotalBytes = 0;
+
+    for (const FoundFile& file : found)
+    {
+        m_lru.push_back(Entry{ file.fileName, file.nBytes });
+        m_index[file.fileName] = std::prev(m_lru.end());
+        m_nTotalBytes += file.nBytes;
+    }
+
+    EvictLocked();
+
+    return true;
+}
+
+MapImageHandle DecodedMapCache::Lookup(const MapRequestKey& key, MapValidators* pValidatorsOut)
+{
+    std::string fileName = FileNameForKey(key);
+    std::string strKey = key.ToCanonicalString();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto found = m_index.find(fileName);
+
+    if (found == m_index.end())
+    {
+        return nullptr;
+    }
+
+    // the image keeps the file mapped, so it is shared rather than moved
+    // into a view the way the DiskMapCache does it
+    std::shared_ptr<MappedFile> pFile = std::make_shared<MappedFile>();
+
+    if (!pFile->Open(m_directory / fileName))
+    {
+        RemoveLocked(fileName);
+        return nullptr;
+    }
+
+    DecodedFileHeader header;
+
+    if (pFile->Size() < sizeof(header))
+    {
+        RemoveLocked(fileName);
+        return nullptr;
+    }
+
+    memcpy(&header, pFile->Data(), sizeof(header));
+
+    // throw away anything that isn't a current cache file for this exact
+    // key, or whose rows don't all fit in the file.  Reading only the
+    // header and key touches just the first page of the file.  Wrap
+    // turns away sizes no decoder would have made.
+    bool bValid = header.magic == kDecodedFileMagic &&
+        header.version == kDecodedFileVersion &&
+        header.keyLength == strKey.size() &&
+        header.eTagLength <= kMaxValidatorLength &&
+        header.lastModifiedLength <= kMaxValidatorLength &&
+        header.pixelOffset % kPixelAlignment == 0 &&
+        header.pixelOffset >= (uint64_t)sizeof(header) + header.keyLength + header.eTagLength + header.lastModifiedLength &&
+        header.pixelOffset <= pFile->Size() &&
+        header.width > 0 && header.height > 0 &&
+        header.stride == (uint64_t)header.width * 4 &&
+        (uint64_t)header.stride * header.height <= pFile->Size() - header.pixelOffset &&
+        0 == memcmp(pFile->Data() + sizeof(header), strKey.data(), strKey.size());
+
+    if (!bValid)
+    {
+        pFile.reset();
+        RemoveLocked(fileName);
+        return nullptr;
+    }
+
+    const uint8_t* pPixels = pFile->Data() + header.pixelOffset;
+    size_t nPixelBytes = pFile->Size() - header.pixelOffset;
+
+    MapImageHandle image = MapImage::Wrap((int)header.width, (int)header.height, pPixels, nPixelBytes, pFile);
+
+    if (!image)
+    {
+        pFile.reset();
+        RemoveLocked(fileName);
+        return nullptr;
+    }
+
+    TouchLocked(found->second);
+
+    if (pValidatorsOut)
+    {
+        const char* pValidators = reinterpret_cast<const char*>(pFile->Data()) + sizeof(header) + header.keyLength;
+
+        pValidatorsOut->strETag.assign(pValidators, header.eTagLength);
+        pValidatorsOut->strLastModified.assign(pValidators + header.eTagLength, header.lastModifiedLength);
+        pValidatorsOut->nMaxAgeSeconds = header.maxAgeSeconds;
+        pValidatorsOut->nFetchedAt = header.fetchedAt;
+    }
+
+    return image;
+}
+
+bool DecodedMapCache::Store(const MapRequestKey& key, const MapImage& image, const MapValidators* pValidators)
+{
+    if (nullptr == image.Pixels() || image.Width() <= 0 || image.Height() <= 0 ||
+        image.Stride() != (size_t)image.Width() * 4)
+    {
+        return false;
+    }
+
+    std::string fileName = FileNameForKey(key);
+    std::string strKey = key.ToCanonicalString();
+
+    // a map with no validators can't be revalidated, only downloaded
+    // again once it is stale
+    MapValidators validators;
+
+    if (pValidators)
+    {
+        validators = *pValidators;
+    }
+
+    if (validators.strETag.size() > kMaxValidatorLength)
+    {
+        validators.strETag.clear();
+    }
+
+    if (validators.strLastModified.size() > kMaxValidatorLength)
+    {
+        validators.strLastModified.clear();
+    }
+
+    DecodedFileHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = kDecodedFileMagic;
+    header.version = kDecodedFileVersion;
+    header.keyLength = (uint32_t)strKey.size();
+    header.eTagLength = (uint32_t)validators.strETag.size();
+    header.lastModifiedLength = (uint32_t)validators.strLastModified.size();
+    header.maxAgeSeconds = validators.nMaxAgeSeconds;
+    header.width = (uint32_t)image.Width();
+    header.height = (uint32_t)image.Height();
+    header.stride = (uint32_t)image.Stride();
+    header.fetchedAt = validators.nFetchedAt;
+
+    size_t nHeaderBytes = sizeof(header) + strKey.size() +
+        validators.strETag.size() + validators.strLastModified.size();
+
+    header.pixelOffset = (uint32_t)((nHeaderBytes + kPixelAlignment - 1) / kPixelAlignment * kPixelAlignment);
+
+    uint64_t nFileBytes = header.pixelOffset + (uint64_t)image.ByteSize();
+
+    // a single map larger than the whole cache is not worth keeping
+    if (nFileBytes > MaxBytes())
+    {
+        return false;
+    }
+
+    // write to a temporary file and rename it into place, so a reader
+    // never sees a partially written map, and one that has the old file
+    // mapped keeps it
+    fs::path finalPath = m_directory / fileName;
+    fs::path tempPath = finalPath;
+    tempPath.replace_extension(kTempFileExtension);
+
+    {
+        std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+
+        if (!out)
+        {
+            return false;
+        }
+
+        std::vector<char> padding(header.pixelOffset - nHeaderBytes, 0);
+
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(strKey.data(), (std::streamsize)strKey.size());
+        out.write(validators.strETag.data(), (std::streamsize)validators.strETag.size());
+        out.write(validators.strLastModified.data(), (std::streamsize)validators.strLastModified.size());
+        out.write(padding.data(), (std::streamsize)padding.size());
+        out.write(reinterpret_cast<const char*>(image.Pixels()), (std::streamsize)image.ByteSize());
+
+        if (!out)
+        {
+            out.close();
+
+            std::error_code ec;
+            fs::remove(tempPath, ec);
+
+            return false;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    std::error_code ec;
+    fs::rename(tempPath, finalPath, ec);
+
+    if (ec)
+    {
+        fs::remove(tempPath, ec);
+        return false;
+    }
+
+    auto found = m_index.find(fileName);
+
+    if (found != m_index.end())
+    {
+        m_nTotalBytes -= found->second->nBytes;
+        found->second->nBytes = nFileBytes;
+        m_lru.splice(m_lru.begin(), m_lru, found->second);
+    }
+    else
+    {
+        m_lru.push_front(Entry{ fileName, nFileBytes });
+        m_index[fileName] = m_lru.begin();
+    }
+
+    m_nTotalBytes += nFileBytes;
+
+    EvictLocked();
+
+    return true;
+}
+
+bool DecodedMapCache::UpdateValidators(const MapRequestKey& key, const MapValidators& validators)
+{
+    std::shared_ptr<MapImage> pCopy;
+
+    {
+        MapImageHandle image = Lookup(key);
+
+        if (!image)
+        {
+            return false;
+        }
+
+        // Windows won't rename a file over one that is mapped, so the
+        // pixels are copied out and the old file unmapped before the new
+        // one is renamed over it.  A 304 only comes once a map's max-age
+        // is up, so rewriting the whole file costs little.
+        pCopy = MapImage::Create(image->Width(), image->Height());
+
+        if (!pCopy)
+        {
+            return false;
+        }
+
+        for (int y = 0; y < image->Height(); y++)
+        {
+            memcpy(pCopy->Row(y), image->Row(y), (size_t)image->Width() * 4);
+        }
+    }
+
+    // if the caller still has the map, the rename fails on Windows and the
+    // old validators stay, so the map is only revalidated again
+    return Store(key, *pCopy, &validators);
+}
+
+void DecodedMapCache::Remove(const MapRequestKey& key)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    RemoveLocked(FileNameForKey(key));
+}
+
+void DecodedMapCache::SetMaxBytes(uint64_t nMaxBytes)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_nMaxBytes = nMaxBytes;
+
+    EvictLocked();
+}
+
+uint64_t DecodedMapCache::MaxBytes() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_nMaxBytes;
+}
+
+uint64_t DecodedMapCache::TotalBytes() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_nTotalBytes;
+}
+
+size_t DecodedMapCache::EntryCount() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_lru.size();
+}
+
+std::string DecodedMapCache::FileNameForKey(const MapRequestKey& key)
+{
+    char szName[32];
+
+    snprintf(szName, sizeof(szName), "%016llx", (unsigned long long)key.Hash());
+
+    return std::string(szName) + kDecodedFileExtension;
+}
+
+void DecodedMapCache::TouchLocked(EntryList::iterator it)
+{
+    m_lru.splice(m_lru.begin(), m_lru, it);
+
+    // persist the LRU order for the next run in the file's write time
+    std::error_code ec;
+    fs::last_write_time(m_directory / it->fileName, fs::file_time_type::clock::now(), ec);
+}
+
+// fileName is taken by value because it is often the name held by
+// the very entry being erased.  An image still mapped from the file
+// keeps its pixels; on Windows the file goes when it is unmapped.
+// A file that can't be removed still takes its space on the disk, so
+// its entry stays, and it is tried again the next time.
+bool DecodedMapCache::RemoveLocked(std::string fileName)
+{
+    std::error_code ec;
+    fs::remove(m_directory / fileName, ec);
+
+    if (ec)
+    {
+        return false;
+    }
+
+    auto found = m_index.find(fileName);
+
+    if (found != m_index.end())
+    {
+        m_nTotalBytes -= found->second->nBytes;
+        m_lru.erase(found->second);
+        m_index.erase(found);
+    }
+
+    return true;
+}
+
+void DecodedMapCache::EvictLocked()
+{
+    // least recently used first, stepping past any file that can't be
+    // removed so that one can't keep the loop going forever
+    EntryList::iterator next = m_lru.end();
+
+    while (m_nTotalBytes > m_nMaxBytes && next != m_lru.begin())
+    {
+        EntryList::iterator victim = std::prev(next);
+
+        if (!RemoveLocked(victim->fileName))
+        {
+            next = victim;
+        }
+    }
+}
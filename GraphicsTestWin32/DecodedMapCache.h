@@ -0,0 +1,100 @@
+// DecodedMapCache.h : A persistent cache of decoded maps, as raw pixels.
+//
+// The DiskMapCache keeps maps as the JPEG or PNG bytes the server sent, so
+// every map it gives back in a new run still has to be decoded into a
+// freshly allocated MapImage.  DecodedMapCache keeps maps as the 32bpp BGRX
+// rows a MapImage holds, after a small header, with the rows starting on a
+// page boundary.  A map is given back as a MapImage whose pixels are the
+// memory-mapped file itself, so a map that was shown in a previous run is
+// shown again with no decode and no copy, and the operating system only
+// reads the pages of it that are painted.
+//
+// Each file keeps the map's MapValidators too, the same way the
+// DiskMapCache does, so a map read from it can still be revalidated.
+//
+// The files are larger than the images they came from, so the cache has
+// its own directory and size cap.  Like the DiskMapCache it has no Windows
+// dependencies and can be used from any thread.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "MapBitmapStore.h"
+#include "MapRequest.h"
+#include "MapRevalidation.h"
+
+class DecodedMapCache
+{
+public:
+    // the default size cap of the cache directory; a full-size static map
+    // is about 2 MB of pixels
+    static const uint64_t kDefaultMaxBytes = 512ULL * 1024 * 1024;
+
+    DecodedMapCache(const std::filesystem::path& directory, uint64_t nMaxBytes = kDefaultMaxBytes);
+
+    DecodedMapCache(const DecodedMapCache&) = delete;
+    DecodedMapCache& operator=(const DecodedMapCache&) = delete;
+
+    // create the cache directory if necessary and index the maps already
+    // in it, oldest first.  Returns false if the directory can't be used.
+    bool Open();
+
+    // the map for key, its pixels mapped straight from the cache file, or
+    // an empty handle on a miss.  The file stays mapped until the last
+    // handle to the image goes.  pValidatorsOut, if given, is set to what
+    // the server said about it.  A hit makes the entry the most recently
+    // used.
+    MapImageHandle Lookup(const MapRequestKey& key, MapValidators* pValidatorsOut = nullptr);
+
+    // write the pixels of image to the cache for key, replacing any
+    // previous version, and evict least-recently-used entries to stay
+    // under the cap.  pValidators, if given, are kept with it.
+    bool Store(const MapRequestKey& key, const MapImage& image, const MapValidators* pValidators = nullptr);
+
+    // replace the validators kept with the map for key, after a 304.
+    // Returns false if key isn't cached.
+    bool UpdateValidators(const MapRequestKey& key, const MapValidators& validators);
+
+    // remove the map for key from the cache
+    void Remove(const MapRequestKey& key);
+
+    // change the size cap, evicting entries if necessary
+    void SetMaxBytes(uint64_t nMaxBytes);
+
+    uint64_t MaxBytes() const;
+    uint64_t TotalBytes() const;
+    size_t EntryCount() const;
+
+    const std::filesystem::path& Directory() const { return m_directory; }
+
+private:
+    struct Entry
+    {
+        std::string     fileName;
+        uint64_t        nBytes;
+    };
+
+    typedef std::list<Entry> EntryList;
+
+    static std::string FileNameForKey(const MapRequestKey& key);
+
+    void TouchLocked(EntryList::iterator it);
+    bool RemoveLocked(std::string fileName);
+    void EvictLocked();
+
+    std::filesystem::path   m_directory;
+    uint64_t                m_nMaxBytes;
+    uint64_t                m_nTotalBytes;
+
+    // most recently used at the front
+    EntryList               m_lru;
+    std::unordered_map<std::string, EntryList::iterator> m_index;
+
+    mutable std::mutex      m_mutex;
+};
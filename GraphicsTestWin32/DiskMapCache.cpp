@@ -0,0 +1,412 @@
+// DiskMapCache.cpp : A persistent, size-capped cache of downloaded map images.
+//
+#include "DiskMapCache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <system_error>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+    // every cache file starts with this header, followed by the canonical
+    // request key (so hash collisions can be detected), the ETag and the
+    // Last-Modified date, followed by the image bytes exactly as they came
+    // from the server
+    struct CacheFileHeader
+    {
+        uint32_t    magic;          // kCacheFileMagic
+        uint32_t    version;        // kCacheFileVersion
+        uint32_t    headerSize;     // offset of the image bytes from the start of the file
+        uint32_t    keyLength;      // bytes of canonical key following this header
+        uint32_t    eTagLength;     // bytes of ETag following the key
+        uint32_t    lastModifiedLength; // bytes of Last-Modified following the ETag
+        uint32_t    maxAgeSeconds;  // MapValidators::nMaxAgeSeconds
+        uint32_t    reserved;
+        int64_t     fetchedAt;      // MapValidators::nFetchedAt
+    };
+
+    const uint32_t kCacheFileMagic = 0x434D5447;      // "GTMC"
+
+    // version 1 files had no validators, and are thrown away and
+    // downloaded again when they are next wanted
+    const uint32_t kCacheFileVersion = 2;
+
+    // the longest ETag or Last-Modified kept; anything longer isn't one
+    const size_t kMaxValidatorLength = 1024;
+
+    const char* const kCacheFileExtension = ".map";
+    const char* const kTempFileExtension = ".tmp";
+}
+
+DiskMapCache::DiskMapCache(const fs::path& directory, uint64_t nMaxBytes)
+    : m_directory(directory),
+      m_nMaxBytes(nMaxBytes),
+      m_nTotalBytes(0)
+{
+}
+
+bool DiskMapCache::Open()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    std::error_code ec;
+
+    fs::create_directories(m_directory, ec);
+
+    if (!fs::is_directory(m_directory, ec))
+    {
+        return false;
+    }
+
+    struct FoundFile
+    {
+        std::string         fileName;
+        uint64_t            nBytes;
+        fs::file_time_type  lastUsed;
+    };
+
+    std::vector<FoundFile> found;
+
+    for (fs::directory_iterator it(m_directory, ec), end; !ec && it != end; it.increment(ec))
+    {
+        const fs::path& path = it->path();
+
+        if (path.extension() == kTempFileExtension)
+        {
+            // left behind by a Store that never finished
+            fs::remove(path, ec);
+            continue;
+        }
+
+        if (path.extension() != kCacheFileExtension || !it->is_regular_file(ec))
+        {
+            continue;
+        }
+
+        FoundFile file;
+        file.fileName = path.filename().string();
+        file.nBytes = it->file_size(ec);
+        file.lastUsed = it->last_write_time(ec);
+
+        if (!ec)
+        {
+            found.push_back(file);
+        }
+
+        ec.clear();
+    }
+
+    // the write time of each file is bumped when it is used, so sorting
+    // newest first rebuilds the LRU order from the previous run
+    std::sort(found.begin(), found.end(),
+        [](const FoundFile& a, const FoundFile& b) { return a.lastUsed > b.lastUsed; });
+
+    m_lru.clear();
+    m_index.clear();
+    m_nTotalBytes = 0;
+
+    for (const FoundFile& file : found)
+    {
+        m_lru.push_back(Entry{ file.fileName, file.nBytes });
+        m_index[file.fileName] = std::prev(m_lru.end());
+        m_nTotalBytes += file.nBytes;
+    }
+
+    EvictLocked();
+
+    return true;
+}
+
+bool DiskMapCache::Lookup(const MapRequestKey& key, MapCacheView& viewOut)
+{
+    std::string fileName = FileNameForKey(key);
+    std::string strKey = key.ToCanonicalString();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto found = m_index.find(fileName);
+
+    if (found == m_index.end())
+    {
+        return false;
+    }
+
+    MappedFile file;
+
+    if (!file.Open(m_directory / fileName))
+    {
+        RemoveLocked(fileName);
+        return false;
+    }
+
+    CacheFileHeader header;
+
+    if (file.Size() < sizeof(header))
+    {
+        RemoveLocked(fileName);
+        return false;
+    }
+
+    memcpy(&header, file.Data(), sizeof(header));
+
+    // throw away anything that isn't a current cache file for this exact key
+    bool bValid = header.magic == kCacheFileMagic &&
+        header.version == kCacheFileVersion &&
+        header.keyLength == strKey.size() &&
+        header.eTagLength <= kMaxValidatorLength &&
+        header.lastModifiedLength <= kMaxValidatorLength &&
+        header.headerSize >= (uint64_t)sizeof(header) + header.keyLength + header.eTagLength + header.lastModifiedLength &&
+        header.headerSize < file.Size() &&
+        0 == memcmp(file.Data() + sizeof(header), strKey.data(), strKey.size());
+
+    if (!bValid)
+    {
+        file.Close();
+        RemoveLocked(fileName);
+        return false;
+    }
+
+    TouchLocked(found->second);
+
+    const char* pValidators = reinterpret_cast<const char*>(file.Data()) + sizeof(header) + header.keyLength;
+
+    viewOut.validators.strETag.assign(pValidators, header.eTagLength);
+    viewOut.validators.strLastModified.assign(pValidators + header.eTagLength, header.lastModifiedLength);
+    viewOut.validators.nMaxAgeSeconds = header.maxAgeSeconds;
+    viewOut.validators.nFetchedAt = header.fetchedAt;
+
+    viewOut.pData = file.Data() + header.headerSize;
+    viewOut.nSize = file.Size() - header.headerSize;
+    viewOut.file = std::move(file);
+
+    return true;
+}
+
+bool DiskMapCache::Store(const MapRequestKey& key, const uint8_t* pBytes, size_t nBytes,
+    const MapValidators* pValidators)
+{
+    if (nullptr == pBytes || 0 == nBytes)
+    {
+        return false;
+    }
+
+    std::string fileName = FileNameForKey(key);
+    std::string strKey = key.ToCanonicalString();
+
+    // a map with no validators can't be revalidated, only downloaded
+    // again once it is stale
+    MapValidators validators;
+
+    if (pValidators)
+    {
+        validators = *pValidators;
+    }
+
+    if (validators.strETag.size() > kMaxValidatorLength)
+    {
+        validators.strETag.clear();
+    }
+
+    if (validators.strLastModified.size() > kMaxValidatorLength)
+    {
+        validators.strLastModified.clear();
+    }
+
+    CacheFileHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = kCacheFileMagic;
+    header.version = kCacheFileVersion;
+    header.keyLength = (uint32_t)strKey.size();
+    header.eTagLength = (uint32_t)validators.strETag.size();
+    header.lastModifiedLength = (uint32_t)validators.strLastModified.size();
+    header.maxAgeSeconds = validators.nMaxAgeSeconds;
+    header.fetchedAt = validators.nFetchedAt;
+    header.headerSize = (uint32_t)(sizeof(header) + strKey.size() +
+        validators.strETag.size() + validators.strLastModified.size());
+
+    uint64_t nFileBytes = header.headerSize + (uint64_t)nBytes;
+
+    // a single map larger than the whole cache is not worth keeping
+    if (nFileBytes > MaxBytes())
+    {
+        return false;
+    }
+
+    // write to a temporary file and rename it into place, so a reader
+    // never sees a partially written map
+    fs::path finalPath = m_directory / fileName;
+    fs::path tempPath = finalPath;
+    tempPath.replace_extension(kTempFileExtension);
+
+    {
+        std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+
+        if (!out)
+        {
+            return false;
+        }
+
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(strKey.data(), (std::streamsize)strKey.size());
+        out.write(validators.strETag.data(), (std::streamsize)validators.strETag.size());
+        out.write(validators.strLastModified.data(), (std::streamsize)validators.strLastModified.size());
+        out.write(reinterpret_cast<const char*>(pBytes), (std::streamsize)nBytes);
+
+        if (!out)
+        {
+            out.close();
+
+            std::error_code ec;
+            fs::remove(tempPath, ec);
+
+            return false;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    std::error_code ec;
+    fs::rename(tempPath, finalPath, ec);
+
+    if (ec)
+    {
+        fs::remove(tempPath, ec);
+        return false;
+    }
+
+    auto found = m_index.find(fileName);
+
+    if (found != m_index.end())
+    {
+        m_nTotalBytes -= found->second->nBytes;
+        found->second->nBytes = nFileBytes;
+        m_lru.splice(m_lru.begin(), m_lru, found->second);
+    }
+    else
+    {
+        m_lru.push_front(Entry{ fileName, nFileBytes });
+        m_index[fileName] = m_lru.begin();
+    }
+
+    m_nTotalBytes += nFileBytes;
+
+    EvictLocked();
+
+    return true;
+}
+
+bool DiskMapCache::UpdateValidators(const MapRequestKey& key, const MapValidators& validators)
+{
+    MapCacheView cachedMap;
+
+    if (!Lookup(key, cachedMap))
+    {
+        return false;
+    }
+
+    // the image bytes stay mapped from the old file while the new one is
+    // written and renamed over it.  A 304 only comes once a map's max-age
+    // is up, so rewriting the whole file costs little.
+    return Store(key, cachedMap.pData, cachedMap.nSize, &validators);
+}
+
+void DiskMapCache::Remove(const MapRequestKey& key)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    RemoveLocked(FileNameForKey(key));
+}
+
+void DiskMapCache::SetMaxBytes(uint64_t nMaxBytes)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_nMaxBytes = nMaxBytes;
+
+    EvictLocked();
+}
+
+uint64_t DiskMapCache::MaxBytes() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_nMaxBytes;
+}
+
+uint64_t DiskMapCache::TotalBytes() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_nTotalBytes;
+}
+
+size_t DiskMapCache::EntryCount() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_lru.size();
+}
+
+std::string DiskMapCache::FileNameForKey(const MapRequestKey& key)
+{
+    char szName[32];
+
+    snprintf(szName, sizeof(szName), "%016llx", (unsigned long long)key.Hash());
+
+    return std::string(szName) + kCacheFileExtension;
+}
+
+void DiskMapCache::TouchLocked(EntryList::iterator it)
+{
+    m_lru.splice(m_lru.begin(), m_lru, it);
+
+    // persist the LRU order for the next run in the file's write time
+    std::error_code ec;
+    fs::last_write_time(m_directory / it->fileName, fs::file_time_type::clock::now(), ec);
+}
+
+// fileName is taken by value because it is often the name held by
+// the very entry being erased.  A file that can't be removed, one a
+// virus scanner has open say, still takes its space on the disk, so its
+// entry stays, and it is tried again the next time.
+bool DiskMapCache::RemoveLocked(std::string fileName)
+{
+    std::error_code ec;
+    fs::remove(m_directory / fileName, ec);
+
+    if (ec)
+    {
+        return false;
+    }
+
+    auto found = m_index.find(fileName);
+
+    if (found != m_index.end())
+    {
+        m_nTotalBytes -= found->second->nBytes;
+        m_lru.erase(found->second);
+        m_index.erase(found);
+    }
+
+    return true;
+}
+
+void DiskMapCache::EvictLocked()
+{
+    // least recently used first, stepping past any file that can't be
+    // removed so that one can't keep the loop going forever
+    EntryList::iterator next = m_lru.end();
+
+    while (m_nTotalBytes > m_nMaxBytes && next != m_lru.begin())
+    {
+        EntryList::iterator victim = std::prev(next);
+
+        if (!RemoveLocked(victim->fileName))
+        {
+            next = victim;
+        }
+    }
+}
@@ -0,0 +1,104 @@
+// DiskMapCache.h : A persistent, size-capped cache of downloaded map images.
+//
+// Each map is stored in its own file, named by the hash of its
+// MapRequestKey, so a map that was downloaded by a previous run of the
+// program can be displayed again without going to the network.  Reads are
+// memory-mapped, so the decoder is fed directly from the file cache rather
+// than from a heap copy.
+//
+// Each file also keeps the map's MapValidators, the ETag, Last-Modified and
+// max-age the server sent with it, so a map read from the cache in a later
+// run can still be revalidated with a conditional request.
+//
+// The cache has no Windows dependencies and can be used from any thread.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "MapRequest.h"
+#include "MapRevalidation.h"
+#include "MappedFile.h"
+
+// a cached map image, mapped into memory.  The image bytes stay valid
+// until the MapCacheView is destroyed or reused.
+struct MapCacheView
+{
+    MappedFile      file;
+    const uint8_t*  pData = nullptr;      // the image bytes, inside the mapped file
+    size_t          nSize = 0;            // the number of image bytes
+    MapValidators   validators;           // what the server said about it
+};
+
+class DiskMapCache
+{
+public:
+    // the default size cap of the cache directory
+    static const uint64_t kDefaultMaxBytes = 256ULL * 1024 * 1024;
+
+    DiskMapCache(const std::filesystem::path& directory, uint64_t nMaxBytes = kDefaultMaxBytes);
+
+    DiskMapCache(const DiskMapCache&) = delete;
+    DiskMapCache& operator=(const DiskMapCache&) = delete;
+
+    // create the cache directory if necessary and index the maps already
+    // in it, oldest first.  Returns false if the directory can't be used.
+    bool Open();
+
+    // map the cached image for key into viewOut.  Returns false on a miss.
+    // A hit makes the entry the most recently used.
+    bool Lookup(const MapRequestKey& key, MapCacheView& viewOut);
+
+    // write the image for key to the cache, replacing any previous
+    // version, and evict least-recently-used entries to stay under the cap.
+    // pValidators, if given, are kept with it.
+    bool Store(const MapRequestKey& key, const uint8_t* pBytes, size_t nBytes,
+        const MapValidators* pValidators = nullptr);
+
+    // replace the validators kept with the image for key, after a 304.
+    // The file is rewritten, the same way Store writes it, so a reader
+    // with it mapped keeps the old one.  Returns false if key isn't cached.
+    bool UpdateValidators(const MapRequestKey& key, const MapValidators& validators);
+
+    // remove the image for key from the cache
+    void Remove(const MapRequestKey& key);
+
+    // change the size cap, evicting entries if necessary
+    void SetMaxBytes(uint64_t nMaxBytes);
+
+    uint64_t MaxBytes() const;
+    uint64_t TotalBytes() const;
+    size_t EntryCount() const;
+
+    const std::filesystem::path& Directory() const { return m_directory; }
+
+private:
+    struct Entry
+    {
+        std::string     fileName;
+        uint64_t        nBytes;
+    };
+
+    typedef std::list<Entry> EntryList;
+
+    static std::string FileNameForKey(const MapRequestKey& key);
+
+    void TouchLocked(EntryList::iterator it);
+    bool RemoveLocked(std::string fileName);
+    void EvictLocked();
+
+    std::filesystem::path   m_directory;
+    uint64_t                m_nMaxBytes;
+    uint64_t                m_nTotalBytes;
+
+    // most recently used at the front
+    EntryList               m_lru;
+    std::unordered_map<std::string, EntryList::iterator> m_index;
+
+    mutable std::mutex      m_mutex;
+};
@@ -0,0 +1,179 @@
+// DownloadBuffer.cpp : A growable, contiguous byte buffer used to read a file
+// from the Internet without copying it more than once.
+//
+#include "DownloadBuffer.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <utility>
+
+DownloadBuffer::DownloadBuffer(std::pmr::memory_resource* pResource)
+    : m_pResource(pResource),
+      m_pBytes(nullptr),
+      m_nSize(0),
+      m_nCapacity(0),
+      m_nAllocations(0)
+{
+}
+
+DownloadBuffer::~DownloadBuffer()
+{
+    Release();
+}
+
+DownloadBuffer::DownloadBuffer(DownloadBuffer&& other) noexcept
+    : m_pResource(other.m_pResource),
+      m_pBytes(other.m_pBytes),
+      m_nSize(other.m_nSize),
+      m_nCapacity(other.m_nCapacity),
+      m_nAllocations(other.m_nAllocations)
+{
+    other.m_pBytes = nullptr;
+    other.m_nSize = 0;
+    other.m_nCapacity = 0;
+    other.m_nAllocations = 0;
+}
+
+DownloadBuffer& DownloadBuffer::operator=(DownloadBuffer&& other) noexcept
+{
+    if (this != &other)
+    {
+        Release();
+
+        std::swap(m_pResource, other.m_pResource);
+        std::swap(m_pBytes, other.m_pBytes);
+        std::swap(m_nSize, other.m_nSize);
+        std::swap(m_nCapacity, other.m_nCapacity);
+        std::swap(m_nAllocations, other.m_nAllocations);
+    }
+
+    return *this;
+}
+
+bool DownloadBuffer::Reserve(size_t nCapacity)
+{
+    // don't let a bogus Content-Length make us allocate the world
+    if (nCapacity > kMaxReserve)
+    {
+        nCapacity = kMaxReserve;
+    }
+
+    if (nCapacity <= m_nCapacity)
+    {
+        return true;
+    }
+
+    return Grow(nCapacity);
+}
+
+uint8_t* DownloadBuffer::PrepareWrite(size_t nMinBytes, size_t* pnAvailable)
+{
+    if (nMinBytes == 0)
+    {
+        nMinBytes = 1;
+    }
+
+    if (m_nCapacity - m_nSize < nMinBytes)
+    {
+        // double the buffer, so a download of unknown size costs
+        // a logarithmic number of allocations and copies
+        size_t nNewCapacity = m_nCapacity * 2;
+
+        if (nNewCapacity < kInitialCapacity)
+        {
+            nNewCapacity = kInitialCapacity;
+        }
+
+        if (nNewCapacity < m_nSize + nMinBytes)
+        {
+            nNewCapacity = m_nSize + nMinBytes;
+        }
+
+        if (!Grow(nNewCapacity))
+        {
+            if (pnAvailable)
+            {
+                *pnAvailable = 0;
+            }
+
+            return nullptr;
+        }
+    }
+
+    if (pnAvailable)
+    {
+        *pnAvailable = m_nCapacity - m_nSize;
+    }
+
+    return m_pBytes + m_nSize;
+}
+
+void DownloadBuffer::CommitWrite(size_t nBytes)
+{
+    // never commit more than was made available
+    if (nBytes > m_nCapacity - m_nSize)
+    {
+        nBytes = m_nCapacity - m_nSize;
+    }
+
+    m_nSize += nBytes;
+}
+
+void DownloadBuffer::Release()
+{
+    if (m_pResource)
+    {
+        if (m_pBytes)
+        {
+            m_pResource->deallocate(m_pBytes, m_nCapacity);
+        }
+    }
+    else
+    {
+        free(m_pBytes);
+    }
+
+    m_pBytes = nullptr;
+    m_nSize = 0;
+    m_nCapacity = 0;
+}
+
+bool DownloadBuffer::Grow(size_t nMinCapacity)
+{
+    uint8_t* pNew = nullptr;
+
+    if (m_pResource)
+    {
+        try
+        {
+            pNew = static_cast<uint8_t*>(m_pResource->allocate(nMinCapacity));
+        }
+        catch (const std::bad_alloc&)
+        {
+            return false;
+        }
+
+        if (m_pBytes)
+        {
+            memcpy(pNew, m_pBytes, m_nSize);
+            m_pResource->deallocate(m_pBytes, m_nCapacity);
+        }
+    }
+    else
+    {
+        // realloc keeps the bytes we have already committed
+        pNew = static_cast<uint8_t*>(realloc(m_pBytes, nMinCapacity));
+
+        if (nullptr == pNew)
+        {
+            return false;
+        }
+    }
+
+    m_pBytes = pNew;
+    m_nCapacity = nMinCapacity;
+    m_nAllocations++;
+
+    return true;
+}
@@ -0,0 +1,87 @@
+// DownloadBuffer.h : A growable, contiguous byte buffer used to read a file
+// from the Internet without copying it more than once.
+//
+// This header is deliberately free of any Windows dependencies so the
+// download path can be built and measured on other platforms.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+
+// DownloadBuffer replaces the old vector of IOVEC chunks in GetBingMap.
+//
+// Instead of reading into a small stack buffer, copying each chunk into its
+// own heap block and then copying all of those blocks into one contiguous
+// buffer again, the caller asks the DownloadBuffer for writable space at the
+// end of its data, reads straight into it, and commits the number of bytes
+// read.  When the server sends a Content-Length the buffer is sized exactly
+// once, up front.  When it doesn't, the buffer grows geometrically, so the
+// number of allocations is logarithmic in the file size rather than linear.
+//
+// The finished bytes are available through Data() and Size() and can be
+// handed to a decoder in place.
+//
+// The memory comes from malloc, or from a memory resource such as a
+// MapRequestArena if one is given.  A resource has no realloc, so growing
+// a buffer that lives in one copies it, and an arena only gets the old
+// block back when the request ends.
+class DownloadBuffer
+{
+public:
+    // the first allocation when we have no size hint from the server
+    static constexpr size_t kInitialCapacity = 64 * 1024;
+
+    // the largest Content-Length we'll trust for an up-front allocation. Bing
+    // static maps are well below this; anything larger grows on demand.
+    static constexpr size_t kMaxReserve = 64 * 1024 * 1024;
+
+    // pResource, if given, must outlive the buffer
+    explicit DownloadBuffer(std::pmr::memory_resource* pResource = nullptr);
+    ~DownloadBuffer();
+
+    DownloadBuffer(const DownloadBuffer&) = delete;
+    DownloadBuffer& operator=(const DownloadBuffer&) = delete;
+
+    DownloadBuffer(DownloadBuffer&& other) noexcept;
+    DownloadBuffer& operator=(DownloadBuffer&& other) noexcept;
+
+    // make sure there is room for at least nCapacity bytes in total.
+    // Typically called with the Content-Length of the response plus one,
+    // so the final zero-byte read doesn't force the buffer to grow.
+    // Returns false if the memory could not be allocated.
+    bool Reserve(size_t nCapacity);
+
+    // return a pointer to at least nMinBytes of writable space following the
+    // data already committed, growing the buffer if necessary. The amount of
+    // space actually available is returned in *pnAvailable.  Returns NULL if
+    // the memory could not be allocated.
+    uint8_t* PrepareWrite(size_t nMinBytes, size_t* pnAvailable);
+
+    // record that nBytes were written into the space returned by PrepareWrite
+    void CommitWrite(size_t nBytes);
+
+    // the downloaded bytes, contiguous
+    const uint8_t* Data() const { return m_pBytes; }
+    size_t Size() const { return m_nSize; }
+    size_t Capacity() const { return m_nCapacity; }
+
+    // the number of times the buffer has been (re)allocated
+    unsigned int AllocationCount() const { return m_nAllocations; }
+
+    // discard the data but keep the memory for reuse
+    void Clear() { m_nSize = 0; }
+
+    // free the memory
+    void Release();
+
+private:
+    bool Grow(size_t nMinCapacity);
+
+    std::pmr::memory_resource* m_pResource;
+
+    uint8_t*        m_pBytes;
+    size_t          m_nSize;
+    size_t          m_nCapacity;
+    unsigned int    m_nAllocations;
+};
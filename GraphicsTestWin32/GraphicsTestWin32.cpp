@@ -4,11 +4,48 @@
 #include "framework.h"
 #include "GraphicsTestWin32.h"
 #include <wininet.h>
+#include <windowsx.h>
 #include <initguid.h>
 #include <atlstr.h>
 #include <vector>
+#include <unordered_map>
+#include <unordered_set>
 #include <wincodec.h>
 #include <wincodecsdk.h>
+#include <shlobj.h>
+#include <shellapi.h>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <fstream>
+#include "DownloadBuffer.h"
+#include "StreamingBuffer.h"
+#include "StreamingBufferStream.h"
+#include "MapRequest.h"
+#include "MapUrl.h"
+#include "MapRequestArena.h"
+#include "DecodedMapCache.h"
+#include "DiskMapCache.h"
+#include "MapSharedCache.h"
+#include "MapScheduler.h"
+#include "MapFetchQueue.h"
+#include "MapSingleFlight.h"
+#include "MapRetry.h"
+#include "MapMetrics.h"
+#include "MapImage.h"
+#include "MapTieredCache.h"
+#include "MapRevalidation.h"
+#include "MapAdaptiveFetch.h"
+#include "MapLocations.h"
+#include "TileLayer.h"
+#include "PixelBlit.h"
+#include "WindowBackBuffer.h"
+#include "ImageScaler.h"
+#include "ViewScroll.h"
+#include "MapPrefetch.h"
+#include "MapBatch.h"
+#include "MapPersistQueue.h"
+#include "HttpSessionPool.h"
 #pragma comment(lib, "WindowsCodecs.lib")
 #pragma comment(lib, "wininet.lib")
 
@@ -27,17 +64,97 @@
 // Macro that releases a COM object if not NULL.
 #define SAFE_RELEASE(p)     do { if ((p)) { (p)->Release(); (p) = NULL; } } while(0)
 
+// An HTTP status as an HRESULT, like the HTTP_E_STATUS_ values in winerror.h.
+#define HRESULT_FROM_HTTP_STATUS(status)    MAKE_HRESULT(SEVERITY_ERROR, FACILITY_HTTP, (status))
+
 // used for calculating scanline stride
 #define DIB_WIDTHBYTES(bits) ((((bits) + 31)>>5)<<2)
 
-// current UI state
-enum class CurrentUIState
+// posted by the map fetch worker threads when a map has been downloaded
+// and decoded.  lParam is a heap-allocated MapFetchCompletion<MapImageHandle>
+// that the WM_APP_MAPREADY handler takes ownership of.
+#define WM_APP_MAPREADY     (WM_APP + 1)
+
+// the number of threads downloading and decoding maps in the background,
+// for the maps on screen, prefetches and revalidation alike
+#define MAP_SCHEDULER_THREADS 6
+
+// posted by the prefetch worker threads for each map fetched at startup.
+// lParam is a heap-allocated MapFetchCompletion<MapPrefetchResult> that
+// the WM_APP_PREFETCHREADY handler takes ownership of.
+#define WM_APP_PREFETCHREADY (WM_APP + 2)
+
+// the most maps fetched in parallel for /prefetch, which leaves threads
+// for the maps the user asks for meanwhile
+#define MAP_PREFETCH_THREADS 4
+
+// how long the window, as it closes, lets the maps still waiting to be
+// written out to the caches be written, in milliseconds.  Those not
+// started by then are left for next time.
+#define MAP_PERSIST_FLUSH_MS 250
+
+// the number of threads rendering maps to files for /batch.  Most of a
+// map's time is spent waiting on the network, so there are more of these
+// than there are processors.
+#define MAP_BATCH_THREADS   16
+
+// the position of the City menu on the menu bar.  Its items are
+// built from g_mapLocations in InitInstance.
+#define CITY_MENU_POSITION  1
+
+// the position of the View menu, which switches between the static
+// map and the tiled map
+#define VIEW_MENU_POSITION  2
+
+// how far the arrow keys move the tiled map, in pixels
+#define TILE_PAN_STEP       64
+
+// the most /retries and the longest /timeout, in milliseconds, the
+// command line may ask for
+#define MAP_MAX_RETRIES     10
+#define MAP_MAX_TIMEOUT_MS  (10 * 60 * 1000)
+
+// the longest /revalidate, in seconds.  IDT_REVALIDATE's interval is in
+// milliseconds, and a day keeps it well inside a UINT.
+#define MAP_MAX_REVALIDATE_SECONDS  (24 * 60 * 60)
+
+// posted by the map fetch worker threads as a streaming decode finishes
+// each band of rows.  lParam is a heap-allocated MapProgress that the
+// WM_APP_MAPPROGRESS handler takes ownership of.
+#define WM_APP_MAPPROGRESS  (WM_APP + 3)
+
+// the number of rows decoded at a time by a streaming decode
+#define MAP_DECODE_BAND_ROWS 32
+
+// posted by the revalidation worker thread when it has asked whether a
+// map has changed.  lParam is a heap-allocated MapFetchCompletion<MapImageHandle>
+// that the WM_APP_MAPREVALIDATED handler takes ownership of.
+#define WM_APP_MAPREVALIDATED (WM_APP + 4)
+
+// the most maps revalidated in the background at once.  Nobody is waiting
+// on them, so one is plenty, and it leaves the connections to the maps the
+// user is waiting on.
+#define MAP_REVALIDATE_THREADS 1
+
+// the timer that sweeps g_mapRevalidation for maps due to be revalidated
+#define IDT_REVALIDATE      1
+
+typedef MapFetchCompletion<MapImageHandle> MapCompletion;
+
+// called on the decoding thread as a streaming decode finishes each band
+// of rows.  The top nRowsReady rows of hMap are final, the rest are not
+// decoded yet.
+typedef std::function<void(const MapImageHandle& hMap, int nRowsReady)> MapProgressCallback;
+
+// how much of a map has been decoded, sent to the UI thread so it can
+// show the part that has arrived
+struct MapProgress
 {
-    START,          // Start, display instructions
-    SEATTLE,		// Display Seattle map
-    PORTLAND,		// Display Portland Map
-    SANFRAN,		// Display San Francisco map
+    MapRequestKey   key;
+    MapImageHandle  hMap;
+    int             nRowsReady;
 };
+typedef MapFetchCompletion<MapPrefetchResult> PrefetchCompletion;
 
 // Global Variables:
 HINSTANCE hInst;                                // current instance
@@ -45,44 +162,43 @@ WCHAR szTitle[MAX_LOADSTRING];                  // The title bar text
 WCHAR szWindowClass[MAX_LOADSTRING];            // the main window class name
 WCHAR szDebugMsg[MAX_DEBUGMSG];                 // for OutputDebugMsg
 
-CurrentUIState		g_uiState = CurrentUIState::START;
+// the most we ask InternetReadFile for in a single call.  The bytes
+// are read straight into a DownloadBuffer, so this only bounds the
+// size of one read, not the size of an allocation.
+const DWORD			g_nMaxReadSize = 64 * 1024;
 
-// default size of UDP packets and DNS payloads, so it
-// makes for a convenient InternetReadFile buffer size
-const int			g_nPacketSize = 512;
+// the maps on the City menu, the three defaults or the contents
+// of locations.txt.  Menu item ID_LOCATION_FIRST + i selects
+// g_mapLocations[i].  Loaded in InitInstance.
+std::vector<MapLocation> g_mapLocations;
 
-// this structure is used to hold a pointer 
-// to a memory buffer and its current size count.
-// These structures are stored in a vector as a 
-// file is read from the Internet with InternetReadFile
-// in discrete chunks.  iovcnt will always be 512 bytes
-// (or the size of the g_nPacketSize constant), except
-// for the last IOVEC in the vector, which will contain
-// the number of bytes from the last Read operation.
-//
-// Used in GetBingMap to hold pointers to chunks of a
-// .jpg file as it is downloaded.
-typedef struct iovec
-{
-    LPBYTE	pBytes;
-    int		iovcnt;
-} IOVEC, * PIOVEC;
-
-// three HBITMAPs for three cities, created in 
-// GetMap, painted in DisplayMap, selected
-// in the WM_COMMAND message handler, and destroyed
-// in DestroyGDIObjects() called from WM_DESTROY handler.
-HBITMAP				g_hbmSeattle;
-HBITMAP				g_hbmPortland;
-HBITMAP				g_hbmSanFran;
+// every map we have, keyed by request.  The JPEGs of thousands are kept
+// in memory and a few recently used ones decoded, each tier within its own
+// byte budget.  GetBingMap keeps the JPEGs, and decodes one again when a
+// map is wanted that is no longer decoded.  The decoded maps are filled in
+// the WM_APP_MAPREADY handler and painted in ComposeMap.
+MapTieredCache		g_mapCache;
+
+// the index in g_mapLocations of the map on screen, or -1 before
+// the user has chosen one
+int					g_nCurrentLocation = -1;
+
+// our reference to the map on screen, so it stays valid even if the
+// store evicts it.  Empty while the map is downloading.
+MapImageHandle		g_hCurrentMap;
 
 // some fonts for writing to the screen, created in
 // CreateSmallUserSizedFonts(), painted by DrawText in
-// DisplayInstructions, and destroyed in DestroyGDIObjects().
+// ComposeInstructions, and destroyed in DestroyGDIObjects().
 HFONT g_hFontSmallBold,
 g_hFontSmallNormal,
 g_hOldFont;
 
+// everything on screen is composed here first, and only the parts that
+// changed are copied to the window.  Sized to the client area in
+// PaintWindow and destroyed in DestroyGDIObjects().
+WindowBackBuffer g_backBuffer;
+
 // Created in InitInstance, used in GetMap
 // to create Image objects from a memory buffer.
 // It is global because it is a COM server "singleton"
@@ -90,16 +206,233 @@ g_hOldFont;
 // released in the WM_DESTROY message handler.
 IWICImagingFactory* g_pIWICFactory = NULL;
 
+// Created in InitInstance, used in GetBingMap to keep every map
+// we download on disk so a later run of the program doesn't need
+// the network to show it again.  Deleted in the WM_DESTROY handler.
+DiskMapCache* g_pDiskCache = NULL;
+
+// Created in InitInstance unless /nodecodedcache is given, every map we
+// decode kept on disk as its raw pixels too, so a later run shows it with
+// its pixels mapped straight from the file, with no decode and no copy.
+// Deleted in the WM_DESTROY handler.
+DecodedMapCache* g_pDecodedCache = NULL;
+bool             g_bDecodedCache = true;
+
+// Created in InitInstance when /shared is given, decoded maps kept in
+// shared memory for every instance of the program on this machine, so a
+// map another instance has already downloaded and decoded is shown with
+// neither.  Deleted in the WM_DESTROY handler; the maps stay for the
+// other instances.
+MapSharedCache* g_pSharedCache = NULL;
+bool            g_bSharedCache = false;
+
+// Created in InitInstance, the one WinInet session every download goes
+// through, so consecutive maps from the same server reuse its kept-alive
+// connections.  Closed and deleted in the WM_DESTROY handler, after the
+// worker threads that use it have stopped.
+HttpSessionPool* g_pHttpPool = NULL;
+
+// every download goes through here, so however many worker threads ask
+// for the same map at once, from whichever queue, it is only downloaded
+// once.  Maps that failed are not asked for again for a few seconds.
+MapSingleFlight<MapImageHandle> g_mapFlights;
+
+// how long a download may take and how often to try it, and whether to
+// race slow ones with a second download.  The policy can be changed on
+// the command line with /retries, /timeout and /hedge.
+MapRetrier g_mapRetrier;
+
+// how long each stage of downloading, decoding and painting maps takes,
+// recorded from every thread.  File > Save Metrics writes them out.
+MapMetrics g_metrics;
+
+// the validators the server sent with every map we have, and so whether
+// each is fresh, stale or expired.  A stale map is shown and revalidated
+// in the background with a conditional request; an expired one is
+// revalidated by GetBingMap before it is shown.  The sweep interval can be
+// changed with /revalidate.
+MapRevalidationTable g_mapRevalidation;
+
+// what the downloads so far say about the link, and when that makes it
+// worth downloading a smaller map first, to show scaled up while the one
+// asked for arrives.  Turned off with /noadaptive.
+MapBandwidthEstimator g_bandwidth;
+MapAdaptivePolicy   g_adaptivePolicy;
+
+// Created in InitInstance, the worker threads every map is downloaded and
+// decoded on.  The fetch, prefetch and revalidation queues share them,
+// each at its own priority, so the maps the user is waiting for always go
+// first.  Shut down and deleted in the WM_DESTROY handler, after the queues.
+MapScheduler*       g_pScheduler = NULL;
+
+// Created in InitInstance, the thread downloaded maps are written out to
+// the disk, shared and decoded caches on.  Shut down and deleted in the
+// WM_DESTROY handler, after the scheduler, so no more maps are coming.
+MapPersistQueue*    g_pPersistQueue = NULL;
+
+// Created in InitInstance, revalidates stale maps on a worker thread, as
+// they are shown and on g_mapRevalidation's schedule.  Each comes back to
+// WndProc as a WM_APP_MAPREVALIDATED message.  Shut down and deleted in the
+// WM_DESTROY handler.
+MapFetchQueue<MapImageHandle>* g_pRevalidateQueue = NULL;
+
+// Created in InitInstance, downloads and decodes maps on worker
+// threads so the message loop never waits on the network.  The
+// finished maps come back to WndProc as WM_APP_MAPREADY messages.
+// Shut down and deleted in the WM_DESTROY handler.
+MapFetchQueue<MapImageHandle>* g_pFetchQueue = NULL;
+
+// the request the UI is waiting on, if any, so selecting the same
+// location twice doesn't start a second download of it
+uint64_t            g_nPendingRequestId = 0;
+MapRequestKey       g_pendingMapKey;
+
+// set when the map the UI is waiting on could not be downloaded
+bool                g_bMapFailed = false;
+
+// the top part of the map the UI is waiting on, while it is still being
+// decoded.  Only the first g_nPartialRows rows of it are final.
+MapImageHandle      g_hPartialMap;
+int                 g_nPartialRows = 0;
+
+// true to decode maps while they download rather than after.  Cleared by
+// the /nostream command line switch, to compare the two.
+bool                g_bStreamingDecode = true;
+
+// where maps and tiles are downloaded from, such as http://127.0.0.1:8080
+// for a MockMapServer, or empty for Bing Maps.  Set with /server.
+std::wstring        g_strMapServer;
+
+// true to scale the static map to fit the window rather than show it at
+// the size it was downloaded.  Toggled from the View menu.
+bool                g_bFitToWindow = true;
+
+// true while the user is dragging the window frame.  The map is rescaled
+// on every WM_SIZE then, so it uses the fast filter until the drag ends.
+bool                g_bLiveResize = false;
+
+// the map on screen scaled to fit the window, the map it was scaled from,
+// how many of that map's rows were ready and the filter used.  Scaling a
+// whole map takes a while, so it is only redone when one of these or the
+// window size changes.  Made in GetScaledMap.
+std::shared_ptr<MapImage> g_pScaledMap;
+MapImageHandle      g_hScaledSource;
+int                 g_nScaledRows = 0;
+ScaleFilter         g_scaledFilter = ScaleFilter::NEAREST;
+
+// true when the window shows the tiled map rather than the static map.
+// Toggled from the View menu.
+bool                g_bTiledView = false;
+
+// the tiled map: where it is centered, and the view composed from the
+// tiles in g_mapCache.  Painted in ComposeTiledMap.
+TileLayer           g_tileLayer;
+
+// true while the tiled map is being dragged with the left mouse button,
+// and where the mouse was when the map was last moved
+bool                g_bDragging = false;
+POINT               g_ptDrag = { 0, 0 };
+
+// mouse wheel movement that doesn't add up to a whole notch yet.  Each
+// WHEEL_DELTA zooms the tiled map one level.
+int                 g_nWheelDelta = 0;
+
+// a tile being downloaded: its fetch queue request id, and whether it is
+// on screen or just off it
+struct PendingTile
+{
+    uint64_t        requestId;
+    MapPriority     priority;
+};
+
+// the tiles being downloaded, so each tile is only requested once, tiles
+// that scroll into view can be moved up the queue, and tiles that scroll
+// away can be cancelled
+std::unordered_map<MapRequestKey, PendingTile, MapRequestKeyHash> g_pendingTiles;
+
+// tiles that could not be downloaded.  They aren't asked for again until
+// another location is selected, so a missing tile doesn't make every
+// repaint start another download of it.
+std::unordered_set<MapRequestKey, MapRequestKeyHash> g_failedTiles;
+
+// set by the /prefetch command line switch.  Every map on the City menu
+// is fetched at startup instead of when it is first selected.
+bool                g_bPrefetch = false;
+
+// Created by StartPrefetch when /prefetch is given, fetches the maps on
+// the City menu in parallel.  The maps come back to WndProc as
+// WM_APP_PREFETCHREADY messages.  Deleted once the last one arrives.
+MapFetchQueue<MapPrefetchResult>* g_pPrefetchQueue = NULL;
+
+// set by the /batch <manifest> command line switch.  Every map in the
+// manifest, a file in the same format as locations.txt, is rendered to
+// an image file in g_strBatchOutput, set with /out, in g_batchFormat, set
+// with /format, and the program exits without ever opening a window.
+std::wstring        g_strBatchManifest;
+std::wstring        g_strBatchOutput = L"maps";
+MapImageFormat      g_batchFormat = MapImageFormat::PNG;
+
+// times the prefetch, written to the debug output when it finishes
+MapPrefetchReport   g_prefetchReport;
+
 // Forward declarations of functions included in this code module:
 ATOM                MyRegisterClass(HINSTANCE hInstance);
 BOOL                InitInstance(HINSTANCE, int);
 LRESULT CALLBACK    WndProc(HWND, UINT, WPARAM, LPARAM);
 INT_PTR CALLBACK    About(HWND, UINT, WPARAM, LPARAM);
 void DestroyGDIObjects();
-HRESULT GetBingMap(LPCTSTR pszCityName, HBITMAP& refHbmOut, int requestedWidth, int requestedHeight);
+HRESULT GetBingMap(const MapRequestKey& mapKey, MapImageHandle& refMapOut, const std::atomic<bool>* pbCancel,
+    const MapProgressCallback* pProgress, bool bRevalidate);
+HRESULT FetchMap(const MapRequestKey& mapKey, MapImageHandle& refMapOut, const std::atomic<bool>* pbCancel,
+    const MapProgressCallback* pProgress, bool bRevalidate = false);
+HRESULT DownloadBingMap(const MapRequestKey& mapKey, MapImageHandle& refMapOut, MapAttemptToken& token,
+    const MapProgressCallback* pProgress, const MapValidators* pValidators);
+void PersistMap(const MapRequestKey& mapKey, MapBytesHandle hBytes, MapImageHandle hMap,
+    const MapValidators& validators);
+MapAttemptResult MapAttemptResultForHResult(HRESULT hr);
+HRESULT DecodeMapImage(const BYTE* pBuf, size_t tBufSize, MapImageHandle& refMapOut);
+HRESULT DecodeMapStream(IStream* pStream, MapImageHandle& refMapOut, const MapProgressCallback* pProgress);
+HRESULT EncodeMapImage(const MapImage& mapImage, MapImageFormat format, std::vector<BYTE>& dataOut);
+void CreateDiskMapCache();
+void CreateDecodedMapCache();
+void CreateSharedMapCache();
+void LoadLocationsAndBuildMenu(HWND hWnd);
+void SelectLocation(HWND hWnd, int nLocation);
+void CreateScheduler();
+void DestroyScheduler();
+void DestroyPersistQueue();
+void CreateFetchQueue(HWND hWnd);
+void DestroyFetchQueue();
+void RequestMap(const MapRequestKey& mapKey);
+void RequestTiles(const std::vector<MapRequestKey>& tileKeys, const std::vector<MapRequestKey>& nearbyKeys);
+void CancelAllFetches();
+void SetViewMode(HWND hWnd, bool bTiled);
+bool IsTiledMapShown();
+void PanView(HWND hWnd, int dx, int dy);
+void ZoomView(HWND hWnd, int x, int y, int nLevels);
+void OnMapReady(HWND hWnd, MapCompletion* pCompletion);
+void OnMapProgress(HWND hWnd, MapProgress* pProgress);
+void CreateRevalidateQueue(HWND hWnd);
+void DestroyRevalidateQueue();
+bool UseCachedMap(const MapRequestKey& mapKey);
+void RevalidateInBackground(const MapRequestKey& mapKey);
+void RevalidateDueMaps();
+void OnMapRevalidated(HWND hWnd, MapCompletion* pCompletion);
+void ParseCommandLine();
+bool ParseSwitchNumber(LPCWSTR pszSwitch, LPCWSTR pszValue, unsigned nMax, unsigned& nOut);
+void StartPrefetch(HWND hWnd);
+void DestroyPrefetchQueue();
+void OnPrefetchReady(HWND hWnd, PrefetchCompletion* pCompletion);
+void OpenMapSources();
+int RunBatch();
 void CreateSmallUserSizedFonts();
-LRESULT DisplayInstructions(HWND hWnd);
-LRESULT DisplayMap(HWND hWnd, HBITMAP& hbmCity);
+void PaintWindow(HWND hWnd);
+PixelRect GetMapRect(const MapImage& mapImage, int nClientWidth, int nClientHeight);
+void ComposeInstructions(LPCTSTR pszText, const PixelRect& dirty);
+void ComposeMap(const MapImageHandle& hMap, int nRows, const PixelRect& dirty);
+MapImageHandle GetScaledMap(const MapImageHandle& hMap, int nRows, int nWidth, int nHeight, int* pRowsOut);
+void ComposeTiledMap(const PixelRect& dirty);
+void SaveMetrics();
 
 // Entry point
 int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
@@ -110,6 +443,16 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
     UNREFERENCED_PARAMETER(hPrevInstance);
     UNREFERENCED_PARAMETER(lpCmdLine);
 
+    // look for /prefetch, /nostream, /noadaptive, /shared, /nodecodedcache,
+    // /server, /retries, /timeout, /hedge, /revalidate and /batch
+    ParseCommandLine();
+
+    // a batch run renders its maps to files and exits, with no window
+    if (!g_strBatchManifest.empty())
+    {
+        return RunBatch();
+    }
+
     // Initialize global strings
     LoadStringW(hInstance, IDS_APP_TITLE, szTitle, MAX_LOADSTRING);
     LoadStringW(hInstance, IDC_GRAPHICSTESTWIN32, szWindowClass, MAX_LOADSTRING);
@@ -214,9 +557,29 @@ BOOL InitInstance(HINSTANCE hInstance, int nCmdShow)
    // does just what it says
    CreateSmallUserSizedFonts();
 
-   g_hbmSeattle = NULL;
-   g_hbmPortland = NULL;
-   g_hbmSanFran = NULL;
+   // the caches and the HTTP session GetBingMap gets maps from
+   OpenMapSources();
+
+   // start the background map download threads, and the one that
+   // writes what they download out to the caches
+   CreateScheduler();
+   g_pPersistQueue = new MapPersistQueue();
+   CreateFetchQueue(hWnd);
+
+   // and the one that asks whether the maps we have are still right
+   CreateRevalidateQueue(hWnd);
+
+   // fill the City menu
+   LoadLocationsAndBuildMenu(hWnd);
+
+   // start with the static map, as we always have
+   SetViewMode(hWnd, false);
+
+   // with /prefetch, get every map on the City menu now
+   if (g_bPrefetch)
+   {
+       StartPrefetch(hWnd);
+   }
 
    ShowWindow(hWnd, nCmdShow);
    UpdateWindow(hWnd);
@@ -244,99 +607,260 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
             // Parse the menu selections:
             switch (wmId)
             {
-            case ID_CITY_SEATTLE:
+            case IDM_ABOUT:
+                DialogBox(hInst, MAKEINTRESOURCE(IDD_ABOUTBOX), hWnd, About);
+                break;
 
-                // only get the map from the Internet once
-                if (NULL == g_hbmSeattle)
-                {
-                    GetBingMap(L"Seattle", g_hbmSeattle, 800, 500);
-                }
+            case IDM_EXIT:
+                DestroyWindow(hWnd);
+                break;
+
+            case ID_FILE_SAVEMETRICS:
+                SaveMetrics();
+                break;
+
+            case ID_VIEW_STATIC:
+                SetViewMode(hWnd, false);
+                break;
+
+            case ID_VIEW_TILED:
+                SetViewMode(hWnd, true);
+                break;
 
-                // set our paint state to Seattle
-                g_uiState = CurrentUIState::SEATTLE;
+            case ID_VIEW_FIT:
+                g_bFitToWindow = !g_bFitToWindow;
 
-                // trigger a repaint
-                InvalidateRect(hWnd, NULL, TRUE);
-                UpdateWindow(hWnd);
+                CheckMenuItem(GetMenu(hWnd), ID_VIEW_FIT,
+                    MF_BYCOMMAND | (g_bFitToWindow ? MF_CHECKED : MF_UNCHECKED));
 
+                InvalidateRect(hWnd, NULL, FALSE);
                 break;
 
-            case ID_CITY_PORTLAND:
+            default:
 
-                // only get the map from the Internet once
-                if (NULL == g_hbmPortland)
+                // one of the locations on the City menu
+                if (wmId >= ID_LOCATION_FIRST && wmId < ID_LOCATION_FIRST + (int)g_mapLocations.size())
                 {
-                    GetBingMap(L"Portland", g_hbmPortland, 600, 600);
+                    SelectLocation(hWnd, wmId - ID_LOCATION_FIRST);
+                    break;
                 }
 
-                // set our paint state to Portland
-                g_uiState = CurrentUIState::PORTLAND;
+                return DefWindowProc(hWnd, message, wParam, lParam);
+            }
+        }
+        break;
 
-                // trigger a repaint
-                InvalidateRect(hWnd, NULL, TRUE);
-                UpdateWindow(hWnd);
+    case WM_APP_MAPREADY:
 
-                break;
+        // a background download has finished, one way or another
+        OnMapReady(hWnd, reinterpret_cast<MapCompletion*>(lParam));
+        break;
 
-            case ID_CITY_SANFRANCISCO:
+    case WM_APP_MAPPROGRESS:
 
-                // only get the map from the Internet once
-                if (NULL == g_hbmSanFran)
-                {
-                    GetBingMap(L"San Francisco", g_hbmSanFran, 500, 400);
-                }
+        // more of a map being downloaded has been decoded
+        OnMapProgress(hWnd, reinterpret_cast<MapProgress*>(lParam));
+        break;
 
-                // set our paint state to San Francisco
-                g_uiState = CurrentUIState::SANFRAN;
+    case WM_APP_PREFETCHREADY:
 
-                // trigger a repaint
-                InvalidateRect(hWnd, NULL, TRUE);
-                UpdateWindow(hWnd);
+        // a map fetched at startup has finished
+        OnPrefetchReady(hWnd, reinterpret_cast<PrefetchCompletion*>(lParam));
+        break;
 
-                break;
+    case WM_APP_MAPREVALIDATED:
 
-            case IDM_ABOUT:
-                DialogBox(hInst, MAKEINTRESOURCE(IDD_ABOUTBOX), hWnd, About);
-                break;
+        // a stale map has been revalidated, and may have changed
+        OnMapRevalidated(hWnd, reinterpret_cast<MapCompletion*>(lParam));
+        break;
 
-            case IDM_EXIT:
-                DestroyWindow(hWnd);
-                break;
+    case WM_TIMER:
+
+        if (IDT_REVALIDATE == wParam)
+        {
+            RevalidateDueMaps();
+            break;
+        }
+
+        return DefWindowProc(hWnd, message, wParam, lParam);
+
+    case WM_SIZE:
+
+        // the tiled map fills the client area
+        g_tileLayer.Resize(LOWORD(lParam), HIWORD(lParam));
+        break;
+
+    case WM_ENTERSIZEMOVE:
+
+        // scale the map with the fast filter while the frame is dragged
+        g_bLiveResize = true;
+        break;
+
+    case WM_EXITSIZEMOVE:
+
+        // and with the sharp one once it has stopped
+        g_bLiveResize = false;
+        InvalidateRect(hWnd, NULL, FALSE);
+        break;
+
+    case WM_KEYDOWN:
+        {
+            // the arrow keys move the tiled map, plus and minus zoom it
+            // about the middle of the window
+            int dx = 0;
+            int dy = 0;
+            int nLevels = 0;
+
+            switch (wParam)
+            {
+            case VK_LEFT:       dx = -TILE_PAN_STEP; break;
+            case VK_RIGHT:      dx = TILE_PAN_STEP; break;
+            case VK_UP:         dy = -TILE_PAN_STEP; break;
+            case VK_DOWN:       dy = TILE_PAN_STEP; break;
+            case VK_ADD:
+            case VK_OEM_PLUS:   nLevels = 1; break;
+            case VK_SUBTRACT:
+            case VK_OEM_MINUS:  nLevels = -1; break;
 
             default:
                 return DefWindowProc(hWnd, message, wParam, lParam);
             }
+
+            if (IsTiledMapShown())
+            {
+                if (0 != nLevels)
+                {
+                    RECT rcClient;
+                    GetClientRect(hWnd, &rcClient);
+
+                    ZoomView(hWnd, rcClient.right / 2, rcClient.bottom / 2, nLevels);
+                }
+                else
+                {
+                    PanView(hWnd, dx, dy);
+                }
+            }
         }
         break;
 
-    case WM_PAINT:
+    case WM_LBUTTONDOWN:
+
+        // start dragging the tiled map
+        if (IsTiledMapShown())
+        {
+            g_bDragging = true;
+            g_ptDrag.x = GET_X_LPARAM(lParam);
+            g_ptDrag.y = GET_Y_LPARAM(lParam);
+
+            // keep getting WM_MOUSEMOVE when the mouse leaves the window
+            SetCapture(hWnd);
+        }
+        break;
+
+    case WM_MOUSEMOVE:
+
+        if (g_bDragging)
+        {
+            POINT pt = { GET_X_LPARAM(lParam), GET_Y_LPARAM(lParam) };
+
+            // the map follows the mouse, so the view moves the other way
+            PanView(hWnd, g_ptDrag.x - pt.x, g_ptDrag.y - pt.y);
+
+            g_ptDrag = pt;
+        }
+        break;
+
+    case WM_LBUTTONUP:
+
+        if (g_bDragging)
+        {
+            // WM_CAPTURECHANGED ends the drag
+            ReleaseCapture();
+        }
+        break;
+
+    case WM_CAPTURECHANGED:
+
+        g_bDragging = false;
+        break;
+
+    case WM_MOUSEWHEEL:
         {
-            switch (g_uiState)
+            if (!IsTiledMapShown())
             {
-            case CurrentUIState::START:
-                DisplayInstructions(hWnd);
-                break;
-            case CurrentUIState::SEATTLE:
-                DisplayMap(hWnd, g_hbmSeattle);
-                break;
-            case CurrentUIState::PORTLAND:
-                DisplayMap(hWnd, g_hbmPortland);
-                break;
-            case CurrentUIState::SANFRAN:
-                DisplayMap(hWnd, g_hbmSanFran);
-                break;
+                return DefWindowProc(hWnd, message, wParam, lParam);
+            }
+
+            // a precise wheel or touchpad sends less than a notch at a time
+            g_nWheelDelta += GET_WHEEL_DELTA_WPARAM(wParam);
+
+            int nLevels = g_nWheelDelta / WHEEL_DELTA;
+            g_nWheelDelta -= nLevels * WHEEL_DELTA;
+
+            if (0 != nLevels)
+            {
+                // the wheel gives the mouse position in screen coordinates
+                POINT pt = { GET_X_LPARAM(lParam), GET_Y_LPARAM(lParam) };
+                ScreenToClient(hWnd, &pt);
+
+                ZoomView(hWnd, pt.x, pt.y, nLevels);
             }
         }
         break;
 
+    case WM_ERASEBKGND:
+
+        // the back buffer covers the whole client area, so there is
+        // nothing to erase, and erasing first is what makes it flicker
+        return 1;
+
+    case WM_PAINT:
+
+        PaintWindow(hWnd);
+        break;
+
     case WM_DESTROY:
 
-        // delete the fonts and city bitmap objects
+        // stop the download threads before anything they use goes away.
+        // The fetch threads can hand maps to the revalidation thread, so
+        // they go first.
+        KillTimer(hWnd, IDT_REVALIDATE);
+        DestroyPrefetchQueue();
+        DestroyFetchQueue();
+        DestroyRevalidateQueue();
+        DestroyScheduler();
+        DestroyPersistQueue();
+
+        // close the HTTP session and its kept-alive connections
+        delete g_pHttpPool;
+        g_pHttpPool = NULL;
+
+        // delete the fonts
         DestroyGDIObjects();
 
+        // let go of the decoded maps
+        g_hCurrentMap.reset();
+        g_hPartialMap.reset();
+        g_pScaledMap.reset();
+        g_hScaledSource.reset();
+        g_mapCache.Clear();
+
         // destroy the global WIC Factory
         SAFE_RELEASE(g_pIWICFactory);
 
+        // close the disk cache, the cached files stay for next time
+        delete g_pDiskCache;
+        g_pDiskCache = NULL;
+
+        // and the decoded cache.  Maps still on screen keep their files
+        // mapped until they are released.
+        delete g_pDecodedCache;
+        g_pDecodedCache = NULL;
+
+        // and the shared cache, which the other instances keep
+        delete g_pSharedCache;
+        g_pSharedCache = NULL;
+
         // shut down COM
         CoUninitialize();
 
@@ -425,507 +949,2625 @@ void CreateSmallUserSizedFonts()
     g_hFontSmallNormal = CreateFontIndirect(&lfSmallNormal);
 }
 
-// destroy global GDI objects to avoid a memory leak
-void DestroyGDIObjects()
+// set up everything GetBingMap needs besides the WIC factory: the disk
+// cache, the decoder for maps in the compressed tier of g_mapCache, and
+// the HTTP session.  This is done in InitInstance, or in RunBatch.
+void OpenMapSources()
 {
-    DeleteObject(g_hFontSmallBold);
-    DeleteObject(g_hFontSmallNormal);
-    DeleteObject(g_hOldFont);			// just in case
+    // maps that drop out of the decoded tier of g_mapCache are decoded
+    // again with WIC, on the fetch worker threads
+    g_mapCache.SetDecoder([](const uint8_t* pData, size_t nSize, MapImageHandle& hImageOut)
+    {
+        return SUCCEEDED(DecodeMapImage(pData, nSize, hImageOut));
+    });
 
-    DeleteObject((HGDIOBJ)g_hbmSeattle);
-    DeleteObject((HGDIOBJ)g_hbmPortland);
-    DeleteObject((HGDIOBJ)g_hbmSanFran);
-}
+    // open the persistent map cache.  If it can't be opened we
+    // simply download every map, as we always have.
+    CreateDiskMapCache();
 
-LRESULT DisplayInstructions(HWND hWnd)
-{
-    RECT rect;
-    HRGN hrgnClip;
-    HDC hdc;
-    PAINTSTRUCT ps;
-    TEXTMETRIC tm;
+    // and the decoded maps beside it, unless asked not to
+    if (g_bDecodedCache)
+    {
+        CreateDecodedMapCache();
+    }
 
-    // this hdc will be destroyed on EndPaint
-    hdc = BeginPaint(hWnd, &ps);
+    // and the maps the other instances have decoded, if asked to
+    if (g_bSharedCache)
+    {
+        CreateSharedMapCache();
+    }
 
-    // The rectangle we get back is in Desktop coordinates, so we need to
-    //   modify it to reflect coordinates relative to this window.
-    //
-    GetWindowRect(hWnd, &rect);
+    // open the HTTP session the downloads share.  If it can't be opened
+    // the maps already in the disk cache can still be shown.
+    g_pHttpPool = new HttpSessionPool(L"GraphicsTestWin32");
 
-    rect.right -= rect.left;
-    rect.bottom -= rect.top;
-    rect.left = rect.top = 0;
+    if (!g_pHttpPool->Open())
+    {
+        OutputDebugString(L"Error: Could not get HINTERNET handle\n");
+    }
 
-    // create a region based on the extent of the current window
-    hrgnClip = CreateRectRgnIndirect(&ps.rcPaint);
+    // don't wait forever for a server that has stopped answering
+    g_pHttpPool->SetTimeouts(g_mapRetrier.Policy().nConnectTimeoutMs, g_mapRetrier.Policy().nReadTimeoutMs);
+}
 
-    // select that region into our device context
-    SelectClipRgn(hdc, hrgnClip);
+// open the disk map cache in the user's local application data folder,
+// %LOCALAPPDATA%\GraphicsTestWin32\MapCache.  This is done in InitInstance.
+void CreateDiskMapCache()
+{
+    PWSTR pszLocalAppData = NULL;
 
-    // select the small bold font into the device context
-    g_hOldFont = (HFONT)SelectObject(hdc, g_hFontSmallBold);
+    if (FAILED(SHGetKnownFolderPath(FOLDERID_LocalAppData, 0, NULL, &pszLocalAppData)))
+    {
+        OutputDebugString(L"Warning: no local application data folder, disk cache disabled.\n");
+        return;
+    }
 
-    // get the text metric data about the selected font
-    GetTextMetrics(hdc, &tm);
+    std::filesystem::path cacheDirectory(pszLocalAppData);
+    cacheDirectory /= L"GraphicsTestWin32";
+    cacheDirectory /= L"MapCache";
 
-    // compute the pixel length of the string so we can
-    // center it on the screen
+    CoTaskMemFree(pszLocalAppData);
 
-    SIZE charSize;
-    RECT rectText;
+    g_pDiskCache = new DiskMapCache(cacheDirectory, DiskMapCache::kDefaultMaxBytes);
 
-    CString aString = L"Select a city from City menu.";
+    if (!g_pDiskCache->Open())
+    {
+        OutputDebugString(L"Warning: could not open the disk map cache, disk cache disabled.\n");
 
-    GetTextExtentPoint32(hdc, (LPCTSTR)aString, aString.GetLength(), &charSize);
+        delete g_pDiskCache;
+        g_pDiskCache = NULL;
+        return;
+    }
 
-    // centered at 50% of the client area width
-    int nStartPointX = (rect.right - charSize.cx) / 2;
+    _snwprintf_s(szDebugMsg, MAX_DEBUGMSG, L"Disk map cache holds %zu maps, %llu bytes.\n",
+        g_pDiskCache->EntryCount(), (unsigned long long)g_pDiskCache->TotalBytes());
+    OutputDebugString(szDebugMsg);
+}
 
-    // start the title at 50% down from the top of the client area
-    int nStartPointY = rect.bottom / 2;
+// open the decoded map cache beside the disk cache, in
+// %LOCALAPPDATA%\GraphicsTestWin32\DecodedCache.  This is done in
+// InitInstance, or in RunBatch.
+void CreateDecodedMapCache()
+{
+    PWSTR pszLocalAppData = NULL;
 
-    SetRect(&rectText, nStartPointX, nStartPointY,
-        nStartPointX + charSize.cx, nStartPointY + charSize.cy);
+    if (FAILED(SHGetKnownFolderPath(FOLDERID_LocalAppData, 0, NULL, &pszLocalAppData)))
+    {
+        OutputDebugString(L"Warning: no local application data folder, decoded cache disabled.\n");
+        return;
+    }
 
-    DrawText(hdc, (LPCTSTR)aString, aString.GetLength(), &rectText, DT_BOTTOM | DT_SINGLELINE | DT_CENTER | DT_NOCLIP);
+    std::filesystem::path cacheDirectory(pszLocalAppData);
+    cacheDirectory /= L"GraphicsTestWin32";
+    cacheDirectory /= L"DecodedCache";
 
-    // don't delete the fonts as they are global and are deleted in DestroyGDIObjects()
-    SelectObject(hdc, g_hOldFont);
+    CoTaskMemFree(pszLocalAppData);
 
-    // deselect the clip region and delete it
-    SelectClipRgn(hdc, NULL);
-    DeleteObject(hrgnClip);
+    g_pDecodedCache = new DecodedMapCache(cacheDirectory, DecodedMapCache::kDefaultMaxBytes);
 
-    // this frees the hdc created with BeginPaint
-    EndPaint(hWnd, &ps);
+    if (!g_pDecodedCache->Open())
+    {
+        OutputDebugString(L"Warning: could not open the decoded map cache, decoded cache disabled.\n");
 
-    return 0;
+        delete g_pDecodedCache;
+        g_pDecodedCache = NULL;
+        return;
+    }
+
+    _snwprintf_s(szDebugMsg, MAX_DEBUGMSG, L"Decoded map cache holds %zu maps, %llu bytes.\n",
+        g_pDecodedCache->EntryCount(), (unsigned long long)g_pDecodedCache->TotalBytes());
+    OutputDebugString(szDebugMsg);
 }
 
-// paint the map on the screen
-LRESULT DisplayMap(HWND hWnd, HBITMAP& hbmCity)
+// open the shared memory map cache every instance started with /shared
+// uses.  Instances sent to different servers with /server get different
+// maps for the same request, so each server has its own.  This is done
+// in InitInstance, or in RunBatch.
+void CreateSharedMapCache()
 {
-    RECT rect;
-    HRGN hrgnClip;
-    HDC hdc;
-    HDC	hMemDC;
-    BITMAP bm;
-    HBITMAP hbmOld;
-    PAINTSTRUCT ps;
-
-    // this hdc will be destroyed on EndPaint
-    hdc = BeginPaint(hWnd, &ps);
-
-    // The rectangle we get back is in Desktop coordinates, so we need to
-    //   modify it to reflect coordinates relative to this window.
-    //
-    GetWindowRect(hWnd, &rect);
+    std::string strName = "GraphicsTestWin32.MapCache";
 
-    rect.right -= rect.left;
-    rect.bottom -= rect.top;
-    rect.left = rect.top = 0;
+    if (!g_strMapServer.empty())
+    {
+        char szServer[32];
 
-    // create a region based on the extent of the current window
-    hrgnClip = CreateRectRgnIndirect(&ps.rcPaint);
+        sprintf_s(szServer, ".%016llx", (unsigned long long)std::hash<std::wstring>()(g_strMapServer));
+        strName += szServer;
+    }
 
-    // select that region into our device context
-    SelectClipRgn(hdc, hrgnClip);
+    g_pSharedCache = new MapSharedCache();
 
-    // create a memory device context into which we can select the
-    // interface images for blitting onto the window instance
-    hMemDC = CreateCompatibleDC(hdc);
+    if (!g_pSharedCache->Open(strName, MapSharedCache::kDefaultSizeBytes))
+    {
+        OutputDebugString(L"Warning: could not open the shared map cache, shared cache disabled.\n");
 
-    // select the City bitmap into the memory device context so we can blit it
-    hbmOld = (HBITMAP)SelectObject(hMemDC, hbmCity);
+        delete g_pSharedCache;
+        g_pSharedCache = NULL;
+        return;
+    }
 
-    // create a brush with a deep sky blue color for the background
-    HBRUSH hBrush = CreateSolidBrush(RGB(0, 191, 255)); // background color brush, deep sky blue
+    _snwprintf_s(szDebugMsg, MAX_DEBUGMSG, L"Shared map cache %s, %zu maps.\n",
+        g_pSharedCache->Created() ? L"created" : L"opened", g_pSharedCache->GetStats().nEntries);
+    OutputDebugString(szDebugMsg);
+}
 
-    // select the brush into the paint dc
-    HBRUSH hBrushOld = (HBRUSH)SelectObject(hdc, (HGDIOBJ)hBrush);
+// write g_metrics to metrics.json and metrics.prom, g_mapCache's hit
+// rates and decode times to cache.json, and what revalidating maps has
+// saved to revalidation.json, beside the disk cache in
+// %LOCALAPPDATA%\GraphicsTestWin32
+void SaveMetrics()
+{
+    PWSTR pszLocalAppData = NULL;
 
-    // fill the paint hdc background with the background color
-    FillRect(hdc, &rect, hBrush);
+    if (FAILED(SHGetKnownFolderPath(FOLDERID_LocalAppData, 0, NULL, &pszLocalAppData)))
+    {
+        OutputDebugString(L"Warning: no local application data folder, metrics not saved.\n");
+        return;
+    }
 
-    // remove the brush from the hdc by selecting the "old" one
-    SelectObject(hdc, (HGDIOBJ)hBrushOld);
+    std::filesystem::path metricsDirectory(pszLocalAppData);
+    metricsDirectory /= L"GraphicsTestWin32";
 
-    // done with the background color brush, delete it
-    DeleteObject((HGDIOBJ)hBrush);
+    CoTaskMemFree(pszLocalAppData);
 
-    // get the size of the hbmCity bitmap
-    GetObject(hbmCity, sizeof(bm), &bm);
+    std::string strCacheJson = g_mapCache.StatsToJson();
+    std::ofstream cacheFile(metricsDirectory / L"cache.json", std::ios::binary | std::ios::trunc);
 
-    // compute coordinates to blit in the center of our client area
-    int nxDest = (rect.right - bm.bmWidth) / 2;
-    int nyDest = (rect.bottom - bm.bmHeight) / 2;
+    cacheFile.write(strCacheJson.data(), (std::streamsize)strCacheJson.size());
+    cacheFile.close();
 
-    // now, blit the composed hMemDC bitmap onto the paint dc
-    BitBlt(
-        hdc,
-        nxDest,
-        nyDest,
-        bm.bmWidth,
-        bm.bmHeight,
-        hMemDC,
-        0,
-        0,
-        SRCCOPY);
+    std::string strRevalidationJson = g_mapRevalidation.StatsToJson();
+    std::ofstream revalidationFile(metricsDirectory / L"revalidation.json", std::ios::binary | std::ios::trunc);
 
-    // unselect the city bitmap image from the hMemDC
-    SelectObject(hMemDC, (HGDIOBJ)hbmOld);
+    revalidationFile.write(strRevalidationJson.data(), (std::streamsize)strRevalidationJson.size());
+    revalidationFile.close();
 
-    // deselect the clip region and delete it
-    SelectClipRgn(hdc, NULL);
-    DeleteObject(hrgnClip);
+    if (!g_metrics.Save(metricsDirectory) || !cacheFile || !revalidationFile)
+    {
+        OutputDebugString(L"Warning: could not save the metrics.\n");
+        return;
+    }
 
-    // get rid of the hMemDC, we no longer need it
-    DeleteDC(hMemDC);
+    MapTieredCache::Stats cacheStats = g_mapCache.GetStats();
 
-    // this frees the hdc created with BeginPaint
-    EndPaint(hWnd, &ps);
+    _snwprintf_s(szDebugMsg, MAX_DEBUGMSG,
+        L"Map cache: %zu decoded (%.0f%% hits), %zu compressed in %zu KB (%.0f%% hits), %.1f ms a decode.\n",
+        cacheStats.decoded.nCount, cacheStats.decoded.HitRate() * 100.0,
+        cacheStats.compressed.nCount, cacheStats.compressed.nTotalBytes / 1024,
+        cacheStats.compressed.HitRate() * 100.0, cacheStats.decodeUs.Mean() / 1000.0);
+    OutputDebugString(szDebugMsg);
 
-    // notice that we do not destroy the hbmCity HBITMAP, but keep
-    // it from call to call. It is destroyed in DestroyGDIObjects(),
-    // called from the WM_DESTROY message handler.
-    return 0;
-}
+    // longer than szDebugMsg
+    OutputDebugString(Utf8ToWide(g_mapRevalidation.FormatStats()).c_str());
+    OutputDebugString(Utf8ToWide(FormatBandwidthEstimate(g_bandwidth.Estimate())).c_str());
 
-HRESULT GetBingMap(LPCTSTR pszCityName, HBITMAP& refHbmOut, int requestedWidth = 500, int requestedHeight = 400)
-{
-    HINTERNET hInternet = NULL;
-    HINTERNET hMapUrl = NULL;
-    DWORD     dwBytesRead = 0;
-    HRESULT	  hr = S_OK;
+    if (g_pHttpPool)
+    {
+        OutputDebugString(Utf8ToWide(g_pHttpPool->FormatStats()).c_str());
+    }
 
-    DWORD dwStatus = 0;
-    DWORD dwIndex = 0;
-    HANDLE hOpen = NULL;
+    if (g_pScheduler)
+    {
+        OutputDebugString(Utf8ToWide(g_pScheduler->FormatStats()).c_str());
+    }
 
-    // pointer to a WICStream interface
-    IWICStream* pIWICStream = NULL;
+    if (g_pPersistQueue)
+    {
+        OutputDebugString(Utf8ToWide(g_pPersistQueue->FormatStats()).c_str());
+    }
 
-    // pointer to a WICBitmapDecoder interface
-    IWICBitmapDecoder* pIWICDecoder = NULL;
+    if (g_pSharedCache)
+    {
+        OutputDebugString(Utf8ToWide(g_pSharedCache->FormatStats()).c_str());
+    }
 
-    // pointer to a WICBitmapDecoderFrame interface
-    IWICBitmapFrameDecode* pIWICBitmapFrameDecode = NULL;
+    _snwprintf_s(szDebugMsg, MAX_DEBUGMSG,
+        L"Metrics saved to %s\\metrics.json, metrics.prom, cache.json and revalidation.json.\n",
+        metricsDirectory.c_str());
+    OutputDebugString(szDebugMsg);
+}
 
-    // pointer to a WICFormatConverter interface
-    IWICFormatConverter* pIWICConvertedFrame = NULL;
+// read locations.txt from the executable's folder, if there is one, and
+// put every location on the City menu.  This is done in InitInstance.
+void LoadLocationsAndBuildMenu(HWND hWnd)
+{
+    g_mapLocations = DefaultMapLocations();
 
-    // these are the Bing Maps defaults
-    const int defaultMapWidth = 500;
-    const int defaultMapHeight = 400;
+    WCHAR szModulePath[MAX_PATH];
 
-    UINT retrievedWidth = 0;
-    UINT retrievedHeight = 0;
+    if (GetModuleFileName(NULL, szModulePath, MAX_PATH) > 0)
+    {
+        std::filesystem::path locationsPath(szModulePath);
+        locationsPath.replace_filename(MAP_LOCATIONS_FILE);
 
-    // Array used to initially hold the chunks of data
-    // read from the internet. This is allocated on the stack.
-    LPBYTE sBuf[g_nPacketSize];
+        if (LoadMapLocations(locationsPath, g_mapLocations))
+        {
+            _snwprintf_s(szDebugMsg, MAX_DEBUGMSG, L"Loaded %zu locations from %s\n",
+                g_mapLocations.size(), locationsPath.c_str());
+            OutputDebugString(szDebugMsg);
+        }
+    }
 
-    // a contiguous byte array used to hold all downloaded data
-    // made up of a number of copied sBuf arrays
-    LPBYTE pBuf = NULL;
+    HMENU hCityMenu = GetSubMenu(GetMenu(hWnd), CITY_MENU_POSITION);
 
-    // default to Seattle, naturally. Best in the west.
-    if (NULL == pszCityName)
+    if (NULL == hCityMenu)
     {
-        pszCityName = L"Seattle";
+        return;
     }
 
-    if (requestedWidth <= 50)
+    // remove the placeholder item from the resource file
+    while (GetMenuItemCount(hCityMenu) > 0)
     {
-        requestedWidth = defaultMapWidth;
+        DeleteMenu(hCityMenu, 0, MF_BYPOSITION);
     }
 
-    if (requestedHeight <= 50)
+    for (size_t i = 0; i < g_mapLocations.size(); i++)
     {
-        requestedHeight = defaultMapHeight;
+        // start a new column every so often so hundreds of locations
+        // don't run off the bottom of the screen
+        UINT uFlags = MF_STRING;
+
+        if (i > 0 && (i % 40) == 0)
+        {
+            uFlags |= MF_MENUBARBREAK;
+        }
+
+        AppendMenu(hCityMenu, uFlags, ID_LOCATION_FIRST + i, g_mapLocations[i].displayName.c_str());
     }
+}
 
-    // build a URL for the call to Bing Maps
-    // get a Bing Maps Key
-    // https://docs.microsoft.com/en-us/bingmaps/getting-started/bing-maps-dev-center-help/getting-a-bing-maps-key
+// true if the window is showing the tiled map, which can be dragged and zoomed
+bool IsTiledMapShown()
+{
+    return g_bTiledView && g_nCurrentLocation >= 0 && g_mapLocations[g_nCurrentLocation].hasCoordinates;
+}
 
-    // Insert your Bing Maps key here
-    CString strBingMapsKey = TEXT("Your Bing Maps Key Here");    
+// move the tiled map dx, dy pixels.  Whatever is already on screen is
+// still right, just somewhere else, so it is moved in the back buffer and
+// on the screen, and only the strips that come into view are composed.
+void PanView(HWND hWnd, int dx, int dy)
+{
+    RECT rcClient;
+    int nMovedX = 0;
+    int nMovedY = 0;
 
-    // this query will return a .jpg image
-    // https://docs.microsoft.com/en-us/bingmaps/rest-services/imagery/get-a-static-map
-    CString strMapUrl = TEXT("https://dev.virtualearth.net/REST/v1/Imagery/Map/AerialWithLabels/");
-    
-    CString strWidth;
-    CString strHeight;
+    // paint anything already waiting first, the update region doesn't
+    // move with the map
+    UpdateWindow(hWnd);
 
-    strWidth.Format(L"?mapSize=%d,", requestedWidth);
-    strHeight.Format(L"%d&key=", requestedHeight);
+    g_tileLayer.PanBy(dx, dy, &nMovedX, &nMovedY);
 
-    strMapUrl.Append(pszCityName);
-    strMapUrl.Append(strWidth);
-    strMapUrl.Append(strHeight);
-    strMapUrl.Append(strBingMapsKey);
+    if (0 == nMovedX && 0 == nMovedY)
+    {
+        // already at the top or bottom of the map
+        return;
+    }
 
-    // open the WinInet stuff
-    hInternet = InternetOpen(L"GraphicsTestWin32", INTERNET_OPEN_TYPE_DIRECT, NULL, NULL, 0);
+    GetClientRect(hWnd, &rcClient);
 
-    if (hInternet)
+    if (g_backBuffer.Width() != rcClient.right || g_backBuffer.Height() != rcClient.bottom)
+    {
+        // the back buffer hasn't been painted at this size, there's nothing to keep
+        InvalidateRect(hWnd, NULL, FALSE);
+    }
+    else
     {
+        // the map moves the opposite way to the view
+        ScrollDamage damage = ComputeScrollDamage(rcClient.right, rcClient.bottom, -nMovedX, -nMovedY);
 
-        // open the Bing Maps URL
-        hMapUrl = InternetOpenUrl(hInternet, (LPCTSTR)strMapUrl, NULL, -1L,
-            INTERNET_FLAG_RELOAD |
-            INTERNET_FLAG_PRAGMA_NOCACHE |
-            INTERNET_FLAG_NO_CACHE_WRITE,
-            NULL);
+        // GDI mustn't still be drawing into the pixels being moved
+        GdiFlush();
+        ScrollPixels(g_backBuffer.Pixels(), -nMovedX, -nMovedY);
 
-        // if we opened the Bing Maps URL, then read the map data
-        if (hMapUrl)
+        // the desktop is composited, so all of the window's pixels are
+        // there to be scrolled, even where other windows cover it
+        ScrollWindowEx(hWnd, -nMovedX, -nMovedY, NULL, NULL, NULL, NULL, 0);
+
+        for (int i = 0; i < damage.nExposed; i++)
         {
-            // success, 
-            OutputDebugString(L"Bing Maps HTTP call successful!\n");
+            RECT rect = ToRect(damage.exposed[i]);
+            InvalidateRect(hWnd, &rect, FALSE);
+        }
+    }
 
-            hr = S_OK;
+    // draw the new strips now rather than when the message queue is
+    // empty, so the map keeps up with the mouse
+    UpdateWindow(hWnd);
+}
 
-            ::ZeroMemory(&sBuf, g_nPacketSize * sizeof(BYTE));
+// zoom the tiled map in nLevels levels of detail, or out if it is
+// negative, keeping the map under client pixel x, y where it is
+void ZoomView(HWND hWnd, int x, int y, int nLevels)
+{
+    if (!g_tileLayer.ZoomAt(x, y, nLevels))
+    {
+        return;
+    }
 
-            // a vector of buffer pointer objects we use to hold
-            // pointers to dynamically allocated memory for reading graphics
-            // from the Internet or anything else where we don't know the
-            // size in advance.
-            std::vector<IOVEC>	readBufferArray;
+    // everything on screen changes.  Until the tiles for the new level
+    // arrive, the ones that were just on screen stand in for them, scaled.
+    InvalidateRect(hWnd, NULL, FALSE);
+    UpdateWindow(hWnd);
+}
 
-            BOOL bRead = InternetReadFile(hMapUrl, &sBuf, g_nPacketSize, &dwBytesRead);
+// show the map for g_mapLocations[nLocation], downloading it if we
+// don't already have it
+void SelectLocation(HWND hWnd, int nLocation)
+{
+    const MapLocation& location = g_mapLocations[nLocation];
+    const MapRequestKey& mapKey = location.key;
 
-            // this structure will hold a pointer to a block of memory read from
-            // the internet, and the block's size in bytes
-            IOVEC FileMemoryBlock{};
+    g_nCurrentLocation = nLocation;
+    g_bMapFailed = false;
 
-            // read the map jpg in chunks
-            while (bRead && (dwBytesRead > 0))
-            {
-                // allocate a new block of memory for the iovec
-                LPBYTE pFMBBuf = NULL;
+    // whatever was half decoded was for the last location
+    g_hPartialMap.reset();
+    g_nPartialRows = 0;
 
-                // this little block of heap memory goes into our iovec
-                CHK_ALLOC(pFMBBuf = new BYTE[dwBytesRead]);
+    if (g_bTiledView)
+    {
+        // give tiles that failed before another chance
+        g_failedTiles.clear();
 
-                // store the number of bytes read in the IOVEC structure
-                FileMemoryBlock.iovcnt = dwBytesRead;
+        // the tiles themselves are requested by ComposeTiledMap, once
+        // it knows which ones it doesn't have
+        if (location.hasCoordinates)
+        {
+            g_tileLayer.SetImagerySet(mapKey.imagerySet);
+            g_tileLayer.CenterOn(location.latitude, location.longitude, location.tileLevel);
+        }
 
-                // copy the bytes read to the iovec byte buffer
-                memcpy_s(pFMBBuf, (size_t)dwBytesRead, sBuf, (size_t)dwBytesRead);
+        InvalidateRect(hWnd, NULL, FALSE);
+        UpdateWindow(hWnd);
+        return;
+    }
 
-                // store the pointer to the byte buffer in the IOVEC structure
-                FileMemoryBlock.pBytes = pFMBBuf;
+    // only get the map from the Internet once.  If it isn't decoded, it is
+    // decoded from its JPEG, or downloaded, in the background and
+    // WM_APP_MAPREADY shows it.  A map that has gone stale is shown while
+    // it is revalidated in the background; one that has expired goes back
+    // through GetBingMap, which revalidates it before it is shown.
+    g_hCurrentMap = g_mapCache.Decoded().Find(mapKey);
 
-                // put a copy of the IOVEC structure in the vector
-                readBufferArray.push_back(FileMemoryBlock);
+    if (g_hCurrentMap && MapFreshness::EXPIRED == g_mapRevalidation.Peek(mapKey, MapRevalidationNow()))
+    {
+        g_hCurrentMap.reset();
+    }
+    else if (g_hCurrentMap)
+    {
+        UseCachedMap(mapKey);
+    }
+
+    if (!g_hCurrentMap)
+    {
+        RequestMap(mapKey);
+    }
+
+    // trigger a repaint
+    InvalidateRect(hWnd, NULL, FALSE);
+    UpdateWindow(hWnd);
+}
+
+// create the worker threads the fetch, prefetch and revalidation queues
+// share.  This is done in InitInstance, before the queues are created.
+void CreateScheduler()
+{
+    // each worker thread decodes with WIC, so it needs COM too
+    auto onThreadStart = []() { CoInitializeEx(NULL, COINIT_MULTITHREADED); };
+    auto onThreadStop = []() { CoUninitialize(); };
+
+    g_pScheduler = new MapScheduler(MAP_SCHEDULER_THREADS, onThreadStart, onThreadStop);
+
+    // however idle the pool, prefetches and revalidation leave threads and
+    // connections for the maps the user asks for
+    g_pScheduler->SetMaxRunning(MapPriority::PREFETCH, MAP_PREFETCH_THREADS);
+    g_pScheduler->SetMaxRunning(MapPriority::REVALIDATE, MAP_REVALIDATE_THREADS);
+}
+
+// stop the worker threads.  This is done in the WM_DESTROY handler, once
+// every queue using them has been destroyed.
+void DestroyScheduler()
+{
+    if (NULL == g_pScheduler)
+    {
+        return;
+    }
+
+    g_pScheduler->Shutdown();
+
+    delete g_pScheduler;
+    g_pScheduler = NULL;
+}
+
+// give the persist thread MAP_PERSIST_FLUSH_MS to write out the maps it
+// has queued, and stop it.  This is done in the WM_DESTROY handler, once
+// the worker threads that queue maps have stopped, and before the caches
+// they are written to are closed.
+void DestroyPersistQueue()
+{
+    if (NULL == g_pPersistQueue)
+    {
+        return;
+    }
+
+    g_pPersistQueue->Shutdown(std::chrono::milliseconds(MAP_PERSIST_FLUSH_MS));
+
+    delete g_pPersistQueue;
+    g_pPersistQueue = NULL;
+}
+
+// create the background map download queue.  Each finished map is
+// posted back to hWnd as a WM_APP_MAPREADY message.  This is done in InitInstance.
+void CreateFetchQueue(HWND hWnd)
+{
+    // runs on a worker thread: download and decode one map
+    auto fetcher = [hWnd](const MapRequestKey& key, const MapFetchCancelToken& token, MapImageHandle& mapOut)
+    {
+        // tiles are small, there's nothing to gain from showing half of one
+        if (key.IsTile())
+        {
+            return SUCCEEDED(FetchMap(key, mapOut, token.Flag(), NULL));
+        }
+
+        // on a slow link, a smaller map of the same view first, scaled up
+        // to stand in for this one.  The map is then downloaded without
+        // showing its rows as they decode, which would cover the preview
+        // with the top of the map and leave the rest blank.
+        MapFetchPlan plan = PlanMapFetch(key, g_bandwidth.Estimate(), g_adaptivePolicy);
+
+        if (plan.bPreview)
+        {
+            MapImageHandle hPreview;
+
+            if (SUCCEEDED(FetchMap(plan.previewKey, hPreview, token.Flag(), NULL)))
+            {
+                MapImageHandle hScaled = ScaleMapPreview(hPreview, key.width, key.height);
+
+                if (hScaled)
+                {
+                    MapProgress* pProgress = new MapProgress{ key, hScaled, key.height };
+
+                    if (!PostMessage(hWnd, WM_APP_MAPPROGRESS, 0, reinterpret_cast<LPARAM>(pProgress)))
+                    {
+                        delete pProgress;
+                    }
+
+                    return SUCCEEDED(FetchMap(key, mapOut, token.Flag(), NULL));
+                }
+            }
+        }
+
+        // runs on the decoding thread: show what has been decoded so far
+        MapProgressCallback onProgress = [hWnd, &key](const MapImageHandle& hMap, int nRowsReady)
+        {
+            MapProgress* pProgress = new MapProgress{ key, hMap, nRowsReady };
+
+            if (!PostMessage(hWnd, WM_APP_MAPPROGRESS, 0, reinterpret_cast<LPARAM>(pProgress)))
+            {
+                delete pProgress;
+            }
+        };
+
+        return SUCCEEDED(FetchMap(key, mapOut, token.Flag(), &onProgress));
+    };
+
+    // runs on a worker thread: hand the result to the UI thread
+    auto onComplete = [hWnd](MapCompletion&& completion)
+    {
+        MapCompletion* pCompletion = new MapCompletion(std::move(completion));
+
+        if (!PostMessage(hWnd, WM_APP_MAPREADY, 0, reinterpret_cast<LPARAM>(pCompletion)))
+        {
+            // the window is gone, nobody wants this map now
+            delete pCompletion;
+        }
+    };
+
+    g_pFetchQueue = new MapFetchQueue<MapImageHandle>(*g_pScheduler, MapPriority::VISIBLE, fetcher, onComplete);
+}
+
+// stop the download threads and throw away any maps they finished but
+// the UI never received.  This is done in the WM_DESTROY handler.
+void DestroyFetchQueue()
+{
+    if (NULL == g_pFetchQueue)
+    {
+        return;
+    }
+
+    // cancels everything and waits for the worker threads to exit
+    g_pFetchQueue->Shutdown();
+
+    delete g_pFetchQueue;
+    g_pFetchQueue = NULL;
+
+    // free the results that are still sitting in the message queue
+    MSG msg;
+
+    while (PeekMessage(&msg, NULL, WM_APP_MAPREADY, WM_APP_MAPREADY, PM_REMOVE))
+    {
+        delete reinterpret_cast<MapCompletion*>(msg.lParam);
+    }
+
+    while (PeekMessage(&msg, NULL, WM_APP_MAPPROGRESS, WM_APP_MAPPROGRESS, PM_REMOVE))
+    {
+        delete reinterpret_cast<MapProgress*>(msg.lParam);
+    }
+}
+
+// start downloading a map in the background.  Anything else still being
+// downloaded is cancelled, because the user has moved on from it.
+void RequestMap(const MapRequestKey& mapKey)
+{
+    if (NULL == g_pFetchQueue)
+    {
+        return;
+    }
+
+    // already on its way
+    if (0 != g_nPendingRequestId && mapKey == g_pendingMapKey)
+    {
+        return;
+    }
+
+    CancelAllFetches();
+
+    g_pendingMapKey = mapKey;
+    g_nPendingRequestId = g_pFetchQueue->Submit(mapKey);
+}
+
+// start downloading the tiles the tiled map is missing, nearest the center
+// first, and then the ones just off screen, nearbyKeys, behind every tile
+// on screen.  A tile still queued that has scrolled into view or out of it
+// is moved up or down the queue, and one that is neither any more is
+// cancelled.
+void RequestTiles(const std::vector<MapRequestKey>& tileKeys, const std::vector<MapRequestKey>& nearbyKeys)
+{
+    if (NULL == g_pFetchQueue)
+    {
+        return;
+    }
+
+    std::unordered_map<MapRequestKey, MapPriority, MapRequestKeyHash> wanted;
+
+    for (const MapRequestKey& tileKey : nearbyKeys)
+    {
+        wanted[tileKey] = MapPriority::NEAR_VISIBLE;
+    }
+
+    for (const MapRequestKey& tileKey : tileKeys)
+    {
+        wanted[tileKey] = MapPriority::VISIBLE;
+    }
+
+    for (auto it = g_pendingTiles.begin(); it != g_pendingTiles.end(); )
+    {
+        auto want = wanted.find(it->first);
+
+        if (want == wanted.end())
+        {
+            g_pFetchQueue->Cancel(it->second.requestId);
+            it = g_pendingTiles.erase(it);
+            continue;
+        }
+
+        // a tile that has already started downloading just carries on
+        if (want->second != it->second.priority)
+        {
+            g_pFetchQueue->Reprioritize(it->second.requestId, want->second);
+            it->second.priority = want->second;
+        }
+
+        ++it;
+    }
+
+    for (const std::vector<MapRequestKey>* pKeys : { &tileKeys, &nearbyKeys })
+    {
+        for (const MapRequestKey& tileKey : *pKeys)
+        {
+            if (g_pendingTiles.count(tileKey) == 0 && g_failedTiles.count(tileKey) == 0)
+            {
+                MapPriority priority = wanted[tileKey];
+
+                g_pendingTiles[tileKey] = PendingTile{ g_pFetchQueue->Submit(tileKey, priority), priority };
+            }
+        }
+    }
+}
+
+// cancel every download, static maps and tiles alike
+void CancelAllFetches()
+{
+    if (NULL == g_pFetchQueue)
+    {
+        return;
+    }
+
+    g_pFetchQueue->CancelAll();
+
+    g_nPendingRequestId = 0;
+    g_pendingTiles.clear();
+}
+
+// switch between the static map and the tiled map, and show the
+// current location in the new view
+void SetViewMode(HWND hWnd, bool bTiled)
+{
+    g_bTiledView = bTiled;
+
+    HMENU hViewMenu = GetSubMenu(GetMenu(hWnd), VIEW_MENU_POSITION);
+
+    if (hViewMenu)
+    {
+        CheckMenuRadioItem(hViewMenu, ID_VIEW_STATIC, ID_VIEW_TILED,
+            bTiled ? ID_VIEW_TILED : ID_VIEW_STATIC, MF_BYCOMMAND);
+    }
+
+    // whatever the old view was waiting for isn't wanted any more
+    CancelAllFetches();
+
+    if (g_nCurrentLocation >= 0)
+    {
+        SelectLocation(hWnd, g_nCurrentLocation);
+    }
+}
+
+// the WM_APP_MAPREADY handler.  Takes ownership of pCompletion.
+void OnMapReady(HWND hWnd, MapCompletion* pCompletion)
+{
+    if (pCompletion->key.IsTile())
+    {
+        auto it = g_pendingTiles.find(pCompletion->key);
+
+        // a cancelled request may have been replaced by a new one for the same tile
+        if (it != g_pendingTiles.end() && it->second.requestId == pCompletion->requestId)
+        {
+            g_pendingTiles.erase(it);
+        }
+
+        if (MapFetchStatus::FAILED == pCompletion->status)
+        {
+            g_failedTiles.insert(pCompletion->key);
+        }
+
+        if (pCompletion->result)
+        {
+            g_mapCache.Decoded().Insert(pCompletion->key, pCompletion->result);
+
+            // repaint just the places the new tile shows up
+            if (g_bTiledView)
+            {
+                for (const PixelRect& rc : g_tileLayer.ScreenRects(pCompletion->key))
+                {
+                    RECT rect = ToRect(rc);
+                    InvalidateRect(hWnd, &rect, FALSE);
+                }
+            }
+        }
+
+        delete pCompletion;
+        return;
+    }
+
+    if (pCompletion->requestId == g_nPendingRequestId)
+    {
+        g_nPendingRequestId = 0;
+        g_bMapFailed = (MapFetchStatus::FAILED == pCompletion->status);
+    }
+
+    // a map that finished just as it was cancelled is still a good map, keep it
+    if (pCompletion->result)
+    {
+        g_mapCache.Decoded().Insert(pCompletion->key, pCompletion->result);
+
+        // is it the one on screen?
+        if (g_nCurrentLocation >= 0 && g_mapLocations[g_nCurrentLocation].key == pCompletion->key)
+        {
+            g_hCurrentMap = pCompletion->result;
+        }
+    }
+
+    // the whole map has arrived, or never will
+    if (g_hCurrentMap || g_bMapFailed)
+    {
+        g_hPartialMap.reset();
+        g_nPartialRows = 0;
+    }
+
+    delete pCompletion;
+
+    // show the new map, or the failure message
+    InvalidateRect(hWnd, NULL, FALSE);
+}
+
+// create the background revalidation thread, and start the timer that
+// sweeps g_mapRevalidation for maps due to be revalidated.  Each map it
+// revalidates is posted back to hWnd as a WM_APP_MAPREVALIDATED message.
+// This is done in InitInstance.
+void CreateRevalidateQueue(HWND hWnd)
+{
+    // runs on the worker thread: ask the server whether one map has changed
+    auto fetcher = [](const MapRequestKey& key, const MapFetchCancelToken& token, MapImageHandle& mapOut)
+    {
+        return SUCCEEDED(FetchMap(key, mapOut, token.Flag(), NULL, true));
+    };
+
+    // runs on the worker thread: the map can be revalidated again now,
+    // and the UI thread shows it if it changed
+    auto onComplete = [hWnd](MapCompletion&& completion)
+    {
+        g_mapRevalidation.EndRevalidation(completion.key);
+
+        MapCompletion* pCompletion = new MapCompletion(std::move(completion));
+
+        if (!PostMessage(hWnd, WM_APP_MAPREVALIDATED, 0, reinterpret_cast<LPARAM>(pCompletion)))
+        {
+            delete pCompletion;
+        }
+    };
+
+    g_pRevalidateQueue = new MapFetchQueue<MapImageHandle>(*g_pScheduler, MapPriority::REVALIDATE,
+        fetcher, onComplete);
+
+    // /revalidate 0 turns the sweep off.  Stale maps are still
+    // revalidated as they are shown.
+    UINT nIntervalSeconds = g_mapRevalidation.Policy().nScheduleIntervalSeconds;
+
+    if (nIntervalSeconds > 0)
+    {
+        SetTimer(hWnd, IDT_REVALIDATE, nIntervalSeconds * 1000, NULL);
+    }
+}
+
+// stop the revalidation thread and throw away any maps it finished but
+// the UI never received.  This is done in the WM_DESTROY handler, after
+// the timer is killed and the fetch threads have stopped.
+void DestroyRevalidateQueue()
+{
+    if (NULL == g_pRevalidateQueue)
+    {
+        return;
+    }
+
+    g_pRevalidateQueue->Shutdown();
+
+    delete g_pRevalidateQueue;
+    g_pRevalidateQueue = NULL;
+
+    MSG msg;
+
+    while (PeekMessage(&msg, NULL, WM_APP_MAPREVALIDATED, WM_APP_MAPREVALIDATED, PM_REMOVE))
+    {
+        delete reinterpret_cast<MapCompletion*>(msg.lParam);
+    }
+}
+
+// whether a map we already have can be used without asking the server
+// first.  One that has gone stale can, and is revalidated in the
+// background; one that has expired can't.  This runs on the UI thread and
+// on the fetch worker threads.
+bool UseCachedMap(const MapRequestKey& mapKey)
+{
+    switch (g_mapRevalidation.Classify(mapKey, MapRevalidationNow()))
+    {
+    case MapFreshness::FRESH:
+        return true;
+
+    case MapFreshness::STALE:
+        RevalidateInBackground(mapKey);
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+// ask the server on the revalidation thread whether a map has changed,
+// unless that is already happening
+void RevalidateInBackground(const MapRequestKey& mapKey)
+{
+    if (NULL == g_pRevalidateQueue || !g_mapRevalidation.BeginRevalidation(mapKey))
+    {
+        return;
+    }
+
+    g_pRevalidateQueue->Submit(mapKey);
+}
+
+// the IDT_REVALIDATE timer: revalidate the maps that went stale first, a
+// few each time, so that maps nobody has looked at for a while are right
+// when they are looked at again
+void RevalidateDueMaps()
+{
+    if (NULL == g_pRevalidateQueue)
+    {
+        return;
+    }
+
+    size_t nMaxPerSweep = g_mapRevalidation.Policy().nMaxPerSweep;
+
+    // TakeDue has claimed each of them, as BeginRevalidation would
+    for (const MapRequestKey& key : g_mapRevalidation.TakeDue(MapRevalidationNow(), nMaxPerSweep))
+    {
+        g_pRevalidateQueue->Submit(key);
+    }
+}
+
+// the WM_APP_MAPREVALIDATED handler.  Takes ownership of pCompletion.  A
+// 304 gives back the map we already had, so only a map that changed
+// changes what is on screen.
+void OnMapRevalidated(HWND hWnd, MapCompletion* pCompletion)
+{
+    if (pCompletion->result)
+    {
+        g_mapCache.Decoded().Insert(pCompletion->key, pCompletion->result);
+
+        if (pCompletion->key.IsTile())
+        {
+            if (g_bTiledView)
+            {
+                for (const PixelRect& rc : g_tileLayer.ScreenRects(pCompletion->key))
+                {
+                    RECT rect = ToRect(rc);
+                    InvalidateRect(hWnd, &rect, FALSE);
+                }
+            }
+        }
+        else if (g_nCurrentLocation >= 0 && g_mapLocations[g_nCurrentLocation].key == pCompletion->key &&
+            g_hCurrentMap && g_hCurrentMap != pCompletion->result)
+        {
+            g_hCurrentMap = pCompletion->result;
+            InvalidateRect(hWnd, NULL, FALSE);
+        }
+    }
+
+    delete pCompletion;
+}
+
+// look for the command line switches we understand, /prefetch,
+// /nostream, /noadaptive, /shared, /nodecodedcache, /server <url>,
+// /retries <n>, /timeout <ms>, /hedge, /revalidate <seconds>,
+// /batch <manifest>, /out <directory> and /format <png|jpeg|bmp> (or
+// -prefetch and so on).  This is done in
+// wWinMain.
+void ParseCommandLine()
+{
+    MapRetryPolicy retryPolicy = g_mapRetrier.Policy();
+    MapRevalidationPolicy revalidationPolicy = g_mapRevalidation.Policy();
+    int nArgs = 0;
+    LPWSTR* ppszArgs = CommandLineToArgvW(GetCommandLineW(), &nArgs);
+
+    if (NULL == ppszArgs)
+    {
+        return;
+    }
+
+    // the first argument is the program itself
+    for (int i = 1; i < nArgs; i++)
+    {
+        LPCWSTR pszArg = ppszArgs[i];
+
+        if (L'/' == pszArg[0] || L'-' == pszArg[0])
+        {
+            if (0 == _wcsicmp(pszArg + 1, L"prefetch"))
+            {
+                g_bPrefetch = true;
+            }
+            else if (0 == _wcsicmp(pszArg + 1, L"nostream"))
+            {
+                g_bStreamingDecode = false;
+            }
+            else if (0 == _wcsicmp(pszArg + 1, L"noadaptive"))
+            {
+                g_adaptivePolicy.bEnabled = false;
+            }
+            else if (0 == _wcsicmp(pszArg + 1, L"shared"))
+            {
+                g_bSharedCache = true;
+            }
+            else if (0 == _wcsicmp(pszArg + 1, L"nodecodedcache"))
+            {
+                g_bDecodedCache = false;
+            }
+            else if (0 == _wcsicmp(pszArg + 1, L"server") && i + 1 < nArgs)
+            {
+                g_strMapServer = ppszArgs[++i];
+            }
+            else if (0 == _wcsicmp(pszArg + 1, L"retries") && i + 1 < nArgs)
+            {
+                // retries after the first try
+                unsigned nRetries = 0;
+
+                if (ParseSwitchNumber(L"retries", ppszArgs[++i], MAP_MAX_RETRIES, nRetries))
+                {
+                    retryPolicy.nMaxAttempts = 1 + nRetries;
+                }
+            }
+            else if (0 == _wcsicmp(pszArg + 1, L"timeout") && i + 1 < nArgs)
+            {
+                // how long to wait for a response to go on, 0 for as long as it takes
+                ParseSwitchNumber(L"timeout", ppszArgs[++i], MAP_MAX_TIMEOUT_MS, retryPolicy.nReadTimeoutMs);
+            }
+            else if (0 == _wcsicmp(pszArg + 1, L"hedge"))
+            {
+                retryPolicy.bHedge = true;
+            }
+            else if (0 == _wcsicmp(pszArg + 1, L"revalidate") && i + 1 < nArgs)
+            {
+                // how often to sweep for stale maps, 0 for never
+                ParseSwitchNumber(L"revalidate", ppszArgs[++i], MAP_MAX_REVALIDATE_SECONDS,
+                    revalidationPolicy.nScheduleIntervalSeconds);
+            }
+            else if (0 == _wcsicmp(pszArg + 1, L"batch") && i + 1 < nArgs)
+            {
+                g_strBatchManifest = ppszArgs[++i];
+            }
+            else if (0 == _wcsicmp(pszArg + 1, L"out") && i + 1 < nArgs)
+            {
+                g_strBatchOutput = ppszArgs[++i];
+            }
+            else if (0 == _wcsicmp(pszArg + 1, L"format") && i + 1 < nArgs)
+            {
+                // an unknown format leaves it PNG
+                ParseMapImageFormat(WideToUtf8(ppszArgs[++i]), g_batchFormat);
+            }
+        }
+    }
+
+    LocalFree(ppszArgs);
+
+    // before any worker threads start
+    g_mapRetrier.SetPolicy(retryPolicy);
+    g_mapRevalidation.SetPolicy(revalidationPolicy);
+}
+
+// the number pszValue, given to /pszSwitch, in nOut.  It must be all
+// digits, so a negative number or garbage is refused, with a warning, and
+// nOut keeps its default.  One larger than nMax is taken as nMax.
+bool ParseSwitchNumber(LPCWSTR pszSwitch, LPCWSTR pszValue, unsigned nMax, unsigned& nOut)
+{
+    LPWSTR pszEnd = NULL;
+    unsigned long nValue = 0;
+
+    errno = 0;
+
+    if (iswdigit(pszValue[0]))
+    {
+        nValue = wcstoul(pszValue, &pszEnd, 10);
+    }
+
+    if (NULL == pszEnd || L'\0' != *pszEnd)
+    {
+        WCHAR szWarning[MAX_DEBUGMSG];
+
+        _snwprintf_s(szWarning, MAX_DEBUGMSG, _TRUNCATE, L"Warning: /%s needs a number from 0 to %u, not \"%s\".\n",
+            pszSwitch, nMax, pszValue);
+        OutputDebugString(szWarning);
+
+        return false;
+    }
+
+    nOut = (ERANGE == errno || nValue > nMax) ? nMax : (unsigned)nValue;
+
+    return true;
+}
+
+// fetch every map on the City menu, as many as fit in the store, in
+// parallel on their own worker threads.  This is done in InitInstance.
+void StartPrefetch(HWND hWnd)
+{
+    std::vector<MapRequestKey> prefetchKeys = SelectPrefetchKeys(g_mapLocations, g_mapCache.Decoded().Budget());
+
+    if (prefetchKeys.empty())
+    {
+        return;
+    }
+
+    // runs on a worker thread: download and decode one map, and time it
+    auto fetcher = [](const MapRequestKey& key, const MapFetchCancelToken& token, MapPrefetchResult& resultOut)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        bool bSucceeded = SUCCEEDED(FetchMap(key, resultOut.hMap, token.Flag(), NULL));
+
+        resultOut.milliseconds = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count();
+
+        return bSucceeded;
+    };
+
+    // runs on a worker thread: hand the result to the UI thread
+    auto onComplete = [hWnd](PrefetchCompletion&& completion)
+    {
+        PrefetchCompletion* pCompletion = new PrefetchCompletion(std::move(completion));
+
+        if (!PostMessage(hWnd, WM_APP_PREFETCHREADY, 0, reinterpret_cast<LPARAM>(pCompletion)))
+        {
+            delete pCompletion;
+        }
+    };
+
+    g_pPrefetchQueue = new MapFetchQueue<MapPrefetchResult>(*g_pScheduler, MapPriority::PREFETCH,
+        fetcher, onComplete);
+
+    _snwprintf_s(szDebugMsg, MAX_DEBUGMSG, L"Prefetching %zu maps, %d at a time.\n",
+        prefetchKeys.size(), MAP_PREFETCH_THREADS);
+    OutputDebugString(szDebugMsg);
+
+    g_prefetchReport.Start(prefetchKeys.size());
+
+    for (const MapRequestKey& key : prefetchKeys)
+    {
+        g_pPrefetchQueue->Submit(key);
+    }
+}
+
+// stop the prefetch threads and throw away any maps the UI never
+// received.  This is done when the prefetch finishes, or in the
+// WM_DESTROY handler if it doesn't get the chance.
+void DestroyPrefetchQueue()
+{
+    if (NULL == g_pPrefetchQueue)
+    {
+        return;
+    }
+
+    g_pPrefetchQueue->Shutdown();
+
+    delete g_pPrefetchQueue;
+    g_pPrefetchQueue = NULL;
+
+    MSG msg;
+
+    while (PeekMessage(&msg, NULL, WM_APP_PREFETCHREADY, WM_APP_PREFETCHREADY, PM_REMOVE))
+    {
+        delete reinterpret_cast<PrefetchCompletion*>(msg.lParam);
+    }
+}
+
+// the WM_APP_PREFETCHREADY handler.  Takes ownership of pCompletion.
+void OnPrefetchReady(HWND hWnd, PrefetchCompletion* pCompletion)
+{
+    g_prefetchReport.Record(pCompletion->key, pCompletion->status, pCompletion->result.milliseconds);
+
+    if (pCompletion->result.hMap)
+    {
+        g_mapCache.Decoded().Insert(pCompletion->key, pCompletion->result.hMap);
+
+        // the user may already be waiting for this one
+        if (g_nCurrentLocation >= 0 && !g_hCurrentMap &&
+            g_mapLocations[g_nCurrentLocation].key == pCompletion->key)
+        {
+            g_hCurrentMap = pCompletion->result.hMap;
+            g_bMapFailed = false;
+
+            InvalidateRect(hWnd, NULL, FALSE);
+        }
+    }
+
+    delete pCompletion;
+
+    if (g_prefetchReport.IsComplete())
+    {
+        // the report can be longer than szDebugMsg
+        std::wstring strReport = Utf8ToWide(g_prefetchReport.Format());
+        OutputDebugString(strReport.c_str());
+
+        // the worker threads have nothing left to do
+        DestroyPrefetchQueue();
+    }
+}
+
+// render every map in the /batch manifest to an image file in
+// g_strBatchOutput, on MAP_BATCH_THREADS worker threads, and write the
+// timings beside them to batch.txt and batch.json.  Nothing is shown; the
+// report goes to the console the program was started from, if there is
+// one, and to the debugger.  This is done in wWinMain instead of
+// InitInstance, and returns the program's exit code: 0 if every map was
+// written, 1 if some weren't, and 2 if the batch couldn't be started.
+int RunBatch()
+{
+    std::vector<MapLocation> batchLocations;
+    std::vector<MapBatchItem> batchItems;
+    std::filesystem::path outputDirectory(g_strBatchOutput);
+    std::error_code error;
+    MapBatchReport report;
+    std::string strReport;
+    std::string strJson;
+    HANDLE hConsole = NULL;
+    DWORD dwWritten = 0;
+    int nExitCode = 2;
+
+    CoInitializeEx(NULL, COINIT_MULTITHREADED);
+
+    if (FAILED(CoCreateInstance(CLSID_WICImagingFactory, NULL, CLSCTX_INPROC_SERVER,
+        IID_PPV_ARGS(&g_pIWICFactory))))
+    {
+        OutputDebugString(L"Error: Could not create WICImagingFactory.\n");
+        goto CleanUp;
+    }
+
+    if (!LoadMapLocations(g_strBatchManifest, batchLocations, kMaxMapBatchItems))
+    {
+        _snwprintf_s(szDebugMsg, MAX_DEBUGMSG, L"Error: no maps in %s.\n", g_strBatchManifest.c_str());
+        OutputDebugString(szDebugMsg);
+        goto CleanUp;
+    }
+
+    std::filesystem::create_directories(outputDirectory, error);
+
+    if (!std::filesystem::is_directory(outputDirectory))
+    {
+        _snwprintf_s(szDebugMsg, MAX_DEBUGMSG, L"Error: could not create %s.\n", g_strBatchOutput.c_str());
+        OutputDebugString(szDebugMsg);
+        goto CleanUp;
+    }
+
+    OpenMapSources();
+
+    batchItems = PlanMapBatch(batchLocations, outputDirectory, g_batchFormat);
+
+    _snwprintf_s(szDebugMsg, MAX_DEBUGMSG, L"Rendering %zu maps on %d threads.\n",
+        batchItems.size(), MAP_BATCH_THREADS);
+    OutputDebugString(szDebugMsg);
+
+    RunMapBatch(batchItems,
+        // runs on a worker thread: download and decode one map.  WIC
+        // decodes it as it arrives, so the decode is part of the fetch.
+        [](const MapRequestKey& key, const MapFetchCancelToken& token, MapImageHandle& hMapOut,
+            MapBatchTimes& timesOut)
+        {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+            HRESULT hrFetch = FetchMap(key, hMapOut, token.Flag(), NULL);
+
+            timesOut.milliseconds[(size_t)MapBatchStage::FETCH] = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - start).count();
+
+            return SUCCEEDED(hrFetch);
+        },
+        g_batchFormat,
+        // runs on a worker thread: encode one map with WIC
+        [](const MapImage& mapImage, std::vector<uint8_t>& dataOut)
+        {
+            return SUCCEEDED(EncodeMapImage(mapImage, g_batchFormat, dataOut));
+        },
+        MAP_BATCH_THREADS, report,
+        []() { CoInitializeEx(NULL, COINIT_MULTITHREADED); },
+        []() { CoUninitialize(); });
+
+    strReport = report.Format();
+    strJson = report.ToJson();
+
+    if (!WriteMapBatchFile(outputDirectory / L"batch.txt", std::vector<uint8_t>(strReport.begin(), strReport.end())) ||
+        !WriteMapBatchFile(outputDirectory / L"batch.json", std::vector<uint8_t>(strJson.begin(), strJson.end())))
+    {
+        OutputDebugString(L"Warning: could not write the batch report.\n");
+    }
+
+    // the report can be longer than szDebugMsg
+    OutputDebugString(Utf8ToWide(strReport).c_str());
+
+    // a console that started the program, or the file its output was
+    // redirected to, gets the report too
+    AttachConsole(ATTACH_PARENT_PROCESS);
+    hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
+
+    if (NULL != hConsole && INVALID_HANDLE_VALUE != hConsole)
+    {
+        WriteFile(hConsole, strReport.data(), (DWORD)strReport.size(), &dwWritten, NULL);
+    }
+
+    nExitCode = (report.Failed() > 0) ? 1 : 0;
+
+CleanUp:
+
+    // the workers have stopped, so nothing is using these
+    delete g_pHttpPool;
+    g_pHttpPool = NULL;
+
+    g_mapCache.Clear();
+
+    SAFE_RELEASE(g_pIWICFactory);
+
+    delete g_pDiskCache;
+    g_pDiskCache = NULL;
+
+    delete g_pDecodedCache;
+    g_pDecodedCache = NULL;
+
+    delete g_pSharedCache;
+    g_pSharedCache = NULL;
+
+    CoUninitialize();
+
+    return nExitCode;
+}
+
+// the WM_APP_MAPPROGRESS handler.  Takes ownership of pProgress.
+void OnMapProgress(HWND hWnd, MapProgress* pProgress)
+{
+    // only show it if it's the map the user is waiting for
+    if (!g_bTiledView && !g_hCurrentMap && g_nCurrentLocation >= 0 &&
+        g_mapLocations[g_nCurrentLocation].key == pProgress->key &&
+        pProgress->nRowsReady > g_nPartialRows)
+    {
+        if (g_hPartialMap == pProgress->hMap)
+        {
+            // only the rows decoded since the last repaint have changed
+            RECT rcClient;
+            GetClientRect(hWnd, &rcClient);
+
+            const MapImage& mapImage = *pProgress->hMap;
+
+            // the rows as they are shown, which may be scaled
+            PixelRect rcRows = GetMapRect(mapImage, rcClient.right, rcClient.bottom);
+            int nShownHeight = rcRows.Height();
+
+            rcRows.bottom = rcRows.top + NearestRowsReady(pProgress->nRowsReady, mapImage.Height(), nShownHeight);
+            rcRows.top += NearestRowsReady(g_nPartialRows, mapImage.Height(), nShownHeight);
+
+            RECT rect = ToRect(rcRows);
+            InvalidateRect(hWnd, &rect, FALSE);
+        }
+        else
+        {
+            // the first rows replace the "Downloading map..." message
+            InvalidateRect(hWnd, NULL, FALSE);
+        }
+
+        g_hPartialMap = pProgress->hMap;
+        g_nPartialRows = pProgress->nRowsReady;
+    }
+
+    delete pProgress;
+}
+
+// destroy global GDI objects to avoid a memory leak
+void DestroyGDIObjects()
+{
+    DeleteObject(g_hFontSmallBold);
+    DeleteObject(g_hFontSmallNormal);
+    DeleteObject(g_hOldFont);			// just in case
+
+    // the back buffer's DIB and memory DC
+    g_backBuffer.Destroy();
+}
+
+// paint the part of the window that needs it.  The picture is composed
+// in g_backBuffer, but only within ps.rcPaint, and only ps.rcPaint is
+// copied to the screen, so a repaint costs as much as the area that
+// changed and nothing is ever seen half drawn.
+void PaintWindow(HWND hWnd)
+{
+    RECT rcClient;
+    PAINTSTRUCT ps;
+
+    // this hdc will be destroyed on EndPaint
+    HDC hdc = BeginPaint(hWnd, &ps);
+
+    // the client area, which unlike GetWindowRect doesn't include the
+    // caption, menu and borders, and is already in window coordinates
+    GetClientRect(hWnd, &rcClient);
+
+    if (IsRectEmpty(&ps.rcPaint) || IsRectEmpty(&rcClient))
+    {
+        EndPaint(hWnd, &ps);
+        return;
+    }
+
+    if (FAILED(g_backBuffer.Resize(hdc, rcClient.right, rcClient.bottom)))
+    {
+        // no memory for the back buffer, at least don't leave garbage
+        FillRect(hdc, &ps.rcPaint, (HBRUSH)(COLOR_WINDOW + 1));
+        EndPaint(hWnd, &ps);
+        return;
+    }
+
+    PixelRect dirty = IntersectPixelRect(ToPixelRect(ps.rcPaint), ToPixelRect(rcClient));
+
+    // GDI may not have finished drawing the last paint's text into the
+    // DIB, and the pixels are about to be written directly
+    GdiFlush();
+
+    MapMetrics::Clock::time_point tPaint = MapMetrics::Clock::now();
+
+    if (g_nCurrentLocation < 0)
+    {
+        ComposeInstructions(L"Select a city from City menu.", dirty);
+    }
+    else if (g_bTiledView)
+    {
+        if (g_mapLocations[g_nCurrentLocation].hasCoordinates)
+        {
+            ComposeTiledMap(dirty);
+        }
+        else
+        {
+            ComposeInstructions(L"This location has no latitude and longitude for the tiled map.", dirty);
+        }
+    }
+    else if (g_hCurrentMap)
+    {
+        ComposeMap(g_hCurrentMap, -1, dirty);
+    }
+    else if (g_hPartialMap)
+    {
+        // as much of the map as has arrived
+        ComposeMap(g_hPartialMap, g_nPartialRows, dirty);
+    }
+    else
+    {
+        // the map is still on its way, or never arrived
+        ComposeInstructions(g_bMapFailed ?
+            L"The map could not be downloaded." : L"Downloading map...", dirty);
+    }
+
+    tPaint = g_metrics.RecordSince(MapMetric::COMPOSE, tPaint);
+
+    // copy only what was recomposed to the screen
+    g_backBuffer.Present(hdc, ps.rcPaint);
+
+    g_metrics.RecordSince(MapMetric::PRESENT, tPaint);
+
+    // this frees the hdc created with BeginPaint
+    EndPaint(hWnd, &ps);
+}
+
+// where a map is drawn: in the middle of the client area, and scaled to
+// fill as much of it as it can if g_bFitToWindow is set
+PixelRect GetMapRect(const MapImage& mapImage, int nClientWidth, int nClientHeight)
+{
+    PixelRect rc;
+
+    int nWidth = mapImage.Width();
+    int nHeight = mapImage.Height();
+
+    if (g_bFitToWindow && nClientWidth > 0 && nClientHeight > 0)
+    {
+        FitImageSize(mapImage.Width(), mapImage.Height(), nClientWidth, nClientHeight, &nWidth, &nHeight);
+    }
+
+    rc.left = (nClientWidth - nWidth) / 2;
+    rc.top = (nClientHeight - nHeight) / 2;
+    rc.right = rc.left + nWidth;
+    rc.bottom = rc.top + nHeight;
+
+    return rc;
+}
+
+// the map scaled to nWidth x nHeight, and in *pRowsOut how many of its rows
+// are ready when only nRows of the map's rows are.  A negative nRows means
+// the whole map.  Returns hMap itself if there's no memory to scale it.
+MapImageHandle GetScaledMap(const MapImageHandle& hMap, int nRows, int nWidth, int nHeight, int* pRowsOut)
+{
+    if (nRows < 0 || nRows > hMap->Height())
+    {
+        nRows = hMap->Height();
+    }
+
+    // while the frame is being dragged, or the map is still arriving, the
+    // map is scaled over and over, so use the fast filter.  It also only
+    // needs the map's rows that are ready.
+    bool bPartial = nRows < hMap->Height();
+    ScaleFilter filter = (g_bLiveResize || bPartial) ? ScaleFilter::NEAREST : ScaleFilter::LANCZOS3;
+
+    int nFirstRow = 0;
+    int nLastRow = bPartial ? NearestRowsReady(nRows, hMap->Height(), nHeight) : nHeight;
+
+    if (g_pScaledMap && g_hScaledSource == hMap && g_scaledFilter == filter &&
+        g_pScaledMap->Width() == nWidth && g_pScaledMap->Height() == nHeight)
+    {
+        if (g_nScaledRows == nRows)
+        {
+            *pRowsOut = nLastRow;
+            return g_pScaledMap;
+        }
+
+        // more of the same map has been decoded, only scale the new rows
+        if (g_nScaledRows < nRows)
+        {
+            nFirstRow = NearestRowsReady(g_nScaledRows, hMap->Height(), nHeight);
+        }
+    }
+    else
+    {
+        std::shared_ptr<MapImage> pScaled = MapImage::Create(nWidth, nHeight);
+
+        if (!pScaled)
+        {
+            *pRowsOut = nRows;
+            return hMap;
+        }
+
+        g_pScaledMap = pScaled;
+        g_hScaledSource = hMap;
+        g_scaledFilter = filter;
+    }
+
+    ScaleImageRows(PixelBufferOf(*hMap), PixelBufferOf(*g_pScaledMap), filter, nFirstRow, nLastRow);
+
+    g_nScaledRows = nRows;
+    *pRowsOut = nLastRow;
+
+    return g_pScaledMap;
+}
+
+// write a line of text in the middle of the back buffer
+void ComposeInstructions(LPCTSTR pszText, const PixelRect& dirty)
+{
+    HDC hdcMem = g_backBuffer.DC();
+    PixelBuffer pixels = g_backBuffer.Pixels();
+
+    // the window background, as BGRX
+    COLORREF crWindow = GetSysColor(COLOR_WINDOW);
+    uint32_t nBackground = ((uint32_t)GetRValue(crWindow) << 16) |
+        ((uint32_t)GetGValue(crWindow) << 8) | (uint32_t)GetBValue(crWindow);
+
+    FillPixels(pixels, dirty, dirty, nBackground);
+
+    // keep the text within the dirty rectangle, the rest of the
+    // back buffer is already right
+    RECT rcDirty = ToRect(dirty);
+    HRGN hrgnClip = CreateRectRgnIndirect(&rcDirty);
+
+    // select that region into our device context
+    SelectClipRgn(hdcMem, hrgnClip);
+
+    // select the small bold font into the device context
+    g_hOldFont = (HFONT)SelectObject(hdcMem, g_hFontSmallBold);
+
+    // the background has already been filled in
+    int nOldBkMode = SetBkMode(hdcMem, TRANSPARENT);
+
+    // compute the pixel length of the string so we can
+    // center it on the screen
+
+    SIZE charSize;
+    RECT rectText;
+
+    CString aString = pszText;
+
+    GetTextExtentPoint32(hdcMem, (LPCTSTR)aString, aString.GetLength(), &charSize);
+
+    // centered at 50% of the client area width
+    int nStartPointX = (pixels.width - charSize.cx) / 2;
+
+    // start the title at 50% down from the top of the client area
+    int nStartPointY = pixels.height / 2;
+
+    SetRect(&rectText, nStartPointX, nStartPointY,
+        nStartPointX + charSize.cx, nStartPointY + charSize.cy);
+
+    DrawText(hdcMem, (LPCTSTR)aString, aString.GetLength(), &rectText, DT_BOTTOM | DT_SINGLELINE | DT_CENTER | DT_NOCLIP);
+
+    SetBkMode(hdcMem, nOldBkMode);
+
+    // don't delete the fonts as they are global and are deleted in DestroyGDIObjects()
+    SelectObject(hdcMem, g_hOldFont);
+
+    // deselect the clip region and delete it
+    SelectClipRgn(hdcMem, NULL);
+    DeleteObject(hrgnClip);
+}
+
+// compose the map into the back buffer, in the middle of the client area
+// on a deep sky blue background, scaled to fit if g_bFitToWindow is set.
+// If nRows isn't negative, only that many rows from the top are drawn,
+// for a map that is still being decoded.
+void ComposeMap(const MapImageHandle& hMap, int nRows, const PixelRect& dirty)
+{
+    PixelBuffer pixels = g_backBuffer.Pixels();
+
+    // a partly decoded map is drawn where the whole map will be
+    if (nRows < 0 || nRows > hMap->Height())
+    {
+        nRows = hMap->Height();
+    }
+
+    PixelRect rcMap = GetMapRect(*hMap, pixels.width, pixels.height);
+
+    MapImageHandle hShown = hMap;
+
+    if (rcMap.Width() != hMap->Width() || rcMap.Height() != hMap->Height())
+    {
+        hShown = GetScaledMap(hMap, nRows, rcMap.Width(), rcMap.Height(), &nRows);
+    }
+
+    rcMap.bottom = rcMap.top + nRows;
+
+    // the background around the map, the same deep sky blue as the tiled
+    // map.  The map's own pixels are only written once.
+    FillPixelsAround(pixels, dirty, rcMap, TileLayer::kBackgroundColor);
+
+    // the rows that are ready, straight from the store or the scaled copy.
+    // We don't free them, they belong to g_mapCache and the map handles.
+    ConstPixelBuffer source = PixelBufferOf(*hShown);
+    source.height = std::min(nRows, source.height);
+
+    BlitPixels(pixels, dirty, rcMap.left, rcMap.top, source);
+}
+
+// compose the visible tiles into the back buffer, and ask for the ones we
+// don't have
+void ComposeTiledMap(const PixelRect& dirty)
+{
+    std::vector<MapRequestKey> missingTiles;
+    std::vector<MapRequestKey> nearbyTiles;
+
+    g_tileLayer.Compose(g_mapCache.Decoded(), g_backBuffer.Pixels(), dirty, missingTiles);
+    g_tileLayer.ComposeNearby(g_mapCache.Decoded(), nearbyTiles);
+
+    // tiles that were already decoded were just drawn, only the rest
+    // need downloading, and the ones just off screen after them
+    RequestTiles(missingTiles, nearbyTiles);
+}
+
+// Decode a map image held in memory, either a fresh download or a
+// memory-mapped file in the disk cache, into 32bppBGR pixels.
+HRESULT DecodeMapImage(const BYTE* pBuf, size_t tBufSize, MapImageHandle& refMapOut)
+{
+    HRESULT	  hr = S_OK;
+
+    // pointer to a WICStream interface
+    IWICStream* pIWICStream = NULL;
+
+    if (NULL == pBuf || 0 == tBufSize || tBufSize > MAXDWORD)
+    {
+        return E_INVALIDARG;
+    }
+
+    /************************************************************************/
+    // this is how we would have done this on WindowsCE, but on the desktop
+    // we need to do something quite different.
+    //IImage* pImage = NULL;
+
+    //ImageInfo imageInfoObject;
+
+    //// now, the image bits are held in pBuf, so make an image from them and put it in pImage
+    //g_pImageFactory->CreateImageFromBuffer((const void*)pBuf, (UINT)i, BufferDisposalFlagNone, &pImage);
+    /************************************************************************/
+
+    // first, we need to put the bytes in a WICStream object
+    CHK_HR(g_pIWICFactory->CreateStream(&pIWICStream));
+
+    // documentation says this is dangerous, but in this case we
+    // already have the bytes and they'll be valid for the duration
+    // of this method, so go ahead, live dangerously!  Not really, it's quite safe in this case.
+    // https://docs.microsoft.com/en-us/windows/win32/api/wincodec/nf-wincodec-iwicstream-initializefrommemory
+    CHK_HR(pIWICStream->InitializeFromMemory(const_cast<BYTE*>(pBuf), (DWORD)tBufSize));
+
+    CHK_HR(DecodeMapStream(pIWICStream, refMapOut, NULL));
+
+CleanUp:
+
+    SAFE_RELEASE(pIWICStream);
+
+    return hr;
+}
+
+// Decode a map image read from pStream into 32bppBGR pixels.  The stream
+// may be a StreamingBufferStream over a map that is still downloading, in
+// which case the decoder waits for the bytes it needs as it goes.  If
+// pProgress is given, the map is decoded in bands of rows from the top,
+// and pProgress is told after each band how many rows are finished.
+HRESULT DecodeMapStream(IStream* pStream, MapImageHandle& refMapOut, const MapProgressCallback* pProgress)
+{
+    HRESULT	  hr = S_OK;
+
+    // pointer to a WICBitmapDecoder interface
+    IWICBitmapDecoder* pIWICDecoder = NULL;
+
+    // pointer to a WICBitmapDecoderFrame interface
+    IWICBitmapFrameDecode* pIWICBitmapFrameDecode = NULL;
+
+    // pointer to a WICFormatConverter interface
+    IWICFormatConverter* pIWICConvertedFrame = NULL;
+
+    UINT retrievedWidth = 0;
+    UINT retrievedHeight = 0;
+
+    // the number of frames in this image. For JPEGs, it should be 1 only
+    UINT nCount = 0;
+
+    // when the current stage started, for g_metrics
+    MapMetrics::Clock::time_point tStage = MapMetrics::Clock::now();
+
+    // make a Bitmap decoder from the stream.  Metadata is only read if it's
+    // asked for, so the decoder doesn't read ahead further than it must.
+    CHK_HR(g_pIWICFactory->CreateDecoderFromStream(
+        pStream,                        // The stream to use to create the decoder
+        NULL,                           // Do not prefer a particular codec vendor
+        WICDecodeMetadataCacheOnDemand, // Cache metadata when needed
+        &pIWICDecoder));                // Pointer to the decoder
+
+    CHK_HR(pIWICDecoder->GetFrameCount(&nCount));
+
+    if (nCount >= 1)
+    {
+        // get the frame. JPEGs have only one
+        CHK_HR(pIWICDecoder->GetFrame(0, &pIWICBitmapFrameDecode));
+
+        // retrieve the image dimensions in case Bing sent us a
+        // different size from what we requested
+        CHK_HR(pIWICBitmapFrameDecode->GetSize(&retrievedWidth, &retrievedHeight));
+
+        tStage = g_metrics.RecordSince(MapMetric::DECODE, tStage);
+
+        // to convert the format of the image from JPEG, we need to create a converter
+        CHK_HR(g_pIWICFactory->CreateFormatConverter(&pIWICConvertedFrame));
+
+        // convert the frame to 32bppBGR
+        CHK_HR(pIWICConvertedFrame->Initialize(
+            pIWICBitmapFrameDecode,         // frame to convert
+            GUID_WICPixelFormat32bppBGR,  // desired pixel format
+            WICBitmapDitherTypeNone,        // no dithering
+            NULL,                           // desired palette
+            0.f,                            // alpha threshold percent
+            WICBitmapPaletteTypeCustom      // palette translation type
+        ));
+
+        g_metrics.RecordSince(MapMetric::FORMAT_CONVERT, tStage);
+
+        // keep the frame at the size Bing Maps sent.  ComposeMap scales it
+        // to fit the window, so resizing the window never needs a new download
+
+        // allocate the pixels, laid out as a top-down 32bpp DIB
+        std::shared_ptr<MapImage> pMapImage = MapImage::Create((int)retrievedWidth, (int)retrievedHeight);
+
+        CHK_ALLOC(pMapImage);
+
+        // Calculate the number of bytes in 1 scanline
+        UINT nStride = DIB_WIDTHBYTES(retrievedWidth * 32);
+
+        // WIC decodes lazily, so this is where the JPEG is really decoded.
+        // When streaming, it includes waiting for the bytes to arrive.
+        tStage = MapMetrics::Clock::now();
+
+        if (NULL == pProgress)
+        {
+            // Calculate the total size of the image
+            UINT numberOfImageBytes = nStride * retrievedHeight;
+
+            // Copy the converted frame pixels to the map image buffer
+            CHK_HR(pIWICConvertedFrame->CopyPixels(nullptr, nStride, numberOfImageBytes, pMapImage->Pixels()));
+        }
+        else
+        {
+            // JPEG scanlines are decoded in order, so asking for the rows a
+            // band at a time lets each band be shown as soon as its bytes
+            // have arrived
+            for (UINT nTop = 0; nTop < retrievedHeight; nTop += MAP_DECODE_BAND_ROWS)
+            {
+                UINT nRows = retrievedHeight - nTop;
+
+                if (nRows > MAP_DECODE_BAND_ROWS)
+                {
+                    nRows = MAP_DECODE_BAND_ROWS;
+                }
+
+                WICRect rcBand = { 0, (INT)nTop, (INT)retrievedWidth, (INT)nRows };
+
+                CHK_HR(pIWICConvertedFrame->CopyPixels(&rcBand, nStride, nStride * nRows,
+                    pMapImage->Row((int)nTop)));
+
+                (*pProgress)(pMapImage, (int)(nTop + nRows));
+            }
+        }
+
+        g_metrics.RecordSince(MapMetric::COPY_PIXELS, tStage);
+
+        // the pixels are freed when the last handle to them goes away
+        refMapOut = pMapImage;
+    }
+    else
+    {
+        OutputDebugString(L"No image frames in decoder.\n");
+
+        hr = E_FAIL;
+    }
+
+CleanUp:
+
+    // release our COM interfaces
+    SAFE_RELEASE(pIWICDecoder);
+    SAFE_RELEASE(pIWICBitmapFrameDecode);
+    SAFE_RELEASE(pIWICConvertedFrame);
+
+    return hr;
+}
+
+// Encode a decoded map as a PNG, JPEG or BMP into dataOut, for /batch.
+// WIC copies the pixels into a bitmap of its own and converts them to
+// 24bpp as it encodes, so the map itself is never written to.  This runs
+// on the batch worker threads.
+HRESULT EncodeMapImage(const MapImage& mapImage, MapImageFormat format, std::vector<BYTE>& dataOut)
+{
+    HRESULT	  hr = S_OK;
+
+    IWICBitmap* pIWICBitmap = NULL;
+    IStream* pStream = NULL;
+    IWICBitmapEncoder* pIWICEncoder = NULL;
+    IWICBitmapFrameEncode* pIWICFrameEncode = NULL;
+    IPropertyBag2* pEncoderOptions = NULL;
+
+    GUID containerFormat = GUID_ContainerFormatPng;
+    WICPixelFormatGUID pixelFormat = GUID_WICPixelFormat24bppBGR;
+    PROPBAG2 qualityOption = {};
+    VARIANT varQuality;
+    STATSTG streamStat = {};
+    LARGE_INTEGER liStart = {};
+    ULONG cbRead = 0;
+
+    VariantInit(&varQuality);
+
+    if (MapImageFormat::JPEG == format)
+    {
+        containerFormat = GUID_ContainerFormatJpeg;
+    }
+    else if (MapImageFormat::BMP == format)
+    {
+        containerFormat = GUID_ContainerFormatBmp;
+    }
+
+    CHK_HR(g_pIWICFactory->CreateBitmapFromMemory(mapImage.Width(), mapImage.Height(),
+        GUID_WICPixelFormat32bppBGR, (UINT)mapImage.Stride(), (UINT)mapImage.ByteSize(),
+        const_cast<BYTE*>(mapImage.Pixels()), &pIWICBitmap));
+
+    // the encoded file goes into memory, and is written out by RunMapBatch
+    CHK_HR(CreateStreamOnHGlobal(NULL, TRUE, &pStream));
+
+    CHK_HR(g_pIWICFactory->CreateEncoder(containerFormat, NULL, &pIWICEncoder));
+    CHK_HR(pIWICEncoder->Initialize(pStream, WICBitmapEncoderNoCache));
+    CHK_HR(pIWICEncoder->CreateNewFrame(&pIWICFrameEncode, &pEncoderOptions));
+
+    // the same quality MapRender's libjpeg encoder uses
+    if (MapImageFormat::JPEG == format)
+    {
+        qualityOption.pstrName = const_cast<LPOLESTR>(L"ImageQuality");
+        varQuality.vt = VT_R4;
+        varQuality.fltVal = 0.85f;
+
+        CHK_HR(pEncoderOptions->Write(1, &qualityOption, &varQuality));
+    }
+
+    CHK_HR(pIWICFrameEncode->Initialize(pEncoderOptions));
+    CHK_HR(pIWICFrameEncode->SetSize(mapImage.Width(), mapImage.Height()));
+
+    // the encoder may pick a different format, WriteSource converts to it
+    CHK_HR(pIWICFrameEncode->SetPixelFormat(&pixelFormat));
+    CHK_HR(pIWICFrameEncode->WriteSource(pIWICBitmap, NULL));
+    CHK_HR(pIWICFrameEncode->Commit());
+    CHK_HR(pIWICEncoder->Commit());
+
+    CHK_HR(pStream->Stat(&streamStat, STATFLAG_NONAME));
+
+    dataOut.resize((size_t)streamStat.cbSize.QuadPart);
+
+    CHK_HR(pStream->Seek(liStart, STREAM_SEEK_SET, NULL));
+    CHK_HR(pStream->Read(dataOut.data(), (ULONG)dataOut.size(), &cbRead));
+
+    if (cbRead != dataOut.size())
+    {
+        hr = E_FAIL;
+    }
+
+CleanUp:
+
+    // release our COM interfaces
+    SAFE_RELEASE(pEncoderOptions);
+    SAFE_RELEASE(pIWICFrameEncode);
+    SAFE_RELEASE(pIWICEncoder);
+    SAFE_RELEASE(pStream);
+    SAFE_RELEASE(pIWICBitmap);
+
+    return hr;
+}
+
+// GetBingMap, but only one thread at a time downloads any one map.  A
+// thread asking for a map another thread is already downloading waits
+// for it and gets the same map, and a map that failed a moment ago fails
+// again at once.  Only the thread that downloads the map sees pProgress
+// called.  This runs on the map fetch worker threads, and with bRevalidate
+// on the revalidation thread.
+HRESULT FetchMap(const MapRequestKey& mapKey, MapImageHandle& refMapOut, const std::atomic<bool>* pbCancel,
+    const MapProgressCallback* pProgress, bool bRevalidate)
+{
+    HRESULT hrFetch = E_FAIL;
+
+    auto fetch = [&](MapImageHandle& mapOut)
+    {
+        hrFetch = GetBingMap(mapKey, mapOut, pbCancel, pProgress, bRevalidate);
+        return SUCCEEDED(hrFetch);
+    };
+
+    switch (g_mapFlights.Run(mapKey, pbCancel, fetch, refMapOut))
+    {
+    case MapSingleFlightStatus::FETCHED:
+        return S_OK;
+
+    case MapSingleFlightStatus::SHARED:
+        OutputDebugString(L"Bing Map shared with a download already in progress.\n");
+        return S_OK;
+
+    case MapSingleFlightStatus::FAILED_RECENTLY:
+        OutputDebugString(L"Bing Map failed a moment ago, not asking again yet.\n");
+        return E_FAIL;
+
+    case MapSingleFlightStatus::CANCELLED:
+        return E_ABORT;
 
-                // read the file again for the next block
-                bRead = InternetReadFile(hMapUrl, &sBuf, g_nPacketSize, &dwBytesRead);
+    default:
+        // another thread's download failed, we don't have its HRESULT
+        return FAILED(hrFetch) ? hrFetch : E_FAIL;
+    }
+}
+
+// whether a download that failed with hr might succeed if it were tried
+// again: a timeout, a connection that failed or broke, a 5xx, 408 or 429,
+// or a try that was aborted because a hedge won.  A 404, a map that won't
+// decode or running out of memory would only happen again.
+MapAttemptResult MapAttemptResultForHResult(HRESULT hr)
+{
+    if (SUCCEEDED(hr))
+    {
+        return MapAttemptResult::SUCCEEDED;
+    }
+
+    if (FACILITY_HTTP == HRESULT_FACILITY(hr))
+    {
+        return MapAttemptResultForHttpStatus(HRESULT_CODE(hr));
+    }
+
+    if (E_ABORT == hr)
+    {
+        return MapAttemptResult::RETRY;
+    }
+
+    if (FACILITY_WIN32 == HRESULT_FACILITY(hr))
+    {
+        switch (HRESULT_CODE(hr))
+        {
+        case ERROR_INTERNET_TIMEOUT:
+        case ERROR_INTERNET_CANNOT_CONNECT:
+        case ERROR_INTERNET_CONNECTION_ABORTED:
+        case ERROR_INTERNET_CONNECTION_RESET:
+        case ERROR_INTERNET_OPERATION_CANCELLED:
+        case ERROR_INTERNET_NAME_NOT_RESOLVED:
+        case ERROR_HTTP_INVALID_SERVER_RESPONSE:
+            return MapAttemptResult::RETRY;
+
+        default:
+            break;
+        }
+    }
+
+    return MapAttemptResult::FAIL;
+}
+
+// Get the map described by requestKey, from memory, from the shared cache
+// other instances fill with /shared, mapped from the decoded cache, from
+// the disk cache or by downloading it, and decode it into refMapOut.  This runs on the map
+// fetch worker threads.  If pbCancel is set while the map is downloading,
+// the download is abandoned and E_ABORT is returned.
+//
+// A map we have is used as it is while g_mapRevalidation says it is fresh
+// or stale, a stale one being revalidated in the background too.  One
+// that has expired, or any map with bRevalidate, is revalidated first: the
+// server is asked with a conditional request whether it has changed, and
+// a 304 means the map we have is still right.
+//
+// A download that fails in a way that might not happen again is tried
+// again, and with /hedge one that is slower than most is raced by a
+// second, as g_mapRetrier decides.  Each try is a DownloadBingMap.
+//
+// Returns S_OK, or the HRESULT the map failed with, so callers can tell a
+// cancel (E_ABORT) from a download that failed.
+HRESULT GetBingMap(const MapRequestKey& requestKey, MapImageHandle& refMapOut, const std::atomic<bool>* pbCancel = NULL,
+    const MapProgressCallback* pProgress = NULL, bool bRevalidate = false)
+{
+    HRESULT	  hr = S_OK;
+
+    // these are the Bing Maps defaults
+    const int defaultMapWidth = 500;
+    const int defaultMapHeight = 400;
+
+    // everything that makes this map different from any other
+    MapRequestKey mapKey(requestKey);
+
+    // how long reading it from the disk cache takes, for g_metrics
+    MapMetrics::Clock::time_point tStage = MapMetrics::Clock::now();
 
-            }  // end while
+    // what each try at downloading it, and the hedge racing it, ended with
+    HRESULT hrAttempts[2] = { E_FAIL, E_FAIL };
 
-            // close the handle on the HTTP request
-            InternetCloseHandle(hMapUrl);
+    // what we already have of the map, decoded or only as its JPEG, and
+    // where it was
+    MapImageHandle hCachedMap;
+    MapCacheTier cachedTier = MapCacheTier::NONE;
+    bool bHaveMap = false;
 
-            if (readBufferArray.size() > 0)
+    // what the server said about it last time, to ask it whether it has
+    // changed since
+    MapValidators validators;
+    bool bConditional = false;
+
+    // default to Seattle, naturally. Best in the west.
+    if (mapKey.location.empty())
+    {
+        mapKey.location = L"Seattle";
+    }
+
+    if (mapKey.imagerySet.empty())
+    {
+        mapKey.imagerySet = DEFAULT_IMAGERY_SET;
+    }
+
+    if (mapKey.width <= 50)
+    {
+        mapKey.width = defaultMapWidth;
+    }
+
+    if (mapKey.height <= 50)
+    {
+        mapKey.height = defaultMapHeight;
+    }
+
+    // a map we downloaded earlier in this run, and still have the JPEG of,
+    // is decoded from that.  Revalidating, one that isn't decoded any more
+    // isn't decoded until we know it hasn't changed.
+    if (bRevalidate)
+    {
+        hCachedMap = g_mapCache.Decoded().Find(mapKey);
+        cachedTier = hCachedMap ? MapCacheTier::DECODED : MapCacheTier::NONE;
+        bHaveMap = hCachedMap || g_mapCache.Compressed().Contains(mapKey);
+    }
+    else
+    {
+        hCachedMap = g_mapCache.Find(mapKey, &cachedTier);
+        bHaveMap = (bool)hCachedMap;
+
+        if (hCachedMap)
+        {
+            OutputDebugString(L"Bing Map decoded from memory.\n");
+        }
+    }
+
+    // a map another instance of the program has downloaded and decoded is
+    // copied out of shared memory, with what the server said about it,
+    // without touching the network or the decoder
+    if (!bHaveMap && !bRevalidate && g_pSharedCache)
+    {
+        MapMetrics::Clock::time_point tShared = MapMetrics::Clock::now();
+        MapValidators sharedValidators;
+
+        hCachedMap = g_pSharedCache->Find(mapKey, &sharedValidators);
+
+        if (hCachedMap)
+        {
+            g_metrics.RecordSince(MapMetric::SHARED_CACHE_READ, tShared);
+
+            if (sharedValidators.nFetchedAt > 0)
             {
-                // the size of the last packet is already in the IOVEC structure,
-                // FileMemoryBlock, so use it
-                size_t tBufSize = ((readBufferArray.size() - 1) * g_nPacketSize) +
-                    FileMemoryBlock.iovcnt;
+                g_mapRevalidation.Set(mapKey, sharedValidators);
+            }
 
-                // allocate a contiguous buffer the size of our segments
-                CHK_ALLOC(pBuf = new BYTE[tBufSize]);
+            // a 304 for it saves a decode as much as one for a map in
+            // the decoded tier
+            cachedTier = MapCacheTier::DECODED;
+            bHaveMap = true;
 
-                // iterate through the vector and copy the memory segments
-                // into the final buffer
-                std::vector<IOVEC>::iterator it;
-                size_t i = 0;
+            OutputDebugString(L"Bing Map copied from the shared cache.\n");
+        }
+    }
 
-                // the readBufferArray contents of IOVEC structures will be 
-                // cleared when it goes out of scope.
-                for (it = readBufferArray.begin(); it < readBufferArray.end(); it++)
-                {
-                    // we're not allocating any memory here, we're just incrementing a pointer
-                    // to a segment of memory inside our contiguous pBuf buffer
-                    LPBYTE pNew = pBuf + i;
+    // a map we decoded before, in this run of the program or an earlier
+    // one, is the decoded cache's file itself, mapped into memory, so it
+    // needs no decode and no copy, and only the pages of it that are
+    // painted are ever read.  Revalidating, it is used as it is if it
+    // hasn't changed, which costs nothing either.
+    if (!bHaveMap && g_pDecodedCache)
+    {
+        MapMetrics::Clock::time_point tDecoded = MapMetrics::Clock::now();
+        MapValidators decodedValidators;
+
+        hCachedMap = g_pDecodedCache->Lookup(mapKey, &decodedValidators);
+
+        if (hCachedMap)
+        {
+            g_metrics.RecordSince(MapMetric::DECODED_CACHE_MAP, tDecoded);
+
+            if (decodedValidators.nFetchedAt > 0)
+            {
+                g_mapRevalidation.Set(mapKey, decodedValidators);
+            }
+
+            cachedTier = MapCacheTier::DECODED;
+            bHaveMap = true;
 
-                    // copy the memory in the iovec segment to the pBuf buffer.  Remember, pNew points
-                    // to an address inside already-allocated pBuf.
-                    memcpy_s(pNew, (size_t)(it->iovcnt), (const void*)(it->pBytes), (size_t)(it->iovcnt));
+            OutputDebugString(L"Bing Map mapped from the decoded cache.\n");
+        }
+    }
+
+    // a map we downloaded before, in this run of the program or an earlier
+    // one, is decoded straight out of the memory-mapped cache file without
+    // touching the network at all
+    if (!bHaveMap && g_pDiskCache)
+    {
+        MapCacheView cachedMap;
+
+        if (g_pDiskCache->Lookup(mapKey, cachedMap))
+        {
+            hr = DecodeMapImage(cachedMap.pData, cachedMap.nSize, hCachedMap);
+
+            if (SUCCEEDED(hr))
+            {
+                g_metrics.RecordSince(MapMetric::CACHE_DECODE, tStage);
 
-                    // increment the buffer pointer inside pBuf
-                    i += (size_t)(it->iovcnt);
+                // keep the JPEG in memory too, so it isn't read from disk again
+                g_mapCache.Compressed().Insert(mapKey, cachedMap.pData, cachedMap.nSize);
 
-                    // recover the heap memory from the iovec segment, we no longer need it
-                    // because it has been copied into the pBuf
-                    delete[] it->pBytes;
+                // and what the server said about it, which decides
+                // whether it can be used without asking again
+                if (cachedMap.validators.nFetchedAt > 0)
+                {
+                    g_mapRevalidation.Set(mapKey, cachedMap.validators);
                 }
 
+                // and let the other instances, and the next run of the
+                // program, have it without decoding it.  Its JPEG is
+                // already on disk.
+                PersistMap(mapKey, MapBytesHandle(), hCachedMap, cachedMap.validators);
+
+                bHaveMap = true;
+
+                OutputDebugString(L"Bing Map read from the disk cache.\n");
+            }
+            else
+            {
+                // the cached file is no good, forget it and download the map again
+                OutputDebugString(L"Warning: discarding undecodable disk cache entry.\n");
+
+                cachedMap.file.Close();
+                g_pDiskCache->Remove(mapKey);
 
-                /************************************************************************/
-                // this is how we would have done this on WindowsCE, but on the desktop
-                // we need to do something quite different.
-                //IImage* pImage = NULL;
+                hCachedMap.reset();
+            }
+        }
+    }
 
-                //ImageInfo imageInfoObject;
+    // use the map we have, unless it has to be revalidated first
+    if (hCachedMap && !bRevalidate && UseCachedMap(mapKey))
+    {
+        refMapOut = hCachedMap;
+        return S_OK;
+    }
 
-                //// now, the image bits are held in pBuf, so make an image from them and put it in pImage
-                //g_pImageFactory->CreateImageFromBuffer((const void*)pBuf, (UINT)i, BufferDisposalFlagNone, &pImage);
-                /************************************************************************/
+    // ask only whether it has changed, if we can.  A map the server gave
+    // no validators for is downloaded again.
+    bConditional = bHaveMap && g_mapRevalidation.Get(mapKey, validators) && validators.CanRevalidate();
 
-                // first, we need to put the newly read bytes in a WICStream object                
-                CHK_HR(g_pIWICFactory->CreateStream(&pIWICStream));
+    // download it.  Only the first try shows its progress; a hedge
+    // racing it would draw over the same rows.
+    MapRetrier::Attempt<MapImageHandle> attempt = [&](MapAttemptToken& token, MapImageHandle& mapOut)
+    {
+        HRESULT hrAttempt = DownloadBingMap(mapKey, mapOut, token, (0 == token.Index()) ? pProgress : NULL,
+            bConditional ? &validators : NULL);
 
-                // documentation says this is dangerous, but in this case we
-                // already have the bytes and they'll be valid for the duration
-                // of this method, so go ahead, live dangerously!  Not really, it's quite safe in this case.
-                // https://docs.microsoft.com/en-us/windows/win32/api/wincodec/nf-wincodec-iwicstream-initializefrommemory
-                CHK_HR(pIWICStream->InitializeFromMemory(pBuf, (DWORD)tBufSize));
+        hrAttempts[token.Index()] = hrAttempt;
 
-                // make a Bitmap decoder from the stream
-                CHK_HR(g_pIWICFactory->CreateDecoderFromStream(
-                    pIWICStream,                    // The stream to use to create the decoder
-                    NULL,                           // Do not prefer a particular codec vendor
-                    WICDecodeMetadataCacheOnLoad,   // Cache metadata when needed
-                    &pIWICDecoder));                // Pointer to the decoder
+        return MapAttemptResultForHResult(hrAttempt);
+    };
 
-                // the number of frames in this image. For JPEGs, it should be 1 only
-                UINT nCount = 0;
+    switch (g_mapRetrier.Run(pbCancel, attempt, refMapOut))
+    {
+    case MapRetryStatus::SUCCEEDED:
+        hr = S_OK;
 
-                CHK_HR(pIWICDecoder->GetFrameCount(&nCount));
+        // only a 304 succeeds without a map: the one we have is still
+        // right, and if it was still decoded it needn't be decoded again
+        if (!refMapOut)
+        {
+            MapBytesHandle hBytes = g_mapCache.Compressed().Find(mapKey);
 
-                if (nCount >= 1)
-                {
-                    // get the frame. JPEGs have only one
-                    CHK_HR(pIWICDecoder->GetFrame(0, &pIWICBitmapFrameDecode));
+            g_mapRevalidation.RecordNotModified(hBytes ? hBytes->size() : 0, MapCacheTier::DECODED == cachedTier);
+
+            refMapOut = hCachedMap ? hCachedMap : g_mapCache.Decode(mapKey);
+
+            if (!refMapOut)
+            {
+                // it was dropped from memory while we asked
+                OutputDebugString(L"Error: Bing Map not modified, but no longer cached.\n");
+                hr = E_FAIL;
+            }
+        }
+        break;
+
+    case MapRetryStatus::CANCELLED:
+        hr = E_ABORT;
+        break;
+
+    default:
+        {
+            // this runs on a worker thread, so it can't use the global szDebugMsg
+            WCHAR szError[MAX_DEBUGMSG];
+
+            hr = FAILED(hrAttempts[0]) ? hrAttempts[0] : E_FAIL;
+
+            _snwprintf_s(szError, MAX_DEBUGMSG, L"Error: Bing Maps download failed, 0x%08lx\n", (unsigned long)hr);
+            OutputDebugString(szError);
+        }
+        break;
+    }
+
+    return hr;
+}
+
+// keep a map for later: its JPEG, if hBytes has one, in the disk cache,
+// and the decoded map in the shared cache for the other instances and in
+// the decoded cache for the next run of the program.  Writing them out
+// takes longer than anything else a download does once the map is
+// decoded, so it is done on g_pPersistQueue's thread, after the fetch
+// worker has handed the map to the UI thread rather than before.  If that
+// queue is full the map isn't kept, and is downloaded again next time.
+// Without the queue, as with /batch, it is done here.
+void PersistMap(const MapRequestKey& mapKey, MapBytesHandle hBytes, MapImageHandle hMap,
+    const MapValidators& validators)
+{
+    auto persist = [mapKey, hBytes, hMap, validators]()
+    {
+        if (g_pDiskCache && hBytes)
+        {
+            g_pDiskCache->Store(mapKey, hBytes->data(), hBytes->size(), &validators);
+        }
+
+        if (g_pSharedCache && hMap)
+        {
+            g_pSharedCache->Insert(mapKey, *hMap, &validators);
+        }
+
+        if (g_pDecodedCache && hMap)
+        {
+            g_pDecodedCache->Store(mapKey, *hMap, &validators);
+        }
+    };
+
+    if (NULL == g_pPersistQueue)
+    {
+        persist();
+    }
+    else if (!g_pPersistQueue->Submit(mapKey, persist))
+    {
+        OutputDebugString(L"Warning: too many maps waiting to be written out, this one won't be kept.\n");
+    }
+}
+
+// One try at downloading the map described by mapKey, which is not in any
+// cache or has to be revalidated, and decoding it into refMapOut.  With
+// pValidators the request is conditional, and if the server answers 304
+// Not Modified, S_FALSE is returned with refMapOut left empty, and the
+// validators are brought up to date.  This runs on the map fetch worker
+// threads, and on the thread of a hedge racing one of them.  If token is
+// cancelled the download is abandoned and E_ABORT is returned; if another
+// thread cancels it, a send or read that is stuck is aborted too.
+//
+// Unless /nostream was given, the map is decoded on a second thread while
+// it downloads, so it is ready about when its last byte arrives.  pProgress,
+// if given, is called on that thread as each band of rows is decoded.
+HRESULT DownloadBingMap(const MapRequestKey& mapKey, MapImageHandle& refMapOut, MapAttemptToken& token,
+    const MapProgressCallback* pProgress, const MapValidators* pValidators)
+{
+    DWORD     dwBytesRead = 0;
+    HRESULT	  hr = S_OK;
 
-                    // retrieve the image dimensions in case Bing sent us a
-                    // different size from what we requested
-                    CHK_HR(pIWICBitmapFrameDecode->GetSize(&retrievedWidth, &retrievedHeight));
+    // the URL, the download buffer and any error text come from here, and
+    // are all freed together when DownloadBingMap returns.  It must be declared
+    // before, and so destroyed after, everything that allocates from it.
+    MapRequestArena arena;
+
+    // the thread decoding the map as it downloads, and what it decoded
+    std::thread decodeThread;
+    HRESULT   hrDecode = E_FAIL;
+    MapImageHandle streamedMap;
+
+    // the HTTP request for the map, sent on one of g_pHttpPool's
+    // kept-alive connections
+    HttpRequest mapRequest;
+
+    // if the server told us how big the map is
+    DWORD dwContentLength = 0;
+
+    // the If-None-Match and If-Modified-Since headers sent with a
+    // conditional request, and the response's headers, which say how
+    // long the map stays fresh
+    std::pmr::wstring strConditionalHeaders(arena.Resource());
+    std::string strResponseHeaders;
+
+    // a contiguous byte buffer that the map data is read into directly,
+    // sized from the Content-Length header when the server sends one.
+    // The decoding thread reads from it at the same time.
+    StreamingBuffer downloadBuffer(arena.Resource());
+
+    // when the download and its current stage started, for g_metrics.
+    // The read loop adds up its time in InternetReadFile and in the
+    // download buffer rather than recording every chunk.
+    MapMetrics::Clock::time_point tStart = MapMetrics::Clock::now();
+    MapMetrics::Clock::time_point tStage = tStart;
+    MapMetrics::Clock::time_point tRead;
+    uint64_t nReadUs = 0;
+    uint64_t nAssemblyUs = 0;
+    uint64_t nReadChunks = 0;
+
+    // when this try has taken too long, whether or not it is still
+    // receiving anything
+    const MapRetryPolicy& policy = g_mapRetrier.Policy();
+    MapMetrics::Clock::time_point tDeadline = tStart + std::chrono::milliseconds(policy.nTotalTimeoutMs);
 
-                    // to convert the format of the image from JPEG, we need to create a converter
-                    CHK_HR(g_pIWICFactory->CreateFormatConverter(&pIWICConvertedFrame));
+    // get a Bing Maps Key
+    // https://docs.microsoft.com/en-us/bingmaps/getting-started/bing-maps-dev-center-help/getting-a-bing-maps-key
+
+    // Insert your Bing Maps key here
+    const WCHAR* pszBingMapsKey = L"Your Bing Maps Key Here";
 
-                    // convert the frame to 32bppBGR
-                    CHK_HR(pIWICConvertedFrame->Initialize(
-                        pIWICBitmapFrameDecode,         // frame to convert
-                        GUID_WICPixelFormat32bppBGR,  // desired pixel format
-                        WICBitmapDitherTypeNone,        // no dithering
-                        NULL,                           // desired palette
-                        0.f,                            // alpha threshold percent
-                        WICBitmapPaletteTypeCustom      // palette translation type
-                    ));
+    // build a URL for the call to Bing Maps, or to the server given
+    // with /server
+    std::pmr::wstring strMapUrl(arena.Resource());
 
-                    // no need to resize the frame, we requested it from Bing Maps at the size we want
+    tStage = MapMetrics::Clock::now();
 
-                    // Render the image to a GDI device context
-                    HBITMAP hDIBBitmap = NULL;
+    if (!BuildMapUrl(mapKey, g_strMapServer, pszBingMapsKey, strMapUrl))
+    {
+        OutputDebugString(L"Error: no map tiles for this imagery set.\n");
+        hr = E_INVALIDARG;
+        goto CleanUp;
+    }
 
-                    // Get a DC for the full screen
-                    HDC hdcScreen = GetDC(NULL);                          
+    g_metrics.RecordSince(MapMetric::URL_BUILD, tStage);
+
+    if (NULL == g_pHttpPool)
+    {
+        OutputDebugString(L"Error: no HTTP session\n");
+        hr = E_FAIL;
+        goto CleanUp;
+    }
 
-                    BITMAPINFO bminfo;
-                    ZeroMemory(&bminfo, sizeof(bminfo));
-                    bminfo.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
-                    bminfo.bmiHeader.biWidth = (LONG)retrievedWidth;
-                    bminfo.bmiHeader.biHeight = -(LONG)retrievedHeight;
-                    bminfo.bmiHeader.biPlanes = 1;
-                    bminfo.bmiHeader.biBitCount = 32;
-                    bminfo.bmiHeader.biCompression = BI_RGB;
+    // a hedge that finishes first, or the user moving on, aborts the
+    // request from another thread if it is stuck
+    token.SetInterrupt([&mapRequest]() { mapRequest.Abort(); });
 
-                    void* pvImageBits = nullptr;    // Freed in DestroyGDIObjects when we free the HBITMAP
+    // the validators are ASCII, so widening them is a copy
+    if (pValidators)
+    {
+        std::string strConditional = ConditionalRequestHeaders(*pValidators);
 
-                    // Create the HBITMAP. Now, the hDIBBitmap points to the image buffer where we'll put the bits
-                    hDIBBitmap = CreateDIBSection(hdcScreen, &bminfo, DIB_RGB_COLORS, &pvImageBits, NULL, 0);                           
+        strConditionalHeaders.assign(strConditional.begin(), strConditional.end());
+    }
 
-                    ReleaseDC(NULL, hdcScreen);
+    // send the request to Bing Maps, reusing a kept-alive connection if
+    // there is one.  We keep our own persistent cache in g_pDiskCache,
+    // and revalidate it ourselves, so WinInet's cache is bypassed.
+    hr = g_pHttpPool->SendGet(strMapUrl.c_str(),
+        INTERNET_FLAG_RELOAD |
+        INTERNET_FLAG_PRAGMA_NOCACHE |
+        INTERNET_FLAG_NO_CACHE_WRITE,
+        mapRequest,
+        strConditionalHeaders.empty() ? NULL : strConditionalHeaders.c_str());
+
+    // if we got a response, then read the map data
+    if (SUCCEEDED(hr))
+    {
+        // the map we have is still right.  The 304 may say how long for.
+        if (pValidators && HTTP_STATUS_NOT_MODIFIED == mapRequest.StatusCode())
+        {
+            OutputDebugString(L"Bing Map not modified.\n");
 
-                    // Calculate the number of bytes in 1 scanline
-                    UINT nStride = DIB_WIDTHBYTES(retrievedWidth * 32);
+            if (!token.IsCancelled())
+            {
+                MapValidators validators(*pValidators);
 
-                    // Calculate the total size of the image
-                    UINT numberOfImageBytes = nStride * retrievedHeight;
+                mapRequest.QueryRawHeaders(strResponseHeaders);
+                UpdateMapValidators(validators, strResponseHeaders, MapRevalidationNow());
 
-                    // Copy the converted frame pixels to the DIB section image buffer
-                    CHK_HR(pIWICConvertedFrame->CopyPixels(nullptr, nStride, numberOfImageBytes, reinterpret_cast<LPBYTE>(pvImageBits)));
+                g_mapRevalidation.Set(mapKey, validators);
 
-                    // The refHBitmapOut must have DeleteObject called on it somewhere or
-                    // there will be a GDI memory and handle leak!!!!!!
-                    //
-                    // We do this in DestroyGDIObjects, called from the WM_DESTROY event handler.
-                    refHbmOut = hDIBBitmap;                           
+                if (g_pDiskCache)
+                {
+                    g_pDiskCache->UpdateValidators(mapKey, validators);
                 }
-                else
+
+                if (g_pDecodedCache)
                 {
-                    OutputDebugString(L"No image frames in decoder.\n");
+                    g_pDecodedCache->UpdateValidators(mapKey, validators);
+                }
+            }
 
-                    goto CleanUp;
-                }               
-            } //endif g_readBufferArray.size() > 0
-        }  // endif hMapUrl
-        else
+            mapRequest.Close();
+
+            hr = S_FALSE;
+            goto CleanUp;
+        }
+
+        if (HTTP_STATUS_OK != mapRequest.StatusCode())
         {
-            // Internet failure, report why 
-            LPTSTR lpExtended;
-            DWORD dwLength = 0;
-            DWORD dwError;
+            WCHAR szError[MAX_DEBUGMSG];
 
-            hr = E_FAIL;
+            _snwprintf_s(szError, MAX_DEBUGMSG, L"GetMap HTTP status %lu\n", mapRequest.StatusCode());
+            OutputDebugString(szError);
+
+            // the status decides whether it is worth asking again
+            hr = HRESULT_FROM_HTTP_STATUS(mapRequest.StatusCode());
+            goto CleanUp;
+        }
+
+        // success, 
+        OutputDebugString(L"Bing Maps HTTP call successful!\n");
+
+        // for the validators, which are kept with the map
+        mapRequest.QueryRawHeaders(strResponseHeaders);
+
+        // if the server told us how big the map is, allocate the whole
+        // buffer once.  The extra byte leaves room for the final zero-byte
+        // read so it doesn't make the buffer grow.
+        DWORD dwLengthSize = sizeof(dwContentLength);
+
+        if (HttpQueryInfo(mapRequest.Handle(), HTTP_QUERY_CONTENT_LENGTH | HTTP_QUERY_FLAG_NUMBER,
+            &dwContentLength, &dwLengthSize, NULL) && dwContentLength > 0)
+        {
+            CHK_ALLOC(downloadBuffer.Reserve((size_t)dwContentLength + 1));
+
+            // lets the decoder find the end of the stream without waiting
+            downloadBuffer.SetExpectedSize(dwContentLength);
+        }
+
+        // start decoding now.  The decoder waits for each byte it
+        // needs, so it runs right behind the download.
+        if (g_bStreamingDecode)
+        {
+            decodeThread = std::thread([&downloadBuffer, &streamedMap, &hrDecode, pProgress]()
+            {
+                // WIC needs COM on this thread too
+                CoInitializeEx(NULL, COINIT_MULTITHREADED);
+
+                IStream* pStream = NULL;
+
+                hrDecode = StreamingBufferStream::Create(&downloadBuffer, &pStream);
+
+                if (SUCCEEDED(hrDecode))
+                {
+                    hrDecode = DecodeMapStream(pStream, streamedMap, pProgress);
+                }
+
+                SAFE_RELEASE(pStream);
+
+                CoUninitialize();
+            });
+        }
+
+        BOOL bRead = TRUE;
+
+        tStage = MapMetrics::Clock::now();
+
+        // read the map jpg straight into the end of the download buffer,
+        // growing it geometrically if we had no Content-Length
+        do
+        {
+            size_t nAvailable = 0;
+            LPBYTE pWrite = NULL;
+
+            // the user has moved on, or a hedge got the map first, so
+            // don't waste the bandwidth
+            if (token.IsCancelled())
+            {
+                OutputDebugString(L"Bing Maps download cancelled.\n");
+
+                hr = E_ABORT;
+                goto CleanUp;
+            }
+
+            // WinInet's receive timeout only limits each read, this
+            // limits the whole download
+            if (policy.nTotalTimeoutMs > 0 && MapMetrics::Clock::now() > tDeadline)
+            {
+                OutputDebugString(L"Error: Bing Maps download took too long.\n");
+
+                hr = HRESULT_FROM_WIN32(ERROR_INTERNET_TIMEOUT);
+                goto CleanUp;
+            }
+
+            CHK_ALLOC(pWrite = downloadBuffer.PrepareWrite(1, &nAvailable));
+
+            DWORD dwToRead = (nAvailable < g_nMaxReadSize) ? (DWORD)nAvailable : g_nMaxReadSize;
+
+            // the last commit and this PrepareWrite are buffer assembly
+            tRead = MapMetrics::Clock::now();
+            nAssemblyUs += MapMetrics::MicrosecondsBetween(tStage, tRead);
+
+            bRead = mapRequest.Read(pWrite, dwToRead, &dwBytesRead);
+
+            tStage = MapMetrics::Clock::now();
+            nReadUs += MapMetrics::MicrosecondsBetween(tRead, tStage);
+            nReadChunks++;
+
+            if (bRead)
+            {
+                downloadBuffer.CommitWrite(dwBytesRead);
+            }
+
+        } while (bRead && (dwBytesRead > 0));
+
+        // a broken connection leaves half a map, which is no map at all
+        if (!bRead)
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            OutputDebugString(L"Error: Bing Maps download interrupted.\n");
+            goto CleanUp;
+        }
+
+        // and so does one that closed early, without an error
+        if (dwContentLength > 0 && downloadBuffer.Size() < dwContentLength)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_INTERNET_CONNECTION_ABORTED);
+            OutputDebugString(L"Error: Bing Maps download cut short.\n");
+            goto CleanUp;
+        }
 
-            // find the length of the error
-            if (!InternetGetLastResponseInfo(&dwError, NULL, &dwLength) &&
-                GetLastError() == ERROR_INSUFFICIENT_BUFFER)
+        // close the HTTP request.  The connection stays open for the next one.
+        mapRequest.Close();
+
+        {
+            // where the time went.  This runs on a worker thread, so it
+            // can't use the global szDebugMsg.
+            const HttpRequestTiming& timing = mapRequest.Timing();
+            WCHAR szTiming[MAX_DEBUGMSG];
+
+            _snwprintf_s(szTiming, MAX_DEBUGMSG,
+                L"Bing Maps HTTP %s connection: connect %.1f ms, TLS %.1f ms, first byte %.1f ms, transfer %.1f ms, %llu bytes\n",
+                timing.reusedConnection ? L"reused" : L"new",
+                timing.connectMs, timing.tlsMs, timing.firstByteMs, timing.transferMs,
+                (unsigned long long)timing.bytesRead);
+            OutputDebugString(szTiming);
+
+            // a reused connection had no connect or handshake, and counting
+            // it as zero would hide how long the real ones take
+            if (!timing.reusedConnection)
+            {
+                g_metrics.RecordMilliseconds(MapMetric::CONNECT, timing.connectMs);
+
+                if (timing.tlsMs > 0)
+                {
+                    g_metrics.RecordMilliseconds(MapMetric::TLS_HANDSHAKE, timing.tlsMs);
+                }
+            }
+
+            g_metrics.RecordMilliseconds(MapMetric::FIRST_BYTE, timing.firstByteMs);
+            g_metrics.Record(MapMetric::READ, nReadUs);
+            g_metrics.Record(MapMetric::READ_CHUNKS, nReadChunks);
+            g_metrics.Record(MapMetric::READ_BYTES, downloadBuffer.Size());
+            g_metrics.Record(MapMetric::BUFFER_ASSEMBLY, nAssemblyUs);
+
+            // what the next static map will take, to choose its size by.
+            // Tiles are all much the same size, and too small to say much.
+            if (!mapKey.IsTile())
             {
-                // allocate a buffer long enough to handle the error, plus 1
-                CHK_ALLOC(lpExtended = (LPTSTR)LocalAlloc(LPTR, dwLength + 1));
+                g_bandwidth.Record(downloadBuffer.Size(), nReadUs, (uint64_t)(timing.firstByteMs * 1000.0),
+                    (uint64_t)mapKey.width * (uint64_t)mapKey.height);
+            }
+        }
+
+        // what decoding costs once the last byte is in: the rest of a
+        // streaming decode, or all of one that waited for the download
+        tStage = MapMetrics::Clock::now();
 
-                // get the error text
-                InternetGetLastResponseInfo(&dwError, lpExtended, &dwLength);
+        if (downloadBuffer.Size() > 0)
+        {
+            if (decodeThread.joinable())
+            {
+                // every byte is here, let the decoder finish the last rows
+                downloadBuffer.Finish();
+                decodeThread.join();
 
-                // write it to the debug console
-                _snwprintf_s(szDebugMsg, MAX_DEBUGMSG, L"GetMap InternetOpenUrl Error: %s\n", lpExtended);
-                OutputDebugString(szDebugMsg);
+                CHK_HR(hrDecode);
 
-                // free the error text memory
-                LocalFree(lpExtended);
+                refMapOut = streamedMap;
             }
             else
             {
-                OutputDebugString(L"Warning: GetMap InternetOpenUrl extended error reported with no response info.\n");
+                // the whole file is already contiguous, so it can be
+                // handed to the decoder without another copy
+                CHK_HR(DecodeMapImage(downloadBuffer.Data(), downloadBuffer.Size(), refMapOut));
             }
 
-        } // hMapUrl
+            g_metrics.RecordSince(MapMetric::DECODE_TAIL, tStage);
+            g_metrics.RecordSince(MapMetric::DOWNLOAD, tStart);
+
+            // it's a good map, so keep its JPEG in memory, and on disk for
+            // next time, with what the server said about it, unless a hedge
+            // got there first and already has.  The decoded map goes into
+            // g_mapCache when it reaches the UI thread, and is written out
+            // after that.
+            if (!token.IsCancelled())
+            {
+                MapValidators validators = ParseMapValidators(strResponseHeaders, g_mapRevalidation.Policy(),
+                    MapRevalidationNow());
+
+                g_mapCache.Compressed().Insert(mapKey, downloadBuffer.Data(), downloadBuffer.Size());
+                g_mapRevalidation.Set(mapKey, validators);
+
+                // we asked whether it had changed, and it had
+                if (pValidators)
+                {
+                    g_mapRevalidation.RecordModified(downloadBuffer.Size());
+                }
+
+                // the download buffer goes when this returns, so the
+                // JPEG written out later is a copy of it
+                MapBytesHandle hBytes;
+
+                if (g_pDiskCache)
+                {
+                    hBytes = std::make_shared<const std::vector<uint8_t>>(downloadBuffer.Data(),
+                        downloadBuffer.Data() + downloadBuffer.Size());
+                }
 
-    } // hInternet
+                PersistMap(mapKey, hBytes, refMapOut, validators);
+            }
+        } //endif downloadBuffer.Size() > 0
+        else
+        {
+            hr = E_FAIL;
+        }
+    }  // endif SUCCEEDED(hr)
     else
     {
-        OutputDebugString(L"Error: Could not get HINTERNET handle\n");
-        hr = E_FAIL;
-    } // hInternet
+        // Internet failure, report why 
+        LPTSTR lpExtended;
+        DWORD dwLength = 0;
+        DWORD dwError;
+
+        // find the length of the error
+        if (!InternetGetLastResponseInfo(&dwError, NULL, &dwLength) &&
+            GetLastError() == ERROR_INSUFFICIENT_BUFFER)
+        {
+            // allocate a buffer long enough to handle the error, plus 1.
+            // It goes when the arena does.
+            CHK_ALLOC(lpExtended = (LPTSTR)arena.Allocate((dwLength + 1) * sizeof(TCHAR)));
+            ZeroMemory(lpExtended, (dwLength + 1) * sizeof(TCHAR));
 
-CleanUp:
+            // get the error text
+            InternetGetLastResponseInfo(&dwError, lpExtended, &dwLength);
 
-    // release our COM interfaces
-    SAFE_RELEASE(pIWICStream);
-    SAFE_RELEASE(pIWICDecoder);
-    SAFE_RELEASE(pIWICBitmapFrameDecode);
-    SAFE_RELEASE(pIWICConvertedFrame);
+            // write it to the debug console.  This runs on a worker
+            // thread, so it can't use the global szDebugMsg.
+            WCHAR szError[MAX_DEBUGMSG];
+
+            _snwprintf_s(szError, MAX_DEBUGMSG, L"GetMap HttpSendRequest Error: %s\n", lpExtended);
+            OutputDebugString(szError);
+        }
+        else
+        {
+            WCHAR szError[MAX_DEBUGMSG];
+
+            _snwprintf_s(szError, MAX_DEBUGMSG, L"GetMap HttpSendRequest failed, 0x%08lx\n", (unsigned long)hr);
+            OutputDebugString(szError);
+        }
 
-    // delete the bytes copied from those read from the Internet
-    delete[] pBuf;
-    pBuf = NULL;
+    } // SUCCEEDED(hr)
 
-    // close the Internet handles    
-    if (hInternet)
+CleanUp:
+
+    // nothing can abort mapRequest once this returns
+    token.ClearInterrupt();
+
+    // if we gave up before the download finished, the decoder is still
+    // waiting for bytes that will never come
+    if (decodeThread.joinable())
     {
-        InternetCloseHandle(hInternet);
+        downloadBuffer.Abort();
+        decodeThread.join();
     }
 
-    return SUCCEEDED(hr) ? 0 : -1;
+    // the downloaded bytes are freed when arena goes out of scope, and the
+    // request, if it is still open, is closed when mapRequest does
+
+    return hr;
 }
@@ -0,0 +1,212 @@
+// HttpConnectionPool.h : Connections kept open between requests, per host.
+//
+// HttpSessionPool used to keep one WinInet connection handle per host for
+// the life of the program, in a map only it could see.  A handle whose
+// connection had been reset stayed in the map, and nothing could test the
+// reuse without WinInet.  This is that table on its own, for any kind of
+// connection.
+//
+// A request takes a connection to its host with Acquire: one left idle by
+// an earlier request if there is one, otherwise a new one from the connect
+// function.  It hands the connection back with Release when it is done,
+// saying whether the connection is still good.  One that isn't, because
+// the request failed on it, is closed and never handed out again, so the
+// next request to that host makes a new connection instead of failing on
+// the dead one too.  Each host keeps at most a few idle connections; any
+// more are closed as they are released.
+//
+// Connections are handed to one request at a time, so requests running
+// at the same time to the same host each get their own.
+//
+// TConnection is a handle that is false when it is empty, such as a
+// HINTERNET or a std::shared_ptr.  The connect and close functions are
+// called with the pool's lock held.
+//
+// HttpConnectionPool has no Windows dependencies.
+#pragma once
+
+#include <cinttypes>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+template <typename TConnection>
+class HttpConnectionPool
+{
+public:
+    // makes a new connection to strHost:nPort, or returns an empty one if
+    // it can't
+    typedef std::function<TConnection(const std::string& strHost, uint16_t nPort)> Connect;
+
+    // closes a connection that is no longer wanted
+    typedef std::function<void(TConnection& connection)> Disconnect;
+
+    // enough for the fetch and prefetch workers to share one host
+    static const size_t kDefaultMaxIdlePerHost = 8;
+
+    // what it has done so far
+    struct Stats
+    {
+        uint64_t    nConnects = 0;          // new connections made
+        uint64_t    nConnectFailures = 0;
+        uint64_t    nReuses = 0;            // idle connections handed out again
+        uint64_t    nEvicted = 0;           // released as dead, and closed
+        uint64_t    nOverflow = 0;          // closed because the host had enough idle
+    };
+
+    HttpConnectionPool(Connect connect, Disconnect disconnect,
+        size_t nMaxIdlePerHost = kDefaultMaxIdlePerHost)
+        : m_connect(std::move(connect)), m_disconnect(std::move(disconnect)),
+          m_nMaxIdlePerHost(nMaxIdlePerHost)
+    {
+    }
+
+    // closes the idle connections.  Those acquired and not yet released
+    // are the requests' to close.
+    ~HttpConnectionPool()
+    {
+        Clear();
+    }
+
+    HttpConnectionPool(const HttpConnectionPool&) = delete;
+    HttpConnectionPool& operator=(const HttpConnectionPool&) = delete;
+
+    // a connection to strHost:nPort, the one released most recently if
+    // any are idle, since it is the least likely to have been closed by
+    // the server.  *pbReused, if given, says which.  Returns an empty
+    // connection if a new one was needed and couldn't be made.
+    TConnection Acquire(const std::string& strHost, uint16_t nPort, bool* pbReused = nullptr)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        std::vector<TConnection>& idle = m_idle[Key(strHost, nPort)];
+
+        if (pbReused)
+        {
+            *pbReused = !idle.empty();
+        }
+
+        if (!idle.empty())
+        {
+            TConnection connection = std::move(idle.back());
+
+            idle.pop_back();
+            m_stats.nReuses++;
+
+            return connection;
+        }
+
+        TConnection connection = m_connect(strHost, nPort);
+
+        if (connection)
+        {
+            m_stats.nConnects++;
+        }
+        else
+        {
+            m_stats.nConnectFailures++;
+        }
+
+        return connection;
+    }
+
+    // hand back a connection from Acquire for the same host.  bAlive
+    // false, after a request failed on it, closes it for good.
+    void Release(const std::string& strHost, uint16_t nPort, TConnection connection, bool bAlive)
+    {
+        if (!connection)
+        {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        std::vector<TConnection>& idle = m_idle[Key(strHost, nPort)];
+
+        if (!bAlive)
+        {
+            m_disconnect(connection);
+            m_stats.nEvicted++;
+        }
+        else if (idle.size() >= m_nMaxIdlePerHost)
+        {
+            m_disconnect(connection);
+            m_stats.nOverflow++;
+        }
+        else
+        {
+            idle.push_back(std::move(connection));
+        }
+    }
+
+    // close every idle connection
+    void Clear()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        for (auto& host : m_idle)
+        {
+            for (TConnection& connection : host.second)
+            {
+                m_disconnect(connection);
+            }
+        }
+
+        m_idle.clear();
+    }
+
+    // the connections waiting for a request, to every host
+    size_t IdleCount() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        size_t nIdle = 0;
+
+        for (const auto& host : m_idle)
+        {
+            nIdle += host.second.size();
+        }
+
+        return nIdle;
+    }
+
+    Stats GetStats() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_stats;
+    }
+
+    // the stats, one line, UTF-8
+    std::string FormatStats() const
+    {
+        Stats stats = GetStats();
+        char szStats[256];
+
+        snprintf(szStats, sizeof(szStats),
+            "Connections: %" PRIu64 " made, %" PRIu64 " failed, %" PRIu64 " reused, %" PRIu64
+            " evicted as dead, %" PRIu64 " closed as spare\n",
+            stats.nConnects, stats.nConnectFailures, stats.nReuses, stats.nEvicted, stats.nOverflow);
+
+        return szStats;
+    }
+
+private:
+    static std::string Key(const std::string& strHost, uint16_t nPort)
+    {
+        return strHost + ":" + std::to_string(nPort);
+    }
+
+    Connect                 m_connect;
+    Disconnect              m_disconnect;
+    size_t                  m_nMaxIdlePerHost;
+
+    mutable std::mutex      m_mutex;        // protects everything below
+    std::map<std::string, std::vector<TConnection>>  m_idle;   // keyed by "host:port"
+    Stats                   m_stats;
+};
@@ -0,0 +1,74 @@
+// HttpRequestTimer.cpp : Where the time went in one HTTP request.
+//
+#include "HttpRequestTimer.h"
+
+double HttpRequestTimer::Milliseconds(Clock::time_point from, Clock::time_point to)
+{
+    return std::chrono::duration<double, std::milli>(to - from).count();
+}
+
+void HttpRequestTimer::Start(Clock::time_point now)
+{
+    *this = HttpRequestTimer();
+    m_start = now;
+}
+
+void HttpRequestTimer::Connecting(Clock::time_point now)
+{
+    // only the first of these starts the clock
+    if (!m_bConnecting)
+    {
+        m_connecting = now;
+        m_bConnecting = true;
+    }
+}
+
+void HttpRequestTimer::Connected(Clock::time_point now)
+{
+    m_connected = now;
+    m_bConnected = true;
+}
+
+void HttpRequestTimer::Sending(Clock::time_point now)
+{
+    if (!m_bSending)
+    {
+        m_sending = now;
+        m_bSending = true;
+    }
+}
+
+void HttpRequestTimer::HeadersReceived(Clock::time_point now)
+{
+    m_headers = now;
+    m_bHeaders = true;
+}
+
+const HttpRequestTiming& HttpRequestTimer::Finish(Clock::time_point now)
+{
+    // a connection that was kept alive from an earlier request is never
+    // reported as connecting
+    m_timing.reusedConnection = !m_bConnected;
+
+    if (m_bConnected)
+    {
+        m_timing.connectMs = Milliseconds(m_bConnecting ? m_connecting : m_start, m_connected);
+
+        // the time from the connection being made to the request being
+        // sent is the TLS handshake
+        if (m_bSending)
+        {
+            m_timing.tlsMs = Milliseconds(m_connected, m_sending);
+        }
+    }
+
+    // a request that failed before its headers arrived spent all its time
+    // waiting for them
+    Clock::time_point headers = m_bHeaders ? m_headers : now;
+
+    m_timing.firstByteMs = Milliseconds(m_bSending ? m_sending : m_start, headers);
+    m_timing.transferMs = Milliseconds(headers, now);
+    m_timing.totalMs = Milliseconds(m_start, now);
+
+    return m_timing;
+}
@@ -0,0 +1,80 @@
+// HttpRequestTimer.h : Where the time went in one HTTP request.
+//
+// HttpRequest used to keep its own time points and work out the connect,
+// TLS, first byte and transfer times from them when it was closed.  That
+// bookkeeping has nothing to do with WinInet, so it lives here, where the
+// tests can drive it from a plain socket client against LocalHttpServer.
+// HttpRequest turns WinInet's status callbacks into the steps below.
+//
+// A request that reuses a kept-alive connection never reports Connecting
+// or Connected, and that is how it is told apart from one that made a new
+// connection.
+//
+// HttpRequestTimer has no Windows dependencies.
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+// how long one request spent on each step, in milliseconds.  A request
+// that reused a kept-alive connection has no connect or TLS time.
+struct HttpRequestTiming
+{
+    bool        reusedConnection = false;   // no new connection was made
+    double      connectMs = 0;              // name resolution and TCP connect
+    double      tlsMs = 0;                  // TLS handshake, https only
+    double      firstByteMs = 0;            // request sent until the response headers arrived
+    double      transferMs = 0;             // response headers until the request was closed
+    double      totalMs = 0;
+    uint64_t    bytesRead = 0;              // the size of the response body
+};
+
+// the steps of one request, in the order they happen.  Each takes the
+// time it happened, now by default, so tests can give their own.  Only
+// the thread making the request calls them.
+class HttpRequestTimer
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    // the request was begun.  Forgets any earlier request.
+    void Start(Clock::time_point now = Clock::now());
+
+    // started resolving the host name or connecting.  Only the first call
+    // counts.
+    void Connecting(Clock::time_point now = Clock::now());
+
+    // the TCP connection was made
+    void Connected(Clock::time_point now = Clock::now());
+
+    // started sending the request, which for https is once the secure
+    // channel is up.  Only the first call counts.
+    void Sending(Clock::time_point now = Clock::now());
+
+    // the response headers arrived
+    void HeadersReceived(Clock::time_point now = Clock::now());
+
+    // nBytes more of the response body were read
+    void BodyRead(uint64_t nBytes) { m_timing.bytesRead += nBytes; }
+
+    // the request was closed.  Works out the timing from the steps above.
+    const HttpRequestTiming& Finish(Clock::time_point now = Clock::now());
+
+    // complete once Finish has been called
+    const HttpRequestTiming& Timing() const { return m_timing; }
+
+private:
+    static double Milliseconds(Clock::time_point from, Clock::time_point to);
+
+    HttpRequestTiming   m_timing;
+
+    Clock::time_point   m_start;                // Start was called
+    Clock::time_point   m_connecting;           // started resolving or connecting
+    Clock::time_point   m_connected;            // the TCP connection was made
+    Clock::time_point   m_sending;              // started sending the request
+    Clock::time_point   m_headers;              // the response headers arrived
+    bool                m_bConnecting = false;
+    bool                m_bConnected = false;
+    bool                m_bSending = false;
+    bool                m_bHeaders = false;
+};
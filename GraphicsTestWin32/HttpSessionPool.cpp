@@ -0,0 +1,354 @@
+// HttpSessionPool.cpp : A long-lived WinInet session shared by every download.
+//
+#include "HttpSessionPool.h"
+#include "MapRequest.h"
+
+#pragma comment(lib, "wininet.lib")
+
+HttpRequest::HttpRequest()
+    : m_hRequest(NULL), m_dwStatusCode(0), m_bAborted(false),
+      m_pPool(NULL), m_hConnect(NULL), m_nPort(0), m_bConnectionFailed(false)
+{
+}
+
+HttpRequest::~HttpRequest()
+{
+    Close();
+}
+
+void HttpRequest::OnStatus(DWORD dwInternetStatus)
+{
+    switch (dwInternetStatus)
+    {
+    case INTERNET_STATUS_RESOLVING_NAME:
+    case INTERNET_STATUS_CONNECTING_TO_SERVER:
+        m_timer.Connecting();
+        break;
+
+    case INTERNET_STATUS_CONNECTED_TO_SERVER:
+        m_timer.Connected();
+        break;
+
+    case INTERNET_STATUS_SENDING_REQUEST:
+
+        // WinInet reports the request being sent once the secure
+        // channel is up, so for https the time since the connection
+        // was made is the TLS handshake
+        m_timer.Sending();
+        break;
+
+    default:
+        break;
+    }
+}
+
+BOOL HttpRequest::Read(LPVOID pBuffer, DWORD dwToRead, DWORD* pdwRead)
+{
+    BOOL bRead = InternetReadFile(m_hRequest, pBuffer, dwToRead, pdwRead);
+
+    if (bRead)
+    {
+        m_timer.BodyRead(*pdwRead);
+    }
+    else if (HttpSessionPool::IsConnectionError(GetLastError()))
+    {
+        m_bConnectionFailed = true;
+    }
+
+    return bRead;
+}
+
+bool HttpRequest::QueryRawHeaders(std::string& strHeadersOut) const
+{
+    DWORD dwSize = 0;
+
+    strHeadersOut.clear();
+
+    if (NULL == m_hRequest)
+    {
+        return false;
+    }
+
+    // the first call only asks how big they are.  Header values are ASCII,
+    // so the ANSI version gives them as they came.
+    if (!HttpQueryInfoA(m_hRequest, HTTP_QUERY_RAW_HEADERS_CRLF, NULL, &dwSize, NULL) &&
+        ERROR_INSUFFICIENT_BUFFER != GetLastError())
+    {
+        return false;
+    }
+
+    strHeadersOut.resize(dwSize);
+
+    if (!HttpQueryInfoA(m_hRequest, HTTP_QUERY_RAW_HEADERS_CRLF, &strHeadersOut[0], &dwSize, NULL))
+    {
+        strHeadersOut.clear();
+        return false;
+    }
+
+    // dwSize is now the length without the terminating zero
+    strHeadersOut.resize(dwSize);
+
+    return true;
+}
+
+void HttpRequest::Close()
+{
+    bool bOpened = false;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (m_hRequest)
+        {
+            // Abort has already closed the handle
+            if (!m_bAborted)
+            {
+                InternetCloseHandle(m_hRequest);
+            }
+
+            m_hRequest = NULL;
+            bOpened = true;
+        }
+    }
+
+    // SendGet may have taken a connection and failed before it opened the
+    // request, so the connection goes back whether or not there was one
+    if (m_hConnect)
+    {
+        m_pPool->m_connections.Release(m_strHost, m_nPort, m_hConnect, !m_bConnectionFailed);
+        m_hConnect = NULL;
+    }
+
+    if (bOpened)
+    {
+        m_timer.Finish();
+    }
+}
+
+void HttpRequest::Abort()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (!m_bAborted && m_hRequest)
+    {
+        InternetCloseHandle(m_hRequest);
+    }
+
+    m_bAborted = true;
+}
+
+HttpSessionPool::HttpSessionPool(LPCWSTR pszUserAgent)
+    : m_strUserAgent(pszUserAgent), m_hSession(NULL),
+      m_connections(
+        [this](const std::string& strHost, uint16_t nPort)
+        {
+            // this doesn't touch the network, the TCP connection is made
+            // (or reused) when a request is sent
+            return InternetConnect(m_hSession, Utf8ToWide(strHost).c_str(), nPort,
+                NULL, NULL, INTERNET_SERVICE_HTTP, 0, 0);
+        },
+        [](HINTERNET& hConnect)
+        {
+            InternetCloseHandle(hConnect);
+            hConnect = NULL;
+        })
+{
+}
+
+HttpSessionPool::~HttpSessionPool()
+{
+    Close();
+}
+
+bool HttpSessionPool::Open()
+{
+    if (m_hSession)
+    {
+        return true;
+    }
+
+    m_hSession = InternetOpen(m_strUserAgent.c_str(), INTERNET_OPEN_TYPE_DIRECT, NULL, NULL, 0);
+
+    if (NULL == m_hSession)
+    {
+        return false;
+    }
+
+    // every connection and request handle made from the session inherits this
+    InternetSetStatusCallback(m_hSession, StatusCallback);
+
+    return true;
+}
+
+void HttpSessionPool::Close()
+{
+    m_connections.Clear();
+
+    if (m_hSession)
+    {
+        InternetSetStatusCallback(m_hSession, NULL);
+        InternetCloseHandle(m_hSession);
+        m_hSession = NULL;
+    }
+}
+
+void HttpSessionPool::SetTimeouts(DWORD dwConnectMs, DWORD dwReceiveMs)
+{
+    if (NULL == m_hSession)
+    {
+        return;
+    }
+
+    // WinInet's "no limit" is 0xFFFFFFFF
+    DWORD dwConnect = (0 == dwConnectMs) ? 0xFFFFFFFF : dwConnectMs;
+    DWORD dwReceive = (0 == dwReceiveMs) ? 0xFFFFFFFF : dwReceiveMs;
+
+    // every connection and request handle made from the session inherits these
+    InternetSetOption(m_hSession, INTERNET_OPTION_CONNECT_TIMEOUT, &dwConnect, sizeof(dwConnect));
+    InternetSetOption(m_hSession, INTERNET_OPTION_SEND_TIMEOUT, &dwReceive, sizeof(dwReceive));
+    InternetSetOption(m_hSession, INTERNET_OPTION_RECEIVE_TIMEOUT, &dwReceive, sizeof(dwReceive));
+}
+
+bool HttpSessionPool::IsConnectionError(DWORD dwError)
+{
+    switch (dwError)
+    {
+    case ERROR_INTERNET_CANNOT_CONNECT:
+    case ERROR_INTERNET_CONNECTION_ABORTED:
+    case ERROR_INTERNET_CONNECTION_RESET:
+    case ERROR_INTERNET_TIMEOUT:
+    case ERROR_INTERNET_SERVER_UNREACHABLE:
+    case ERROR_HTTP_INVALID_SERVER_RESPONSE:
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+HRESULT HttpSessionPool::SendGet(LPCWSTR pszUrl, DWORD dwFlags, HttpRequest& requestOut, LPCWSTR pszHeaders)
+{
+    if (NULL == m_hSession || requestOut.m_hRequest)
+    {
+        return E_UNEXPECTED;
+    }
+
+    // split the URL into the host, port and everything after them
+    WCHAR szHost[INTERNET_MAX_HOST_NAME_LENGTH];
+    URL_COMPONENTS urlComponents;
+
+    ZeroMemory(&urlComponents, sizeof(urlComponents));
+    urlComponents.dwStructSize = sizeof(urlComponents);
+    urlComponents.lpszHostName = szHost;
+    urlComponents.dwHostNameLength = INTERNET_MAX_HOST_NAME_LENGTH;
+    urlComponents.dwUrlPathLength = 1;      // point into pszUrl
+    urlComponents.dwExtraInfoLength = 1;
+
+    if (!InternetCrackUrl(pszUrl, 0, 0, &urlComponents))
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    // the path and the query string, which directly follows it
+    std::wstring strObject(urlComponents.lpszUrlPath,
+        urlComponents.dwUrlPathLength + urlComponents.dwExtraInfoLength);
+
+    if (strObject.empty())
+    {
+        strObject = L"/";
+    }
+
+    requestOut.m_timer.Start();
+
+    // the request hands the connection back when it is closed
+    requestOut.m_strHost = WideToUtf8(szHost);
+    requestOut.m_nPort = urlComponents.nPort;
+    requestOut.m_hConnect = m_connections.Acquire(requestOut.m_strHost, requestOut.m_nPort);
+
+    if (NULL == requestOut.m_hConnect)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    requestOut.m_pPool = this;
+    requestOut.m_bConnectionFailed = false;
+
+    if (INTERNET_SCHEME_HTTPS == urlComponents.nScheme)
+    {
+        dwFlags |= INTERNET_FLAG_SECURE;
+    }
+
+    // the request is the context of its own status callbacks
+    HINTERNET hRequest = HttpOpenRequest(requestOut.m_hConnect, L"GET", strObject.c_str(), NULL, NULL, NULL,
+        dwFlags | INTERNET_FLAG_KEEP_CONNECTION, reinterpret_cast<DWORD_PTR>(&requestOut));
+
+    if (NULL == hRequest)
+    {
+        HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+
+        requestOut.Close();
+
+        return hr;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(requestOut.m_mutex);
+
+        // aborted before there was a handle to close
+        if (requestOut.m_bAborted)
+        {
+            InternetCloseHandle(hRequest);
+
+            lock.unlock();
+            requestOut.Close();
+
+            return HRESULT_FROM_WIN32(ERROR_INTERNET_OPERATION_CANCELLED);
+        }
+
+        requestOut.m_hRequest = hRequest;
+    }
+
+    // returns once the response headers have arrived.  -1 tells WinInet
+    // the extra headers are zero-terminated.
+    if (!HttpSendRequest(requestOut.m_hRequest, pszHeaders, pszHeaders ? (DWORD)-1L : 0, NULL, 0))
+    {
+        DWORD dwError = GetLastError();
+
+        requestOut.m_bConnectionFailed = IsConnectionError(dwError);
+        requestOut.Close();
+
+        return HRESULT_FROM_WIN32(dwError);
+    }
+
+    requestOut.m_timer.HeadersReceived();
+
+    DWORD dwStatusCode = 0;
+    DWORD dwSize = sizeof(dwStatusCode);
+
+    if (HttpQueryInfo(requestOut.m_hRequest, HTTP_QUERY_STATUS_CODE | HTTP_QUERY_FLAG_NUMBER,
+        &dwStatusCode, &dwSize, NULL))
+    {
+        requestOut.m_dwStatusCode = dwStatusCode;
+    }
+
+    return S_OK;
+}
+
+void CALLBACK HttpSessionPool::StatusCallback(HINTERNET hInternet, DWORD_PTR dwContext,
+    DWORD dwInternetStatus, LPVOID pvStatusInformation, DWORD dwStatusInformationLength)
+{
+    UNREFERENCED_PARAMETER(hInternet);
+    UNREFERENCED_PARAMETER(pvStatusInformation);
+    UNREFERENCED_PARAMETER(dwStatusInformationLength);
+
+    // the session and connection handles have no context, and the
+    // request is already being torn down once its handle is closing
+    if (0 == dwContext || INTERNET_STATUS_HANDLE_CLOSING == dwInternetStatus)
+    {
+        return;
+    }
+
+    // the session is synchronous, so this runs on the thread that called
+    // HttpSendRequest or InternetReadFile on the request
+    reinterpret_cast<HttpRequest*>(dwContext)->OnStatus(dwInternetStatus);
+}
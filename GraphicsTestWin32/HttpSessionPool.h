@@ -0,0 +1,139 @@
+// HttpSessionPool.h : A long-lived WinInet session shared by every download.
+//
+// Opening a new WinInet session for each map throws away the connections
+// the last one made, so every map paid for a new TCP connection and TLS
+// handshake to the same server.  The pool opens one session for the life
+// of the program and keeps connection handles per host in an
+// HttpConnectionPool, and requests are sent with
+// INTERNET_FLAG_KEEP_CONNECTION, so WinInet can reuse an idle keep-alive
+// connection to that host for the next request.  A request that fails on
+// its connection, because it was reset or timed out, hands the handle back
+// as dead, and the next request to that host gets a new one.
+//
+// WinInet handles may be used from any thread, so the worker threads share
+// the pool.  HttpConnectionPool does its own locking.
+//
+// Each HttpRequest records how long the connect, TLS handshake, time to
+// first byte and transfer took, by feeding WinInet's status callbacks to
+// an HttpRequestTimer.
+//
+// The session's connect, send and receive timeouts come from the
+// MapRetryPolicy, and a request that is stuck can be aborted from another
+// thread when a hedged request beats it.
+#pragma once
+
+#include "framework.h"
+#include <wininet.h>
+#include <mutex>
+#include <string>
+
+#include "HttpConnectionPool.h"
+#include "HttpRequestTimer.h"
+
+class HttpSessionPool;
+
+// a single GET request, opened by HttpSessionPool::SendGet.  It must stay
+// at the same address until it is closed, because WinInet's status
+// callbacks are handed a pointer to it.
+class HttpRequest
+{
+public:
+    HttpRequest();
+    ~HttpRequest();
+
+    HttpRequest(const HttpRequest&) = delete;
+    HttpRequest& operator=(const HttpRequest&) = delete;
+
+    HINTERNET Handle() const { return m_hRequest; }
+
+    // the HTTP status code, 0 if there is no response yet
+    DWORD StatusCode() const { return m_dwStatusCode; }
+
+    // InternetReadFile, counting the bytes read.  A read that fails
+    // because the connection was lost marks the connection dead.
+    BOOL Read(LPVOID pBuffer, DWORD dwToRead, DWORD* pdwRead);
+
+    // the response's status line and headers, each ending in CRLF.
+    // Returns false if there is no response yet.
+    bool QueryRawHeaders(std::string& strHeadersOut) const;
+
+    // close the request handle, hand its connection back to the pool and
+    // finish timing it
+    void Close();
+
+    // close the request handle from another thread, which makes a send or
+    // read blocked on it fail with ERROR_INTERNET_OPERATION_CANCELLED, and
+    // makes SendGet fail if it hasn't opened the request yet.  The thread
+    // that owns the request still calls Close.
+    void Abort();
+
+    // complete once the request has been closed
+    const HttpRequestTiming& Timing() const { return m_timer.Timing(); }
+
+private:
+    friend class HttpSessionPool;
+
+    // called from HttpSessionPool's status callback, on the thread that
+    // is sending or reading the request
+    void OnStatus(DWORD dwInternetStatus);
+
+    HINTERNET           m_hRequest;
+    DWORD               m_dwStatusCode;
+
+    // protects m_hRequest being opened and closed against Abort
+    std::mutex          m_mutex;
+    bool                m_bAborted;
+    HttpRequestTimer    m_timer;
+
+    // the connection the request was sent on, and where it goes back to
+    HttpSessionPool*    m_pPool;
+    HINTERNET           m_hConnect;
+    std::string         m_strHost;          // UTF-8
+    INTERNET_PORT       m_nPort;
+    bool                m_bConnectionFailed;
+};
+
+class HttpSessionPool
+{
+public:
+    explicit HttpSessionPool(LPCWSTR pszUserAgent);
+    ~HttpSessionPool();
+
+    HttpSessionPool(const HttpSessionPool&) = delete;
+    HttpSessionPool& operator=(const HttpSessionPool&) = delete;
+
+    // open the WinInet session.  Returns false if WinInet is unavailable.
+    bool Open();
+
+    // close every handle.  Requests still open must be closed first.
+    void Close();
+
+    // how long to wait to connect, and for each send or receive, in
+    // milliseconds, 0 for no limit.  Every request made afterwards uses
+    // them.
+    void SetTimeouts(DWORD dwConnectMs, DWORD dwReceiveMs);
+
+    // send a GET request for pszUrl and wait for the response headers.
+    // dwFlags are added to the HttpOpenRequest flags, and pszHeaders, if
+    // given, "Name: value" lines each ending in CRLF, to the request's
+    // headers.  On failure the HRESULT wraps the WinInet error.
+    HRESULT SendGet(LPCWSTR pszUrl, DWORD dwFlags, HttpRequest& requestOut, LPCWSTR pszHeaders = NULL);
+
+    // how many connection handles have been made, reused and thrown away,
+    // one line, UTF-8
+    std::string FormatStats() const { return m_connections.FormatStats(); }
+
+private:
+    friend class HttpRequest;
+
+    // true if a request failed with dwError because its connection is no
+    // good, rather than because of the request itself
+    static bool IsConnectionError(DWORD dwError);
+
+    static void CALLBACK StatusCallback(HINTERNET hInternet, DWORD_PTR dwContext,
+        DWORD dwInternetStatus, LPVOID pvStatusInformation, DWORD dwStatusInformationLength);
+
+    std::wstring                        m_strUserAgent;
+    HINTERNET                           m_hSession;
+    HttpConnectionPool<HINTERNET>       m_connections;
+};
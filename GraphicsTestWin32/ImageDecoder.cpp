@@ -0,0 +1,30 @@
+// ImageDecoder.cpp : A platform-neutral interface to an image decoder.
+//
+#include "ImageDecoder.h"
+
+bool DecodeToMapImage(ImageDecoder& decoder, const uint8_t* pData, size_t nSize,
+    MapImageHandle& refMapOut)
+{
+    ImageInfo info;
+
+    if (!decoder.ReadInfo(pData, nSize, info))
+    {
+        return false;
+    }
+
+    std::shared_ptr<MapImage> pMapImage = MapImage::Create(info.width, info.height);
+
+    if (!pMapImage)
+    {
+        return false;
+    }
+
+    if (!decoder.Decode(pData, nSize, info, pMapImage->Pixels(), pMapImage->Stride()))
+    {
+        return false;
+    }
+
+    refMapOut = pMapImage;
+
+    return true;
+}
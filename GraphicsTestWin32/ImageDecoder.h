@@ -0,0 +1,44 @@
+// ImageDecoder.h : A platform-neutral interface to an image decoder.
+//
+// The Windows program decodes maps with WIC.  An ImageDecoder does the same
+// job without Windows: it decodes an encoded image in memory straight into
+// a caller's 32bpp BGRX buffer, laid out the way MapImage, CreateDIBSection
+// and DIB_WIDTHBYTES expect, so the pixel pipeline can be run and measured
+// on any platform.  See JpegDecoder.h for the libjpeg backend.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "MapBitmapStore.h"
+
+struct ImageInfo
+{
+    int     width;
+    int     height;
+};
+
+class ImageDecoder
+{
+public:
+    virtual ~ImageDecoder() {}
+
+    // a short name for diagnostics and benchmark reports
+    virtual const char* Name() const = 0;
+
+    // read the image's size without decoding it.  Returns false if the
+    // data isn't an image this decoder understands.
+    virtual bool ReadInfo(const uint8_t* pData, size_t nSize, ImageInfo& infoOut) = 0;
+
+    // decode the whole image into pPixels, a top-down buffer of
+    // info.height rows, nStride bytes apart.  nStride must be at least
+    // info.width * 4.  Returns false if the data is damaged, in which case
+    // the buffer may be partly written.
+    virtual bool Decode(const uint8_t* pData, size_t nSize, const ImageInfo& info,
+        uint8_t* pPixels, size_t nStride) = 0;
+};
+
+// decode an image into a new MapImage.  Returns false if it can't be
+// decoded or the pixels can't be allocated.
+bool DecodeToMapImage(ImageDecoder& decoder, const uint8_t* pData, size_t nSize,
+    MapImageHandle& refMapOut);
@@ -0,0 +1,131 @@
+// ImageEncoder.cpp : A platform-neutral interface to an image encoder.
+//
+#include "ImageEncoder.h"
+
+#include <cctype>
+
+namespace
+{
+    // the sizes of BITMAPFILEHEADER and BITMAPINFOHEADER, which are
+    // written out field by field so this builds without windows.h
+    const size_t kBmpFileHeaderSize = 14;
+    const size_t kBmpInfoHeaderSize = 40;
+
+    void PutLE16(uint8_t* p, uint32_t n)
+    {
+        p[0] = (uint8_t)n;
+        p[1] = (uint8_t)(n >> 8);
+    }
+
+    void PutLE32(uint8_t* p, uint32_t n)
+    {
+        p[0] = (uint8_t)n;
+        p[1] = (uint8_t)(n >> 8);
+        p[2] = (uint8_t)(n >> 16);
+        p[3] = (uint8_t)(n >> 24);
+    }
+
+    class BmpEncoder : public ImageEncoder
+    {
+    public:
+        const char* Name() const override { return "bmp"; }
+
+        MapImageFormat Format() const override { return MapImageFormat::BMP; }
+
+        bool Encode(const MapImage& image, std::vector<uint8_t>& dataOut) override
+        {
+            // 24bpp rows are padded to a DWORD, as DIB_WIDTHBYTES does
+            size_t nRowBytes = ((size_t)image.Width() * 24 + 31) / 32 * 4;
+            size_t nPixelBytes = nRowBytes * (size_t)image.Height();
+            size_t nOffset = kBmpFileHeaderSize + kBmpInfoHeaderSize;
+
+            if (nOffset + nPixelBytes > 0xFFFFFFFFu)
+            {
+                return false;
+            }
+
+            dataOut.assign(nOffset + nPixelBytes, 0);
+
+            uint8_t* pHeader = dataOut.data();
+
+            // BITMAPFILEHEADER
+            pHeader[0] = 'B';
+            pHeader[1] = 'M';
+            PutLE32(pHeader + 2, (uint32_t)dataOut.size());
+            PutLE32(pHeader + 10, (uint32_t)nOffset);
+
+            // BITMAPINFOHEADER, BI_RGB, positive height for bottom-up
+            uint8_t* pInfo = pHeader + kBmpFileHeaderSize;
+            PutLE32(pInfo, (uint32_t)kBmpInfoHeaderSize);
+            PutLE32(pInfo + 4, (uint32_t)image.Width());
+            PutLE32(pInfo + 8, (uint32_t)image.Height());
+            PutLE16(pInfo + 12, 1);
+            PutLE16(pInfo + 14, 24);
+            PutLE32(pInfo + 20, (uint32_t)nPixelBytes);
+            PutLE32(pInfo + 24, 2835);      // 72 dpi, in pixels per meter
+            PutLE32(pInfo + 28, 2835);
+
+            // BMP is BGR already, it just needs the fourth byte dropped
+            for (int y = 0; y < image.Height(); y++)
+            {
+                const uint8_t* pSource = image.Row(y);
+                uint8_t* pDest = dataOut.data() + nOffset + (size_t)(image.Height() - 1 - y) * nRowBytes;
+
+                for (int x = 0; x < image.Width(); x++, pSource += 4, pDest += 3)
+                {
+                    pDest[0] = pSource[0];
+                    pDest[1] = pSource[1];
+                    pDest[2] = pSource[2];
+                }
+            }
+
+            return true;
+        }
+    };
+}
+
+const char* MapImageFormatName(MapImageFormat format)
+{
+    switch (format)
+    {
+    case MapImageFormat::PNG:   return "png";
+    case MapImageFormat::JPEG:  return "jpeg";
+    case MapImageFormat::BMP:   return "bmp";
+    }
+
+    return "png";
+}
+
+bool ParseMapImageFormat(const std::string& strName, MapImageFormat& formatOut)
+{
+    std::string strLower;
+
+    for (char c : strName)
+    {
+        strLower += (char)tolower((unsigned char)c);
+    }
+
+    if ("png" == strLower)
+    {
+        formatOut = MapImageFormat::PNG;
+    }
+    else if ("jpeg" == strLower || "jpg" == strLower)
+    {
+        formatOut = MapImageFormat::JPEG;
+    }
+    else if ("bmp" == strLower)
+    {
+        formatOut = MapImageFormat::BMP;
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+std::unique_ptr<ImageEncoder> CreateBmpEncoder()
+{
+    return std::unique_ptr<ImageEncoder>(new BmpEncoder());
+}
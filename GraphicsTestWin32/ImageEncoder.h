@@ -0,0 +1,49 @@
+// ImageEncoder.h : A platform-neutral interface to an image encoder.
+//
+// The other half of ImageDecoder: an ImageEncoder turns a MapImage's 32bpp
+// BGRX pixels back into a file, in memory, so batch runs can write maps out
+// without WIC.  The fourth byte of each pixel is ignored; every format is
+// written as 24-bit color.
+//
+// The BMP encoder is here, since it needs nothing but the pixels.  See
+// JpegEncoder.h and PngEncoder.h for the others.
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "MapImage.h"
+
+// the formats a map can be written in
+enum class MapImageFormat
+{
+    PNG,
+    JPEG,
+    BMP,
+};
+
+// "png", "jpeg" or "bmp", also the file extension
+const char* MapImageFormatName(MapImageFormat format);
+
+// parse a format name, ignoring case.  "jpg" is taken for "jpeg".
+bool ParseMapImageFormat(const std::string& strName, MapImageFormat& formatOut);
+
+class ImageEncoder
+{
+public:
+    virtual ~ImageEncoder() {}
+
+    // a short name for diagnostics and benchmark reports
+    virtual const char* Name() const = 0;
+
+    virtual MapImageFormat Format() const = 0;
+
+    // encode the whole image, replacing the contents of dataOut.  Returns
+    // false if it can't be encoded.
+    virtual bool Encode(const MapImage& image, std::vector<uint8_t>& dataOut) = 0;
+};
+
+// a bottom-up 24bpp BMP, as Paint writes them
+std::unique_ptr<ImageEncoder> CreateBmpEncoder();
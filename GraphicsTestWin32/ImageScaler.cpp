@@ -0,0 +1,530 @@
+// ImageScaler.cpp : Resamples 32bpp BGRX pixels to a new size.
+//
+#include "ImageScaler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define IMAGESCALER_SSE2 1
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+    const double kPi = 3.14159265358979323846;
+
+    // weights are fixed point with this many fraction bits, and every
+    // output pixel's weights add up to exactly 1 << kWeightBits
+    const int kWeightBits = 14;
+    const int kWeightRound = 1 << (kWeightBits - 1);
+
+    // below this many output pixels a second thread costs more than it saves
+    const int64_t kMinPixelsPerThread = 128 * 1024;
+
+    // never more threads than this, the passes are memory bound
+    const int kMaxThreads = 8;
+
+    // the weights for resampling one axis.  Output position i is the sum of
+    // nTaps input positions starting at first[i], weighted by
+    // weights[i * nTaps] onwards.  Taps past the end of an output's filter
+    // have zero weight.
+    struct ScaleAxis
+    {
+        int                     nTaps = 0;
+        std::vector<int>        first;
+        std::vector<int16_t>    weights;
+    };
+
+    double Sinc(double x)
+    {
+        if (0 == x)
+        {
+            return 1;
+        }
+
+        x *= kPi;
+
+        return sin(x) / x;
+    }
+
+    double FilterRadius(ScaleFilter filter)
+    {
+        return (ScaleFilter::LANCZOS3 == filter) ? 3.0 : 1.0;
+    }
+
+    double FilterWeight(ScaleFilter filter, double x)
+    {
+        x = fabs(x);
+
+        if (ScaleFilter::LANCZOS3 == filter)
+        {
+            return (x < 3) ? Sinc(x) * Sinc(x / 3) : 0;
+        }
+
+        return (x < 1) ? 1 - x : 0;
+    }
+
+    ScaleAxis BuildAxis(ScaleFilter filter, int nIn, int nOut)
+    {
+        ScaleAxis axis;
+
+        double scale = (double)nIn / nOut;
+
+        // when shrinking, stretch the filter over the input pixels
+        // each output pixel covers
+        double filterScale = std::max(scale, 1.0);
+        double support = FilterRadius(filter) * filterScale;
+
+        axis.nTaps = std::min((int)ceil(support) * 2 + 1, nIn);
+        axis.first.resize(nOut);
+        axis.weights.assign((size_t)nOut * axis.nTaps, 0);
+
+        std::vector<double> taps(axis.nTaps);
+
+        for (int i = 0; i < nOut; i++)
+        {
+            double center = (i + 0.5) * scale;
+
+            // the taps are a fixed-size window, kept inside the input
+            int nFirst = (int)floor(center - axis.nTaps / 2.0 + 0.5);
+            nFirst = std::min(std::max(nFirst, 0), nIn - axis.nTaps);
+
+            double total = 0;
+
+            for (int t = 0; t < axis.nTaps; t++)
+            {
+                taps[t] = FilterWeight(filter, (nFirst + t + 0.5 - center) / filterScale);
+                total += taps[t];
+            }
+
+            int16_t* pWeights = &axis.weights[(size_t)i * axis.nTaps];
+            int nSum = 0;
+            int nLargest = 0;
+
+            for (int t = 0; t < axis.nTaps; t++)
+            {
+                pWeights[t] = (int16_t)lround(taps[t] / total * (1 << kWeightBits));
+                nSum += pWeights[t];
+
+                if (pWeights[t] > pWeights[nLargest])
+                {
+                    nLargest = t;
+                }
+            }
+
+            // rounding mustn't brighten or darken the image
+            pWeights[nLargest] = (int16_t)(pWeights[nLargest] + (1 << kWeightBits) - nSum);
+
+            axis.first[i] = nFirst;
+        }
+
+        return axis;
+    }
+
+    uint8_t ClampToByte(int32_t n)
+    {
+        return (uint8_t)std::min(std::max(n, 0), 255);
+    }
+
+    // resample one row horizontally, nOut pixels from pSource into pDest
+    void ScaleRowScalar(const uint8_t* pSource, uint8_t* pDest, const ScaleAxis& axis, int nOut)
+    {
+        for (int x = 0; x < nOut; x++)
+        {
+            const uint8_t* pTap = pSource + (size_t)axis.first[x] * 4;
+            const int16_t* pWeights = &axis.weights[(size_t)x * axis.nTaps];
+
+            int32_t sum[4] = { kWeightRound, kWeightRound, kWeightRound, kWeightRound };
+
+            for (int t = 0; t < axis.nTaps; t++)
+            {
+                for (int c = 0; c < 4; c++)
+                {
+                    sum[c] += pWeights[t] * pTap[t * 4 + c];
+                }
+            }
+
+            for (int c = 0; c < 4; c++)
+            {
+                pDest[x * 4 + c] = ClampToByte(sum[c] >> kWeightBits);
+            }
+        }
+    }
+
+    // resample one output row vertically from nTaps rows of width pixels
+    void ScaleColumnsScalar(const uint8_t* const* ppRows, const int16_t* pWeights, int nTaps,
+        uint8_t* pDest, int nWidth)
+    {
+        for (int i = 0; i < nWidth * 4; i++)
+        {
+            int32_t sum = kWeightRound;
+
+            for (int t = 0; t < nTaps; t++)
+            {
+                sum += pWeights[t] * ppRows[t][i];
+            }
+
+            pDest[i] = ClampToByte(sum >> kWeightBits);
+        }
+    }
+
+#ifdef IMAGESCALER_SSE2
+
+    // two 16-bit weights side by side, as _mm_madd_epi16 wants them
+    __m128i WeightPair(int16_t w0, int16_t w1)
+    {
+        return _mm_set1_epi32((int32_t)(((uint32_t)(uint16_t)w1 << 16) | (uint16_t)w0));
+    }
+
+    // round, drop the fraction and pack four int32 channels to bytes
+    __m128i Narrow(__m128i sum0, __m128i sum1, __m128i sum2, __m128i sum3)
+    {
+        const __m128i round = _mm_set1_epi32(kWeightRound);
+
+        sum0 = _mm_srai_epi32(_mm_add_epi32(sum0, round), kWeightBits);
+        sum1 = _mm_srai_epi32(_mm_add_epi32(sum1, round), kWeightBits);
+        sum2 = _mm_srai_epi32(_mm_add_epi32(sum2, round), kWeightBits);
+        sum3 = _mm_srai_epi32(_mm_add_epi32(sum3, round), kWeightBits);
+
+        return _mm_packus_epi16(_mm_packs_epi32(sum0, sum1), _mm_packs_epi32(sum2, sum3));
+    }
+
+    void ScaleRowSse2(const uint8_t* pSource, uint8_t* pDest, const ScaleAxis& axis, int nOut)
+    {
+        const __m128i zero = _mm_setzero_si128();
+
+        for (int x = 0; x < nOut; x++)
+        {
+            const uint8_t* pTap = pSource + (size_t)axis.first[x] * 4;
+            const int16_t* pWeights = &axis.weights[(size_t)x * axis.nTaps];
+
+            __m128i sum = zero;
+            int t = 0;
+
+            // two taps at a time: [b0 g0 r0 x0 b1 g1 r1 x1] becomes
+            // [b0 b1 g0 g1 r0 r1 x0 x1], and one madd weights and adds both
+            for (; t + 2 <= axis.nTaps; t += 2)
+            {
+                __m128i pixels = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(pTap + t * 4)), zero);
+                pixels = _mm_unpacklo_epi16(pixels, _mm_srli_si128(pixels, 8));
+
+                sum = _mm_add_epi32(sum, _mm_madd_epi16(pixels, WeightPair(pWeights[t], pWeights[t + 1])));
+            }
+
+            if (t < axis.nTaps)
+            {
+                int32_t nPixel;
+                memcpy(&nPixel, pTap + t * 4, 4);
+
+                __m128i pixel = _mm_unpacklo_epi8(_mm_cvtsi32_si128(nPixel), zero);
+                pixel = _mm_unpacklo_epi16(pixel, zero);
+
+                sum = _mm_add_epi32(sum, _mm_madd_epi16(pixel, WeightPair(pWeights[t], 0)));
+            }
+
+            int32_t nResult = _mm_cvtsi128_si32(Narrow(sum, zero, zero, zero));
+            memcpy(pDest + x * 4, &nResult, 4);
+        }
+    }
+
+    void ScaleColumnsSse2(const uint8_t* const* ppRows, const int16_t* pWeights, int nTaps,
+        uint8_t* pDest, int nWidth)
+    {
+        const __m128i zero = _mm_setzero_si128();
+
+        int nBytes = nWidth * 4;
+        int i = 0;
+
+        // four pixels at a time, interleaving two rows so one madd
+        // weights and adds a channel from each
+        for (; i + 16 <= nBytes; i += 16)
+        {
+            __m128i sum0 = zero;
+            __m128i sum1 = zero;
+            __m128i sum2 = zero;
+            __m128i sum3 = zero;
+
+            for (int t = 0; t < nTaps; t += 2)
+            {
+                __m128i a = _mm_loadu_si128((const __m128i*)(ppRows[t] + i));
+                __m128i b = (t + 1 < nTaps) ? _mm_loadu_si128((const __m128i*)(ppRows[t + 1] + i)) : zero;
+                __m128i weights = WeightPair(pWeights[t], (t + 1 < nTaps) ? pWeights[t + 1] : 0);
+
+                __m128i aLow = _mm_unpacklo_epi8(a, zero);
+                __m128i aHigh = _mm_unpackhi_epi8(a, zero);
+                __m128i bLow = _mm_unpacklo_epi8(b, zero);
+                __m128i bHigh = _mm_unpackhi_epi8(b, zero);
+
+                sum0 = _mm_add_epi32(sum0, _mm_madd_epi16(_mm_unpacklo_epi16(aLow, bLow), weights));
+                sum1 = _mm_add_epi32(sum1, _mm_madd_epi16(_mm_unpackhi_epi16(aLow, bLow), weights));
+                sum2 = _mm_add_epi32(sum2, _mm_madd_epi16(_mm_unpacklo_epi16(aHigh, bHigh), weights));
+                sum3 = _mm_add_epi32(sum3, _mm_madd_epi16(_mm_unpackhi_epi16(aHigh, bHigh), weights));
+            }
+
+            _mm_storeu_si128((__m128i*)(pDest + i), Narrow(sum0, sum1, sum2, sum3));
+        }
+
+        // the last few pixels
+        if (i < nBytes)
+        {
+            std::vector<const uint8_t*> rows(ppRows, ppRows + nTaps);
+
+            for (const uint8_t*& pRow : rows)
+            {
+                pRow += i;
+            }
+
+            ScaleColumnsScalar(rows.data(), pWeights, nTaps, pDest + i, (nBytes - i) / 4);
+        }
+    }
+
+#endif // IMAGESCALER_SSE2
+
+    // scale output rows [nFirstRow, nLastRow) with a separable filter
+    void ScaleBand(const ConstPixelBuffer& source, const PixelBuffer& dest,
+        const ScaleAxis& horizontal, const ScaleAxis& vertical,
+        int nFirstRow, int nLastRow, bool bSimd)
+    {
+        if (nFirstRow >= nLastRow)
+        {
+            return;
+        }
+
+        // the source rows this band reads, each scaled horizontally once
+        int nFirstSource = vertical.first[nFirstRow];
+        int nLastSource = vertical.first[nLastRow - 1] + vertical.nTaps;
+
+        size_t nRowBytes = (size_t)dest.width * 4;
+        std::vector<uint8_t> scaledRows((size_t)(nLastSource - nFirstSource) * nRowBytes);
+
+        for (int y = nFirstSource; y < nLastSource; y++)
+        {
+            uint8_t* pScaled = &scaledRows[(size_t)(y - nFirstSource) * nRowBytes];
+
+#ifdef IMAGESCALER_SSE2
+            if (bSimd)
+            {
+                ScaleRowSse2(source.Row(y), pScaled, horizontal, dest.width);
+                continue;
+            }
+#endif
+            ScaleRowScalar(source.Row(y), pScaled, horizontal, dest.width);
+        }
+
+        std::vector<const uint8_t*> rows(vertical.nTaps);
+
+        for (int y = nFirstRow; y < nLastRow; y++)
+        {
+            for (int t = 0; t < vertical.nTaps; t++)
+            {
+                rows[t] = &scaledRows[(size_t)(vertical.first[y] + t - nFirstSource) * nRowBytes];
+            }
+
+            const int16_t* pWeights = &vertical.weights[(size_t)y * vertical.nTaps];
+
+#ifdef IMAGESCALER_SSE2
+            if (bSimd)
+            {
+                ScaleColumnsSse2(rows.data(), pWeights, vertical.nTaps, dest.Row(y), dest.width);
+                continue;
+            }
+#endif
+            ScaleColumnsScalar(rows.data(), pWeights, vertical.nTaps, dest.Row(y), dest.width);
+        }
+    }
+
+    // the source pixel nearest the middle of output pixel i
+    int NearestIndex(int i, int nIn, int nOut)
+    {
+        return (int)(((int64_t)i * 2 + 1) * nIn / ((int64_t)nOut * 2));
+    }
+
+    void ScaleBandNearest(const ConstPixelBuffer& source, const PixelBuffer& dest,
+        const std::vector<int>& columns, int nFirstRow, int nLastRow)
+    {
+        for (int y = nFirstRow; y < nLastRow; y++)
+        {
+            const uint32_t* pSource = reinterpret_cast<const uint32_t*>(
+                source.Row(NearestIndex(y, source.height, dest.height)));
+            uint32_t* pDest = reinterpret_cast<uint32_t*>(dest.Row(y));
+
+            for (int x = 0; x < dest.width; x++)
+            {
+                pDest[x] = pSource[columns[x]];
+            }
+        }
+    }
+
+    int ChooseThreads(int nWidth, int nRows, int nThreads)
+    {
+        if (nThreads <= 0)
+        {
+            nThreads = std::min((int)std::thread::hardware_concurrency(), kMaxThreads);
+            nThreads = (int)std::min<int64_t>(nThreads, (int64_t)nWidth * nRows / kMinPixelsPerThread);
+        }
+
+        // at least a few rows each
+        return std::max(1, std::min(nThreads, nRows / 16));
+    }
+
+    // run band(nFirst, nLast) over rows [nFirstRow, nLastRow), split
+    // between nThreads threads
+    template <typename Band>
+    void RunBands(int nFirstRow, int nLastRow, int nThreads, const Band& band)
+    {
+        int nRows = nLastRow - nFirstRow;
+
+        if (nThreads <= 1)
+        {
+            band(nFirstRow, nLastRow);
+            return;
+        }
+
+        std::vector<std::thread> threads;
+
+        for (int i = 1; i < nThreads; i++)
+        {
+            threads.emplace_back(band, nFirstRow + (int)((int64_t)nRows * i / nThreads),
+                nFirstRow + (int)((int64_t)nRows * (i + 1) / nThreads));
+        }
+
+        // this thread does the first band
+        band(nFirstRow, nFirstRow + (int)((int64_t)nRows / nThreads));
+
+        for (std::thread& thread : threads)
+        {
+            thread.join();
+        }
+    }
+
+    void Scale(const ConstPixelBuffer& source, const PixelBuffer& dest, ScaleFilter filter,
+        int nFirstRow, int nLastRow, int nThreads, bool bSimd)
+    {
+        if (source.width <= 0 || source.height <= 0 || dest.width <= 0 || dest.height <= 0)
+        {
+            return;
+        }
+
+        nFirstRow = std::max(nFirstRow, 0);
+        nLastRow = std::min(nLastRow, dest.height);
+
+        if (nFirstRow >= nLastRow)
+        {
+            return;
+        }
+
+        if (nThreads <= 0)
+        {
+            nThreads = ChooseThreads(dest.width, nLastRow - nFirstRow, 0);
+        }
+
+        if (ScaleFilter::NEAREST == filter)
+        {
+            std::vector<int> columns(dest.width);
+
+            for (int x = 0; x < dest.width; x++)
+            {
+                columns[x] = NearestIndex(x, source.width, dest.width);
+            }
+
+            RunBands(nFirstRow, nLastRow, nThreads, [&](int nFirst, int nLast)
+            {
+                ScaleBandNearest(source, dest, columns, nFirst, nLast);
+            });
+
+            return;
+        }
+
+        ScaleAxis horizontal = BuildAxis(filter, source.width, dest.width);
+        ScaleAxis vertical = BuildAxis(filter, source.height, dest.height);
+
+        RunBands(nFirstRow, nLastRow, nThreads, [&](int nFirst, int nLast)
+        {
+            ScaleBand(source, dest, horizontal, vertical, nFirst, nLast, bSimd);
+        });
+    }
+}
+
+const char* ScaleFilterName(ScaleFilter filter)
+{
+    switch (filter)
+    {
+    case ScaleFilter::NEAREST:      return "nearest";
+    case ScaleFilter::BILINEAR:     return "bilinear";
+    case ScaleFilter::LANCZOS3:     return "lanczos3";
+    }
+
+    return "unknown";
+}
+
+void ScaleImage(const ConstPixelBuffer& source, const PixelBuffer& dest, ScaleFilter filter, int nThreads)
+{
+    Scale(source, dest, filter, 0, dest.height, nThreads, true);
+}
+
+void ScaleImageRows(const ConstPixelBuffer& source, const PixelBuffer& dest, ScaleFilter filter,
+    int nFirstRow, int nLastRow, int nThreads)
+{
+    Scale(source, dest, filter, nFirstRow, nLastRow, nThreads, true);
+}
+
+void ScaleImageScalar(const ConstPixelBuffer& source, const PixelBuffer& dest, ScaleFilter filter)
+{
+    Scale(source, dest, filter, 0, dest.height, 1, false);
+}
+
+bool ImageScalerHasSimd()
+{
+#ifdef IMAGESCALER_SSE2
+    return true;
+#else
+    return false;
+#endif
+}
+
+void FitImageSize(int nWidth, int nHeight, int nBoxWidth, int nBoxHeight, int* pFitWidth, int* pFitHeight)
+{
+    if (nWidth <= 0 || nHeight <= 0 || nBoxWidth <= 0 || nBoxHeight <= 0)
+    {
+        *pFitWidth = 1;
+        *pFitHeight = 1;
+        return;
+    }
+
+    // whichever side of the box is the tighter fit decides the scale
+    if ((int64_t)nWidth * nBoxHeight > (int64_t)nHeight * nBoxWidth)
+    {
+        *pFitWidth = nBoxWidth;
+        *pFitHeight = (int)(((int64_t)nHeight * nBoxWidth * 2 + nWidth) / ((int64_t)nWidth * 2));
+    }
+    else
+    {
+        *pFitHeight = nBoxHeight;
+        *pFitWidth = (int)(((int64_t)nWidth * nBoxHeight * 2 + nHeight) / ((int64_t)nHeight * 2));
+    }
+
+    *pFitWidth = std::max(*pFitWidth, 1);
+    *pFitHeight = std::max(*pFitHeight, 1);
+}
+
+int NearestRowsReady(int nSourceRows, int nSourceHeight, int nDestHeight)
+{
+    if (nSourceRows >= nSourceHeight)
+    {
+        return nDestHeight;
+    }
+
+    // NearestIndex only grows, so count the rows until it reaches nSourceRows
+    int nRows = 0;
+
+    while (nRows < nDestHeight && NearestIndex(nRows, nSourceHeight, nDestHeight) < nSourceRows)
+    {
+        nRows++;
+    }
+
+    return nRows;
+}
@@ -0,0 +1,61 @@
+// ImageScaler.h : Resamples 32bpp BGRX pixels to a new size.
+//
+// A map is downloaded at the size its location asks for, so when the
+// window is a different size the map is scaled to fit rather than
+// downloaded again.  There are three filters:
+//
+//      NEAREST     copies the nearest source pixel.  Blocky, but fast
+//                  enough to redo on every WM_SIZE while the user drags
+//                  the window frame.
+//      BILINEAR    a triangle filter over the nearest two pixels each way.
+//      LANCZOS3    a windowed sinc over the nearest six pixels each way.
+//                  The sharpest, used once the window stops changing size.
+//
+// Bilinear and Lanczos are separable: each row is resampled horizontally,
+// then each column vertically.  When shrinking, the filters are widened
+// by the scale factor so every source pixel contributes and the map
+// doesn't alias.  The weights are 14-bit fixed point, and both passes use
+// SSE2 when the compiler targets it.  The scalar reference does the same
+// integer arithmetic, so the two give identical pixels.
+//
+// Large images are split into bands of rows scaled on separate threads.
+//
+// ImageScaler has no Windows dependencies.
+#pragma once
+
+#include "PixelBlit.h"
+
+enum class ScaleFilter
+{
+    NEAREST,
+    BILINEAR,
+    LANCZOS3,
+};
+
+// "nearest", "bilinear" or "lanczos3"
+const char* ScaleFilterName(ScaleFilter filter);
+
+// scale all of source to exactly fill dest.  nThreads is the most
+// threads to use, 0 to decide from the size of dest and the machine.
+void ScaleImage(const ConstPixelBuffer& source, const PixelBuffer& dest, ScaleFilter filter, int nThreads = 0);
+
+// scale only rows [nFirstRow, nLastRow) of dest, as ScaleImage would.
+// Only the source rows those rows are made from are read, so part of a
+// map that is still being decoded can be scaled while it arrives.
+void ScaleImageRows(const ConstPixelBuffer& source, const PixelBuffer& dest, ScaleFilter filter,
+    int nFirstRow, int nLastRow, int nThreads = 0);
+
+// the portable, single-threaded reference for ScaleImage
+void ScaleImageScalar(const ConstPixelBuffer& source, const PixelBuffer& dest, ScaleFilter filter);
+
+// true if ScaleImage is vectorized in this build
+bool ImageScalerHasSimd();
+
+// the largest size with the same shape as nWidth x nHeight that fits in
+// nBoxWidth x nBoxHeight.  Never smaller than 1 x 1.
+void FitImageSize(int nWidth, int nHeight, int nBoxWidth, int nBoxHeight, int* pFitWidth, int* pFitHeight);
+
+// for a NEAREST scale from nSourceHeight rows to nDestHeight, how many
+// rows from the top of dest come only from the first nSourceRows rows of
+// source.  This is how much of a partly decoded map can be shown scaled.
+int NearestRowsReady(int nSourceRows, int nSourceHeight, int nDestHeight);
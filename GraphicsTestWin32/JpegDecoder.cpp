@@ -0,0 +1,395 @@
+// JpegDecoder.cpp : An ImageDecoder for JPEG, built on libjpeg.
+//
+#include "JpegDecoder.h"
+
+#include <csetjmp>
+#include <cstdio>
+#include <cstring>
+
+#include <jpeglib.h>
+#include <jerror.h>
+
+#include "ColorConvert.h"
+#include "MapImage.h"
+
+namespace
+{
+    // libjpeg reports errors by calling error_exit, which must not return.
+    // The decoder jumps back out to where it started, so nothing in the
+    // functions below that calls setjmp may have a destructor.
+    struct JpegErrorManager
+    {
+        jpeg_error_mgr  pub;
+        jmp_buf         jumpBuffer;
+        bool            bTruncated;     // the data ended before the image did
+    };
+
+    void OnJpegError(j_common_ptr pInfo)
+    {
+        JpegErrorManager* pError = reinterpret_cast<JpegErrorManager*>(pInfo->err);
+
+        longjmp(pError->jumpBuffer, 1);
+    }
+
+    void OnJpegMessage(j_common_ptr pInfo, int nLevel)
+    {
+        JpegErrorManager* pError = reinterpret_cast<JpegErrorManager*>(pInfo->err);
+
+        // libjpeg pads a truncated file out with gray and carries on, but
+        // half a map is no map.  Other warnings aren't worth reporting.
+        if (nLevel < 0 && JWRN_JPEG_EOF == pInfo->err->msg_code)
+        {
+            pError->bTruncated = true;
+        }
+    }
+
+    void InitErrorManager(jpeg_decompress_struct& info, JpegErrorManager& error)
+    {
+        info.err = jpeg_std_error(&error.pub);
+        error.pub.error_exit = OnJpegError;
+        error.pub.emit_message = OnJpegMessage;
+        error.bTruncated = false;
+    }
+
+    // true if the image can be decoded from raw planes: YCbCr with full
+    // resolution or 2x subsampled chroma, or grayscale
+    bool CanDecodeRaw(const jpeg_decompress_struct& info)
+    {
+        if (1 == info.num_components)
+        {
+            return JCS_GRAYSCALE == info.jpeg_color_space;
+        }
+
+        if (3 != info.num_components || JCS_YCbCr != info.jpeg_color_space)
+        {
+            return false;
+        }
+
+        const jpeg_component_info* pComponents = info.comp_info;
+
+        int nLumaH = pComponents[0].h_samp_factor;
+        int nLumaV = pComponents[0].v_samp_factor;
+
+        return (1 == nLumaH || 2 == nLumaH) && (1 == nLumaV || 2 == nLumaV) &&
+            1 == pComponents[1].h_samp_factor && 1 == pComponents[1].v_samp_factor &&
+            1 == pComponents[2].h_samp_factor && 1 == pComponents[2].v_samp_factor;
+    }
+
+    // decode an iMCU row at a time from the raw planes, converting colors
+    // ourselves.  Called after jpeg_read_header.
+    void DecodeRaw(jpeg_decompress_struct& info, uint8_t* pPixels, size_t nStride)
+    {
+        info.raw_data_out = TRUE;
+
+        jpeg_start_decompress(&info);
+
+        int nComponents = info.num_components;
+        int nRowsPerPass = info.max_v_samp_factor * DCTSIZE;
+
+        // libjpeg's pools are freed by jpeg_destroy_decompress, even after an error
+        JSAMPARRAY planes[3];
+
+        for (int c = 0; c < nComponents; c++)
+        {
+            const jpeg_component_info& component = info.comp_info[c];
+
+            planes[c] = (*info.mem->alloc_sarray)(reinterpret_cast<j_common_ptr>(&info), JPOOL_IMAGE,
+                component.width_in_blocks * DCTSIZE, component.v_samp_factor * DCTSIZE);
+        }
+
+        int nWidth = (int)info.output_width;
+        int nHeight = (int)info.output_height;
+        int nChromaShiftX = (nComponents == 3 && 2 == info.comp_info[0].h_samp_factor) ? 1 : 0;
+        int nChromaShiftY = (nComponents == 3 && 2 == info.comp_info[0].v_samp_factor) ? 1 : 0;
+
+        for (int nTop = 0; nTop < nHeight; nTop += nRowsPerPass)
+        {
+            if (0 == jpeg_read_raw_data(&info, planes, nRowsPerPass))
+            {
+                // suspended, which neither of our sources ever does
+                break;
+            }
+
+            for (int row = 0; row < nRowsPerPass && nTop + row < nHeight; row++)
+            {
+                uint8_t* pOut = pPixels + (size_t)(nTop + row) * nStride;
+
+                if (1 == nComponents)
+                {
+                    GrayRowToBgrx(planes[0][row], pOut, nWidth);
+                }
+                else
+                {
+                    int nChromaRow = row >> nChromaShiftY;
+
+                    YCbCrRowToBgrx(planes[0][row], planes[1][nChromaRow], planes[2][nChromaRow],
+                        nChromaShiftX, pOut, nWidth);
+                }
+            }
+        }
+    }
+
+    // let libjpeg convert to RGB and only swap the bytes around
+    void DecodeRgb(jpeg_decompress_struct& info, uint8_t* pPixels, size_t nStride)
+    {
+        info.out_color_space = JCS_RGB;
+
+        jpeg_start_decompress(&info);
+
+        JSAMPARRAY pRow = (*info.mem->alloc_sarray)(reinterpret_cast<j_common_ptr>(&info), JPOOL_IMAGE,
+            info.output_width * info.output_components, 1);
+
+        while (info.output_scanline < info.output_height)
+        {
+            JDIMENSION nRow = info.output_scanline;
+
+            if (0 == jpeg_read_scanlines(&info, pRow, 1))
+            {
+                break;
+            }
+
+            RgbRowToBgrx(pRow[0], pPixels + (size_t)nRow * nStride, (int)info.output_width);
+        }
+    }
+
+    // decode the pixels once the header has been read, and finish.
+    // Returns false if the image ended early.  The caller has set the
+    // error manager's jump buffer.
+    bool DecodePixels(jpeg_decompress_struct& info, JpegErrorManager& error, uint8_t* pPixels, size_t nStride)
+    {
+        if (CanDecodeRaw(info))
+        {
+            DecodeRaw(info, pPixels, nStride);
+        }
+        else
+        {
+            DecodeRgb(info, pPixels, nStride);
+        }
+
+        bool bComplete = (info.output_scanline >= info.output_height) && !error.bTruncated;
+
+        if (info.output_scanline >= info.output_height)
+        {
+            jpeg_finish_decompress(&info);
+        }
+
+        return bComplete;
+    }
+
+    // how much the stream source asks the StreamingBuffer for at a time.
+    // Small, so the decoder starts on each piece soon after it arrives.
+    const size_t kStreamReadSize = 4096;
+
+    // a libjpeg source that reads a StreamingBuffer as it downloads,
+    // waiting for bytes that haven't arrived yet
+    struct StreamSource
+    {
+        jpeg_source_mgr     pub;
+        StreamingBuffer*    pBuffer;
+        size_t              nOffset;        // of the next read
+        JOCTET              bytes[kStreamReadSize];
+    };
+
+    void InitStreamSource(j_decompress_ptr)
+    {
+    }
+
+    boolean FillStreamSource(j_decompress_ptr pInfo)
+    {
+        StreamSource* pSource = reinterpret_cast<StreamSource*>(pInfo->src);
+        size_t nRead = 0;
+
+        if (StreamingBuffer::ReadStatus::ABORTED ==
+            pSource->pBuffer->Read(pSource->nOffset, pSource->bytes, kStreamReadSize, &nRead))
+        {
+            // the download failed, so there is nothing to wait for
+            ERREXIT(pInfo, JERR_INPUT_EOF);
+        }
+
+        if (0 == nRead)
+        {
+            // the download finished before the image did.  As libjpeg's
+            // own sources do, warn, which marks it truncated, and end it.
+            WARNMS(pInfo, JWRN_JPEG_EOF);
+
+            pSource->bytes[0] = (JOCTET)0xFF;
+            pSource->bytes[1] = (JOCTET)JPEG_EOI;
+            nRead = 2;
+        }
+        else
+        {
+            pSource->nOffset += nRead;
+        }
+
+        pSource->pub.next_input_byte = pSource->bytes;
+        pSource->pub.bytes_in_buffer = nRead;
+
+        return TRUE;
+    }
+
+    void SkipStreamSource(j_decompress_ptr pInfo, long nBytes)
+    {
+        StreamSource* pSource = reinterpret_cast<StreamSource*>(pInfo->src);
+
+        if (nBytes <= 0)
+        {
+            return;
+        }
+
+        while ((size_t)nBytes > pSource->pub.bytes_in_buffer)
+        {
+            nBytes -= (long)pSource->pub.bytes_in_buffer;
+            FillStreamSource(pInfo);
+        }
+
+        pSource->pub.next_input_byte += nBytes;
+        pSource->pub.bytes_in_buffer -= (size_t)nBytes;
+    }
+
+    void TermStreamSource(j_decompress_ptr)
+    {
+    }
+
+    // create the decompressor reading source and read the header.  The
+    // image can only be allocated once its size is known, which can't be
+    // done in a function that calls setjmp, so this is in two parts.
+    bool ReadStreamHeader(jpeg_decompress_struct& info, JpegErrorManager& error, StreamSource& source)
+    {
+        if (setjmp(error.jumpBuffer))
+        {
+            return false;
+        }
+
+        jpeg_create_decompress(&info);
+
+        source.pub.init_source = InitStreamSource;
+        source.pub.fill_input_buffer = FillStreamSource;
+        source.pub.skip_input_data = SkipStreamSource;
+        source.pub.resync_to_restart = jpeg_resync_to_restart;
+        source.pub.term_source = TermStreamSource;
+        source.pub.next_input_byte = nullptr;
+        source.pub.bytes_in_buffer = 0;
+
+        info.src = &source.pub;
+
+        jpeg_read_header(&info, TRUE);
+
+        return info.image_width > 0 && info.image_height > 0;
+    }
+
+    bool DecodeStreamPixels(jpeg_decompress_struct& info, JpegErrorManager& error, uint8_t* pPixels, size_t nStride)
+    {
+        if (setjmp(error.jumpBuffer))
+        {
+            return false;
+        }
+
+        return DecodePixels(info, error, pPixels, nStride);
+    }
+
+    class JpegDecoder : public ImageDecoder
+    {
+    public:
+        const char* Name() const override
+        {
+            return ColorConvertHasSimd() ? "libjpeg+simd" : "libjpeg";
+        }
+
+        bool ReadInfo(const uint8_t* pData, size_t nSize, ImageInfo& infoOut) override
+        {
+            jpeg_decompress_struct info;
+            JpegErrorManager error;
+
+            InitErrorManager(info, error);
+
+            if (setjmp(error.jumpBuffer))
+            {
+                jpeg_destroy_decompress(&info);
+                return false;
+            }
+
+            jpeg_create_decompress(&info);
+            jpeg_mem_src(&info, pData, (unsigned long)nSize);
+            jpeg_read_header(&info, TRUE);
+
+            infoOut.width = (int)info.image_width;
+            infoOut.height = (int)info.image_height;
+
+            jpeg_destroy_decompress(&info);
+
+            return infoOut.width > 0 && infoOut.height > 0;
+        }
+
+        bool Decode(const uint8_t* pData, size_t nSize, const ImageInfo& imageInfo,
+            uint8_t* pPixels, size_t nStride) override
+        {
+            jpeg_decompress_struct info;
+            JpegErrorManager error;
+
+            InitErrorManager(info, error);
+
+            if (setjmp(error.jumpBuffer))
+            {
+                jpeg_destroy_decompress(&info);
+                return false;
+            }
+
+            jpeg_create_decompress(&info);
+            jpeg_mem_src(&info, pData, (unsigned long)nSize);
+            jpeg_read_header(&info, TRUE);
+
+            // the caller's buffer was sized from ReadInfo
+            if ((int)info.image_width != imageInfo.width ||
+                (int)info.image_height != imageInfo.height ||
+                nStride < (size_t)imageInfo.width * 4)
+            {
+                jpeg_destroy_decompress(&info);
+                return false;
+            }
+
+            bool bComplete = DecodePixels(info, error, pPixels, nStride);
+
+            jpeg_destroy_decompress(&info);
+
+            return bComplete;
+        }
+    };
+}
+
+std::unique_ptr<ImageDecoder> CreateJpegDecoder()
+{
+    return std::unique_ptr<ImageDecoder>(new JpegDecoder());
+}
+
+bool DecodeJpegStream(StreamingBuffer& buffer, MapImageHandle& refMapOut)
+{
+    jpeg_decompress_struct info;
+    JpegErrorManager error;
+    StreamSource source;
+
+    // so destroying it is safe even if creating it failed
+    memset(&info, 0, sizeof(info));
+
+    InitErrorManager(info, error);
+
+    source.pBuffer = &buffer;
+    source.nOffset = 0;
+
+    std::shared_ptr<MapImage> pImage;
+    bool bDecoded = ReadStreamHeader(info, error, source);
+
+    if (bDecoded)
+    {
+        pImage = MapImage::Create((int)info.image_width, (int)info.image_height);
+        bDecoded = pImage && DecodeStreamPixels(info, error, pImage->Pixels(), pImage->Stride());
+    }
+
+    jpeg_destroy_decompress(&info);
+
+    if (bDecoded)
+    {
+        refMapOut = pImage;
+    }
+
+    return bDecoded;
+}
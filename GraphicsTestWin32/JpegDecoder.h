@@ -0,0 +1,30 @@
+// JpegDecoder.h : An ImageDecoder for JPEG, built on libjpeg.
+//
+// Bing Maps sends JPEGs.  This decoder asks libjpeg (libjpeg-turbo, or any
+// libjpeg with the version 8 memory source) for the raw Y, Cb and Cr
+// planes and does the color conversion itself with YCbCrRowToBgrx, which
+// is vectorized, writing each row straight into the caller's buffer.
+// Chroma is upsampled by repeating samples, as libjpeg's merged upsampler
+// does.  JPEGs that aren't YCbCr or grayscale, or use unusual sampling, are
+// converted to RGB by libjpeg instead.
+//
+// It can also decode a map while it downloads, reading a StreamingBuffer
+// as the Windows program's WIC decoder reads a StreamingBufferStream.
+//
+// This needs libjpeg, so it isn't part of the Windows project, which
+// decodes with WIC.
+#pragma once
+
+#include <memory>
+
+#include "ImageDecoder.h"
+#include "StreamingBuffer.h"
+
+std::unique_ptr<ImageDecoder> CreateJpegDecoder();
+
+// decode a JPEG from buffer into a new MapImage, reading the bytes as they
+// arrive and waiting for the rest, so decoding overlaps the download.  Run
+// it on a thread of its own while another downloads into buffer.  Returns
+// false if the download is aborted or ends before the image does, or the
+// data is damaged.
+bool DecodeJpegStream(StreamingBuffer& buffer, MapImageHandle& refMapOut);
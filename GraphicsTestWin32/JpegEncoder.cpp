@@ -0,0 +1,139 @@
+// JpegEncoder.cpp : An ImageEncoder for JPEG, built on libjpeg.
+//
+#include "JpegEncoder.h"
+
+#include <algorithm>
+#include <csetjmp>
+#include <cstdio>
+#include <cstdlib>
+
+#include <jpeglib.h>
+
+namespace
+{
+    // as in JpegDecoder, errors jump back to where the encode started, so
+    // nothing in a function that calls setjmp may have a destructor
+    struct JpegErrorManager
+    {
+        jpeg_error_mgr  pub;
+        jmp_buf         jumpBuffer;
+    };
+
+    void OnJpegError(j_common_ptr pInfo)
+    {
+        JpegErrorManager* pError = reinterpret_cast<JpegErrorManager*>(pInfo->err);
+
+        longjmp(pError->jumpBuffer, 1);
+    }
+
+    void OnJpegMessage(j_common_ptr, int)
+    {
+    }
+
+    class JpegEncoder : public ImageEncoder
+    {
+    public:
+        explicit JpegEncoder(int nQuality)
+            : m_nQuality(std::min(std::max(nQuality, 1), 100))
+        {
+        }
+
+        const char* Name() const override { return "libjpeg"; }
+
+        MapImageFormat Format() const override { return MapImageFormat::JPEG; }
+
+        bool Encode(const MapImage& image, std::vector<uint8_t>& dataOut) override
+        {
+            unsigned char* pOutput = nullptr;
+            unsigned long nOutputSize = 0;
+
+            if (!Compress(image, &pOutput, &nOutputSize))
+            {
+                free(pOutput);
+                return false;
+            }
+
+            dataOut.assign(pOutput, pOutput + nOutputSize);
+            free(pOutput);
+
+            return true;
+        }
+
+    private:
+        // jpeg_mem_dest leaves the JPEG in a buffer from malloc, which
+        // the caller frees whether or not this succeeds
+        bool Compress(const MapImage& image, unsigned char** ppOutput, unsigned long* pnOutputSize)
+        {
+            jpeg_compress_struct info;
+            JpegErrorManager error;
+
+#ifndef JCS_EXTENSIONS
+            // an RGB row, for libjpegs that can't read BGRX.  It is sized
+            // before setjmp, so a longjmp back here finds it as it was.
+            std::vector<uint8_t> rgbRow((size_t)image.Width() * 3);
+            uint8_t* pRgbRow = rgbRow.data();
+#endif
+
+            info.err = jpeg_std_error(&error.pub);
+            error.pub.error_exit = OnJpegError;
+            error.pub.emit_message = OnJpegMessage;
+
+            if (setjmp(error.jumpBuffer))
+            {
+                jpeg_destroy_compress(&info);
+                return false;
+            }
+
+            jpeg_create_compress(&info);
+            jpeg_mem_dest(&info, ppOutput, pnOutputSize);
+
+            info.image_width = (JDIMENSION)image.Width();
+            info.image_height = (JDIMENSION)image.Height();
+
+#ifdef JCS_EXTENSIONS
+            info.input_components = 4;
+            info.in_color_space = JCS_EXT_BGRX;
+#else
+            info.input_components = 3;
+            info.in_color_space = JCS_RGB;
+#endif
+
+            jpeg_set_defaults(&info);
+            jpeg_set_quality(&info, m_nQuality, TRUE);
+
+            jpeg_start_compress(&info, TRUE);
+
+            while (info.next_scanline < info.image_height)
+            {
+                const uint8_t* pSource = image.Row((int)info.next_scanline);
+
+#ifdef JCS_EXTENSIONS
+                JSAMPROW pRow = const_cast<JSAMPROW>(pSource);
+#else
+                for (int x = 0; x < image.Width(); x++)
+                {
+                    pRgbRow[x * 3] = pSource[x * 4 + 2];
+                    pRgbRow[x * 3 + 1] = pSource[x * 4 + 1];
+                    pRgbRow[x * 3 + 2] = pSource[x * 4];
+                }
+
+                JSAMPROW pRow = pRgbRow;
+#endif
+
+                jpeg_write_scanlines(&info, &pRow, 1);
+            }
+
+            jpeg_finish_compress(&info);
+            jpeg_destroy_compress(&info);
+
+            return true;
+        }
+
+        int     m_nQuality;
+    };
+}
+
+std::unique_ptr<ImageEncoder> CreateJpegEncoder(int nQuality)
+{
+    return std::unique_ptr<ImageEncoder>(new JpegEncoder(nQuality));
+}
@@ -0,0 +1,16 @@
+// JpegEncoder.h : An ImageEncoder for JPEG, built on libjpeg.
+//
+// libjpeg-turbo reads the BGRX pixels as they are.  Other libjpegs are
+// handed each row converted to RGB.  The chroma is subsampled 2x2, as the
+// maps Bing sends are.
+//
+// This needs libjpeg, so it isn't part of the Windows project, which
+// encodes with WIC.
+#pragma once
+
+#include <memory>
+
+#include "ImageEncoder.h"
+
+// nQuality is libjpeg's, 1 to 100
+std::unique_ptr<ImageEncoder> CreateJpegEncoder(int nQuality = 85);
@@ -0,0 +1,185 @@
+// MapAdaptiveFetch.cpp : Choosing what size of map to download first.
+//
+#include "MapAdaptiveFetch.h"
+
+#include <algorithm>
+#include <cstdio>
+
+#include "ImageScaler.h"
+#include "PixelBlit.h"
+
+double MapBandwidthEstimate::PredictMs(uint64_t nPixels) const
+{
+    if (!bValid || fBytesPerSecond <= 0)
+    {
+        return 0;
+    }
+
+    return fFirstByteMs + (double)nPixels * fBytesPerPixel * 1000.0 / fBytesPerSecond;
+}
+
+MapBandwidthEstimator::MapBandwidthEstimator()
+    : m_fBytes(0), m_fReadUs(0), m_bThroughput(false),
+      m_fFirstByteUs(0), m_bFirstByte(false),
+      m_fBytesPerPixel(0), m_bBytesPerPixel(false),
+      m_nDownloads(0)
+{
+}
+
+void MapBandwidthEstimator::Record(uint64_t nBytes, uint64_t nReadUs, uint64_t nFirstByteUs, uint64_t nPixels)
+{
+    // the first sample of each is taken as it is, later ones smoothed in
+    auto smooth = [](double& fAverage, bool& bHave, double fSample)
+    {
+        fAverage = bHave ? fAverage + kSmoothing * (fSample - fAverage) : fSample;
+        bHave = true;
+    };
+
+    m_nDownloads.fetch_add(1, std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    smooth(m_fFirstByteUs, m_bFirstByte, (double)nFirstByteUs);
+
+    if (nBytes >= kMinThroughputSampleBytes && nReadUs > 0)
+    {
+        // both averages move together, so they stay a matched pair
+        bool bHave = m_bThroughput;
+
+        smooth(m_fBytes, bHave, (double)nBytes);
+        smooth(m_fReadUs, m_bThroughput, (double)nReadUs);
+    }
+
+    if (nPixels > 0 && nBytes > 0)
+    {
+        smooth(m_fBytesPerPixel, m_bBytesPerPixel, (double)nBytes / (double)nPixels);
+    }
+}
+
+MapBandwidthEstimate MapBandwidthEstimator::Estimate() const
+{
+    MapBandwidthEstimate estimate;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    estimate.bValid = m_bThroughput && m_bBytesPerPixel && m_fReadUs > 0;
+    estimate.fBytesPerSecond = (m_fReadUs > 0) ? m_fBytes * 1000000.0 / m_fReadUs : 0;
+    estimate.fFirstByteMs = m_fFirstByteUs / 1000.0;
+    estimate.fBytesPerPixel = m_fBytesPerPixel;
+
+    return estimate;
+}
+
+void MapBandwidthEstimator::Reset()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_fBytes = 0;
+    m_fReadUs = 0;
+    m_bThroughput = false;
+    m_fFirstByteUs = 0;
+    m_bFirstByte = false;
+    m_fBytesPerPixel = 0;
+    m_bBytesPerPixel = false;
+
+    m_nDownloads.store(0, std::memory_order_relaxed);
+}
+
+MapFetchPlan PlanMapFetch(const MapRequestKey& key, const MapBandwidthEstimate& estimate,
+    const MapAdaptivePolicy& policy)
+{
+    MapFetchPlan plan;
+
+    if (key.IsTile() || key.width <= 0 || key.height <= 0)
+    {
+        return plan;
+    }
+
+    plan.fFullMs = estimate.PredictMs((uint64_t)key.width * (uint64_t)key.height);
+
+    // an unmeasured link is assumed fast, and a map that will be here soon
+    // enough needs no stand-in
+    if (!policy.bEnabled || !estimate.bValid || plan.fFullMs <= (double)policy.nTargetFirstMapMs)
+    {
+        return plan;
+    }
+
+    // the largest preview that arrives in time, or failing that the smallest there is
+    int nHalvings = 0;
+    double fPreviewMs = plan.fFullMs;
+
+    for (int nTry = 1; nTry <= policy.nMaxPreviewHalvings; nTry++)
+    {
+        int nWidth = key.width >> nTry;
+        int nHeight = key.height >> nTry;
+
+        if (std::min(nWidth, nHeight) < policy.nMinPreviewSide)
+        {
+            break;
+        }
+
+        nHalvings = nTry;
+        fPreviewMs = estimate.PredictMs((uint64_t)nWidth * (uint64_t)nHeight);
+
+        if (fPreviewMs <= (double)policy.nTargetFirstMapMs)
+        {
+            break;
+        }
+    }
+
+    // when the wait is mostly latency, a smaller map wouldn't come much
+    // sooner, and would only add a request
+    if (0 == nHalvings || fPreviewMs > plan.fFullMs * policy.fMaxPreviewFraction)
+    {
+        return plan;
+    }
+
+    plan.bPreview = true;
+    plan.nHalvings = nHalvings;
+    plan.fPreviewMs = fPreviewMs;
+    plan.previewKey = key;
+    plan.previewKey.width = key.width >> nHalvings;
+    plan.previewKey.height = key.height >> nHalvings;
+
+    return plan;
+}
+
+MapImageHandle ScaleMapPreview(const MapImageHandle& hPreview, int nWidth, int nHeight)
+{
+    if (!hPreview)
+    {
+        return MapImageHandle();
+    }
+
+    if (hPreview->Width() == nWidth && hPreview->Height() == nHeight)
+    {
+        return hPreview;
+    }
+
+    std::shared_ptr<MapImage> pScaled = MapImage::Create(nWidth, nHeight);
+
+    if (!pScaled)
+    {
+        return MapImageHandle();
+    }
+
+    // enlarging, Lanczos would only sharpen the JPEG's blocks
+    ScaleImage(PixelBufferOf(*hPreview), PixelBufferOf(*pScaled), ScaleFilter::BILINEAR);
+
+    return pScaled;
+}
+
+std::string FormatBandwidthEstimate(const MapBandwidthEstimate& estimate)
+{
+    if (!estimate.bValid)
+    {
+        return "Link not measured yet.\n";
+    }
+
+    char szLine[256];
+
+    snprintf(szLine, sizeof(szLine), "Link: %.1f KB/s, first byte %.1f ms, %.3f bytes a pixel.\n",
+        estimate.fBytesPerSecond / 1024.0, estimate.fFirstByteMs, estimate.fBytesPerPixel);
+
+    return szLine;
+}
@@ -0,0 +1,127 @@
+// MapAdaptiveFetch.h : Choosing what size of map to download first.
+//
+// A map used to be downloaded at the size its location asks for, however
+// slow the link.  On a link of a few hundred kilobits a second an 800 x 500
+// map takes seconds to arrive, and there is nothing on screen until it has.
+//
+// MapBandwidthEstimator learns the link from every download's read loop:
+// how many bytes arrived in how long, how long the first byte took, and how
+// many bytes a pixel of JPEG comes to.  PlanMapFetch uses that to predict
+// how long the map asked for will take.  If it would be longer than the
+// policy's target, it plans a preview first: the same map at a half or a
+// quarter of the size, which is a quarter or a sixteenth of the bytes.
+// The preview is scaled up to the full size and shown at once, and the
+// full map is downloaded behind it and replaces it when it arrives.
+//
+// Bing Maps fits a location to the map it is asked for, a whole zoom level
+// at a time, so a map half the size shows the same view one level out.
+// That is why previews are only ever halvings.  Tiles have a fixed size,
+// and the tile layer already stands in scaled tiles from other levels for
+// missing ones, so tiles are never previewed.
+//
+// A link that hasn't been measured yet is assumed fast, so nothing changes
+// until there is a reason to.
+//
+// MapAdaptiveFetch has no Windows dependencies.
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+#include "MapBitmapStore.h"
+#include "MapRequest.h"
+
+// when to download a preview first, and how small it may be
+struct MapAdaptivePolicy
+{
+    bool        bEnabled = true;
+    unsigned    nTargetFirstMapMs = 300;        // something should be on screen by then
+    int         nMinPreviewSide = 100;          // the shorter side of the smallest preview, in pixels
+    int         nMaxPreviewHalvings = 2;        // a quarter of the size, a sixteenth of the bytes
+    double      fMaxPreviewFraction = 0.5;      // a preview must take at most this much of the full map's time
+};
+
+// what MapBandwidthEstimator has learned about the link
+struct MapBandwidthEstimate
+{
+    bool        bValid = false;                 // there has been a download big enough to measure
+    double      fBytesPerSecond = 0;            // while a body is arriving
+    double      fFirstByteMs = 0;               // from sending a request to its headers
+    double      fBytesPerPixel = 0;             // of the JPEGs downloaded so far
+
+    // how long a JPEG of nPixels should take to download, in milliseconds
+    double PredictMs(uint64_t nPixels) const;
+};
+
+// what to download for a map
+struct MapFetchPlan
+{
+    bool            bPreview = false;           // download previewKey first
+    MapRequestKey   previewKey;                 // the same view, smaller
+    int             nHalvings = 0;              // previewKey is 1 / 2^nHalvings the size
+    double          fFullMs = 0;                // the predicted download time of the map asked for
+    double          fPreviewMs = 0;             // and of the preview
+};
+
+// learns the link from the downloads' read loops.  Safe from any thread.
+class MapBandwidthEstimator
+{
+public:
+    // a body smaller than this arrives in one read, which says more about
+    // the latency than the throughput
+    static const uint64_t kMinThroughputSampleBytes = 16 * 1024;
+
+    // how much each download counts for against the ones before it
+    static constexpr double kSmoothing = 0.25;
+
+    MapBandwidthEstimator();
+
+    MapBandwidthEstimator(const MapBandwidthEstimator&) = delete;
+    MapBandwidthEstimator& operator=(const MapBandwidthEstimator&) = delete;
+
+    // one download: nBytes of body read in nReadUs microseconds of reads,
+    // after waiting nFirstByteUs for the response, for a map of nPixels.
+    // nPixels may be 0 if it isn't known.
+    void Record(uint64_t nBytes, uint64_t nReadUs, uint64_t nFirstByteUs, uint64_t nPixels);
+
+    MapBandwidthEstimate Estimate() const;
+
+    // how many downloads it has seen
+    uint64_t Count() const { return m_nDownloads.load(std::memory_order_relaxed); }
+
+    // forget everything, for a link that has changed
+    void Reset();
+
+private:
+    mutable std::mutex      m_mutex;            // protects everything but m_nDownloads
+
+    // smoothed averages of the bytes and read time of each big enough
+    // download.  Their ratio weights each download by its size, as the
+    // link saw it, where averaging each download's rate would let a small
+    // download count as much as a large one.
+    double                  m_fBytes;
+    double                  m_fReadUs;
+    bool                    m_bThroughput;
+
+    double                  m_fFirstByteUs;
+    bool                    m_bFirstByte;
+
+    double                  m_fBytesPerPixel;
+    bool                    m_bBytesPerPixel;
+
+    std::atomic<uint64_t>   m_nDownloads;
+};
+
+// what to download for key, a preview first if the map asked for would
+// take longer than the policy's target
+MapFetchPlan PlanMapFetch(const MapRequestKey& key, const MapBandwidthEstimate& estimate,
+    const MapAdaptivePolicy& policy);
+
+// hPreview scaled up to nWidth x nHeight to stand in for the full map, or
+// an empty handle if it can't be
+MapImageHandle ScaleMapPreview(const MapImageHandle& hPreview, int nWidth, int nHeight);
+
+// the estimate, one line, UTF-8
+std::string FormatBandwidthEstimate(const MapBandwidthEstimate& estimate);
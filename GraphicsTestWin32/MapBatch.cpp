@@ -0,0 +1,393 @@
+// MapBatch.cpp : Renders many maps to image files, without a window.
+//
+#include "MapBatch.h"
+
+#include <cstdio>
+#include <cwctype>
+#include <fstream>
+#include <unordered_set>
+
+#include "ImageScaler.h"
+#include "PixelBlit.h"
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    // what a worker hands from the fetch to the encode
+    struct MapBatchLoad
+    {
+        MapImageHandle  hImage;
+        MapBatchTimes   times;
+    };
+
+    // a location as part of a file name: letters and digits are kept, and
+    // anything else becomes a single underscore
+    std::wstring FileNamePart(const std::wstring& str)
+    {
+        std::wstring strPart;
+
+        for (wchar_t c : str)
+        {
+            if (iswalnum(c) || L'-' == c || c >= 0x80)
+            {
+                strPart += c;
+            }
+            else if (!strPart.empty() && L'_' != strPart.back())
+            {
+                strPart += L'_';
+            }
+        }
+
+        while (!strPart.empty() && L'_' == strPart.back())
+        {
+            strPart.pop_back();
+        }
+
+        return strPart.empty() ? std::wstring(L"map") : strPart;
+    }
+
+    std::wstring ToLower(const std::wstring& str)
+    {
+        std::wstring strLower(str);
+
+        for (wchar_t& c : strLower)
+        {
+            c = (wchar_t)towlower(c);
+        }
+
+        return strLower;
+    }
+
+    double Milliseconds(Clock::time_point start, Clock::time_point end)
+    {
+        return std::chrono::duration<double, std::milli>(end - start).count();
+    }
+
+    const char* StatusName(MapFetchStatus status)
+    {
+        return (MapFetchStatus::CANCELLED == status) ? "cancelled" : "failed";
+    }
+}
+
+const char* MapBatchStageName(MapBatchStage stage)
+{
+    switch (stage)
+    {
+    case MapBatchStage::FETCH:  return "fetch";
+    case MapBatchStage::DECODE: return "decode";
+    case MapBatchStage::SCALE:  return "scale";
+    case MapBatchStage::ENCODE: return "encode";
+    case MapBatchStage::WRITE:  return "write";
+    default:                    return "total";
+    }
+}
+
+std::vector<MapBatchItem> PlanMapBatch(const std::vector<MapLocation>& locations,
+    const std::filesystem::path& outputDirectory, MapImageFormat format)
+{
+    std::vector<MapBatchItem> items;
+    std::unordered_set<MapRequestKey, MapRequestKeyHash> keys;
+    std::unordered_set<std::wstring> names;
+
+    std::wstring strExtension = Utf8ToWide(MapImageFormatName(format));
+
+    for (const MapLocation& location : locations)
+    {
+        if (items.size() >= kMaxMapBatchItems)
+        {
+            break;
+        }
+
+        // the same map twice would only be written twice
+        if (!keys.insert(location.key).second)
+        {
+            continue;
+        }
+
+        std::wstring strStem = FileNamePart(location.key.location) + L"_" +
+            std::to_wstring(location.key.width) + L"x" + std::to_wstring(location.key.height) + L"_" +
+            FileNamePart(location.key.imagerySet);
+
+        // Windows file names ignore case, so "seattle" and "Seattle" collide
+        std::wstring strName = strStem;
+
+        for (int n = 2; !names.insert(ToLower(strName)).second; n++)
+        {
+            strName = strStem + L"_" + std::to_wstring(n);
+        }
+
+        MapBatchItem item;
+        item.key = location.key;
+        item.output = outputDirectory / (strName + L"." + strExtension);
+
+        items.push_back(item);
+    }
+
+    return items;
+}
+
+MapBatchReport::MapBatchReport()
+    : m_nItems(0),
+      m_nWorkers(0),
+      m_format(MapImageFormat::PNG),
+      m_nSucceeded(0),
+      m_nDownloadBytes(0),
+      m_nOutputBytes(0)
+{
+}
+
+void MapBatchReport::Start(size_t nItems, unsigned nWorkers, MapImageFormat format)
+{
+    m_nItems = nItems;
+    m_nWorkers = nWorkers;
+    m_format = format;
+
+    for (MetricHistogram& histogram : m_stages)
+    {
+        histogram.Reset();
+    }
+
+    m_nSucceeded = 0;
+    m_nDownloadBytes = 0;
+    m_nOutputBytes = 0;
+    m_failures.clear();
+
+    m_start = m_end = Clock::now();
+}
+
+void MapBatchReport::Record(const MapBatchItem& item, MapFetchStatus status, const MapBatchTimes& times)
+{
+    if (MapFetchStatus::SUCCEEDED != status)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        m_failures.push_back({ item.key, status, times.failedStage });
+        return;
+    }
+
+    double fTotal = 0;
+
+    for (size_t i = 0; i < kTotal; i++)
+    {
+        m_stages[i].Record((uint64_t)(times.milliseconds[i] * 1000.0));
+        fTotal += times.milliseconds[i];
+    }
+
+    m_stages[kTotal].Record((uint64_t)(fTotal * 1000.0));
+
+    m_nDownloadBytes.fetch_add(times.nDownloadBytes, std::memory_order_relaxed);
+    m_nOutputBytes.fetch_add(times.nOutputBytes, std::memory_order_relaxed);
+    m_nSucceeded.fetch_add(1, std::memory_order_relaxed);
+}
+
+void MapBatchReport::Finish()
+{
+    m_end = Clock::now();
+}
+
+size_t MapBatchReport::Failed() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    return m_failures.size();
+}
+
+double MapBatchReport::WallSeconds() const
+{
+    return std::chrono::duration<double>(m_end - m_start).count();
+}
+
+double MapBatchReport::MapsPerSecond() const
+{
+    double fSeconds = WallSeconds();
+
+    return (fSeconds > 0) ? Succeeded() / fSeconds : 0.0;
+}
+
+std::string MapBatchReport::Format() const
+{
+    char szLine[512];
+
+    snprintf(szLine, sizeof(szLine),
+        "Rendered %zu of %zu maps to %s in %.2f s on %u workers, %.1f maps/s\n",
+        Succeeded(), m_nItems, MapImageFormatName(m_format), WallSeconds(), m_nWorkers, MapsPerSecond());
+
+    std::string report(szLine);
+
+    snprintf(szLine, sizeof(szLine), "Fetched %.1f MB, wrote %.1f MB\n\n",
+        m_nDownloadBytes.load() / 1048576.0, m_nOutputBytes.load() / 1048576.0);
+    report += szLine;
+
+    snprintf(szLine, sizeof(szLine), "%-8s %9s %9s %9s %9s %9s\n", "ms", "mean", "p50", "p90", "p99", "max");
+    report += szLine;
+
+    for (size_t i = 0; i <= kTotal; i++)
+    {
+        MetricHistogram::Snapshot snapshot = m_stages[i].TakeSnapshot();
+
+        snprintf(szLine, sizeof(szLine), "%-8s %9.2f %9.2f %9.2f %9.2f %9.2f\n",
+            MapBatchStageName((MapBatchStage)i), snapshot.Mean() / 1000.0,
+            snapshot.ValueAtPercentile(50) / 1000.0, snapshot.ValueAtPercentile(90) / 1000.0,
+            snapshot.ValueAtPercentile(99) / 1000.0, snapshot.nMax / 1000.0);
+        report += szLine;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (!m_failures.empty())
+    {
+        snprintf(szLine, sizeof(szLine), "\n%zu maps failed:\n", m_failures.size());
+        report += szLine;
+
+        for (const Failure& failure : m_failures)
+        {
+            snprintf(szLine, sizeof(szLine), "    %-9s at %-6s  %s\n", StatusName(failure.status),
+                MapBatchStageName(failure.stage), failure.key.ToCanonicalString().c_str());
+            report += szLine;
+        }
+    }
+
+    return report;
+}
+
+std::string MapBatchReport::ToJson() const
+{
+    char szBuffer[512];
+
+    snprintf(szBuffer, sizeof(szBuffer),
+        "{\"maps\":%zu,\"succeeded\":%zu,\"failed\":%zu,\"format\":\"%s\",\"workers\":%u,"
+        "\"seconds\":%.3f,\"maps_per_second\":%.2f,\"download_bytes\":%llu,\"output_bytes\":%llu,\"stages\":{",
+        m_nItems, Succeeded(), Failed(), MapImageFormatName(m_format), m_nWorkers, WallSeconds(),
+        MapsPerSecond(), (unsigned long long)m_nDownloadBytes.load(), (unsigned long long)m_nOutputBytes.load());
+
+    std::string json(szBuffer);
+
+    for (size_t i = 0; i <= kTotal; i++)
+    {
+        MetricHistogram::Snapshot snapshot = m_stages[i].TakeSnapshot();
+
+        snprintf(szBuffer, sizeof(szBuffer),
+            "%s\"%s\":{\"mean_ms\":%.3f,\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f}",
+            (i > 0) ? "," : "", MapBatchStageName((MapBatchStage)i), snapshot.Mean() / 1000.0,
+            snapshot.ValueAtPercentile(50) / 1000.0, snapshot.ValueAtPercentile(90) / 1000.0,
+            snapshot.ValueAtPercentile(99) / 1000.0, snapshot.nMax / 1000.0);
+        json += szBuffer;
+    }
+
+    json += "}}\n";
+
+    return json;
+}
+
+void RunMapBatch(const std::vector<MapBatchItem>& items, const MapBatchLoader& loader,
+    MapImageFormat format, const MapBatchEncoder& encoder, unsigned nWorkers, MapBatchReport& report,
+    std::function<void()> onThreadStart, std::function<void()> onThreadStop)
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t nCompleted = 0;
+
+    // runs on a worker thread: fetch and decode
+    auto fetcher = [&](const MapRequestKey& key, const MapFetchCancelToken& token, MapBatchLoad& loadOut)
+    {
+        return loader(key, token, loadOut.hImage, loadOut.times);
+    };
+
+    // runs on the same worker thread: encode and write the map.  Request
+    // ids start at 1 and go up by one for each Submit, so they index items.
+    auto onComplete = [&](MapFetchCompletion<MapBatchLoad>&& completion)
+    {
+        const MapBatchItem& item = items[completion.requestId - 1];
+        MapBatchTimes& times = completion.result.times;
+        MapFetchStatus status = completion.status;
+
+        if (MapFetchStatus::SUCCEEDED == status && !completion.result.hImage)
+        {
+            times.failedStage = MapBatchStage::DECODE;
+            status = MapFetchStatus::FAILED;
+        }
+
+        if (MapFetchStatus::SUCCEEDED == status)
+        {
+            MapImageHandle hImage = completion.result.hImage;
+            Clock::time_point start = Clock::now();
+
+            // the worker pool is already as wide as the machine, so the
+            // scale runs on this thread alone
+            if (!item.key.IsTile() && (hImage->Width() != item.key.width || hImage->Height() != item.key.height))
+            {
+                std::shared_ptr<MapImage> pScaled = MapImage::Create(item.key.width, item.key.height);
+
+                if (pScaled)
+                {
+                    ScaleImage(PixelBufferOf(*hImage), PixelBufferOf(*pScaled), ScaleFilter::LANCZOS3, 1);
+                    hImage = pScaled;
+                }
+                else
+                {
+                    times.failedStage = MapBatchStage::SCALE;
+                    status = MapFetchStatus::FAILED;
+                }
+            }
+
+            std::vector<uint8_t> data;
+            Clock::time_point scaled = Clock::now();
+            times.milliseconds[(size_t)MapBatchStage::SCALE] = Milliseconds(start, scaled);
+
+            if (MapFetchStatus::SUCCEEDED == status && !encoder(*hImage, data))
+            {
+                times.failedStage = MapBatchStage::ENCODE;
+                status = MapFetchStatus::FAILED;
+            }
+
+            Clock::time_point encoded = Clock::now();
+            times.milliseconds[(size_t)MapBatchStage::ENCODE] = Milliseconds(scaled, encoded);
+
+            if (MapFetchStatus::SUCCEEDED == status && !WriteMapBatchFile(item.output, data))
+            {
+                times.failedStage = MapBatchStage::WRITE;
+                status = MapFetchStatus::FAILED;
+            }
+
+            times.milliseconds[(size_t)MapBatchStage::WRITE] = Milliseconds(encoded, Clock::now());
+            times.nOutputBytes = data.size();
+
+            // the maps aren't needed once they are written
+            hImage.reset();
+            completion.result.hImage.reset();
+        }
+
+        report.Record(item, status, times);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        nCompleted++;
+        cv.notify_one();
+    };
+
+    report.Start(items.size(), nWorkers, format);
+
+    {
+        MapFetchQueue<MapBatchLoad> queue(fetcher, onComplete, nWorkers, onThreadStart, onThreadStop);
+
+        for (const MapBatchItem& item : items)
+        {
+            queue.Submit(item.key);
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]() { return nCompleted >= items.size(); });
+    }
+
+    report.Finish();
+}
+
+bool WriteMapBatchFile(const std::filesystem::path& path, const std::vector<uint8_t>& data)
+{
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+
+    file.write(reinterpret_cast<const char*>(data.data()), (std::streamsize)data.size());
+    file.close();
+
+    return !file.fail();
+}
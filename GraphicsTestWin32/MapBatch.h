@@ -0,0 +1,161 @@
+// MapBatch.h : Renders many maps to image files, without a window.
+//
+// A batch run reads a manifest of maps, in the same format as the
+// locations file (see MapLocations.h), fetches and decodes them on a pool
+// of worker threads, encodes each one as PNG, JPEG or BMP and writes it to
+// an output directory.  The Windows program does this for /batch, with
+// WinInet and WIC.  MapRender does it on Linux against a MockMapServer, to
+// generate thumbnails and measure how many maps a second the pipeline can
+// turn out.
+//
+// PlanMapBatch names the output files.  RunMapBatch drives the workers,
+// through a MapFetchQueue, and times every stage of every map into a
+// MapBatchReport: fetching the map (downloading it, or finding it in a
+// cache), decoding it, scaling it, encoding it and writing it out.  Where
+// the fetch and decode can't be told apart, as with WIC decoding a map
+// while it downloads, the decode is counted as part of the fetch.  A map
+// that comes back at a size other than the one asked for, as the
+// MockMapServer's recorded maps do, is scaled to that size with the
+// Lanczos filter, so every file is the size its manifest line says.
+//
+// MapBatch has no Windows dependencies.
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "ImageEncoder.h"
+#include "MapBitmapStore.h"
+#include "MapFetchQueue.h"
+#include "MapLocations.h"
+#include "MapMetrics.h"
+#include "MapRequest.h"
+
+// the most maps one batch may have
+const size_t kMaxMapBatchItems = 1000000;
+
+// one map to render, and where to write it
+struct MapBatchItem
+{
+    MapRequestKey           key;
+    std::filesystem::path   output;
+};
+
+// the stages a map goes through
+enum class MapBatchStage
+{
+    FETCH,
+    DECODE,
+    SCALE,
+    ENCODE,
+    WRITE,
+
+    COUNT
+};
+
+// "fetch", "decode", "scale", "encode" or "write", and "total" for COUNT
+const char* MapBatchStageName(MapBatchStage stage);
+
+// how one map went.  The loader fills in the fetch and decode, and
+// RunMapBatch the rest.
+struct MapBatchTimes
+{
+    double          milliseconds[(size_t)MapBatchStage::COUNT] = {};
+    uint64_t        nDownloadBytes = 0;     // the encoded map as fetched, if known
+    uint64_t        nOutputBytes = 0;       // the file written
+    MapBatchStage   failedStage = MapBatchStage::FETCH;
+};
+
+// one output file for each distinct map in locations, named for its
+// location, size and imagery set, such as Mount_Rainier_1024x768_Aerial.png,
+// in outputDirectory.  Names that would collide, ignoring case, are
+// numbered.
+std::vector<MapBatchItem> PlanMapBatch(const std::vector<MapLocation>& locations,
+    const std::filesystem::path& outputDirectory, MapImageFormat format);
+
+class MapBatchReport
+{
+public:
+    MapBatchReport();
+
+    MapBatchReport(const MapBatchReport&) = delete;
+    MapBatchReport& operator=(const MapBatchReport&) = delete;
+
+    // begin timing a batch of nItems maps on nWorkers threads
+    void Start(size_t nItems, unsigned nWorkers, MapImageFormat format);
+
+    // one map has finished, one way or another.  Safe from any thread.
+    void Record(const MapBatchItem& item, MapFetchStatus status, const MapBatchTimes& times);
+
+    // stop the clock
+    void Finish();
+
+    size_t Succeeded() const { return m_nSucceeded.load(std::memory_order_relaxed); }
+    size_t Failed() const;
+
+    double WallSeconds() const;
+
+    // maps written per second of wall-clock time
+    double MapsPerSecond() const;
+
+    // a summary, the percentiles of each stage, and the maps that failed,
+    // UTF-8
+    std::string Format() const;
+
+    // the same, for tools: {"maps":...,"maps_per_second":...,"stages":{...}}
+    std::string ToJson() const;
+
+private:
+    // m_stages' last histogram is the whole of each map
+    static const size_t kTotal = (size_t)MapBatchStage::COUNT;
+
+    struct Failure
+    {
+        MapRequestKey   key;
+        MapFetchStatus  status;
+        MapBatchStage   stage;
+    };
+
+    size_t                                  m_nItems;
+    unsigned                                m_nWorkers;
+    MapImageFormat                          m_format;
+    std::chrono::steady_clock::time_point   m_start;
+    std::chrono::steady_clock::time_point   m_end;
+
+    // the time each map that succeeded spent in each stage, in microseconds
+    MetricHistogram                         m_stages[kTotal + 1];
+    std::atomic<size_t>                     m_nSucceeded;
+    std::atomic<uint64_t>                   m_nDownloadBytes;
+    std::atomic<uint64_t>                   m_nOutputBytes;
+
+    mutable std::mutex                      m_mutex;    // protects m_failures
+    std::vector<Failure>                    m_failures;
+};
+
+// fetch and decode one map into imageOut, timing both in timesOut, and
+// setting its failedStage if it fails.  Runs on the worker threads.
+typedef std::function<bool(const MapRequestKey& key, const MapFetchCancelToken& token,
+    MapImageHandle& imageOut, MapBatchTimes& timesOut)> MapBatchLoader;
+
+// encode a map in the batch's format.  Runs on the worker threads, so it
+// must be thread safe.
+typedef std::function<bool(const MapImage& image, std::vector<uint8_t>& dataOut)> MapBatchEncoder;
+
+// render every item on nWorkers threads, recording each into report, and
+// return once they have all been written or have failed.  The output
+// directories must already exist.  onThreadStart and onThreadStop are
+// called on each worker as it starts and stops, e.g. for CoInitializeEx.
+void RunMapBatch(const std::vector<MapBatchItem>& items, const MapBatchLoader& loader,
+    MapImageFormat format, const MapBatchEncoder& encoder, unsigned nWorkers, MapBatchReport& report,
+    std::function<void()> onThreadStart = nullptr, std::function<void()> onThreadStop = nullptr);
+
+// write data to path, replacing whatever is there.  Returns false if it
+// couldn't all be written.
+bool WriteMapBatchFile(const std::filesystem::path& path, const std::vector<uint8_t>& data);
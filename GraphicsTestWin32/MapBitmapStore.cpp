@@ -0,0 +1,150 @@
+// MapBitmapStore.cpp : An in-memory store of decoded maps, keyed by request.
+//
+#include "MapBitmapStore.h"
+
+MapBitmapStore::MapBitmapStore(size_t nBudgetBytes)
+    : m_nBudgetBytes(nBudgetBytes),
+      m_nTotalBytes(0),
+      m_nHits(0),
+      m_nMisses(0),
+      m_nEvictions(0)
+{
+}
+
+MapImageHandle MapBitmapStore::Find(const MapRequestKey& key)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto found = m_index.find(key);
+
+    if (found == m_index.end())
+    {
+        m_nMisses++;
+        return MapImageHandle();
+    }
+
+    m_nHits++;
+    m_lru.splice(m_lru.begin(), m_lru, found->second);
+
+    return found->second->second;
+}
+
+bool MapBitmapStore::Contains(const MapRequestKey& key) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    return m_index.find(key) != m_index.end();
+}
+
+void MapBitmapStore::Insert(const MapRequestKey& key, MapImageHandle hImage)
+{
+    if (!hImage)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto found = m_index.find(key);
+
+    if (found != m_index.end())
+    {
+        m_nTotalBytes -= found->second->second->ByteSize();
+        found->second->second = hImage;
+        m_lru.splice(m_lru.begin(), m_lru, found->second);
+    }
+    else
+    {
+        m_lru.emplace_front(key, hImage);
+        m_index[key] = m_lru.begin();
+    }
+
+    m_nTotalBytes += hImage->ByteSize();
+
+    EvictLocked(hImage);
+}
+
+void MapBitmapStore::Remove(const MapRequestKey& key)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto found = m_index.find(key);
+
+    if (found != m_index.end())
+    {
+        m_nTotalBytes -= found->second->second->ByteSize();
+        m_lru.erase(found->second);
+        m_index.erase(found);
+    }
+}
+
+void MapBitmapStore::Clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_index.clear();
+    m_lru.clear();
+    m_nTotalBytes = 0;
+}
+
+void MapBitmapStore::SetBudget(size_t nBudgetBytes)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_nBudgetBytes = nBudgetBytes;
+
+    EvictLocked(MapImageHandle());
+}
+
+size_t MapBitmapStore::Budget() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_nBudgetBytes;
+}
+
+size_t MapBitmapStore::TotalBytes() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_nTotalBytes;
+}
+
+size_t MapBitmapStore::Count() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_lru.size();
+}
+
+MapStoreStats MapBitmapStore::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    MapStoreStats stats;
+    stats.nHits = m_nHits;
+    stats.nMisses = m_nMisses;
+    stats.nEvictions = m_nEvictions;
+    stats.nCount = m_lru.size();
+    stats.nTotalBytes = m_nTotalBytes;
+    stats.nBudgetBytes = m_nBudgetBytes;
+
+    return stats;
+}
+
+void MapBitmapStore::EvictLocked(const MapImageHandle& hKeep)
+{
+    // the store only gives up its own reference.  Anyone still holding a
+    // handle to an evicted map keeps it alive until they let go.
+    while (m_nTotalBytes > m_nBudgetBytes && !m_lru.empty())
+    {
+        const Entry& oldest = m_lru.back();
+
+        if (oldest.second == hKeep)
+        {
+            break;
+        }
+
+        m_nTotalBytes -= oldest.second->ByteSize();
+        m_index.erase(oldest.first);
+        m_lru.pop_back();
+        m_nEvictions++;
+    }
+}
@@ -0,0 +1,95 @@
+// MapBitmapStore.h : An in-memory store of decoded maps, keyed by request.
+//
+// This replaces the one-HBITMAP-per-city globals.  Any number of maps can
+// be held, up to a byte budget; when the budget is exceeded the least
+// recently used maps are dropped.  Maps are handed out as reference-counted
+// MapImageHandles, so a map that is on screen stays valid even if the store
+// evicts it in the meantime.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+#include "MapImage.h"
+#include "MapRequest.h"
+
+typedef std::shared_ptr<const MapImage> MapImageHandle;
+
+// how well a store is doing, for MapBitmapStore and MapCompressedStore
+struct MapStoreStats
+{
+    uint64_t    nHits = 0;          // Find calls that found their map
+    uint64_t    nMisses = 0;
+    uint64_t    nEvictions = 0;     // maps dropped to stay within the budget
+    size_t      nCount = 0;
+    size_t      nTotalBytes = 0;
+    size_t      nBudgetBytes = 0;
+
+    // the fraction of Find calls that hit, 0 if there were none
+    double HitRate() const
+    {
+        uint64_t nLookups = nHits + nMisses;
+        return (nLookups > 0) ? (double)nHits / (double)nLookups : 0.0;
+    }
+};
+
+class MapBitmapStore
+{
+public:
+    // enough for a few dozen full-size static maps
+    static const size_t kDefaultBudgetBytes = 64 * 1024 * 1024;
+
+    explicit MapBitmapStore(size_t nBudgetBytes = kDefaultBudgetBytes);
+
+    MapBitmapStore(const MapBitmapStore&) = delete;
+    MapBitmapStore& operator=(const MapBitmapStore&) = delete;
+
+    // return the map for key, or an empty handle.  A hit makes the map the
+    // most recently used.
+    MapImageHandle Find(const MapRequestKey& key);
+
+    // true if the map for key is in the store.  Does not affect LRU order.
+    bool Contains(const MapRequestKey& key) const;
+
+    // add or replace the map for key, then evict to stay within the budget.
+    // The newly inserted map is never evicted by its own insertion.
+    void Insert(const MapRequestKey& key, MapImageHandle hImage);
+
+    // drop the map for key
+    void Remove(const MapRequestKey& key);
+
+    // drop every map
+    void Clear();
+
+    void SetBudget(size_t nBudgetBytes);
+
+    size_t Budget() const;
+    size_t TotalBytes() const;
+    size_t Count() const;
+
+    MapStoreStats GetStats() const;
+
+private:
+    typedef std::pair<MapRequestKey, MapImageHandle> Entry;
+    typedef std::list<Entry> EntryList;
+
+    void EvictLocked(const MapImageHandle& hKeep);
+
+    size_t                  m_nBudgetBytes;
+    size_t                  m_nTotalBytes;
+
+    // most recently used at the front
+    EntryList               m_lru;
+    std::unordered_map<MapRequestKey, EntryList::iterator, MapRequestKeyHash> m_index;
+
+    uint64_t                m_nHits;
+    uint64_t                m_nMisses;
+    uint64_t                m_nEvictions;
+
+    mutable std::mutex      m_mutex;
+};
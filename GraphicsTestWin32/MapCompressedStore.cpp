@@ -0,0 +1,152 @@
+// MapCompressedStore.cpp : An in-memory store of downloaded map files,
+// keyed by request.
+//
+#include "MapCompressedStore.h"
+
+MapCompressedStore::MapCompressedStore(size_t nBudgetBytes)
+    : m_nBudgetBytes(nBudgetBytes),
+      m_nTotalBytes(0),
+      m_nHits(0),
+      m_nMisses(0),
+      m_nEvictions(0)
+{
+}
+
+MapBytesHandle MapCompressedStore::Find(const MapRequestKey& key)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto found = m_index.find(key);
+
+    if (found == m_index.end())
+    {
+        m_nMisses++;
+        return MapBytesHandle();
+    }
+
+    m_nHits++;
+    m_lru.splice(m_lru.begin(), m_lru, found->second);
+
+    return found->second->second;
+}
+
+bool MapCompressedStore::Contains(const MapRequestKey& key) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    return m_index.find(key) != m_index.end();
+}
+
+void MapCompressedStore::Insert(const MapRequestKey& key, const uint8_t* pData, size_t nSize)
+{
+    if (!pData || 0 == nSize)
+    {
+        return;
+    }
+
+    // copied outside the lock
+    MapBytesHandle hBytes = std::make_shared<const std::vector<uint8_t>>(pData, pData + nSize);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto found = m_index.find(key);
+
+    if (found != m_index.end())
+    {
+        m_nTotalBytes -= found->second->second->size();
+        found->second->second = hBytes;
+        m_lru.splice(m_lru.begin(), m_lru, found->second);
+    }
+    else
+    {
+        m_lru.emplace_front(key, hBytes);
+        m_index[key] = m_lru.begin();
+    }
+
+    m_nTotalBytes += nSize;
+
+    EvictLocked(hBytes);
+}
+
+void MapCompressedStore::Remove(const MapRequestKey& key)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto found = m_index.find(key);
+
+    if (found != m_index.end())
+    {
+        m_nTotalBytes -= found->second->second->size();
+        m_lru.erase(found->second);
+        m_index.erase(found);
+    }
+}
+
+void MapCompressedStore::Clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_index.clear();
+    m_lru.clear();
+    m_nTotalBytes = 0;
+}
+
+void MapCompressedStore::SetBudget(size_t nBudgetBytes)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_nBudgetBytes = nBudgetBytes;
+
+    EvictLocked(MapBytesHandle());
+}
+
+size_t MapCompressedStore::Budget() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_nBudgetBytes;
+}
+
+size_t MapCompressedStore::TotalBytes() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_nTotalBytes;
+}
+
+size_t MapCompressedStore::Count() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_lru.size();
+}
+
+MapStoreStats MapCompressedStore::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    MapStoreStats stats;
+    stats.nHits = m_nHits;
+    stats.nMisses = m_nMisses;
+    stats.nEvictions = m_nEvictions;
+    stats.nCount = m_lru.size();
+    stats.nTotalBytes = m_nTotalBytes;
+    stats.nBudgetBytes = m_nBudgetBytes;
+
+    return stats;
+}
+
+void MapCompressedStore::EvictLocked(const MapBytesHandle& hKeep)
+{
+    while (m_nTotalBytes > m_nBudgetBytes && !m_lru.empty())
+    {
+        const Entry& oldest = m_lru.back();
+
+        if (oldest.second == hKeep)
+        {
+            break;
+        }
+
+        m_nTotalBytes -= oldest.second->size();
+        m_index.erase(oldest.first);
+        m_lru.pop_back();
+        m_nEvictions++;
+    }
+}
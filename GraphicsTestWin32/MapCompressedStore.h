@@ -0,0 +1,84 @@
+// MapCompressedStore.h : An in-memory store of downloaded map files, keyed
+// by request.
+//
+// The JPEG Bing Maps sends is a small fraction of the size of the decoded
+// map: about 60 KB for the 800x500 Seattle map against 1.6 MB decoded.
+// This keeps the files themselves, up to a byte budget, so that thousands
+// of maps can stay in memory and be decoded again when they are wanted.
+// When the budget is exceeded the least recently used files are dropped.
+// Files are handed out as reference-counted MapBytesHandles, so one being
+// decoded stays valid even if the store evicts it in the meantime.
+//
+// MapCompressedStore has no Windows dependencies.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "MapBitmapStore.h"
+#include "MapRequest.h"
+
+typedef std::shared_ptr<const std::vector<uint8_t>> MapBytesHandle;
+
+class MapCompressedStore
+{
+public:
+    // about a thousand static maps, or three thousand tiles
+    static const size_t kDefaultBudgetBytes = 64 * 1024 * 1024;
+
+    explicit MapCompressedStore(size_t nBudgetBytes = kDefaultBudgetBytes);
+
+    MapCompressedStore(const MapCompressedStore&) = delete;
+    MapCompressedStore& operator=(const MapCompressedStore&) = delete;
+
+    // return the file for key, or an empty handle.  A hit makes the file
+    // the most recently used.
+    MapBytesHandle Find(const MapRequestKey& key);
+
+    // true if the file for key is in the store.  Does not affect LRU order.
+    bool Contains(const MapRequestKey& key) const;
+
+    // add or replace the file for key, copying nSize bytes from pData,
+    // then evict to stay within the budget.  The newly inserted file is
+    // never evicted by its own insertion.
+    void Insert(const MapRequestKey& key, const uint8_t* pData, size_t nSize);
+
+    // drop the file for key
+    void Remove(const MapRequestKey& key);
+
+    // drop every file
+    void Clear();
+
+    void SetBudget(size_t nBudgetBytes);
+
+    size_t Budget() const;
+    size_t TotalBytes() const;
+    size_t Count() const;
+
+    MapStoreStats GetStats() const;
+
+private:
+    typedef std::pair<MapRequestKey, MapBytesHandle> Entry;
+    typedef std::list<Entry> EntryList;
+
+    void EvictLocked(const MapBytesHandle& hKeep);
+
+    size_t                  m_nBudgetBytes;
+    size_t                  m_nTotalBytes;
+
+    // most recently used at the front
+    EntryList               m_lru;
+    std::unordered_map<MapRequestKey, EntryList::iterator, MapRequestKeyHash> m_index;
+
+    uint64_t                m_nHits;
+    uint64_t                m_nMisses;
+    uint64_t                m_nEvictions;
+
+    mutable std::mutex      m_mutex;
+};
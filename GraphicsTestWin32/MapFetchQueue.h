@@ -0,0 +1,262 @@
+// MapFetchQueue.h : Fetches and decodes maps on background worker threads.
+//
+// The UI thread submits MapRequestKeys and goes straight back to its
+// message loop.  Worker threads call the fetcher, which downloads and
+// decodes the map, and hand the result to the completion callback.  The
+// Windows program's callback posts the result back to the UI thread as a
+// window message; the queue itself knows nothing about windows, so it can
+// be driven by a fake fetcher on any platform.
+//
+// Requests can be cancelled while queued, in which case they never reach
+// the fetcher, or while running, in which case the fetcher sees its cancel
+// token set and is expected to give up as soon as it can.
+//
+// The worker threads are a MapScheduler's.  A queue can have one to
+// itself, or share one with other queues, each submitting at its own
+// priority, so that the maps the user is waiting for go ahead of
+// prefetches and revalidation.  A queued request can be moved to another
+// priority with Reprioritize.
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "MapRequest.h"
+#include "MapScheduler.h"
+
+enum class MapFetchStatus
+{
+    SUCCEEDED,      // the fetcher produced a result
+    FAILED,         // the fetcher reported an error
+    CANCELLED,      // the request was cancelled before or while it ran
+};
+
+// what the completion callback receives for every submitted request
+template <typename TResult>
+struct MapFetchCompletion
+{
+    uint64_t        requestId;
+    MapRequestKey   key;
+    MapFetchStatus  status;
+
+    // valid when status is SUCCEEDED.  A fetcher that finished just as it
+    // was cancelled may still have produced a result, so the callback owns
+    // whatever is here regardless of status.
+    TResult         result;
+};
+
+template <typename TResult>
+class MapFetchQueue
+{
+public:
+    // downloads and decodes one map into resultOut.  Returns false on failure.
+    typedef std::function<bool(const MapRequestKey& key, const MapFetchCancelToken& token, TResult& resultOut)> Fetcher;
+
+    // called on a worker thread once for every submitted request
+    typedef std::function<void(MapFetchCompletion<TResult>&& completion)> CompletionCallback;
+
+    // called on each worker thread as it starts and stops, e.g. for CoInitializeEx
+    typedef MapScheduler::ThreadHook ThreadHook;
+
+    // a queue with nWorkers threads of its own
+    MapFetchQueue(Fetcher fetcher, CompletionCallback onComplete, unsigned int nWorkers = 2,
+        ThreadHook onThreadStart = nullptr, ThreadHook onThreadStop = nullptr)
+        : m_pOwnScheduler(new MapScheduler(nWorkers, std::move(onThreadStart), std::move(onThreadStop))),
+          m_scheduler(*m_pOwnScheduler),
+          m_priority(MapPriority::VISIBLE),
+          m_fetcher(std::move(fetcher)),
+          m_onComplete(std::move(onComplete)),
+          m_bShutdown(false)
+    {
+    }
+
+    // a queue on a scheduler shared with others, submitting at priority
+    // unless told otherwise.  The scheduler must outlive the queue.
+    MapFetchQueue(MapScheduler& scheduler, MapPriority priority, Fetcher fetcher, CompletionCallback onComplete)
+        : m_scheduler(scheduler),
+          m_priority(priority),
+          m_fetcher(std::move(fetcher)),
+          m_onComplete(std::move(onComplete)),
+          m_bShutdown(false)
+    {
+    }
+
+    ~MapFetchQueue()
+    {
+        Shutdown();
+    }
+
+    MapFetchQueue(const MapFetchQueue&) = delete;
+    MapFetchQueue& operator=(const MapFetchQueue&) = delete;
+
+    // queue a request and return its id, or 0 if the queue is shut down
+    uint64_t Submit(const MapRequestKey& key)
+    {
+        return Submit(key, m_priority);
+    }
+
+    // the same, at another priority than the queue's own
+    uint64_t Submit(const MapRequestKey& key, MapPriority priority)
+    {
+        // held until the request is in m_pending, so that it can't finish
+        // before it is there
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (m_bShutdown)
+        {
+            return 0;
+        }
+
+        uint64_t requestId = m_scheduler.Submit(priority,
+            [this, key](uint64_t jobId, const MapFetchCancelToken& token)
+            {
+                TResult result = TResult();
+
+                bool bSucceeded = m_fetcher(key, token, result);
+
+                MapFetchStatus status = token.IsCancelled() ? MapFetchStatus::CANCELLED :
+                    (bSucceeded ? MapFetchStatus::SUCCEEDED : MapFetchStatus::FAILED);
+
+                Complete(jobId, key, status, std::move(result));
+            },
+            [this, key](uint64_t jobId)
+            {
+                Complete(jobId, key, MapFetchStatus::CANCELLED, TResult());
+            });
+
+        if (0 != requestId)
+        {
+            m_pending.insert(requestId);
+        }
+
+        return requestId;
+    }
+
+    // move a queued request to another priority, e.g. a tile that has
+    // scrolled into view.  Returns false if it has already started.
+    bool Reprioritize(uint64_t requestId, MapPriority priority)
+    {
+        if (!IsPending(requestId))
+        {
+            return false;
+        }
+
+        return m_scheduler.Reprioritize(requestId, priority);
+    }
+
+    // cancel one request.  Returns false if it has already completed.
+    bool Cancel(uint64_t requestId)
+    {
+        if (!IsPending(requestId))
+        {
+            return false;
+        }
+
+        // a queued request completes on this thread, outside the lock,
+        // so the callback can call back into the queue
+        return m_scheduler.Cancel(requestId);
+    }
+
+    // cancel every queued and running request, e.g. when the user moves on
+    void CancelAll()
+    {
+        std::vector<uint64_t> requestIds;
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            requestIds.assign(m_pending.begin(), m_pending.end());
+        }
+
+        // oldest first, as they were queued
+        std::sort(requestIds.begin(), requestIds.end());
+
+        for (uint64_t requestId : requestIds)
+        {
+            m_scheduler.Cancel(requestId);
+        }
+    }
+
+    // cancel everything and wait for the running requests to finish.
+    // Completion callbacks for running requests are made before this
+    // returns.  A queue with its own threads waits for them to exit.
+    void Shutdown()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            if (m_bShutdown)
+            {
+                return;
+            }
+
+            m_bShutdown = true;
+        }
+
+        CancelAll();
+
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_idle.wait(lock, [this] { return m_pending.empty(); });
+        }
+
+        if (m_pOwnScheduler)
+        {
+            m_pOwnScheduler->Shutdown();
+        }
+    }
+
+    // the number of requests queued or running
+    size_t PendingCount() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_pending.size();
+    }
+
+private:
+    bool IsPending(uint64_t requestId) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_pending.count(requestId) != 0;
+    }
+
+    // hand the result to the callback, then forget the request
+    void Complete(uint64_t requestId, const MapRequestKey& key, MapFetchStatus status, TResult&& result)
+    {
+        if (m_onComplete)
+        {
+            MapFetchCompletion<TResult> completion{ requestId, key, status, std::move(result) };
+            m_onComplete(std::move(completion));
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        m_pending.erase(requestId);
+
+        if (m_pending.empty())
+        {
+            m_idle.notify_all();
+        }
+    }
+
+    // declared first, so it is made before m_scheduler refers to it
+    std::unique_ptr<MapScheduler> m_pOwnScheduler;
+    MapScheduler&           m_scheduler;
+    MapPriority             m_priority;
+
+    Fetcher                 m_fetcher;
+    CompletionCallback      m_onComplete;
+
+    // the requests submitted that haven't completed
+    std::unordered_set<uint64_t> m_pending;
+    bool                    m_bShutdown;
+
+    mutable std::mutex      m_mutex;
+    std::condition_variable m_idle;
+};
@@ -0,0 +1,70 @@
+// MapImage.cpp : A decoded map, held as 32bpp BGRX pixels.
+//
+#include "MapImage.h"
+
+#include <new>
+
+namespace
+{
+    // Bing Maps static maps are at most 2000 x 1500, and tile compositions
+    // are bounded by the window size, so anything past this is a bad header
+    const int kMaxImageDimension = 16384;
+}
+
+std::shared_ptr<MapImage> MapImage::Create(int nWidth, int nHeight)
+{
+    if (nWidth <= 0 || nHeight <= 0 || nWidth > kMaxImageDimension || nHeight > kMaxImageDimension)
+    {
+        return nullptr;
+    }
+
+    size_t nStride = (size_t)nWidth * 4;
+
+    std::unique_ptr<uint8_t[]> pStorage(new (std::nothrow) uint8_t[nStride * (size_t)nHeight]);
+
+    if (!pStorage)
+    {
+        return nullptr;
+    }
+
+    return std::shared_ptr<MapImage>(new MapImage(nWidth, nHeight, nStride, std::move(pStorage)));
+}
+
+std::shared_ptr<const MapImage> MapImage::Wrap(int nWidth, int nHeight, const uint8_t* pPixels, size_t nSize,
+    std::shared_ptr<const void> pOwner)
+{
+    if (nWidth <= 0 || nHeight <= 0 || nWidth > kMaxImageDimension || nHeight > kMaxImageDimension ||
+        nullptr == pPixels)
+    {
+        return nullptr;
+    }
+
+    size_t nStride = (size_t)nWidth * 4;
+
+    if (nStride * (size_t)nHeight > nSize)
+    {
+        return nullptr;
+    }
+
+    // the image is only ever const, so the pixels are never written
+    return std::shared_ptr<const MapImage>(new MapImage(nWidth, nHeight, nStride,
+        const_cast<uint8_t*>(pPixels), std::move(pOwner)));
+}
+
+MapImage::MapImage(int nWidth, int nHeight, size_t nStride, std::unique_ptr<uint8_t[]> pStorage)
+    : m_nWidth(nWidth),
+      m_nHeight(nHeight),
+      m_nStride(nStride),
+      m_pStorage(std::move(pStorage)),
+      m_pPixels(m_pStorage.get())
+{
+}
+
+MapImage::MapImage(int nWidth, int nHeight, size_t nStride, uint8_t* pPixels, std::shared_ptr<const void> pOwner)
+    : m_nWidth(nWidth),
+      m_nHeight(nHeight),
+      m_nStride(nStride),
+      m_pOwner(std::move(pOwner)),
+      m_pPixels(pPixels)
+{
+}
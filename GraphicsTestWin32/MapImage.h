@@ -0,0 +1,59 @@
+// MapImage.h : A decoded map, held as 32bpp BGRX pixels.
+//
+// The layout is the one CreateDIBSection and SetDIBitsToDevice expect for
+// a top-down 32bpp DIB: rows of width * 4 bytes, blue first, the fourth
+// byte unused.  Since 32bpp rows are always DWORD aligned the stride is
+// exactly DIB_WIDTHBYTES(width * 32).
+//
+// The pixels are usually the image's own, but can belong to something
+// else that the image keeps alive, such as a memory-mapped file in the
+// DecodedMapCache, so a map can be painted from the file with no copy.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+class MapImage
+{
+public:
+    // allocate an image of the given size.  Returns nullptr if the size
+    // is unreasonable or the memory could not be allocated.
+    static std::shared_ptr<MapImage> Create(int nWidth, int nHeight);
+
+    // an image of the nSize bytes at pPixels, which pOwner keeps valid for
+    // as long as the image lives.  The pixels may be read-only, so the
+    // image is only handed out const.  Returns nullptr if the size is
+    // unreasonable or the rows don't fit in nSize bytes.
+    static std::shared_ptr<const MapImage> Wrap(int nWidth, int nHeight, const uint8_t* pPixels, size_t nSize,
+        std::shared_ptr<const void> pOwner);
+
+    MapImage(const MapImage&) = delete;
+    MapImage& operator=(const MapImage&) = delete;
+
+    int Width() const { return m_nWidth; }
+    int Height() const { return m_nHeight; }
+
+    // bytes from the start of one row to the start of the next
+    size_t Stride() const { return m_nStride; }
+
+    // the total number of pixel bytes, used for cache budgets
+    size_t ByteSize() const { return m_nStride * (size_t)m_nHeight; }
+
+    uint8_t* Pixels() { return m_pPixels; }
+    const uint8_t* Pixels() const { return m_pPixels; }
+
+    uint8_t* Row(int y) { return m_pPixels + (size_t)y * m_nStride; }
+    const uint8_t* Row(int y) const { return m_pPixels + (size_t)y * m_nStride; }
+
+private:
+    MapImage(int nWidth, int nHeight, size_t nStride, std::unique_ptr<uint8_t[]> pStorage);
+    MapImage(int nWidth, int nHeight, size_t nStride, uint8_t* pPixels, std::shared_ptr<const void> pOwner);
+
+    int                         m_nWidth;
+    int                         m_nHeight;
+    size_t                      m_nStride;
+    std::unique_ptr<uint8_t[]>  m_pStorage;     // our own pixels, or empty
+    std::shared_ptr<const void> m_pOwner;       // or whatever holds someone else's
+    uint8_t*                    m_pPixels;
+};
@@ -0,0 +1,180 @@
+// MapLocations.cpp : The list of maps the user can choose from.
+//
+#include "MapLocations.h"
+
+#include <cstdlib>
+#include <fstream>
+
+namespace
+{
+    // trim spaces and tabs from both ends
+    std::string Trim(const std::string& str)
+    {
+        size_t first = str.find_first_not_of(" \t\r\n");
+
+        if (first == std::string::npos)
+        {
+            return std::string();
+        }
+
+        size_t last = str.find_last_not_of(" \t\r\n");
+
+        return str.substr(first, last - first + 1);
+    }
+
+    // split a line on commas, trimming each field
+    std::vector<std::string> SplitFields(const std::string& line)
+    {
+        std::vector<std::string> fields;
+        size_t start = 0;
+
+        for (;;)
+        {
+            size_t comma = line.find(',', start);
+
+            fields.push_back(Trim(line.substr(start, comma - start)));
+
+            if (comma == std::string::npos)
+            {
+                break;
+            }
+
+            start = comma + 1;
+        }
+
+        return fields;
+    }
+
+    bool ParseInt(const std::string& str, int nMin, int nMax, int& nOut)
+    {
+        if (str.empty())
+        {
+            return false;
+        }
+
+        char* pEnd = nullptr;
+        long n = strtol(str.c_str(), &pEnd, 10);
+
+        if (*pEnd != '\0' || n < nMin || n > nMax)
+        {
+            return false;
+        }
+
+        nOut = (int)n;
+        return true;
+    }
+
+    bool ParseDouble(const std::string& str, double dMin, double dMax, double& dOut)
+    {
+        if (str.empty())
+        {
+            return false;
+        }
+
+        char* pEnd = nullptr;
+        double d = strtod(str.c_str(), &pEnd);
+
+        if (*pEnd != '\0' || !(d >= dMin && d <= dMax))
+        {
+            return false;
+        }
+
+        dOut = d;
+        return true;
+    }
+}
+
+std::vector<MapLocation> DefaultMapLocations()
+{
+    std::vector<MapLocation> locations;
+
+    locations.push_back(MapLocation(L"Seattle",
+        MapRequestKey(DEFAULT_IMAGERY_SET, L"Seattle", 800, 500), 47.6062, -122.3321));
+    locations.push_back(MapLocation(L"Portland",
+        MapRequestKey(DEFAULT_IMAGERY_SET, L"Portland", 600, 600), 45.5152, -122.6784));
+    locations.push_back(MapLocation(L"San Francisco",
+        MapRequestKey(DEFAULT_IMAGERY_SET, L"San Francisco", 500, 400), 37.7749, -122.4194));
+
+    return locations;
+}
+
+bool LoadMapLocations(const std::filesystem::path& path, std::vector<MapLocation>& locationsOut,
+    size_t nMaxLocations)
+{
+    std::ifstream in(path, std::ios::binary);
+
+    if (!in)
+    {
+        return false;
+    }
+
+    std::vector<MapLocation> locations;
+    std::string line;
+    bool bFirstLine = true;
+
+    while (std::getline(in, line) && locations.size() < nMaxLocations)
+    {
+        // skip a UTF-8 byte order mark, Notepad likes to add one
+        if (bFirstLine && line.size() >= 3 && line.compare(0, 3, "\xEF\xBB\xBF") == 0)
+        {
+            line.erase(0, 3);
+        }
+
+        bFirstLine = false;
+
+        line = Trim(line);
+
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+
+        std::vector<std::string> fields = SplitFields(line);
+
+        if (fields.size() < 3 || fields[0].empty())
+        {
+            continue;
+        }
+
+        // Bing Maps static maps are at most 2000 x 1500
+        MapLocation location;
+        location.displayName = Utf8ToWide(fields[0]);
+        location.key.location = location.displayName;
+
+        if (!ParseInt(fields[1], 80, 2000, location.key.width) ||
+            !ParseInt(fields[2], 80, 1500, location.key.height))
+        {
+            continue;
+        }
+
+        if (fields.size() >= 4 && !fields[3].empty())
+        {
+            location.key.imagerySet = Utf8ToWide(fields[3]);
+        }
+
+        // a location without good coordinates still works as a static map
+        if (fields.size() >= 6 &&
+            ParseDouble(fields[4], -90, 90, location.latitude) &&
+            ParseDouble(fields[5], -180, 180, location.longitude))
+        {
+            location.hasCoordinates = true;
+
+            if (fields.size() >= 7 &&
+                !ParseInt(fields[6], TileSystem::kMinLevel, TileSystem::kMaxLevel, location.tileLevel))
+            {
+                location.tileLevel = kDefaultTileLevel;
+            }
+        }
+
+        locations.push_back(location);
+    }
+
+    if (locations.empty())
+    {
+        return false;
+    }
+
+    locationsOut.swap(locations);
+
+    return true;
+}
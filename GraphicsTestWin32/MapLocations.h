@@ -0,0 +1,63 @@
+// MapLocations.h : The list of maps the user can choose from.
+//
+// The program starts with the three cities it has always offered.  A
+// locations file can replace them with any number of others, one map per
+// line:
+//
+//      # location, width, height [, imagery set [, latitude, longitude [, level]]]
+//      Seattle, 800, 500
+//      Portland, 600, 600, Road
+//      Mount Rainier, 1024, 768, Aerial, 46.8523, -121.7603, 11
+//
+// The file is UTF-8.  Blank lines and lines starting with # are ignored.
+// A location can only be shown on the tiled map if it has a latitude and
+// longitude.  The imagery set may be left empty to give them.
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "MapRequest.h"
+#include "TileSystem.h"
+
+// the name of the locations file, looked for next to the executable
+#define MAP_LOCATIONS_FILE L"locations.txt"
+
+// the most locations we'll put on the menu
+const size_t kMaxMapLocations = 2000;
+
+// the tiled map's level of detail when a location doesn't give one
+const int kDefaultTileLevel = 12;
+
+struct MapLocation
+{
+    std::wstring    displayName;    // the text on the menu
+    MapRequestKey   key;            // the map to request
+    bool            hasCoordinates; // false if the tiled map can't show it
+    double          latitude;       // the center of the tiled map
+    double          longitude;
+    int             tileLevel;      // the tiled map's level of detail
+
+    MapLocation()
+        : hasCoordinates(false), latitude(0), longitude(0), tileLevel(kDefaultTileLevel)
+    {
+    }
+
+    MapLocation(const std::wstring& strDisplayName, const MapRequestKey& mapKey,
+        double dLatitude, double dLongitude, int nTileLevel = kDefaultTileLevel)
+        : displayName(strDisplayName), key(mapKey), hasCoordinates(true),
+          latitude(dLatitude), longitude(dLongitude), tileLevel(nTileLevel)
+    {
+    }
+};
+
+// Seattle, Portland and San Francisco, at their traditional sizes
+std::vector<MapLocation> DefaultMapLocations();
+
+// read a locations file, up to nMaxLocations of them.  Malformed lines are
+// skipped.  Returns false if the file can't be read or contains no valid
+// locations, in which case locationsOut is left alone.  A batch manifest
+// (see MapBatch.h) is read with a higher limit than the menu's.
+bool LoadMapLocations(const std::filesystem::path& path, std::vector<MapLocation>& locationsOut,
+    size_t nMaxLocations = kMaxMapLocations);
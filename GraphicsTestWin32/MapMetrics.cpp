@@ -0,0 +1,427 @@
+// MapMetrics.cpp : Where the time goes between asking for a map and seeing it.
+//
+#include "MapMetrics.h"
+
+#include <cinttypes>
+#include <cstdarg>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+
+namespace
+{
+    // the position of the highest set bit of a non-zero value
+    int HighestBit(uint64_t nValue)
+    {
+        int nBit = 0;
+
+        for (int nShift = 32; nShift > 0; nShift >>= 1)
+        {
+            if (nValue >> nShift)
+            {
+                nValue >>= nShift;
+                nBit += nShift;
+            }
+        }
+
+        return nBit;
+    }
+
+    // the Prometheus bucket bounds: 1, 2.5 and 5 to each power of ten.
+    // Times are from 100us to 50s, counts and bytes from 1 to 500 million.
+    std::vector<double> BucketBounds(MetricUnit unit)
+    {
+        double fLowest = (MetricUnit::MICROSECONDS == unit) ? 1e-4 : 1.0;
+        double fHighest = (MetricUnit::MICROSECONDS == unit) ? 50.0 : 5e8;
+
+        std::vector<double> bounds;
+
+        for (double fDecade = fLowest; fDecade <= fHighest * 1.001; fDecade *= 10.0)
+        {
+            bounds.push_back(fDecade);
+
+            if (MetricUnit::MICROSECONDS == unit)
+            {
+                bounds.push_back(fDecade * 2.5);
+            }
+            else
+            {
+                // counts are whole numbers, 2.5 chunks is no bound at all
+                bounds.push_back(fDecade * 2.0);
+            }
+
+            bounds.push_back(fDecade * 5.0);
+        }
+
+        return bounds;
+    }
+
+    const char* UnitName(MetricUnit unit)
+    {
+        switch (unit)
+        {
+        case MetricUnit::MICROSECONDS:  return "us";
+        case MetricUnit::BYTES:         return "bytes";
+        default:                        return "count";
+        }
+    }
+
+    void AppendFormat(std::string& str, const char* pszFormat, ...)
+    {
+        char szBuffer[512];
+
+        va_list args;
+        va_start(args, pszFormat);
+        int nLength = vsnprintf(szBuffer, sizeof(szBuffer), pszFormat, args);
+        va_end(args);
+
+        if (nLength > 0)
+        {
+            str.append(szBuffer, (size_t)nLength < sizeof(szBuffer) ? (size_t)nLength : sizeof(szBuffer) - 1);
+        }
+    }
+
+    // the same order as MapMetric
+    const MapMetricInfo g_metricInfo[] =
+    {
+        { "url_build",          MetricUnit::MICROSECONDS,   "Time to build the request URL." },
+        { "connect",            MetricUnit::MICROSECONDS,   "TCP connect time, new connections only." },
+        { "tls_handshake",      MetricUnit::MICROSECONDS,   "TLS handshake time, new connections only." },
+        { "first_byte",         MetricUnit::MICROSECONDS,   "Time from sending the request to the first byte of the response." },
+        { "read",               MetricUnit::MICROSECONDS,   "Time spent in InternetReadFile reading one map." },
+        { "read_chunks",        MetricUnit::COUNT,          "Reads it took to download one map." },
+        { "read_size",          MetricUnit::BYTES,          "Bytes downloaded for one map." },
+        { "buffer_assembly",    MetricUnit::MICROSECONDS,   "Time spent growing and committing the download buffer for one map." },
+        { "decode",             MetricUnit::MICROSECONDS,   "Time to create the decoder and read the frame header." },
+        { "format_convert",     MetricUnit::MICROSECONDS,   "Time to set up the conversion to 32bpp BGR." },
+        { "copy_pixels",        MetricUnit::MICROSECONDS,   "Time in CopyPixels, where the pixels are decoded and converted." },
+        { "decode_tail",        MetricUnit::MICROSECONDS,   "Time from the last byte arriving to the map being decoded." },
+        { "download",           MetricUnit::MICROSECONDS,   "Time to download and decode one map from the network." },
+        { "cache_decode",       MetricUnit::MICROSECONDS,   "Time to decode one map from the disk cache." },
+        { "shared_cache_read",  MetricUnit::MICROSECONDS,   "Time to copy one map out of the shared memory cache." },
+        { "decoded_cache_map",  MetricUnit::MICROSECONDS,   "Time to map one map's pixels from the decoded map cache." },
+        { "compose",            MetricUnit::MICROSECONDS,   "Time to compose the back buffer for one paint." },
+        { "present",            MetricUnit::MICROSECONDS,   "Time to BitBlt the back buffer to the screen for one paint." },
+    };
+
+    static_assert(sizeof(g_metricInfo) / sizeof(g_metricInfo[0]) == (size_t)MapMetric::COUNT,
+        "a MapMetric has no MapMetricInfo");
+}
+
+double MetricHistogram::Snapshot::Mean() const
+{
+    return (nCount > 0) ? (double)nSum / (double)nCount : 0.0;
+}
+
+uint64_t MetricHistogram::Snapshot::ValueAtPercentile(double fPercentile) const
+{
+    if (0 == nCount)
+    {
+        return 0;
+    }
+
+    if (fPercentile < 0.0)
+    {
+        fPercentile = 0.0;
+    }
+
+    if (fPercentile > 100.0)
+    {
+        fPercentile = 100.0;
+    }
+
+    // the rank of the value wanted, counting from 1
+    uint64_t nRank = (uint64_t)std::ceil(fPercentile / 100.0 * (double)nCount);
+
+    if (nRank < 1)
+    {
+        nRank = 1;
+    }
+
+    uint64_t nSeen = 0;
+
+    for (size_t i = 0; i < counts.size(); i++)
+    {
+        nSeen += counts[i];
+
+        if (nSeen >= nRank)
+        {
+            // the top of the bucket, but never past the largest value seen
+            uint64_t nValue = BucketHighest(i);
+            return (nValue < nMax) ? nValue : nMax;
+        }
+    }
+
+    return nMax;
+}
+
+uint64_t MetricHistogram::Snapshot::CountAtOrBelow(uint64_t nValue) const
+{
+    uint64_t nTotal = 0;
+
+    for (size_t i = 0; i < counts.size() && BucketHighest(i) <= nValue; i++)
+    {
+        nTotal += counts[i];
+    }
+
+    return nTotal;
+}
+
+MetricHistogram::MetricHistogram()
+{
+    Reset();
+}
+
+void MetricHistogram::Record(uint64_t nValue)
+{
+    m_counts[BucketIndex(nValue)].fetch_add(1, std::memory_order_relaxed);
+    m_nSum.fetch_add(nValue, std::memory_order_relaxed);
+
+    uint64_t nMin = m_nMin.load(std::memory_order_relaxed);
+
+    while (nValue < nMin && !m_nMin.compare_exchange_weak(nMin, nValue, std::memory_order_relaxed))
+    {
+    }
+
+    uint64_t nMax = m_nMax.load(std::memory_order_relaxed);
+
+    while (nValue > nMax && !m_nMax.compare_exchange_weak(nMax, nValue, std::memory_order_relaxed))
+    {
+    }
+}
+
+MetricHistogram::Snapshot MetricHistogram::TakeSnapshot() const
+{
+    Snapshot snapshot;
+
+    snapshot.counts.resize(kBucketCount);
+
+    uint64_t nBucketTotal = 0;
+
+    for (size_t i = 0; i < kBucketCount; i++)
+    {
+        snapshot.counts[i] = m_counts[i].load(std::memory_order_relaxed);
+        nBucketTotal += snapshot.counts[i];
+    }
+
+    // the buckets are what the percentiles are worked out from, so the
+    // count is what they hold
+    snapshot.nCount = nBucketTotal;
+    snapshot.nSum = m_nSum.load(std::memory_order_relaxed);
+
+    if (nBucketTotal > 0)
+    {
+        snapshot.nMin = m_nMin.load(std::memory_order_relaxed);
+        snapshot.nMax = m_nMax.load(std::memory_order_relaxed);
+    }
+
+    return snapshot;
+}
+
+void MetricHistogram::Reset()
+{
+    for (size_t i = 0; i < kBucketCount; i++)
+    {
+        m_counts[i].store(0, std::memory_order_relaxed);
+    }
+
+    m_nSum.store(0, std::memory_order_relaxed);
+    m_nMin.store(UINT64_MAX, std::memory_order_relaxed);
+    m_nMax.store(0, std::memory_order_relaxed);
+}
+
+size_t MetricHistogram::BucketIndex(uint64_t nValue)
+{
+    const uint64_t nLargest = ((uint64_t)1 << kMaxValueBits) - 1;
+
+    if (nValue > nLargest)
+    {
+        nValue = nLargest;
+    }
+
+    if (nValue < (uint64_t)kSubBucketCount)
+    {
+        return (size_t)nValue;
+    }
+
+    // keep the top kSubBucketBits + 1 bits of the value.  Each power of
+    // two past the first gets kSubBucketCount more buckets.
+    int nShift = HighestBit(nValue) - kSubBucketBits;
+
+    return ((size_t)nShift << kSubBucketBits) + (size_t)(nValue >> nShift);
+}
+
+uint64_t MetricHistogram::BucketLowest(size_t nIndex)
+{
+    if (nIndex < 2 * (size_t)kSubBucketCount)
+    {
+        return nIndex;
+    }
+
+    int nShift = (int)(nIndex >> kSubBucketBits) - 1;
+    uint64_t nMantissa = nIndex - ((size_t)nShift << kSubBucketBits);
+
+    return nMantissa << nShift;
+}
+
+uint64_t MetricHistogram::BucketHighest(size_t nIndex)
+{
+    if (nIndex < 2 * (size_t)kSubBucketCount)
+    {
+        return nIndex;
+    }
+
+    int nShift = (int)(nIndex >> kSubBucketBits) - 1;
+    uint64_t nMantissa = nIndex - ((size_t)nShift << kSubBucketBits);
+
+    return ((nMantissa + 1) << nShift) - 1;
+}
+
+const MapMetricInfo& GetMapMetricInfo(MapMetric metric)
+{
+    return g_metricInfo[(size_t)metric];
+}
+
+void MapMetrics::Record(MapMetric metric, uint64_t nValue)
+{
+    m_histograms[(size_t)metric].Record(nValue);
+}
+
+void MapMetrics::RecordMilliseconds(MapMetric metric, double fMilliseconds)
+{
+    if (fMilliseconds < 0.0)
+    {
+        fMilliseconds = 0.0;
+    }
+
+    Record(metric, (uint64_t)(fMilliseconds * 1000.0 + 0.5));
+}
+
+MapMetrics::Clock::time_point MapMetrics::RecordSince(MapMetric metric, Clock::time_point start)
+{
+    Clock::time_point now = Clock::now();
+
+    Record(metric, MicrosecondsBetween(start, now));
+
+    return now;
+}
+
+const MetricHistogram& MapMetrics::Histogram(MapMetric metric) const
+{
+    return m_histograms[(size_t)metric];
+}
+
+void MapMetrics::Reset()
+{
+    for (MetricHistogram& histogram : m_histograms)
+    {
+        histogram.Reset();
+    }
+}
+
+std::string MapMetrics::ToJson() const
+{
+    std::string json = "{\"metrics\":{";
+
+    for (size_t i = 0; i < (size_t)MapMetric::COUNT; i++)
+    {
+        const MapMetricInfo& info = g_metricInfo[i];
+        MetricHistogram::Snapshot snapshot = m_histograms[i].TakeSnapshot();
+
+        AppendFormat(json,
+            "%s\"%s\":{\"unit\":\"%s\",\"count\":%" PRIu64 ",\"sum\":%" PRIu64
+            ",\"min\":%" PRIu64 ",\"max\":%" PRIu64 ",\"mean\":%.1f"
+            ",\"p50\":%" PRIu64 ",\"p90\":%" PRIu64 ",\"p99\":%" PRIu64 ",\"p999\":%" PRIu64 "}",
+            (i > 0) ? "," : "", info.pszName, UnitName(info.unit),
+            snapshot.nCount, snapshot.nSum, snapshot.nMin, snapshot.nMax, snapshot.Mean(),
+            snapshot.ValueAtPercentile(50.0), snapshot.ValueAtPercentile(90.0),
+            snapshot.ValueAtPercentile(99.0), snapshot.ValueAtPercentile(99.9));
+    }
+
+    json += "}}\n";
+
+    return json;
+}
+
+std::string MapMetrics::ToPrometheus(const char* pszPrefix) const
+{
+    std::string text;
+
+    for (size_t i = 0; i < (size_t)MapMetric::COUNT; i++)
+    {
+        const MapMetricInfo& info = g_metricInfo[i];
+        MetricHistogram::Snapshot snapshot = m_histograms[i].TakeSnapshot();
+
+        bool bSeconds = (MetricUnit::MICROSECONDS == info.unit);
+
+        // Prometheus wants the unit in the name, and times in seconds
+        std::string strName = std::string(pszPrefix) + info.pszName +
+            (bSeconds ? "_seconds" : (MetricUnit::BYTES == info.unit) ? "_bytes" : "");
+
+        AppendFormat(text, "# HELP %s %s\n", strName.c_str(), info.pszHelp);
+        AppendFormat(text, "# TYPE %s histogram\n", strName.c_str());
+
+        for (double fBound : BucketBounds(info.unit))
+        {
+            // the bound in the units the histogram counts in
+            uint64_t nBound = (uint64_t)(bSeconds ? fBound * 1e6 + 0.5 : fBound);
+
+            AppendFormat(text, "%s_bucket{le=\"%g\"} %" PRIu64 "\n",
+                strName.c_str(), fBound, snapshot.CountAtOrBelow(nBound));
+        }
+
+        AppendFormat(text, "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", strName.c_str(), snapshot.nCount);
+
+        if (bSeconds)
+        {
+            AppendFormat(text, "%s_sum %.6f\n", strName.c_str(), (double)snapshot.nSum / 1e6);
+        }
+        else
+        {
+            AppendFormat(text, "%s_sum %" PRIu64 "\n", strName.c_str(), snapshot.nSum);
+        }
+
+        AppendFormat(text, "%s_count %" PRIu64 "\n", strName.c_str(), snapshot.nCount);
+    }
+
+    return text;
+}
+
+bool MapMetrics::Save(const std::filesystem::path& directory) const
+{
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+
+    bool bSaved = true;
+
+    const struct
+    {
+        const wchar_t*  pszFile;
+        std::string     strText;
+    } files[] =
+    {
+        { L"metrics.json", ToJson() },
+        { L"metrics.prom", ToPrometheus() },
+    };
+
+    for (const auto& file : files)
+    {
+        std::ofstream out(directory / file.pszFile, std::ios::binary | std::ios::trunc);
+
+        out.write(file.strText.data(), (std::streamsize)file.strText.size());
+
+        bSaved = bSaved && out.good();
+    }
+
+    return bSaved;
+}
+
+uint64_t MapMetrics::MicrosecondsBetween(Clock::time_point start, Clock::time_point end)
+{
+    if (end <= start)
+    {
+        return 0;
+    }
+
+    return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+}
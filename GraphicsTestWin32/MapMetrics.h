@@ -0,0 +1,175 @@
+// MapMetrics.h : Where the time goes between asking for a map and seeing it.
+//
+// Each stage of fetching, decoding and painting a map records how long it
+// took into a histogram of its own: building the URL, connecting, the TLS
+// handshake, waiting for the first byte, the read loop and how many chunks
+// and bytes it read, growing the download buffer, the decode, the format
+// conversion, CopyPixels, composing the back buffer and the BitBlt to the
+// screen.  One sample is recorded per map (or per paint), so the
+// percentiles are per map, and p99 says what the slowest maps spend where.
+//
+// The histograms are HDR-style: buckets are exact below 64 and then 32 to
+// every power of two, so any value is counted within about 3% of itself
+// and the whole range from a microsecond to days needs a fixed 1152
+// counters.  Recording is a handful of relaxed atomic adds, with no lock
+// and no allocation, so it can be left on in release builds and called
+// from any thread.
+//
+// The histograms can be written out as JSON, with percentiles worked out,
+// or as Prometheus text exposition format, with cumulative buckets.
+//
+// MapMetrics has no Windows dependencies.
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+// a histogram that any number of threads can record into at once
+class MetricHistogram
+{
+public:
+    // 2^kSubBucketBits buckets to each power of two
+    static constexpr int kSubBucketBits = 5;
+    static constexpr int kSubBucketCount = 1 << kSubBucketBits;
+
+    // values from 2^kMaxValueBits up are counted in the last bucket
+    static constexpr int kMaxValueBits = 40;
+
+    static constexpr size_t kBucketCount = (size_t)(kMaxValueBits - kSubBucketBits + 1) * kSubBucketCount;
+
+    // the histogram's counts at one moment
+    struct Snapshot
+    {
+        uint64_t                nCount = 0;
+        uint64_t                nSum = 0;
+        uint64_t                nMin = 0;
+        uint64_t                nMax = 0;
+        std::vector<uint64_t>   counts;     // kBucketCount of them
+
+        double Mean() const;
+
+        // the smallest value that fPercentile percent of the values are no
+        // greater than, give or take the width of its bucket.  0 if empty.
+        uint64_t ValueAtPercentile(double fPercentile) const;
+
+        // how many values were no greater than nValue.  A bucket only counts
+        // if all of it is no greater than nValue.
+        uint64_t CountAtOrBelow(uint64_t nValue) const;
+    };
+
+    MetricHistogram();
+
+    MetricHistogram(const MetricHistogram&) = delete;
+    MetricHistogram& operator=(const MetricHistogram&) = delete;
+
+    void Record(uint64_t nValue);
+
+    // the counts can change while they're being copied, so a snapshot taken
+    // while other threads record is only consistent to within those values
+    Snapshot TakeSnapshot() const;
+
+    // not safe while other threads record
+    void Reset();
+
+    // which bucket nValue is counted in
+    static size_t BucketIndex(uint64_t nValue);
+
+    // the smallest and largest values counted in bucket nIndex
+    static uint64_t BucketLowest(size_t nIndex);
+    static uint64_t BucketHighest(size_t nIndex);
+
+private:
+    std::atomic<uint64_t>   m_counts[kBucketCount];
+    std::atomic<uint64_t>   m_nSum;
+    std::atomic<uint64_t>   m_nMin;
+    std::atomic<uint64_t>   m_nMax;
+};
+
+// everything that is measured
+enum class MapMetric
+{
+    URL_BUILD,          // building the request URL
+    CONNECT,            // TCP connect, new connections only
+    TLS_HANDSHAKE,      // TLS handshake, new connections only
+    FIRST_BYTE,         // sending the request until the response starts
+    READ,               // inside InternetReadFile, over the whole read loop
+    READ_CHUNKS,        // how many reads a map took
+    READ_BYTES,         // how many bytes a map was
+    BUFFER_ASSEMBLY,    // growing and committing the download buffer
+    DECODE,             // creating the decoder and reading the frame header
+    FORMAT_CONVERT,     // setting up the conversion to 32bpp BGR
+    COPY_PIXELS,        // CopyPixels, where WIC actually decodes the pixels
+    DECODE_TAIL,        // from the last byte arriving to the map being decoded
+    DOWNLOAD,           // a whole GetBingMap that went to the network
+    CACHE_DECODE,       // decoding a map out of the disk cache
+    SHARED_CACHE_READ,  // copying a map out of the shared memory cache
+    DECODED_CACHE_MAP,  // mapping a map's pixels from the decoded map cache
+    COMPOSE,            // composing the back buffer in WM_PAINT
+    PRESENT,            // the BitBlt from the back buffer to the screen
+
+    COUNT
+};
+
+enum class MetricUnit
+{
+    MICROSECONDS,
+    COUNT,
+    BYTES,
+};
+
+struct MapMetricInfo
+{
+    const char*     pszName;    // lower case, for JSON keys and Prometheus names
+    MetricUnit      unit;
+    const char*     pszHelp;
+};
+
+const MapMetricInfo& GetMapMetricInfo(MapMetric metric);
+
+// a histogram for every MapMetric
+class MapMetrics
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    MapMetrics() = default;
+
+    MapMetrics(const MapMetrics&) = delete;
+    MapMetrics& operator=(const MapMetrics&) = delete;
+
+    void Record(MapMetric metric, uint64_t nValue);
+
+    // record a time measured elsewhere, like HttpRequestTiming's
+    void RecordMilliseconds(MapMetric metric, double fMilliseconds);
+
+    // record the time from start until now, and return now so the next
+    // stage can be timed from it
+    Clock::time_point RecordSince(MapMetric metric, Clock::time_point start);
+
+    const MetricHistogram& Histogram(MapMetric metric) const;
+
+    // not safe while other threads record
+    void Reset();
+
+    // {"metrics":{"url_build":{"unit":"us","count":...,"p99":...},...}}
+    std::string ToJson() const;
+
+    // Prometheus text exposition format.  Times are in seconds, as
+    // Prometheus expects, and every metric has the same fixed buckets
+    // for its unit so they can be aggregated across machines.
+    std::string ToPrometheus(const char* pszPrefix = "graphicstest_map_") const;
+
+    // write metrics.json and metrics.prom into directory, creating it if
+    // need be.  Returns false if either couldn't be written.
+    bool Save(const std::filesystem::path& directory) const;
+
+    static uint64_t MicrosecondsBetween(Clock::time_point start, Clock::time_point end);
+
+private:
+    MetricHistogram     m_histograms[(size_t)MapMetric::COUNT];
+};
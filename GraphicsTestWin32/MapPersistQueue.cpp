@@ -0,0 +1,135 @@
+// MapPersistQueue.cpp : Writing downloaded maps out to the caches on a
+// thread of their own.
+//
+#include "MapPersistQueue.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+
+MapPersistQueue::MapPersistQueue(size_t nMaxQueued)
+    : m_nMaxQueued(std::max<size_t>(nMaxQueued, 1))
+{
+    m_thread = std::thread(&MapPersistQueue::WriterLoop, this);
+}
+
+MapPersistQueue::~MapPersistQueue()
+{
+    Shutdown();
+}
+
+bool MapPersistQueue::Submit(const MapRequestKey& key, Write write)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (m_bShutdown)
+        {
+            m_stats.nRefused++;
+            return false;
+        }
+
+        auto queued = std::find_if(m_queue.begin(), m_queue.end(),
+            [&key](const Item& item) { return item.key == key; });
+
+        // the newer map, or newer validators, are what should be kept
+        if (queued != m_queue.end())
+        {
+            queued->write.swap(write);
+            m_stats.nReplaced++;
+            return true;
+        }
+
+        if (m_queue.size() >= m_nMaxQueued)
+        {
+            m_stats.nRefused++;
+            return false;
+        }
+
+        m_queue.push_back(Item{ key, std::move(write) });
+        m_stats.nQueued++;
+    }
+
+    m_cv.notify_one();
+
+    // the write it replaced, if any, lets go of its map here, outside the lock
+    return true;
+}
+
+void MapPersistQueue::Shutdown(std::chrono::milliseconds flushFor)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (m_bShutdown)
+        {
+            return;
+        }
+
+        m_bShutdown = true;
+        m_flushDeadline = Clock::now() + flushFor;
+    }
+
+    m_cv.notify_all();
+    m_thread.join();
+}
+
+size_t MapPersistQueue::QueuedCount() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_queue.size();
+}
+
+MapPersistQueue::Stats MapPersistQueue::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
+
+std::string MapPersistQueue::FormatStats() const
+{
+    Stats stats = GetStats();
+    char szStats[256];
+
+    snprintf(szStats, sizeof(szStats),
+        "Persist: %" PRIu64 " queued, %" PRIu64 " replaced, %" PRIu64 " written, %" PRIu64
+        " refused, %" PRIu64 " discarded at exit\n",
+        stats.nQueued, stats.nReplaced, stats.nWritten, stats.nRefused, stats.nDiscarded);
+
+    return szStats;
+}
+
+void MapPersistQueue::WriterLoop()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    for (;;)
+    {
+        m_cv.wait(lock, [this] { return m_bShutdown || !m_queue.empty(); });
+
+        // shutting down, and either done or out of time
+        if (m_bShutdown && (m_queue.empty() || Clock::now() >= m_flushDeadline))
+        {
+            std::deque<Item> discarded;
+
+            discarded.swap(m_queue);
+            m_stats.nDiscarded += discarded.size();
+
+            // the maps they hold are let go of outside the lock
+            lock.unlock();
+            return;
+        }
+
+        Item item = std::move(m_queue.front());
+        m_queue.pop_front();
+
+        lock.unlock();
+
+        item.write();
+        item = Item();
+
+        lock.lock();
+
+        m_stats.nWritten++;
+    }
+}
@@ -0,0 +1,100 @@
+// MapPersistQueue.h : Writing downloaded maps out to the caches on a
+// thread of their own.
+//
+// Once a map is downloaded and decoded, its JPEG goes to the disk cache
+// and the decoded map to the shared and decoded caches, which takes longer
+// than anything else left to do with it.  That used to be a PREFETCH job
+// on MapScheduler, so it competed with /prefetch for the same four
+// running jobs, and any writes still queued at exit were done as they
+// were cancelled, on the UI thread, while the window was being destroyed.
+//
+// MapPersistQueue has one writer thread and a queue with room for a fixed
+// number of maps.  A map queued again before it is written replaces the
+// write already queued for it, and when the queue is full a new map isn't
+// queued at all: the caches miss it, and it is downloaded again next time,
+// which is better than holding up the thread that downloaded it.  Shutdown
+// lets the writer carry on for a while to empty the queue, and then throws
+// away whatever it hasn't started.
+//
+// MapPersistQueue has no Windows dependencies.
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "MapRequest.h"
+
+class MapPersistQueue
+{
+public:
+    // writes one map out, on the writer thread
+    typedef std::function<void()> Write;
+
+    // a few seconds of downloads at full speed
+    static const size_t kDefaultMaxQueued = 64;
+
+    // what it has done so far
+    struct Stats
+    {
+        uint64_t    nQueued = 0;
+        uint64_t    nReplaced = 0;      // queued again before they were written
+        uint64_t    nWritten = 0;
+        uint64_t    nRefused = 0;       // the queue was full, or shut down
+        uint64_t    nDiscarded = 0;     // still queued when Shutdown gave up
+    };
+
+    explicit MapPersistQueue(size_t nMaxQueued = kDefaultMaxQueued);
+
+    // Shutdown with no time to flush, if it hasn't been called
+    ~MapPersistQueue();
+
+    MapPersistQueue(const MapPersistQueue&) = delete;
+    MapPersistQueue& operator=(const MapPersistQueue&) = delete;
+
+    // queue write for the map key, in place of any write for it that
+    // hasn't started.  Returns false, without queuing it, if the queue is
+    // full or shut down.
+    bool Submit(const MapRequestKey& key, Write write);
+
+    // refuse any more maps, let the writer go on emptying the queue for up
+    // to flushFor, throw away what it hasn't started by then, and wait for
+    // the write in progress to finish
+    void Shutdown(std::chrono::milliseconds flushFor = std::chrono::milliseconds(0));
+
+    // the maps queued and not yet being written
+    size_t QueuedCount() const;
+
+    Stats GetStats() const;
+
+    // the stats, one line, UTF-8
+    std::string FormatStats() const;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Item
+    {
+        MapRequestKey   key;
+        Write           write;
+    };
+
+    void WriterLoop();
+
+    size_t                  m_nMaxQueued;
+
+    mutable std::mutex      m_mutex;        // protects everything below but m_thread
+    std::condition_variable m_cv;
+    std::deque<Item>        m_queue;
+    bool                    m_bShutdown = false;
+    Clock::time_point       m_flushDeadline;
+    Stats                   m_stats;
+
+    std::thread             m_thread;
+};
@@ -0,0 +1,124 @@
+// MapPrefetch.cpp : Fetches every configured map at startup.
+//
+#include "MapPrefetch.h"
+
+#include <cstdio>
+
+std::vector<MapRequestKey> SelectPrefetchKeys(const std::vector<MapLocation>& locations,
+    size_t nBudgetBytes)
+{
+    std::vector<MapRequestKey> keys;
+    size_t nTotalBytes = 0;
+
+    for (const MapLocation& location : locations)
+    {
+        // a decoded map is 4 bytes a pixel
+        size_t nBytes = (size_t)location.key.width * (size_t)location.key.height * 4;
+
+        if (nTotalBytes + nBytes > nBudgetBytes)
+        {
+            break;
+        }
+
+        // the same map may be on the menu twice under different names
+        bool bDuplicate = false;
+
+        for (const MapRequestKey& key : keys)
+        {
+            if (key == location.key)
+            {
+                bDuplicate = true;
+                break;
+            }
+        }
+
+        if (!bDuplicate)
+        {
+            keys.push_back(location.key);
+            nTotalBytes += nBytes;
+        }
+    }
+
+    return keys;
+}
+
+MapPrefetchReport::MapPrefetchReport()
+    : m_nExpected(0)
+{
+}
+
+void MapPrefetchReport::Start(size_t nExpected)
+{
+    m_nExpected = nExpected;
+    m_entries.clear();
+    m_entries.reserve(nExpected);
+    m_start = m_end = std::chrono::steady_clock::now();
+}
+
+void MapPrefetchReport::Record(const MapRequestKey& key, MapFetchStatus status, double milliseconds)
+{
+    m_entries.push_back({ key, status, milliseconds });
+    m_end = std::chrono::steady_clock::now();
+}
+
+double MapPrefetchReport::WallMilliseconds() const
+{
+    return std::chrono::duration<double, std::milli>(m_end - m_start).count();
+}
+
+double MapPrefetchReport::SequentialMilliseconds() const
+{
+    double total = 0;
+
+    for (const Entry& entry : m_entries)
+    {
+        total += entry.milliseconds;
+    }
+
+    return total;
+}
+
+std::string MapPrefetchReport::Format() const
+{
+    size_t nSucceeded = 0;
+
+    for (const Entry& entry : m_entries)
+    {
+        if (MapFetchStatus::SUCCEEDED == entry.status)
+        {
+            nSucceeded++;
+        }
+    }
+
+    double wall = WallMilliseconds();
+    double sequential = SequentialMilliseconds();
+
+    char szLine[512];
+
+    snprintf(szLine, sizeof(szLine),
+        "Prefetched %zu of %zu maps in %.1f ms, %.1f ms one after another, %.2fx speedup\n",
+        nSucceeded, m_nExpected, wall, sequential, wall > 0 ? sequential / wall : 0.0);
+
+    std::string report(szLine);
+
+    for (const Entry& entry : m_entries)
+    {
+        const char* pszStatus = "ok";
+
+        if (MapFetchStatus::FAILED == entry.status)
+        {
+            pszStatus = "failed";
+        }
+        else if (MapFetchStatus::CANCELLED == entry.status)
+        {
+            pszStatus = "cancelled";
+        }
+
+        snprintf(szLine, sizeof(szLine), "    %9.1f ms  %-9s  %s\n",
+            entry.milliseconds, pszStatus, entry.key.ToCanonicalString().c_str());
+
+        report += szLine;
+    }
+
+    return report;
+}
@@ -0,0 +1,71 @@
+// MapPrefetch.h : Fetches every configured map at startup.
+//
+// When the program is started with /prefetch, the maps on the City menu are
+// downloaded and decoded in parallel on their own bounded pool of worker
+// threads, filling the MapBitmapStore before the user asks for any of them.
+// MapPrefetchReport times the whole batch and each map in it, so the time
+// the batch took can be compared with the time the same maps would have
+// taken one after another.
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "MapBitmapStore.h"
+#include "MapFetchQueue.h"
+#include "MapLocations.h"
+#include "MapRequest.h"
+
+// what a prefetch worker hands back: the map, and how long it took to
+// download and decode it, not counting time spent waiting in the queue
+struct MapPrefetchResult
+{
+    MapImageHandle  hMap;
+    double          milliseconds = 0;
+};
+
+// the static maps to prefetch: every location in menu order, stopping
+// before their decoded size would overflow nBudgetBytes, since maps
+// prefetched past that would only push earlier ones out of the store
+std::vector<MapRequestKey> SelectPrefetchKeys(const std::vector<MapLocation>& locations,
+    size_t nBudgetBytes);
+
+class MapPrefetchReport
+{
+public:
+    MapPrefetchReport();
+
+    // begin timing a batch of nExpected maps
+    void Start(size_t nExpected);
+
+    // one map of the batch has finished, one way or another
+    void Record(const MapRequestKey& key, MapFetchStatus status, double milliseconds);
+
+    // true once every map of the batch has been recorded
+    bool IsComplete() const { return m_entries.size() >= m_nExpected; }
+
+    // wall-clock time from Start to the last Record
+    double WallMilliseconds() const;
+
+    // the sum of the per-map times, roughly what fetching the maps one
+    // after another would have taken
+    double SequentialMilliseconds() const;
+
+    // a summary line followed by one line per map, UTF-8
+    std::string Format() const;
+
+private:
+    struct Entry
+    {
+        MapRequestKey   key;
+        MapFetchStatus  status;
+        double          milliseconds;
+    };
+
+    size_t                                  m_nExpected;
+    std::chrono::steady_clock::time_point   m_start;
+    std::chrono::steady_clock::time_point   m_end;
+    std::vector<Entry>                      m_entries;
+};
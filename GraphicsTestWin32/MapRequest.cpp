@@ -0,0 +1,221 @@
+// MapRequest.cpp : Identifies a single static Bing Map request.
+//
+#include "MapRequest.h"
+
+#include <cwctype>
+
+namespace
+{
+    // FNV-1a, 64 bit.  Simple, fast, and stable across runs and
+    // platforms, which matters because it names files in the disk cache.
+    const uint64_t kFnvOffsetBasis = 14695981039346656037ULL;
+    const uint64_t kFnvPrime = 1099511628211ULL;
+
+    std::wstring ToLower(const std::wstring& str)
+    {
+        std::wstring strLower(str);
+
+        for (wchar_t& ch : strLower)
+        {
+            ch = static_cast<wchar_t>(towlower(static_cast<wint_t>(ch)));
+        }
+
+        return strLower;
+    }
+
+    bool EqualsNoCase(const std::wstring& a, const std::wstring& b)
+    {
+        if (a.size() != b.size())
+        {
+            return false;
+        }
+
+        for (size_t i = 0; i < a.size(); i++)
+        {
+            if (towlower(static_cast<wint_t>(a[i])) != towlower(static_cast<wint_t>(b[i])))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+}
+
+std::string WideToUtf8(const std::wstring& str)
+{
+    std::string strOut;
+    strOut.reserve(str.size());
+
+    for (size_t i = 0; i < str.size(); i++)
+    {
+        uint32_t cp = static_cast<uint32_t>(str[i]);
+
+        // wchar_t is UTF-16 on Windows, so join surrogate pairs
+        if (cp >= 0xD800 && cp <= 0xDBFF && i + 1 < str.size())
+        {
+            uint32_t low = static_cast<uint32_t>(str[i + 1]);
+
+            if (low >= 0xDC00 && low <= 0xDFFF)
+            {
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                i++;
+            }
+        }
+
+        if (cp < 0x80)
+        {
+            strOut.push_back(static_cast<char>(cp));
+        }
+        else if (cp < 0x800)
+        {
+            strOut.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+            strOut.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        }
+        else if (cp < 0x10000)
+        {
+            strOut.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+            strOut.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+            strOut.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        }
+        else
+        {
+            strOut.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+            strOut.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+            strOut.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+            strOut.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        }
+    }
+
+    return strOut;
+}
+
+std::wstring Utf8ToWide(const std::string& str)
+{
+    std::wstring strOut;
+    strOut.reserve(str.size());
+
+    size_t i = 0;
+
+    while (i < str.size())
+    {
+        unsigned char lead = static_cast<unsigned char>(str[i]);
+        uint32_t cp = 0xFFFD;
+        size_t nLength = 1;
+
+        if (lead < 0x80)
+        {
+            cp = lead;
+        }
+        else if ((lead & 0xE0) == 0xC0)
+        {
+            nLength = 2;
+            cp = lead & 0x1F;
+        }
+        else if ((lead & 0xF0) == 0xE0)
+        {
+            nLength = 3;
+            cp = lead & 0x0F;
+        }
+        else if ((lead & 0xF8) == 0xF0)
+        {
+            nLength = 4;
+            cp = lead & 0x07;
+        }
+
+        if (nLength > 1)
+        {
+            if (i + nLength > str.size())
+            {
+                cp = 0xFFFD;
+                nLength = str.size() - i;
+            }
+            else
+            {
+                for (size_t j = 1; j < nLength; j++)
+                {
+                    unsigned char trail = static_cast<unsigned char>(str[i + j]);
+
+                    if ((trail & 0xC0) != 0x80)
+                    {
+                        cp = 0xFFFD;
+                        nLength = j;
+                        break;
+                    }
+
+                    cp = (cp << 6) | (trail & 0x3F);
+                }
+            }
+        }
+
+        i += nLength;
+
+        // wchar_t is UTF-16 on Windows, so split into a surrogate pair
+        if (cp >= 0x10000 && sizeof(wchar_t) == 2)
+        {
+            cp -= 0x10000;
+            strOut.push_back(static_cast<wchar_t>(0xD800 + (cp >> 10)));
+            strOut.push_back(static_cast<wchar_t>(0xDC00 + (cp & 0x3FF)));
+        }
+        else
+        {
+            strOut.push_back(static_cast<wchar_t>(cp));
+        }
+    }
+
+    return strOut;
+}
+
+MapRequestKey MapRequestKey::ForTile(const std::wstring& strImagerySet, const std::string& quadKey)
+{
+    // tiles are always 256 x 256, and a quadkey has one digit per level
+    MapRequestKey key(strImagerySet, Utf8ToWide(quadKey), 256, 256, (int)quadKey.size());
+    key.kind = MapRequestKind::TILE;
+
+    return key;
+}
+
+std::string MapRequestKey::ToCanonicalString() const
+{
+    // static maps have no prefix, so the names of the maps already
+    // in the disk cache don't change
+    std::string str = IsTile() ? "tile/" : "";
+
+    str += WideToUtf8(ToLower(imagerySet));
+
+    str += '/';
+    str += WideToUtf8(ToLower(location));
+    str += '/';
+    str += std::to_string(width);
+    str += 'x';
+    str += std::to_string(height);
+    str += '/';
+    str += std::to_string(zoomLevel);
+
+    return str;
+}
+
+uint64_t MapRequestKey::Hash() const
+{
+    std::string str = ToCanonicalString();
+
+    uint64_t hash = kFnvOffsetBasis;
+
+    for (unsigned char ch : str)
+    {
+        hash ^= ch;
+        hash *= kFnvPrime;
+    }
+
+    return hash;
+}
+
+bool MapRequestKey::operator==(const MapRequestKey& other) const
+{
+    return kind == other.kind &&
+        width == other.width &&
+        height == other.height &&
+        zoomLevel == other.zoomLevel &&
+        EqualsNoCase(imagerySet, other.imagerySet) &&
+        EqualsNoCase(location, other.location);
+}
@@ -0,0 +1,80 @@
+// MapRequest.h : Identifies a single Bing Map request.
+//
+// A MapRequestKey holds everything that changes the image Bing Maps sends
+// back, so two requests with equal keys always produce the same map.  It is
+// used to key the caches, so it has no Windows dependencies.
+//
+// A key names either a static map of a location, or one 256 x 256 map tile.
+// For a tile, location holds the tile's quadkey and zoomLevel its level of
+// detail, see TileSystem.h.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// the imagery set GetBingMap has always used
+#define DEFAULT_IMAGERY_SET L"AerialWithLabels"
+
+// zoom level 0 means "let Bing Maps choose", which is what a query
+// by location name without a zoom level does
+const int kDefaultZoomLevel = 0;
+
+enum class MapRequestKind
+{
+    STATIC_MAP,     // a whole map of a named location
+    TILE,           // a single tile, named by its quadkey
+};
+
+struct MapRequestKey
+{
+    MapRequestKind  kind;
+    std::wstring    imagerySet;     // AerialWithLabels, Road, ...
+    std::wstring    location;       // a place name such as "Seattle", or a quadkey
+    int             width;          // requested map width in pixels
+    int             height;         // requested map height in pixels
+    int             zoomLevel;      // 0 for the Bing Maps default
+
+    MapRequestKey()
+        : kind(MapRequestKind::STATIC_MAP), imagerySet(DEFAULT_IMAGERY_SET),
+          width(0), height(0), zoomLevel(kDefaultZoomLevel)
+    {
+    }
+
+    MapRequestKey(const std::wstring& strImagerySet, const std::wstring& strLocation,
+        int nWidth, int nHeight, int nZoomLevel = kDefaultZoomLevel)
+        : kind(MapRequestKind::STATIC_MAP), imagerySet(strImagerySet), location(strLocation),
+          width(nWidth), height(nHeight), zoomLevel(nZoomLevel)
+    {
+    }
+
+    // the key of the tile named by quadKey
+    static MapRequestKey ForTile(const std::wstring& strImagerySet, const std::string& quadKey);
+
+    bool IsTile() const { return MapRequestKind::TILE == kind; }
+
+    // a UTF-8 string that uniquely identifies the request.  Location and
+    // imagery set names are case-insensitive, so they are lower-cased.
+    std::string ToCanonicalString() const;
+
+    // a stable 64-bit FNV-1a hash of ToCanonicalString()
+    uint64_t Hash() const;
+
+    bool operator==(const MapRequestKey& other) const;
+    bool operator!=(const MapRequestKey& other) const { return !(*this == other); }
+};
+
+// lets MapRequestKey be used as the key of an unordered_map
+struct MapRequestKeyHash
+{
+    size_t operator()(const MapRequestKey& key) const
+    {
+        return static_cast<size_t>(key.Hash());
+    }
+};
+
+// convert a wide string to UTF-8
+std::string WideToUtf8(const std::wstring& str);
+
+// convert UTF-8 to a wide string.  Invalid sequences become U+FFFD.
+std::wstring Utf8ToWide(const std::string& str);
@@ -0,0 +1,44 @@
+// MapRequestArena.cpp : Memory for one map request, freed all at once.
+//
+#include "MapRequestArena.h"
+
+#include <new>
+
+MapRequestArena::MapRequestArena()
+    : m_buffer(m_inline, sizeof(m_inline), std::pmr::new_delete_resource()),
+      m_counter(&m_buffer)
+{
+}
+
+void* MapRequestArena::Allocate(size_t nBytes, size_t nAlignment)
+{
+    try
+    {
+        return m_counter.allocate(nBytes, nAlignment);
+    }
+    catch (const std::bad_alloc&)
+    {
+        return nullptr;
+    }
+}
+
+void* MapRequestArena::CountingResource::do_allocate(size_t nBytesWanted, size_t nAlignment)
+{
+    void* p = pUpstream->allocate(nBytesWanted, nAlignment);
+
+    nBytes += nBytesWanted;
+    nAllocations++;
+
+    return p;
+}
+
+void MapRequestArena::CountingResource::do_deallocate(void* p, size_t nBytesFreed, size_t nAlignment)
+{
+    // a no-op for the monotonic buffer, but it is its call to make
+    pUpstream->deallocate(p, nBytesFreed, nAlignment);
+}
+
+bool MapRequestArena::CountingResource::do_is_equal(const std::pmr::memory_resource& other) const noexcept
+{
+    return this == &other;
+}
@@ -0,0 +1,70 @@
+// MapRequestArena.h : Memory for one map request, freed all at once.
+//
+// Downloading a map makes a run of short-lived allocations: the URL, the
+// request and response headers, the download buffer and, when something
+// goes wrong, the error text.  Each used to come from the heap and go back
+// to it separately, and with several fetch workers downloading at once they
+// all queued on the heap's lock.  A MapRequestArena is a monotonic buffer
+// that the request's allocations are carved from instead.  The first few
+// kilobytes are inside the arena itself, which lives on the worker's stack,
+// and anything larger is taken from the heap in a few big blocks.  Nothing
+// is freed until the arena goes out of scope at the end of the request,
+// when it is all freed together.
+//
+// Anything that must outlive the request, such as the decoded map or the
+// JPEG kept in the map cache, is copied out of the arena or allocated
+// elsewhere.  An arena belongs to one thread.
+//
+// MapRequestArena has no Windows dependencies.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+
+class MapRequestArena
+{
+public:
+    // enough for the URL and headers of a request
+    static constexpr size_t kInlineBytes = 4 * 1024;
+
+    MapRequestArena();
+
+    MapRequestArena(const MapRequestArena&) = delete;
+    MapRequestArena& operator=(const MapRequestArena&) = delete;
+
+    // for std::pmr containers and the download buffer
+    std::pmr::memory_resource* Resource() { return &m_counter; }
+
+    // nBytes from the arena, or nullptr if the heap is out of memory.
+    // There is no Free; it all goes when the arena does.
+    void* Allocate(size_t nBytes, size_t nAlignment = alignof(std::max_align_t));
+
+    // how much has been asked of the arena, and how many times
+    size_t BytesAllocated() const { return m_counter.nBytes; }
+    size_t AllocationCount() const { return m_counter.nAllocations; }
+
+private:
+    // counts what passes through to the monotonic buffer
+    class CountingResource : public std::pmr::memory_resource
+    {
+    public:
+        explicit CountingResource(std::pmr::memory_resource* pUpstream)
+            : pUpstream(pUpstream), nBytes(0), nAllocations(0)
+        {
+        }
+
+        std::pmr::memory_resource*  pUpstream;
+        size_t                      nBytes;
+        size_t                      nAllocations;
+
+    private:
+        void* do_allocate(size_t nBytes, size_t nAlignment) override;
+        void do_deallocate(void* p, size_t nBytes, size_t nAlignment) override;
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+    };
+
+    alignas(std::max_align_t) uint8_t       m_inline[kInlineBytes];
+    std::pmr::monotonic_buffer_resource     m_buffer;
+    CountingResource                        m_counter;
+};
@@ -0,0 +1,160 @@
+// MapRetry.cpp : Deadlines, retries and hedged requests for map downloads.
+//
+#include "MapRetry.h"
+
+#include <algorithm>
+#include <random>
+
+namespace
+{
+    // the hedge delay is worked out again after this many more downloads
+    const uint64_t kHedgeDelayRefresh = 16;
+
+    // each thread has its own generator for the jitter
+    std::mt19937& JitterRandom()
+    {
+        thread_local std::mt19937 random(std::random_device{}());
+        return random;
+    }
+}
+
+MapAttemptResult MapAttemptResultForHttpStatus(int nStatus)
+{
+    if (200 == nStatus)
+    {
+        return MapAttemptResult::SUCCEEDED;
+    }
+
+    // no response, a timeout, too many requests, or a server that is
+    // struggling or restarting
+    if (0 == nStatus || 408 == nStatus || 429 == nStatus || nStatus >= 500)
+    {
+        return MapAttemptResult::RETRY;
+    }
+
+    // asking again would get the same answer
+    return MapAttemptResult::FAIL;
+}
+
+void MapAttemptToken::Cancel()
+{
+    m_bCancelled.store(true, std::memory_order_release);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (m_interrupt)
+    {
+        m_interrupt();
+    }
+}
+
+void MapAttemptToken::SetInterrupt(std::function<void()> interrupt)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_interrupt = std::move(interrupt);
+
+    // cancelled before there was anything to interrupt
+    if (m_interrupt && m_bCancelled.load(std::memory_order_acquire))
+    {
+        m_interrupt();
+    }
+}
+
+MapRetrier::MapRetrier(const MapRetryPolicy& policy)
+    : m_policy(policy),
+      m_nLatencySamples(0),
+      m_nHedgeDelayUs(0),
+      m_nDownloads(0),
+      m_nAttempts(0),
+      m_nRetries(0),
+      m_nHedges(0),
+      m_nHedgeWins(0),
+      m_nFailed(0),
+      m_nGaveUp(0)
+{
+}
+
+MapRetrier::Clock::duration MapRetrier::Backoff(unsigned nRetry) const
+{
+    // base, 2 x base, 4 x base ... up to the maximum, and then a random
+    // part of that, so retries that failed together spread out
+    uint64_t nCapMs = m_policy.nBackoffBaseMs;
+
+    for (unsigned i = 0; i < nRetry && nCapMs < m_policy.nBackoffMaxMs; i++)
+    {
+        nCapMs *= 2;
+    }
+
+    nCapMs = std::min<uint64_t>(nCapMs, m_policy.nBackoffMaxMs);
+
+    std::uniform_int_distribution<uint64_t> jitter(0, nCapMs * 1000);
+
+    return std::chrono::microseconds(jitter(JitterRandom()));
+}
+
+MapRetrier::Clock::duration MapRetrier::HedgeDelay() const
+{
+    if (!m_policy.bHedge || m_nLatencySamples.load(std::memory_order_relaxed) < m_policy.nHedgeMinSamples)
+    {
+        return Clock::duration::zero();
+    }
+
+    int64_t nDelayUs = std::max<int64_t>(m_nHedgeDelayUs.load(std::memory_order_relaxed),
+        (int64_t)m_policy.nHedgeMinDelayMs * 1000);
+
+    return std::chrono::microseconds(std::max<int64_t>(nDelayUs, 1));
+}
+
+void MapRetrier::RecordSuccess(Clock::duration duration)
+{
+    m_latency.Record((uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(duration).count());
+
+    uint64_t nSamples = m_nLatencySamples.fetch_add(1, std::memory_order_relaxed) + 1;
+
+    // a snapshot copies every bucket, so it isn't taken every time
+    if (m_policy.bHedge && (nSamples == m_policy.nHedgeMinSamples || 0 == nSamples % kHedgeDelayRefresh))
+    {
+        MetricHistogram::Snapshot snapshot = m_latency.TakeSnapshot();
+
+        m_nHedgeDelayUs.store((int64_t)snapshot.ValueAtPercentile(m_policy.fHedgePercentile),
+            std::memory_order_relaxed);
+    }
+}
+
+bool MapRetrier::SleepUnlessCancelled(Clock::duration duration, const std::atomic<bool>* pbCancel)
+{
+    Clock::time_point end = Clock::now() + duration;
+
+    for (;;)
+    {
+        if (pbCancel && pbCancel->load(std::memory_order_acquire))
+        {
+            return false;
+        }
+
+        Clock::time_point now = Clock::now();
+
+        if (now >= end)
+        {
+            return true;
+        }
+
+        std::this_thread::sleep_for(std::min<Clock::duration>(end - now, kCancelPollInterval));
+    }
+}
+
+MapRetrier::Stats MapRetrier::GetStats() const
+{
+    Stats stats;
+
+    stats.nDownloads = m_nDownloads.load(std::memory_order_relaxed);
+    stats.nAttempts = m_nAttempts.load(std::memory_order_relaxed);
+    stats.nRetries = m_nRetries.load(std::memory_order_relaxed);
+    stats.nHedges = m_nHedges.load(std::memory_order_relaxed);
+    stats.nHedgeWins = m_nHedgeWins.load(std::memory_order_relaxed);
+    stats.nFailed = m_nFailed.load(std::memory_order_relaxed);
+    stats.nGaveUp = m_nGaveUp.load(std::memory_order_relaxed);
+
+    return stats;
+}
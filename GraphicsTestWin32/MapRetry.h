@@ -0,0 +1,361 @@
+// MapRetry.h : Deadlines, retries and hedged requests for map downloads.
+//
+// A download used to be tried once, with no limit on how long it could
+// take.  A map server that answered with a 503 left an empty map, and a
+// connection that stalled half way through a map held its worker until
+// the operating system gave up on it, minutes later.  Under load those
+// stalls, rare as they are, were most of the tail latency.
+//
+// MapRetryPolicy says how long a download may take: to connect, between
+// one read and the next, and in all.  Applying those is the transport's
+// job (HttpSessionPool on Windows, LocalHttpClient in the load tests).
+// MapRetrier then runs each download as a series of attempts.  An attempt
+// that fails in a way that might not happen again (no response, a timeout,
+// a cut-off body, a 5xx, a 408 or a 429) is tried again after a backoff
+// that doubles each time, up to a limit, with full jitter so that the
+// workers that failed together don't all come back together.  A failure
+// that would only happen again, such as a 404 or an undecodable map, ends
+// the download at once.
+//
+// With hedging on, an attempt that has taken longer than most (the 95th
+// percentile of the downloads so far, by default) is raced by a second
+// one on another thread.  Whichever finishes first wins, and the other is
+// cancelled and interrupted.  Only the slowest few downloads are ever
+// hedged, so the extra load is a few percent, but a stalled connection no
+// longer holds up its map.
+//
+// An attempt is handed a MapAttemptToken.  It polls the token between
+// reads, as GetBingMap polls its cancel flag, and can register an
+// interrupt with it to break out of a read that is blocked.
+//
+// MapRetry has no Windows dependencies.
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "MapMetrics.h"
+
+// how long a download may take, and how hard to try.  Times are in
+// milliseconds, and 0 means no limit.
+struct MapRetryPolicy
+{
+    unsigned    nConnectTimeoutMs = 5000;   // to make a connection
+    unsigned    nReadTimeoutMs = 10000;     // waiting for the next bytes of a response
+    unsigned    nTotalTimeoutMs = 30000;    // one attempt, from start to finish
+    unsigned    nMaxAttempts = 3;           // including the first
+    unsigned    nBackoffBaseMs = 100;       // the longest wait before the first retry
+    unsigned    nBackoffMaxMs = 2000;       // and before any retry
+    bool        bHedge = false;             // race slow attempts with a second one
+    double      fHedgePercentile = 95;      // how slow an attempt must be to be raced
+    unsigned    nHedgeMinDelayMs = 10;      // but never sooner than this
+    unsigned    nHedgeMinSamples = 20;      // nor before this many downloads have finished
+};
+
+// how an attempt ended
+enum class MapAttemptResult
+{
+    SUCCEEDED,
+    RETRY,              // failed, but trying again might work
+    FAIL,               // failed, and would fail again
+};
+
+// how the whole download ended
+enum class MapRetryStatus
+{
+    SUCCEEDED,
+    FAILED,             // an attempt failed in a way not worth retrying
+    GAVE_UP,            // every attempt failed
+    CANCELLED,          // the caller's cancel flag was set
+};
+
+// whether a response with HTTP status nStatus is worth asking for again.
+// 0 is no response at all.
+MapAttemptResult MapAttemptResultForHttpStatus(int nStatus);
+
+// handed to each attempt, to tell it to stop
+class MapAttemptToken
+{
+public:
+    // pbParent is the caller's cancel flag, if it has one.  nIndex is 0
+    // for an attempt, 1 for the hedge racing it.
+    explicit MapAttemptToken(const std::atomic<bool>* pbParent = nullptr, int nIndex = 0)
+        : m_pbParent(pbParent), m_nIndex(nIndex), m_bCancelled(false)
+    {
+    }
+
+    MapAttemptToken(const MapAttemptToken&) = delete;
+    MapAttemptToken& operator=(const MapAttemptToken&) = delete;
+
+    // the caller gave up, or another attempt won
+    bool IsCancelled() const
+    {
+        return m_bCancelled.load(std::memory_order_acquire) ||
+            (m_pbParent && m_pbParent->load(std::memory_order_acquire));
+    }
+
+    int Index() const { return m_nIndex; }
+
+    // set IsCancelled, and call the interrupt if there is one
+    void Cancel();
+
+    // call interrupt, from whichever thread cancels the attempt, to break
+    // it out of a blocking read.  It is called at once if the attempt is
+    // already cancelled.  Clear it before whatever it refers to goes away.
+    void SetInterrupt(std::function<void()> interrupt);
+    void ClearInterrupt() { SetInterrupt(nullptr); }
+
+private:
+    const std::atomic<bool>*    m_pbParent;
+    int                         m_nIndex;
+    std::atomic<bool>           m_bCancelled;
+
+    std::mutex                  m_mutex;        // protects m_interrupt
+    std::function<void()>       m_interrupt;
+};
+
+class MapRetrier
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    // one attempt at a download, into valueOut
+    template <typename TValue>
+    using Attempt = std::function<MapAttemptResult(MapAttemptToken& token, TValue& valueOut)>;
+
+    // what it has done so far
+    struct Stats
+    {
+        uint64_t    nDownloads = 0;
+        uint64_t    nAttempts = 0;      // not counting hedges
+        uint64_t    nRetries = 0;
+        uint64_t    nHedges = 0;
+        uint64_t    nHedgeWins = 0;     // hedges that finished first
+        uint64_t    nFailed = 0;
+        uint64_t    nGaveUp = 0;
+    };
+
+    explicit MapRetrier(const MapRetryPolicy& policy = MapRetryPolicy());
+
+    MapRetrier(const MapRetrier&) = delete;
+    MapRetrier& operator=(const MapRetrier&) = delete;
+
+    // call before any downloads are run
+    void SetPolicy(const MapRetryPolicy& policy) { m_policy = policy; }
+    const MapRetryPolicy& Policy() const { return m_policy; }
+
+    // run attempt until it succeeds, fails for good, or the policy's
+    // attempts run out.  pbCancel, if given, is polled while waiting to
+    // retry and passed to each attempt's token.
+    template <typename TValue>
+    MapRetryStatus Run(const std::atomic<bool>* pbCancel, const Attempt<TValue>& attempt, TValue& valueOut)
+    {
+        m_nDownloads.fetch_add(1, std::memory_order_relaxed);
+
+        unsigned nMaxAttempts = (m_policy.nMaxAttempts > 0) ? m_policy.nMaxAttempts : 1;
+
+        for (unsigned nAttempt = 0; ; nAttempt++)
+        {
+            if (pbCancel && pbCancel->load(std::memory_order_acquire))
+            {
+                return MapRetryStatus::CANCELLED;
+            }
+
+            m_nAttempts.fetch_add(1, std::memory_order_relaxed);
+
+            MapAttemptResult result = RunAttempt(pbCancel, attempt, valueOut);
+
+            if (MapAttemptResult::SUCCEEDED == result)
+            {
+                return MapRetryStatus::SUCCEEDED;
+            }
+
+            if (pbCancel && pbCancel->load(std::memory_order_acquire))
+            {
+                return MapRetryStatus::CANCELLED;
+            }
+
+            if (MapAttemptResult::FAIL == result)
+            {
+                m_nFailed.fetch_add(1, std::memory_order_relaxed);
+                return MapRetryStatus::FAILED;
+            }
+
+            if (nAttempt + 1 >= nMaxAttempts)
+            {
+                m_nGaveUp.fetch_add(1, std::memory_order_relaxed);
+                return MapRetryStatus::GAVE_UP;
+            }
+
+            m_nRetries.fetch_add(1, std::memory_order_relaxed);
+
+            if (!SleepUnlessCancelled(Backoff(nAttempt), pbCancel))
+            {
+                return MapRetryStatus::CANCELLED;
+            }
+        }
+    }
+
+    // how long to wait before retry number nRetry, counting from 0
+    Clock::duration Backoff(unsigned nRetry) const;
+
+    // how long an attempt may run before it is hedged, or zero if hedging
+    // is off or there aren't enough downloads to go on yet
+    Clock::duration HedgeDelay() const;
+
+    Stats GetStats() const;
+
+private:
+    // how often a waiting hedge looks at the caller's cancel flag
+    static constexpr std::chrono::milliseconds kCancelPollInterval{ 20 };
+
+    // one attempt, and its hedge if it runs long
+    template <typename TValue>
+    MapAttemptResult RunAttempt(const std::atomic<bool>* pbCancel, const Attempt<TValue>& attempt, TValue& valueOut)
+    {
+        Clock::time_point start = Clock::now();
+        Clock::duration hedgeDelay = HedgeDelay();
+        MapAttemptToken first(pbCancel, 0);
+
+        if (Clock::duration::zero() == hedgeDelay)
+        {
+            MapAttemptResult result = attempt(first, valueOut);
+
+            if (MapAttemptResult::SUCCEEDED == result)
+            {
+                RecordSuccess(Clock::now() - start);
+            }
+
+            return result;
+        }
+
+        // what the two attempts share.  The first to succeed is the winner.
+        std::mutex mutex;
+        std::condition_variable cv;
+        bool bFirstDone = false;
+        bool bHedgeStarted = false;
+        int nWinner = -1;
+        MapAttemptResult hedgeResult = MapAttemptResult::FAIL;
+        TValue hedgeValue;
+
+        MapAttemptToken hedge(pbCancel, 1);
+
+        // the hedge waits on its own thread, and runs if the first attempt
+        // is still going when its time comes
+        std::thread hedgeThread([&]()
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                Clock::time_point due = start + hedgeDelay;
+
+                while (!bFirstDone && !hedge.IsCancelled() && Clock::now() < due)
+                {
+                    cv.wait_until(lock, std::min(due, Clock::now() + kCancelPollInterval));
+                }
+
+                if (bFirstDone || hedge.IsCancelled())
+                {
+                    return;
+                }
+
+                bHedgeStarted = true;
+            }
+
+            m_nHedges.fetch_add(1, std::memory_order_relaxed);
+
+            MapAttemptResult result = attempt(hedge, hedgeValue);
+            bool bWon = false;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+
+                hedgeResult = result;
+
+                if (MapAttemptResult::SUCCEEDED == result && nWinner < 0)
+                {
+                    nWinner = 1;
+                    bWon = true;
+                }
+            }
+
+            // the first attempt is still stuck, stop it
+            if (bWon)
+            {
+                first.Cancel();
+            }
+        });
+
+        MapAttemptResult result = attempt(first, valueOut);
+        bool bHedged = false;
+        bool bFirstWon = false;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            bFirstDone = true;
+            bHedged = bHedgeStarted;
+
+            if (MapAttemptResult::SUCCEEDED == result && nWinner < 0)
+            {
+                nWinner = 0;
+                bFirstWon = true;
+            }
+        }
+
+        cv.notify_all();
+
+        if (bFirstWon)
+        {
+            hedge.Cancel();
+        }
+
+        // the hedge has finished with everything shared once it is joined
+        hedgeThread.join();
+
+        if (1 == nWinner)
+        {
+            m_nHedgeWins.fetch_add(1, std::memory_order_relaxed);
+            valueOut = std::move(hedgeValue);
+            result = MapAttemptResult::SUCCEEDED;
+        }
+        else if (nWinner < 0 && bHedged && MapAttemptResult::FAIL != result)
+        {
+            // both failed.  A retry is only worth it if neither failed for good.
+            result = hedgeResult;
+        }
+
+        if (MapAttemptResult::SUCCEEDED == result)
+        {
+            RecordSuccess(Clock::now() - start);
+        }
+
+        return result;
+    }
+
+    // remember how long a successful download took, for HedgeDelay
+    void RecordSuccess(Clock::duration duration);
+
+    // sleep, unless pbCancel is set.  Returns false if it is.
+    static bool SleepUnlessCancelled(Clock::duration duration, const std::atomic<bool>* pbCancel);
+
+    MapRetryPolicy          m_policy;
+
+    // successful download times in microseconds, and the hedge delay
+    // worked out from them every so often
+    MetricHistogram         m_latency;
+    std::atomic<uint64_t>   m_nLatencySamples;
+    std::atomic<int64_t>    m_nHedgeDelayUs;
+
+    std::atomic<uint64_t>   m_nDownloads;
+    std::atomic<uint64_t>   m_nAttempts;
+    std::atomic<uint64_t>   m_nRetries;
+    std::atomic<uint64_t>   m_nHedges;
+    std::atomic<uint64_t>   m_nHedgeWins;
+    std::atomic<uint64_t>   m_nFailed;
+    std::atomic<uint64_t>   m_nGaveUp;
+};
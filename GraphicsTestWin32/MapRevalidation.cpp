@@ -0,0 +1,472 @@
+// MapRevalidation.cpp : Asking the server whether a cached map has changed.
+//
+#include "MapRevalidation.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+
+namespace
+{
+    // what a block of response headers says about caching
+    struct CacheHeaders
+    {
+        std::string_view    strETag;
+        std::string_view    strLastModified;
+        bool                bHasMaxAge = false;     // max-age, no-cache or no-store
+        uint32_t            nMaxAgeSeconds = 0;
+    };
+
+    std::string_view Trim(std::string_view str)
+    {
+        size_t nStart = str.find_first_not_of(" \t");
+
+        if (nStart == std::string_view::npos)
+        {
+            return std::string_view();
+        }
+
+        size_t nEnd = str.find_last_not_of(" \t");
+
+        return str.substr(nStart, nEnd - nStart + 1);
+    }
+
+    bool EqualsNoCase(std::string_view a, std::string_view b)
+    {
+        if (a.size() != b.size())
+        {
+            return false;
+        }
+
+        for (size_t i = 0; i < a.size(); i++)
+        {
+            if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i]))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // one Cache-Control directive, such as "max-age=86400" or "no-store"
+    void ParseCacheControlDirective(std::string_view strDirective, CacheHeaders& headers)
+    {
+        strDirective = Trim(strDirective);
+
+        size_t nEquals = strDirective.find('=');
+        std::string_view strName = Trim(strDirective.substr(0, nEquals));
+
+        if (EqualsNoCase(strName, "no-cache") || EqualsNoCase(strName, "no-store"))
+        {
+            headers.bHasMaxAge = true;
+            headers.nMaxAgeSeconds = 0;
+        }
+        else if (EqualsNoCase(strName, "max-age") && nEquals != std::string_view::npos)
+        {
+            std::string_view strValue = Trim(strDirective.substr(nEquals + 1));
+            uint64_t nSeconds = 0;
+
+            for (size_t i = 0; i < strValue.size() && isdigit((unsigned char)strValue[i]); i++)
+            {
+                nSeconds = std::min<uint64_t>(nSeconds * 10 + (uint64_t)(strValue[i] - '0'), UINT32_MAX);
+            }
+
+            // no-cache wins over a max-age in the same header
+            if (!headers.bHasMaxAge)
+            {
+                headers.bHasMaxAge = true;
+                headers.nMaxAgeSeconds = (uint32_t)nSeconds;
+            }
+        }
+    }
+
+    CacheHeaders ParseCacheHeaders(std::string_view strHeaders)
+    {
+        CacheHeaders headers;
+
+        while (!strHeaders.empty())
+        {
+            size_t nLineEnd = strHeaders.find("\r\n");
+            std::string_view strLine = strHeaders.substr(0, nLineEnd);
+
+            strHeaders = (nLineEnd == std::string_view::npos) ? std::string_view() : strHeaders.substr(nLineEnd + 2);
+
+            // the status line has no colon before its first space
+            size_t nColon = strLine.find(':');
+
+            if (nColon == std::string_view::npos || strLine.find(' ') < nColon)
+            {
+                continue;
+            }
+
+            std::string_view strName = strLine.substr(0, nColon);
+            std::string_view strValue = Trim(strLine.substr(nColon + 1));
+
+            if (EqualsNoCase(strName, "ETag"))
+            {
+                headers.strETag = strValue;
+            }
+            else if (EqualsNoCase(strName, "Last-Modified"))
+            {
+                headers.strLastModified = strValue;
+            }
+            else if (EqualsNoCase(strName, "Cache-Control"))
+            {
+                for (size_t nStart = 0; nStart <= strValue.size(); )
+                {
+                    size_t nComma = strValue.find(',', nStart);
+
+                    if (nComma == std::string_view::npos)
+                    {
+                        nComma = strValue.size();
+                    }
+
+                    ParseCacheControlDirective(strValue.substr(nStart, nComma - nStart), headers);
+                    nStart = nComma + 1;
+                }
+            }
+        }
+
+        return headers;
+    }
+}
+
+int64_t MapRevalidationNow()
+{
+    return std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+MapFreshness ClassifyMap(const MapValidators& validators, const MapRevalidationPolicy& policy, int64_t nNow)
+{
+    int64_t nAge = nNow - validators.nFetchedAt;
+    int64_t nFreshSeconds = validators.nMaxAgeSeconds;
+
+    // revalidating a map with no validators downloads all of it, so a
+    // server that says no-cache doesn't get asked for it on every look
+    if (!validators.CanRevalidate())
+    {
+        nFreshSeconds = std::max<int64_t>(nFreshSeconds, policy.nMinRedownloadSeconds);
+    }
+
+    // a clock that went backwards makes everything young, not old
+    if (nAge < nFreshSeconds)
+    {
+        return MapFreshness::FRESH;
+    }
+
+    if (nAge < nFreshSeconds + (int64_t)policy.nStaleWhileRevalidateSeconds)
+    {
+        return MapFreshness::STALE;
+    }
+
+    return MapFreshness::EXPIRED;
+}
+
+const char* MapFreshnessName(MapFreshness freshness)
+{
+    switch (freshness)
+    {
+    case MapFreshness::FRESH:   return "FRESH";
+    case MapFreshness::STALE:   return "STALE";
+    case MapFreshness::EXPIRED: return "EXPIRED";
+    }
+
+    return "UNKNOWN";
+}
+
+MapValidators ParseMapValidators(std::string_view strHeaders, const MapRevalidationPolicy& policy, int64_t nNow)
+{
+    CacheHeaders headers = ParseCacheHeaders(strHeaders);
+    MapValidators validators;
+
+    validators.strETag = headers.strETag;
+    validators.strLastModified = headers.strLastModified;
+    validators.nFetchedAt = nNow;
+    validators.nMaxAgeSeconds = headers.bHasMaxAge ? headers.nMaxAgeSeconds : policy.nDefaultMaxAgeSeconds;
+
+    return validators;
+}
+
+void UpdateMapValidators(MapValidators& cached, std::string_view strHeaders, int64_t nNow)
+{
+    CacheHeaders headers = ParseCacheHeaders(strHeaders);
+
+    if (!headers.strETag.empty())
+    {
+        cached.strETag = headers.strETag;
+    }
+
+    if (!headers.strLastModified.empty())
+    {
+        cached.strLastModified = headers.strLastModified;
+    }
+
+    if (headers.bHasMaxAge)
+    {
+        cached.nMaxAgeSeconds = headers.nMaxAgeSeconds;
+    }
+
+    cached.nFetchedAt = nNow;
+}
+
+std::string ConditionalRequestHeaders(const MapValidators& validators)
+{
+    std::string strHeaders;
+
+    // a server that understands both uses If-None-Match, which is exact
+    if (!validators.strETag.empty())
+    {
+        strHeaders.append("If-None-Match: ").append(validators.strETag).append("\r\n");
+    }
+
+    if (!validators.strLastModified.empty())
+    {
+        strHeaders.append("If-Modified-Since: ").append(validators.strLastModified).append("\r\n");
+    }
+
+    return strHeaders;
+}
+
+MapRevalidationTable::MapRevalidationTable(size_t nMaxEntries)
+    : m_nMaxEntries(std::max<size_t>(nMaxEntries, 1)),
+      m_nFresh(0), m_nStale(0), m_nExpired(0), m_nNotModified(0), m_nModified(0),
+      m_nBytesSaved(0), m_nBytesDownloaded(0), m_nDecodesSaved(0), m_nBackground(0)
+{
+}
+
+void MapRevalidationTable::SetPolicy(const MapRevalidationPolicy& policy)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_policy = policy;
+}
+
+MapRevalidationPolicy MapRevalidationTable::Policy() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_policy;
+}
+
+void MapRevalidationTable::Set(const MapRequestKey& key, const MapValidators& validators)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto found = m_entries.find(key);
+
+    if (found != m_entries.end())
+    {
+        found->second.validators = validators;
+        return;
+    }
+
+    // full, forget the oldest.  This is a walk of the whole table, but
+    // only once in thousands of maps.
+    if (m_entries.size() >= m_nMaxEntries)
+    {
+        auto oldest = std::min_element(m_entries.begin(), m_entries.end(),
+            [](const EntryMap::value_type& a, const EntryMap::value_type& b)
+            {
+                return a.second.validators.nFetchedAt < b.second.validators.nFetchedAt;
+            });
+
+        m_entries.erase(oldest);
+    }
+
+    m_entries[key].validators = validators;
+}
+
+bool MapRevalidationTable::Get(const MapRequestKey& key, MapValidators& validatorsOut) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto found = m_entries.find(key);
+
+    if (found == m_entries.end())
+    {
+        return false;
+    }
+
+    validatorsOut = found->second.validators;
+    return true;
+}
+
+MapFreshness MapRevalidationTable::Peek(const MapRequestKey& key, int64_t nNow) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto found = m_entries.find(key);
+
+    if (found == m_entries.end())
+    {
+        return MapFreshness::FRESH;
+    }
+
+    return ClassifyMap(found->second.validators, m_policy, nNow);
+}
+
+MapFreshness MapRevalidationTable::Classify(const MapRequestKey& key, int64_t nNow)
+{
+    MapFreshness freshness = Peek(key, nNow);
+
+    switch (freshness)
+    {
+    case MapFreshness::FRESH:   m_nFresh.fetch_add(1, std::memory_order_relaxed); break;
+    case MapFreshness::STALE:   m_nStale.fetch_add(1, std::memory_order_relaxed); break;
+    case MapFreshness::EXPIRED: m_nExpired.fetch_add(1, std::memory_order_relaxed); break;
+    }
+
+    return freshness;
+}
+
+bool MapRevalidationTable::BeginRevalidation(const MapRequestKey& key)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto found = m_entries.find(key);
+
+    if (found == m_entries.end() || found->second.bRevalidating)
+    {
+        return false;
+    }
+
+    found->second.bRevalidating = true;
+    m_nBackground.fetch_add(1, std::memory_order_relaxed);
+
+    return true;
+}
+
+void MapRevalidationTable::EndRevalidation(const MapRequestKey& key)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto found = m_entries.find(key);
+
+    if (found != m_entries.end())
+    {
+        found->second.bRevalidating = false;
+    }
+}
+
+std::vector<MapRequestKey> MapRevalidationTable::TakeDue(int64_t nNow, size_t nMax)
+{
+    std::vector<std::pair<int64_t, EntryMap::iterator>> due;
+    std::vector<MapRequestKey> keys;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    for (auto it = m_entries.begin(); it != m_entries.end(); ++it)
+    {
+        const MapValidators& validators = it->second.validators;
+
+        if (!it->second.bRevalidating && MapFreshness::FRESH != ClassifyMap(validators, m_policy, nNow))
+        {
+            due.emplace_back(validators.nFetchedAt + (int64_t)validators.nMaxAgeSeconds, it);
+        }
+    }
+
+    size_t nTake = std::min(nMax, due.size());
+
+    std::partial_sort(due.begin(), due.begin() + nTake, due.end(),
+        [](const std::pair<int64_t, EntryMap::iterator>& a, const std::pair<int64_t, EntryMap::iterator>& b)
+        {
+            return a.first < b.first;
+        });
+
+    for (size_t i = 0; i < nTake; i++)
+    {
+        due[i].second->second.bRevalidating = true;
+        keys.push_back(due[i].second->first);
+    }
+
+    m_nBackground.fetch_add(nTake, std::memory_order_relaxed);
+
+    return keys;
+}
+
+void MapRevalidationTable::RecordNotModified(uint64_t nBytes, bool bWasDecoded)
+{
+    m_nNotModified.fetch_add(1, std::memory_order_relaxed);
+    m_nBytesSaved.fetch_add(nBytes, std::memory_order_relaxed);
+
+    if (bWasDecoded)
+    {
+        m_nDecodesSaved.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void MapRevalidationTable::RecordModified(uint64_t nBytes)
+{
+    m_nModified.fetch_add(1, std::memory_order_relaxed);
+    m_nBytesDownloaded.fetch_add(nBytes, std::memory_order_relaxed);
+}
+
+void MapRevalidationTable::Remove(const MapRequestKey& key)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_entries.erase(key);
+}
+
+void MapRevalidationTable::Clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_entries.clear();
+}
+
+size_t MapRevalidationTable::Count() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_entries.size();
+}
+
+MapRevalidationTable::Stats MapRevalidationTable::GetStats() const
+{
+    Stats stats;
+
+    stats.nFresh = m_nFresh.load(std::memory_order_relaxed);
+    stats.nStale = m_nStale.load(std::memory_order_relaxed);
+    stats.nExpired = m_nExpired.load(std::memory_order_relaxed);
+    stats.nNotModified = m_nNotModified.load(std::memory_order_relaxed);
+    stats.nModified = m_nModified.load(std::memory_order_relaxed);
+    stats.nConditional = stats.nNotModified + stats.nModified;
+    stats.nBytesSaved = m_nBytesSaved.load(std::memory_order_relaxed);
+    stats.nBytesDownloaded = m_nBytesDownloaded.load(std::memory_order_relaxed);
+    stats.nDecodesSaved = m_nDecodesSaved.load(std::memory_order_relaxed);
+    stats.nBackground = m_nBackground.load(std::memory_order_relaxed);
+
+    return stats;
+}
+
+std::string MapRevalidationTable::FormatStats() const
+{
+    Stats stats = GetStats();
+    char szStats[512];
+
+    snprintf(szStats, sizeof(szStats),
+        "Revalidation: %" PRIu64 " fresh, %" PRIu64 " stale, %" PRIu64 " expired; %" PRIu64
+        " conditional requests, %" PRIu64 " not modified (%.0f%%), %" PRIu64 " changed; "
+        "%.1f KB not downloaded, %" PRIu64 " decodes saved, %" PRIu64 " revalidated in the background\n",
+        stats.nFresh, stats.nStale, stats.nExpired, stats.nConditional, stats.nNotModified,
+        stats.NotModifiedRate() * 100.0, stats.nModified, stats.nBytesSaved / 1024.0,
+        stats.nDecodesSaved, stats.nBackground);
+
+    return szStats;
+}
+
+std::string MapRevalidationTable::StatsToJson() const
+{
+    Stats stats = GetStats();
+    char szJson[512];
+
+    snprintf(szJson, sizeof(szJson),
+        "{\"fresh\":%" PRIu64 ",\"stale\":%" PRIu64 ",\"expired\":%" PRIu64 ",\"conditional\":%" PRIu64
+        ",\"not_modified\":%" PRIu64 ",\"modified\":%" PRIu64 ",\"bytes_saved\":%" PRIu64
+        ",\"bytes_downloaded\":%" PRIu64 ",\"decodes_saved\":%" PRIu64 ",\"background\":%" PRIu64 "}",
+        stats.nFresh, stats.nStale, stats.nExpired, stats.nConditional, stats.nNotModified,
+        stats.nModified, stats.nBytesSaved, stats.nBytesDownloaded, stats.nDecodesSaved, stats.nBackground);
+
+    return szJson;
+}
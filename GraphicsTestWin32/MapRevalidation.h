@@ -0,0 +1,196 @@
+// MapRevalidation.h : Asking the server whether a cached map has changed.
+//
+// A map used to be downloaded with INTERNET_FLAG_RELOAD and PRAGMA_NOCACHE
+// every time it wasn't already cached, and once it was cached it was never
+// asked for again, however old it got.  Bing Maps imagery does change, but
+// rarely, so the choice was between showing a map forever or downloading
+// the whole JPEG again to find out it was the same.
+//
+// Now each cached map keeps the validators the server sent with it, its
+// ETag and Last-Modified headers, and how long the server said it stays
+// fresh, from Cache-Control: max-age.  A map that is still fresh is used
+// without asking.  Once it isn't, the server is asked with If-None-Match
+// and If-Modified-Since, and a 304 Not Modified, a few hundred bytes of
+// headers, means the map already in memory is still right: it isn't
+// downloaded, and if it is still decoded it isn't decoded either.
+//
+// For a while after a map stops being fresh (stale-while-revalidate) it is
+// still shown at once, and asked about in the background, so the UI never
+// waits on the network for a map it already has.  After that it is asked
+// about before it is shown.  MapRevalidationTable keeps every map's
+// validators, and hands out the maps whose time has come, for a background
+// sweep to revalidate on a schedule.  It also counts what revalidation
+// saved: the bytes that didn't have to be downloaded and the decodes that
+// didn't have to be done.
+//
+// MapRevalidation has no Windows dependencies.
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "MapRequest.h"
+
+// what the server said about a map when it was last downloaded or
+// revalidated
+struct MapValidators
+{
+    std::string     strETag;                // as the server sent it, quotes and all
+    std::string     strLastModified;        // an HTTP date, as the server sent it
+    int64_t         nFetchedAt = 0;         // when, in seconds since 1970
+    uint32_t        nMaxAgeSeconds = 0;     // how long after that it stays fresh
+
+    // true if there is something to send with a conditional request
+    bool CanRevalidate() const { return !strETag.empty() || !strLastModified.empty(); }
+};
+
+// how a cached map may be used
+enum class MapFreshness
+{
+    FRESH,          // use it without asking
+    STALE,          // use it, and revalidate it in the background
+    EXPIRED,        // revalidate it before using it
+};
+
+// how long maps stay fresh, in seconds
+struct MapRevalidationPolicy
+{
+    uint32_t    nDefaultMaxAgeSeconds = 24 * 60 * 60;           // when the server doesn't say
+    uint32_t    nStaleWhileRevalidateSeconds = 7 * 24 * 60 * 60; // shown while revalidating after that
+    uint32_t    nMinRedownloadSeconds = 60 * 60;                // fresh at least this long without validators
+    uint32_t    nScheduleIntervalSeconds = 5 * 60;              // between background sweeps, 0 for none
+    size_t      nMaxPerSweep = 16;                              // maps revalidated by one sweep
+};
+
+// the time to give MapValidators, in seconds since 1970
+int64_t MapRevalidationNow();
+
+// how a map with these validators may be used at nNow.  A map the server
+// gave no validators for can't be revalidated, only downloaded again, so
+// it stays fresh for at least the policy's nMinRedownloadSeconds, however
+// short its max-age, rather than being downloaded each time it is shown.
+MapFreshness ClassifyMap(const MapValidators& validators, const MapRevalidationPolicy& policy, int64_t nNow);
+
+// "FRESH", "STALE" or "EXPIRED"
+const char* MapFreshnessName(MapFreshness freshness);
+
+// the validators in a block of response headers, "Name: value" lines
+// ending in CRLF, from a 200 received at nNow.  Cache-Control: no-cache or
+// no-store makes a map stale at once, and with no max-age the policy's
+// default is used.
+MapValidators ParseMapValidators(std::string_view strHeaders, const MapRevalidationPolicy& policy, int64_t nNow);
+
+// a 304 received at nNow with strHeaders makes cached fresh again.  Any
+// validators or max-age it carries replace the old ones.
+void UpdateMapValidators(MapValidators& cached, std::string_view strHeaders, int64_t nNow);
+
+// the If-None-Match and If-Modified-Since request headers for a map with
+// these validators, each ending in CRLF, or an empty string if it has none
+std::string ConditionalRequestHeaders(const MapValidators& validators);
+
+// the validators of every map in memory or on disk, and what revalidating
+// them has saved.  Safe from any thread.
+class MapRevalidationTable
+{
+public:
+    // plenty for the City menu and a long session of tiles
+    static const size_t kDefaultMaxEntries = 16384;
+
+    struct Stats
+    {
+        uint64_t    nFresh = 0;             // maps used without asking
+        uint64_t    nStale = 0;             // shown at once, revalidated in the background
+        uint64_t    nExpired = 0;           // revalidated before they were shown
+        uint64_t    nConditional = 0;       // conditional requests answered
+        uint64_t    nNotModified = 0;       // of those, 304s
+        uint64_t    nModified = 0;          // and maps that had changed
+        uint64_t    nBytesSaved = 0;        // the maps the 304s didn't download
+        uint64_t    nBytesDownloaded = 0;   // the maps that had changed
+        uint64_t    nDecodesSaved = 0;      // 304s for maps that were still decoded
+        uint64_t    nBackground = 0;        // claimed by BeginRevalidation or TakeDue
+
+        double NotModifiedRate() const { return nConditional ? (double)nNotModified / (double)nConditional : 0.0; }
+    };
+
+    explicit MapRevalidationTable(size_t nMaxEntries = kDefaultMaxEntries);
+
+    MapRevalidationTable(const MapRevalidationTable&) = delete;
+    MapRevalidationTable& operator=(const MapRevalidationTable&) = delete;
+
+    // call before the first Classify
+    void SetPolicy(const MapRevalidationPolicy& policy);
+    MapRevalidationPolicy Policy() const;
+
+    // remember the validators for key, replacing any it had.  When the
+    // table is full the map fetched longest ago is forgotten.
+    void Set(const MapRequestKey& key, const MapValidators& validators);
+
+    // the validators for key.  Returns false if there are none.
+    bool Get(const MapRequestKey& key, MapValidators& validatorsOut) const;
+
+    // how the map for key may be used now, counted in the stats.  A map
+    // the table doesn't know is FRESH: it was just downloaded, or it came
+    // from somewhere that keeps no validators.
+    MapFreshness Classify(const MapRequestKey& key, int64_t nNow);
+
+    // the same, without counting it, for a caller deciding who should
+    MapFreshness Peek(const MapRequestKey& key, int64_t nNow) const;
+
+    // claim key for revalidation in the background, so it is only
+    // revalidated once at a time.  Returns false if it already is being.
+    bool BeginRevalidation(const MapRequestKey& key);
+    void EndRevalidation(const MapRequestKey& key);
+
+    // claim up to nMax maps that are no longer fresh and aren't being
+    // revalidated, those that went stale first first, for a background sweep
+    std::vector<MapRequestKey> TakeDue(int64_t nNow, size_t nMax);
+
+    // what the conditional request for a map of nBytes came to.
+    // bWasDecoded is true if a 304 let the decoded map be used as it was.
+    void RecordNotModified(uint64_t nBytes, bool bWasDecoded);
+    void RecordModified(uint64_t nBytes);
+
+    void Remove(const MapRequestKey& key);
+    void Clear();
+
+    size_t Count() const;
+
+    Stats GetStats() const;
+
+    // the stats, one line, UTF-8
+    std::string FormatStats() const;
+
+    // and as JSON
+    std::string StatsToJson() const;
+
+private:
+    struct Entry
+    {
+        MapValidators   validators;
+        bool            bRevalidating = false;
+    };
+
+    typedef std::unordered_map<MapRequestKey, Entry, MapRequestKeyHash> EntryMap;
+
+    MapRevalidationPolicy   m_policy;
+    size_t                  m_nMaxEntries;
+
+    mutable std::mutex      m_mutex;        // protects m_policy and m_entries
+    EntryMap                m_entries;
+
+    std::atomic<uint64_t>   m_nFresh;
+    std::atomic<uint64_t>   m_nStale;
+    std::atomic<uint64_t>   m_nExpired;
+    std::atomic<uint64_t>   m_nNotModified;
+    std::atomic<uint64_t>   m_nModified;
+    std::atomic<uint64_t>   m_nBytesSaved;
+    std::atomic<uint64_t>   m_nBytesDownloaded;
+    std::atomic<uint64_t>   m_nDecodesSaved;
+    std::atomic<uint64_t>   m_nBackground;
+};
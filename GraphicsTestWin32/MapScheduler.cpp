@@ -0,0 +1,493 @@
+// MapScheduler.cpp : One pool of worker threads for every kind of map job.
+//
+#include "MapScheduler.h"
+
+#include <cinttypes>
+#include <cstdio>
+
+namespace
+{
+    // the scheduler and worker the current thread belongs to, if any, so
+    // a job that submits another can keep it on its own worker
+    thread_local const void* t_pScheduler = nullptr;
+    thread_local size_t t_nWorker = 0;
+}
+
+const char* MapPriorityName(MapPriority priority)
+{
+    switch (priority)
+    {
+    case MapPriority::VISIBLE:
+        return "visible";
+
+    case MapPriority::NEAR_VISIBLE:
+        return "near-visible";
+
+    case MapPriority::PREFETCH:
+        return "prefetch";
+
+    case MapPriority::REVALIDATE:
+        return "revalidate";
+    }
+
+    return "unknown";
+}
+
+MapScheduler::MapScheduler(unsigned int nWorkers, ThreadHook onThreadStart, ThreadHook onThreadStop)
+    : m_onThreadStart(std::move(onThreadStart)),
+      m_onThreadStop(std::move(onThreadStop)),
+      m_nNextJobId(1),
+      m_nNextWorker(0),
+      m_nQueuedJobs(0),
+      m_bShutdown(false),
+      m_bStopping(false)
+{
+    if (nWorkers == 0)
+    {
+        nWorkers = 1;
+    }
+
+    // every worker's queues exist before any worker looks at them
+    for (unsigned int i = 0; i < nWorkers; i++)
+    {
+        m_workers.emplace_back(new Worker());
+    }
+
+    for (unsigned int i = 0; i < nWorkers; i++)
+    {
+        m_workers[i]->thread = std::thread(&MapScheduler::WorkerLoop, this, (size_t)i);
+    }
+}
+
+MapScheduler::~MapScheduler()
+{
+    Shutdown();
+}
+
+void MapScheduler::SetMaxRunning(MapPriority priority, unsigned int nMax)
+{
+    m_priorities[(size_t)priority].nMaxRunning = nMax;
+}
+
+uint64_t MapScheduler::Submit(MapPriority priority, Job job, CancelHandler onCancelled)
+{
+    std::shared_lock<std::shared_mutex> lifetime(m_lifetimeMutex);
+
+    if (m_bShutdown)
+    {
+        return 0;
+    }
+
+    std::shared_ptr<JobState> pJob = std::make_shared<JobState>();
+
+    pJob->nId = m_nNextJobId.fetch_add(1, std::memory_order_relaxed);
+    pJob->job = std::move(job);
+    pJob->onCancelled = std::move(onCancelled);
+    pJob->queuedAt = Clock::now();
+    pJob->priority.store((int)priority, std::memory_order_relaxed);
+
+    {
+        JobShard& shard = ShardOf(pJob->nId);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.jobs[pJob->nId] = pJob;
+    }
+
+    m_priorities[(size_t)priority].nSubmitted.fetch_add(1, std::memory_order_relaxed);
+    m_nQueuedJobs.fetch_add(1, std::memory_order_relaxed);
+
+    uint64_t nId = pJob->nId;
+
+    Enqueue(priority, Entry{ std::move(pJob), 0 });
+
+    return nId;
+}
+
+bool MapScheduler::Reprioritize(uint64_t jobId, MapPriority priority)
+{
+    std::shared_ptr<JobState> pJob = FindJob(jobId);
+
+    if (!pJob || JOB_QUEUED != pJob->state.load(std::memory_order_acquire))
+    {
+        return false;
+    }
+
+    if ((int)priority == pJob->priority.load(std::memory_order_relaxed))
+    {
+        return true;
+    }
+
+    // the entry at the old priority is stale from now on, and is thrown
+    // away when a worker reaches it
+    uint32_t nGeneration = pJob->generation.fetch_add(1, std::memory_order_acq_rel) + 1;
+
+    pJob->priority.store((int)priority, std::memory_order_relaxed);
+    m_priorities[(size_t)priority].nMovedIn.fetch_add(1, std::memory_order_relaxed);
+
+    Enqueue(priority, Entry{ std::move(pJob), nGeneration });
+
+    return true;
+}
+
+bool MapScheduler::Cancel(uint64_t jobId)
+{
+    std::shared_ptr<JobState> pJob = FindJob(jobId);
+
+    if (!pJob)
+    {
+        return false;
+    }
+
+    int nState = JOB_QUEUED;
+
+    if (pJob->state.compare_exchange_strong(nState, JOB_FINISHED, std::memory_order_acq_rel))
+    {
+        // it never started, and never will: its entries are stale now
+        m_nQueuedJobs.fetch_sub(1, std::memory_order_relaxed);
+        m_priorities[pJob->priority.load(std::memory_order_relaxed)].nCancelled.fetch_add(1, std::memory_order_relaxed);
+
+        ForgetJob(jobId);
+
+        // let go of what the job holds now, not when its entries are reached
+        CancelHandler onCancelled = std::move(pJob->onCancelled);
+        pJob->job = nullptr;
+
+        if (onCancelled)
+        {
+            onCancelled(jobId);
+        }
+
+        return true;
+    }
+
+    if (JOB_RUNNING == nState)
+    {
+        pJob->token.Cancel();
+        return true;
+    }
+
+    return false;
+}
+
+void MapScheduler::Shutdown()
+{
+    {
+        std::unique_lock<std::shared_mutex> lifetime(m_lifetimeMutex);
+
+        if (m_bShutdown)
+        {
+            return;
+        }
+
+        m_bShutdown = true;
+    }
+
+    // nothing more can be queued, so cancel what is
+    std::vector<uint64_t> jobIds;
+
+    for (JobShard& shard : m_shards)
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        for (const auto& job : shard.jobs)
+        {
+            jobIds.push_back(job.first);
+        }
+    }
+
+    for (uint64_t jobId : jobIds)
+    {
+        Cancel(jobId);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_sleepMutex);
+        m_bStopping = true;
+    }
+
+    m_sleepCv.notify_all();
+
+    for (std::unique_ptr<Worker>& pWorker : m_workers)
+    {
+        if (pWorker->thread.joinable())
+        {
+            pWorker->thread.join();
+        }
+    }
+}
+
+size_t MapScheduler::QueuedCount() const
+{
+    return m_nQueuedJobs.load(std::memory_order_relaxed);
+}
+
+MapScheduler::Stats MapScheduler::GetStats() const
+{
+    Stats stats;
+
+    for (size_t i = 0; i < kMapPriorityCount; i++)
+    {
+        const PriorityCounters& counters = m_priorities[i];
+        ClassStats& classStats = stats.classes[i];
+
+        classStats.nSubmitted = counters.nSubmitted.load(std::memory_order_relaxed);
+        classStats.nStarted = counters.nStarted.load(std::memory_order_relaxed);
+        classStats.nCancelled = counters.nCancelled.load(std::memory_order_relaxed);
+        classStats.nMovedIn = counters.nMovedIn.load(std::memory_order_relaxed);
+        classStats.nStolen = counters.nStolen.load(std::memory_order_relaxed);
+        classStats.queuedUs = counters.queuedUs.TakeSnapshot();
+    }
+
+    return stats;
+}
+
+std::string MapScheduler::FormatStats() const
+{
+    Stats stats = GetStats();
+    std::string strStats;
+
+    for (size_t i = 0; i < kMapPriorityCount; i++)
+    {
+        const ClassStats& classStats = stats.classes[i];
+        char szLine[256];
+
+        snprintf(szLine, sizeof(szLine),
+            "Scheduler %s: %" PRIu64 " submitted, %" PRIu64 " started, %" PRIu64 " cancelled, %" PRIu64
+            " moved in, %" PRIu64 " stolen; queued %.1f ms on average, %.1f ms p99\n",
+            MapPriorityName((MapPriority)i), classStats.nSubmitted, classStats.nStarted, classStats.nCancelled,
+            classStats.nMovedIn, classStats.nStolen, classStats.queuedUs.Mean() / 1000.0,
+            classStats.queuedUs.ValueAtPercentile(99) / 1000.0);
+
+        strStats += szLine;
+    }
+
+    return strStats;
+}
+
+std::shared_ptr<MapScheduler::JobState> MapScheduler::FindJob(uint64_t jobId)
+{
+    JobShard& shard = ShardOf(jobId);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    auto it = shard.jobs.find(jobId);
+
+    return (it == shard.jobs.end()) ? std::shared_ptr<JobState>() : it->second;
+}
+
+void MapScheduler::ForgetJob(uint64_t jobId)
+{
+    JobShard& shard = ShardOf(jobId);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    shard.jobs.erase(jobId);
+}
+
+void MapScheduler::Enqueue(MapPriority priority, Entry entry)
+{
+    size_t nWorker = (t_pScheduler == this) ? t_nWorker :
+        m_nNextWorker.fetch_add(1, std::memory_order_relaxed) % m_workers.size();
+
+    Worker& worker = *m_workers[nWorker];
+
+    // counted before it is queued, so the count is never less than the
+    // entries there are, and a worker never gives up on one it missed
+    m_priorities[(size_t)priority].nQueued.fetch_add(1, std::memory_order_acq_rel);
+
+    {
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.queues[(size_t)priority].push_back(std::move(entry));
+    }
+
+    WakeWorker();
+}
+
+void MapScheduler::WakeWorker()
+{
+    // taking the mutex orders this against a worker deciding to wait, so
+    // the notification can't fall between its check and its wait
+    {
+        std::lock_guard<std::mutex> lock(m_sleepMutex);
+    }
+
+    m_sleepCv.notify_one();
+}
+
+bool MapScheduler::HasRunnableWork() const
+{
+    for (const PriorityCounters& counters : m_priorities)
+    {
+        if (counters.nQueued.load(std::memory_order_acquire) > 0 &&
+            (0 == counters.nMaxRunning || counters.nRunning.load(std::memory_order_acquire) < counters.nMaxRunning))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool MapScheduler::TakeJob(size_t nWorker, std::shared_ptr<JobState>& pJobOut, size_t& nPriorityOut)
+{
+    for (size_t nPriority = 0; nPriority < kMapPriorityCount; nPriority++)
+    {
+        PriorityCounters& counters = m_priorities[nPriority];
+
+        if (0 == counters.nQueued.load(std::memory_order_acquire))
+        {
+            continue;
+        }
+
+        // claim a running slot first, so a limited priority never runs
+        // more than its limit however many workers look at once
+        unsigned int nRunning = counters.nRunning.load(std::memory_order_relaxed);
+
+        do
+        {
+            if (0 != counters.nMaxRunning && nRunning >= counters.nMaxRunning)
+            {
+                break;
+            }
+        } while (!counters.nRunning.compare_exchange_weak(nRunning, nRunning + 1, std::memory_order_acq_rel));
+
+        if (0 != counters.nMaxRunning && nRunning >= counters.nMaxRunning)
+        {
+            continue;
+        }
+
+        Entry entry;
+        bool bStolen = false;
+
+        while (PopEntry(nWorker, nPriority, entry, bStolen))
+        {
+            counters.nQueued.fetch_sub(1, std::memory_order_acq_rel);
+
+            // an entry left behind by Reprioritize or Cancel is thrown away
+            int nState = JOB_QUEUED;
+
+            if (entry.generation == entry.pJob->generation.load(std::memory_order_acquire) &&
+                entry.pJob->state.compare_exchange_strong(nState, JOB_RUNNING, std::memory_order_acq_rel))
+            {
+                m_nQueuedJobs.fetch_sub(1, std::memory_order_relaxed);
+
+                if (bStolen)
+                {
+                    counters.nStolen.fetch_add(1, std::memory_order_relaxed);
+                }
+
+                pJobOut = std::move(entry.pJob);
+                nPriorityOut = nPriority;
+
+                return true;
+            }
+        }
+
+        // nothing after all, so the slot goes back, and a worker that
+        // passed this priority by because of it may want another look
+        counters.nRunning.fetch_sub(1, std::memory_order_acq_rel);
+
+        if (0 != counters.nMaxRunning && counters.nQueued.load(std::memory_order_acquire) > 0)
+        {
+            WakeWorker();
+        }
+    }
+
+    return false;
+}
+
+bool MapScheduler::PopEntry(size_t nWorker, size_t nPriority, Entry& entryOut, bool& bStolenOut)
+{
+    // the oldest of our own, so they run in the order they came
+    {
+        Worker& worker = *m_workers[nWorker];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        std::deque<Entry>& queue = worker.queues[nPriority];
+
+        if (!queue.empty())
+        {
+            entryOut = std::move(queue.front());
+            queue.pop_front();
+            bStolenOut = false;
+
+            return true;
+        }
+    }
+
+    // the newest of someone else's, the one that would wait longest there
+    for (size_t i = 1; i < m_workers.size(); i++)
+    {
+        Worker& victim = *m_workers[(nWorker + i) % m_workers.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        std::deque<Entry>& queue = victim.queues[nPriority];
+
+        if (!queue.empty())
+        {
+            entryOut = std::move(queue.back());
+            queue.pop_back();
+            bStolenOut = true;
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void MapScheduler::WorkerLoop(size_t nWorker)
+{
+    t_pScheduler = this;
+    t_nWorker = nWorker;
+
+    if (m_onThreadStart)
+    {
+        m_onThreadStart();
+    }
+
+    for (;;)
+    {
+        std::shared_ptr<JobState> pJob;
+        size_t nPriority = 0;
+
+        if (TakeJob(nWorker, pJob, nPriority))
+        {
+            PriorityCounters& counters = m_priorities[nPriority];
+
+            counters.nStarted.fetch_add(1, std::memory_order_relaxed);
+            counters.queuedUs.Record(MapMetrics::MicrosecondsBetween(pJob->queuedAt, Clock::now()));
+
+            pJob->job(pJob->nId, pJob->token);
+
+            // the job's captures go now, even if stale entries still
+            // point at it
+            pJob->job = nullptr;
+            pJob->onCancelled = nullptr;
+            pJob->state.store(JOB_FINISHED, std::memory_order_release);
+
+            ForgetJob(pJob->nId);
+
+            counters.nRunning.fetch_sub(1, std::memory_order_acq_rel);
+
+            // a job of a limited priority may have been waiting for this slot
+            if (0 != counters.nMaxRunning && counters.nQueued.load(std::memory_order_acquire) > 0)
+            {
+                WakeWorker();
+            }
+
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(m_sleepMutex);
+
+        m_sleepCv.wait(lock, [this] { return m_bStopping || HasRunnableWork(); });
+
+        if (m_bStopping)
+        {
+            break;
+        }
+    }
+
+    if (m_onThreadStop)
+    {
+        m_onThreadStop();
+    }
+
+    t_pScheduler = nullptr;
+}
@@ -0,0 +1,257 @@
+// MapScheduler.h : One pool of worker threads for every kind of map job.
+//
+// The program used to give each kind of background work its own
+// MapFetchQueue and its own threads: two for the maps the user is looking
+// at, four for /prefetch and one for revalidation.  None of them knew
+// about the others, so a map the user had just selected could wait for a
+// connection behind prefetches of maps nobody had asked for, and a
+// thread kept for one kind of work sat idle while another had a queue.
+//
+// MapScheduler runs them all on one set of threads, in priority order:
+// what is on screen now, then what is about to be, then prefetches, then
+// background revalidation.  A job never starts while a job of a higher
+// priority is waiting for a thread.  A queued job can be moved to another
+// priority, as tiles scroll into or out of view, or cancelled, as the user
+// moves on, without waiting for it to reach the front.
+//
+// Each worker has a queue for each priority.  Jobs submitted from outside
+// the pool are dealt out to the workers in turn, and a job submitted by a
+// running job goes on its own worker's queue.  A worker takes the oldest
+// job of the highest priority from its own queues, and when it has none
+// of that priority, steals the newest from another worker, which is the
+// one that would otherwise wait longest.  So the workers only contend
+// when one has run out of work.
+//
+// Moving or cancelling a queued job doesn't search the queues for it.  A
+// moved job is queued again at its new priority, and a cancelled one is
+// marked, and the entries left behind are thrown away when a worker
+// reaches them.
+//
+// A priority can be limited to some number of running jobs, so that, say,
+// revalidation never holds more than one connection however idle the
+// pool is.  Per priority, the scheduler counts what it has run, and how
+// long jobs waited for a thread.
+//
+// MapScheduler has no Windows dependencies.
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "MapMetrics.h"
+
+// shared between whoever queued a job and the job while it runs
+class MapFetchCancelToken
+{
+public:
+    MapFetchCancelToken() : m_pbCancelled(std::make_shared<std::atomic<bool>>(false)) {}
+
+    bool IsCancelled() const { return m_pbCancelled->load(std::memory_order_acquire); }
+    void Cancel() const { m_pbCancelled->store(true, std::memory_order_release); }
+
+    // the raw flag, for code that polls it in a tight loop
+    const std::atomic<bool>* Flag() const { return m_pbCancelled.get(); }
+
+private:
+    std::shared_ptr<std::atomic<bool>> m_pbCancelled;
+};
+
+// which jobs go first, most urgent first
+enum class MapPriority
+{
+    VISIBLE,            // on screen now, the user is waiting for it
+    NEAR_VISIBLE,       // just off screen, the user is about to want it
+    PREFETCH,           // might be wanted later
+    REVALIDATE,         // already shown, checking it is still right
+};
+
+const size_t kMapPriorityCount = 4;
+
+// "visible", "near-visible", "prefetch" or "revalidate"
+const char* MapPriorityName(MapPriority priority);
+
+class MapScheduler
+{
+public:
+    // runs on a worker thread.  token is set if the job is cancelled while
+    // it runs, and the job should give up as soon as it can.
+    typedef std::function<void(uint64_t jobId, const MapFetchCancelToken& token)> Job;
+
+    // called instead of the job if it is cancelled before it starts, on
+    // the thread that cancelled it
+    typedef std::function<void(uint64_t jobId)> CancelHandler;
+
+    // called on each worker thread as it starts and stops, e.g. for CoInitializeEx
+    typedef std::function<void()> ThreadHook;
+
+    // one priority's counts
+    struct ClassStats
+    {
+        uint64_t    nSubmitted = 0;
+        uint64_t    nStarted = 0;
+        uint64_t    nCancelled = 0;         // before they started
+        uint64_t    nMovedIn = 0;           // queued jobs moved to this priority
+        uint64_t    nStolen = 0;            // started by a worker they weren't queued on
+        MetricHistogram::Snapshot queuedUs; // from submitted to started
+    };
+
+    struct Stats
+    {
+        ClassStats  classes[kMapPriorityCount];
+    };
+
+    MapScheduler(unsigned int nWorkers = 4, ThreadHook onThreadStart = nullptr, ThreadHook onThreadStop = nullptr);
+    ~MapScheduler();
+
+    MapScheduler(const MapScheduler&) = delete;
+    MapScheduler& operator=(const MapScheduler&) = delete;
+
+    // run no more than nMax jobs of this priority at once, 0 for no limit.
+    // Call before submitting any.
+    void SetMaxRunning(MapPriority priority, unsigned int nMax);
+
+    // queue a job and return its id, or 0 if the scheduler is shut down
+    uint64_t Submit(MapPriority priority, Job job, CancelHandler onCancelled = nullptr);
+
+    // move a queued job to another priority.  Returns false if it has
+    // already started or finished.
+    bool Reprioritize(uint64_t jobId, MapPriority priority);
+
+    // cancel a job.  A queued job never starts, and its CancelHandler is
+    // called before this returns.  A running job has its token set.
+    // Returns false if it has already finished.
+    bool Cancel(uint64_t jobId);
+
+    // cancel every job, and wait for the workers to exit.  Jobs submitted
+    // from now on are refused.  Not from a job.
+    void Shutdown();
+
+    unsigned int WorkerCount() const { return (unsigned int)m_workers.size(); }
+
+    // the jobs queued and not yet started, of every priority
+    size_t QueuedCount() const;
+
+    Stats GetStats() const;
+
+    // the stats, one line a priority, UTF-8
+    std::string FormatStats() const;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    enum JobStateValue
+    {
+        JOB_QUEUED,
+        JOB_RUNNING,
+        JOB_FINISHED,
+    };
+
+    struct JobState
+    {
+        uint64_t                nId = 0;
+        Job                     job;
+        CancelHandler           onCancelled;
+        MapFetchCancelToken     token;
+        Clock::time_point       queuedAt;
+        std::atomic<int>        state{ JOB_QUEUED };
+        std::atomic<int>        priority{ 0 };          // a MapPriority, the latest it was queued at
+
+        // bumped each time the job is queued again at another priority.
+        // Only the entry with the latest generation may start it.
+        std::atomic<uint32_t>   generation{ 0 };
+    };
+
+    // a job's place in a worker's queue
+    struct Entry
+    {
+        std::shared_ptr<JobState>   pJob;
+        uint32_t                    generation = 0;
+    };
+
+    struct Worker
+    {
+        std::mutex          mutex;      // protects queues
+        std::deque<Entry>   queues[kMapPriorityCount];
+        std::thread         thread;
+    };
+
+    // the jobs that haven't finished, by id, split so that threads
+    // submitting and finishing different jobs rarely wait for each other
+    static const size_t kJobShards = 16;
+
+    struct JobShard
+    {
+        std::mutex          mutex;
+        std::unordered_map<uint64_t, std::shared_ptr<JobState>> jobs;
+    };
+
+    struct PriorityCounters
+    {
+        std::atomic<size_t>     nQueued{ 0 };       // entries in the workers' queues, stale ones too
+        std::atomic<unsigned>   nRunning{ 0 };
+        unsigned                nMaxRunning = 0;    // 0 for no limit
+        std::atomic<uint64_t>   nSubmitted{ 0 };
+        std::atomic<uint64_t>   nStarted{ 0 };
+        std::atomic<uint64_t>   nCancelled{ 0 };
+        std::atomic<uint64_t>   nMovedIn{ 0 };
+        std::atomic<uint64_t>   nStolen{ 0 };
+        MetricHistogram         queuedUs;
+    };
+
+    JobShard& ShardOf(uint64_t jobId) { return m_shards[jobId % kJobShards]; }
+    std::shared_ptr<JobState> FindJob(uint64_t jobId);
+    void ForgetJob(uint64_t jobId);
+
+    // put an entry on a worker's queue: this thread's own if it is one of
+    // our workers, otherwise the next in turn.  Wakes a worker to run it.
+    void Enqueue(MapPriority priority, Entry entry);
+
+    // wake a worker, if one is asleep, because there may be work for it
+    void WakeWorker();
+
+    // true if some priority has jobs queued and room to run one
+    bool HasRunnableWork() const;
+
+    // take the job the worker should run next, and claim a running slot
+    // for its priority.  Returns false if there is nothing it may run.
+    bool TakeJob(size_t nWorker, std::shared_ptr<JobState>& pJobOut, size_t& nPriorityOut);
+
+    // pop an entry of one priority, from the front of the worker's own
+    // queue or the back of another's
+    bool PopEntry(size_t nWorker, size_t nPriority, Entry& entryOut, bool& bStolenOut);
+
+    void WorkerLoop(size_t nWorker);
+
+    ThreadHook                  m_onThreadStart;
+    ThreadHook                  m_onThreadStop;
+
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    JobShard                    m_shards[kJobShards];
+    PriorityCounters            m_priorities[kMapPriorityCount];
+
+    std::atomic<uint64_t>       m_nNextJobId;
+    std::atomic<size_t>         m_nNextWorker;
+    std::atomic<size_t>         m_nQueuedJobs;      // submitted and neither started nor cancelled
+
+    // held shared by Submit and exclusively by Shutdown, so no job can be
+    // queued after Shutdown has cancelled what was there
+    std::shared_mutex           m_lifetimeMutex;
+    bool                        m_bShutdown;
+
+    // where idle workers wait
+    mutable std::mutex          m_sleepMutex;
+    std::condition_variable     m_sleepCv;
+    bool                        m_bStopping;        // protected by m_sleepMutex
+};
@@ -0,0 +1,959 @@
+// MapSharedCache.cpp : Decoded maps shared by every instance of the program.
+//
+#include "MapSharedCache.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <type_traits>
+
+#ifdef _WIN32
+#include "framework.h"
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+    const uint32_t kSegmentMagic = 0x534D5447;      // "GTMS"
+    const uint32_t kSegmentVersion = 2;
+
+    // SegmentHeader::state once the segment is set up.  It is 0 before.
+    const uint32_t kSegmentReady = 1;
+
+    // the smallest segment worth having
+    const size_t kMinSegmentBytes = 1024 * 1024;
+
+    // a slot for every 64 KB of ring, four for each tile, within limits
+    const size_t kDataBytesPerSlot = 64 * 1024;
+    const size_t kMinSlots = 256;
+    const size_t kMaxSlots = 64 * 1024;
+
+    // how many slots, from the one a key hashes to, it may be in
+    const uint32_t kProbeSlots = 8;
+
+    // entries, and the pixels in them, start on a cache line
+    const uint64_t kEntryAlignment = 64;
+
+    // the longest key, ETag or Last-Modified kept; anything longer isn't one
+    const size_t kMaxKeyLength = 1024;
+    const size_t kMaxValidatorLength = 1024;
+
+    // the widest or tallest map kept, far more than Bing Maps sends
+    const uint32_t kMaxMapDimension = 16 * 1024;
+
+    // how often a read that raced a writer is tried before it is a miss
+    const int kMaxReadAttempts = 4;
+
+    // how long an insert waits for another process to finish its own
+    const std::chrono::microseconds kWriterWait(2000);
+
+    // how long to wait for the process that made the segment to set it up
+    const std::chrono::milliseconds kSegmentWait(1000);
+
+    uint64_t AlignUp(uint64_t n, uint64_t nAlignment)
+    {
+        return (n + nAlignment - 1) / nAlignment * nAlignment;
+    }
+
+    // the hash a key is kept under.  0 marks an empty slot, so no key has it.
+    uint64_t SlotHash(const MapRequestKey& key)
+    {
+        uint64_t nHash = key.Hash();
+        return (0 == nHash) ? 1 : nHash;
+    }
+
+    uint32_t CurrentProcessId()
+    {
+#ifdef _WIN32
+        return (uint32_t)GetCurrentProcessId();
+#else
+        return (uint32_t)getpid();
+#endif
+    }
+
+    // when process nProcessId started, folded to 32 bits, which tells it
+    // from an earlier process that had the same id.  0 if we can't tell.
+    uint32_t ProcessStartToken(uint32_t nProcessId)
+    {
+#ifdef _WIN32
+        HANDLE hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, (DWORD)nProcessId);
+
+        if (NULL == hProcess)
+        {
+            return 0;
+        }
+
+        FILETIME ftCreation, ftExit, ftKernel, ftUser;
+        BOOL bTimes = GetProcessTimes(hProcess, &ftCreation, &ftExit, &ftKernel, &ftUser);
+
+        CloseHandle(hProcess);
+
+        if (!bTimes)
+        {
+            return 0;
+        }
+
+        uint64_t nStart = ((uint64_t)ftCreation.dwHighDateTime << 32) | ftCreation.dwLowDateTime;
+#else
+        // field 22 of /proc/<pid>/stat, in clock ticks since boot.  The
+        // command name, field 2, is in parentheses and may hold spaces, so
+        // the fields are counted from the last ')'.
+        char szPath[64];
+        snprintf(szPath, sizeof(szPath), "/proc/%u/stat", (unsigned)nProcessId);
+
+        FILE* pFile = fopen(szPath, "r");
+
+        if (!pFile)
+        {
+            return 0;
+        }
+
+        char szStat[1024];
+        size_t nRead = fread(szStat, 1, sizeof(szStat) - 1, pFile);
+
+        fclose(pFile);
+        szStat[nRead] = '\0';
+
+        const char* pField = strrchr(szStat, ')');
+
+        for (int nField = 2; pField && nField < 22; nField++)
+        {
+            pField = strchr(pField + 1, ' ');
+        }
+
+        unsigned long long nStart = 0;
+
+        if (!pField || 1 != sscanf(pField, " %llu", &nStart))
+        {
+            return 0;
+        }
+#endif
+
+        uint32_t nToken = (uint32_t)(nStart ^ (nStart >> 32));
+
+        return (0 == nToken) ? 1 : nToken;
+    }
+
+    // what the writer lock holds while process nProcessId, started at
+    // nStartToken, inserts
+    uint64_t WriterId(uint32_t nProcessId, uint32_t nStartToken)
+    {
+        return ((uint64_t)nStartToken << 32) | nProcessId;
+    }
+
+    // false only if we know the process has exited
+    bool IsProcessAlive(uint32_t nProcessId)
+    {
+#ifdef _WIN32
+        HANDLE hProcess = OpenProcess(SYNCHRONIZE, FALSE, (DWORD)nProcessId);
+
+        if (NULL == hProcess)
+        {
+            // it's there, we just may not look at it
+            return ERROR_ACCESS_DENIED == GetLastError();
+        }
+
+        DWORD dwWait = WaitForSingleObject(hProcess, 0);
+        CloseHandle(hProcess);
+
+        return WAIT_TIMEOUT == dwWait;
+#else
+        return 0 == kill((pid_t)nProcessId, 0) || EPERM == errno;
+#endif
+    }
+
+    // false only if we know the writer nWriterId has exited.  Its process id
+    // may have been given to another process since, which has a different
+    // start token.
+    bool IsWriterAlive(uint64_t nWriterId)
+    {
+        uint32_t nProcessId = (uint32_t)nWriterId;
+        uint32_t nStartToken = (uint32_t)(nWriterId >> 32);
+
+        if (!IsProcessAlive(nProcessId))
+        {
+            return false;
+        }
+
+        uint32_t nNowToken = (0 != nStartToken) ? ProcessStartToken(nProcessId) : 0;
+
+        return 0 == nNowToken || nNowToken == nStartToken;
+    }
+}
+
+// at the start of the segment.  Every field but the atomics is written once,
+// by the process that made the segment, before it sets state.
+struct MapSharedCache::SegmentHeader
+{
+    std::atomic<uint32_t>   state;              // kSegmentReady once the fields below are set
+    uint32_t                magic;              // kSegmentMagic
+    uint32_t                version;            // kSegmentVersion
+    uint32_t                nSlots;
+    uint64_t                nSegmentBytes;
+    uint64_t                nSlotsOffset;       // of the slot table, from the start of the segment
+    uint64_t                nDataOffset;        // of the ring
+    uint64_t                nDataBytes;
+
+    // the WriterId of the process inserting, 0 when none is
+    alignas(64) std::atomic<uint64_t> writerId;
+
+    // bytes written to the ring so far.  The next entry goes at
+    // nHead % nDataBytes, or at the start if it doesn't fit before the end.
+    std::atomic<uint64_t>   nHead;
+
+    // the serial of the last insert
+    std::atomic<uint64_t>   nSerial;
+};
+
+// where one key's entry is.  Readers load the fields between two loads of
+// sequence; only the process holding the writer lock stores them.
+struct alignas(64) MapSharedCache::Slot
+{
+    std::atomic<uint32_t>   sequence;           // odd while the slot or its entry is changing
+    std::atomic<uint32_t>   keyLength;
+    std::atomic<uint64_t>   keyHash;            // SlotHash of the key, 0 for an empty slot
+    std::atomic<uint64_t>   offset;             // of the entry, from the start of the ring
+    std::atomic<uint64_t>   entryBytes;
+    std::atomic<uint64_t>   serial;             // the oldest in a key's run is replaced first
+    std::atomic<int64_t>    fetchedAt;          // MapValidators::nFetchedAt
+    std::atomic<uint32_t>   width;
+    std::atomic<uint32_t>   height;
+    std::atomic<uint32_t>   eTagLength;
+    std::atomic<uint32_t>   lastModifiedLength;
+    std::atomic<uint32_t>   maxAgeSeconds;      // MapValidators::nMaxAgeSeconds
+};
+
+// the segment is shared between processes, so the atomics in it must not
+// need a lock that lives in one of them
+static_assert(std::atomic<uint32_t>::is_always_lock_free && std::atomic<uint64_t>::is_always_lock_free &&
+    std::atomic<int64_t>::is_always_lock_free, "MapSharedCache needs lock-free atomics");
+
+// an entry is the canonical key, the ETag and the Last-Modified date, and
+// then, at the next multiple of kEntryAlignment, the pixels, width * 4
+// bytes a row
+static uint64_t PixelOffset(uint64_t nKeyLength, uint64_t nETagLength, uint64_t nLastModifiedLength)
+{
+    return AlignUp(nKeyLength + nETagLength + nLastModifiedLength, kEntryAlignment);
+}
+
+MapSharedCache::MapSharedCache()
+    : m_pView(nullptr),
+      m_nViewBytes(0),
+      m_bCreated(false),
+      m_nProcessId(CurrentProcessId()),
+      m_nWriterId(WriterId(m_nProcessId, ProcessStartToken(m_nProcessId))),
+      m_pHeader(nullptr),
+      m_pSlots(nullptr),
+#ifdef _WIN32
+      m_hMapping(NULL),
+#endif
+      m_nHits(0),
+      m_nMisses(0),
+      m_nRetries(0),
+      m_nInserts(0),
+      m_nInsertsSkipped(0),
+      m_nEvictions(0),
+      m_nLocksTaken(0)
+{
+}
+
+MapSharedCache::~MapSharedCache()
+{
+    Close();
+}
+
+bool MapSharedCache::Open(const std::string& strName, size_t nSizeBytes)
+{
+    Close();
+
+    for (int nAttempt = 0; ; nAttempt++)
+    {
+        bool bStale = false;
+
+        if (!MapSegment(strName, (std::max)(nSizeBytes, kMinSegmentBytes), &bStale))
+        {
+            if (!bStale)
+            {
+                return false;
+            }
+        }
+        else
+        {
+            m_pHeader = static_cast<SegmentHeader*>(m_pView);
+
+            if (m_bCreated)
+            {
+                InitializeSegment(m_nViewBytes);
+                break;
+            }
+
+            if (WaitForSegment())
+            {
+                break;
+            }
+
+            Close();
+            bStale = true;
+        }
+
+#ifdef _WIN32
+        // the mapping goes with its last handle, so it can't be replaced
+        return false;
+#else
+        // a segment made by another build, or by a process that died
+        // making it, will never be any use.  Make a new one in its place;
+        // processes that have the old one mapped keep it until they close
+        // it.  Only once, in case another process is doing the same.
+        if (nAttempt > 0 || !Remove(strName))
+        {
+            return false;
+        }
+#endif
+    }
+
+    m_pSlots = reinterpret_cast<Slot*>(static_cast<uint8_t*>(m_pView) + m_pHeader->nSlotsOffset);
+
+    return true;
+}
+
+void MapSharedCache::Close()
+{
+    UnmapSegment();
+
+    m_pHeader = nullptr;
+    m_pSlots = nullptr;
+    m_bCreated = false;
+}
+
+void MapSharedCache::InitializeSegment(size_t nSizeBytes)
+{
+    size_t nSlots = (std::min)((std::max)(nSizeBytes / kDataBytesPerSlot, kMinSlots), kMaxSlots);
+
+    // the new segment is all zeros, which is every slot empty and the
+    // writer lock free, so only the layout needs filling in
+    m_pHeader->magic = kSegmentMagic;
+    m_pHeader->version = kSegmentVersion;
+    m_pHeader->nSlots = (uint32_t)nSlots;
+    m_pHeader->nSegmentBytes = nSizeBytes;
+    m_pHeader->nSlotsOffset = AlignUp(sizeof(SegmentHeader), kEntryAlignment);
+    m_pHeader->nDataOffset = AlignUp(m_pHeader->nSlotsOffset + nSlots * sizeof(Slot), 4096);
+    m_pHeader->nDataBytes = (nSizeBytes - m_pHeader->nDataOffset) / kEntryAlignment * kEntryAlignment;
+
+    m_pHeader->state.store(kSegmentReady, std::memory_order_release);
+}
+
+bool MapSharedCache::WaitForSegment()
+{
+    std::chrono::steady_clock::time_point tGiveUp = std::chrono::steady_clock::now() + kSegmentWait;
+
+    while (kSegmentReady != m_pHeader->state.load(std::memory_order_acquire))
+    {
+        if (std::chrono::steady_clock::now() > tGiveUp)
+        {
+            return false;
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    // made by another build, or it doesn't say what we mapped
+    return kSegmentMagic == m_pHeader->magic && kSegmentVersion == m_pHeader->version &&
+        m_pHeader->nSegmentBytes <= m_nViewBytes &&
+        m_pHeader->nDataOffset + m_pHeader->nDataBytes <= m_pHeader->nSegmentBytes &&
+        m_pHeader->nSlotsOffset + (uint64_t)m_pHeader->nSlots * sizeof(Slot) <= m_pHeader->nDataOffset &&
+        m_pHeader->nSlots > 0 && m_pHeader->nDataBytes > 0;
+}
+
+uint8_t* MapSharedCache::Data() const
+{
+    return static_cast<uint8_t*>(m_pView) + m_pHeader->nDataOffset;
+}
+
+MapImageHandle MapSharedCache::Find(const MapRequestKey& key, MapValidators* pValidatorsOut)
+{
+    if (!IsOpen())
+    {
+        return MapImageHandle();
+    }
+
+    std::string strKey = key.ToCanonicalString();
+    uint64_t nHash = SlotHash(key);
+    uint32_t nSlots = m_pHeader->nSlots;
+    uint64_t nDataBytes = m_pHeader->nDataBytes;
+    const uint8_t* pData = Data();
+
+    for (int nAttempt = 0; nAttempt < kMaxReadAttempts; nAttempt++)
+    {
+        // a slot we couldn't read because a writer was changing it
+        bool bRaced = false;
+
+        for (uint32_t nProbe = 0; nProbe < kProbeSlots; nProbe++)
+        {
+            Slot& slot = m_pSlots[(nHash + nProbe) % nSlots];
+
+            uint32_t nSequence = slot.sequence.load(std::memory_order_acquire);
+
+            if (nSequence & 1)
+            {
+                bRaced = true;
+                continue;
+            }
+
+            if (slot.keyHash.load(std::memory_order_relaxed) != nHash)
+            {
+                continue;
+            }
+
+            uint64_t nKeyLength = slot.keyLength.load(std::memory_order_relaxed);
+            uint64_t nETagLength = slot.eTagLength.load(std::memory_order_relaxed);
+            uint64_t nLastModifiedLength = slot.lastModifiedLength.load(std::memory_order_relaxed);
+            uint64_t nOffset = slot.offset.load(std::memory_order_relaxed);
+            uint64_t nEntryBytes = slot.entryBytes.load(std::memory_order_relaxed);
+            uint32_t nWidth = slot.width.load(std::memory_order_relaxed);
+            uint32_t nHeight = slot.height.load(std::memory_order_relaxed);
+
+            // the fields may be half from one entry and half from another
+            // if a writer has been here since, so check they make sense
+            // before going near the ring with them
+            uint64_t nPixelOffset = PixelOffset(nKeyLength, nETagLength, nLastModifiedLength);
+            uint64_t nRowBytes = (uint64_t)nWidth * 4;
+
+            bool bSane = nKeyLength <= kMaxKeyLength && nETagLength <= kMaxValidatorLength &&
+                nLastModifiedLength <= kMaxValidatorLength && nOffset <= nDataBytes &&
+                nEntryBytes <= nDataBytes - nOffset && nWidth > 0 && nHeight > 0 &&
+                nWidth <= kMaxMapDimension && nHeight <= kMaxMapDimension &&
+                nPixelOffset + nRowBytes * nHeight <= nEntryBytes;
+
+            const uint8_t* pEntry = pData + nOffset;
+            bool bMatches = bSane && nKeyLength == strKey.size() && 0 == memcmp(pEntry, strKey.data(), strKey.size());
+
+            std::shared_ptr<MapImage> pImage;
+            MapValidators validators;
+
+            if (bMatches)
+            {
+                pImage = MapImage::Create((int)nWidth, (int)nHeight);
+
+                if (!pImage)
+                {
+                    break;
+                }
+
+                // copying while a writer may be overwriting is the point of
+                // a seqlock: what was copied is only used if the sequence
+                // number says nothing changed
+                const uint8_t* pPixels = pEntry + nPixelOffset;
+
+                for (int y = 0; y < pImage->Height(); y++)
+                {
+                    memcpy(pImage->Row(y), pPixels + (uint64_t)y * nRowBytes, (size_t)nRowBytes);
+                }
+
+                const char* pValidators = reinterpret_cast<const char*>(pEntry) + nKeyLength;
+
+                validators.strETag.assign(pValidators, (size_t)nETagLength);
+                validators.strLastModified.assign(pValidators + nETagLength, (size_t)nLastModifiedLength);
+                validators.nFetchedAt = slot.fetchedAt.load(std::memory_order_relaxed);
+                validators.nMaxAgeSeconds = slot.maxAgeSeconds.load(std::memory_order_relaxed);
+            }
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            if (slot.sequence.load(std::memory_order_relaxed) != nSequence)
+            {
+                bRaced = true;
+                continue;
+            }
+
+            // another key with the same hash
+            if (!bMatches)
+            {
+                continue;
+            }
+
+            if (pValidatorsOut)
+            {
+                *pValidatorsOut = std::move(validators);
+            }
+
+            m_nHits.fetch_add(1, std::memory_order_relaxed);
+
+            return pImage;
+        }
+
+        if (!bRaced)
+        {
+            break;
+        }
+
+        m_nRetries.fetch_add(1, std::memory_order_relaxed);
+        std::this_thread::yield();
+    }
+
+    m_nMisses.fetch_add(1, std::memory_order_relaxed);
+
+    return MapImageHandle();
+}
+
+bool MapSharedCache::Insert(const MapRequestKey& key, const MapImage& image, const MapValidators* pValidators)
+{
+    if (!IsOpen())
+    {
+        return false;
+    }
+
+    std::string strKey = key.ToCanonicalString();
+    uint64_t nHash = SlotHash(key);
+
+    // a map with no validators, or ones that are too long to be real,
+    // can't be revalidated, only downloaded again
+    MapValidators validators;
+
+    if (pValidators)
+    {
+        validators = *pValidators;
+    }
+
+    if (validators.strETag.size() > kMaxValidatorLength)
+    {
+        validators.strETag.clear();
+    }
+
+    if (validators.strLastModified.size() > kMaxValidatorLength)
+    {
+        validators.strLastModified.clear();
+    }
+
+    uint64_t nRowBytes = (uint64_t)image.Width() * 4;
+    uint64_t nPixelOffset = PixelOffset(strKey.size(), validators.strETag.size(), validators.strLastModified.size());
+    uint64_t nEntryBytes = AlignUp(nPixelOffset + nRowBytes * (uint64_t)image.Height(), kEntryAlignment);
+    uint64_t nDataBytes = m_pHeader->nDataBytes;
+
+    // a map that would push out most of the others isn't worth it
+    if (strKey.size() > kMaxKeyLength || image.Width() <= 0 || image.Height() <= 0 ||
+        image.Width() > (int)kMaxMapDimension || image.Height() > (int)kMaxMapDimension || nEntryBytes > nDataBytes / 4)
+    {
+        m_nInsertsSkipped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    if (!LockWriter())
+    {
+        m_nInsertsSkipped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    uint32_t nSlots = m_pHeader->nSlots;
+    uint8_t* pData = Data();
+
+    // the entry goes at the head of the ring, or at the start of it if it
+    // doesn't fit before the end
+    uint64_t nHead = m_pHeader->nHead.load(std::memory_order_relaxed);
+    uint64_t nStart = nHead % nDataBytes;
+
+    if (nStart + nEntryBytes > nDataBytes)
+    {
+        nHead += nDataBytes - nStart;
+        nStart = 0;
+    }
+
+    // evict the entries it will overwrite, before it does
+    for (uint32_t i = 0; i < nSlots; i++)
+    {
+        Slot& slot = m_pSlots[i];
+
+        if (0 == slot.keyHash.load(std::memory_order_relaxed))
+        {
+            continue;
+        }
+
+        uint64_t nOffset = slot.offset.load(std::memory_order_relaxed);
+        uint64_t nBytes = slot.entryBytes.load(std::memory_order_relaxed);
+
+        if (nOffset < nStart + nEntryBytes && nStart < nOffset + nBytes)
+        {
+            ClearSlot(slot);
+            m_nEvictions.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // the key's own slot if it is already here, or else an empty one, or
+    // else the one inserted longest ago
+    Slot* pTarget = nullptr;
+    Slot* pEmpty = nullptr;
+    Slot* pOldest = nullptr;
+
+    for (uint32_t nProbe = 0; nProbe < kProbeSlots; nProbe++)
+    {
+        Slot& slot = m_pSlots[(nHash + nProbe) % nSlots];
+        uint64_t nSlotHash = slot.keyHash.load(std::memory_order_relaxed);
+
+        if (0 == nSlotHash)
+        {
+            pEmpty = pEmpty ? pEmpty : &slot;
+            continue;
+        }
+
+        if (nSlotHash == nHash && slot.keyLength.load(std::memory_order_relaxed) == strKey.size() &&
+            0 == memcmp(pData + slot.offset.load(std::memory_order_relaxed), strKey.data(), strKey.size()))
+        {
+            pTarget = &slot;
+            break;
+        }
+
+        if (!pOldest || slot.serial.load(std::memory_order_relaxed) < pOldest->serial.load(std::memory_order_relaxed))
+        {
+            pOldest = &slot;
+        }
+    }
+
+    if (!pTarget)
+    {
+        pTarget = pEmpty ? pEmpty : pOldest;
+    }
+    else
+    {
+        pOldest = nullptr;
+    }
+
+    // another key pushed out of its slot
+    if (pTarget == pOldest)
+    {
+        m_nEvictions.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // readers of the slot see it change from here until the last store
+    uint32_t nSequence = pTarget->sequence.load(std::memory_order_relaxed);
+
+    pTarget->sequence.store(nSequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    uint8_t* pEntry = pData + nStart;
+
+    memcpy(pEntry, strKey.data(), strKey.size());
+    memcpy(pEntry + strKey.size(), validators.strETag.data(), validators.strETag.size());
+    memcpy(pEntry + strKey.size() + validators.strETag.size(), validators.strLastModified.data(),
+        validators.strLastModified.size());
+
+    for (int y = 0; y < image.Height(); y++)
+    {
+        memcpy(pEntry + nPixelOffset + (uint64_t)y * nRowBytes, image.Row(y), (size_t)nRowBytes);
+    }
+
+    pTarget->keyHash.store(nHash, std::memory_order_relaxed);
+    pTarget->keyLength.store((uint32_t)strKey.size(), std::memory_order_relaxed);
+    pTarget->eTagLength.store((uint32_t)validators.strETag.size(), std::memory_order_relaxed);
+    pTarget->lastModifiedLength.store((uint32_t)validators.strLastModified.size(), std::memory_order_relaxed);
+    pTarget->offset.store(nStart, std::memory_order_relaxed);
+    pTarget->entryBytes.store(nEntryBytes, std::memory_order_relaxed);
+    pTarget->width.store((uint32_t)image.Width(), std::memory_order_relaxed);
+    pTarget->height.store((uint32_t)image.Height(), std::memory_order_relaxed);
+    pTarget->fetchedAt.store(validators.nFetchedAt, std::memory_order_relaxed);
+    pTarget->maxAgeSeconds.store(validators.nMaxAgeSeconds, std::memory_order_relaxed);
+    pTarget->serial.store(m_pHeader->nSerial.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+    pTarget->sequence.store(nSequence + 2, std::memory_order_release);
+
+    m_pHeader->nHead.store(nHead + nEntryBytes, std::memory_order_relaxed);
+
+    UnlockWriter();
+
+    m_nInserts.fetch_add(1, std::memory_order_relaxed);
+
+    return true;
+}
+
+void MapSharedCache::ClearSlot(Slot& slot)
+{
+    uint32_t nSequence = slot.sequence.load(std::memory_order_relaxed);
+
+    slot.sequence.store(nSequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot.keyHash.store(0, std::memory_order_relaxed);
+
+    slot.sequence.store(nSequence + 2, std::memory_order_release);
+}
+
+bool MapSharedCache::LockWriter()
+{
+    std::chrono::steady_clock::time_point tGiveUp = std::chrono::steady_clock::now() + kWriterWait;
+
+    for (;;)
+    {
+        uint64_t nOwner = 0;
+
+        if (m_pHeader->writerId.compare_exchange_weak(nOwner, m_nWriterId,
+            std::memory_order_acquire, std::memory_order_relaxed))
+        {
+            return true;
+        }
+
+        // the writer died holding the lock.  Whatever it was changing is
+        // emptied, since it may be only half written.  Another thread of
+        // this process holding it is alive, whatever its start token says.
+        if (0 != nOwner && (uint32_t)nOwner != m_nProcessId && !IsWriterAlive(nOwner))
+        {
+            if (m_pHeader->writerId.compare_exchange_strong(nOwner, m_nWriterId,
+                std::memory_order_acquire, std::memory_order_relaxed))
+            {
+                for (uint32_t i = 0; i < m_pHeader->nSlots; i++)
+                {
+                    Slot& slot = m_pSlots[i];
+                    uint32_t nSequence = slot.sequence.load(std::memory_order_relaxed);
+
+                    if (nSequence & 1)
+                    {
+                        slot.keyHash.store(0, std::memory_order_relaxed);
+                        slot.sequence.store(nSequence + 1, std::memory_order_release);
+                    }
+                }
+
+                m_nLocksTaken.fetch_add(1, std::memory_order_relaxed);
+
+                return true;
+            }
+
+            continue;
+        }
+
+        if (std::chrono::steady_clock::now() > tGiveUp)
+        {
+            return false;
+        }
+
+        std::this_thread::yield();
+    }
+}
+
+void MapSharedCache::UnlockWriter()
+{
+    m_pHeader->writerId.store(0, std::memory_order_release);
+}
+
+MapSharedCache::Stats MapSharedCache::GetStats() const
+{
+    Stats stats;
+
+    stats.nHits = m_nHits.load(std::memory_order_relaxed);
+    stats.nMisses = m_nMisses.load(std::memory_order_relaxed);
+    stats.nRetries = m_nRetries.load(std::memory_order_relaxed);
+    stats.nInserts = m_nInserts.load(std::memory_order_relaxed);
+    stats.nInsertsSkipped = m_nInsertsSkipped.load(std::memory_order_relaxed);
+    stats.nEvictions = m_nEvictions.load(std::memory_order_relaxed);
+    stats.nLocksTaken = m_nLocksTaken.load(std::memory_order_relaxed);
+
+    if (IsOpen())
+    {
+        stats.nSizeBytes = (size_t)m_pHeader->nSegmentBytes;
+
+        for (uint32_t i = 0; i < m_pHeader->nSlots; i++)
+        {
+            if (0 != m_pSlots[i].keyHash.load(std::memory_order_relaxed))
+            {
+                stats.nEntries++;
+            }
+        }
+    }
+
+    return stats;
+}
+
+std::string MapSharedCache::FormatStats() const
+{
+    Stats stats = GetStats();
+    char szStats[512];
+
+    snprintf(szStats, sizeof(szStats),
+        "Shared map cache: %zu maps in %zu MB; %" PRIu64 " hits, %" PRIu64 " misses (%.0f%% hits), %" PRIu64
+        " reads retried; %" PRIu64 " inserts, %" PRIu64 " skipped, %" PRIu64 " evictions\n",
+        stats.nEntries, stats.nSizeBytes / (1024 * 1024), stats.nHits, stats.nMisses, stats.HitRate() * 100.0,
+        stats.nRetries, stats.nInserts, stats.nInsertsSkipped, stats.nEvictions);
+
+    return szStats;
+}
+
+#ifdef _WIN32
+
+bool MapSharedCache::MapSegment(const std::string& strName, size_t nSizeBytes, bool* pbStale)
+{
+    *pbStale = false;
+
+    // Local\ is this logon session's namespace, the instances of one user
+    std::wstring strMappingName = L"Local\\" + Utf8ToWide(strName);
+
+    HANDLE hMapping = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+        (DWORD)((uint64_t)nSizeBytes >> 32), (DWORD)nSizeBytes, strMappingName.c_str());
+
+    if (NULL == hMapping)
+    {
+        return false;
+    }
+
+    m_bCreated = ERROR_ALREADY_EXISTS != GetLastError();
+    m_hMapping = hMapping;
+
+    // a mapping that already exists keeps the size its maker gave it
+    m_pView = MapViewOfFile(hMapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+
+    if (NULL == m_pView)
+    {
+        UnmapSegment();
+        return false;
+    }
+
+    MEMORY_BASIC_INFORMATION info;
+
+    if (0 == VirtualQuery(m_pView, &info, sizeof(info)))
+    {
+        UnmapSegment();
+        return false;
+    }
+
+    m_nViewBytes = m_bCreated ? nSizeBytes : info.RegionSize;
+
+    return true;
+}
+
+void MapSharedCache::UnmapSegment()
+{
+    if (m_pView)
+    {
+        UnmapViewOfFile(m_pView);
+        m_pView = nullptr;
+    }
+
+    if (m_hMapping)
+    {
+        CloseHandle(m_hMapping);
+        m_hMapping = NULL;
+    }
+
+    m_nViewBytes = 0;
+}
+
+bool MapSharedCache::Remove(const std::string& strName)
+{
+    (void)strName;
+    return true;
+}
+
+#else
+
+bool MapSharedCache::MapSegment(const std::string& strName, size_t nSizeBytes, bool* pbStale)
+{
+    std::string strPath = "/" + strName;
+
+    *pbStale = false;
+
+    // whoever makes the object sizes it; everyone else takes its size
+    int fd = shm_open(strPath.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+
+    if (fd >= 0)
+    {
+        if (0 != ftruncate(fd, (off_t)nSizeBytes))
+        {
+            close(fd);
+            shm_unlink(strPath.c_str());
+            return false;
+        }
+
+        m_bCreated = true;
+    }
+    else if (EEXIST == errno)
+    {
+        fd = shm_open(strPath.c_str(), O_RDWR | O_CLOEXEC, 0);
+
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        // the process that made it may not have sized it yet
+        std::chrono::steady_clock::time_point tGiveUp = std::chrono::steady_clock::now() + kSegmentWait;
+        struct stat st;
+
+        for (;;)
+        {
+            if (0 != fstat(fd, &st))
+            {
+                close(fd);
+                return false;
+            }
+
+            if (st.st_size > 0)
+            {
+                break;
+            }
+
+            if (std::chrono::steady_clock::now() > tGiveUp)
+            {
+                // its maker died before sizing it
+                close(fd);
+                *pbStale = true;
+                return false;
+            }
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        // too small to be a segment, and to read a header from safely
+        if ((size_t)st.st_size < kMinSegmentBytes)
+        {
+            close(fd);
+            *pbStale = true;
+            return false;
+        }
+
+        nSizeBytes = (size_t)st.st_size;
+        m_bCreated = false;
+    }
+    else
+    {
+        return false;
+    }
+
+    void* pView = mmap(nullptr, nSizeBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    // the mapping keeps the object open
+    close(fd);
+
+    if (MAP_FAILED == pView)
+    {
+        return false;
+    }
+
+    m_pView = pView;
+    m_nViewBytes = nSizeBytes;
+
+    return true;
+}
+
+void MapSharedCache::UnmapSegment()
+{
+    if (m_pView)
+    {
+        munmap(m_pView, m_nViewBytes);
+        m_pView = nullptr;
+    }
+
+    m_nViewBytes = 0;
+}
+
+bool MapSharedCache::Remove(const std::string& strName)
+{
+    std::string strPath = "/" + strName;
+
+    return 0 == shm_unlink(strPath.c_str()) || ENOENT == errno;
+}
+
+#endif
@@ -0,0 +1,155 @@
+// MapSharedCache.h : Decoded maps shared by every instance of the program.
+//
+// Each instance keeps its decoded maps in its own MapTieredCache, so
+// several instances on one machine each download and decode the same maps.
+// MapSharedCache keeps decoded maps in a named shared memory segment that
+// any instance can open, so a map one instance has decoded is shown by the
+// next without touching the network or the decoder.  It is a cache: any
+// instance may find a map gone, and fetches it as it would have anyway.
+//
+// The segment holds a table of slots and a ring of entries.  An entry is a
+// map's canonical key, its MapValidators and its 32bpp pixels, written at
+// the head of the ring; the entries the head runs over are evicted.  A slot
+// says where a key's entry is.  Keys are found by hash, in a short run of
+// slots starting at the hash's own, so nothing has to be moved when an
+// entry goes.
+//
+// Readers take no lock.  Each slot has a sequence number that is odd while
+// the slot, or the entry it points to, is being changed.  A reader copies
+// the entry out and then checks that the sequence number is even and
+// unchanged, and if not it tries again (a seqlock).  A reader can't hold
+// up a writer, or another process, however slow it is or if it dies.
+//
+// One process at a time inserts.  The writer lock is a word in the
+// segment holding the writer's process id and when that process started.
+// A process that finds it held waits a little and then gives up the
+// insert, since another instance is probably inserting the same map.  If
+// the writer has died, the lock is taken from it, and any slot it was half
+// way through changing is emptied.  The start time is what shows it has
+// died once its process id has been given to another process.
+//
+// The segment is a Windows named file mapping backed by the paging file,
+// which goes when the last instance closes it, or a POSIX shared memory
+// object, which stays until it is removed with Remove.  Whichever instance
+// opens it first sets its size.  A POSIX object left by another build, or
+// by a process that died making it, is removed and made again.  MapSharedCache has no Windows
+// dependencies outside MapSharedCache.cpp.
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "MapBitmapStore.h"
+#include "MapRequest.h"
+#include "MapRevalidation.h"
+
+class MapSharedCache
+{
+public:
+    // a dozen full-size static maps and a couple of hundred tiles
+    static const size_t kDefaultSizeBytes = 64 * 1024 * 1024;
+
+    // what this process has done with the segment, and what is in it
+    struct Stats
+    {
+        uint64_t    nHits = 0;
+        uint64_t    nMisses = 0;
+        uint64_t    nRetries = 0;           // reads that raced a writer and were tried again
+        uint64_t    nInserts = 0;
+        uint64_t    nInsertsSkipped = 0;    // the writer lock was busy, or the map too big
+        uint64_t    nEvictions = 0;         // entries this process's inserts ran over
+        uint64_t    nLocksTaken = 0;        // writer locks taken from a process that had died
+        size_t      nEntries = 0;           // in the segment, from every process
+        size_t      nSizeBytes = 0;
+
+        double HitRate() const
+        {
+            uint64_t nLookups = nHits + nMisses;
+            return (nLookups > 0) ? (double)nHits / (double)nLookups : 0.0;
+        }
+    };
+
+    MapSharedCache();
+    ~MapSharedCache();
+
+    MapSharedCache(const MapSharedCache&) = delete;
+    MapSharedCache& operator=(const MapSharedCache&) = delete;
+
+    // open the segment called strName, letters, digits and dots, creating
+    // it nSizeBytes long if no other process has.  Returns false if it
+    // can't be opened, or on Windows if another build made it or another
+    // process made it and never finished.
+    bool Open(const std::string& strName, size_t nSizeBytes = kDefaultSizeBytes);
+
+    // unmap the segment.  The maps stay for other processes.
+    void Close();
+
+    bool IsOpen() const { return m_pView != nullptr; }
+
+    // true if this process made the segment rather than finding it
+    bool Created() const { return m_bCreated; }
+
+    // a copy of the map for key, or an empty handle.  pValidatorsOut, if
+    // given, is set to what the server said about it.
+    MapImageHandle Find(const MapRequestKey& key, MapValidators* pValidatorsOut = nullptr);
+
+    // add or replace the map for key, evicting the oldest entries to make
+    // room.  Returns false if it wasn't added, because another process was
+    // inserting or the map is more than a quarter of the segment.
+    bool Insert(const MapRequestKey& key, const MapImage& image, const MapValidators* pValidators = nullptr);
+
+    Stats GetStats() const;
+
+    // the stats, one line, UTF-8
+    std::string FormatStats() const;
+
+    // remove the segment called strName, for when no process will open it
+    // again.  Processes that have it open keep it until they close it.
+    // Does nothing on Windows, where it goes with its last handle.
+    static bool Remove(const std::string& strName);
+
+private:
+    struct SegmentHeader;
+    struct Slot;
+
+    // *pbStale is set if a segment was there but can't be one of ours
+    bool MapSegment(const std::string& strName, size_t nSizeBytes, bool* pbStale);
+    void UnmapSegment();
+
+    // fill in the header of a segment this process made
+    void InitializeSegment(size_t nSizeBytes);
+
+    // wait for the process that made the segment to fill in its header
+    bool WaitForSegment();
+
+    bool LockWriter();
+    void UnlockWriter();
+
+    // empty a slot, so readers stop finding it
+    void ClearSlot(Slot& slot);
+
+    uint8_t* Data() const;
+
+    void*               m_pView;
+    size_t              m_nViewBytes;
+    bool                m_bCreated;
+    uint32_t            m_nProcessId;
+    uint64_t            m_nWriterId;    // what the writer lock holds while this process inserts
+
+    SegmentHeader*      m_pHeader;
+    Slot*               m_pSlots;
+
+#ifdef _WIN32
+    void*               m_hMapping;     // HANDLE, kept as void* to keep windows.h out of this header
+#endif
+
+    std::atomic<uint64_t> m_nHits;
+    std::atomic<uint64_t> m_nMisses;
+    std::atomic<uint64_t> m_nRetries;
+    std::atomic<uint64_t> m_nInserts;
+    std::atomic<uint64_t> m_nInsertsSkipped;
+    std::atomic<uint64_t> m_nEvictions;
+    std::atomic<uint64_t> m_nLocksTaken;
+};
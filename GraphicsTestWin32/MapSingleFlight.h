@@ -0,0 +1,272 @@
+// MapSingleFlight.h : One download per map, however many threads want it.
+//
+// The fetch queue, the prefetch queue and any future loader each run their
+// own worker threads, and nothing stopped two of them downloading the same
+// map at the same time; the map store only helps once a download has
+// finished.  Run routes every fetch through a table of fetches in flight.
+// The first thread to ask for a key runs the fetch; any thread asking for
+// an equal key while it runs waits for it and shares its result.
+//
+// A key whose fetch failed is remembered for a short while, and asking for
+// it again in that time fails straight away instead of going back to the
+// network.  A fetch that was cancelled is not a failure: the threads that
+// were waiting on it run it again themselves.  Nor is one that threw; the
+// exception goes on to the thread that ran the fetch, and the threads
+// waiting on it are woken to run it again.
+//
+// MapSingleFlight has no Windows dependencies.
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "MapRequest.h"
+
+enum class MapSingleFlightStatus
+{
+    FETCHED,            // this thread ran the fetch, and it succeeded
+    SHARED,             // another thread's fetch of the same key succeeded
+    FAILED,             // the fetch failed
+    FAILED_RECENTLY,    // a fetch of this key failed a moment ago, not tried again
+    CANCELLED,          // this thread's cancel flag was set
+};
+
+inline bool MapSingleFlightSucceeded(MapSingleFlightStatus status)
+{
+    return MapSingleFlightStatus::FETCHED == status || MapSingleFlightStatus::SHARED == status;
+}
+
+template <typename TValue>
+class MapSingleFlight
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    // fetches one map into valueOut.  Returns false on failure.
+    typedef std::function<bool(TValue& valueOut)> Fetch;
+
+    // how many fetches of each kind there have been
+    struct Stats
+    {
+        uint64_t    nFetched = 0;
+        uint64_t    nShared = 0;
+        uint64_t    nFailed = 0;
+        uint64_t    nFailedRecently = 0;
+        uint64_t    nCancelled = 0;
+    };
+
+    explicit MapSingleFlight(Clock::duration failureTtl = std::chrono::seconds(10))
+        : m_failureTtl(failureTtl)
+    {
+    }
+
+    MapSingleFlight(const MapSingleFlight&) = delete;
+    MapSingleFlight& operator=(const MapSingleFlight&) = delete;
+
+    // fetch key with fetch, unless another thread is already fetching it,
+    // in which case wait for that fetch and copy its result to valueOut.
+    // pbCancel, if given, is polled while waiting; the fetch is expected
+    // to poll the same flag itself.
+    MapSingleFlightStatus Run(const MapRequestKey& key, const std::atomic<bool>* pbCancel,
+        const Fetch& fetch, TValue& valueOut)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        for (;;)
+        {
+            if (IsCancelled(pbCancel))
+            {
+                return Count(MapSingleFlightStatus::CANCELLED);
+            }
+
+            if (FailedRecently(key))
+            {
+                return Count(MapSingleFlightStatus::FAILED_RECENTLY);
+            }
+
+            auto it = m_flights.find(key);
+
+            if (it == m_flights.end())
+            {
+                break;
+            }
+
+            // someone else is fetching it, wait for them
+            std::shared_ptr<Flight> pFlight = it->second;
+
+            while (!pFlight->bDone && !IsCancelled(pbCancel))
+            {
+                // the cancel flag can't wake us, so look at it now and then
+                m_cv.wait_for(lock, kCancelPollInterval);
+            }
+
+            if (!pFlight->bDone)
+            {
+                return Count(MapSingleFlightStatus::CANCELLED);
+            }
+
+            if (MapSingleFlightStatus::FETCHED == pFlight->status)
+            {
+                valueOut = pFlight->value;
+                return Count(MapSingleFlightStatus::SHARED);
+            }
+
+            if (MapSingleFlightStatus::FAILED == pFlight->status)
+            {
+                return Count(MapSingleFlightStatus::FAILED);
+            }
+
+            // the thread fetching it gave up, go round again and maybe
+            // become the one that fetches it
+        }
+
+        std::shared_ptr<Flight> pFlight = std::make_shared<Flight>();
+        m_flights[key] = pFlight;
+
+        lock.unlock();
+
+        TValue value = TValue();
+        bool bSucceeded = false;
+
+        try
+        {
+            bSucceeded = fetch(value);
+        }
+        catch (...)
+        {
+            // land the flight as if cancelled, so the waiters don't wait
+            // forever and nothing is remembered as a failure
+            lock.lock();
+
+            Land(key, *pFlight, MapSingleFlightStatus::CANCELLED);
+            Count(MapSingleFlightStatus::FAILED);
+
+            throw;
+        }
+
+        lock.lock();
+
+        if (bSucceeded)
+        {
+            pFlight->value = value;
+            Land(key, *pFlight, MapSingleFlightStatus::FETCHED);
+        }
+        else if (IsCancelled(pbCancel))
+        {
+            Land(key, *pFlight, MapSingleFlightStatus::CANCELLED);
+        }
+        else
+        {
+            RememberFailure(key);
+            Land(key, *pFlight, MapSingleFlightStatus::FAILED);
+        }
+
+        valueOut = value;
+
+        return Count(pFlight->status);
+    }
+
+    Stats GetStats() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_stats;
+    }
+
+private:
+    // how often a waiting thread looks at its cancel flag
+    static constexpr std::chrono::milliseconds kCancelPollInterval{ 50 };
+
+    // failures beyond this many are pruned of the ones that have expired
+    static constexpr size_t kMaxFailures = 256;
+
+    struct Flight
+    {
+        bool                    bDone = false;
+        MapSingleFlightStatus   status = MapSingleFlightStatus::CANCELLED;
+        TValue                  value = TValue();
+    };
+
+    static bool IsCancelled(const std::atomic<bool>* pbCancel)
+    {
+        return pbCancel && pbCancel->load(std::memory_order_acquire);
+    }
+
+    // m_mutex is held
+    bool FailedRecently(const MapRequestKey& key)
+    {
+        auto it = m_failures.find(key);
+
+        if (it == m_failures.end())
+        {
+            return false;
+        }
+
+        if (Clock::now() < it->second)
+        {
+            return true;
+        }
+
+        m_failures.erase(it);
+
+        return false;
+    }
+
+    // m_mutex is held
+    void RememberFailure(const MapRequestKey& key)
+    {
+        Clock::time_point now = Clock::now();
+
+        if (m_failures.size() >= kMaxFailures)
+        {
+            for (auto it = m_failures.begin(); it != m_failures.end();)
+            {
+                it = (now < it->second) ? std::next(it) : m_failures.erase(it);
+            }
+        }
+
+        m_failures[key] = now + m_failureTtl;
+    }
+
+    // finish a flight and wake the threads waiting on it.  m_mutex is held.
+    void Land(const MapRequestKey& key, Flight& flight, MapSingleFlightStatus status)
+    {
+        flight.status = status;
+        flight.bDone = true;
+        m_flights.erase(key);
+
+        m_cv.notify_all();
+    }
+
+    // m_mutex is held
+    MapSingleFlightStatus Count(MapSingleFlightStatus status)
+    {
+        switch (status)
+        {
+        case MapSingleFlightStatus::FETCHED:            m_stats.nFetched++; break;
+        case MapSingleFlightStatus::SHARED:             m_stats.nShared++; break;
+        case MapSingleFlightStatus::FAILED:             m_stats.nFailed++; break;
+        case MapSingleFlightStatus::FAILED_RECENTLY:    m_stats.nFailedRecently++; break;
+        case MapSingleFlightStatus::CANCELLED:          m_stats.nCancelled++; break;
+        }
+
+        return status;
+    }
+
+    Clock::duration             m_failureTtl;
+
+    mutable std::mutex          m_mutex;
+    std::condition_variable     m_cv;
+
+    std::unordered_map<MapRequestKey, std::shared_ptr<Flight>, MapRequestKeyHash> m_flights;
+
+    // when each failure stops counting
+    std::unordered_map<MapRequestKey, Clock::time_point, MapRequestKeyHash> m_failures;
+
+    Stats                       m_stats;
+};
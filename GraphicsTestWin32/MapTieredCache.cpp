@@ -0,0 +1,130 @@
+// MapTieredCache.cpp : Maps in memory in two tiers, decoded and compressed.
+//
+#include "MapTieredCache.h"
+
+#include <cinttypes>
+#include <cstdio>
+
+namespace
+{
+    // one tier's stats as a JSON object
+    std::string TierToJson(const MapStoreStats& stats)
+    {
+        char szJson[512];
+
+        snprintf(szJson, sizeof(szJson),
+            "{\"hits\":%" PRIu64 ",\"misses\":%" PRIu64 ",\"hit_rate\":%.4f,\"evictions\":%" PRIu64
+            ",\"count\":%zu,\"bytes\":%zu,\"budget_bytes\":%zu}",
+            stats.nHits, stats.nMisses, stats.HitRate(), stats.nEvictions,
+            stats.nCount, stats.nTotalBytes, stats.nBudgetBytes);
+
+        return szJson;
+    }
+}
+
+MapTieredCache::MapTieredCache(size_t nDecodedBudgetBytes, size_t nCompressedBudgetBytes)
+    : m_decoded(nDecodedBudgetBytes),
+      m_compressed(nCompressedBudgetBytes),
+      m_nDecodeFailures(0)
+{
+}
+
+MapImageHandle MapTieredCache::Find(const MapRequestKey& key, MapCacheTier* pTierOut)
+{
+    MapCacheTier tier = MapCacheTier::DECODED;
+    MapImageHandle hImage = m_decoded.Find(key);
+
+    if (!hImage)
+    {
+        hImage = Decode(key);
+        tier = hImage ? MapCacheTier::COMPRESSED : MapCacheTier::NONE;
+    }
+
+    if (pTierOut)
+    {
+        *pTierOut = tier;
+    }
+
+    return hImage;
+}
+
+MapImageHandle MapTieredCache::Decode(const MapRequestKey& key)
+{
+    MapImageHandle hImage;
+    MapBytesHandle hBytes = m_compressed.Find(key);
+
+    if (!hBytes || !m_decoder)
+    {
+        return hImage;
+    }
+
+    MapMetrics::Clock::time_point start = MapMetrics::Clock::now();
+
+    if (!m_decoder(hBytes->data(), hBytes->size(), hImage) || !hImage)
+    {
+        // it will never decode, so don't keep it
+        m_nDecodeFailures.fetch_add(1, std::memory_order_relaxed);
+        m_compressed.Remove(key);
+
+        return MapImageHandle();
+    }
+
+    m_decodeUs.Record(MapMetrics::MicrosecondsBetween(start, MapMetrics::Clock::now()));
+
+    m_decoded.Insert(key, hImage);
+
+    return hImage;
+}
+
+void MapTieredCache::Insert(const MapRequestKey& key, const uint8_t* pData, size_t nSize, MapImageHandle hImage)
+{
+    m_compressed.Insert(key, pData, nSize);
+
+    if (hImage)
+    {
+        m_decoded.Insert(key, hImage);
+    }
+}
+
+void MapTieredCache::Remove(const MapRequestKey& key)
+{
+    m_decoded.Remove(key);
+    m_compressed.Remove(key);
+}
+
+void MapTieredCache::Clear()
+{
+    m_decoded.Clear();
+    m_compressed.Clear();
+}
+
+MapTieredCache::Stats MapTieredCache::GetStats() const
+{
+    Stats stats;
+
+    stats.decoded = m_decoded.GetStats();
+    stats.compressed = m_compressed.GetStats();
+    stats.nDecodeFailures = m_nDecodeFailures.load(std::memory_order_relaxed);
+    stats.decodeUs = m_decodeUs.TakeSnapshot();
+
+    return stats;
+}
+
+std::string MapTieredCache::StatsToJson() const
+{
+    Stats stats = GetStats();
+
+    char szDecode[512];
+
+    snprintf(szDecode, sizeof(szDecode),
+        "{\"count\":%" PRIu64 ",\"failures\":%" PRIu64 ",\"mean_us\":%.1f,\"p50_us\":%" PRIu64
+        ",\"p90_us\":%" PRIu64 ",\"p99_us\":%" PRIu64 ",\"max_us\":%" PRIu64 "}",
+        stats.decodeUs.nCount, stats.nDecodeFailures, stats.decodeUs.Mean(),
+        stats.decodeUs.ValueAtPercentile(50.0), stats.decodeUs.ValueAtPercentile(90.0),
+        stats.decodeUs.ValueAtPercentile(99.0), stats.decodeUs.nMax);
+
+    // the decoded tier never decodes, a hit there is free
+    return "{\"decoded\":" + TierToJson(stats.decoded) +
+        ",\"compressed\":" + TierToJson(stats.compressed) +
+        ",\"compressed_decode\":" + szDecode + "}\n";
+}
@@ -0,0 +1,98 @@
+// MapTieredCache.h : Maps in memory in two tiers, decoded and compressed.
+//
+// A decoded map is ready to paint but is 4 bytes a pixel; the JPEG it was
+// decoded from is a twentieth of that.  The cache keeps the JPEG of every
+// map it is given in a MapCompressedStore with a large budget, and only a
+// hot set of recently used maps decoded, in a MapBitmapStore with a small
+// one.  A map that has dropped out of the decoded tier is decoded again
+// from its JPEG when it is next wanted, which costs a few milliseconds
+// instead of a download.
+//
+// The decoded tier is used directly by code that must not decode, such as
+// painting on the UI thread; Decode is for the worker threads.  Each tier
+// counts its own hits and misses, and the cache times every decode.
+//
+// MapTieredCache has no Windows dependencies.  The decoder is passed in:
+// the Windows program decodes with WIC, the benchmarks with JpegDecoder.
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include "MapBitmapStore.h"
+#include "MapCompressedStore.h"
+#include "MapMetrics.h"
+#include "MapRequest.h"
+
+// where Find found a map
+enum class MapCacheTier
+{
+    NONE,           // in neither tier
+    DECODED,        // ready to paint
+    COMPRESSED,     // decoded from its JPEG just now
+};
+
+class MapTieredCache
+{
+public:
+    // decodes one map file.  Returns false if it can't.
+    typedef std::function<bool(const uint8_t* pData, size_t nSize, MapImageHandle& hImageOut)> Decoder;
+
+    // a handful of full-size static maps and a few hundred tiles decoded,
+    // and about a thousand maps compressed
+    static const size_t kDefaultDecodedBudgetBytes = 32 * 1024 * 1024;
+    static const size_t kDefaultCompressedBudgetBytes = MapCompressedStore::kDefaultBudgetBytes;
+
+    struct Stats
+    {
+        MapStoreStats               decoded;
+        MapStoreStats               compressed;
+        uint64_t                    nDecodeFailures = 0;
+        MetricHistogram::Snapshot   decodeUs;       // every decode out of the compressed tier
+    };
+
+    explicit MapTieredCache(size_t nDecodedBudgetBytes = kDefaultDecodedBudgetBytes,
+        size_t nCompressedBudgetBytes = kDefaultCompressedBudgetBytes);
+
+    MapTieredCache(const MapTieredCache&) = delete;
+    MapTieredCache& operator=(const MapTieredCache&) = delete;
+
+    // how to decode a map file.  Call once, before the first Decode or Find.
+    void SetDecoder(Decoder decoder) { m_decoder = std::move(decoder); }
+
+    MapBitmapStore& Decoded() { return m_decoded; }
+    MapCompressedStore& Compressed() { return m_compressed; }
+
+    // the map for key from the decoded tier, or else decoded from the
+    // compressed tier.  pTierOut, if given, is set to where it was found.
+    MapImageHandle Find(const MapRequestKey& key, MapCacheTier* pTierOut = nullptr);
+
+    // decode the map for key from the compressed tier and put it in the
+    // decoded tier.  Returns an empty handle if there is no file for key
+    // or it won't decode, in which case the file is dropped.
+    MapImageHandle Decode(const MapRequestKey& key);
+
+    // keep the file a map was decoded from and, if hImage is given, the
+    // decoded map too
+    void Insert(const MapRequestKey& key, const uint8_t* pData, size_t nSize, MapImageHandle hImage);
+
+    void Remove(const MapRequestKey& key);
+    void Clear();
+
+    Stats GetStats() const;
+
+    // the stats as JSON: each tier's hit rate, size and evictions, and the
+    // decode times, in microseconds
+    std::string StatsToJson() const;
+
+private:
+    MapBitmapStore          m_decoded;
+    MapCompressedStore      m_compressed;
+    Decoder                 m_decoder;
+
+    MetricHistogram         m_decodeUs;
+    std::atomic<uint64_t>   m_nDecodeFailures;
+};
@@ -0,0 +1,131 @@
+// MapUrl.cpp : The URLs maps and tiles are downloaded from.
+//
+#include "MapUrl.h"
+
+#include <cwchar>
+#include <cwctype>
+
+namespace
+{
+    // room for the longest URL there is, less the parts that vary in length
+    const size_t kUrlReserve = 128;
+
+    bool EqualsNoCase(const std::wstring& a, const wchar_t* b)
+    {
+        size_t i = 0;
+
+        for (; i < a.size() && b[i]; i++)
+        {
+            if (towlower(a[i]) != towlower(b[i]))
+            {
+                return false;
+            }
+        }
+
+        return i == a.size() && 0 == b[i];
+    }
+}
+
+wchar_t TileImageryCode(const std::wstring& strImagerySet)
+{
+    // each imagery set has a one letter code in the tile URL
+    if (EqualsNoCase(strImagerySet, L"AerialWithLabels"))
+    {
+        return L'h';
+    }
+
+    if (EqualsNoCase(strImagerySet, L"Aerial"))
+    {
+        return L'a';
+    }
+
+    if (EqualsNoCase(strImagerySet, L"Road"))
+    {
+        return L'r';
+    }
+
+    return 0;
+}
+
+bool BuildMapUrl(const MapRequestKey& key, std::wstring_view strBaseUrl,
+    std::wstring_view strBingMapsKey, std::pmr::wstring& strUrlOut)
+{
+    std::wstring_view strBase(strBaseUrl);
+
+    while (!strBase.empty() && L'/' == strBase.back())
+    {
+        strBase.remove_suffix(1);
+    }
+
+    // the numbers in the URL, formatted on the stack
+    wchar_t szNumbers[64];
+
+    strUrlOut.clear();
+    strUrlOut.reserve(kUrlReserve + key.imagerySet.size() + key.location.size() + strBingMapsKey.size());
+
+    if (key.IsTile())
+    {
+        // tiles are served without a key.  This is the imageUrl template
+        // the Bing Maps Imagery Metadata service returns for each imagery
+        // set, with the subdomain and quadkey filled in.
+        // https://docs.microsoft.com/en-us/bingmaps/rest-services/imagery/get-imagery-metadata
+        wchar_t chImagery = TileImageryCode(key.imagerySet);
+
+        if (0 == chImagery || key.location.empty())
+        {
+            return false;
+        }
+
+        if (strBase.empty())
+        {
+            // spread the tiles over the four tile servers, the same
+            // tile always coming from the same one
+            int nSubdomain = (key.location.back() - L'0') & 3;
+
+            swprintf(szNumbers, sizeof(szNumbers) / sizeof(szNumbers[0]), L"%d", nSubdomain);
+
+            strUrlOut.append(L"https://ecn.t").append(szNumbers).append(L".tiles.virtualearth.net");
+        }
+        else
+        {
+            strUrlOut.append(strBase);
+        }
+
+        strUrlOut.append(L"/tiles/").append(1, chImagery).append(key.location).append(L".jpeg?g=1");
+
+        return true;
+    }
+
+    // this query will return a .jpg image
+    // https://docs.microsoft.com/en-us/bingmaps/rest-services/imagery/get-a-static-map
+    if (strBase.empty())
+    {
+        strUrlOut.append(L"https://dev.virtualearth.net");
+    }
+    else
+    {
+        strUrlOut.append(strBase);
+    }
+
+    swprintf(szNumbers, sizeof(szNumbers) / sizeof(szNumbers[0]), L"?mapSize=%d,%d&key=", key.width, key.height);
+
+    strUrlOut.append(L"/REST/v1/Imagery/Map/").append(key.imagerySet).append(L"/").append(key.location)
+        .append(szNumbers).append(strBingMapsKey);
+
+    return true;
+}
+
+bool BuildMapUrl(const MapRequestKey& key, std::wstring_view strBaseUrl,
+    std::wstring_view strBingMapsKey, std::wstring& strUrlOut)
+{
+    std::pmr::wstring strUrl;
+
+    if (!BuildMapUrl(key, strBaseUrl, strBingMapsKey, strUrl))
+    {
+        return false;
+    }
+
+    strUrlOut.assign(strUrl.data(), strUrl.size());
+
+    return true;
+}
@@ -0,0 +1,36 @@
+// MapUrl.h : The URLs maps and tiles are downloaded from.
+//
+// Normally these are the Bing Maps REST service for static maps and the
+// Bing Maps tile servers for tiles.  Given a base URL, such as
+// http://127.0.0.1:8080, both are asked for from that server instead,
+// with the same paths and queries:
+//
+//      <base>/REST/v1/Imagery/Map/<imagery set>/<location>?mapSize=<w>,<h>&key=<key>
+//      <base>/tiles/<imagery letter><quadkey>.jpeg?g=1
+//
+// which is what the MockMapServer in Benchmarks serves, so the program
+// and the load tests can run without a network or a Bing Maps key.
+//
+// MapUrl has no Windows dependencies.
+#pragma once
+
+#include <memory_resource>
+#include <string>
+#include <string_view>
+
+#include "MapRequest.h"
+
+// the URL of the map or tile named by key, from strBaseUrl, or from Bing
+// Maps if it is empty.  A trailing '/' on strBaseUrl is ignored.  Returns
+// false if there is no such map, such as a tile of an imagery set that
+// has no tiles.  The URL is built in place in strUrlOut, so it is only
+// allocated from strUrlOut's memory resource, such as a MapRequestArena.
+bool BuildMapUrl(const MapRequestKey& key, std::wstring_view strBaseUrl,
+    std::wstring_view strBingMapsKey, std::pmr::wstring& strUrlOut);
+
+// the same, into an ordinary string
+bool BuildMapUrl(const MapRequestKey& key, std::wstring_view strBaseUrl,
+    std::wstring_view strBingMapsKey, std::wstring& strUrlOut);
+
+// the one letter code for an imagery set in a tile URL, or 0 if it has no tiles
+wchar_t TileImageryCode(const std::wstring& strImagerySet);
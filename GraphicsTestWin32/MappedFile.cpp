@@ -0,0 +1,183 @@
+// MappedFile.cpp : A read-only, memory-mapped view of a whole file.
+//
+#include "MappedFile.h"
+
+#include <utility>
+
+#ifdef _WIN32
+#include "framework.h"
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile()
+    : m_pView(nullptr),
+      m_nSize(0),
+#ifdef _WIN32
+      m_hFile(INVALID_HANDLE_VALUE),
+      m_hMapping(NULL)
+#else
+      m_fd(-1)
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+    Close();
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept
+    : MappedFile()
+{
+    Swap(other);
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept
+{
+    if (this != &other)
+    {
+        Close();
+        Swap(other);
+    }
+
+    return *this;
+}
+
+void MappedFile::Swap(MappedFile& other) noexcept
+{
+    std::swap(m_pView, other.m_pView);
+    std::swap(m_nSize, other.m_nSize);
+#ifdef _WIN32
+    std::swap(m_hFile, other.m_hFile);
+    std::swap(m_hMapping, other.m_hMapping);
+#else
+    std::swap(m_fd, other.m_fd);
+#endif
+}
+
+#ifdef _WIN32
+
+bool MappedFile::Open(const std::filesystem::path& path)
+{
+    Close();
+
+    // FILE_SHARE_DELETE lets the cache evict a file even while a view of it is mapped
+    m_hFile = CreateFileW(path.c_str(), GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL, NULL);
+
+    if (INVALID_HANDLE_VALUE == m_hFile)
+    {
+        return false;
+    }
+
+    LARGE_INTEGER liSize;
+
+    if (!GetFileSizeEx(m_hFile, &liSize) || liSize.QuadPart == 0 ||
+        (unsigned long long)liSize.QuadPart > (unsigned long long)SIZE_MAX)
+    {
+        Close();
+        return false;
+    }
+
+    m_hMapping = CreateFileMappingW(m_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+
+    if (NULL == m_hMapping)
+    {
+        Close();
+        return false;
+    }
+
+    m_pView = MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0);
+
+    if (NULL == m_pView)
+    {
+        Close();
+        return false;
+    }
+
+    m_nSize = (size_t)liSize.QuadPart;
+
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (m_pView)
+    {
+        UnmapViewOfFile(m_pView);
+        m_pView = nullptr;
+    }
+
+    if (m_hMapping)
+    {
+        CloseHandle(m_hMapping);
+        m_hMapping = NULL;
+    }
+
+    if (INVALID_HANDLE_VALUE != m_hFile)
+    {
+        CloseHandle(m_hFile);
+        m_hFile = INVALID_HANDLE_VALUE;
+    }
+
+    m_nSize = 0;
+}
+
+#else
+
+bool MappedFile::Open(const std::filesystem::path& path)
+{
+    Close();
+
+    m_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (m_fd < 0)
+    {
+        return false;
+    }
+
+    struct stat st;
+
+    if (fstat(m_fd, &st) != 0 || st.st_size <= 0)
+    {
+        Close();
+        return false;
+    }
+
+    void* pView = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+
+    if (MAP_FAILED == pView)
+    {
+        Close();
+        return false;
+    }
+
+    m_pView = pView;
+    m_nSize = (size_t)st.st_size;
+
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (m_pView)
+    {
+        munmap(m_pView, m_nSize);
+        m_pView = nullptr;
+    }
+
+    if (m_fd >= 0)
+    {
+        close(m_fd);
+        m_fd = -1;
+    }
+
+    m_nSize = 0;
+}
+
+#endif
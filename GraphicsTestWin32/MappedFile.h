@@ -0,0 +1,47 @@
+// MappedFile.h : A read-only, memory-mapped view of a whole file.
+//
+// Uses CreateFileMapping/MapViewOfFile on Windows and mmap elsewhere, so
+// code that reads cached maps can be built and tested on either.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    MappedFile(MappedFile&& other) noexcept;
+    MappedFile& operator=(MappedFile&& other) noexcept;
+
+    // map the whole of the file read-only.  Returns false if the file
+    // does not exist, is empty, or could not be mapped.
+    bool Open(const std::filesystem::path& path);
+
+    // unmap the file
+    void Close();
+
+    bool IsOpen() const { return m_pView != nullptr; }
+
+    const uint8_t* Data() const { return static_cast<const uint8_t*>(m_pView); }
+    size_t Size() const { return m_nSize; }
+
+private:
+    void Swap(MappedFile& other) noexcept;
+
+    void*   m_pView;
+    size_t  m_nSize;
+
+#ifdef _WIN32
+    void*   m_hFile;            // HANDLE, kept as void* to keep windows.h out of this header
+    void*   m_hMapping;         // HANDLE
+#else
+    int     m_fd;
+#endif
+};
@@ -0,0 +1,119 @@
+// PixelBlit.cpp : Fills and copies rectangles of 32bpp BGRX pixels.
+//
+#include "PixelBlit.h"
+
+#include <algorithm>
+#include <cstring>
+
+PixelRect IntersectPixelRect(const PixelRect& a, const PixelRect& b)
+{
+    PixelRect rc;
+
+    rc.left = std::max(a.left, b.left);
+    rc.top = std::max(a.top, b.top);
+    rc.right = std::min(a.right, b.right);
+    rc.bottom = std::min(a.bottom, b.bottom);
+
+    if (rc.IsEmpty())
+    {
+        rc.left = rc.top = rc.right = rc.bottom = 0;
+    }
+
+    return rc;
+}
+
+PixelRect UnionPixelRect(const PixelRect& a, const PixelRect& b)
+{
+    if (a.IsEmpty())
+    {
+        return b;
+    }
+
+    if (b.IsEmpty())
+    {
+        return a;
+    }
+
+    PixelRect rc;
+
+    rc.left = std::min(a.left, b.left);
+    rc.top = std::min(a.top, b.top);
+    rc.right = std::max(a.right, b.right);
+    rc.bottom = std::max(a.bottom, b.bottom);
+
+    return rc;
+}
+
+PixelBuffer PixelBufferOf(MapImage& image)
+{
+    PixelBuffer buffer = { image.Pixels(), image.Width(), image.Height(), image.Stride() };
+    return buffer;
+}
+
+ConstPixelBuffer PixelBufferOf(const MapImage& image)
+{
+    ConstPixelBuffer buffer = { image.Pixels(), image.Width(), image.Height(), image.Stride() };
+    return buffer;
+}
+
+void FillPixels(const PixelBuffer& dest, const PixelRect& clip, const PixelRect& rect, uint32_t color)
+{
+    PixelRect rc = IntersectPixelRect(IntersectPixelRect(rect, clip), dest.Bounds());
+
+    if (rc.IsEmpty())
+    {
+        return;
+    }
+
+    for (int y = rc.top; y < rc.bottom; y++)
+    {
+        uint32_t* pDest = reinterpret_cast<uint32_t*>(dest.Row(y)) + rc.left;
+
+        std::fill(pDest, pDest + rc.Width(), color);
+    }
+}
+
+void FillPixelsAround(const PixelBuffer& dest, const PixelRect& clip, const PixelRect& inner, uint32_t color)
+{
+    PixelRect rc = IntersectPixelRect(clip, dest.Bounds());
+    PixelRect hole = IntersectPixelRect(inner, rc);
+
+    if (hole.IsEmpty())
+    {
+        FillPixels(dest, rc, rc, color);
+        return;
+    }
+
+    // the bands above and below the hole, full width, and the
+    // pieces to its left and right
+    PixelRect above = { rc.left, rc.top, rc.right, hole.top };
+    PixelRect below = { rc.left, hole.bottom, rc.right, rc.bottom };
+    PixelRect left = { rc.left, hole.top, hole.left, hole.bottom };
+    PixelRect right = { hole.right, hole.top, rc.right, hole.bottom };
+
+    FillPixels(dest, rc, above, color);
+    FillPixels(dest, rc, below, color);
+    FillPixels(dest, rc, left, color);
+    FillPixels(dest, rc, right, color);
+}
+
+void BlitPixels(const PixelBuffer& dest, const PixelRect& clip, int x, int y, const ConstPixelBuffer& source)
+{
+    PixelRect placed = { x, y, x + source.width, y + source.height };
+    PixelRect rc = IntersectPixelRect(IntersectPixelRect(placed, clip), dest.Bounds());
+
+    if (rc.IsEmpty())
+    {
+        return;
+    }
+
+    size_t nRowBytes = (size_t)rc.Width() * 4;
+
+    for (int row = rc.top; row < rc.bottom; row++)
+    {
+        const uint8_t* pSource = source.Row(row - y) + (size_t)(rc.left - x) * 4;
+        uint8_t* pDest = dest.Row(row) + (size_t)rc.left * 4;
+
+        memcpy(pDest, pSource, nRowBytes);
+    }
+}
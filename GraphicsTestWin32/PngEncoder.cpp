@@ -0,0 +1,159 @@
+// PngEncoder.cpp : An ImageEncoder for PNG, built on zlib.
+//
+#include "PngEncoder.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <zlib.h>
+
+namespace
+{
+    const uint8_t kPngSignature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+    // PNG's filter types
+    const uint8_t kPngFilterUp = 2;
+
+    void PutBE32(uint8_t* p, uint32_t n)
+    {
+        p[0] = (uint8_t)(n >> 24);
+        p[1] = (uint8_t)(n >> 16);
+        p[2] = (uint8_t)(n >> 8);
+        p[3] = (uint8_t)n;
+    }
+
+    // fill in the length and CRC of the chunk whose length field is at
+    // nStart and whose data ends at nEnd, where the CRC goes
+    void FinishChunk(std::vector<uint8_t>& data, size_t nStart, size_t nEnd)
+    {
+        uint32_t nLength = (uint32_t)(nEnd - nStart - 8);
+        PutBE32(&data[nStart], nLength);
+
+        // the CRC covers the chunk type and data, not the length
+        uLong nCrc = crc32(0, &data[nStart + 4], (uInt)(nLength + 4));
+        PutBE32(&data[nEnd], (uint32_t)nCrc);
+    }
+
+    class PngEncoder : public ImageEncoder
+    {
+    public:
+        explicit PngEncoder(int nLevel)
+            : m_nLevel(std::min(std::max(nLevel, 0), 9))
+        {
+        }
+
+        const char* Name() const override { return "zlib"; }
+
+        MapImageFormat Format() const override { return MapImageFormat::PNG; }
+
+        bool Encode(const MapImage& image, std::vector<uint8_t>& dataOut) override
+        {
+            size_t nRowBytes = (size_t)image.Width() * 3;
+            uint64_t nRawBytes = (uint64_t)(nRowBytes + 1) * (uint64_t)image.Height();
+
+            if (image.Width() <= 0 || image.Height() <= 0 || nRawBytes > 0x7FFFFFFF)
+            {
+                return false;
+            }
+
+            z_stream stream;
+            memset(&stream, 0, sizeof(stream));
+
+            if (Z_OK != deflateInit(&stream, m_nLevel))
+            {
+                return false;
+            }
+
+            // room for everything at once: the signature, IHDR, one IDAT
+            // as big as deflate could possibly make it, and IEND
+            size_t nIdatStart = sizeof(kPngSignature) + 25;
+            size_t nBound = deflateBound(&stream, (uLong)nRawBytes);
+
+            dataOut.resize(nIdatStart + 8 + nBound + 4 + 12);
+
+            memcpy(dataOut.data(), kPngSignature, sizeof(kPngSignature));
+
+            uint8_t* pIhdr = dataOut.data() + sizeof(kPngSignature);
+            memcpy(pIhdr + 4, "IHDR", 4);
+            PutBE32(pIhdr + 8, (uint32_t)image.Width());
+            PutBE32(pIhdr + 12, (uint32_t)image.Height());
+            pIhdr[16] = 8;      // bits per sample
+            pIhdr[17] = 2;      // truecolor
+            pIhdr[18] = 0;      // deflate
+            pIhdr[19] = 0;      // adaptive filtering
+            pIhdr[20] = 0;      // not interlaced
+            FinishChunk(dataOut, sizeof(kPngSignature), nIdatStart - 4);
+
+            memcpy(&dataOut[nIdatStart + 4], "IDAT", 4);
+
+            stream.next_out = &dataOut[nIdatStart + 8];
+            stream.avail_out = (uInt)nBound;
+
+            // this row and the last in RGB, and this row filtered.  The
+            // row above the first is taken to be black.
+            std::vector<uint8_t> rows(nRowBytes * 2, 0);
+            std::vector<uint8_t> filtered(nRowBytes + 1);
+            uint8_t* pRow = rows.data();
+            uint8_t* pPrevious = rows.data() + nRowBytes;
+
+            filtered[0] = kPngFilterUp;
+
+            bool bSucceeded = true;
+
+            for (int y = 0; y < image.Height() && bSucceeded; y++)
+            {
+                const uint8_t* pSource = image.Row(y);
+
+                for (int x = 0; x < image.Width(); x++, pSource += 4)
+                {
+                    pRow[x * 3] = pSource[2];
+                    pRow[x * 3 + 1] = pSource[1];
+                    pRow[x * 3 + 2] = pSource[0];
+                }
+
+                for (size_t i = 0; i < nRowBytes; i++)
+                {
+                    filtered[i + 1] = (uint8_t)(pRow[i] - pPrevious[i]);
+                }
+
+                std::swap(pRow, pPrevious);
+
+                stream.next_in = filtered.data();
+                stream.avail_in = (uInt)filtered.size();
+
+                bool bLast = (y + 1 == image.Height());
+                int nResult = deflate(&stream, bLast ? Z_FINISH : Z_NO_FLUSH);
+
+                bSucceeded = bLast ? (Z_STREAM_END == nResult) : (Z_OK == nResult && 0 == stream.avail_in);
+            }
+
+            size_t nIdatEnd = nIdatStart + 8 + stream.total_out;
+
+            deflateEnd(&stream);
+
+            if (!bSucceeded)
+            {
+                dataOut.clear();
+                return false;
+            }
+
+            FinishChunk(dataOut, nIdatStart, nIdatEnd);
+
+            size_t nIendStart = nIdatEnd + 4;
+            memcpy(&dataOut[nIendStart + 4], "IEND", 4);
+            FinishChunk(dataOut, nIendStart, nIendStart + 8);
+
+            dataOut.resize(nIendStart + 12);
+
+            return true;
+        }
+
+    private:
+        int     m_nLevel;
+    };
+}
+
+std::unique_ptr<ImageEncoder> CreatePngEncoder(int nLevel)
+{
+    return std::unique_ptr<ImageEncoder>(new PngEncoder(nLevel));
+}
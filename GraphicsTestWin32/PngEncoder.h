@@ -0,0 +1,18 @@
+// PngEncoder.h : An ImageEncoder for PNG, built on zlib.
+//
+// Writes 8-bit RGB with no interlacing.  Each row is filtered with the Up
+// filter, the difference from the row above, which suits aerial imagery
+// about as well as choosing a filter per row and costs a fraction of the
+// time, and the rows are deflated as they are filtered.
+//
+// This needs zlib, so it isn't part of the Windows project, which encodes
+// with WIC.
+#pragma once
+
+#include <memory>
+
+#include "ImageEncoder.h"
+
+// nLevel is zlib's, 0 (stored) to 9.  Aerial imagery is noisy enough that
+// the higher levels save almost nothing, and take twice as long or more.
+std::unique_ptr<ImageEncoder> CreatePngEncoder(int nLevel = 1);
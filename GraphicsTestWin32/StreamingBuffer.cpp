@@ -0,0 +1,119 @@
+// StreamingBuffer.cpp : A DownloadBuffer that can be read while it is being
+// downloaded.
+//
+#include "StreamingBuffer.h"
+
+#include <cstring>
+
+StreamingBuffer::StreamingBuffer(std::pmr::memory_resource* pResource)
+    : m_buffer(pResource), m_nExpectedSize(0), m_bFinished(false), m_bAborted(false)
+{
+}
+
+bool StreamingBuffer::Reserve(size_t nCapacity)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    return m_buffer.Reserve(nCapacity);
+}
+
+uint8_t* StreamingBuffer::PrepareWrite(size_t nMinBytes, size_t* pnAvailable)
+{
+    // growing the buffer moves it, so it can't happen while a reader copies
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    return m_buffer.PrepareWrite(nMinBytes, pnAvailable);
+}
+
+void StreamingBuffer::CommitWrite(size_t nBytes)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        m_buffer.CommitWrite(nBytes);
+    }
+
+    m_dataArrived.notify_all();
+}
+
+void StreamingBuffer::SetExpectedSize(size_t nBytes)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_nExpectedSize = nBytes;
+}
+
+void StreamingBuffer::Finish()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        m_bFinished = true;
+    }
+
+    m_dataArrived.notify_all();
+}
+
+void StreamingBuffer::Abort()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        m_bAborted = true;
+    }
+
+    m_dataArrived.notify_all();
+}
+
+StreamingBuffer::ReadStatus StreamingBuffer::Read(size_t nOffset, void* pDest, size_t nBytes, size_t* pnRead)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    *pnRead = 0;
+
+    m_dataArrived.wait(lock, [&]()
+    {
+        return m_bAborted || m_bFinished || m_buffer.Size() >= nOffset + nBytes;
+    });
+
+    if (m_bAborted)
+    {
+        return ReadStatus::ABORTED;
+    }
+
+    size_t nAvailable = (m_buffer.Size() > nOffset) ? m_buffer.Size() - nOffset : 0;
+    size_t nToCopy = (nAvailable < nBytes) ? nAvailable : nBytes;
+
+    if (nToCopy > 0)
+    {
+        memcpy(pDest, m_buffer.Data() + nOffset, nToCopy);
+    }
+
+    *pnRead = nToCopy;
+
+    return (nToCopy == nBytes) ? ReadStatus::OK : ReadStatus::END_OF_STREAM;
+}
+
+bool StreamingBuffer::WaitForSize(size_t* pnSize)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    if (m_nExpectedSize > 0 && !m_bAborted)
+    {
+        *pnSize = m_nExpectedSize;
+        return true;
+    }
+
+    m_dataArrived.wait(lock, [&]() { return m_bAborted || m_bFinished; });
+
+    *pnSize = m_buffer.Size();
+
+    return !m_bAborted;
+}
+
+size_t StreamingBuffer::Size() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    return m_buffer.Size();
+}
@@ -0,0 +1,78 @@
+// StreamingBuffer.h : A DownloadBuffer that can be read while it is being
+// downloaded.
+//
+// The download thread writes into it exactly as it writes into a
+// DownloadBuffer, with PrepareWrite and CommitWrite.  A decoder on another
+// thread reads from it at the same time, and a read past the bytes that
+// have arrived waits for more, so decoding overlaps the download instead of
+// starting after it.
+//
+// Like DownloadBuffer this has no Windows dependencies.  On Windows it is
+// handed to WIC through a StreamingBufferStream.
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+#include "DownloadBuffer.h"
+
+class StreamingBuffer
+{
+public:
+    enum class ReadStatus
+    {
+        OK,             // all the bytes asked for were read
+        END_OF_STREAM,  // the download finished first, fewer bytes were read
+        ABORTED,        // the download failed or was cancelled
+    };
+
+    // the bytes come from pResource, such as a MapRequestArena, if it is
+    // given.  It must outlive the buffer.
+    explicit StreamingBuffer(std::pmr::memory_resource* pResource = nullptr);
+
+    StreamingBuffer(const StreamingBuffer&) = delete;
+    StreamingBuffer& operator=(const StreamingBuffer&) = delete;
+
+    // writer: as DownloadBuffer.  Only one thread may write.  The space
+    // PrepareWrite returns is filled without holding the lock; readers only
+    // ever see bytes that have been committed.
+    bool Reserve(size_t nCapacity);
+    uint8_t* PrepareWrite(size_t nMinBytes, size_t* pnAvailable);
+    void CommitWrite(size_t nBytes);
+
+    // writer: the size the server promised, 0 if it didn't say.  Lets a
+    // reader find the end of the stream without waiting for it.
+    void SetExpectedSize(size_t nBytes);
+
+    // writer: every byte has arrived
+    void Finish();
+
+    // writer: no more bytes are coming.  Waiting readers return ABORTED.
+    void Abort();
+
+    // reader: copy nBytes starting at nOffset into pDest, waiting until
+    // they have arrived.  *pnRead is set to the number of bytes copied.
+    ReadStatus Read(size_t nOffset, void* pDest, size_t nBytes, size_t* pnRead);
+
+    // reader: the total size of the stream, the expected size if the
+    // server gave one, otherwise waiting for the download to finish.
+    // Returns false if it was aborted.
+    bool WaitForSize(size_t* pnSize);
+
+    // the bytes committed so far
+    size_t Size() const;
+
+    // the finished download, contiguous.  Only valid after Finish, once
+    // the writer has stopped.
+    const uint8_t* Data() const { return m_buffer.Data(); }
+
+private:
+    mutable std::mutex          m_mutex;
+    std::condition_variable     m_dataArrived;
+    DownloadBuffer              m_buffer;
+    size_t                      m_nExpectedSize;
+    bool                        m_bFinished;
+    bool                        m_bAborted;
+};
@@ -0,0 +1,234 @@
+// StreamingBufferStream.cpp : An IStream over a StreamingBuffer.
+//
+#include "StreamingBufferStream.h"
+
+#include <new>
+
+HRESULT StreamingBufferStream::Create(StreamingBuffer* pBuffer, IStream** ppStream)
+{
+    if (NULL == pBuffer || NULL == ppStream)
+    {
+        return E_POINTER;
+    }
+
+    StreamingBufferStream* pStream = new (std::nothrow) StreamingBufferStream(pBuffer);
+
+    if (NULL == pStream)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    *ppStream = pStream;
+
+    return S_OK;
+}
+
+StreamingBufferStream::StreamingBufferStream(StreamingBuffer* pBuffer)
+    : m_nRefCount(1), m_pBuffer(pBuffer), m_nPosition(0)
+{
+}
+
+STDMETHODIMP StreamingBufferStream::QueryInterface(REFIID riid, void** ppvObject)
+{
+    if (NULL == ppvObject)
+    {
+        return E_POINTER;
+    }
+
+    if (riid == IID_IUnknown || riid == IID_ISequentialStream || riid == IID_IStream)
+    {
+        *ppvObject = static_cast<IStream*>(this);
+        AddRef();
+        return S_OK;
+    }
+
+    *ppvObject = NULL;
+
+    return E_NOINTERFACE;
+}
+
+STDMETHODIMP_(ULONG) StreamingBufferStream::AddRef()
+{
+    return (ULONG)InterlockedIncrement(&m_nRefCount);
+}
+
+STDMETHODIMP_(ULONG) StreamingBufferStream::Release()
+{
+    LONG nRefCount = InterlockedDecrement(&m_nRefCount);
+
+    if (0 == nRefCount)
+    {
+        delete this;
+    }
+
+    return (ULONG)nRefCount;
+}
+
+STDMETHODIMP StreamingBufferStream::Read(void* pv, ULONG cb, ULONG* pcbRead)
+{
+    if (NULL == pv)
+    {
+        return STG_E_INVALIDPOINTER;
+    }
+
+    size_t nRead = 0;
+
+    // waits for the bytes to arrive
+    StreamingBuffer::ReadStatus status = m_pBuffer->Read((size_t)m_nPosition, pv, cb, &nRead);
+
+    m_nPosition += nRead;
+
+    if (pcbRead)
+    {
+        *pcbRead = (ULONG)nRead;
+    }
+
+    switch (status)
+    {
+    case StreamingBuffer::ReadStatus::OK:
+        return S_OK;
+
+    case StreamingBuffer::ReadStatus::END_OF_STREAM:
+        return S_FALSE;
+
+    default:
+        return E_ABORT;
+    }
+}
+
+STDMETHODIMP StreamingBufferStream::Write(const void* pv, ULONG cb, ULONG* pcbWritten)
+{
+    UNREFERENCED_PARAMETER(pv);
+    UNREFERENCED_PARAMETER(cb);
+    UNREFERENCED_PARAMETER(pcbWritten);
+
+    return STG_E_ACCESSDENIED;
+}
+
+STDMETHODIMP StreamingBufferStream::Seek(LARGE_INTEGER dlibMove, DWORD dwOrigin, ULARGE_INTEGER* plibNewPosition)
+{
+    LONGLONG nBase = 0;
+
+    switch (dwOrigin)
+    {
+    case STREAM_SEEK_SET:
+        break;
+
+    case STREAM_SEEK_CUR:
+        nBase = (LONGLONG)m_nPosition;
+        break;
+
+    case STREAM_SEEK_END:
+        {
+            // the end isn't known until the download finishes, unless
+            // the server sent a Content-Length
+            size_t nSize = 0;
+
+            if (!m_pBuffer->WaitForSize(&nSize))
+            {
+                return E_ABORT;
+            }
+
+            nBase = (LONGLONG)nSize;
+        }
+        break;
+
+    default:
+        return STG_E_INVALIDFUNCTION;
+    }
+
+    LONGLONG nPosition = nBase + dlibMove.QuadPart;
+
+    if (nPosition < 0)
+    {
+        return STG_E_INVALIDFUNCTION;
+    }
+
+    // seeking past the bytes that have arrived is fine, reading there waits
+    m_nPosition = (ULONGLONG)nPosition;
+
+    if (plibNewPosition)
+    {
+        plibNewPosition->QuadPart = m_nPosition;
+    }
+
+    return S_OK;
+}
+
+STDMETHODIMP StreamingBufferStream::SetSize(ULARGE_INTEGER libNewSize)
+{
+    UNREFERENCED_PARAMETER(libNewSize);
+
+    return E_NOTIMPL;
+}
+
+STDMETHODIMP StreamingBufferStream::CopyTo(IStream* pstm, ULARGE_INTEGER cb, ULARGE_INTEGER* pcbRead, ULARGE_INTEGER* pcbWritten)
+{
+    UNREFERENCED_PARAMETER(pstm);
+    UNREFERENCED_PARAMETER(cb);
+    UNREFERENCED_PARAMETER(pcbRead);
+    UNREFERENCED_PARAMETER(pcbWritten);
+
+    return E_NOTIMPL;
+}
+
+STDMETHODIMP StreamingBufferStream::Commit(DWORD grfCommitFlags)
+{
+    UNREFERENCED_PARAMETER(grfCommitFlags);
+
+    return S_OK;
+}
+
+STDMETHODIMP StreamingBufferStream::Revert()
+{
+    return E_NOTIMPL;
+}
+
+STDMETHODIMP StreamingBufferStream::LockRegion(ULARGE_INTEGER libOffset, ULARGE_INTEGER cb, DWORD dwLockType)
+{
+    UNREFERENCED_PARAMETER(libOffset);
+    UNREFERENCED_PARAMETER(cb);
+    UNREFERENCED_PARAMETER(dwLockType);
+
+    return STG_E_INVALIDFUNCTION;
+}
+
+STDMETHODIMP StreamingBufferStream::UnlockRegion(ULARGE_INTEGER libOffset, ULARGE_INTEGER cb, DWORD dwLockType)
+{
+    UNREFERENCED_PARAMETER(libOffset);
+    UNREFERENCED_PARAMETER(cb);
+    UNREFERENCED_PARAMETER(dwLockType);
+
+    return STG_E_INVALIDFUNCTION;
+}
+
+STDMETHODIMP StreamingBufferStream::Stat(STATSTG* pstatstg, DWORD grfStatFlag)
+{
+    UNREFERENCED_PARAMETER(grfStatFlag);
+
+    if (NULL == pstatstg)
+    {
+        return STG_E_INVALIDPOINTER;
+    }
+
+    size_t nSize = 0;
+
+    if (!m_pBuffer->WaitForSize(&nSize))
+    {
+        return E_ABORT;
+    }
+
+    ZeroMemory(pstatstg, sizeof(*pstatstg));
+    pstatstg->type = STGTY_STREAM;
+    pstatstg->cbSize.QuadPart = nSize;
+    pstatstg->grfMode = STGM_READ;
+
+    return S_OK;
+}
+
+STDMETHODIMP StreamingBufferStream::Clone(IStream** ppstm)
+{
+    UNREFERENCED_PARAMETER(ppstm);
+
+    return E_NOTIMPL;
+}
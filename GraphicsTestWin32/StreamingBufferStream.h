@@ -0,0 +1,50 @@
+// StreamingBufferStream.h : An IStream over a StreamingBuffer.
+//
+// WIC decoders read their input through an IStream.  This one reads from a
+// StreamingBuffer that is still being downloaded: a read past the bytes
+// that have arrived blocks until they do, so a decoder running on its own
+// thread consumes the map as it comes in off the network.
+//
+// The stream is read-only, and only one thread may read it at a time.
+#pragma once
+
+#include "framework.h"
+#include <objidl.h>
+
+#include "StreamingBuffer.h"
+
+class StreamingBufferStream : public IStream
+{
+public:
+    // create a stream reading pBuffer from the start.  The buffer must
+    // outlive the stream.
+    static HRESULT Create(StreamingBuffer* pBuffer, IStream** ppStream);
+
+    // IUnknown
+    STDMETHODIMP QueryInterface(REFIID riid, void** ppvObject) override;
+    STDMETHODIMP_(ULONG) AddRef() override;
+    STDMETHODIMP_(ULONG) Release() override;
+
+    // ISequentialStream
+    STDMETHODIMP Read(void* pv, ULONG cb, ULONG* pcbRead) override;
+    STDMETHODIMP Write(const void* pv, ULONG cb, ULONG* pcbWritten) override;
+
+    // IStream
+    STDMETHODIMP Seek(LARGE_INTEGER dlibMove, DWORD dwOrigin, ULARGE_INTEGER* plibNewPosition) override;
+    STDMETHODIMP SetSize(ULARGE_INTEGER libNewSize) override;
+    STDMETHODIMP CopyTo(IStream* pstm, ULARGE_INTEGER cb, ULARGE_INTEGER* pcbRead, ULARGE_INTEGER* pcbWritten) override;
+    STDMETHODIMP Commit(DWORD grfCommitFlags) override;
+    STDMETHODIMP Revert() override;
+    STDMETHODIMP LockRegion(ULARGE_INTEGER libOffset, ULARGE_INTEGER cb, DWORD dwLockType) override;
+    STDMETHODIMP UnlockRegion(ULARGE_INTEGER libOffset, ULARGE_INTEGER cb, DWORD dwLockType) override;
+    STDMETHODIMP Stat(STATSTG* pstatstg, DWORD grfStatFlag) override;
+    STDMETHODIMP Clone(IStream** ppstm) override;
+
+private:
+    explicit StreamingBufferStream(StreamingBuffer* pBuffer);
+    virtual ~StreamingBufferStream() {}
+
+    LONG                m_nRefCount;
+    StreamingBuffer*    m_pBuffer;
+    ULONGLONG           m_nPosition;
+};
@@ -0,0 +1,343 @@
+// TileLayer.cpp : A map built from Bing Maps tiles.
+//
+#include "TileLayer.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+
+#include "ImageScaler.h"
+
+namespace
+{
+    // how many levels up DrawStandIn looks for an ancestor of a missing
+    // tile.  Beyond this an ancestor is too blurry to be worth it.
+    const int kMaxStandInLevels = 4;
+
+    // the map is 2^31 pixels tall at the deepest level, too tall for an int
+    int ClampToInt(int64_t n)
+    {
+        return (int)std::min(std::max(n, (int64_t)INT_MIN), (int64_t)INT_MAX);
+    }
+}
+
+TileLayer::TileLayer(const std::wstring& strImagerySet)
+    : m_imagerySet(strImagerySet)
+{
+    m_viewport.centerPixelX = 0;
+    m_viewport.centerPixelY = 0;
+    m_viewport.level = TileSystem::kMinLevel;
+    m_viewport.width = 0;
+    m_viewport.height = 0;
+}
+
+void TileLayer::CenterOn(double latitude, double longitude, int nLevel)
+{
+    nLevel = std::min(std::max(nLevel, TileSystem::kMinLevel), TileSystem::kMaxLevel);
+
+    m_viewport.level = nLevel;
+
+    TileSystem::LatLongToPixelXY(latitude, longitude, nLevel,
+        &m_viewport.centerPixelX, &m_viewport.centerPixelY);
+}
+
+void TileLayer::PanBy(int dx, int dy, int* pMovedX, int* pMovedY)
+{
+    double mapSize = TileSystem::MapSize(m_viewport.level);
+    double top = floor(m_viewport.centerPixelY - m_viewport.height / 2.0);
+
+    // east and west wrap around, north and south stop at the edge
+    m_viewport.centerPixelX = fmod(m_viewport.centerPixelX + dx, mapSize);
+
+    if (m_viewport.centerPixelX < 0)
+    {
+        m_viewport.centerPixelX += mapSize;
+    }
+
+    m_viewport.centerPixelY = std::min(std::max(m_viewport.centerPixelY + dy, 0.0), mapSize - 1);
+
+    // wrapping around doesn't change what's on screen, stopping does
+    if (pMovedX)
+    {
+        *pMovedX = dx;
+    }
+
+    if (pMovedY)
+    {
+        *pMovedY = (int)(floor(m_viewport.centerPixelY - m_viewport.height / 2.0) - top);
+    }
+}
+
+bool TileLayer::ZoomAt(int x, int y, int nLevels)
+{
+    int nLevel = std::min(std::max(m_viewport.level + nLevels, TileSystem::kMinLevel), TileSystem::kMaxLevel);
+
+    if (nLevel == m_viewport.level)
+    {
+        return false;
+    }
+
+    // the middle of the world pixel under x, y
+    double worldX = floor(m_viewport.centerPixelX - m_viewport.width / 2.0) + x + 0.5;
+    double worldY = floor(m_viewport.centerPixelY - m_viewport.height / 2.0) + y + 0.5;
+
+    // each level is twice the size of the one above it
+    double factor = ldexp(1.0, nLevel - m_viewport.level);
+
+    m_viewport.level = nLevel;
+    m_viewport.centerPixelX = worldX * factor - x - 0.5 + m_viewport.width / 2.0;
+    m_viewport.centerPixelY = worldY * factor - y - 0.5 + m_viewport.height / 2.0;
+
+    // wrap and clamp as PanBy does
+    PanBy(0, 0);
+
+    return true;
+}
+
+void TileLayer::Resize(int nWidth, int nHeight)
+{
+    m_viewport.width = std::max(nWidth, 0);
+    m_viewport.height = std::max(nHeight, 0);
+}
+
+MapRequestKey TileLayer::TileKey(const VisibleTile& tile) const
+{
+    return MapRequestKey::ForTile(m_imagerySet,
+        TileSystem::TileXYToQuadKey(tile.tileX, tile.tileY, tile.level));
+}
+
+void TileLayer::Compose(MapBitmapStore& store, const PixelBuffer& target, const PixelRect& dirty,
+    std::vector<MapRequestKey>& missingOut)
+{
+    missingOut.clear();
+
+    std::vector<VisibleTile> tiles = ComputeVisibleTiles(m_viewport);
+
+    PixelRect clip = IntersectPixelRect(dirty, target.Bounds());
+
+    // the background shows above and below the map.  The rows of tiles
+    // cover everything in between, so those pixels are only written once.
+    int64_t top = (int64_t)floor(m_viewport.centerPixelY - m_viewport.height / 2.0);
+    int64_t bottom = (int64_t)TileSystem::MapSize(m_viewport.level) - top;
+    PixelRect world = { clip.left, ClampToInt(-top), clip.right, ClampToInt(bottom) };
+
+    FillPixelsAround(target, clip, world, kBackgroundColor);
+
+    for (const VisibleTile& tile : tiles)
+    {
+        MapRequestKey key = TileKey(tile);
+        PixelRect slot = { tile.screenX, tile.screenY,
+            tile.screenX + TileSystem::kTileSize, tile.screenY + TileSystem::kTileSize };
+
+        // only the tiles that are drawn count as used by the store
+        if (IntersectPixelRect(slot, clip).IsEmpty())
+        {
+            if (!store.Contains(key))
+            {
+                missingOut.push_back(key);
+            }
+
+            continue;
+        }
+
+        MapImageHandle hTile = store.Find(key);
+
+        if (hTile)
+        {
+            DrawTile(target, clip, *hTile, tile.screenX, tile.screenY);
+        }
+        else
+        {
+            // something close to it, or the background, until the tile arrives
+            if (!DrawStandIn(store, target, clip, tile))
+            {
+                FillPixels(target, clip, slot, kBackgroundColor);
+            }
+
+            missingOut.push_back(key);
+        }
+    }
+}
+
+void TileLayer::ComposeNearby(const MapBitmapStore& store, std::vector<MapRequestKey>& nearbyOut) const
+{
+    nearbyOut.clear();
+
+    if (m_viewport.width <= 0 || m_viewport.height <= 0)
+    {
+        return;
+    }
+
+    // the view with a tile's width more all round, which has the same
+    // center, so its tiles come nearest the view first
+    TileViewport around = m_viewport;
+    around.width += 2 * TileSystem::kTileSize;
+    around.height += 2 * TileSystem::kTileSize;
+
+    std::unordered_set<MapRequestKey, MapRequestKeyHash> seen;
+
+    for (const VisibleTile& tile : ComputeVisibleTiles(m_viewport))
+    {
+        seen.insert(TileKey(tile));
+    }
+
+    for (const VisibleTile& tile : ComputeVisibleTiles(around))
+    {
+        MapRequestKey key = TileKey(tile);
+
+        if (seen.insert(key).second && !store.Contains(key))
+        {
+            nearbyOut.push_back(key);
+        }
+    }
+}
+
+std::vector<PixelRect> TileLayer::ScreenRects(const MapRequestKey& tileKey) const
+{
+    std::vector<PixelRect> rects;
+
+    if (!tileKey.IsTile() || tileKey.zoomLevel != m_viewport.level)
+    {
+        return rects;
+    }
+
+    for (const VisibleTile& tile : ComputeVisibleTiles(m_viewport))
+    {
+        if (TileKey(tile) == tileKey)
+        {
+            PixelRect rc = { tile.screenX, tile.screenY,
+                tile.screenX + TileSystem::kTileSize, tile.screenY + TileSystem::kTileSize };
+
+            rects.push_back(rc);
+        }
+    }
+
+    return rects;
+}
+
+void TileLayer::DrawTile(const PixelBuffer& target, const PixelRect& clip, const MapImage& tileImage, int x, int y)
+{
+    // a tile should be 256 x 256, but never draw outside its slot
+    ConstPixelBuffer source = PixelBufferOf(tileImage);
+    source.width = std::min(source.width, (int)TileSystem::kTileSize);
+    source.height = std::min(source.height, (int)TileSystem::kTileSize);
+
+    BlitPixels(target, clip, x, y, source);
+
+    // a short tile leaves part of its slot to the background
+    PixelRect slot = { x, y, x + TileSystem::kTileSize, y + TileSystem::kTileSize };
+    PixelRect drawn = { x, y, x + source.width, y + source.height };
+
+    FillPixelsAround(target, IntersectPixelRect(slot, clip), drawn, kBackgroundColor);
+}
+
+bool TileLayer::DrawStandIn(MapBitmapStore& store, const PixelBuffer& target, const PixelRect& clip,
+    const VisibleTile& tile)
+{
+    const int kHalf = TileSystem::kTileSize / 2;
+
+    // the four tiles a level down, which were on screen just before
+    // zooming out, each scaled to a quarter of the slot
+    if (tile.level < TileSystem::kMaxLevel)
+    {
+        MapImageHandle hChildren[4];
+        bool bAny = false;
+
+        for (int i = 0; i < 4; i++)
+        {
+            VisibleTile child = { tile.tileX * 2 + (i & 1), tile.tileY * 2 + (i >> 1), tile.level + 1, 0, 0 };
+
+            hChildren[i] = store.Find(TileKey(child));
+            bAny = bAny || hChildren[i];
+        }
+
+        if (bAny)
+        {
+            for (int i = 0; i < 4; i++)
+            {
+                int x = tile.screenX + (i & 1) * kHalf;
+                int y = tile.screenY + (i >> 1) * kHalf;
+
+                if (hChildren[i])
+                {
+                    DrawScaled(target, clip, PixelBufferOf(*hChildren[i]), x, y, kHalf);
+                }
+                else
+                {
+                    PixelRect quarter = { x, y, x + kHalf, y + kHalf };
+                    FillPixels(target, clip, quarter, kBackgroundColor);
+                }
+            }
+
+            return true;
+        }
+    }
+
+    // the part of the nearest ancestor that covers this tile, which was
+    // on screen just before zooming in, scaled up
+    for (int k = 1; k <= kMaxStandInLevels && tile.level - k >= TileSystem::kMinLevel; k++)
+    {
+        VisibleTile ancestor = { tile.tileX >> k, tile.tileY >> k, tile.level - k, 0, 0 };
+        MapImageHandle hAncestor = store.Find(TileKey(ancestor));
+
+        if (!hAncestor)
+        {
+            continue;
+        }
+
+        int nPart = std::min(hAncestor->Width(), hAncestor->Height()) >> k;
+
+        if (nPart < 1)
+        {
+            break;
+        }
+
+        int nMask = (1 << k) - 1;
+
+        ConstPixelBuffer source = PixelBufferOf(*hAncestor);
+        source.pPixels = source.Row((tile.tileY & nMask) * nPart) + (size_t)(tile.tileX & nMask) * nPart * 4;
+        source.width = nPart;
+        source.height = nPart;
+
+        DrawScaled(target, clip, source, tile.screenX, tile.screenY, TileSystem::kTileSize);
+
+        return true;
+    }
+
+    return false;
+}
+
+void TileLayer::DrawScaled(const PixelBuffer& target, const PixelRect& clip, const ConstPixelBuffer& source,
+    int x, int y, int nSize)
+{
+    PixelRect slot = { x, y, x + nSize, y + nSize };
+    PixelRect rc = IntersectPixelRect(IntersectPixelRect(slot, clip), target.Bounds());
+
+    if (rc.IsEmpty())
+    {
+        return;
+    }
+
+    if (!m_pScratch)
+    {
+        m_pScratch = MapImage::Create(TileSystem::kTileSize, TileSystem::kTileSize);
+
+        if (!m_pScratch)
+        {
+            FillPixels(target, rc, rc, kBackgroundColor);
+            return;
+        }
+    }
+
+    PixelBuffer scratch = PixelBufferOf(*m_pScratch);
+    scratch.width = nSize;
+    scratch.height = nSize;
+
+    // a pan only exposes a strip of the slot, so only scale the rows of
+    // it that are going to be seen.  Tiles are small, one thread will do.
+    ScaleImageRows(source, scratch, ScaleFilter::BILINEAR, rc.top - y, rc.bottom - y, 1);
+
+    ConstPixelBuffer scaled = { scratch.pPixels, scratch.width, scratch.height, scratch.stride };
+
+    BlitPixels(target, rc, x, y, scaled);
+}
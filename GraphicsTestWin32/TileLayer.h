@@ -0,0 +1,105 @@
+// TileLayer.h : A map built from Bing Maps tiles.
+//
+// Instead of asking Bing Maps for one static image of the whole window, the
+// tile layer works out which 256 x 256 tiles cover the window and draws
+// each one from the MapBitmapStore.  Tiles are shared between every view
+// that shows them, so moving the map only needs the tiles that have just
+// come into view, not a whole new map.
+//
+// While a tile is downloading, a stand-in for it is drawn from tiles the
+// store already has at other levels: part of an ancestor scaled up, or
+// its four children scaled down.  So zooming in or out shows a scaled
+// preview of the new view at once, which sharpens as the tiles arrive.
+//
+// TileLayer has no Windows dependencies.  It composes into whatever pixels
+// the caller gives it, normally the window's back buffer.  The caller
+// fetches the tiles Compose reports as missing, and repaints the
+// rectangles ScreenRects gives for each one when it arrives.  It can also
+// fetch the tiles ComposeNearby reports, just outside the view, at a
+// lower priority, so a short pan finds them already there.
+#pragma once
+
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "MapBitmapStore.h"
+#include "MapImage.h"
+#include "MapRequest.h"
+#include "PixelBlit.h"
+#include "TileSystem.h"
+
+class TileLayer
+{
+public:
+    // the deep sky blue DisplayMap paints behind a static map, as BGRX
+    static constexpr uint32_t kBackgroundColor = 0x0000BFFF;
+
+    explicit TileLayer(const std::wstring& strImagerySet = DEFAULT_IMAGERY_SET);
+
+    TileLayer(const TileLayer&) = delete;
+    TileLayer& operator=(const TileLayer&) = delete;
+
+    // show a latitude and longitude in the middle of the view
+    void CenterOn(double latitude, double longitude, int nLevel);
+
+    // move the map by a number of screen pixels.  Positive dx moves the
+    // view east, positive dy moves it south.  The view stops at the top and
+    // bottom of the map, so the distance it really moved, which is how far
+    // what's on screen has to scroll, goes in *pMovedX and *pMovedY.
+    void PanBy(int dx, int dy, int* pMovedX = nullptr, int* pMovedY = nullptr);
+
+    // zoom in by nLevels levels of detail, or out if it is negative,
+    // keeping the map under screen pixel x, y where it is.  Returns false
+    // if the view was already as far in or out as it goes.
+    bool ZoomAt(int x, int y, int nLevels);
+
+    // the size of the window the map is drawn in
+    void Resize(int nWidth, int nHeight);
+
+    void SetImagerySet(const std::wstring& strImagerySet) { m_imagerySet = strImagerySet; }
+    const std::wstring& ImagerySet() const { return m_imagerySet; }
+
+    const TileViewport& Viewport() const { return m_viewport; }
+
+    // the key MapBitmapStore and the fetch queue know a tile by
+    MapRequestKey TileKey(const VisibleTile& tile) const;
+
+    // draw the part of the view within dirty into target, which is the
+    // size given to Resize, and list the keys of every visible tile the
+    // store doesn't have, nearest the center first.  Only tiles that
+    // overlap dirty are copied, but missing tiles are listed wherever they
+    // are, so the whole view keeps loading.
+    void Compose(MapBitmapStore& store, const PixelBuffer& target, const PixelRect& dirty,
+        std::vector<MapRequestKey>& missingOut);
+
+    // list the keys of the tiles just outside the view, within a tile of
+    // its edges, that the store doesn't have, nearest the center first.
+    // These are the tiles a short pan would show next.
+    void ComposeNearby(const MapBitmapStore& store, std::vector<MapRequestKey>& nearbyOut) const;
+
+    // where a tile is on screen.  Usually once or not at all, but a view
+    // wider than the world shows a tile more than once.
+    std::vector<PixelRect> ScreenRects(const MapRequestKey& tileKey) const;
+
+private:
+    // copy a tile into target at x, y, within clip
+    void DrawTile(const PixelBuffer& target, const PixelRect& clip, const MapImage& tileImage, int x, int y);
+
+    // draw a stand-in for a tile the store doesn't have, from its children
+    // or an ancestor.  Returns false if the store has none of them.
+    bool DrawStandIn(MapBitmapStore& store, const PixelBuffer& target, const PixelRect& clip,
+        const VisibleTile& tile);
+
+    // scale source so it covers the slot at x, y of nSize x nSize
+    // pixels, within clip
+    void DrawScaled(const PixelBuffer& target, const PixelRect& clip, const ConstPixelBuffer& source,
+        int x, int y, int nSize);
+
+    std::wstring                m_imagerySet;
+    TileViewport                m_viewport;
+
+    // where DrawScaled scales a stand-in before it is clipped
+    std::shared_ptr<MapImage>   m_pScratch;
+};
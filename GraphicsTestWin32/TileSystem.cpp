@@ -0,0 +1,219 @@
+// TileSystem.cpp : Bing Maps tile system math.
+//
+#include "TileSystem.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+    const double kEarthRadius = 6378137;
+    const double kMinLatitude = -85.05112878;
+    const double kMaxLatitude = 85.05112878;
+    const double kMinLongitude = -180;
+    const double kMaxLongitude = 180;
+    const double kPi = 3.14159265358979323846;
+
+    // floor division that rounds towards negative infinity
+    int64_t FloorDiv(int64_t n, int64_t d)
+    {
+        int64_t q = n / d;
+
+        if ((n % d != 0) && ((n < 0) != (d < 0)))
+        {
+            q--;
+        }
+
+        return q;
+    }
+}
+
+double TileSystem::Clip(double n, double minValue, double maxValue)
+{
+    return std::min(std::max(n, minValue), maxValue);
+}
+
+uint32_t TileSystem::MapSize(int nLevel)
+{
+    return (uint32_t)kTileSize << nLevel;
+}
+
+double TileSystem::GroundResolution(double latitude, int nLevel)
+{
+    latitude = Clip(latitude, kMinLatitude, kMaxLatitude);
+
+    return cos(latitude * kPi / 180) * 2 * kPi * kEarthRadius / MapSize(nLevel);
+}
+
+void TileSystem::LatLongToPixelXY(double latitude, double longitude, int nLevel,
+    double* pPixelX, double* pPixelY)
+{
+    latitude = Clip(latitude, kMinLatitude, kMaxLatitude);
+    longitude = Clip(longitude, kMinLongitude, kMaxLongitude);
+
+    double x = (longitude + 180) / 360;
+    double sinLatitude = sin(latitude * kPi / 180);
+    double y = 0.5 - log((1 + sinLatitude) / (1 - sinLatitude)) / (4 * kPi);
+
+    double mapSize = MapSize(nLevel);
+
+    *pPixelX = Clip(x * mapSize + 0.5, 0, mapSize - 1);
+    *pPixelY = Clip(y * mapSize + 0.5, 0, mapSize - 1);
+}
+
+void TileSystem::PixelXYToLatLong(double pixelX, double pixelY, int nLevel,
+    double* pLatitude, double* pLongitude)
+{
+    double mapSize = MapSize(nLevel);
+
+    double x = (Clip(pixelX, 0, mapSize - 1) / mapSize) - 0.5;
+    double y = 0.5 - (Clip(pixelY, 0, mapSize - 1) / mapSize);
+
+    *pLatitude = 90 - 360 * atan(exp(-y * 2 * kPi)) / kPi;
+    *pLongitude = 360 * x;
+}
+
+void TileSystem::PixelXYToTileXY(int64_t pixelX, int64_t pixelY, int* pTileX, int* pTileY)
+{
+    *pTileX = (int)FloorDiv(pixelX, kTileSize);
+    *pTileY = (int)FloorDiv(pixelY, kTileSize);
+}
+
+void TileSystem::TileXYToPixelXY(int nTileX, int nTileY, int64_t* pPixelX, int64_t* pPixelY)
+{
+    *pPixelX = (int64_t)nTileX * kTileSize;
+    *pPixelY = (int64_t)nTileY * kTileSize;
+}
+
+std::string TileSystem::TileXYToQuadKey(int nTileX, int nTileY, int nLevel)
+{
+    std::string quadKey;
+    quadKey.reserve(nLevel);
+
+    for (int i = nLevel; i > 0; i--)
+    {
+        char digit = '0';
+        int mask = 1 << (i - 1);
+
+        if ((nTileX & mask) != 0)
+        {
+            digit++;
+        }
+
+        if ((nTileY & mask) != 0)
+        {
+            digit += 2;
+        }
+
+        quadKey.push_back(digit);
+    }
+
+    return quadKey;
+}
+
+bool TileSystem::QuadKeyToTileXY(const std::string& quadKey, int* pTileX, int* pTileY, int* pLevel)
+{
+    int nTileX = 0;
+    int nTileY = 0;
+    int nLevel = (int)quadKey.size();
+
+    if (nLevel < kMinLevel || nLevel > kMaxLevel)
+    {
+        return false;
+    }
+
+    for (int i = nLevel; i > 0; i--)
+    {
+        int mask = 1 << (i - 1);
+
+        switch (quadKey[nLevel - i])
+        {
+        case '0':
+            break;
+
+        case '1':
+            nTileX |= mask;
+            break;
+
+        case '2':
+            nTileY |= mask;
+            break;
+
+        case '3':
+            nTileX |= mask;
+            nTileY |= mask;
+            break;
+
+        default:
+            return false;
+        }
+    }
+
+    *pTileX = nTileX;
+    *pTileY = nTileY;
+    *pLevel = nLevel;
+
+    return true;
+}
+
+std::vector<VisibleTile> ComputeVisibleTiles(const TileViewport& viewport)
+{
+    std::vector<VisibleTile> tiles;
+
+    if (viewport.width <= 0 || viewport.height <= 0 ||
+        viewport.level < TileSystem::kMinLevel || viewport.level > TileSystem::kMaxLevel)
+    {
+        return tiles;
+    }
+
+    // the world pixel at the top left corner of the viewport
+    int64_t left = (int64_t)floor(viewport.centerPixelX - viewport.width / 2.0);
+    int64_t top = (int64_t)floor(viewport.centerPixelY - viewport.height / 2.0);
+    int64_t right = left + viewport.width;
+    int64_t bottom = top + viewport.height;
+
+    int nFirstX, nFirstY, nLastX, nLastY;
+
+    TileSystem::PixelXYToTileXY(left, top, &nFirstX, &nFirstY);
+    TileSystem::PixelXYToTileXY(right - 1, bottom - 1, &nLastX, &nLastY);
+
+    int nTilesAcross = (int)(TileSystem::MapSize(viewport.level) / TileSystem::kTileSize);
+
+    // there is nothing above the top or below the bottom of the map
+    nFirstY = std::max(nFirstY, 0);
+    nLastY = std::min(nLastY, nTilesAcross - 1);
+
+    for (int y = nFirstY; y <= nLastY; y++)
+    {
+        for (int x = nFirstX; x <= nLastX; x++)
+        {
+            int64_t pixelX, pixelY;
+            TileSystem::TileXYToPixelXY(x, y, &pixelX, &pixelY);
+
+            VisibleTile tile;
+
+            // the map wraps around at the date line
+            tile.tileX = (int)(((x % nTilesAcross) + nTilesAcross) % nTilesAcross);
+            tile.tileY = y;
+            tile.level = viewport.level;
+            tile.screenX = (int)(pixelX - left);
+            tile.screenY = (int)(pixelY - top);
+
+            tiles.push_back(tile);
+        }
+    }
+
+    // nearest the center first
+    double centerX = viewport.width / 2.0 - TileSystem::kTileSize / 2.0;
+    double centerY = viewport.height / 2.0 - TileSystem::kTileSize / 2.0;
+
+    std::stable_sort(tiles.begin(), tiles.end(), [centerX, centerY](const VisibleTile& a, const VisibleTile& b)
+    {
+        double da = (a.screenX - centerX) * (a.screenX - centerX) + (a.screenY - centerY) * (a.screenY - centerY);
+        double db = (b.screenX - centerX) * (b.screenX - centerX) + (b.screenY - centerY) * (b.screenY - centerY);
+
+        return da < db;
+    });
+
+    return tiles;
+}
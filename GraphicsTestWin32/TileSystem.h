@@ -0,0 +1,81 @@
+// TileSystem.h : Bing Maps tile system math.
+//
+// Bing Maps divides the world, in the Web Mercator projection, into
+// 256 x 256 pixel tiles.  At level of detail 1 the world is 2 x 2 tiles,
+// and each level doubles the size in both directions.  A tile is named by a
+// quadkey, a string of base-4 digits with one digit per level, so a tile's
+// quadkey always starts with the quadkey of the tile containing it.
+//
+// This follows the reference implementation in the Bing Maps documentation:
+// https://docs.microsoft.com/en-us/bingmaps/articles/bing-maps-tile-system
+//
+// Pixel coordinates here are "world" pixels at a given level of detail,
+// with (0, 0) at the top left corner of the map (180W, ~85N).
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class TileSystem
+{
+public:
+    static constexpr int kTileSize = 256;
+    static constexpr int kMinLevel = 1;
+    static constexpr int kMaxLevel = 23;
+
+    // the width and height of the whole map, in pixels
+    static uint32_t MapSize(int nLevel);
+
+    // meters per pixel at a latitude and level of detail
+    static double GroundResolution(double latitude, int nLevel);
+
+    // convert a latitude and longitude to world pixel coordinates
+    static void LatLongToPixelXY(double latitude, double longitude, int nLevel,
+        double* pPixelX, double* pPixelY);
+
+    // convert world pixel coordinates back to a latitude and longitude
+    static void PixelXYToLatLong(double pixelX, double pixelY, int nLevel,
+        double* pLatitude, double* pLongitude);
+
+    // the tile containing a world pixel
+    static void PixelXYToTileXY(int64_t pixelX, int64_t pixelY, int* pTileX, int* pTileY);
+
+    // the world pixel at the top left corner of a tile
+    static void TileXYToPixelXY(int nTileX, int nTileY, int64_t* pPixelX, int64_t* pPixelY);
+
+    // the quadkey naming a tile
+    static std::string TileXYToQuadKey(int nTileX, int nTileY, int nLevel);
+
+    // the tile named by a quadkey.  Returns false if it isn't a valid quadkey.
+    static bool QuadKeyToTileXY(const std::string& quadKey, int* pTileX, int* pTileY, int* pLevel);
+
+private:
+    static double Clip(double n, double minValue, double maxValue);
+};
+
+// a tile that is at least partly visible in a viewport, and where to draw it
+struct VisibleTile
+{
+    int     tileX;          // tile column, already wrapped into the map
+    int     tileY;          // tile row
+    int     level;          // level of detail
+    int     screenX;        // where the tile's top left corner lands in the viewport
+    int     screenY;
+};
+
+// a window onto the map: which world pixel is at its center, at what level
+struct TileViewport
+{
+    double  centerPixelX;
+    double  centerPixelY;
+    int     level;
+    int     width;          // viewport size in pixels
+    int     height;
+};
+
+// every tile that covers some part of the viewport.  The map wraps around
+// horizontally, so a viewport wider than the world shows tiles more than
+// once.  Rows above or below the map are left out.  The tiles nearest the
+// center come first, so they can be requested first.
+std::vector<VisibleTile> ComputeVisibleTiles(const TileViewport& viewport);
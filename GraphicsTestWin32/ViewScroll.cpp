@@ -0,0 +1,87 @@
+// ViewScroll.cpp : Scrolling a view that is already on screen.
+//
+#include "ViewScroll.h"
+
+#include <cstring>
+
+ScrollDamage ComputeScrollDamage(int nWidth, int nHeight, int dx, int dy)
+{
+    ScrollDamage damage;
+
+    PixelRect view = { 0, 0, nWidth, nHeight };
+    PixelRect moved = { dx, dy, nWidth + dx, nHeight + dy };
+
+    damage.kept = IntersectPixelRect(view, moved);
+    damage.nExposed = 0;
+
+    if (damage.kept.IsEmpty())
+    {
+        // scrolled right out of view, everything is new
+        if (!view.IsEmpty())
+        {
+            damage.exposed[damage.nExposed++] = view;
+        }
+
+        return damage;
+    }
+
+    // a full width band above or below what was kept
+    if (dy > 0)
+    {
+        PixelRect band = { 0, 0, nWidth, damage.kept.top };
+        damage.exposed[damage.nExposed++] = band;
+    }
+    else if (dy < 0)
+    {
+        PixelRect band = { 0, damage.kept.bottom, nWidth, nHeight };
+        damage.exposed[damage.nExposed++] = band;
+    }
+
+    // and a band beside it, only as tall as what was kept
+    if (dx > 0)
+    {
+        PixelRect band = { 0, damage.kept.top, damage.kept.left, damage.kept.bottom };
+        damage.exposed[damage.nExposed++] = band;
+    }
+    else if (dx < 0)
+    {
+        PixelRect band = { damage.kept.right, damage.kept.top, nWidth, damage.kept.bottom };
+        damage.exposed[damage.nExposed++] = band;
+    }
+
+    return damage;
+}
+
+void ScrollPixels(const PixelBuffer& buffer, int dx, int dy)
+{
+    ScrollDamage damage = ComputeScrollDamage(buffer.width, buffer.height, dx, dy);
+
+    if (damage.kept.IsEmpty() || (0 == dx && 0 == dy))
+    {
+        return;
+    }
+
+    size_t nRowBytes = (size_t)damage.kept.Width() * 4;
+
+    // copy rows in the order that never overwrites a row before it has
+    // been read: from the bottom when moving down, from the top otherwise
+    int nFirst = damage.kept.top;
+    int nLast = damage.kept.bottom;
+    int nStep = 1;
+
+    if (dy > 0)
+    {
+        nFirst = damage.kept.bottom - 1;
+        nLast = damage.kept.top - 1;
+        nStep = -1;
+    }
+
+    for (int y = nFirst; y != nLast; y += nStep)
+    {
+        uint8_t* pDest = buffer.Row(y) + (size_t)damage.kept.left * 4;
+        const uint8_t* pSource = buffer.Row(y - dy) + (size_t)(damage.kept.left - dx) * 4;
+
+        // a row can overlap itself when moving sideways
+        memmove(pDest, pSource, nRowBytes);
+    }
+}
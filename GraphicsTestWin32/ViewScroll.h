@@ -0,0 +1,36 @@
+// ViewScroll.h : Scrolling a view that is already on screen.
+//
+// When the map is dragged, almost everything that was on screen is still
+// on screen, just somewhere else.  Rather than compose the whole view
+// again, the pixels already in the back buffer are moved by the distance
+// dragged, the window's pixels are scrolled the same way, and only the
+// strips that scroll into view are composed.
+//
+// Everything here is in view pixels, with dx and dy the distance the
+// content moves: positive dx moves it right, positive dy moves it down.
+//
+// ViewScroll has no Windows dependencies.
+#pragma once
+
+#include "PixelBlit.h"
+
+// what scrolling a view leaves to be drawn
+struct ScrollDamage
+{
+    // where the pixels that stay in view end up.  Empty if the view moved
+    // by its own size or more, and nothing can be kept.
+    PixelRect   kept;
+
+    // the strips that scrolled into view: at most a band across the whole
+    // view above or below what was kept, and a band down one side of it
+    PixelRect   exposed[2];
+    int         nExposed;
+};
+
+// the damage from scrolling a nWidth x nHeight view by dx, dy
+ScrollDamage ComputeScrollDamage(int nWidth, int nHeight, int dx, int dy);
+
+// move the pixels of buffer by dx, dy, in place.  Pixels that move out of
+// the buffer are lost, and the strips that scroll into view are left as
+// they were, for the caller to draw.
+void ScrollPixels(const PixelBuffer& buffer, int dx, int dy);
@@ -0,0 +1,118 @@
+// WindowBackBuffer.cpp : A retained back buffer the window is painted from.
+//
+#include "WindowBackBuffer.h"
+
+WindowBackBuffer::WindowBackBuffer()
+    : m_hdcMem(NULL), m_hBitmap(NULL), m_hOldBitmap(NULL), m_pBits(NULL),
+      m_nWidth(0), m_nHeight(0)
+{
+}
+
+WindowBackBuffer::~WindowBackBuffer()
+{
+    Destroy();
+}
+
+HRESULT WindowBackBuffer::Resize(HDC hdc, int nWidth, int nHeight)
+{
+    if (nWidth <= 0 || nHeight <= 0)
+    {
+        return E_INVALIDARG;
+    }
+
+    if (NULL != m_hBitmap && nWidth == m_nWidth && nHeight == m_nHeight)
+    {
+        return S_OK;
+    }
+
+    if (NULL == m_hdcMem)
+    {
+        m_hdcMem = CreateCompatibleDC(hdc);
+
+        if (NULL == m_hdcMem)
+        {
+            return E_FAIL;
+        }
+    }
+
+    // a top-down 32bpp DIB, the same layout as a MapImage
+    BITMAPINFO bminfo;
+    ZeroMemory(&bminfo, sizeof(bminfo));
+    bminfo.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    bminfo.bmiHeader.biWidth = (LONG)nWidth;
+    bminfo.bmiHeader.biHeight = -(LONG)nHeight;
+    bminfo.bmiHeader.biPlanes = 1;
+    bminfo.bmiHeader.biBitCount = 32;
+    bminfo.bmiHeader.biCompression = BI_RGB;
+
+    void* pBits = NULL;
+    HBITMAP hBitmap = CreateDIBSection(hdc, &bminfo, DIB_RGB_COLORS, &pBits, NULL, 0);
+
+    if (NULL == hBitmap)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    // swap the new bitmap in before the old one is deleted
+    HBITMAP hPrevious = (HBITMAP)SelectObject(m_hdcMem, hBitmap);
+
+    if (NULL == m_hOldBitmap)
+    {
+        m_hOldBitmap = hPrevious;
+    }
+
+    if (NULL != m_hBitmap)
+    {
+        DeleteObject(m_hBitmap);
+    }
+
+    m_hBitmap = hBitmap;
+    m_pBits = static_cast<uint8_t*>(pBits);
+    m_nWidth = nWidth;
+    m_nHeight = nHeight;
+
+    return S_OK;
+}
+
+void WindowBackBuffer::Destroy()
+{
+    if (NULL != m_hdcMem)
+    {
+        if (NULL != m_hOldBitmap)
+        {
+            SelectObject(m_hdcMem, m_hOldBitmap);
+        }
+
+        DeleteDC(m_hdcMem);
+    }
+
+    if (NULL != m_hBitmap)
+    {
+        DeleteObject(m_hBitmap);
+    }
+
+    m_hdcMem = NULL;
+    m_hBitmap = NULL;
+    m_hOldBitmap = NULL;
+    m_pBits = NULL;
+    m_nWidth = 0;
+    m_nHeight = 0;
+}
+
+PixelBuffer WindowBackBuffer::Pixels() const
+{
+    // 32bpp rows are always DWORD aligned, so the stride is width * 4
+    PixelBuffer buffer = { m_pBits, m_nWidth, m_nHeight, (size_t)m_nWidth * 4 };
+    return buffer;
+}
+
+void WindowBackBuffer::Present(HDC hdc, const RECT& rc) const
+{
+    if (NULL == m_hdcMem)
+    {
+        return;
+    }
+
+    BitBlt(hdc, rc.left, rc.top, rc.right - rc.left, rc.bottom - rc.top,
+        m_hdcMem, rc.left, rc.top, SRCCOPY);
+}
@@ -0,0 +1,68 @@
+// WindowBackBuffer.h : A retained back buffer the window is painted from.
+//
+// Creating a memory DC and a bitmap on every WM_PAINT, filling the whole
+// window and then copying the whole map makes a repaint cost the same
+// however little of the window changed, and painting straight onto the
+// screen flickers.  The back buffer is a top-down 32bpp DIB section the
+// size of the client area, selected into a memory DC that lives as long
+// as the window.  WM_PAINT composes only ps.rcPaint into it, with GDI or
+// with PixelBlit on its bits, and BitBlts only ps.rcPaint to the screen.
+//
+// The DIB is only recreated when the client area changes size.
+#pragma once
+
+#include "framework.h"
+
+#include "PixelBlit.h"
+
+class WindowBackBuffer
+{
+public:
+    WindowBackBuffer();
+    ~WindowBackBuffer();
+
+    WindowBackBuffer(const WindowBackBuffer&) = delete;
+    WindowBackBuffer& operator=(const WindowBackBuffer&) = delete;
+
+    // make sure the back buffer is nWidth x nHeight, compatible with
+    // hdc.  Its contents are undefined after it changes size.
+    HRESULT Resize(HDC hdc, int nWidth, int nHeight);
+
+    // free the DIB and the memory DC
+    void Destroy();
+
+    int Width() const { return m_nWidth; }
+    int Height() const { return m_nHeight; }
+
+    // the memory DC, for drawing with GDI.  NULL before Resize.
+    HDC DC() const { return m_hdcMem; }
+
+    // the DIB's pixels, for drawing with PixelBlit.  Call GdiFlush()
+    // first if GDI has drawn into the DC since the last flush.
+    PixelBuffer Pixels() const;
+
+    // copy rc from the back buffer to the same place on hdc
+    void Present(HDC hdc, const RECT& rc) const;
+
+private:
+    HDC         m_hdcMem;
+    HBITMAP     m_hBitmap;
+    HBITMAP     m_hOldBitmap;
+    uint8_t*    m_pBits;
+    int         m_nWidth;
+    int         m_nHeight;
+};
+
+// a Win32 RECT as a PixelRect
+inline PixelRect ToPixelRect(const RECT& rc)
+{
+    PixelRect rcPixels = { (int)rc.left, (int)rc.top, (int)rc.right, (int)rc.bottom };
+    return rcPixels;
+}
+
+// a PixelRect as a Win32 RECT
+inline RECT ToRect(const PixelRect& rc)
+{
+    RECT rect = { rc.left, rc.top, rc.right, rc.bottom };
+    return rect;
+}
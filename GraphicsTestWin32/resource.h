@@ -12,9 +12,13 @@
 #define IDI_SMALL                       108
 #define IDC_GRAPHICSTESTWIN32           109
 #define IDR_MAINFRAME                   128
-#define ID_CITY_SEATTLE                 32771
-#define ID_CITY_PORTLAND                32772
-#define ID_CITY_SANFRANCISCO            32773
+#define ID_LOCATION_NONE                32771
+#define ID_VIEW_STATIC                  32772
+#define ID_VIEW_TILED                   32773
+#define ID_VIEW_FIT                     32774
+#define ID_FILE_SAVEMETRICS             32775
+#define ID_LOCATION_FIRST               33000
+#define ID_LOCATION_LAST                34999
 #define IDC_STATIC                      -1
 
 // Next default values for new objects
@@ -23,7 +27,7 @@
 #ifndef APSTUDIO_READONLY_SYMBOLS
 #define _APS_NO_MFC                     1
 #define _APS_NEXT_RESOURCE_VALUE        129
-#define _APS_NEXT_COMMAND_VALUE         32774
+#define _APS_NEXT_COMMAND_VALUE         32776
 #define _APS_NEXT_CONTROL_VALUE         1000
 #define _APS_NEXT_SYMED_VALUE           110
 #endif
@@ -0,0 +1,530 @@
+// DiskMapCacheTest.cpp : Unit tests of DiskMapCache.
+//
+// Each test runs against a directory of its own: maps stored and read back
+// through the memory-mapped path, least-recently-used eviction under the
+// size cap, the LRU order carried over to the next run, and files that are
+// corrupt, cut short or for another key being thrown away.
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "DiskMapCache.h"
+#include "TestDirectory.h"
+
+namespace fs = std::filesystem;
+
+namespace
+{
+    // some made-up JPEG bytes, different for each seed
+    std::vector<uint8_t> MakeBytes(size_t nBytes, unsigned nSeed)
+    {
+        std::vector<uint8_t> bytes(nBytes);
+
+        for (size_t i = 0; i < nBytes; i++)
+        {
+            bytes[i] = (uint8_t)(i * 31 + nSeed * 7);
+        }
+
+        return bytes;
+    }
+
+    MapRequestKey MakeKey(const wchar_t* pszLocation)
+    {
+        return MapRequestKey(DEFAULT_IMAGERY_SET, pszLocation, 500, 400);
+    }
+
+    // the file DiskMapCache keeps key in
+    fs::path FileForKey(const fs::path& directory, const MapRequestKey& key)
+    {
+        char szName[32];
+
+        snprintf(szName, sizeof(szName), "%016llx.map", (unsigned long long)key.Hash());
+
+        return directory / szName;
+    }
+
+    bool LookupBytes(DiskMapCache& cache, const MapRequestKey& key, std::vector<uint8_t>& bytesOut)
+    {
+        MapCacheView view;
+
+        if (!cache.Lookup(key, view))
+        {
+            return false;
+        }
+
+        bytesOut.assign(view.pData, view.pData + view.nSize);
+
+        return true;
+    }
+
+    std::vector<uint8_t> ReadWholeFile(const fs::path& path)
+    {
+        std::ifstream in(path, std::ios::binary);
+
+        return std::vector<uint8_t>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+
+    void WriteWholeFile(const fs::path& path, const std::vector<uint8_t>& bytes)
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+
+        out.write(reinterpret_cast<const char*>(bytes.data()), (std::streamsize)bytes.size());
+    }
+
+    // make path look last used nSecondsAgo, the way a run of the program
+    // that long ago would have left it
+    void SetLastUsed(const fs::path& path, int nSecondsAgo)
+    {
+        fs::last_write_time(path, fs::file_time_type::clock::now() - std::chrono::seconds(nSecondsAgo));
+    }
+}
+
+TEST(DiskMapCache, StoreThenLookupMapsTheFile)
+{
+    TestDirectory directory;
+    DiskMapCache cache(directory.Path());
+
+    ASSERT_TRUE(cache.Open());
+    EXPECT_TRUE(fs::is_directory(directory.Path()));
+
+    MapRequestKey key = MakeKey(L"Seattle");
+    std::vector<uint8_t> bytes = MakeBytes(10000, 1);
+
+    MapValidators validators;
+    validators.strETag = "\"abc123\"";
+    validators.strLastModified = "Sat, 17 Oct 2026 06:00:00 GMT";
+    validators.nFetchedAt = 1792224000;
+    validators.nMaxAgeSeconds = 3600;
+
+    ASSERT_TRUE(cache.Store(key, bytes.data(), bytes.size(), &validators));
+    EXPECT_EQ(1u, cache.EntryCount());
+    EXPECT_EQ(fs::file_size(FileForKey(directory.Path(), key)), cache.TotalBytes());
+
+    MapCacheView view;
+
+    ASSERT_TRUE(cache.Lookup(key, view));
+    ASSERT_EQ(bytes.size(), view.nSize);
+    EXPECT_EQ(0, memcmp(bytes.data(), view.pData, bytes.size()));
+
+    // the bytes are read in place from the mapped file, not a heap copy
+    ASSERT_TRUE(view.file.IsOpen());
+    EXPECT_GE(view.pData, view.file.Data());
+    EXPECT_EQ(view.file.Data() + view.file.Size(), view.pData + view.nSize);
+
+    EXPECT_EQ(validators.strETag, view.validators.strETag);
+    EXPECT_EQ(validators.strLastModified, view.validators.strLastModified);
+    EXPECT_EQ(validators.nFetchedAt, view.validators.nFetchedAt);
+    EXPECT_EQ(validators.nMaxAgeSeconds, view.validators.nMaxAgeSeconds);
+}
+
+TEST(DiskMapCache, MissForAnotherKey)
+{
+    TestDirectory directory;
+    DiskMapCache cache(directory.Path());
+    std::vector<uint8_t> bytes = MakeBytes(100, 1);
+    MapCacheView view;
+
+    ASSERT_TRUE(cache.Open());
+    ASSERT_TRUE(cache.Store(MakeKey(L"Seattle"), bytes.data(), bytes.size()));
+
+    EXPECT_FALSE(cache.Lookup(MakeKey(L"Portland"), view));
+    EXPECT_FALSE(cache.Lookup(MapRequestKey(DEFAULT_IMAGERY_SET, L"Seattle", 800, 600), view));
+}
+
+TEST(DiskMapCache, StoreReplacesTheOldVersion)
+{
+    TestDirectory directory;
+    DiskMapCache cache(directory.Path());
+    MapRequestKey key = MakeKey(L"Seattle");
+    std::vector<uint8_t> first = MakeBytes(5000, 1);
+    std::vector<uint8_t> second = MakeBytes(3000, 2);
+    std::vector<uint8_t> found;
+
+    ASSERT_TRUE(cache.Open());
+    ASSERT_TRUE(cache.Store(key, first.data(), first.size()));
+    ASSERT_TRUE(cache.Store(key, second.data(), second.size()));
+
+    ASSERT_TRUE(LookupBytes(cache, key, found));
+    EXPECT_EQ(second, found);
+    EXPECT_EQ(1u, cache.EntryCount());
+    EXPECT_EQ(fs::file_size(FileForKey(directory.Path(), key)), cache.TotalBytes());
+}
+
+TEST(DiskMapCache, StoreRefusesNothingAndTooMuch)
+{
+    TestDirectory directory;
+    DiskMapCache cache(directory.Path(), 4096);
+    std::vector<uint8_t> bytes = MakeBytes(8192, 1);
+
+    ASSERT_TRUE(cache.Open());
+
+    EXPECT_FALSE(cache.Store(MakeKey(L"Seattle"), nullptr, 10));
+    EXPECT_FALSE(cache.Store(MakeKey(L"Seattle"), bytes.data(), 0));
+
+    // a single map larger than the whole cache isn't kept
+    EXPECT_FALSE(cache.Store(MakeKey(L"Seattle"), bytes.data(), bytes.size()));
+    EXPECT_EQ(0u, cache.EntryCount());
+    EXPECT_EQ(0u, cache.TotalBytes());
+}
+
+TEST(DiskMapCache, EvictsLeastRecentlyUsed)
+{
+    TestDirectory directory;
+    std::vector<uint8_t> bytes = MakeBytes(1000, 1);
+
+    // room for three maps, each 1000 bytes and a header, but not four
+    DiskMapCache cache(directory.Path(), 3600);
+
+    ASSERT_TRUE(cache.Open());
+
+    MapRequestKey a = MakeKey(L"Seattle");
+    MapRequestKey b = MakeKey(L"Portland");
+    MapRequestKey c = MakeKey(L"San Francisco");
+    MapRequestKey d = MakeKey(L"Vancouver");
+    MapCacheView view;
+
+    ASSERT_TRUE(cache.Store(a, bytes.data(), bytes.size()));
+    ASSERT_TRUE(cache.Store(b, bytes.data(), bytes.size()));
+    ASSERT_TRUE(cache.Store(c, bytes.data(), bytes.size()));
+    EXPECT_EQ(3u, cache.EntryCount());
+
+    // using a makes b the least recently used
+    ASSERT_TRUE(cache.Lookup(a, view));
+
+    ASSERT_TRUE(cache.Store(d, bytes.data(), bytes.size()));
+
+    EXPECT_EQ(3u, cache.EntryCount());
+    EXPECT_LE(cache.TotalBytes(), cache.MaxBytes());
+    EXPECT_FALSE(cache.Lookup(b, view));
+    EXPECT_FALSE(fs::exists(FileForKey(directory.Path(), b)));
+    EXPECT_TRUE(cache.Lookup(a, view));
+    EXPECT_TRUE(cache.Lookup(c, view));
+    EXPECT_TRUE(cache.Lookup(d, view));
+}
+
+TEST(DiskMapCache, SetMaxBytesEvicts)
+{
+    TestDirectory directory;
+    DiskMapCache cache(directory.Path());
+    std::vector<uint8_t> bytes = MakeBytes(1000, 1);
+
+    ASSERT_TRUE(cache.Open());
+
+    for (const wchar_t* pszLocation : { L"Seattle", L"Portland", L"San Francisco", L"Vancouver" })
+    {
+        ASSERT_TRUE(cache.Store(MakeKey(pszLocation), bytes.data(), bytes.size()));
+    }
+
+    // the keys, and so the files, are different lengths
+    uint64_t nLastTwo = fs::file_size(FileForKey(directory.Path(), MakeKey(L"San Francisco"))) +
+        fs::file_size(FileForKey(directory.Path(), MakeKey(L"Vancouver")));
+
+    cache.SetMaxBytes(nLastTwo);
+
+    EXPECT_EQ(2u, cache.EntryCount());
+    EXPECT_EQ(nLastTwo, cache.TotalBytes());
+
+    MapCacheView view;
+
+    // the two stored last are the two kept
+    EXPECT_FALSE(cache.Lookup(MakeKey(L"Seattle"), view));
+    EXPECT_FALSE(cache.Lookup(MakeKey(L"Portland"), view));
+    EXPECT_TRUE(cache.Lookup(MakeKey(L"San Francisco"), view));
+    EXPECT_TRUE(cache.Lookup(MakeKey(L"Vancouver"), view));
+}
+
+TEST(DiskMapCache, OpenRebuildsTheLruOrder)
+{
+    TestDirectory directory;
+    std::vector<uint8_t> bytes = MakeBytes(1000, 1);
+    MapRequestKey a = MakeKey(L"Seattle");
+    MapRequestKey b = MakeKey(L"Portland");
+    MapRequestKey c = MakeKey(L"San Francisco");
+    uint64_t nTotalBytes = 0;
+
+    {
+        DiskMapCache cache(directory.Path());
+
+        ASSERT_TRUE(cache.Open());
+        ASSERT_TRUE(cache.Store(a, bytes.data(), bytes.size()));
+        ASSERT_TRUE(cache.Store(b, bytes.data(), bytes.size()));
+        ASSERT_TRUE(cache.Store(c, bytes.data(), bytes.size()));
+
+        nTotalBytes = cache.TotalBytes();
+    }
+
+    // as if b was used longest ago and a most recently, in the last run
+    SetLastUsed(FileForKey(directory.Path(), b), 300);
+    SetLastUsed(FileForKey(directory.Path(), c), 200);
+    SetLastUsed(FileForKey(directory.Path(), a), 100);
+
+    DiskMapCache cache(directory.Path(), nTotalBytes);
+
+    ASSERT_TRUE(cache.Open());
+    EXPECT_EQ(3u, cache.EntryCount());
+    EXPECT_EQ(nTotalBytes, cache.TotalBytes());
+
+    // a smaller cap now drops the least recently used, b, then c
+    MapCacheView view;
+
+    cache.SetMaxBytes(nTotalBytes - 1);
+
+    EXPECT_FALSE(cache.Lookup(b, view));
+    EXPECT_EQ(2u, cache.EntryCount());
+
+    cache.SetMaxBytes(fs::file_size(FileForKey(directory.Path(), a)));
+
+    EXPECT_FALSE(cache.Lookup(c, view));
+    EXPECT_TRUE(cache.Lookup(a, view));
+
+    // and a lookup is remembered in the file for the run after
+    EXPECT_GT(fs::last_write_time(FileForKey(directory.Path(), a)),
+        fs::file_time_type::clock::now() - std::chrono::seconds(50));
+}
+
+TEST(DiskMapCache, OpenRemovesTemporaryFiles)
+{
+    TestDirectory directory;
+    DiskMapCache cache(directory.Path());
+
+    ASSERT_TRUE(cache.Open());
+
+    // left behind by a Store that never finished, and something that
+    // isn't the cache's at all
+    fs::path tempPath = directory.Path() / "0123456789abcdef.tmp";
+    fs::path otherPath = directory.Path() / "readme.txt";
+
+    WriteWholeFile(tempPath, MakeBytes(100, 1));
+    WriteWholeFile(otherPath, MakeBytes(100, 1));
+
+    DiskMapCache reopened(directory.Path());
+
+    ASSERT_TRUE(reopened.Open());
+    EXPECT_FALSE(fs::exists(tempPath));
+    EXPECT_TRUE(fs::exists(otherPath));
+    EXPECT_EQ(0u, reopened.EntryCount());
+}
+
+TEST(DiskMapCache, RejectsACorruptFile)
+{
+    TestDirectory directory;
+    DiskMapCache cache(directory.Path());
+    MapRequestKey key = MakeKey(L"Seattle");
+    std::vector<uint8_t> bytes = MakeBytes(1000, 1);
+    MapCacheView view;
+
+    ASSERT_TRUE(cache.Open());
+    ASSERT_TRUE(cache.Store(key, bytes.data(), bytes.size()));
+
+    // spoil the magic number
+    fs::path path = FileForKey(directory.Path(), key);
+    std::vector<uint8_t> file = ReadWholeFile(path);
+
+    file[0] ^= 0xFF;
+    WriteWholeFile(path, file);
+
+    EXPECT_FALSE(cache.Lookup(key, view));
+
+    // and it is forgotten, file and all
+    EXPECT_FALSE(fs::exists(path));
+    EXPECT_EQ(0u, cache.EntryCount());
+    EXPECT_EQ(0u, cache.TotalBytes());
+}
+
+TEST(DiskMapCache, RejectsAFileOfAnotherVersion)
+{
+    TestDirectory directory;
+    DiskMapCache cache(directory.Path());
+    MapRequestKey key = MakeKey(L"Seattle");
+    std::vector<uint8_t> bytes = MakeBytes(1000, 1);
+    MapCacheView view;
+
+    ASSERT_TRUE(cache.Open());
+    ASSERT_TRUE(cache.Store(key, bytes.data(), bytes.size()));
+
+    // the version follows the magic number
+    fs::path path = FileForKey(directory.Path(), key);
+    std::vector<uint8_t> file = ReadWholeFile(path);
+
+    file[4] = 1;
+    file[5] = file[6] = file[7] = 0;
+    WriteWholeFile(path, file);
+
+    EXPECT_FALSE(cache.Lookup(key, view));
+    EXPECT_FALSE(fs::exists(path));
+}
+
+TEST(DiskMapCache, RejectsAPartialFile)
+{
+    TestDirectory directory;
+    MapRequestKey key = MakeKey(L"Seattle");
+    std::vector<uint8_t> bytes = MakeBytes(1000, 1);
+    fs::path path = FileForKey(directory.Path(), key);
+    std::vector<uint8_t> whole;
+
+    {
+        DiskMapCache cache(directory.Path());
+
+        ASSERT_TRUE(cache.Open());
+        ASSERT_TRUE(cache.Store(key, bytes.data(), bytes.size()));
+
+        whole = ReadWholeFile(path);
+    }
+
+    // cut short in the header, and just after it, with no image at all
+    for (size_t nKeep : { (size_t)0, (size_t)10, whole.size() - bytes.size() })
+    {
+        WriteWholeFile(path, std::vector<uint8_t>(whole.begin(), whole.begin() + nKeep));
+
+        DiskMapCache cache(directory.Path());
+        MapCacheView view;
+
+        ASSERT_TRUE(cache.Open());
+        EXPECT_FALSE(cache.Lookup(key, view)) << "kept " << nKeep << " bytes";
+        EXPECT_FALSE(fs::exists(path));
+        EXPECT_EQ(0u, cache.EntryCount());
+    }
+}
+
+TEST(DiskMapCache, RejectsAFileForAnotherKey)
+{
+    TestDirectory directory;
+    DiskMapCache cache(directory.Path());
+    MapRequestKey seattle = MakeKey(L"Seattle");
+    MapRequestKey portland = MakeKey(L"Portland");
+    std::vector<uint8_t> bytes = MakeBytes(1000, 1);
+    MapCacheView view;
+
+    ASSERT_TRUE(cache.Open());
+    ASSERT_TRUE(cache.Store(seattle, bytes.data(), bytes.size()));
+
+    // as a hash collision would leave it: Seattle's map under Portland's name
+    fs::rename(FileForKey(directory.Path(), seattle), FileForKey(directory.Path(), portland));
+
+    DiskMapCache reopened(directory.Path());
+
+    ASSERT_TRUE(reopened.Open());
+    EXPECT_FALSE(reopened.Lookup(portland, view));
+    EXPECT_FALSE(fs::exists(FileForKey(directory.Path(), portland)));
+}
+
+TEST(DiskMapCache, UpdateValidatorsKeepsTheImage)
+{
+    TestDirectory directory;
+    DiskMapCache cache(directory.Path());
+    MapRequestKey key = MakeKey(L"Seattle");
+    std::vector<uint8_t> bytes = MakeBytes(1000, 1);
+
+    MapValidators before;
+    before.strETag = "\"v1\"";
+    before.nFetchedAt = 1000;
+    before.nMaxAgeSeconds = 60;
+
+    MapValidators after;
+    after.strETag = "\"v1\"";
+    after.strLastModified = "Sat, 17 Oct 2026 06:00:00 GMT";
+    after.nFetchedAt = 2000;
+    after.nMaxAgeSeconds = 120;
+
+    ASSERT_TRUE(cache.Open());
+    EXPECT_FALSE(cache.UpdateValidators(key, after));
+
+    ASSERT_TRUE(cache.Store(key, bytes.data(), bytes.size(), &before));
+    ASSERT_TRUE(cache.UpdateValidators(key, after));
+
+    MapCacheView view;
+
+    ASSERT_TRUE(cache.Lookup(key, view));
+    ASSERT_EQ(bytes.size(), view.nSize);
+    EXPECT_EQ(0, memcmp(bytes.data(), view.pData, bytes.size()));
+    EXPECT_EQ(after.strLastModified, view.validators.strLastModified);
+    EXPECT_EQ(after.nFetchedAt, view.validators.nFetchedAt);
+    EXPECT_EQ(after.nMaxAgeSeconds, view.validators.nMaxAgeSeconds);
+}
+
+TEST(DiskMapCache, RemoveForgetsTheMap)
+{
+    TestDirectory directory;
+    DiskMapCache cache(directory.Path());
+    MapRequestKey key = MakeKey(L"Seattle");
+    std::vector<uint8_t> bytes = MakeBytes(1000, 1);
+    MapCacheView view;
+
+    ASSERT_TRUE(cache.Open());
+    ASSERT_TRUE(cache.Store(key, bytes.data(), bytes.size()));
+
+    cache.Remove(key);
+
+    EXPECT_FALSE(cache.Lookup(key, view));
+    EXPECT_FALSE(fs::exists(FileForKey(directory.Path(), key)));
+    EXPECT_EQ(0u, cache.EntryCount());
+    EXPECT_EQ(0u, cache.TotalBytes());
+}
+
+TEST(DiskMapCache, AViewOutlivesItsFile)
+{
+    TestDirectory directory;
+    DiskMapCache cache(directory.Path());
+    MapRequestKey key = MakeKey(L"Seattle");
+    std::vector<uint8_t> first = MakeBytes(1000, 1);
+    std::vector<uint8_t> second = MakeBytes(1000, 2);
+    MapCacheView view;
+
+    ASSERT_TRUE(cache.Open());
+    ASSERT_TRUE(cache.Store(key, first.data(), first.size()));
+    ASSERT_TRUE(cache.Lookup(key, view));
+
+    // replacing the map doesn't change the one being read
+    ASSERT_TRUE(cache.Store(key, second.data(), second.size()));
+    EXPECT_EQ(0, memcmp(first.data(), view.pData, first.size()));
+
+    std::vector<uint8_t> found;
+
+    ASSERT_TRUE(LookupBytes(cache, key, found));
+    EXPECT_EQ(second, found);
+}
+
+TEST(DiskMapCache, EvictionStepsPastAFileItCantRemove)
+{
+    TestDirectory directory;
+    DiskMapCache cache(directory.Path());
+    std::vector<uint8_t> bytes = MakeBytes(1000, 1);
+
+    ASSERT_TRUE(cache.Open());
+
+    for (const wchar_t* pszLocation : { L"Seattle", L"Portland", L"San Francisco" })
+    {
+        ASSERT_TRUE(cache.Store(MakeKey(pszLocation), bytes.data(), bytes.size()));
+    }
+
+    // the least recently used map's file can't be removed.  A directory
+    // with something in it stands in for a file another program has open.
+    fs::path held = FileForKey(directory.Path(), MakeKey(L"Seattle"));
+    uint64_t nHeldBytes = fs::file_size(held);
+
+    fs::remove(held);
+    fs::create_directory(held);
+    WriteWholeFile(held / "open", bytes);
+
+    // nothing can bring the cache under this, but eviction still ends,
+    // and the file that is left is still counted
+    cache.SetMaxBytes(0);
+
+    EXPECT_EQ(1u, cache.EntryCount());
+    EXPECT_EQ(nHeldBytes, cache.TotalBytes());
+
+    // and it goes once it can
+    fs::remove_all(held);
+    cache.SetMaxBytes(0);
+
+    EXPECT_EQ(0u, cache.EntryCount());
+    EXPECT_EQ(0u, cache.TotalBytes());
+}
@@ -0,0 +1,333 @@
+// DownloadBufferTest.cpp : Unit tests of DownloadBuffer.
+//
+// The read loop's side of the buffer: reserving from a Content-Length,
+// growing without one, committing what a read wrote, and moving the
+// finished bytes on, from the heap and from a memory resource.
+#include <algorithm>
+#include <cstring>
+#include <memory_resource>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "DownloadBuffer.h"
+#include "MapRequestArena.h"
+
+namespace
+{
+    // a resource that counts what it hands out and gets back, so the
+    // tests can see the old block go back when the buffer grows
+    class CountingResource : public std::pmr::memory_resource
+    {
+    public:
+        size_t  nAllocations = 0;
+        size_t  nDeallocations = 0;
+        size_t  nBytesOutstanding = 0;
+
+    private:
+        void* do_allocate(size_t nBytes, size_t nAlignment) override
+        {
+            nAllocations++;
+            nBytesOutstanding += nBytes;
+            return std::pmr::new_delete_resource()->allocate(nBytes, nAlignment);
+        }
+
+        void do_deallocate(void* p, size_t nBytes, size_t nAlignment) override
+        {
+            nDeallocations++;
+            nBytesOutstanding -= nBytes;
+            std::pmr::new_delete_resource()->deallocate(p, nBytes, nAlignment);
+        }
+
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+        {
+            return this == &other;
+        }
+    };
+
+    // write nBytes of a counting pattern starting at nFirst, as one read
+    void WriteBytes(DownloadBuffer& buffer, size_t nBytes, size_t nFirst)
+    {
+        size_t nAvailable = 0;
+        uint8_t* pWrite = buffer.PrepareWrite(nBytes, &nAvailable);
+
+        ASSERT_NE(nullptr, pWrite);
+        ASSERT_GE(nAvailable, nBytes);
+
+        for (size_t i = 0; i < nBytes; i++)
+        {
+            pWrite[i] = (uint8_t)(nFirst + i);
+        }
+
+        buffer.CommitWrite(nBytes);
+    }
+
+    void ExpectPattern(const DownloadBuffer& buffer, size_t nBytes)
+    {
+        ASSERT_EQ(nBytes, buffer.Size());
+
+        for (size_t i = 0; i < nBytes; i++)
+        {
+            ASSERT_EQ((uint8_t)i, buffer.Data()[i]) << "at byte " << i;
+        }
+    }
+}
+
+TEST(DownloadBuffer, StartsEmpty)
+{
+    DownloadBuffer buffer;
+
+    EXPECT_EQ(nullptr, buffer.Data());
+    EXPECT_EQ(0u, buffer.Size());
+    EXPECT_EQ(0u, buffer.Capacity());
+    EXPECT_EQ(0u, buffer.AllocationCount());
+}
+
+TEST(DownloadBuffer, ReserveSizesOnce)
+{
+    DownloadBuffer buffer;
+
+    ASSERT_TRUE(buffer.Reserve(100001));
+    EXPECT_EQ(100001u, buffer.Capacity());
+    EXPECT_EQ(1u, buffer.AllocationCount());
+
+    // the whole Content-Length, read in pieces, needs nothing more
+    for (size_t nOffset = 0; nOffset < 100000; nOffset += 500)
+    {
+        WriteBytes(buffer, 500, nOffset);
+    }
+
+    ExpectPattern(buffer, 100000);
+    EXPECT_EQ(1u, buffer.AllocationCount());
+
+    // and reserving less than there is room for changes nothing
+    ASSERT_TRUE(buffer.Reserve(10));
+    EXPECT_EQ(100001u, buffer.Capacity());
+    EXPECT_EQ(1u, buffer.AllocationCount());
+}
+
+TEST(DownloadBuffer, ReserveClampsAtMaxReserve)
+{
+    DownloadBuffer buffer;
+
+    // a bogus Content-Length doesn't allocate the world
+    ASSERT_TRUE(buffer.Reserve(DownloadBuffer::kMaxReserve * 4));
+    EXPECT_EQ(DownloadBuffer::kMaxReserve, buffer.Capacity());
+
+    ASSERT_TRUE(buffer.Reserve(DownloadBuffer::kMaxReserve + 1));
+    EXPECT_EQ(DownloadBuffer::kMaxReserve, buffer.Capacity());
+    EXPECT_EQ(1u, buffer.AllocationCount());
+}
+
+TEST(DownloadBuffer, PrepareWriteStartsAtInitialCapacity)
+{
+    DownloadBuffer buffer;
+    size_t nAvailable = 0;
+
+    ASSERT_NE(nullptr, buffer.PrepareWrite(512, &nAvailable));
+    EXPECT_EQ(DownloadBuffer::kInitialCapacity, buffer.Capacity());
+    EXPECT_EQ(DownloadBuffer::kInitialCapacity, nAvailable);
+
+    // a zero-byte request still gets somewhere to write
+    DownloadBuffer empty;
+
+    ASSERT_NE(nullptr, empty.PrepareWrite(0, &nAvailable));
+    EXPECT_GE(nAvailable, 1u);
+}
+
+TEST(DownloadBuffer, PrepareWriteDoubles)
+{
+    DownloadBuffer buffer;
+    size_t nExpectedCapacity = DownloadBuffer::kInitialCapacity;
+    size_t nWritten = 0;
+
+    WriteBytes(buffer, 512, nWritten);
+    nWritten += 512;
+
+    // fill the buffer a read at a time and watch it double each time
+    for (int nGrowth = 0; nGrowth < 5; nGrowth++)
+    {
+        while (nWritten < nExpectedCapacity)
+        {
+            size_t nRead = std::min<size_t>(512, nExpectedCapacity - nWritten);
+
+            WriteBytes(buffer, nRead, nWritten);
+            nWritten += nRead;
+        }
+
+        EXPECT_EQ(nExpectedCapacity, buffer.Capacity());
+
+        WriteBytes(buffer, 1, nWritten);
+        nWritten += 1;
+        nExpectedCapacity *= 2;
+
+        EXPECT_EQ(nExpectedCapacity, buffer.Capacity());
+    }
+
+    // logarithmic, not one allocation per read
+    EXPECT_EQ(6u, buffer.AllocationCount());
+    ExpectPattern(buffer, nWritten);
+}
+
+TEST(DownloadBuffer, PrepareWriteGrowsPastDoubleForBigReads)
+{
+    DownloadBuffer buffer;
+    size_t nAvailable = 0;
+
+    ASSERT_NE(nullptr, buffer.PrepareWrite(DownloadBuffer::kInitialCapacity * 5, &nAvailable));
+    EXPECT_EQ(DownloadBuffer::kInitialCapacity * 5, buffer.Capacity());
+    EXPECT_EQ(DownloadBuffer::kInitialCapacity * 5, nAvailable);
+}
+
+TEST(DownloadBuffer, CommitWriteClampsToCapacity)
+{
+    DownloadBuffer buffer;
+    size_t nAvailable = 0;
+
+    ASSERT_TRUE(buffer.Reserve(100));
+    ASSERT_NE(nullptr, buffer.PrepareWrite(10, &nAvailable));
+    EXPECT_EQ(100u, nAvailable);
+
+    // a read can't have written more than it was given room for
+    buffer.CommitWrite(1000);
+    EXPECT_EQ(100u, buffer.Size());
+
+    // and once full, nothing more is committed without more room
+    buffer.CommitWrite(1);
+    EXPECT_EQ(100u, buffer.Size());
+}
+
+TEST(DownloadBuffer, ClearKeepsMemory)
+{
+    DownloadBuffer buffer;
+
+    WriteBytes(buffer, 1000, 0);
+
+    const uint8_t* pBefore = buffer.Data();
+    size_t nCapacity = buffer.Capacity();
+
+    buffer.Clear();
+
+    EXPECT_EQ(0u, buffer.Size());
+    EXPECT_EQ(nCapacity, buffer.Capacity());
+    EXPECT_EQ(pBefore, buffer.Data());
+
+    buffer.Release();
+
+    EXPECT_EQ(nullptr, buffer.Data());
+    EXPECT_EQ(0u, buffer.Capacity());
+}
+
+TEST(DownloadBuffer, MoveConstructTakesTheBytes)
+{
+    DownloadBuffer source;
+
+    WriteBytes(source, 3000, 0);
+
+    const uint8_t* pBytes = source.Data();
+    DownloadBuffer moved(std::move(source));
+
+    EXPECT_EQ(pBytes, moved.Data());
+    ExpectPattern(moved, 3000);
+
+    EXPECT_EQ(nullptr, source.Data());
+    EXPECT_EQ(0u, source.Size());
+    EXPECT_EQ(0u, source.Capacity());
+}
+
+TEST(DownloadBuffer, MoveAssignTakesTheBytes)
+{
+    DownloadBuffer source;
+    DownloadBuffer target;
+
+    WriteBytes(source, 3000, 0);
+    WriteBytes(target, 10, 100);
+
+    const uint8_t* pBytes = source.Data();
+
+    target = std::move(source);
+
+    // the target's own bytes are freed, and it has the source's
+    EXPECT_EQ(pBytes, target.Data());
+    ExpectPattern(target, 3000);
+
+    EXPECT_EQ(nullptr, source.Data());
+    EXPECT_EQ(0u, source.Size());
+    EXPECT_EQ(0u, source.Capacity());
+
+    // the moved-from buffer is still usable
+    WriteBytes(source, 10, 0);
+    ExpectPattern(source, 10);
+}
+
+TEST(DownloadBuffer, MoveAssignFromResourceBuffer)
+{
+    CountingResource resource;
+
+    {
+        DownloadBuffer source(&resource);
+        DownloadBuffer target;
+
+        WriteBytes(source, 2000, 0);
+        WriteBytes(target, 2000, 0);
+
+        target = std::move(source);
+
+        ExpectPattern(target, 2000);
+        EXPECT_EQ(1u, resource.nAllocations);
+        EXPECT_EQ(0u, resource.nDeallocations);
+    }
+
+    // the block goes back to the resource it came from
+    EXPECT_EQ(1u, resource.nDeallocations);
+    EXPECT_EQ(0u, resource.nBytesOutstanding);
+}
+
+TEST(DownloadBuffer, ResourceGrowCopiesAndFreesTheOldBlock)
+{
+    CountingResource resource;
+
+    {
+        DownloadBuffer buffer(&resource);
+        size_t nWritten = 0;
+
+        // three growths: the initial capacity, then double twice
+        while (nWritten <= DownloadBuffer::kInitialCapacity * 2)
+        {
+            WriteBytes(buffer, 700, nWritten);
+            nWritten += 700;
+        }
+
+        EXPECT_EQ(DownloadBuffer::kInitialCapacity * 4, buffer.Capacity());
+        EXPECT_EQ(3u, buffer.AllocationCount());
+        EXPECT_EQ(3u, resource.nAllocations);
+
+        // a resource has no realloc, so each growth copied the bytes
+        // and gave the old block back
+        EXPECT_EQ(2u, resource.nDeallocations);
+        EXPECT_EQ(buffer.Capacity(), resource.nBytesOutstanding);
+
+        ExpectPattern(buffer, nWritten);
+    }
+
+    EXPECT_EQ(3u, resource.nDeallocations);
+    EXPECT_EQ(0u, resource.nBytesOutstanding);
+}
+
+TEST(DownloadBuffer, ArenaBackedBuffer)
+{
+    MapRequestArena arena;
+    DownloadBuffer buffer(arena.Resource());
+
+    ASSERT_TRUE(buffer.Reserve(20000));
+
+    for (size_t nOffset = 0; nOffset < 100000; nOffset += 1000)
+    {
+        WriteBytes(buffer, 1000, nOffset);
+    }
+
+    ExpectPattern(buffer, 100000);
+    EXPECT_GE(arena.BytesAllocated(), buffer.Capacity());
+    EXPECT_EQ(buffer.AllocationCount(), arena.AllocationCount());
+}
@@ -0,0 +1,459 @@
+// HttpConnectionPoolTest.cpp : Unit tests of HttpConnectionPool and
+// HttpRequestTimer, the parts of HttpSessionPool that don't need WinInet.
+//
+// The pool here holds plain sockets to a LocalHttpServer on the loopback
+// interface, and each request is timed the way HttpRequest times one from
+// WinInet's status callbacks: the connect function reports connecting and
+// connected, so a request on a reused connection reports neither.
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "HttpConnectionPool.h"
+#include "HttpRequestTimer.h"
+#include "LocalHttpServer.h"
+
+namespace
+{
+    typedef HttpRequestTimer::Clock Clock;
+
+    // one TCP connection to the server, closed when the last pointer to it goes
+    struct Socket
+    {
+        explicit Socket(int nSocket) : nSocket(nSocket) {}
+        ~Socket() { close(nSocket); }
+
+        int nSocket;
+    };
+
+    typedef std::shared_ptr<Socket> SocketPtr;
+    typedef HttpConnectionPool<SocketPtr> SocketPool;
+
+    // the request being made on this thread, for the connect function to
+    // report to, as WinInet's status callbacks report to HttpRequest
+    thread_local HttpRequestTimer* t_pTimer = nullptr;
+
+    std::vector<uint8_t> MakeBody(size_t nBytes)
+    {
+        std::vector<uint8_t> body(nBytes);
+
+        for (size_t i = 0; i < nBytes; i++)
+        {
+            body[i] = (uint8_t)(i * 13 + (i >> 8));
+        }
+
+        return body;
+    }
+
+    // connects to 127.0.0.1, counting the sockets it makes and closes
+    class Connector
+    {
+    public:
+        SocketPool::Connect Connect()
+        {
+            return [this](const std::string& strHost, uint16_t nPort) -> SocketPtr
+            {
+                if (t_pTimer)
+                {
+                    t_pTimer->Connecting();
+                }
+
+                sockaddr_in address;
+
+                memset(&address, 0, sizeof(address));
+                address.sin_family = AF_INET;
+                address.sin_port = htons(nPort);
+
+                int nSocket = socket(AF_INET, SOCK_STREAM, 0);
+
+                if (nSocket < 0 || 1 != inet_pton(AF_INET, strHost.c_str(), &address.sin_addr) ||
+                    0 != connect(nSocket, reinterpret_cast<sockaddr*>(&address), sizeof(address)))
+                {
+                    if (nSocket >= 0)
+                    {
+                        close(nSocket);
+                    }
+
+                    return SocketPtr();
+                }
+
+                if (t_pTimer)
+                {
+                    t_pTimer->Connected();
+                }
+
+                m_nConnects++;
+                return std::make_shared<Socket>(nSocket);
+            };
+        }
+
+        SocketPool::Disconnect Disconnect()
+        {
+            return [this](SocketPtr& socket)
+            {
+                socket.reset();
+                m_nDisconnects++;
+            };
+        }
+
+        int     m_nConnects = 0;
+        int     m_nDisconnects = 0;
+    };
+
+    // one GET on a connection from the pool, handed back dead if the
+    // request failed on it.  Returns the status, or 0 if there was no
+    // response.
+    int Get(SocketPool& pool, uint16_t nPort, const std::string& strPath,
+        std::vector<uint8_t>& bodyOut, HttpRequestTiming& timingOut)
+    {
+        HttpRequestTimer timer;
+
+        timer.Start();
+        t_pTimer = &timer;
+
+        bool bReused = false;
+        SocketPtr socket = pool.Acquire("127.0.0.1", nPort, &bReused);
+
+        t_pTimer = nullptr;
+        bodyOut.clear();
+
+        if (!socket)
+        {
+            timingOut = timer.Finish();
+            return 0;
+        }
+
+        std::string strRequest = "GET " + strPath + " HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n";
+
+        timer.Sending();
+
+        int nStatus = 0;
+        std::string strResponse;
+        size_t nHeaderEnd = std::string::npos;
+        char buffer[16 * 1024];
+
+        if ((ssize_t)strRequest.size() == send(socket->nSocket, strRequest.data(), strRequest.size(), MSG_NOSIGNAL))
+        {
+            // the status line and headers
+            while (std::string::npos == (nHeaderEnd = strResponse.find("\r\n\r\n")))
+            {
+                ssize_t nRead = recv(socket->nSocket, buffer, sizeof(buffer), 0);
+
+                if (nRead <= 0)
+                {
+                    break;
+                }
+
+                strResponse.append(buffer, nRead);
+            }
+        }
+
+        if (std::string::npos != nHeaderEnd)
+        {
+            timer.HeadersReceived();
+
+            nStatus = atoi(strResponse.c_str() + strlen("HTTP/1.1 "));
+
+            size_t nContentLength = 0;
+            size_t nField = strResponse.find("Content-Length: ");
+
+            if (std::string::npos != nField && nField < nHeaderEnd)
+            {
+                nContentLength = strtoul(strResponse.c_str() + nField + strlen("Content-Length: "), nullptr, 10);
+            }
+
+            bodyOut.assign(strResponse.begin() + nHeaderEnd + 4, strResponse.end());
+            timer.BodyRead(bodyOut.size());
+
+            while (bodyOut.size() < nContentLength)
+            {
+                ssize_t nRead = recv(socket->nSocket, buffer, sizeof(buffer), 0);
+
+                if (nRead <= 0)
+                {
+                    nStatus = 0;
+                    break;
+                }
+
+                bodyOut.insert(bodyOut.end(), buffer, buffer + nRead);
+                timer.BodyRead(nRead);
+            }
+        }
+
+        pool.Release("127.0.0.1", nPort, std::move(socket), 0 != nStatus);
+
+        timingOut = timer.Finish();
+
+        EXPECT_EQ(bReused, timingOut.reusedConnection);
+
+        return nStatus;
+    }
+
+    class HttpConnectionPoolTest : public ::testing::Test
+    {
+    protected:
+        void SetUp() override
+        {
+            m_small = MakeBody(3000);
+            m_big = MakeBody(40 * 1000);
+
+            for (LocalHttpServer* pServer : { &m_server, &m_other })
+            {
+                pServer->AddFile("/small.jpeg", m_small);
+                pServer->AddFile("/big.jpeg", m_big);
+            }
+        }
+
+        LocalHttpServer         m_server;
+        LocalHttpServer         m_other;
+        std::vector<uint8_t>    m_small;
+        std::vector<uint8_t>    m_big;
+        Connector               m_connector;
+    };
+}
+
+TEST(HttpRequestTimer, TimesEachStepOfANewConnection)
+{
+    Clock::time_point start = Clock::now();
+    HttpRequestTimer timer;
+
+    timer.Start(start);
+    timer.Connecting(start + std::chrono::milliseconds(5));
+    timer.Connecting(start + std::chrono::milliseconds(8));     // only the first counts
+    timer.Connected(start + std::chrono::milliseconds(15));
+    timer.Sending(start + std::chrono::milliseconds(40));
+    timer.Sending(start + std::chrono::milliseconds(45));
+    timer.HeadersReceived(start + std::chrono::milliseconds(100));
+    timer.BodyRead(1000);
+    timer.BodyRead(234);
+
+    const HttpRequestTiming& timing = timer.Finish(start + std::chrono::milliseconds(250));
+
+    EXPECT_FALSE(timing.reusedConnection);
+    EXPECT_DOUBLE_EQ(10.0, timing.connectMs);
+    EXPECT_DOUBLE_EQ(25.0, timing.tlsMs);
+    EXPECT_DOUBLE_EQ(60.0, timing.firstByteMs);
+    EXPECT_DOUBLE_EQ(150.0, timing.transferMs);
+    EXPECT_DOUBLE_EQ(250.0, timing.totalMs);
+    EXPECT_EQ(1234u, timing.bytesRead);
+}
+
+TEST(HttpRequestTimer, AReusedConnectionHasNoConnectOrTlsTime)
+{
+    Clock::time_point start = Clock::now();
+    HttpRequestTimer timer;
+
+    timer.Start(start);
+    timer.Sending(start + std::chrono::milliseconds(2));
+    timer.HeadersReceived(start + std::chrono::milliseconds(30));
+
+    const HttpRequestTiming& timing = timer.Finish(start + std::chrono::milliseconds(50));
+
+    EXPECT_TRUE(timing.reusedConnection);
+    EXPECT_DOUBLE_EQ(0.0, timing.connectMs);
+    EXPECT_DOUBLE_EQ(0.0, timing.tlsMs);
+    EXPECT_DOUBLE_EQ(28.0, timing.firstByteMs);
+    EXPECT_DOUBLE_EQ(20.0, timing.transferMs);
+}
+
+TEST(HttpRequestTimer, StartForgetsTheLastRequest)
+{
+    Clock::time_point start = Clock::now();
+    HttpRequestTimer timer;
+
+    timer.Start(start);
+    timer.Connecting(start);
+    timer.Connected(start + std::chrono::milliseconds(10));
+    timer.HeadersReceived(start + std::chrono::milliseconds(20));
+    timer.BodyRead(100);
+    timer.Finish(start + std::chrono::milliseconds(30));
+
+    // and a request that failed before its headers spent it all waiting
+    timer.Start(start + std::chrono::milliseconds(100));
+    timer.Sending(start + std::chrono::milliseconds(100));
+
+    const HttpRequestTiming& timing = timer.Finish(start + std::chrono::milliseconds(140));
+
+    EXPECT_TRUE(timing.reusedConnection);
+    EXPECT_EQ(0u, timing.bytesRead);
+    EXPECT_DOUBLE_EQ(40.0, timing.firstByteMs);
+    EXPECT_DOUBLE_EQ(0.0, timing.transferMs);
+    EXPECT_DOUBLE_EQ(40.0, timing.totalMs);
+}
+
+TEST_F(HttpConnectionPoolTest, ReusesAConnectionPerHost)
+{
+    ASSERT_TRUE(m_server.Start());
+    ASSERT_TRUE(m_other.Start());
+
+    SocketPool pool(m_connector.Connect(), m_connector.Disconnect());
+
+    for (int i = 0; i < 3; i++)
+    {
+        for (LocalHttpServer* pServer : { &m_server, &m_other })
+        {
+            std::vector<uint8_t> body;
+            HttpRequestTiming timing;
+
+            ASSERT_EQ(200, Get(pool, pServer->Port(), "/small.jpeg", body, timing));
+            EXPECT_EQ(m_small, body);
+
+            // only the first request to each server connects
+            EXPECT_EQ(i > 0, timing.reusedConnection) << "request " << i;
+        }
+    }
+
+    SocketPool::Stats stats = pool.GetStats();
+
+    EXPECT_EQ(2u, stats.nConnects);
+    EXPECT_EQ(4u, stats.nReuses);
+    EXPECT_EQ(2u, pool.IdleCount());
+
+    // and the server saw one connection each
+    EXPECT_EQ(3u, m_server.RequestCount());
+    EXPECT_EQ(3u, m_other.RequestCount());
+
+    pool.Clear();
+
+    EXPECT_EQ(0u, pool.IdleCount());
+    EXPECT_EQ(2, m_connector.m_nDisconnects);
+}
+
+TEST_F(HttpConnectionPoolTest, RequestsAtTheSameTimeGetConnectionsOfTheirOwn)
+{
+    ASSERT_TRUE(m_server.Start());
+
+    SocketPool pool(m_connector.Connect(), m_connector.Disconnect(), 2);
+    SocketPtr sockets[3];
+    bool bReused = true;
+
+    for (SocketPtr& socket : sockets)
+    {
+        socket = pool.Acquire("127.0.0.1", m_server.Port(), &bReused);
+
+        ASSERT_TRUE(socket);
+        EXPECT_FALSE(bReused);
+    }
+
+    EXPECT_EQ(3, m_connector.m_nConnects);
+
+    // the host only keeps two of them
+    for (SocketPtr& socket : sockets)
+    {
+        pool.Release("127.0.0.1", m_server.Port(), std::move(socket), true);
+    }
+
+    EXPECT_EQ(2u, pool.IdleCount());
+    EXPECT_EQ(1u, pool.GetStats().nOverflow);
+    EXPECT_EQ(1, m_connector.m_nDisconnects);
+
+    // the last one released is the first handed out
+    SocketPtr socket = pool.Acquire("127.0.0.1", m_server.Port(), &bReused);
+
+    EXPECT_TRUE(bReused);
+    pool.Release("127.0.0.1", m_server.Port(), std::move(socket), true);
+}
+
+TEST_F(HttpConnectionPoolTest, EvictsADeadConnection)
+{
+    ASSERT_TRUE(m_server.Start());
+
+    uint16_t nPort = m_server.Port();
+    SocketPool pool(m_connector.Connect(), m_connector.Disconnect());
+    std::vector<uint8_t> body;
+    HttpRequestTiming timing;
+
+    ASSERT_EQ(200, Get(pool, nPort, "/small.jpeg", body, timing));
+    ASSERT_EQ(1u, pool.IdleCount());
+
+    // the server goes away and comes back, which closes the idle
+    // connection under the pool
+    m_server.Stop();
+    ASSERT_TRUE(m_server.Start(nPort));
+
+    // the request on the dead connection fails, and the connection is
+    // closed instead of going back to the pool
+    EXPECT_EQ(0, Get(pool, nPort, "/small.jpeg", body, timing));
+    EXPECT_TRUE(timing.reusedConnection);
+    EXPECT_EQ(0u, pool.IdleCount());
+    EXPECT_EQ(1u, pool.GetStats().nEvicted);
+    EXPECT_EQ(1, m_connector.m_nDisconnects);
+
+    // so the next one connects again
+    ASSERT_EQ(200, Get(pool, nPort, "/small.jpeg", body, timing));
+    EXPECT_FALSE(timing.reusedConnection);
+    EXPECT_EQ(m_small, body);
+    EXPECT_EQ(2u, pool.GetStats().nConnects);
+}
+
+TEST_F(HttpConnectionPoolTest, CountsAConnectionThatCannotBeMade)
+{
+    // a port with nothing listening on it
+    ASSERT_TRUE(m_server.Start());
+
+    uint16_t nPort = m_server.Port();
+
+    m_server.Stop();
+
+    SocketPool pool(m_connector.Connect(), m_connector.Disconnect());
+    std::vector<uint8_t> body;
+    HttpRequestTiming timing;
+
+    EXPECT_EQ(0, Get(pool, nPort, "/small.jpeg", body, timing));
+    EXPECT_EQ(1u, pool.GetStats().nConnectFailures);
+    EXPECT_EQ(0u, pool.GetStats().nConnects);
+    EXPECT_EQ(0u, pool.IdleCount());
+}
+
+TEST_F(HttpConnectionPoolTest, TimesTheFirstByteAndTheTransfer)
+{
+    // 40 KB at 200 KB a second is a fifth of a second
+    LocalHttpFaults faults;
+
+    faults.nLatencyMs = 60;
+    faults.nBytesPerSecond = 200 * 1000;
+    m_server.SetFaults(faults);
+
+    ASSERT_TRUE(m_server.Start());
+
+    SocketPool pool(m_connector.Connect(), m_connector.Disconnect());
+
+    for (int i = 0; i < 2; i++)
+    {
+        std::vector<uint8_t> body;
+        HttpRequestTiming timing;
+
+        ASSERT_EQ(200, Get(pool, m_server.Port(), "/big.jpeg", body, timing));
+        EXPECT_EQ(m_big, body);
+        EXPECT_EQ(m_big.size(), timing.bytesRead);
+
+        // the server waits before answering, and then sends slowly
+        EXPECT_GE(timing.firstByteMs, 55.0);
+        EXPECT_GE(timing.transferMs, 100.0);
+        EXPECT_GE(timing.totalMs, timing.firstByteMs + timing.transferMs);
+
+        // a new connection to the loopback is quick, but it is counted
+        if (0 == i)
+        {
+            EXPECT_FALSE(timing.reusedConnection);
+            EXPECT_GT(timing.connectMs, 0.0);
+            EXPECT_LT(timing.connectMs, 50.0);
+        }
+        else
+        {
+            EXPECT_TRUE(timing.reusedConnection);
+            EXPECT_EQ(0.0, timing.connectMs);
+            EXPECT_EQ(0.0, timing.tlsMs);
+        }
+    }
+}
@@ -0,0 +1,372 @@
+// ImageEncoderTest.cpp : Unit tests of the BMP, PNG and JPEG encoders.
+//
+// Each encoder's output is read back and compared with the map it was
+// made from.  The JPEG is decoded with JpegDecoder, and only has to come
+// close.  The BMP and PNG are read by the minimal readers below, which
+// check every header field and, for PNG, every chunk's CRC, and have to
+// give back the exact pixels.
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+#include <gtest/gtest.h>
+
+#include "ImageDecoder.h"
+#include "ImageEncoder.h"
+#include "JpegDecoder.h"
+#include "JpegEncoder.h"
+#include "MapImage.h"
+#include "PngEncoder.h"
+
+namespace
+{
+    // a smooth gradient, with the fourth byte of each pixel set to
+    // something the encoders must ignore
+    std::shared_ptr<MapImage> MakeImage(int nWidth, int nHeight)
+    {
+        std::shared_ptr<MapImage> pImage = MapImage::Create(nWidth, nHeight);
+
+        for (int y = 0; y < nHeight; y++)
+        {
+            uint8_t* pRow = pImage->Row(y);
+
+            for (int x = 0; x < nWidth; x++)
+            {
+                pRow[x * 4 + 0] = (uint8_t)(x * 255 / nWidth);
+                pRow[x * 4 + 1] = (uint8_t)(y * 255 / nHeight);
+                pRow[x * 4 + 2] = (uint8_t)((x + y) * 127 / (nWidth + nHeight));
+                pRow[x * 4 + 3] = 0xA5;
+            }
+        }
+
+        return pImage;
+    }
+
+    uint32_t GetLE16(const uint8_t* p) { return p[0] | (p[1] << 8); }
+    uint32_t GetLE32(const uint8_t* p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24); }
+    uint32_t GetBE32(const uint8_t* p) { return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+
+    // the first three bytes of every pixel match
+    void ExpectSameColors(const MapImage& expected, const MapImage& actual)
+    {
+        ASSERT_EQ(expected.Width(), actual.Width());
+        ASSERT_EQ(expected.Height(), actual.Height());
+
+        for (int y = 0; y < expected.Height(); y++)
+        {
+            for (int x = 0; x < expected.Width(); x++)
+            {
+                ASSERT_EQ(0, memcmp(expected.Row(y) + x * 4, actual.Row(y) + x * 4, 3))
+                    << "pixel " << x << ", " << y;
+            }
+        }
+    }
+
+    // a 24bpp BI_RGB BMP, as CreateBmpEncoder writes it
+    std::shared_ptr<MapImage> ReadBmp(const std::vector<uint8_t>& bmp)
+    {
+        EXPECT_GE(bmp.size(), 54u);
+
+        if (bmp.size() < 54 || 'B' != bmp[0] || 'M' != bmp[1])
+        {
+            return nullptr;
+        }
+
+        const uint8_t* pInfo = bmp.data() + 14;
+        uint32_t nOffset = GetLE32(bmp.data() + 10);
+        int nWidth = (int)GetLE32(pInfo + 4);
+        int nHeight = (int)GetLE32(pInfo + 8);
+        size_t nRowBytes = ((size_t)nWidth * 3 + 3) & ~(size_t)3;
+
+        EXPECT_EQ(bmp.size(), GetLE32(bmp.data() + 2));
+        EXPECT_EQ(54u, nOffset);
+        EXPECT_EQ(40u, GetLE32(pInfo));
+        EXPECT_EQ(1u, GetLE16(pInfo + 12));
+        EXPECT_EQ(24u, GetLE16(pInfo + 14));
+        EXPECT_EQ(0u, GetLE32(pInfo + 16));
+        EXPECT_EQ(nRowBytes * nHeight, GetLE32(pInfo + 20));
+
+        if (nWidth <= 0 || nHeight <= 0 || nOffset + nRowBytes * nHeight != bmp.size())
+        {
+            return nullptr;
+        }
+
+        std::shared_ptr<MapImage> pImage = MapImage::Create(nWidth, nHeight);
+
+        // bottom-up
+        for (int y = 0; y < nHeight; y++)
+        {
+            const uint8_t* pSource = bmp.data() + nOffset + (size_t)(nHeight - 1 - y) * nRowBytes;
+            uint8_t* pDest = pImage->Row(y);
+
+            for (int x = 0; x < nWidth; x++)
+            {
+                memcpy(pDest + x * 4, pSource + x * 3, 3);
+                pDest[x * 4 + 3] = 0;
+            }
+
+            // the padding is zero
+            for (size_t i = (size_t)nWidth * 3; i < nRowBytes; i++)
+            {
+                EXPECT_EQ(0, pSource[i]) << "row " << y;
+            }
+        }
+
+        return pImage;
+    }
+
+    // the Paeth predictor, from the PNG specification
+    uint8_t Paeth(int a, int b, int c)
+    {
+        int p = a + b - c;
+        int pa = abs(p - a);
+        int pb = abs(p - b);
+        int pc = abs(p - c);
+
+        return (uint8_t)((pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c);
+    }
+
+    // an 8-bit RGB PNG with no interlacing: the signature, the chunks and
+    // their CRCs, IHDR, the IDAT data inflated and unfiltered, and IEND
+    std::shared_ptr<MapImage> ReadPng(const std::vector<uint8_t>& png)
+    {
+        static const uint8_t kSignature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+        if (png.size() < 8 || 0 != memcmp(png.data(), kSignature, 8))
+        {
+            ADD_FAILURE() << "no PNG signature";
+            return nullptr;
+        }
+
+        int nWidth = 0;
+        int nHeight = 0;
+        std::vector<uint8_t> idat;
+        std::vector<std::string> chunks;
+        size_t nOffset = 8;
+
+        while (nOffset + 12 <= png.size())
+        {
+            uint32_t nLength = GetBE32(png.data() + nOffset);
+            const uint8_t* pType = png.data() + nOffset + 4;
+            const uint8_t* pData = pType + 4;
+
+            if (nOffset + 12 + nLength > png.size())
+            {
+                ADD_FAILURE() << "chunk runs past the end";
+                return nullptr;
+            }
+
+            // the CRC covers the type and the data
+            uint32_t nCrc = (uint32_t)crc32(crc32(0, nullptr, 0), pType, 4 + nLength);
+
+            EXPECT_EQ(GetBE32(pData + nLength), nCrc) << std::string((const char*)pType, 4) << " CRC";
+
+            std::string strType((const char*)pType, 4);
+
+            chunks.push_back(strType);
+
+            if ("IHDR" == strType)
+            {
+                EXPECT_EQ(13u, nLength);
+
+                nWidth = (int)GetBE32(pData);
+                nHeight = (int)GetBE32(pData + 4);
+
+                EXPECT_EQ(8, pData[8]);     // bit depth
+                EXPECT_EQ(2, pData[9]);     // RGB
+                EXPECT_EQ(0, pData[10]);    // deflate
+                EXPECT_EQ(0, pData[11]);    // adaptive filtering
+                EXPECT_EQ(0, pData[12]);    // no interlace
+            }
+            else if ("IDAT" == strType)
+            {
+                idat.insert(idat.end(), pData, pData + nLength);
+            }
+
+            nOffset += 12 + nLength;
+        }
+
+        EXPECT_EQ(png.size(), nOffset);
+
+        if (chunks.size() < 3 || "IHDR" != chunks.front() || "IEND" != chunks.back() || nWidth <= 0 || nHeight <= 0)
+        {
+            ADD_FAILURE() << "IHDR, IDAT and IEND not where they should be";
+            return nullptr;
+        }
+
+        size_t nStride = (size_t)nWidth * 3 + 1;
+        std::vector<uint8_t> raw(nStride * nHeight);
+        uLongf nRawSize = (uLongf)raw.size();
+
+        if (Z_OK != uncompress(raw.data(), &nRawSize, idat.data(), (uLong)idat.size()) || nRawSize != raw.size())
+        {
+            ADD_FAILURE() << "IDAT doesn't inflate to the image's size";
+            return nullptr;
+        }
+
+        std::shared_ptr<MapImage> pImage = MapImage::Create(nWidth, nHeight);
+        std::vector<uint8_t> previous(nWidth * 3, 0);
+        std::vector<uint8_t> current(nWidth * 3);
+
+        for (int y = 0; y < nHeight; y++)
+        {
+            const uint8_t* pFiltered = raw.data() + y * nStride;
+            uint8_t nFilter = pFiltered[0];
+
+            for (int i = 0; i < nWidth * 3; i++)
+            {
+                int a = (i >= 3) ? current[i - 3] : 0;
+                int b = previous[i];
+                int c = (i >= 3) ? previous[i - 3] : 0;
+                int nPredicted = 0;
+
+                switch (nFilter)
+                {
+                case 0: nPredicted = 0; break;
+                case 1: nPredicted = a; break;
+                case 2: nPredicted = b; break;
+                case 3: nPredicted = (a + b) / 2; break;
+                case 4: nPredicted = Paeth(a, b, c); break;
+                default:
+                    ADD_FAILURE() << "filter " << (int)nFilter << " on row " << y;
+                    return nullptr;
+                }
+
+                current[i] = (uint8_t)(pFiltered[1 + i] + nPredicted);
+            }
+
+            // RGB to BGRX
+            uint8_t* pDest = pImage->Row(y);
+
+            for (int x = 0; x < nWidth; x++)
+            {
+                pDest[x * 4 + 0] = current[x * 3 + 2];
+                pDest[x * 4 + 1] = current[x * 3 + 1];
+                pDest[x * 4 + 2] = current[x * 3 + 0];
+                pDest[x * 4 + 3] = 0;
+            }
+
+            previous.swap(current);
+        }
+
+        return pImage;
+    }
+}
+
+TEST(ImageEncoder, BmpRoundTripsExactly)
+{
+    // 3 bytes a pixel, so odd widths need row padding
+    for (int nWidth : { 1, 2, 3, 5, 64, 101 })
+    {
+        std::shared_ptr<MapImage> pImage = MakeImage(nWidth, 7);
+        std::vector<uint8_t> bmp;
+
+        ASSERT_TRUE(CreateBmpEncoder()->Encode(*pImage, bmp));
+
+        std::shared_ptr<MapImage> pRead = ReadBmp(bmp);
+
+        ASSERT_TRUE(pRead) << "width " << nWidth;
+        ExpectSameColors(*pImage, *pRead);
+    }
+}
+
+TEST(ImageEncoder, PngRoundTripsExactly)
+{
+    std::shared_ptr<MapImage> pImage = MakeImage(123, 45);
+
+    // stored, the default and the best compression
+    for (int nLevel : { 0, 1, 9 })
+    {
+        std::vector<uint8_t> png;
+
+        ASSERT_TRUE(CreatePngEncoder(nLevel)->Encode(*pImage, png));
+
+        std::shared_ptr<MapImage> pRead = ReadPng(png);
+
+        ASSERT_TRUE(pRead) << "level " << nLevel;
+        ExpectSameColors(*pImage, *pRead);
+    }
+}
+
+TEST(ImageEncoder, PngOfOnePixel)
+{
+    std::shared_ptr<MapImage> pImage = MakeImage(1, 1);
+    std::vector<uint8_t> png;
+
+    ASSERT_TRUE(CreatePngEncoder()->Encode(*pImage, png));
+
+    std::shared_ptr<MapImage> pRead = ReadPng(png);
+
+    ASSERT_TRUE(pRead);
+    ExpectSameColors(*pImage, *pRead);
+}
+
+TEST(ImageEncoder, JpegRoundTripsClosely)
+{
+    std::shared_ptr<MapImage> pImage = MakeImage(203, 97);
+    std::vector<uint8_t> jpeg;
+
+    ASSERT_TRUE(CreateJpegEncoder(95)->Encode(*pImage, jpeg));
+
+    MapImageHandle hRead;
+
+    ASSERT_TRUE(DecodeToMapImage(*CreateJpegDecoder(), jpeg.data(), jpeg.size(), hRead));
+    ASSERT_EQ(pImage->Width(), hRead->Width());
+    ASSERT_EQ(pImage->Height(), hRead->Height());
+
+    // a smooth gradient at quality 95 comes back within a few levels
+    uint64_t nTotalError = 0;
+    int nMaxError = 0;
+
+    for (int y = 0; y < pImage->Height(); y++)
+    {
+        for (int x = 0; x < pImage->Width() * 4; x++)
+        {
+            if (3 == (x & 3))
+            {
+                continue;
+            }
+
+            int nError = abs((int)pImage->Row(y)[x] - (int)hRead->Row(y)[x]);
+
+            nTotalError += nError;
+            nMaxError = std::max(nMaxError, nError);
+        }
+    }
+
+    double dMeanError = (double)nTotalError / ((double)pImage->Width() * pImage->Height() * 3);
+
+    EXPECT_LT(dMeanError, 2.0);
+    EXPECT_LE(nMaxError, 16);
+}
+
+TEST(ImageEncoder, FormatNames)
+{
+    MapImageFormat format = MapImageFormat::BMP;
+
+    EXPECT_TRUE(ParseMapImageFormat("PNG", format));
+    EXPECT_EQ(MapImageFormat::PNG, format);
+    EXPECT_TRUE(ParseMapImageFormat("jpg", format));
+    EXPECT_EQ(MapImageFormat::JPEG, format);
+    EXPECT_TRUE(ParseMapImageFormat("Jpeg", format));
+    EXPECT_EQ(MapImageFormat::JPEG, format);
+    EXPECT_TRUE(ParseMapImageFormat("bmp", format));
+    EXPECT_EQ(MapImageFormat::BMP, format);
+
+    EXPECT_FALSE(ParseMapImageFormat("gif", format));
+    EXPECT_FALSE(ParseMapImageFormat("", format));
+    EXPECT_EQ(MapImageFormat::BMP, format);
+
+    EXPECT_STREQ("png", MapImageFormatName(MapImageFormat::PNG));
+    EXPECT_STREQ("jpeg", MapImageFormatName(MapImageFormat::JPEG));
+    EXPECT_STREQ("bmp", MapImageFormatName(MapImageFormat::BMP));
+
+    EXPECT_EQ(MapImageFormat::PNG, CreatePngEncoder()->Format());
+    EXPECT_EQ(MapImageFormat::JPEG, CreateJpegEncoder()->Format());
+    EXPECT_EQ(MapImageFormat::BMP, CreateBmpEncoder()->Format());
+}
@@ -0,0 +1,345 @@
+// ImageScalerTest.cpp : Unit tests of ScaleImage.
+//
+// The vectorized and threaded scales are checked against the portable,
+// single-threaded ScaleImageScalar.  For the edge cases, source and dest
+// are put right up against a page that can't be read or written, so a
+// filter tap or a vector load past either end of the pixels crashes the
+// test instead of reading whatever happens to be there.
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "ImageScaler.h"
+
+namespace
+{
+    const ScaleFilter kFilters[] = { ScaleFilter::NEAREST, ScaleFilter::BILINEAR, ScaleFilter::LANCZOS3 };
+
+    // tightly packed 32bpp pixels, flush against an inaccessible page at
+    // one end
+    class GuardedPixels
+    {
+    public:
+        enum Guard
+        {
+            GUARD_AFTER,    // the last pixel is the last byte before the guard
+            GUARD_BEFORE,   // the first pixel is the first byte after the guard
+        };
+
+        GuardedPixels(int nWidth, int nHeight, Guard guard)
+            : m_nWidth(nWidth), m_nHeight(nHeight)
+        {
+            size_t nPage = (size_t)sysconf(_SC_PAGESIZE);
+            size_t nBytes = (size_t)nWidth * nHeight * 4;
+            size_t nDataPages = (nBytes + nPage - 1) / nPage;
+
+            // a guard page on both sides, and the pixels against one of them
+            m_nMapped = (nDataPages + 2) * nPage;
+            m_pMapped = (uint8_t*)mmap(nullptr, m_nMapped, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+            EXPECT_NE(MAP_FAILED, (void*)m_pMapped);
+
+            mprotect(m_pMapped, nPage, PROT_NONE);
+            mprotect(m_pMapped + (nDataPages + 1) * nPage, nPage, PROT_NONE);
+
+            m_pPixels = (GUARD_BEFORE == guard) ? m_pMapped + nPage : m_pMapped + (nDataPages + 1) * nPage - nBytes;
+        }
+
+        ~GuardedPixels()
+        {
+            munmap(m_pMapped, m_nMapped);
+        }
+
+        GuardedPixels(const GuardedPixels&) = delete;
+        GuardedPixels& operator=(const GuardedPixels&) = delete;
+
+        PixelBuffer Buffer() const
+        {
+            PixelBuffer buffer = { m_pPixels, m_nWidth, m_nHeight, (size_t)m_nWidth * 4 };
+            return buffer;
+        }
+
+        ConstPixelBuffer ConstBuffer() const
+        {
+            ConstPixelBuffer buffer = { m_pPixels, m_nWidth, m_nHeight, (size_t)m_nWidth * 4 };
+            return buffer;
+        }
+
+    private:
+        int         m_nWidth;
+        int         m_nHeight;
+        uint8_t*    m_pMapped = nullptr;
+        size_t      m_nMapped = 0;
+        uint8_t*    m_pPixels = nullptr;
+    };
+
+    // pixels in an ordinary vector
+    struct Image
+    {
+        Image(int nWidth, int nHeight) : width(nWidth), height(nHeight), pixels((size_t)nWidth * nHeight * 4) {}
+
+        PixelBuffer Buffer()
+        {
+            PixelBuffer buffer = { pixels.data(), width, height, (size_t)width * 4 };
+            return buffer;
+        }
+
+        ConstPixelBuffer ConstBuffer() const
+        {
+            ConstPixelBuffer buffer = { pixels.data(), width, height, (size_t)width * 4 };
+            return buffer;
+        }
+
+        int                     width;
+        int                     height;
+        std::vector<uint8_t>    pixels;
+    };
+
+    // something like a map: gradients with sharp edges and noise, so
+    // Lanczos rings and clamps
+    void FillMapLike(const PixelBuffer& buffer, uint32_t nSeed = 1)
+    {
+        for (int y = 0; y < buffer.height; y++)
+        {
+            uint8_t* pRow = buffer.Row(y);
+
+            for (int x = 0; x < buffer.width; x++)
+            {
+                nSeed = nSeed * 1103515245 + 12345;
+
+                bool bRoad = (x / 7 + y / 5) % 4 == 0;
+
+                pRow[x * 4 + 0] = bRoad ? 255 : (uint8_t)(x * 3 + y);
+                pRow[x * 4 + 1] = bRoad ? 0 : (uint8_t)(y * 5);
+                pRow[x * 4 + 2] = (uint8_t)(nSeed >> 24);
+                pRow[x * 4 + 3] = (uint8_t)((x ^ y) * 17);
+            }
+        }
+    }
+
+    // the largest difference between two buffers of the same size
+    int MaxDifference(const ConstPixelBuffer& a, const ConstPixelBuffer& b)
+    {
+        int nMax = 0;
+
+        for (int y = 0; y < a.height; y++)
+        {
+            for (int i = 0; i < a.width * 4; i++)
+            {
+                nMax = std::max(nMax, abs((int)a.Row(y)[i] - (int)b.Row(y)[i]));
+            }
+        }
+
+        return nMax;
+    }
+
+    ConstPixelBuffer ConstOf(const PixelBuffer& buffer)
+    {
+        ConstPixelBuffer constBuffer = { buffer.pPixels, buffer.width, buffer.height, buffer.stride };
+        return constBuffer;
+    }
+}
+
+TEST(ImageScaler, SimdMatchesTheScalarReference)
+{
+    if (!ImageScalerHasSimd())
+    {
+        GTEST_SKIP() << "no SIMD in this build";
+    }
+
+    Image source(203, 131);
+
+    FillMapLike(source.Buffer());
+
+    // up, down, and one axis each way
+    const int kSizes[][2] = { { 512, 300 }, { 64, 40 }, { 97, 301 }, { 410, 17 }, { 1, 1 }, { 203, 130 } };
+
+    for (ScaleFilter filter : kFilters)
+    {
+        for (const int* pSize : kSizes)
+        {
+            Image simd(pSize[0], pSize[1]);
+            Image scalar(pSize[0], pSize[1]);
+
+            ScaleImage(source.ConstBuffer(), simd.Buffer(), filter, 1);
+            ScaleImageScalar(source.ConstBuffer(), scalar.Buffer(), filter);
+
+            EXPECT_LE(MaxDifference(simd.ConstBuffer(), scalar.ConstBuffer()), 1)
+                << ScaleFilterName(filter) << " to " << pSize[0] << "x" << pSize[1];
+        }
+    }
+}
+
+TEST(ImageScaler, NearestPicksTheNearestPixel)
+{
+    Image source(10, 6);
+    Image dest(25, 4);
+
+    FillMapLike(source.Buffer());
+
+    ScaleImage(source.ConstBuffer(), dest.Buffer(), ScaleFilter::NEAREST);
+
+    for (int y = 0; y < dest.height; y++)
+    {
+        for (int x = 0; x < dest.width; x++)
+        {
+            // the source pixel under the middle of the dest pixel
+            int nSourceX = (int)((x + 0.5) * source.width / dest.width);
+            int nSourceY = (int)((y + 0.5) * source.height / dest.height);
+
+            EXPECT_EQ(0, memcmp(dest.ConstBuffer().Row(y) + x * 4, source.ConstBuffer().Row(nSourceY) + nSourceX * 4, 4))
+                << x << ", " << y;
+        }
+    }
+}
+
+TEST(ImageScaler, IdentityIsExact)
+{
+    for (int nWidth : { 1, 3, 64, 257 })
+    {
+        Image source(nWidth, 37);
+
+        FillMapLike(source.Buffer(), nWidth);
+
+        for (ScaleFilter filter : kFilters)
+        {
+            Image dest(nWidth, 37);
+            Image scalar(nWidth, 37);
+
+            ScaleImage(source.ConstBuffer(), dest.Buffer(), filter);
+            ScaleImageScalar(source.ConstBuffer(), scalar.Buffer(), filter);
+
+            EXPECT_EQ(source.pixels, dest.pixels) << ScaleFilterName(filter) << " at width " << nWidth;
+            EXPECT_EQ(source.pixels, scalar.pixels) << ScaleFilterName(filter) << " at width " << nWidth;
+        }
+    }
+}
+
+TEST(ImageScaler, AFlatImageStaysFlat)
+{
+    Image source(50, 30);
+
+    for (size_t i = 0; i < source.pixels.size(); i++)
+    {
+        source.pixels[i] = (uint8_t)(0x30 + (i & 3) * 0x40);
+    }
+
+    for (ScaleFilter filter : kFilters)
+    {
+        for (int nWidth : { 7, 50, 333 })
+        {
+            Image dest(nWidth, 41);
+
+            ScaleImage(source.ConstBuffer(), dest.Buffer(), filter);
+
+            // the weights add up to exactly one, even with Lanczos's negative lobes
+            for (size_t i = 0; i < dest.pixels.size(); i++)
+            {
+                ASSERT_EQ(source.pixels[i & 3], dest.pixels[i]) << ScaleFilterName(filter) << " byte " << i;
+            }
+        }
+    }
+}
+
+TEST(ImageScaler, EdgesAndOddWidthsStayInBounds)
+{
+    // widths that leave 1, 2 and 3 pixels after the four-pixel vector
+    // loops, and sizes at which the filters are wider than the image
+    const int kSizes[][2] = {
+        { 1, 1 }, { 1, 7 }, { 2, 3 }, { 3, 1 }, { 5, 5 }, { 6, 9 }, { 7, 2 }, { 13, 11 }, { 17, 3 }, { 255, 3 },
+    };
+
+    for (GuardedPixels::Guard guard : { GuardedPixels::GUARD_AFTER, GuardedPixels::GUARD_BEFORE })
+    {
+        for (const int* pSource : kSizes)
+        {
+            GuardedPixels source(pSource[0], pSource[1], guard);
+
+            FillMapLike(source.Buffer());
+
+            for (const int* pDest : kSizes)
+            {
+                GuardedPixels dest(pDest[0], pDest[1], guard);
+
+                for (ScaleFilter filter : kFilters)
+                {
+                    // a stray read or write past either end crashes here
+                    ScaleImage(source.ConstBuffer(), dest.Buffer(), filter, 1);
+
+                    Image scalar(pDest[0], pDest[1]);
+
+                    ScaleImageScalar(source.ConstBuffer(), scalar.Buffer(), filter);
+
+                    EXPECT_LE(MaxDifference(ConstOf(dest.Buffer()), scalar.ConstBuffer()), 1)
+                        << ScaleFilterName(filter) << " " << pSource[0] << "x" << pSource[1]
+                        << " to " << pDest[0] << "x" << pDest[1];
+                }
+            }
+        }
+    }
+}
+
+TEST(ImageScaler, ThreadsGiveTheSamePixels)
+{
+    Image source(800, 500);
+
+    FillMapLike(source.Buffer());
+
+    // enlarging and shrinking, with row counts that don't split evenly
+    const int kSizes[][2] = { { 1283, 797 }, { 301, 187 } };
+
+    for (ScaleFilter filter : kFilters)
+    {
+        for (const int* pSize : kSizes)
+        {
+            Image single(pSize[0], pSize[1]);
+
+            ScaleImage(source.ConstBuffer(), single.Buffer(), filter, 1);
+
+            for (int nThreads : { 2, 3, 8, 0 })
+            {
+                Image threaded(pSize[0], pSize[1]);
+
+                ScaleImage(source.ConstBuffer(), threaded.Buffer(), filter, nThreads);
+
+                EXPECT_EQ(single.pixels, threaded.pixels)
+                    << ScaleFilterName(filter) << " on " << nThreads << " threads";
+            }
+        }
+    }
+}
+
+TEST(ImageScaler, RowsScaledApartMatchTheWhole)
+{
+    Image source(640, 480);
+
+    FillMapLike(source.Buffer());
+
+    for (ScaleFilter filter : kFilters)
+    {
+        Image whole(500, 333);
+        Image pieces(500, 333);
+
+        ScaleImage(source.ConstBuffer(), whole.Buffer(), filter);
+
+        // in uneven pieces, as a map arrives
+        int nRow = 0;
+
+        for (int nPiece : { 1, 40, 7, 100, 185 })
+        {
+            ScaleImageRows(source.ConstBuffer(), pieces.Buffer(), filter, nRow, nRow + nPiece);
+            nRow += nPiece;
+        }
+
+        ASSERT_EQ(333, nRow);
+        EXPECT_EQ(whole.pixels, pieces.pixels) << ScaleFilterName(filter);
+    }
+}
@@ -0,0 +1,143 @@
+// JpegDecoderTest.cpp : Unit tests of DecodeJpegStream.
+//
+// A map decoded while it downloads must come out the same as one decoded
+// after, however the bytes arrive, and a download that fails or ends
+// early must fail the decode rather than leave it waiting.
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "ImageDecoder.h"
+#include "JpegDecoder.h"
+#include "MapImage.h"
+#include "StreamingBuffer.h"
+
+namespace
+{
+    // a map from the benchmark fixtures, big enough to take many stream reads
+    std::vector<uint8_t> LoadJpeg(const char* pszName)
+    {
+        std::string strPath = std::string(MAPBENCH_FIXTURES_DIR) + "/" + pszName;
+        std::ifstream file(strPath, std::ios::binary);
+
+        EXPECT_TRUE(file.good()) << strPath;
+
+        return std::vector<uint8_t>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+
+    // write bytes into body nPiece at a time, as a download does
+    void Download(const std::vector<uint8_t>& bytes, size_t nBytes, size_t nPiece, StreamingBuffer& body)
+    {
+        size_t nOffset = 0;
+
+        while (nOffset < nBytes)
+        {
+            size_t nAvailable = 0;
+            uint8_t* pWrite = body.PrepareWrite(nPiece, &nAvailable);
+            size_t nWrite = std::min(std::min(nPiece, nAvailable), nBytes - nOffset);
+
+            memcpy(pWrite, bytes.data() + nOffset, nWrite);
+            body.CommitWrite(nWrite);
+            nOffset += nWrite;
+
+            std::this_thread::yield();
+        }
+    }
+
+    bool SamePixels(const MapImage& a, const MapImage& b)
+    {
+        if (a.Width() != b.Width() || a.Height() != b.Height())
+        {
+            return false;
+        }
+
+        for (int y = 0; y < a.Height(); y++)
+        {
+            if (0 != memcmp(a.Row(y), b.Row(y), (size_t)a.Width() * 4))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+}
+
+TEST(JpegDecoder, StreamMatchesInMemoryDecode)
+{
+    std::vector<uint8_t> jpeg = LoadJpeg("seattle_800x500.jpg");
+
+    MapImageHandle hExpected;
+    ASSERT_TRUE(DecodeToMapImage(*CreateJpegDecoder(), jpeg.data(), jpeg.size(), hExpected));
+
+    for (size_t nPiece : { (size_t)1, (size_t)500, (size_t)4096, (size_t)100000 })
+    {
+        StreamingBuffer body;
+        MapImageHandle hMap;
+        bool bDecoded = false;
+
+        std::thread decoder([&]() { bDecoded = DecodeJpegStream(body, hMap); });
+
+        Download(jpeg, jpeg.size(), nPiece, body);
+        body.Finish();
+
+        decoder.join();
+
+        ASSERT_TRUE(bDecoded) << "pieces of " << nPiece;
+        EXPECT_TRUE(SamePixels(*hExpected, *hMap)) << "pieces of " << nPiece;
+    }
+}
+
+TEST(JpegDecoder, StreamFailsWhenTheDownloadIsAborted)
+{
+    std::vector<uint8_t> jpeg = LoadJpeg("seattle_800x500.jpg");
+
+    StreamingBuffer body;
+    MapImageHandle hMap;
+    bool bDecoded = true;
+
+    std::thread decoder([&]() { bDecoded = DecodeJpegStream(body, hMap); });
+
+    Download(jpeg, jpeg.size() / 2, 1000, body);
+    body.Abort();
+
+    decoder.join();
+
+    EXPECT_FALSE(bDecoded);
+    EXPECT_FALSE(hMap);
+}
+
+TEST(JpegDecoder, StreamFailsWhenTheDownloadEndsEarly)
+{
+    std::vector<uint8_t> jpeg = LoadJpeg("seattle_800x500.jpg");
+
+    // the connection closed part way with no Content-Length to say so
+    StreamingBuffer body;
+    MapImageHandle hMap;
+
+    Download(jpeg, jpeg.size() / 2, 1000, body);
+    body.Finish();
+
+    EXPECT_FALSE(DecodeJpegStream(body, hMap));
+    EXPECT_FALSE(hMap);
+
+    // and an empty one, or one that isn't a JPEG, is no better
+    StreamingBuffer empty;
+    empty.Finish();
+
+    EXPECT_FALSE(DecodeJpegStream(empty, hMap));
+
+    StreamingBuffer notJpeg;
+    std::vector<uint8_t> text(5000, 'x');
+
+    Download(text, text.size(), 1000, notJpeg);
+    notJpeg.Finish();
+
+    EXPECT_FALSE(DecodeJpegStream(notJpeg, hMap));
+}
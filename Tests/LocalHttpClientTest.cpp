@@ -0,0 +1,252 @@
+// LocalHttpClientTest.cpp : Unit tests of LocalHttpClient against a
+// LocalHttpServer on the loopback interface.
+//
+// HttpSessionPool needs WinInet, so only its connection pool and timing
+// can be tested here, in HttpConnectionPoolTest.  These test its POSIX
+// counterpart, which the benchmarks download through: one
+// connection kept alive across requests, reconnecting when it has gone,
+// Content-Length and chunked bodies, conditional requests, and the
+// timeouts and interrupts MapRetrier relies on.
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "LocalHttpClient.h"
+#include "LocalHttpServer.h"
+#include "StreamingBuffer.h"
+
+namespace
+{
+    std::vector<uint8_t> MakeBody(size_t nBytes)
+    {
+        std::vector<uint8_t> body(nBytes);
+
+        for (size_t i = 0; i < nBytes; i++)
+        {
+            body[i] = (uint8_t)(i * 7 + (i >> 8));
+        }
+
+        return body;
+    }
+
+    bool SameBytes(const std::vector<uint8_t>& expected, const StreamingBuffer& body)
+    {
+        return expected.size() == body.Size() &&
+            (expected.empty() || 0 == memcmp(expected.data(), body.Data(), expected.size()));
+    }
+
+    // a server with a small map and a big one
+    class LocalHttpClientTest : public ::testing::Test
+    {
+    protected:
+        void StartServer(const LocalHttpFaults& faults = LocalHttpFaults())
+        {
+            m_small = MakeBody(3000);
+            m_big = MakeBody(1000 * 1000 + 17);
+
+            m_server.AddFile("/small.jpeg", m_small);
+            m_server.AddFile("/big.jpeg", m_big);
+            m_server.SetFaults(faults);
+
+            ASSERT_TRUE(m_server.Start());
+        }
+
+        LocalHttpServer         m_server;
+        std::vector<uint8_t>    m_small;
+        std::vector<uint8_t>    m_big;
+    };
+}
+
+TEST_F(LocalHttpClientTest, KeepsTheConnectionAlive)
+{
+    StartServer();
+
+    LocalHttpClient client;
+
+    for (int i = 0; i < 5; i++)
+    {
+        StreamingBuffer body;
+        LocalHttpTiming timing;
+
+        ASSERT_EQ(200, client.Get(m_server.Port(), (i & 1) ? "/big.jpeg" : "/small.jpeg", body, &timing));
+        EXPECT_TRUE(SameBytes((i & 1) ? m_big : m_small, body));
+
+        // only the first request connects
+        EXPECT_EQ(i > 0, timing.reusedConnection) << "request " << i;
+
+        // the Content-Length sized the buffer, and the reads were at most
+        // kMaxReadSize
+        EXPECT_GE(timing.nReads, (unsigned)(body.Size() / LocalHttpClient::kMaxReadSize));
+    }
+
+    EXPECT_EQ(5u, m_server.RequestCount());
+}
+
+TEST_F(LocalHttpClientTest, ReconnectsAfterClose)
+{
+    StartServer();
+
+    LocalHttpClient client;
+    StreamingBuffer first;
+    StreamingBuffer second;
+    LocalHttpTiming timing;
+
+    ASSERT_EQ(200, client.Get(m_server.Port(), "/small.jpeg", first));
+
+    client.Close();
+
+    ASSERT_EQ(200, client.Get(m_server.Port(), "/small.jpeg", second, &timing));
+    EXPECT_FALSE(timing.reusedConnection);
+    EXPECT_TRUE(SameBytes(m_small, second));
+}
+
+TEST_F(LocalHttpClientTest, ReconnectsWhenTheServerHasGone)
+{
+    StartServer();
+
+    LocalHttpClient client;
+    StreamingBuffer first;
+
+    ASSERT_EQ(200, client.Get(m_server.Port(), "/small.jpeg", first));
+
+    // the server restarts on the same port, closing the kept-alive
+    // connection, and the next request notices and connects again
+    uint16_t nPort = m_server.Port();
+    m_server.Stop();
+    ASSERT_TRUE(m_server.Start(nPort));
+
+    StreamingBuffer second;
+    LocalHttpTiming timing;
+
+    ASSERT_EQ(200, client.Get(nPort, "/small.jpeg", second, &timing));
+    EXPECT_FALSE(timing.reusedConnection);
+    EXPECT_TRUE(SameBytes(m_small, second));
+}
+
+TEST_F(LocalHttpClientTest, NotFoundKeepsTheConnection)
+{
+    StartServer();
+
+    LocalHttpClient client;
+    StreamingBuffer missing;
+    StreamingBuffer found;
+    LocalHttpTiming timing;
+
+    EXPECT_EQ(404, client.Get(m_server.Port(), "/nowhere.jpeg", missing));
+
+    ASSERT_EQ(200, client.Get(m_server.Port(), "/small.jpeg", found, &timing));
+    EXPECT_TRUE(timing.reusedConnection);
+    EXPECT_TRUE(SameBytes(m_small, found));
+}
+
+TEST_F(LocalHttpClientTest, ReadsChunkedBodies)
+{
+    LocalHttpFaults faults;
+    faults.bChunked = true;
+    faults.nChunkBytes = 5000;
+
+    StartServer(faults);
+
+    LocalHttpClient client;
+
+    for (int i = 0; i < 2; i++)
+    {
+        StreamingBuffer body;
+        LocalHttpTiming timing;
+
+        ASSERT_EQ(200, client.Get(m_server.Port(), "/big.jpeg", body, &timing));
+        EXPECT_TRUE(SameBytes(m_big, body));
+        EXPECT_EQ(i > 0, timing.reusedConnection);
+    }
+}
+
+TEST_F(LocalHttpClientTest, ConditionalRequestGetsNotModified)
+{
+    LocalHttpFile file;
+    file.body = MakeBody(2000);
+    file.strContentType = "image/jpeg";
+    file.strETag = "\"v1\"";
+
+    m_server.SetResolver([&file](const std::string& strPath, const std::string&) -> const LocalHttpFile*
+    {
+        return "/tagged.jpeg" == strPath ? &file : nullptr;
+    });
+
+    StartServer();
+
+    LocalHttpClient client;
+    StreamingBuffer full;
+    std::pmr::string headers;
+
+    ASSERT_EQ(200, client.Get(m_server.Port(), "/tagged.jpeg", full, nullptr, nullptr, std::string_view(), &headers));
+    EXPECT_TRUE(SameBytes(file.body, full));
+    EXPECT_NE(std::pmr::string::npos, headers.find("\"v1\""));
+
+    // the same version again has no body, on the same connection
+    StreamingBuffer empty;
+    LocalHttpTiming timing;
+
+    EXPECT_EQ(304, client.Get(m_server.Port(), "/tagged.jpeg", empty, &timing, nullptr, "If-None-Match: \"v1\"\r\n"));
+    EXPECT_EQ(0u, empty.Size());
+    EXPECT_TRUE(timing.reusedConnection);
+
+    // and another version gets the whole file
+    StreamingBuffer changed;
+
+    EXPECT_EQ(200, client.Get(m_server.Port(), "/tagged.jpeg", changed, nullptr, nullptr, "If-None-Match: \"v0\"\r\n"));
+    EXPECT_TRUE(SameBytes(file.body, changed));
+}
+
+TEST_F(LocalHttpClientTest, ReadTimeoutEndsASlowRequest)
+{
+    LocalHttpFaults faults;
+    faults.nLatencyMs = 2000;
+
+    StartServer(faults);
+
+    LocalHttpClient client;
+    StreamingBuffer body;
+    LocalHttpTiming timing;
+
+    client.SetTimeouts(1000, 100, 0);
+
+    auto start = std::chrono::steady_clock::now();
+
+    EXPECT_EQ(0, client.Get(m_server.Port(), "/small.jpeg", body, &timing));
+    EXPECT_TRUE(timing.timedOut);
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(1500));
+}
+
+TEST_F(LocalHttpClientTest, InterruptEndsARequestFromAnotherThread)
+{
+    LocalHttpFaults faults;
+    faults.nLatencyMs = 3000;
+
+    StartServer(faults);
+
+    LocalHttpClient client;
+    StreamingBuffer body;
+    std::atomic<int> nStatus(-1);
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::thread request([&]() { nStatus = client.Get(m_server.Port(), "/small.jpeg", body); });
+
+    // a hedged request has won, so the first is given up
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    client.Interrupt();
+    request.join();
+
+    EXPECT_EQ(0, nStatus.load());
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(2000));
+
+    // and it stays interrupted until reset
+    StreamingBuffer again;
+
+    EXPECT_EQ(0, client.Get(m_server.Port(), "/small.jpeg", again));
+}
@@ -0,0 +1,225 @@
+// MapAdaptiveFetchTest.cpp : Unit tests of MapBandwidthEstimator and
+// PlanMapFetch.
+//
+// The link is described with synthetic downloads, chosen so the
+// predictions come out exact: an eighth of a byte a pixel, a 50 ms first
+// byte, and a rate that puts an 800 x 500 map on either side of the
+// 300 ms target, or its half or quarter size inside it.
+#include <gtest/gtest.h>
+
+#include "MapAdaptiveFetch.h"
+
+namespace
+{
+    const uint64_t kFirstByteUs = 50 * 1000;
+
+    // 125000 bytes for a million pixels is an eighth of a byte a pixel
+    const uint64_t kSampleBytes = 125000;
+    const uint64_t kSamplePixels = 1000 * 1000;
+
+    MapRequestKey MakeKey(int nWidth, int nHeight)
+    {
+        return MapRequestKey(DEFAULT_IMAGERY_SET, L"Seattle", nWidth, nHeight);
+    }
+
+    // an estimate of a link that moves nBytesPerSecond
+    MapBandwidthEstimate LinkOf(uint64_t nBytesPerSecond)
+    {
+        MapBandwidthEstimator estimator;
+
+        estimator.Record(kSampleBytes, kSampleBytes * 1000000 / nBytesPerSecond, kFirstByteUs, kSamplePixels);
+
+        return estimator.Estimate();
+    }
+}
+
+TEST(MapBandwidthEstimator, UnmeasuredIsNotValid)
+{
+    MapBandwidthEstimator estimator;
+    MapBandwidthEstimate estimate = estimator.Estimate();
+
+    EXPECT_FALSE(estimate.bValid);
+    EXPECT_EQ(0.0, estimate.PredictMs(800 * 500));
+    EXPECT_EQ(0u, estimator.Count());
+}
+
+TEST(MapBandwidthEstimator, FirstDownloadIsTakenAsItIs)
+{
+    MapBandwidthEstimate estimate = LinkOf(200000);
+
+    EXPECT_TRUE(estimate.bValid);
+    EXPECT_DOUBLE_EQ(200000.0, estimate.fBytesPerSecond);
+    EXPECT_DOUBLE_EQ(50.0, estimate.fFirstByteMs);
+    EXPECT_DOUBLE_EQ(0.125, estimate.fBytesPerPixel);
+
+    // 50000 bytes at 200000 a second, after the first byte
+    EXPECT_DOUBLE_EQ(300.0, estimate.PredictMs(800 * 500));
+}
+
+TEST(MapBandwidthEstimator, SmallBodiesOnlyMeasureLatency)
+{
+    MapBandwidthEstimator estimator;
+
+    // one read's worth says nothing about the rate
+    estimator.Record(MapBandwidthEstimator::kMinThroughputSampleBytes - 1, 100, 30 * 1000, 100000);
+
+    MapBandwidthEstimate estimate = estimator.Estimate();
+
+    EXPECT_FALSE(estimate.bValid);
+    EXPECT_DOUBLE_EQ(30.0, estimate.fFirstByteMs);
+    EXPECT_GT(estimate.fBytesPerPixel, 0.0);
+    EXPECT_EQ(1u, estimator.Count());
+}
+
+TEST(MapBandwidthEstimator, LaterDownloadsAreSmoothedIn)
+{
+    MapBandwidthEstimator estimator;
+
+    estimator.Record(100000, 1000000, 40 * 1000, 800000);
+    estimator.Record(200000, 1000000, 80 * 1000, 800000);
+
+    MapBandwidthEstimate estimate = estimator.Estimate();
+
+    // a quarter of the way from the first to the second
+    EXPECT_DOUBLE_EQ(125000.0, estimate.fBytesPerSecond);
+    EXPECT_DOUBLE_EQ(50.0, estimate.fFirstByteMs);
+    EXPECT_DOUBLE_EQ(0.15625, estimate.fBytesPerPixel);
+    EXPECT_EQ(2u, estimator.Count());
+}
+
+TEST(MapBandwidthEstimator, BigDownloadsCountForMore)
+{
+    MapBandwidthEstimator estimator;
+
+    // a big download at 1 MB/s, then a small one at 10 MB/s.  Averaging
+    // the rates would give 3.25 MB/s; the link moved far fewer bytes
+    // that fast, so the estimate is barely over 1 MB/s.
+    estimator.Record(1000000, 1000000, 0, 0);
+    estimator.Record(20000, 2000, 0, 0);
+
+    double fBytes = 1000000 + MapBandwidthEstimator::kSmoothing * (20000 - 1000000.0);
+    double fReadUs = 1000000 + MapBandwidthEstimator::kSmoothing * (2000 - 1000000.0);
+
+    EXPECT_DOUBLE_EQ(fBytes * 1000000.0 / fReadUs, estimator.Estimate().fBytesPerSecond);
+    EXPECT_LT(estimator.Estimate().fBytesPerSecond, 1010000.0);
+}
+
+TEST(MapBandwidthEstimator, ResetForgetsTheLink)
+{
+    MapBandwidthEstimator estimator;
+
+    estimator.Record(kSampleBytes, 625000, kFirstByteUs, kSamplePixels);
+    ASSERT_TRUE(estimator.Estimate().bValid);
+
+    estimator.Reset();
+
+    EXPECT_FALSE(estimator.Estimate().bValid);
+    EXPECT_EQ(0u, estimator.Count());
+}
+
+TEST(PlanMapFetch, NoPreviewAtTheTarget)
+{
+    // exactly 300 ms is soon enough
+    MapFetchPlan plan = PlanMapFetch(MakeKey(800, 500), LinkOf(200000), MapAdaptivePolicy());
+
+    EXPECT_FALSE(plan.bPreview);
+    EXPECT_DOUBLE_EQ(300.0, plan.fFullMs);
+}
+
+TEST(PlanMapFetch, HalfSizeJustOverTheTarget)
+{
+    // 362.5 ms, and the half size takes 128.125
+    MapFetchPlan plan = PlanMapFetch(MakeKey(800, 500), LinkOf(160000), MapAdaptivePolicy());
+
+    ASSERT_TRUE(plan.bPreview);
+    EXPECT_EQ(1, plan.nHalvings);
+    EXPECT_EQ(400, plan.previewKey.width);
+    EXPECT_EQ(250, plan.previewKey.height);
+    EXPECT_EQ(L"Seattle", plan.previewKey.location);
+    EXPECT_DOUBLE_EQ(362.5, plan.fFullMs);
+    EXPECT_DOUBLE_EQ(128.125, plan.fPreviewMs);
+}
+
+TEST(PlanMapFetch, HalfSizeAtTheTarget)
+{
+    // the half size arrives in exactly 300 ms, so it will do
+    MapFetchPlan plan = PlanMapFetch(MakeKey(800, 500), LinkOf(50000), MapAdaptivePolicy());
+
+    ASSERT_TRUE(plan.bPreview);
+    EXPECT_EQ(1, plan.nHalvings);
+    EXPECT_DOUBLE_EQ(1050.0, plan.fFullMs);
+    EXPECT_DOUBLE_EQ(300.0, plan.fPreviewMs);
+}
+
+TEST(PlanMapFetch, QuarterSizeOnASlowLink)
+{
+    // the half size would take 362.5 ms, the quarter 128.125
+    MapFetchPlan plan = PlanMapFetch(MakeKey(800, 500), LinkOf(40000), MapAdaptivePolicy());
+
+    ASSERT_TRUE(plan.bPreview);
+    EXPECT_EQ(2, plan.nHalvings);
+    EXPECT_EQ(200, plan.previewKey.width);
+    EXPECT_EQ(125, plan.previewKey.height);
+    EXPECT_DOUBLE_EQ(1300.0, plan.fFullMs);
+    EXPECT_DOUBLE_EQ(128.125, plan.fPreviewMs);
+}
+
+TEST(PlanMapFetch, SmallestAllowedWhenNoneIsInTime)
+{
+    MapAdaptivePolicy policy;
+
+    // only halving once is allowed, and it is still late
+    policy.nMaxPreviewHalvings = 1;
+
+    MapFetchPlan plan = PlanMapFetch(MakeKey(800, 500), LinkOf(40000), policy);
+
+    ASSERT_TRUE(plan.bPreview);
+    EXPECT_EQ(1, plan.nHalvings);
+    EXPECT_DOUBLE_EQ(362.5, plan.fPreviewMs);
+
+    // and a quarter of 400 x 300 would be under the smallest side
+    plan = PlanMapFetch(MakeKey(400, 300), LinkOf(10000), MapAdaptivePolicy());
+
+    ASSERT_TRUE(plan.bPreview);
+    EXPECT_EQ(1, plan.nHalvings);
+    EXPECT_EQ(200, plan.previewKey.width);
+    EXPECT_EQ(150, plan.previewKey.height);
+}
+
+TEST(PlanMapFetch, NoPreviewOnAnUnthrottledLink)
+{
+    // loopback speeds; the map takes barely more than its first byte
+    MapFetchPlan plan = PlanMapFetch(MakeKey(800, 500), LinkOf(500 * 1000 * 1000), MapAdaptivePolicy());
+
+    EXPECT_FALSE(plan.bPreview);
+    EXPECT_LT(plan.fFullMs, 51.0);
+}
+
+TEST(PlanMapFetch, NoPreviewWhenTheWaitIsLatency)
+{
+    // a second to the first byte, on a fast link: a smaller map would
+    // come no sooner
+    MapBandwidthEstimator estimator;
+
+    estimator.Record(kSampleBytes, 125000, 1000 * 1000, kSamplePixels);
+
+    MapFetchPlan plan = PlanMapFetch(MakeKey(800, 500), estimator.Estimate(), MapAdaptivePolicy());
+
+    EXPECT_FALSE(plan.bPreview);
+    EXPECT_DOUBLE_EQ(1050.0, plan.fFullMs);
+}
+
+TEST(PlanMapFetch, NoPreviewWithoutAReason)
+{
+    MapAdaptivePolicy disabled;
+    disabled.bEnabled = false;
+
+    // an unmeasured link is assumed fast
+    EXPECT_FALSE(PlanMapFetch(MakeKey(800, 500), MapBandwidthEstimate(), MapAdaptivePolicy()).bPreview);
+
+    EXPECT_FALSE(PlanMapFetch(MakeKey(800, 500), LinkOf(40000), disabled).bPreview);
+
+    // tiles have a fixed size
+    EXPECT_FALSE(PlanMapFetch(MapRequestKey::ForTile(DEFAULT_IMAGERY_SET, "0231"), LinkOf(40000),
+        MapAdaptivePolicy()).bPreview);
+}
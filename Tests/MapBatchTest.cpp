@@ -0,0 +1,278 @@
+// MapBatchTest.cpp : Unit tests of the batch manifest, PlanMapBatch and
+// RunMapBatch.
+//
+// A manifest is read by LoadMapLocations, as the locations file is, so
+// these check the lines a batch run keeps and the ones it skips.  The
+// batch itself runs on a loader that makes its maps up, and writes BMPs
+// into a directory of the test's own.
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "ImageEncoder.h"
+#include "MapBatch.h"
+#include "MapLocations.h"
+#include "TestDirectory.h"
+
+namespace
+{
+    // write strText, as it is, to a file in directory
+    std::filesystem::path WriteManifest(const TestDirectory& directory, const std::string& strText)
+    {
+        std::filesystem::create_directories(directory.Path());
+
+        std::filesystem::path path = directory.Path() / "manifest.txt";
+        std::ofstream out(path, std::ios::binary);
+
+        out << strText;
+
+        return path;
+    }
+
+    std::vector<uint8_t> ReadFile(const std::filesystem::path& path)
+    {
+        std::ifstream in(path, std::ios::binary);
+
+        return std::vector<uint8_t>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+
+    uint32_t GetLE32(const uint8_t* p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24); }
+
+    MapLocation StaticMap(const wchar_t* pszLocation, int nWidth, int nHeight,
+        const wchar_t* pszImagerySet = DEFAULT_IMAGERY_SET)
+    {
+        MapLocation location;
+
+        location.displayName = pszLocation;
+        location.key = MapRequestKey(pszImagerySet, pszLocation, nWidth, nHeight);
+
+        return location;
+    }
+}
+
+TEST(MapBatchManifest, ReadsEveryFormOfLine)
+{
+    TestDirectory directory;
+
+    std::filesystem::path path = WriteManifest(directory,
+        "\xEF\xBB\xBF# location, width, height [, imagery set [, latitude, longitude [, level]]]\r\n"
+        "Seattle, 800, 500\r\n"
+        "\r\n"
+        "   # an indented comment\n"
+        "Portland, 600, 600, Road\n"
+        "Mount Rainier, 1024, 768, Aerial, 46.8523, -121.7603, 11\n"
+        "Z\xC3\xBCrich,80,1500,,47.3769,8.5417\n");
+
+    std::vector<MapLocation> locations;
+
+    ASSERT_TRUE(LoadMapLocations(path, locations, kMaxMapBatchItems));
+    ASSERT_EQ(4u, locations.size());
+
+    EXPECT_EQ(L"Seattle", locations[0].displayName);
+    EXPECT_EQ(800, locations[0].key.width);
+    EXPECT_EQ(500, locations[0].key.height);
+    EXPECT_EQ(DEFAULT_IMAGERY_SET, locations[0].key.imagerySet);
+    EXPECT_FALSE(locations[0].hasCoordinates);
+
+    EXPECT_EQ(L"Road", locations[1].key.imagerySet);
+
+    EXPECT_EQ(L"Mount Rainier", locations[2].key.location);
+    EXPECT_TRUE(locations[2].hasCoordinates);
+    EXPECT_DOUBLE_EQ(46.8523, locations[2].latitude);
+    EXPECT_DOUBLE_EQ(-121.7603, locations[2].longitude);
+    EXPECT_EQ(11, locations[2].tileLevel);
+
+    // UTF-8, the smallest width and the tallest height, and an empty
+    // imagery set that only makes room for the coordinates
+    EXPECT_EQ(L"Zürich", locations[3].displayName);
+    EXPECT_EQ(80, locations[3].key.width);
+    EXPECT_EQ(1500, locations[3].key.height);
+    EXPECT_EQ(DEFAULT_IMAGERY_SET, locations[3].key.imagerySet);
+    EXPECT_TRUE(locations[3].hasCoordinates);
+    EXPECT_EQ(kDefaultTileLevel, locations[3].tileLevel);
+}
+
+TEST(MapBatchManifest, SkipsBadLines)
+{
+    TestDirectory directory;
+
+    std::filesystem::path path = WriteManifest(directory,
+        "Seattle, 800\n"                    // no height
+        ", 800, 500\n"                      // no location
+        "Portland, 600px, 600\n"            // not a number
+        "Portland, 600, 6e2\n"
+        "Boise, 79, 500\n"                  // too small
+        "Boise, 800, 1501\n"                // too tall
+        "Boise, -800, 500\n"
+        "Boise, 99999999999999999999, 500\n"
+        "Tacoma, , 500\n"
+        "Spokane, 640, 480\n");
+
+    std::vector<MapLocation> locations;
+
+    ASSERT_TRUE(LoadMapLocations(path, locations, kMaxMapBatchItems));
+    ASSERT_EQ(1u, locations.size());
+    EXPECT_EQ(L"Spokane", locations[0].displayName);
+}
+
+TEST(MapBatchManifest, KeepsAMapWithBadCoordinates)
+{
+    TestDirectory directory;
+
+    std::filesystem::path path = WriteManifest(directory,
+        "North Pole, 800, 500, Aerial, 91, 0\n"
+        "Dateline, 800, 500, Aerial, 0, 180.5\n"
+        "Nowhere, 800, 500, Aerial, north, west\n"
+        "Deep, 800, 500, Aerial, 10, 20, 99\n");
+
+    std::vector<MapLocation> locations;
+
+    ASSERT_TRUE(LoadMapLocations(path, locations, kMaxMapBatchItems));
+    ASSERT_EQ(4u, locations.size());
+
+    // still static maps, just not on the tiled map
+    EXPECT_FALSE(locations[0].hasCoordinates);
+    EXPECT_FALSE(locations[1].hasCoordinates);
+    EXPECT_FALSE(locations[2].hasCoordinates);
+
+    // a bad level falls back to the default
+    EXPECT_TRUE(locations[3].hasCoordinates);
+    EXPECT_EQ(kDefaultTileLevel, locations[3].tileLevel);
+}
+
+TEST(MapBatchManifest, FailsWithoutAGoodLine)
+{
+    TestDirectory directory;
+    std::vector<MapLocation> locations = DefaultMapLocations();
+
+    // nothing to read, and nothing good in it, leave the list alone
+    EXPECT_FALSE(LoadMapLocations(directory.Path() / "missing.txt", locations, kMaxMapBatchItems));
+    EXPECT_FALSE(LoadMapLocations(WriteManifest(directory, "# only\n\nBoise, 1, 1\n"), locations, kMaxMapBatchItems));
+    EXPECT_EQ(3u, locations.size());
+    EXPECT_EQ(L"Seattle", locations[0].displayName);
+}
+
+TEST(MapBatchManifest, StopsAtTheLimit)
+{
+    TestDirectory directory;
+    std::string strManifest;
+
+    for (int i = 0; i < 50; i++)
+    {
+        strManifest += "Place " + std::to_string(i) + ", 256, 256\n";
+    }
+
+    std::vector<MapLocation> locations;
+
+    ASSERT_TRUE(LoadMapLocations(WriteManifest(directory, strManifest), locations, 20));
+    ASSERT_EQ(20u, locations.size());
+    EXPECT_EQ(L"Place 19", locations.back().displayName);
+}
+
+TEST(MapBatch, PlansOneFilePerMap)
+{
+    std::vector<MapLocation> locations;
+
+    locations.push_back(StaticMap(L"Mount Rainier", 1024, 768, L"Aerial"));
+    locations.push_back(StaticMap(L"Seattle", 800, 500));
+    locations.push_back(StaticMap(L"Seattle", 800, 500));          // the same map again
+    locations.push_back(StaticMap(L"seattle", 800, 500));          // and again, Bing ignores case
+    locations.push_back(StaticMap(L"St. Louis (Downtown)", 640, 480, L"Road"));
+    locations.push_back(StaticMap(L"st louis downtown", 640, 480, L"Road"));  // another map, the same name
+    locations.push_back(StaticMap(L"???", 640, 480, L"Road"));
+
+    std::vector<MapBatchItem> items = PlanMapBatch(locations, "out", MapImageFormat::PNG);
+
+    ASSERT_EQ(5u, items.size());
+
+    EXPECT_EQ(std::filesystem::path("out") / "Mount_Rainier_1024x768_Aerial.png", items[0].output);
+    EXPECT_EQ(std::filesystem::path("out") / "Seattle_800x500_AerialWithLabels.png", items[1].output);
+    EXPECT_EQ(std::filesystem::path("out") / "St_Louis_Downtown_640x480_Road.png", items[2].output);
+    EXPECT_EQ(std::filesystem::path("out") / "st_louis_downtown_640x480_Road_2.png", items[3].output);
+    EXPECT_EQ(std::filesystem::path("out") / "map_640x480_Road.png", items[4].output);
+
+    EXPECT_EQ(L"st louis downtown", items[3].key.location);
+
+    items = PlanMapBatch(locations, "out", MapImageFormat::JPEG);
+
+    EXPECT_EQ(".jpeg", items[0].output.extension());
+}
+
+TEST(MapBatch, RendersScalesAndReportsFailures)
+{
+    TestDirectory directory;
+
+    std::filesystem::create_directories(directory.Path());
+
+    std::vector<MapLocation> locations;
+
+    locations.push_back(StaticMap(L"Seattle", 200, 100));
+    locations.push_back(StaticMap(L"Portland", 120, 90));          // comes back the wrong size
+    locations.push_back(StaticMap(L"Nowhere", 100, 100));          // fails to load
+
+    std::vector<MapBatchItem> items = PlanMapBatch(locations, directory.Path(), MapImageFormat::BMP);
+    std::atomic<int> nLoads(0);
+
+    MapBatchLoader loader = [&](const MapRequestKey& key, const MapFetchCancelToken&,
+        MapImageHandle& imageOut, MapBatchTimes& timesOut)
+    {
+        nLoads++;
+
+        if (L"Nowhere" == key.location)
+        {
+            timesOut.failedStage = MapBatchStage::FETCH;
+            return false;
+        }
+
+        int nWidth = (L"Portland" == key.location) ? 300 : key.width;
+        int nHeight = (L"Portland" == key.location) ? 200 : key.height;
+        std::shared_ptr<MapImage> pImage = MapImage::Create(nWidth, nHeight);
+
+        for (int y = 0; y < nHeight; y++)
+        {
+            memset(pImage->Row(y), 0x40, (size_t)nWidth * 4);
+        }
+
+        timesOut.nDownloadBytes = 1000;
+        imageOut = pImage;
+
+        return true;
+    };
+
+    std::unique_ptr<ImageEncoder> pEncoder = CreateBmpEncoder();
+    MapBatchReport report;
+
+    RunMapBatch(items, loader, MapImageFormat::BMP,
+        [&](const MapImage& image, std::vector<uint8_t>& dataOut) { return pEncoder->Encode(image, dataOut); },
+        2, report);
+
+    EXPECT_EQ(3, nLoads.load());
+    EXPECT_EQ(2u, report.Succeeded());
+    EXPECT_EQ(1u, report.Failed());
+
+    // every file written is the size its line asked for
+    for (size_t i = 0; i < 2; i++)
+    {
+        std::vector<uint8_t> bmp = ReadFile(items[i].output);
+
+        ASSERT_GE(bmp.size(), 54u) << items[i].output;
+        EXPECT_EQ((uint32_t)items[i].key.width, GetLE32(bmp.data() + 18));
+        EXPECT_EQ((uint32_t)items[i].key.height, GetLE32(bmp.data() + 22));
+    }
+
+    EXPECT_FALSE(std::filesystem::exists(items[2].output));
+
+    std::string strReport = report.Format();
+
+    EXPECT_NE(std::string::npos, strReport.find("1 maps failed"));
+    EXPECT_NE(std::string::npos, strReport.find("at fetch"));
+    EXPECT_NE(std::string::npos, strReport.find("/nowhere/100x100/"));
+    EXPECT_NE(std::string::npos, report.ToJson().find("\"maps\":3"));
+}
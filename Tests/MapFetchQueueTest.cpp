@@ -0,0 +1,405 @@
+// MapFetchQueueTest.cpp : Unit tests of MapFetchQueue, with a fake fetcher.
+//
+// The fetcher stands in for GetBingMap and the completion callback for
+// posting to the UI thread.  A gate the fetcher waits on holds a worker
+// busy, so a test can queue requests behind it and cancel or move them
+// before they start.
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "MapFetchQueue.h"
+
+namespace
+{
+    // a door the fetcher waits at until the test opens it
+    class Gate
+    {
+    public:
+        void Open()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_bOpen = true;
+            m_cv.notify_all();
+        }
+
+        // wait until opened, or the token is cancelled.  Returns false if
+        // it was cancelled.
+        bool Wait(const MapFetchCancelToken& token)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+
+            while (!m_bOpen)
+            {
+                if (token.IsCancelled())
+                {
+                    return false;
+                }
+
+                m_cv.wait_for(lock, std::chrono::milliseconds(1));
+            }
+
+            return true;
+        }
+
+    private:
+        std::mutex              m_mutex;
+        std::condition_variable m_cv;
+        bool                    m_bOpen = false;
+    };
+
+    // what the completion callback has been given, and a way to wait for it
+    class Completions
+    {
+    public:
+        void Add(MapFetchCompletion<std::string>&& completion)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_completions.push_back(std::move(completion));
+            m_threads.insert(std::this_thread::get_id());
+            m_cv.notify_all();
+        }
+
+        // wait for nCount completions.  Returns false after five seconds.
+        bool WaitFor(size_t nCount)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+
+            return m_cv.wait_for(lock, std::chrono::seconds(5), [&] { return m_completions.size() >= nCount; });
+        }
+
+        std::vector<MapFetchCompletion<std::string>> Get()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_completions;
+        }
+
+        // the completion for requestId, which must be there
+        MapFetchCompletion<std::string> For(uint64_t requestId)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            for (const auto& completion : m_completions)
+            {
+                if (completion.requestId == requestId)
+                {
+                    return completion;
+                }
+            }
+
+            ADD_FAILURE() << "no completion for request " << requestId;
+
+            return MapFetchCompletion<std::string>{ 0, MapRequestKey(), MapFetchStatus::FAILED, std::string() };
+        }
+
+        bool CalledOn(std::thread::id threadId)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_threads.count(threadId) != 0;
+        }
+
+    private:
+        std::mutex                                      m_mutex;
+        std::condition_variable                         m_cv;
+        std::vector<MapFetchCompletion<std::string>>    m_completions;
+        std::set<std::thread::id>                       m_threads;
+    };
+
+    MapRequestKey MakeKey(const wchar_t* pszLocation)
+    {
+        return MapRequestKey(DEFAULT_IMAGERY_SET, pszLocation, 500, 400);
+    }
+
+    // the "map" a fake fetch produces for key
+    std::string FakeMap(const MapRequestKey& key)
+    {
+        return "map of " + WideToUtf8(key.location);
+    }
+}
+
+TEST(MapFetchQueue, CompletesEveryRequestOnAWorker)
+{
+    Completions completions;
+    std::atomic<int> nFetches(0);
+
+    MapFetchQueue<std::string> queue(
+        [&](const MapRequestKey& key, const MapFetchCancelToken&, std::string& resultOut)
+        {
+            nFetches++;
+            resultOut = FakeMap(key);
+            return true;
+        },
+        [&](MapFetchCompletion<std::string>&& completion) { completions.Add(std::move(completion)); },
+        3);
+
+    std::vector<uint64_t> requestIds;
+
+    for (const wchar_t* pszLocation : { L"Seattle", L"Portland", L"San Francisco", L"Vancouver", L"Denver" })
+    {
+        uint64_t requestId = queue.Submit(MakeKey(pszLocation));
+
+        ASSERT_NE(0u, requestId);
+        requestIds.push_back(requestId);
+    }
+
+    ASSERT_TRUE(completions.WaitFor(requestIds.size()));
+
+    for (uint64_t requestId : requestIds)
+    {
+        MapFetchCompletion<std::string> completion = completions.For(requestId);
+
+        EXPECT_EQ(MapFetchStatus::SUCCEEDED, completion.status);
+        EXPECT_EQ(FakeMap(completion.key), completion.result);
+    }
+
+    EXPECT_EQ(5, nFetches.load());
+    EXPECT_FALSE(completions.CalledOn(std::this_thread::get_id()));
+
+    queue.Shutdown();
+    EXPECT_EQ(0u, queue.PendingCount());
+}
+
+TEST(MapFetchQueue, ReportsFailures)
+{
+    Completions completions;
+
+    MapFetchQueue<std::string> queue(
+        [&](const MapRequestKey& key, const MapFetchCancelToken&, std::string&)
+        {
+            return key.location != L"Atlantis";
+        },
+        [&](MapFetchCompletion<std::string>&& completion) { completions.Add(std::move(completion)); },
+        2);
+
+    uint64_t good = queue.Submit(MakeKey(L"Seattle"));
+    uint64_t bad = queue.Submit(MakeKey(L"Atlantis"));
+
+    ASSERT_TRUE(completions.WaitFor(2));
+
+    EXPECT_EQ(MapFetchStatus::SUCCEEDED, completions.For(good).status);
+    EXPECT_EQ(MapFetchStatus::FAILED, completions.For(bad).status);
+}
+
+TEST(MapFetchQueue, CancelledWhileQueuedNeverFetches)
+{
+    Completions completions;
+    Gate gate;
+    std::atomic<int> nPortlandFetches(0);
+
+    MapFetchQueue<std::string> queue(
+        [&](const MapRequestKey& key, const MapFetchCancelToken& token, std::string& resultOut)
+        {
+            if (key.location == L"Portland")
+            {
+                nPortlandFetches++;
+            }
+
+            if (!gate.Wait(token))
+            {
+                return false;
+            }
+
+            resultOut = FakeMap(key);
+            return true;
+        },
+        [&](MapFetchCompletion<std::string>&& completion) { completions.Add(std::move(completion)); },
+        1);
+
+    // the one worker is busy with Seattle, so Portland waits behind it
+    uint64_t seattle = queue.Submit(MakeKey(L"Seattle"));
+    uint64_t portland = queue.Submit(MakeKey(L"Portland"));
+
+    ASSERT_TRUE(queue.Cancel(portland));
+
+    // a queued request completes, cancelled, before Cancel returns
+    EXPECT_EQ(MapFetchStatus::CANCELLED, completions.For(portland).status);
+
+    gate.Open();
+
+    ASSERT_TRUE(completions.WaitFor(2));
+    EXPECT_EQ(MapFetchStatus::SUCCEEDED, completions.For(seattle).status);
+    EXPECT_EQ(0, nPortlandFetches.load());
+
+    // and neither can be cancelled once it has completed
+    queue.Shutdown();
+
+    EXPECT_FALSE(queue.Cancel(portland));
+    EXPECT_FALSE(queue.Cancel(seattle));
+}
+
+TEST(MapFetchQueue, CancelledWhileRunningSeesItsToken)
+{
+    Completions completions;
+    Gate gate;
+    std::atomic<bool> bStarted(false);
+
+    MapFetchQueue<std::string> queue(
+        [&](const MapRequestKey& key, const MapFetchCancelToken& token, std::string& resultOut)
+        {
+            bStarted = true;
+
+            if (!gate.Wait(token))
+            {
+                return false;
+            }
+
+            resultOut = FakeMap(key);
+            return true;
+        },
+        [&](MapFetchCompletion<std::string>&& completion) { completions.Add(std::move(completion)); },
+        1);
+
+    uint64_t requestId = queue.Submit(MakeKey(L"Seattle"));
+
+    while (!bStarted)
+    {
+        std::this_thread::yield();
+    }
+
+    // the user switched cities mid-download
+    ASSERT_TRUE(queue.Cancel(requestId));
+    ASSERT_TRUE(completions.WaitFor(1));
+
+    EXPECT_EQ(MapFetchStatus::CANCELLED, completions.For(requestId).status);
+}
+
+TEST(MapFetchQueue, CancelAllCancelsQueuedAndRunning)
+{
+    Completions completions;
+    Gate gate;
+
+    MapFetchQueue<std::string> queue(
+        [&](const MapRequestKey&, const MapFetchCancelToken& token, std::string&)
+        {
+            return gate.Wait(token);
+        },
+        [&](MapFetchCompletion<std::string>&& completion) { completions.Add(std::move(completion)); },
+        2);
+
+    for (const wchar_t* pszLocation : { L"Seattle", L"Portland", L"San Francisco", L"Vancouver", L"Denver" })
+    {
+        queue.Submit(MakeKey(pszLocation));
+    }
+
+    queue.CancelAll();
+
+    ASSERT_TRUE(completions.WaitFor(5));
+
+    for (const auto& completion : completions.Get())
+    {
+        EXPECT_EQ(MapFetchStatus::CANCELLED, completion.status);
+    }
+}
+
+TEST(MapFetchQueue, ShutdownWaitsAndRefusesMore)
+{
+    Completions completions;
+    std::atomic<int> nRunning(0);
+
+    MapFetchQueue<std::string> queue(
+        [&](const MapRequestKey& key, const MapFetchCancelToken&, std::string& resultOut)
+        {
+            // a fetcher that doesn't look at its token finishes anyway
+            nRunning++;
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            resultOut = FakeMap(key);
+            nRunning--;
+            return true;
+        },
+        [&](MapFetchCompletion<std::string>&& completion) { completions.Add(std::move(completion)); },
+        2);
+
+    for (const wchar_t* pszLocation : { L"Seattle", L"Portland", L"San Francisco", L"Vancouver" })
+    {
+        queue.Submit(MakeKey(pszLocation));
+    }
+
+    queue.Shutdown();
+
+    // every request has completed, one way or the other, and none is running
+    EXPECT_EQ(4u, completions.Get().size());
+    EXPECT_EQ(0, nRunning.load());
+    EXPECT_EQ(0u, queue.PendingCount());
+
+    EXPECT_EQ(0u, queue.Submit(MakeKey(L"Denver")));
+}
+
+TEST(MapFetchQueue, ThreadHooksRunOnEveryWorker)
+{
+    std::atomic<int> nStarted(0);
+    std::atomic<int> nStopped(0);
+
+    {
+        MapFetchQueue<std::string> queue(
+            [](const MapRequestKey&, const MapFetchCancelToken&, std::string&) { return true; },
+            nullptr, 3,
+            [&]() { nStarted++; },
+            [&]() { nStopped++; });
+
+        queue.Submit(MakeKey(L"Seattle"));
+    }
+
+    EXPECT_EQ(3, nStarted.load());
+    EXPECT_EQ(3, nStopped.load());
+}
+
+TEST(MapFetchQueue, SharedSchedulerRunsVisibleFirst)
+{
+    MapScheduler scheduler(1);
+    Completions completions;
+    Gate gate;
+    std::mutex orderMutex;
+    std::vector<std::wstring> order;
+
+    MapFetchQueue<std::string>::Fetcher fetcher =
+        [&](const MapRequestKey& key, const MapFetchCancelToken& token, std::string&)
+        {
+            {
+                std::lock_guard<std::mutex> lock(orderMutex);
+                order.push_back(key.location);
+            }
+
+            return key.location != L"Blocker" || gate.Wait(token);
+        };
+
+    MapFetchQueue<std::string>::CompletionCallback onComplete =
+        [&](MapFetchCompletion<std::string>&& completion) { completions.Add(std::move(completion)); };
+
+    MapFetchQueue<std::string> visible(scheduler, MapPriority::VISIBLE, fetcher, onComplete);
+    MapFetchQueue<std::string> prefetch(scheduler, MapPriority::PREFETCH, fetcher, onComplete);
+
+    // hold the one worker, then queue a prefetch before a visible map
+    prefetch.Submit(MakeKey(L"Blocker"));
+
+    while (true)
+    {
+        std::lock_guard<std::mutex> lock(orderMutex);
+
+        if (!order.empty())
+        {
+            break;
+        }
+    }
+
+    prefetch.Submit(MakeKey(L"Portland"));
+    uint64_t moved = prefetch.Submit(MakeKey(L"Denver"));
+    visible.Submit(MakeKey(L"Seattle"));
+
+    // and a queued prefetch scrolled into view goes ahead of the rest
+    ASSERT_TRUE(prefetch.Reprioritize(moved, MapPriority::NEAR_VISIBLE));
+
+    gate.Open();
+
+    ASSERT_TRUE(completions.WaitFor(4));
+
+    std::vector<std::wstring> expected = { L"Blocker", L"Seattle", L"Denver", L"Portland" };
+
+    EXPECT_EQ(expected, order);
+}
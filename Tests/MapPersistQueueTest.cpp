@@ -0,0 +1,271 @@
+// MapPersistQueueTest.cpp : Unit tests of MapPersistQueue.
+//
+// The writes here only record that they ran, and where.  The first write
+// of most tests waits at a gate, so that the ones after it are still
+// queued while the test looks at the queue.
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "MapPersistQueue.h"
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    // a door the writer waits at until the test opens it
+    class Gate
+    {
+    public:
+        void Open()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_bOpen = true;
+            m_cv.notify_all();
+        }
+
+        void Wait()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_bWaiting = true;
+            m_cv.notify_all();
+            m_cv.wait(lock, [this] { return m_bOpen; });
+        }
+
+        // until the writer is at the gate
+        void WaitForWaiter()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this] { return m_bWaiting; });
+        }
+
+    private:
+        std::mutex              m_mutex;
+        std::condition_variable m_cv;
+        bool                    m_bOpen = false;
+        bool                    m_bWaiting = false;
+    };
+
+    // the writes that ran, in order
+    class Journal
+    {
+    public:
+        MapPersistQueue::Write Record(const std::string& strName)
+        {
+            return [this, strName]()
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_names.push_back(strName);
+                m_threads.push_back(std::this_thread::get_id());
+            };
+        }
+
+        std::vector<std::string> Names() const
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_names;
+        }
+
+        std::vector<std::thread::id> Threads() const
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_threads;
+        }
+
+    private:
+        mutable std::mutex              m_mutex;
+        std::vector<std::string>        m_names;
+        std::vector<std::thread::id>    m_threads;
+    };
+
+    MapRequestKey MakeKey(const wchar_t* pszLocation)
+    {
+        return MapRequestKey(DEFAULT_IMAGERY_SET, pszLocation, 500, 400);
+    }
+
+    // hold the writer at gate, on a write of its own
+    void BlockWriter(MapPersistQueue& queue, Gate& gate)
+    {
+        ASSERT_TRUE(queue.Submit(MakeKey(L"Gate"), [&gate]() { gate.Wait(); }));
+        gate.WaitForWaiter();
+    }
+}
+
+TEST(MapPersistQueue, WritesInOrderOnItsOwnThread)
+{
+    Journal journal;
+
+    {
+        MapPersistQueue queue;
+        Gate gate;
+
+        BlockWriter(queue, gate);
+
+        EXPECT_TRUE(queue.Submit(MakeKey(L"Seattle"), journal.Record("Seattle")));
+        EXPECT_TRUE(queue.Submit(MakeKey(L"Portland"), journal.Record("Portland")));
+        EXPECT_TRUE(queue.Submit(MakeKey(L"Boise"), journal.Record("Boise")));
+        EXPECT_EQ(3u, queue.QueuedCount());
+
+        gate.Open();
+        queue.Shutdown(std::chrono::seconds(5));
+
+        EXPECT_EQ(4u, queue.GetStats().nWritten);
+        EXPECT_EQ(0u, queue.GetStats().nDiscarded);
+    }
+
+    EXPECT_EQ(std::vector<std::string>({ "Seattle", "Portland", "Boise" }), journal.Names());
+
+    for (std::thread::id id : journal.Threads())
+    {
+        EXPECT_NE(std::this_thread::get_id(), id);
+    }
+}
+
+TEST(MapPersistQueue, ANewerWriteReplacesAQueuedOne)
+{
+    MapPersistQueue queue;
+    Journal journal;
+    Gate gate;
+
+    BlockWriter(queue, gate);
+
+    EXPECT_TRUE(queue.Submit(MakeKey(L"Seattle"), journal.Record("Seattle v1")));
+    EXPECT_TRUE(queue.Submit(MakeKey(L"Portland"), journal.Record("Portland")));
+    EXPECT_TRUE(queue.Submit(MakeKey(L"Seattle"), journal.Record("Seattle v2")));
+    EXPECT_EQ(2u, queue.QueuedCount());
+
+    gate.Open();
+    queue.Shutdown(std::chrono::seconds(5));
+
+    // it keeps its place in the queue
+    EXPECT_EQ(std::vector<std::string>({ "Seattle v2", "Portland" }), journal.Names());
+
+    MapPersistQueue::Stats stats = queue.GetStats();
+
+    EXPECT_EQ(3u, stats.nQueued);
+    EXPECT_EQ(1u, stats.nReplaced);
+    EXPECT_EQ(3u, stats.nWritten);
+}
+
+TEST(MapPersistQueue, RefusesMapsWhenFull)
+{
+    MapPersistQueue queue(2);
+    Journal journal;
+    Gate gate;
+
+    // the write in progress doesn't count against the queue
+    BlockWriter(queue, gate);
+
+    EXPECT_TRUE(queue.Submit(MakeKey(L"Seattle"), journal.Record("Seattle")));
+    EXPECT_TRUE(queue.Submit(MakeKey(L"Portland"), journal.Record("Portland")));
+    EXPECT_FALSE(queue.Submit(MakeKey(L"Boise"), journal.Record("Boise")));
+
+    // but a map already queued can still be brought up to date
+    EXPECT_TRUE(queue.Submit(MakeKey(L"Seattle"), journal.Record("Seattle again")));
+
+    gate.Open();
+    queue.Shutdown(std::chrono::seconds(5));
+
+    EXPECT_EQ(std::vector<std::string>({ "Seattle again", "Portland" }), journal.Names());
+    EXPECT_EQ(1u, queue.GetStats().nRefused);
+}
+
+TEST(MapPersistQueue, ShutdownDropsWhatHasNotStarted)
+{
+    MapPersistQueue queue;
+    Journal journal;
+    Gate gate;
+
+    BlockWriter(queue, gate);
+
+    EXPECT_TRUE(queue.Submit(MakeKey(L"Seattle"), journal.Record("Seattle")));
+    EXPECT_TRUE(queue.Submit(MakeKey(L"Portland"), journal.Record("Portland")));
+
+    // the write in progress finishes, a little later, and Shutdown waits for it
+    std::thread opener([&gate]()
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        gate.Open();
+    });
+
+    queue.Shutdown();
+    opener.join();
+
+    EXPECT_TRUE(journal.Names().empty());
+    EXPECT_EQ(0u, queue.QueuedCount());
+
+    MapPersistQueue::Stats stats = queue.GetStats();
+
+    EXPECT_EQ(1u, stats.nWritten);
+    EXPECT_EQ(2u, stats.nDiscarded);
+
+    // and nothing more is taken
+    EXPECT_FALSE(queue.Submit(MakeKey(L"Boise"), journal.Record("Boise")));
+    EXPECT_EQ(1u, queue.GetStats().nRefused);
+}
+
+TEST(MapPersistQueue, ShutdownFlushesUntilItsDeadline)
+{
+    MapPersistQueue queue;
+    Gate gate;
+    std::atomic<int> nWrites(0);
+
+    BlockWriter(queue, gate);
+
+    // twenty writes of 50 ms, a second's worth, and a fifth of a second to do them
+    for (int i = 0; i < 20; i++)
+    {
+        std::wstring strLocation = L"Place " + std::to_wstring(i);
+
+        ASSERT_TRUE(queue.Submit(MakeKey(strLocation.c_str()), [&nWrites]()
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            nWrites++;
+        }));
+    }
+
+    gate.Open();
+
+    Clock::time_point start = Clock::now();
+
+    queue.Shutdown(std::chrono::milliseconds(200));
+
+    // the deadline, and the write that was going on at it
+    EXPECT_LT(Clock::now() - start, std::chrono::milliseconds(1000));
+
+    MapPersistQueue::Stats stats = queue.GetStats();
+
+    EXPECT_GE(nWrites.load(), 2);
+    EXPECT_LT(nWrites.load(), 20);
+    EXPECT_EQ(20u, (uint64_t)nWrites.load() + stats.nDiscarded);
+}
+
+TEST(MapPersistQueue, DestructorDropsWhatIsQueued)
+{
+    Journal journal;
+    Gate gate;
+    std::thread opener;
+
+    {
+        MapPersistQueue queue;
+
+        BlockWriter(queue, gate);
+        EXPECT_TRUE(queue.Submit(MakeKey(L"Seattle"), journal.Record("Seattle")));
+
+        opener = std::thread([&gate]()
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            gate.Open();
+        });
+    }
+
+    opener.join();
+
+    EXPECT_TRUE(journal.Names().empty());
+}
@@ -0,0 +1,399 @@
+// MapRetryTest.cpp : Unit tests of MapRetrier against LocalHttpServers
+// that misbehave.
+//
+// Each attempt downloads a map with a LocalHttpClient, as MapLoadTest's
+// do, from a server chosen by the test: one that answers with a 503, one
+// that cuts its bodies off, one that stalls half way through them, or one
+// that behaves.  The attempts are counted, the read timeout is checked
+// against a stalled body, and a hedge is raced against a stalled attempt
+// once there are enough downloads to know what slow is.
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "LocalHttpClient.h"
+#include "LocalHttpServer.h"
+#include "MapRetry.h"
+#include "StreamingBuffer.h"
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    // a server with one map, misbehaving as faults says
+    class Origin
+    {
+    public:
+        explicit Origin(const LocalHttpFaults& faults = LocalHttpFaults())
+        {
+            m_server.AddFile("/map.jpeg", std::vector<uint8_t>(200 * 1000, 0x3c));
+            m_server.SetFaults(faults);
+            m_bStarted = m_server.Start();
+        }
+
+        ~Origin() { m_server.Stop(); }
+
+        bool Started() const { return m_bStarted; }
+        uint16_t Port() const { return m_server.Port(); }
+        LocalHttpServer::Stats GetStats() const { return m_server.GetStats(); }
+
+    private:
+        LocalHttpServer m_server;
+        bool            m_bStarted = false;
+    };
+
+    LocalHttpFaults Errors(int nStatus)
+    {
+        LocalHttpFaults faults;
+        faults.fErrorRate = 1;
+        faults.nErrorStatus = nStatus;
+        return faults;
+    }
+
+    LocalHttpFaults Resets()
+    {
+        LocalHttpFaults faults;
+        faults.fTruncateRate = 1;
+        return faults;
+    }
+
+    LocalHttpFaults Stalls(unsigned nStallMs)
+    {
+        LocalHttpFaults faults;
+        faults.fStallRate = 1;
+        faults.nStallMs = nStallMs;
+        return faults;
+    }
+
+    // one attempt at a download from nPort, as MapLoadTest makes it.  The
+    // client can be interrupted through the token, by a hedge that won.
+    MapAttemptResult Download(uint16_t nPort, const char* pszPath, const MapRetryPolicy& policy,
+        MapAttemptToken& token, LocalHttpTiming* pTiming = nullptr)
+    {
+        LocalHttpClient client;
+        StreamingBuffer body;
+        LocalHttpTiming timing;
+
+        client.SetTimeouts(policy.nConnectTimeoutMs, policy.nReadTimeoutMs, policy.nTotalTimeoutMs);
+        token.SetInterrupt([&client]() { client.Interrupt(); });
+
+        int nStatus = client.Get(nPort, pszPath, body, &timing);
+
+        token.ClearInterrupt();
+
+        if (pTiming)
+        {
+            *pTiming = timing;
+        }
+
+        if (token.IsCancelled())
+        {
+            return MapAttemptResult::RETRY;
+        }
+
+        return MapAttemptResultForHttpStatus(nStatus);
+    }
+
+    // short backoffs, so the tests that retry don't take long
+    MapRetryPolicy QuickPolicy()
+    {
+        MapRetryPolicy policy;
+
+        policy.nBackoffBaseMs = 5;
+        policy.nBackoffMaxMs = 20;
+
+        return policy;
+    }
+
+    long long MillisecondsSince(Clock::time_point start)
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start).count();
+    }
+}
+
+TEST(MapRetrier, RetriesA5xxUntilItSucceeds)
+{
+    Origin failing(Errors(503));
+    Origin healthy;
+
+    ASSERT_TRUE(failing.Started());
+    ASSERT_TRUE(healthy.Started());
+
+    MapRetryPolicy policy = QuickPolicy();
+    MapRetrier retrier(policy);
+    int nAttempts = 0;
+
+    // the first two attempts get a 503, the third a map
+    MapRetrier::Attempt<int> attempt = [&](MapAttemptToken& token, int& valueOut)
+    {
+        uint16_t nPort = (++nAttempts < 3) ? failing.Port() : healthy.Port();
+
+        valueOut = nAttempts;
+        return Download(nPort, "/map.jpeg", policy, token);
+    };
+
+    int value = 0;
+
+    EXPECT_EQ(MapRetryStatus::SUCCEEDED, retrier.Run<int>(nullptr, attempt, value));
+    EXPECT_EQ(3, value);
+    EXPECT_EQ(2u, failing.GetStats().nErrors);
+
+    MapRetrier::Stats stats = retrier.GetStats();
+
+    EXPECT_EQ(1u, stats.nDownloads);
+    EXPECT_EQ(3u, stats.nAttempts);
+    EXPECT_EQ(2u, stats.nRetries);
+    EXPECT_EQ(0u, stats.nGaveUp);
+}
+
+TEST(MapRetrier, GivesUpAfterMaxAttemptsOfResets)
+{
+    Origin resetting(Resets());
+
+    ASSERT_TRUE(resetting.Started());
+
+    MapRetryPolicy policy = QuickPolicy();
+    policy.nMaxAttempts = 4;
+
+    MapRetrier retrier(policy);
+    int nAttempts = 0;
+
+    // every body is cut off half way, which is no response at all
+    MapRetrier::Attempt<int> attempt = [&](MapAttemptToken& token, int&)
+    {
+        nAttempts++;
+        return Download(resetting.Port(), "/map.jpeg", policy, token);
+    };
+
+    int value = 0;
+
+    EXPECT_EQ(MapRetryStatus::GAVE_UP, retrier.Run<int>(nullptr, attempt, value));
+    EXPECT_EQ(4, nAttempts);
+    EXPECT_EQ(4u, resetting.GetStats().nTruncated);
+
+    MapRetrier::Stats stats = retrier.GetStats();
+
+    EXPECT_EQ(4u, stats.nAttempts);
+    EXPECT_EQ(3u, stats.nRetries);
+    EXPECT_EQ(1u, stats.nGaveUp);
+}
+
+TEST(MapRetrier, DoesNotRetryWhatWouldFailAgain)
+{
+    Origin healthy;
+    Origin forbidding(Errors(403));
+
+    ASSERT_TRUE(healthy.Started());
+    ASSERT_TRUE(forbidding.Started());
+
+    MapRetryPolicy policy = QuickPolicy();
+    MapRetrier retrier(policy);
+    int nAttempts = 0;
+    int value = 0;
+
+    MapRetrier::Attempt<int> notFound = [&](MapAttemptToken& token, int&)
+    {
+        nAttempts++;
+        return Download(healthy.Port(), "/nowhere.jpeg", policy, token);
+    };
+
+    MapRetrier::Attempt<int> forbidden = [&](MapAttemptToken& token, int&)
+    {
+        nAttempts++;
+        return Download(forbidding.Port(), "/map.jpeg", policy, token);
+    };
+
+    EXPECT_EQ(MapRetryStatus::FAILED, retrier.Run<int>(nullptr, notFound, value));
+    EXPECT_EQ(MapRetryStatus::FAILED, retrier.Run<int>(nullptr, forbidden, value));
+    EXPECT_EQ(2, nAttempts);
+    EXPECT_EQ(0u, retrier.GetStats().nRetries);
+}
+
+TEST(MapRetrier, BackoffIsJitteredUnderADoublingCap)
+{
+    MapRetryPolicy policy;
+    policy.nBackoffBaseMs = 100;
+    policy.nBackoffMaxMs = 1000;
+
+    MapRetrier retrier(policy);
+
+    // the cap starts at the base, doubles, and stops at the maximum, and
+    // each wait is anywhere under it
+    const uint64_t caps[] = { 100, 200, 400, 800, 1000, 1000 };
+
+    for (unsigned nRetry = 0; nRetry < sizeof(caps) / sizeof(caps[0]); nRetry++)
+    {
+        std::set<int64_t> waits;
+        int64_t nLongestUs = 0;
+
+        for (int i = 0; i < 200; i++)
+        {
+            int64_t nWaitUs = std::chrono::duration_cast<std::chrono::microseconds>(retrier.Backoff(nRetry)).count();
+
+            ASSERT_GE(nWaitUs, 0);
+            ASSERT_LE(nWaitUs, (int64_t)caps[nRetry] * 1000) << "retry " << nRetry;
+
+            waits.insert(nWaitUs);
+            nLongestUs = std::max(nLongestUs, nWaitUs);
+        }
+
+        // spread out, not all the same, and reaching most of the way up
+        EXPECT_GT(waits.size(), 100u);
+        EXPECT_GT(nLongestUs, (int64_t)caps[nRetry] * 1000 / 2);
+    }
+
+    // however many retries, never past the maximum
+    EXPECT_LE(retrier.Backoff(1000), std::chrono::milliseconds(1000));
+}
+
+TEST(MapRetrier, CancelEndsTheBackoff)
+{
+    Origin failing(Errors(503));
+
+    ASSERT_TRUE(failing.Started());
+
+    MapRetryPolicy policy;
+    policy.nBackoffBaseMs = 10000;
+    policy.nBackoffMaxMs = 10000;
+
+    MapRetrier retrier(policy);
+    std::atomic<bool> bCancel(false);
+
+    MapRetrier::Attempt<int> attempt = [&](MapAttemptToken& token, int&)
+    {
+        return Download(failing.Port(), "/map.jpeg", policy, token);
+    };
+
+    std::thread canceller([&bCancel]()
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        bCancel = true;
+    });
+
+    Clock::time_point start = Clock::now();
+    int value = 0;
+
+    EXPECT_EQ(MapRetryStatus::CANCELLED, retrier.Run<int>(&bCancel, attempt, value));
+    EXPECT_LT(MillisecondsSince(start), 2000);
+
+    canceller.join();
+}
+
+TEST(MapRetrier, ReadTimeoutEndsAStalledBody)
+{
+    Origin stalling(Stalls(5000));
+
+    ASSERT_TRUE(stalling.Started());
+
+    MapRetryPolicy policy = QuickPolicy();
+    policy.nReadTimeoutMs = 200;
+    policy.nMaxAttempts = 1;
+
+    MapRetrier retrier(policy);
+    LocalHttpTiming timing;
+
+    MapRetrier::Attempt<int> attempt = [&](MapAttemptToken& token, int&)
+    {
+        return Download(stalling.Port(), "/map.jpeg", policy, token, &timing);
+    };
+
+    Clock::time_point start = Clock::now();
+    int value = 0;
+
+    // half the body arrives, then nothing for five seconds
+    EXPECT_EQ(MapRetryStatus::GAVE_UP, retrier.Run<int>(nullptr, attempt, value));
+    EXPECT_TRUE(timing.timedOut);
+    EXPECT_GE(MillisecondsSince(start), 200);
+    EXPECT_LT(MillisecondsSince(start), 2000);
+    EXPECT_EQ(1u, stalling.GetStats().nStalled);
+}
+
+TEST(MapRetrier, HedgesPastThePercentileAndCancelsTheLoser)
+{
+    Origin stalling(Stalls(5000));
+    Origin healthy;
+
+    ASSERT_TRUE(stalling.Started());
+    ASSERT_TRUE(healthy.Started());
+
+    MapRetryPolicy policy = QuickPolicy();
+    policy.bHedge = true;
+    policy.nHedgeMinSamples = 20;
+    policy.nHedgeMinDelayMs = 10;
+    policy.nReadTimeoutMs = 0;
+    policy.nTotalTimeoutMs = 0;
+
+    MapRetrier retrier(policy);
+    int value = 0;
+
+    // nothing is hedged until there are enough downloads to go on
+    MapRetrier::Attempt<int> slowish = [](MapAttemptToken&, int&)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(40));
+        return MapAttemptResult::SUCCEEDED;
+    };
+
+    for (unsigned i = 0; i < policy.nHedgeMinSamples; i++)
+    {
+        EXPECT_EQ(Clock::duration::zero(), retrier.HedgeDelay());
+        ASSERT_EQ(MapRetryStatus::SUCCEEDED, retrier.Run<int>(nullptr, slowish, value));
+    }
+
+    // and then it is the 95th percentile of them, give or take its bucket
+    Clock::duration hedgeDelay = retrier.HedgeDelay();
+
+    EXPECT_GE(hedgeDelay, std::chrono::milliseconds(38));
+    EXPECT_LE(hedgeDelay, std::chrono::milliseconds(100));
+    EXPECT_EQ(0u, retrier.GetStats().nHedges);
+
+    // a download quicker than that isn't raced
+    MapRetrier::Attempt<int> quick = [&](MapAttemptToken& token, int& valueOut)
+    {
+        valueOut = token.Index();
+        return Download(healthy.Port(), "/map.jpeg", policy, token);
+    };
+
+    ASSERT_EQ(MapRetryStatus::SUCCEEDED, retrier.Run<int>(nullptr, quick, value));
+    EXPECT_EQ(0u, retrier.GetStats().nHedges);
+
+    // one that stalls is raced by a hedge to a healthy server, which wins
+    // and interrupts it
+    Clock::time_point start = Clock::now();
+    std::atomic<int64_t> nHedgeStartMs(-1);
+    std::atomic<bool> bLoserCancelled(false);
+
+    MapRetrier::Attempt<int> stalled = [&](MapAttemptToken& token, int& valueOut)
+    {
+        valueOut = token.Index();
+
+        if (0 == token.Index())
+        {
+            MapAttemptResult result = Download(stalling.Port(), "/map.jpeg", policy, token);
+
+            bLoserCancelled = token.IsCancelled();
+            return result;
+        }
+
+        nHedgeStartMs = MillisecondsSince(start);
+        return Download(healthy.Port(), "/map.jpeg", policy, token);
+    };
+
+    ASSERT_EQ(MapRetryStatus::SUCCEEDED, retrier.Run<int>(nullptr, stalled, value));
+
+    // the stalled attempt didn't wait out its five seconds
+    EXPECT_LT(MillisecondsSince(start), 2000);
+    EXPECT_EQ(1, value);
+    EXPECT_TRUE(bLoserCancelled);
+    EXPECT_GE(nHedgeStartMs.load(), std::chrono::duration_cast<std::chrono::milliseconds>(hedgeDelay).count());
+
+    MapRetrier::Stats stats = retrier.GetStats();
+
+    EXPECT_EQ(1u, stats.nHedges);
+    EXPECT_EQ(1u, stats.nHedgeWins);
+    EXPECT_EQ(0u, stats.nRetries);
+}
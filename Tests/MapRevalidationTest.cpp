@@ -0,0 +1,326 @@
+// MapRevalidationTest.cpp : Unit tests of MapValidators, ClassifyMap and
+// MapRevalidationTable.
+//
+// The validators are parsed from header blocks written out here, the
+// classification is checked on either side of each boundary, and the
+// conditional requests they make are sent to a LocalHttpServer on the
+// loopback interface, which answers a map that hasn't changed with a 304.
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "LocalHttpClient.h"
+#include "LocalHttpServer.h"
+#include "MapRevalidation.h"
+#include "StreamingBuffer.h"
+
+namespace
+{
+    // an arbitrary time the maps were fetched at
+    const int64_t kFetchedAt = 1700000000;
+
+    MapRequestKey MakeKey(const wchar_t* pszLocation)
+    {
+        return MapRequestKey(DEFAULT_IMAGERY_SET, pszLocation, 500, 400);
+    }
+
+    MapValidators Validators(const char* pszETag, uint32_t nMaxAgeSeconds, int64_t nFetchedAt = kFetchedAt)
+    {
+        MapValidators validators;
+
+        validators.strETag = pszETag;
+        validators.nFetchedAt = nFetchedAt;
+        validators.nMaxAgeSeconds = nMaxAgeSeconds;
+
+        return validators;
+    }
+
+    // a short policy, so the boundaries are easy to read
+    MapRevalidationPolicy ShortPolicy()
+    {
+        MapRevalidationPolicy policy;
+
+        policy.nDefaultMaxAgeSeconds = 100;
+        policy.nStaleWhileRevalidateSeconds = 50;
+        policy.nMinRedownloadSeconds = 300;
+
+        return policy;
+    }
+}
+
+TEST(MapValidators, ParsesQuotedAndWeakETags)
+{
+    MapValidators strong = ParseMapValidators(
+        "HTTP/1.1 200 OK\r\nETag: \"abc123\"\r\nContent-Length: 10\r\n\r\n", ShortPolicy(), kFetchedAt);
+
+    EXPECT_EQ("\"abc123\"", strong.strETag);
+    EXPECT_TRUE(strong.CanRevalidate());
+    EXPECT_EQ(kFetchedAt, strong.nFetchedAt);
+
+    // a weak ETag is sent back as it came, W/ and all, and the header
+    // name is matched without regard to case
+    MapValidators weak = ParseMapValidators("HTTP/1.1 200 OK\r\netag:   W/\"abc123\"  \r\n\r\n",
+        ShortPolicy(), kFetchedAt);
+
+    EXPECT_EQ("W/\"abc123\"", weak.strETag);
+    EXPECT_EQ("If-None-Match: W/\"abc123\"\r\n", ConditionalRequestHeaders(weak));
+}
+
+TEST(MapValidators, ParsesMaxAgeAndNoCache)
+{
+    MapRevalidationPolicy policy = ShortPolicy();
+
+    EXPECT_EQ(3600u, ParseMapValidators("Cache-Control: public, max-age=3600\r\n", policy, kFetchedAt).nMaxAgeSeconds);
+
+    // no max-age takes the policy's default
+    EXPECT_EQ(100u, ParseMapValidators("Cache-Control: public\r\n", policy, kFetchedAt).nMaxAgeSeconds);
+    EXPECT_EQ(100u, ParseMapValidators("ETag: \"x\"\r\n", policy, kFetchedAt).nMaxAgeSeconds);
+
+    // no-cache and no-store are stale at once, even with a max-age
+    EXPECT_EQ(0u, ParseMapValidators("Cache-Control: no-cache\r\n", policy, kFetchedAt).nMaxAgeSeconds);
+    EXPECT_EQ(0u, ParseMapValidators("Cache-Control: max-age=600, no-store\r\n", policy, kFetchedAt).nMaxAgeSeconds);
+    EXPECT_EQ(0u, ParseMapValidators("Cache-Control: No-Cache, max-age=600\r\n", policy, kFetchedAt).nMaxAgeSeconds);
+
+    // a max-age that isn't a number is none at all, and a huge one is capped
+    EXPECT_EQ(0u, ParseMapValidators("Cache-Control: max-age=soon\r\n", policy, kFetchedAt).nMaxAgeSeconds);
+    EXPECT_EQ(0u, ParseMapValidators("Cache-Control: max-age=-5\r\n", policy, kFetchedAt).nMaxAgeSeconds);
+    EXPECT_EQ(UINT32_MAX, ParseMapValidators("Cache-Control: max-age=99999999999999\r\n", policy,
+        kFetchedAt).nMaxAgeSeconds);
+}
+
+TEST(MapValidators, KeepsLastModifiedAsTheServerSentIt)
+{
+    // the server compares If-Modified-Since with its own date, so even
+    // one that doesn't parse goes back exactly as it came
+    MapValidators validators = ParseMapValidators(
+        "HTTP/1.1 200 OK\r\nLast-Modified: Sun, 06 Nov 1994 08:49:37 GMT\r\n\r\n", ShortPolicy(), kFetchedAt);
+
+    EXPECT_EQ("Sun, 06 Nov 1994 08:49:37 GMT", validators.strLastModified);
+    EXPECT_EQ("If-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n", ConditionalRequestHeaders(validators));
+
+    MapValidators bad = ParseMapValidators("Last-Modified: yesterday-ish\r\n", ShortPolicy(), kFetchedAt);
+
+    EXPECT_EQ("yesterday-ish", bad.strLastModified);
+    EXPECT_TRUE(bad.CanRevalidate());
+
+    // and an empty one is none at all
+    MapValidators none = ParseMapValidators("Last-Modified:\r\nContent-Type: image/jpeg\r\n", ShortPolicy(), kFetchedAt);
+
+    EXPECT_FALSE(none.CanRevalidate());
+    EXPECT_EQ("", ConditionalRequestHeaders(none));
+}
+
+TEST(MapValidators, NotModifiedRefreshesTheValidators)
+{
+    MapValidators cached = Validators("\"v1\"", 100);
+
+    // a 304 with nothing new only restarts the clock
+    UpdateMapValidators(cached, "HTTP/1.1 304 Not Modified\r\n\r\n", kFetchedAt + 500);
+
+    EXPECT_EQ("\"v1\"", cached.strETag);
+    EXPECT_EQ(100u, cached.nMaxAgeSeconds);
+    EXPECT_EQ(kFetchedAt + 500, cached.nFetchedAt);
+
+    UpdateMapValidators(cached, "HTTP/1.1 304 Not Modified\r\nETag: \"v2\"\r\nCache-Control: max-age=7\r\n\r\n",
+        kFetchedAt + 600);
+
+    EXPECT_EQ("\"v2\"", cached.strETag);
+    EXPECT_EQ(7u, cached.nMaxAgeSeconds);
+}
+
+TEST(ClassifyMap, Boundaries)
+{
+    MapRevalidationPolicy policy = ShortPolicy();
+    MapValidators validators = Validators("\"v1\"", 100);
+
+    EXPECT_EQ(MapFreshness::FRESH, ClassifyMap(validators, policy, kFetchedAt));
+    EXPECT_EQ(MapFreshness::FRESH, ClassifyMap(validators, policy, kFetchedAt + 99));
+    EXPECT_EQ(MapFreshness::STALE, ClassifyMap(validators, policy, kFetchedAt + 100));
+    EXPECT_EQ(MapFreshness::STALE, ClassifyMap(validators, policy, kFetchedAt + 149));
+    EXPECT_EQ(MapFreshness::EXPIRED, ClassifyMap(validators, policy, kFetchedAt + 150));
+
+    // a clock that went backwards
+    EXPECT_EQ(MapFreshness::FRESH, ClassifyMap(validators, policy, kFetchedAt - 1000));
+
+    // no-cache is stale straight away
+    EXPECT_EQ(MapFreshness::STALE, ClassifyMap(Validators("\"v1\"", 0), policy, kFetchedAt));
+}
+
+TEST(ClassifyMap, MapWithoutValidatorsIsNotDownloadedEachTimeItIsShown)
+{
+    MapRevalidationPolicy policy = ShortPolicy();
+
+    // no-cache, and nothing to revalidate it with
+    MapValidators validators = Validators("", 0);
+
+    ASSERT_FALSE(validators.CanRevalidate());
+
+    EXPECT_EQ(MapFreshness::FRESH, ClassifyMap(validators, policy, kFetchedAt + 299));
+    EXPECT_EQ(MapFreshness::STALE, ClassifyMap(validators, policy, kFetchedAt + 300));
+    EXPECT_EQ(MapFreshness::STALE, ClassifyMap(validators, policy, kFetchedAt + 349));
+
+    // and it doesn't stay stale forever
+    EXPECT_EQ(MapFreshness::EXPIRED, ClassifyMap(validators, policy, kFetchedAt + 350));
+
+    // a longer max-age than the minimum still counts
+    EXPECT_EQ(MapFreshness::FRESH, ClassifyMap(Validators("", 1000), policy, kFetchedAt + 999));
+    EXPECT_EQ(MapFreshness::STALE, ClassifyMap(Validators("", 1000), policy, kFetchedAt + 1000));
+}
+
+TEST(MapRevalidationTable, UnknownMapsAreFresh)
+{
+    MapRevalidationTable table;
+
+    EXPECT_EQ(MapFreshness::FRESH, table.Classify(MakeKey(L"Seattle"), kFetchedAt));
+    EXPECT_FALSE(table.BeginRevalidation(MakeKey(L"Seattle")));
+    EXPECT_EQ(1u, table.GetStats().nFresh);
+}
+
+TEST(MapRevalidationTable, RevalidatesAMapOnceAtATime)
+{
+    MapRevalidationTable table;
+    MapRequestKey key = MakeKey(L"Seattle");
+
+    table.SetPolicy(ShortPolicy());
+    table.Set(key, Validators("\"v1\"", 100));
+
+    EXPECT_EQ(MapFreshness::STALE, table.Classify(key, kFetchedAt + 120));
+
+    EXPECT_TRUE(table.BeginRevalidation(key));
+    EXPECT_FALSE(table.BeginRevalidation(key));
+
+    // nor does a sweep take it while it is being revalidated
+    EXPECT_TRUE(table.TakeDue(kFetchedAt + 120, 10).empty());
+
+    table.EndRevalidation(key);
+
+    EXPECT_TRUE(table.BeginRevalidation(key));
+    EXPECT_EQ(2u, table.GetStats().nBackground);
+}
+
+TEST(MapRevalidationTable, TakeDueTakesTheStalestFirst)
+{
+    MapRevalidationTable table;
+
+    table.SetPolicy(ShortPolicy());
+    table.Set(MakeKey(L"Seattle"), Validators("\"a\"", 100, kFetchedAt - 30));
+    table.Set(MakeKey(L"Portland"), Validators("\"b\"", 100, kFetchedAt - 60));
+    table.Set(MakeKey(L"Boise"), Validators("\"c\"", 100, kFetchedAt));
+    table.Set(MakeKey(L"Spokane"), Validators("\"d\"", 1000, kFetchedAt - 60));
+
+    std::vector<MapRequestKey> due = table.TakeDue(kFetchedAt + 100, 2);
+
+    ASSERT_EQ(2u, due.size());
+    EXPECT_EQ(L"Portland", due[0].location);
+    EXPECT_EQ(L"Seattle", due[1].location);
+
+    // they are claimed, so the next sweep gets the rest, and not the fresh one
+    due = table.TakeDue(kFetchedAt + 100, 10);
+
+    ASSERT_EQ(1u, due.size());
+    EXPECT_EQ(L"Boise", due[0].location);
+}
+
+TEST(MapRevalidationTable, ForgetsTheOldestWhenFull)
+{
+    MapRevalidationTable table(2);
+    MapValidators validators;
+
+    table.Set(MakeKey(L"Seattle"), Validators("\"a\"", 100, kFetchedAt));
+    table.Set(MakeKey(L"Portland"), Validators("\"b\"", 100, kFetchedAt - 10));
+    table.Set(MakeKey(L"Boise"), Validators("\"c\"", 100, kFetchedAt + 10));
+
+    EXPECT_EQ(2u, table.Count());
+    EXPECT_FALSE(table.Get(MakeKey(L"Portland"), validators));
+    EXPECT_TRUE(table.Get(MakeKey(L"Seattle"), validators));
+}
+
+TEST(MapRevalidationTable, ConditionalRequestsToALocalServer)
+{
+    LocalHttpFile file;
+    file.body.assign(5000, 0x5a);
+    file.strContentType = "image/jpeg";
+    file.strETag = "\"map-v1\"";
+    file.strLastModified = LocalHttpServer::HttpDate(1600000000);
+
+    LocalHttpServer server;
+
+    server.SetResolver([&file](const std::string& strPath, const std::string&) -> const LocalHttpFile*
+    {
+        return "/map.jpeg" == strPath ? &file : nullptr;
+    });
+    server.SetMaxAge(60);
+
+    ASSERT_TRUE(server.Start());
+
+    MapRevalidationTable table;
+    MapRequestKey key = MakeKey(L"Seattle");
+    LocalHttpClient client;
+
+    table.SetPolicy(ShortPolicy());
+
+    // the first download brings the validators
+    StreamingBuffer body;
+    std::pmr::string headers;
+
+    ASSERT_EQ(200, client.Get(server.Port(), "/map.jpeg", body, nullptr, nullptr, std::string_view(), &headers));
+
+    MapValidators validators = ParseMapValidators(headers, table.Policy(), kFetchedAt);
+
+    EXPECT_EQ("\"map-v1\"", validators.strETag);
+    EXPECT_EQ(file.strLastModified, validators.strLastModified);
+    EXPECT_EQ(60u, validators.nMaxAgeSeconds);
+
+    table.Set(key, validators);
+
+    // once it is stale, asking with them gets a 304 and no body
+    ASSERT_EQ(MapFreshness::STALE, table.Classify(key, kFetchedAt + 61));
+
+    StreamingBuffer notModified;
+    std::pmr::string notModifiedHeaders;
+
+    ASSERT_EQ(304, client.Get(server.Port(), "/map.jpeg", notModified, nullptr, nullptr,
+        ConditionalRequestHeaders(validators), &notModifiedHeaders));
+    EXPECT_EQ(0u, notModified.Size());
+
+    UpdateMapValidators(validators, notModifiedHeaders, kFetchedAt + 61);
+    table.Set(key, validators);
+    table.RecordNotModified(body.Size(), true);
+
+    EXPECT_EQ(MapFreshness::FRESH, table.Classify(key, kFetchedAt + 62));
+
+    // asking with If-Modified-Since alone gets a 304 too
+    MapValidators dateOnly = validators;
+    dateOnly.strETag.clear();
+
+    EXPECT_EQ(304, client.Get(server.Port(), "/map.jpeg", notModified, nullptr, nullptr,
+        ConditionalRequestHeaders(dateOnly)));
+
+    // and a map that has changed comes back whole
+    MapValidators old = validators;
+    old.strETag = "\"map-v0\"";
+    old.strLastModified.clear();
+
+    StreamingBuffer changed;
+
+    ASSERT_EQ(200, client.Get(server.Port(), "/map.jpeg", changed, nullptr, nullptr,
+        ConditionalRequestHeaders(old)));
+    EXPECT_EQ(file.body.size(), changed.Size());
+    table.RecordModified(changed.Size());
+
+    MapRevalidationTable::Stats stats = table.GetStats();
+
+    EXPECT_EQ(1u, stats.nNotModified);
+    EXPECT_EQ(1u, stats.nModified);
+    EXPECT_EQ(5000u, stats.nBytesSaved);
+    EXPECT_EQ(1u, stats.nDecodesSaved);
+    EXPECT_DOUBLE_EQ(0.5, stats.NotModifiedRate());
+
+    LocalHttpServer::Stats serverStats = server.GetStats();
+
+    EXPECT_EQ(3u, serverStats.nConditional);
+    EXPECT_EQ(2u, serverStats.nNotModified);
+
+    server.Stop();
+}
@@ -0,0 +1,439 @@
+// MapSchedulerTest.cpp : Unit tests of MapScheduler.
+//
+// The jobs here only record that they ran, and in what order.  A job
+// waiting at a gate holds a worker busy, so a test can queue jobs behind
+// it and move or cancel them before they start.  The per-priority limits
+// are the program's: four prefetches and one revalidation at a time.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "MapScheduler.h"
+
+namespace
+{
+    const unsigned int kPrefetchLimit = 4;
+    const unsigned int kRevalidateLimit = 1;
+
+    // a door a job waits at until the test opens it
+    class Gate
+    {
+    public:
+        void Open()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_bOpen = true;
+            m_cv.notify_all();
+        }
+
+        // wait until opened, or the token is cancelled.  Returns false if
+        // it was cancelled.
+        bool Wait(const MapFetchCancelToken& token)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+
+            m_nWaiting++;
+            m_cv.notify_all();
+
+            while (!m_bOpen)
+            {
+                if (token.IsCancelled())
+                {
+                    return false;
+                }
+
+                m_cv.wait_for(lock, std::chrono::milliseconds(1));
+            }
+
+            return true;
+        }
+
+        // until nCount jobs are at the gate.  Returns false after five seconds.
+        bool WaitForWaiters(int nCount = 1)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+
+            return m_cv.wait_for(lock, std::chrono::seconds(5), [&] { return m_nWaiting >= nCount; });
+        }
+
+    private:
+        std::mutex              m_mutex;
+        std::condition_variable m_cv;
+        bool                    m_bOpen = false;
+        int                     m_nWaiting = 0;
+    };
+
+    // the jobs that ran, in order, and a way to wait for them
+    class Journal
+    {
+    public:
+        MapScheduler::Job Record(const std::string& strName)
+        {
+            return [this, strName](uint64_t, const MapFetchCancelToken&)
+            {
+                Add(strName);
+            };
+        }
+
+        void Add(const std::string& strName)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_names.push_back(strName);
+            m_cv.notify_all();
+        }
+
+        // wait for nCount jobs.  Returns false after five seconds.
+        bool WaitFor(size_t nCount)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+
+            return m_cv.wait_for(lock, std::chrono::seconds(5), [&] { return m_names.size() >= nCount; });
+        }
+
+        std::vector<std::string> Names() const
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_names;
+        }
+
+    private:
+        mutable std::mutex          m_mutex;
+        std::condition_variable     m_cv;
+        std::vector<std::string>    m_names;
+    };
+
+    // how many jobs of one kind run at once, and the most there have been
+    class Concurrency
+    {
+    public:
+        void Enter()
+        {
+            int nNow = ++m_nRunning;
+            int nMost = m_nMost.load();
+
+            while (nNow > nMost && !m_nMost.compare_exchange_weak(nMost, nNow))
+            {
+            }
+        }
+
+        void Leave() { --m_nRunning; }
+
+        int Most() const { return m_nMost.load(); }
+
+    private:
+        std::atomic<int>    m_nRunning{ 0 };
+        std::atomic<int>    m_nMost{ 0 };
+    };
+
+    // hold the scheduler's only worker at gate, on a job of its own
+    uint64_t BlockWorker(MapScheduler& scheduler, Gate& gate)
+    {
+        uint64_t jobId = scheduler.Submit(MapPriority::VISIBLE,
+            [&gate](uint64_t, const MapFetchCancelToken& token) { gate.Wait(token); });
+
+        EXPECT_NE(0u, jobId);
+        EXPECT_TRUE(gate.WaitForWaiters());
+
+        return jobId;
+    }
+}
+
+TEST(MapScheduler, RunsJobsInStrictPriorityOrder)
+{
+    MapScheduler scheduler(1);
+    Journal journal;
+    Gate gate;
+
+    BlockWorker(scheduler, gate);
+
+    scheduler.Submit(MapPriority::REVALIDATE, journal.Record("revalidate 1"));
+    scheduler.Submit(MapPriority::PREFETCH, journal.Record("prefetch 1"));
+    scheduler.Submit(MapPriority::NEAR_VISIBLE, journal.Record("near 1"));
+    scheduler.Submit(MapPriority::VISIBLE, journal.Record("visible 1"));
+    scheduler.Submit(MapPriority::PREFETCH, journal.Record("prefetch 2"));
+    scheduler.Submit(MapPriority::VISIBLE, journal.Record("visible 2"));
+    scheduler.Submit(MapPriority::REVALIDATE, journal.Record("revalidate 2"));
+    scheduler.Submit(MapPriority::NEAR_VISIBLE, journal.Record("near 2"));
+
+    EXPECT_EQ(8u, scheduler.QueuedCount());
+
+    gate.Open();
+
+    ASSERT_TRUE(journal.WaitFor(8));
+
+    // highest priority first, and oldest first within one
+    EXPECT_EQ(std::vector<std::string>({ "visible 1", "visible 2", "near 1", "near 2",
+        "prefetch 1", "prefetch 2", "revalidate 1", "revalidate 2" }), journal.Names());
+
+    MapScheduler::Stats stats = scheduler.GetStats();
+
+    EXPECT_EQ(3u, stats.classes[(size_t)MapPriority::VISIBLE].nStarted);
+    EXPECT_EQ(2u, stats.classes[(size_t)MapPriority::REVALIDATE].nStarted);
+}
+
+TEST(MapScheduler, ReprioritizeMovesAQueuedJob)
+{
+    MapScheduler scheduler(1);
+    Journal journal;
+    Gate gate;
+
+    uint64_t blockerId = BlockWorker(scheduler, gate);
+
+    uint64_t firstId = scheduler.Submit(MapPriority::PREFETCH, journal.Record("first"));
+    scheduler.Submit(MapPriority::PREFETCH, journal.Record("second"));
+    uint64_t thirdId = scheduler.Submit(MapPriority::REVALIDATE, journal.Record("third"));
+
+    // the tile scrolled into view, and another out of it
+    EXPECT_TRUE(scheduler.Reprioritize(thirdId, MapPriority::VISIBLE));
+    EXPECT_TRUE(scheduler.Reprioritize(firstId, MapPriority::REVALIDATE));
+
+    // moving a job to where it already is does nothing
+    EXPECT_TRUE(scheduler.Reprioritize(thirdId, MapPriority::VISIBLE));
+
+    // the job at the gate has started, so it stays where it is
+    EXPECT_FALSE(scheduler.Reprioritize(blockerId, MapPriority::REVALIDATE));
+
+    // and the entries left behind don't count as queued jobs
+    EXPECT_EQ(3u, scheduler.QueuedCount());
+
+    gate.Open();
+
+    ASSERT_TRUE(journal.WaitFor(3));
+
+    // each job ran once, at its new priority
+    EXPECT_EQ(std::vector<std::string>({ "third", "second", "first" }), journal.Names());
+
+    // and once finished, there is nothing left to move
+    EXPECT_FALSE(scheduler.Reprioritize(thirdId, MapPriority::PREFETCH));
+
+    MapScheduler::Stats stats = scheduler.GetStats();
+
+    EXPECT_EQ(1u, stats.classes[(size_t)MapPriority::VISIBLE].nMovedIn);
+    EXPECT_EQ(1u, stats.classes[(size_t)MapPriority::REVALIDATE].nMovedIn);
+    EXPECT_EQ(1u, stats.classes[(size_t)MapPriority::REVALIDATE].nStarted);
+}
+
+TEST(MapScheduler, CancelledJobsNeverRun)
+{
+    MapScheduler scheduler(1);
+    Journal journal;
+    Gate gate;
+    std::atomic<int> nCancelled(0);
+    std::atomic<uint64_t> cancelledId(0);
+
+    uint64_t blockerId = BlockWorker(scheduler, gate);
+
+    uint64_t doomedId = scheduler.Submit(MapPriority::VISIBLE, journal.Record("doomed"),
+        [&](uint64_t jobId)
+        {
+            cancelledId = jobId;
+            nCancelled++;
+        });
+
+    scheduler.Submit(MapPriority::VISIBLE, journal.Record("kept"));
+
+    // moved, and then cancelled, so it has two entries and neither runs
+    EXPECT_TRUE(scheduler.Reprioritize(doomedId, MapPriority::NEAR_VISIBLE));
+
+    // the handler has run by the time Cancel returns, on this thread
+    EXPECT_TRUE(scheduler.Cancel(doomedId));
+    EXPECT_EQ(1, nCancelled.load());
+    EXPECT_EQ(doomedId, cancelledId.load());
+    EXPECT_EQ(1u, scheduler.QueuedCount());
+
+    // and only once
+    EXPECT_FALSE(scheduler.Cancel(doomedId));
+    EXPECT_FALSE(scheduler.Reprioritize(doomedId, MapPriority::VISIBLE));
+
+    gate.Open();
+
+    ASSERT_TRUE(journal.WaitFor(1));
+
+    // give a stray entry time to run, if there were one
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    EXPECT_EQ(std::vector<std::string>({ "kept" }), journal.Names());
+    EXPECT_EQ(1, nCancelled.load());
+    EXPECT_EQ(1u, scheduler.GetStats().classes[(size_t)MapPriority::NEAR_VISIBLE].nCancelled);
+
+    // the blocker has finished too, so there is nothing to cancel
+    EXPECT_FALSE(scheduler.Cancel(blockerId));
+}
+
+TEST(MapScheduler, CancelSetsARunningJobsToken)
+{
+    MapScheduler scheduler(1);
+    Gate gate;
+    std::atomic<bool> bGaveUp(false);
+    std::atomic<int> nCancelled(0);
+
+    uint64_t jobId = scheduler.Submit(MapPriority::VISIBLE,
+        [&](uint64_t, const MapFetchCancelToken& token) { bGaveUp = !gate.Wait(token); },
+        [&](uint64_t) { nCancelled++; });
+
+    ASSERT_TRUE(gate.WaitForWaiters());
+
+    EXPECT_TRUE(scheduler.Cancel(jobId));
+
+    scheduler.Shutdown();
+
+    // it had started, so its handler isn't called
+    EXPECT_TRUE(bGaveUp.load());
+    EXPECT_EQ(0, nCancelled.load());
+}
+
+TEST(MapScheduler, LimitsRunningJobsPerPriority)
+{
+    MapScheduler scheduler(8);
+
+    scheduler.SetMaxRunning(MapPriority::PREFETCH, kPrefetchLimit);
+    scheduler.SetMaxRunning(MapPriority::REVALIDATE, kRevalidateLimit);
+
+    Concurrency prefetches;
+    Concurrency revalidations;
+    Concurrency visibles;
+    Journal journal;
+
+    auto Hold = [&journal](Concurrency& concurrency)
+    {
+        return [&journal, &concurrency](uint64_t, const MapFetchCancelToken&)
+        {
+            concurrency.Enter();
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            concurrency.Leave();
+            journal.Add("done");
+        };
+    };
+
+    for (int i = 0; i < 12; i++)
+    {
+        scheduler.Submit(MapPriority::PREFETCH, Hold(prefetches));
+    }
+
+    for (int i = 0; i < 4; i++)
+    {
+        scheduler.Submit(MapPriority::REVALIDATE, Hold(revalidations));
+    }
+
+    // the limited priorities leave workers free for these
+    for (int i = 0; i < 6; i++)
+    {
+        scheduler.Submit(MapPriority::VISIBLE, Hold(visibles));
+    }
+
+    ASSERT_TRUE(journal.WaitFor(22));
+
+    EXPECT_EQ((int)kPrefetchLimit, prefetches.Most());
+    EXPECT_EQ((int)kRevalidateLimit, revalidations.Most());
+    EXPECT_GT(visibles.Most(), 1);
+
+    MapScheduler::Stats stats = scheduler.GetStats();
+
+    EXPECT_EQ(12u, stats.classes[(size_t)MapPriority::PREFETCH].nStarted);
+    EXPECT_EQ(4u, stats.classes[(size_t)MapPriority::REVALIDATE].nStarted);
+}
+
+TEST(MapScheduler, StolenJobsRunExactlyOnce)
+{
+    const int kChildren = 400;
+
+    MapScheduler scheduler(4);
+    std::vector<std::atomic<int>> runs(kChildren);
+    Journal journal;
+
+    for (std::atomic<int>& nRuns : runs)
+    {
+        nRuns = 0;
+    }
+
+    // jobs submitted from a job go on its own worker's queue, so the
+    // other workers only get them by stealing
+    scheduler.Submit(MapPriority::PREFETCH, [&](uint64_t, const MapFetchCancelToken&)
+    {
+        for (int i = 0; i < kChildren; i++)
+        {
+            scheduler.Submit(MapPriority::PREFETCH, [&runs, &journal, i](uint64_t, const MapFetchCancelToken&)
+            {
+                runs[i]++;
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+                journal.Add("child");
+            });
+        }
+    });
+
+    ASSERT_TRUE(journal.WaitFor(kChildren));
+
+    scheduler.Shutdown();
+
+    for (int i = 0; i < kChildren; i++)
+    {
+        EXPECT_EQ(1, runs[i].load()) << "child " << i;
+    }
+
+    MapScheduler::ClassStats stats = scheduler.GetStats().classes[(size_t)MapPriority::PREFETCH];
+
+    EXPECT_EQ((uint64_t)kChildren + 1, stats.nStarted);
+    EXPECT_GT(stats.nStolen, 0u);
+    EXPECT_LT(stats.nStolen, (uint64_t)kChildren);
+}
+
+TEST(MapScheduler, ShutdownCancelsTheQueueAndJoins)
+{
+    std::atomic<int> nThreadsStarted(0);
+    std::atomic<int> nThreadsStopped(0);
+
+    MapScheduler scheduler(2,
+        [&]() { nThreadsStarted++; },
+        [&]() { nThreadsStopped++; });
+
+    Journal journal;
+    Gate gate;
+    std::atomic<int> nGaveUp(0);
+    std::atomic<int> nCancelled(0);
+
+    // both workers busy until their tokens are cancelled
+    for (int i = 0; i < 2; i++)
+    {
+        scheduler.Submit(MapPriority::VISIBLE, [&](uint64_t, const MapFetchCancelToken& token)
+        {
+            if (!gate.Wait(token))
+            {
+                nGaveUp++;
+            }
+        });
+    }
+
+    ASSERT_TRUE(gate.WaitForWaiters(2));
+
+    for (int i = 0; i < 10; i++)
+    {
+        scheduler.Submit((MapPriority)(i % kMapPriorityCount), journal.Record("queued"),
+            [&](uint64_t) { nCancelled++; });
+    }
+
+    EXPECT_EQ(10u, scheduler.QueuedCount());
+
+    scheduler.Shutdown();
+
+    // the workers have exited, having given up on what they were doing,
+    // and nothing queued ran
+    EXPECT_EQ(2, nThreadsStarted.load());
+    EXPECT_EQ(2, nThreadsStopped.load());
+    EXPECT_EQ(2, nGaveUp.load());
+    EXPECT_EQ(10, nCancelled.load());
+    EXPECT_TRUE(journal.Names().empty());
+    EXPECT_EQ(0u, scheduler.QueuedCount());
+
+    // nothing more is taken, and a second Shutdown does nothing
+    EXPECT_EQ(0u, scheduler.Submit(MapPriority::VISIBLE, journal.Record("late")));
+
+    scheduler.Shutdown();
+}
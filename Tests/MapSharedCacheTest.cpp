@@ -0,0 +1,468 @@
+// MapSharedCacheTest.cpp : Unit tests of MapSharedCache across processes.
+//
+// Each test has a segment of its own, named after the test and this
+// process, which is removed when the test ends.  The other processes are
+// forked, open the segment by name as another instance of the program
+// would, and report back with their exit status, so nothing but
+// MapSharedCache is used in them.
+//
+// The maps are made up.  Every pixel of one is worked out from its key
+// and a generation number kept in its first pixel, so a reader can check
+// every byte of a map it finds, and a read torn by a writer shows.
+//
+// POSIX only, for fork and shm_open.
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include "MapSharedCache.h"
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    MapRequestKey KeyOf(uint32_t nKey)
+    {
+        return MapRequestKey(DEFAULT_IMAGERY_SET, L"Place " + std::to_wstring(nKey), 500, 400);
+    }
+
+    uint8_t PixelByte(uint32_t nKey, uint32_t nGeneration, int x, int y, int nChannel)
+    {
+        return (uint8_t)(x * 7 + y * 13 + nKey * 31 + nGeneration * 17 + nChannel * 59);
+    }
+
+    // map nKey as it was at nGeneration
+    std::shared_ptr<MapImage> MakeMap(uint32_t nKey, uint32_t nGeneration, int nSize)
+    {
+        std::shared_ptr<MapImage> pImage = MapImage::Create(nSize, nSize);
+
+        for (int y = 0; y < nSize; y++)
+        {
+            uint8_t* pRow = pImage->Row(y);
+
+            for (int x = 0; x < nSize; x++)
+            {
+                for (int c = 0; c < 4; c++)
+                {
+                    pRow[x * 4 + c] = PixelByte(nKey, nGeneration, x, y, c);
+                }
+            }
+        }
+
+        memcpy(pImage->Row(0), &nGeneration, sizeof(nGeneration));
+
+        return pImage;
+    }
+
+    // true if every pixel of image is what MakeMap made for nKey, at the
+    // generation in its first pixel
+    bool IsIntact(const MapImage& image, uint32_t nKey, int nSize)
+    {
+        if (image.Width() != nSize || image.Height() != nSize)
+        {
+            return false;
+        }
+
+        uint32_t nGeneration = 0;
+        memcpy(&nGeneration, image.Row(0), sizeof(nGeneration));
+
+        for (int y = 0; y < nSize; y++)
+        {
+            const uint8_t* pRow = image.Row(y);
+
+            for (int x = (0 == y) ? 1 : 0; x < nSize; x++)
+            {
+                for (int c = 0; c < 4; c++)
+                {
+                    if (pRow[x * 4 + c] != PixelByte(nKey, nGeneration, x, y, c))
+                    {
+                        return false;
+                    }
+                }
+            }
+        }
+
+        return true;
+    }
+
+    MapValidators ValidatorsOf(uint32_t nKey)
+    {
+        MapValidators validators;
+
+        validators.strETag = "\"" + std::to_string(nKey) + "\"";
+        validators.strLastModified = "Sun, 06 Nov 1994 08:49:37 GMT";
+        validators.nFetchedAt = 1700000000 + nKey;
+        validators.nMaxAgeSeconds = 3600;
+
+        return validators;
+    }
+
+    // run body in a child process, whose exit status is what it returns
+    pid_t Fork(const std::function<int()>& body)
+    {
+        fflush(stdout);
+
+        pid_t pid = fork();
+
+        if (0 == pid)
+        {
+            _exit(body());
+        }
+
+        return pid;
+    }
+
+    // the child's exit status, or -1 if it didn't exit
+    int Wait(pid_t pid)
+    {
+        int nStatus = 0;
+
+        if (pid <= 0 || waitpid(pid, &nStatus, 0) != pid || !WIFEXITED(nStatus))
+        {
+            return -1;
+        }
+
+        return WEXITSTATUS(nStatus);
+    }
+
+    class MapSharedCacheTest : public ::testing::Test
+    {
+    protected:
+        void SetUp() override
+        {
+            m_strName = std::string("MapSharedCacheTest.") +
+                ::testing::UnitTest::GetInstance()->current_test_info()->name() + "." + std::to_string(getpid());
+
+            MapSharedCache::Remove(m_strName);
+        }
+
+        void TearDown() override
+        {
+            EXPECT_TRUE(MapSharedCache::Remove(m_strName));
+
+            // and it is gone
+            int fd = shm_open(("/" + m_strName).c_str(), O_RDONLY, 0);
+
+            EXPECT_LT(fd, 0);
+
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+        }
+
+        // a shared memory object called m_strName, nBytes long, starting with header
+        void MakeObject(size_t nBytes, const std::vector<uint32_t>& header)
+        {
+            int fd = shm_open(("/" + m_strName).c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+
+            ASSERT_GE(fd, 0);
+            ASSERT_EQ(0, ftruncate(fd, (off_t)nBytes));
+
+            if (!header.empty())
+            {
+                ASSERT_EQ((ssize_t)(header.size() * sizeof(uint32_t)),
+                    pwrite(fd, header.data(), header.size() * sizeof(uint32_t), 0));
+            }
+
+            close(fd);
+        }
+
+        std::string m_strName;
+    };
+}
+
+TEST_F(MapSharedCacheTest, AnotherProcessFindsWhatOneInserted)
+{
+    MapSharedCache cache;
+
+    MapValidators validators = ValidatorsOf(1);
+
+    ASSERT_TRUE(cache.Open(m_strName, 4 * 1024 * 1024));
+    EXPECT_TRUE(cache.Created());
+    ASSERT_TRUE(cache.Insert(KeyOf(1), *MakeMap(1, 5, 200), &validators));
+
+    // the child finds the parent's map, and inserts one of its own
+    pid_t pid = Fork([this]()
+    {
+        MapSharedCache child;
+        MapValidators validators;
+
+        if (!child.Open(m_strName) || child.Created())
+        {
+            return 1;
+        }
+
+        MapImageHandle hMap = child.Find(KeyOf(1), &validators);
+
+        if (!hMap || !IsIntact(*hMap, 1, 200))
+        {
+            return 2;
+        }
+
+        uint32_t nGeneration = 0;
+        memcpy(&nGeneration, hMap->Row(0), sizeof(nGeneration));
+
+        MapValidators expected = ValidatorsOf(1);
+
+        if (5 != nGeneration || validators.strETag != expected.strETag ||
+            validators.strLastModified != expected.strLastModified ||
+            validators.nFetchedAt != expected.nFetchedAt || validators.nMaxAgeSeconds != expected.nMaxAgeSeconds)
+        {
+            return 3;
+        }
+
+        validators = ValidatorsOf(2);
+
+        return child.Insert(KeyOf(2), *MakeMap(2, 9, 120), &validators) ? 0 : 4;
+    });
+
+    ASSERT_EQ(0, Wait(pid));
+
+    MapImageHandle hMap = cache.Find(KeyOf(2), &validators);
+
+    ASSERT_TRUE(hMap);
+    EXPECT_TRUE(IsIntact(*hMap, 2, 120));
+    EXPECT_EQ("\"2\"", validators.strETag);
+
+    // and what nobody inserted isn't there
+    EXPECT_FALSE(cache.Find(KeyOf(3)));
+
+    MapSharedCache::Stats stats = cache.GetStats();
+
+    EXPECT_EQ(2u, stats.nEntries);
+    EXPECT_EQ(1u, stats.nHits);
+    EXPECT_EQ(1u, stats.nMisses);
+}
+
+TEST_F(MapSharedCacheTest, ReadersNeverSeeATornMap)
+{
+    // a small segment, so the writer's inserts keep running over the
+    // entries the readers are copying
+    const int kSize = 256;
+    const uint32_t kKeys = 12;
+    const auto kRun = std::chrono::milliseconds(1500);
+
+    MapSharedCache cache;
+
+    ASSERT_TRUE(cache.Open(m_strName, 2 * 1024 * 1024));
+
+    pid_t writer = Fork([&]()
+    {
+        MapSharedCache child;
+
+        if (!child.Open(m_strName))
+        {
+            return 1;
+        }
+
+        // every map, at every generation, made once up front, so the
+        // writer spends its time inserting
+        std::vector<std::shared_ptr<MapImage>> maps;
+
+        for (uint32_t nGeneration = 0; nGeneration < 4; nGeneration++)
+        {
+            for (uint32_t nKey = 0; nKey < kKeys; nKey++)
+            {
+                maps.push_back(MakeMap(nKey, nGeneration, kSize));
+            }
+        }
+
+        Clock::time_point end = Clock::now() + kRun;
+        uint64_t nInserts = 0;
+
+        for (size_t i = 0; Clock::now() < end; i++)
+        {
+            uint32_t nKey = (uint32_t)(i % kKeys);
+
+            nInserts += child.Insert(KeyOf(nKey), *maps[i % maps.size()], nullptr) ? 1 : 0;
+        }
+
+        return (nInserts > 0) ? 0 : 2;
+    });
+
+    std::vector<pid_t> readers;
+
+    for (int nReader = 0; nReader < 3; nReader++)
+    {
+        readers.push_back(Fork([&, nReader]()
+        {
+            MapSharedCache child;
+
+            if (!child.Open(m_strName))
+            {
+                return 1;
+            }
+
+            Clock::time_point end = Clock::now() + kRun;
+            uint64_t nHits = 0;
+
+            for (uint32_t i = (uint32_t)nReader; Clock::now() < end; i++)
+            {
+                MapImageHandle hMap = child.Find(KeyOf(i % kKeys));
+
+                if (hMap)
+                {
+                    if (!IsIntact(*hMap, i % kKeys, kSize))
+                    {
+                        return 3;
+                    }
+
+                    nHits++;
+                }
+            }
+
+            return (nHits > 0) ? 0 : 2;
+        }));
+    }
+
+    EXPECT_EQ(0, Wait(writer));
+
+    for (pid_t reader : readers)
+    {
+        EXPECT_EQ(0, Wait(reader)) << "3 is a torn map, 2 no maps found";
+    }
+}
+
+TEST_F(MapSharedCacheTest, TakesTheLockFromAWriterThatWasKilled)
+{
+    // big maps, so the writer holds the lock most of the time it runs
+    const int kSize = 1024;
+    const uint32_t kKeys = 4;
+
+    MapSharedCache cache;
+
+    ASSERT_TRUE(cache.Open(m_strName, 32 * 1024 * 1024));
+
+    // a kill may land between inserts, so a few are tried
+    for (int nTry = 0; nTry < 20 && 0 == cache.GetStats().nLocksTaken; nTry++)
+    {
+        int fds[2];
+
+        ASSERT_EQ(0, pipe(fds));
+
+        pid_t writer = Fork([&]()
+        {
+            MapSharedCache child;
+            std::vector<std::shared_ptr<MapImage>> maps;
+
+            for (uint32_t nKey = 0; nKey < kKeys; nKey++)
+            {
+                maps.push_back(MakeMap(nKey, (uint32_t)nTry, kSize));
+            }
+
+            if (!child.Open(m_strName) || 1 != write(fds[1], "x", 1))
+            {
+                return 1;
+            }
+
+            for (uint32_t i = 0; ; i++)
+            {
+                child.Insert(KeyOf(i % kKeys), *maps[i % kKeys], nullptr);
+            }
+        });
+
+        ASSERT_GT(writer, 0);
+        close(fds[1]);
+
+        char c = 0;
+
+        ASSERT_EQ(1, read(fds[0], &c, 1));
+        close(fds[0]);
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(20 + nTry));
+
+        kill(writer, SIGKILL);
+        ASSERT_EQ(-1, Wait(writer));
+
+        // a dead writer's lock is taken at once, not after a wait
+        EXPECT_TRUE(cache.Insert(KeyOf(100), *MakeMap(100, 0, 64), nullptr));
+    }
+
+    ASSERT_EQ(1u, cache.GetStats().nLocksTaken);
+
+    // the slot the writer was half way through was emptied, so nothing is
+    // left looking busy to readers, and every map that is there is whole
+    uint64_t nRetries = cache.GetStats().nRetries;
+
+    for (uint32_t nKey = 0; nKey < kKeys; nKey++)
+    {
+        MapImageHandle hMap = cache.Find(KeyOf(nKey));
+
+        if (hMap)
+        {
+            EXPECT_TRUE(IsIntact(*hMap, nKey, kSize)) << "key " << nKey;
+        }
+    }
+
+    EXPECT_EQ(nRetries, cache.GetStats().nRetries);
+
+    // and inserts carry on
+    EXPECT_TRUE(cache.Insert(KeyOf(0), *MakeMap(0, 99, kSize), nullptr));
+
+    MapImageHandle hMap = cache.Find(KeyOf(0));
+
+    ASSERT_TRUE(hMap);
+    EXPECT_TRUE(IsIntact(*hMap, 0, kSize));
+}
+
+TEST_F(MapSharedCacheTest, ReplacesASegmentFromAnotherBuild)
+{
+    // ready, but not our magic number
+    MakeObject(4 * 1024 * 1024, { 1, 0xdeadbeef, 1 });
+
+    MapSharedCache cache;
+
+    ASSERT_TRUE(cache.Open(m_strName, 4 * 1024 * 1024));
+    EXPECT_TRUE(cache.Created());
+    EXPECT_TRUE(cache.Insert(KeyOf(1), *MakeMap(1, 0, 64), nullptr));
+
+    // and another process uses the new one
+    pid_t pid = Fork([this]()
+    {
+        MapSharedCache child;
+
+        return (child.Open(m_strName) && !child.Created() && child.Find(KeyOf(1))) ? 0 : 1;
+    });
+
+    EXPECT_EQ(0, Wait(pid));
+}
+
+TEST_F(MapSharedCacheTest, ReplacesAnUndersizedSegment)
+{
+    // too small to hold a header and a ring
+    MakeObject(4096, {});
+
+    MapSharedCache cache;
+
+    ASSERT_TRUE(cache.Open(m_strName, 4 * 1024 * 1024));
+    EXPECT_TRUE(cache.Created());
+    EXPECT_EQ(4u * 1024 * 1024, cache.GetStats().nSizeBytes);
+}
+
+TEST_F(MapSharedCacheTest, ReplacesASegmentNeverMadeReady)
+{
+    // the size of one, but its maker died before filling in the header
+    MakeObject(4 * 1024 * 1024, {});
+
+    MapSharedCache cache;
+    Clock::time_point start = Clock::now();
+
+    ASSERT_TRUE(cache.Open(m_strName, 4 * 1024 * 1024));
+    EXPECT_TRUE(cache.Created());
+
+    // after waiting a moment for it to be made ready
+    EXPECT_LT(Clock::now() - start, std::chrono::seconds(5));
+}
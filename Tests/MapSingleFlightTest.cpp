@@ -0,0 +1,375 @@
+// MapSingleFlightTest.cpp : Unit tests of MapSingleFlight.
+//
+// Threads asking for a key that is already being fetched share the one
+// fetch, a failure is remembered for the failure TTL and no longer, and a
+// fetch that is cancelled or throws is neither remembered nor leaves the
+// threads waiting on it stuck.
+//
+// The waiting threads are given a moment to reach Run before the fetch
+// they wait on is let go; there is no way to see them waiting from here.
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "MapSingleFlight.h"
+
+namespace
+{
+    typedef MapSingleFlight<int> Flights;
+
+    // long enough for a thread that has been started to be waiting in Run
+    const std::chrono::milliseconds kSettle(200);
+
+    // a door the fetch waits at until the test opens it
+    class Gate
+    {
+    public:
+        void Open()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_bOpen = true;
+            m_cv.notify_all();
+        }
+
+        void Wait()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this] { return m_bOpen; });
+        }
+
+    private:
+        std::mutex              m_mutex;
+        std::condition_variable m_cv;
+        bool                    m_bOpen = false;
+    };
+
+    MapRequestKey MakeKey(const wchar_t* pszLocation)
+    {
+        return MapRequestKey(DEFAULT_IMAGERY_SET, pszLocation, 500, 400);
+    }
+
+    // the outcome of one Run on a thread of its own
+    struct Waiter
+    {
+        MapSingleFlightStatus   status = MapSingleFlightStatus::CANCELLED;
+        int                     value = 0;
+        std::thread             thread;
+    };
+
+    void StartWaiter(Flights& flights, const MapRequestKey& key, const Flights::Fetch& fetch,
+        const std::atomic<bool>* pbCancel, Waiter& waiter)
+    {
+        waiter.thread = std::thread([&flights, key, fetch, pbCancel, &waiter]()
+        {
+            waiter.status = flights.Run(key, pbCancel, fetch, waiter.value);
+        });
+    }
+}
+
+TEST(MapSingleFlight, CoalescesFetchesOfOneKey)
+{
+    Flights flights;
+    Gate gate;
+    std::atomic<int> nFetches(0);
+
+    Flights::Fetch fetch = [&](int& valueOut)
+    {
+        nFetches++;
+        gate.Wait();
+        valueOut = 42;
+        return true;
+    };
+
+    Waiter first;
+    StartWaiter(flights, MakeKey(L"Seattle"), fetch, nullptr, first);
+    std::this_thread::sleep_for(kSettle);
+
+    std::vector<Waiter> waiters(4);
+
+    for (Waiter& waiter : waiters)
+    {
+        StartWaiter(flights, MakeKey(L"Seattle"), fetch, nullptr, waiter);
+    }
+
+    std::this_thread::sleep_for(kSettle);
+    gate.Open();
+
+    first.thread.join();
+
+    for (Waiter& waiter : waiters)
+    {
+        waiter.thread.join();
+
+        EXPECT_EQ(MapSingleFlightStatus::SHARED, waiter.status);
+        EXPECT_EQ(42, waiter.value);
+    }
+
+    EXPECT_EQ(MapSingleFlightStatus::FETCHED, first.status);
+    EXPECT_EQ(42, first.value);
+    EXPECT_EQ(1, nFetches.load());
+
+    Flights::Stats stats = flights.GetStats();
+
+    EXPECT_EQ(1u, stats.nFetched);
+    EXPECT_EQ(4u, stats.nShared);
+}
+
+TEST(MapSingleFlight, OtherKeysFetchSeparately)
+{
+    Flights flights;
+    int nFetches = 0;
+    int value = 0;
+
+    Flights::Fetch fetch = [&](int& valueOut)
+    {
+        valueOut = ++nFetches;
+        return true;
+    };
+
+    EXPECT_EQ(MapSingleFlightStatus::FETCHED, flights.Run(MakeKey(L"Seattle"), nullptr, fetch, value));
+    EXPECT_EQ(MapSingleFlightStatus::FETCHED, flights.Run(MakeKey(L"Portland"), nullptr, fetch, value));
+
+    // and a finished fetch isn't shared; keeping maps is the store's job
+    EXPECT_EQ(MapSingleFlightStatus::FETCHED, flights.Run(MakeKey(L"Seattle"), nullptr, fetch, value));
+    EXPECT_EQ(3, nFetches);
+    EXPECT_EQ(3, value);
+}
+
+TEST(MapSingleFlight, WaitersShareAFailure)
+{
+    Flights flights;
+    Gate gate;
+    std::atomic<int> nFetches(0);
+
+    Flights::Fetch fetch = [&](int&)
+    {
+        nFetches++;
+        gate.Wait();
+        return false;
+    };
+
+    Waiter first;
+    Waiter second;
+
+    StartWaiter(flights, MakeKey(L"Atlantis"), fetch, nullptr, first);
+    std::this_thread::sleep_for(kSettle);
+    StartWaiter(flights, MakeKey(L"Atlantis"), fetch, nullptr, second);
+    std::this_thread::sleep_for(kSettle);
+
+    gate.Open();
+    first.thread.join();
+    second.thread.join();
+
+    EXPECT_EQ(MapSingleFlightStatus::FAILED, first.status);
+    EXPECT_EQ(MapSingleFlightStatus::FAILED, second.status);
+    EXPECT_EQ(1, nFetches.load());
+}
+
+TEST(MapSingleFlight, RemembersAFailureForTheDefaultTtl)
+{
+    Flights flights;
+    int nFetches = 0;
+    int value = 0;
+
+    Flights::Fetch fail = [&](int&) { nFetches++; return false; };
+    Flights::Fetch succeed = [&](int& valueOut) { nFetches++; valueOut = 1; return true; };
+
+    EXPECT_EQ(MapSingleFlightStatus::FAILED, flights.Run(MakeKey(L"Atlantis"), nullptr, fail, value));
+
+    // ten seconds is too long to wait for here, but a moment later it
+    // is still failing without asking the network
+    std::this_thread::sleep_for(kSettle);
+
+    EXPECT_EQ(MapSingleFlightStatus::FAILED_RECENTLY, flights.Run(MakeKey(L"Atlantis"), nullptr, succeed, value));
+    EXPECT_EQ(1, nFetches);
+    EXPECT_EQ(1u, flights.GetStats().nFailedRecently);
+}
+
+TEST(MapSingleFlight, ForgetsAFailureAfterItsTtl)
+{
+    Flights flights(std::chrono::milliseconds(100));
+    int nFetches = 0;
+    int value = 0;
+
+    Flights::Fetch fail = [&](int&) { nFetches++; return false; };
+    Flights::Fetch succeed = [&](int& valueOut) { nFetches++; valueOut = 7; return true; };
+
+    EXPECT_EQ(MapSingleFlightStatus::FAILED, flights.Run(MakeKey(L"Atlantis"), nullptr, fail, value));
+    EXPECT_EQ(MapSingleFlightStatus::FAILED_RECENTLY, flights.Run(MakeKey(L"Atlantis"), nullptr, succeed, value));
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(150));
+
+    EXPECT_EQ(MapSingleFlightStatus::FETCHED, flights.Run(MakeKey(L"Atlantis"), nullptr, succeed, value));
+    EXPECT_EQ(7, value);
+    EXPECT_EQ(2, nFetches);
+}
+
+TEST(MapSingleFlight, CancelledFetchIsNotAFailure)
+{
+    Flights flights;
+    std::atomic<bool> bCancel(false);
+    int nFetches = 0;
+    int value = 0;
+
+    // the user moved on while it was downloading
+    Flights::Fetch cancelled = [&](int&)
+    {
+        nFetches++;
+        bCancel = true;
+        return false;
+    };
+
+    Flights::Fetch succeed = [&](int& valueOut) { nFetches++; valueOut = 3; return true; };
+
+    EXPECT_EQ(MapSingleFlightStatus::CANCELLED, flights.Run(MakeKey(L"Seattle"), &bCancel, cancelled, value));
+
+    // asked for again, it is fetched, not failed straight away
+    std::atomic<bool> bNotCancelled(false);
+
+    EXPECT_EQ(MapSingleFlightStatus::FETCHED, flights.Run(MakeKey(L"Seattle"), &bNotCancelled, succeed, value));
+    EXPECT_EQ(3, value);
+    EXPECT_EQ(2, nFetches);
+
+    // and a flag already set doesn't fetch at all
+    EXPECT_EQ(MapSingleFlightStatus::CANCELLED, flights.Run(MakeKey(L"Seattle"), &bCancel, succeed, value));
+    EXPECT_EQ(2, nFetches);
+}
+
+TEST(MapSingleFlight, WaitersRunACancelledFetchThemselves)
+{
+    Flights flights;
+    Gate gate;
+    std::atomic<bool> bCancelFirst(false);
+    std::atomic<int> nFetches(0);
+
+    Flights::Fetch fetch = [&](int& valueOut)
+    {
+        // the first fetch is cancelled, the second succeeds
+        if (1 == ++nFetches)
+        {
+            gate.Wait();
+            bCancelFirst = true;
+            return false;
+        }
+
+        valueOut = 9;
+        return true;
+    };
+
+    Waiter first;
+    Waiter second;
+
+    StartWaiter(flights, MakeKey(L"Seattle"), fetch, &bCancelFirst, first);
+    std::this_thread::sleep_for(kSettle);
+    StartWaiter(flights, MakeKey(L"Seattle"), fetch, nullptr, second);
+    std::this_thread::sleep_for(kSettle);
+
+    gate.Open();
+    first.thread.join();
+    second.thread.join();
+
+    EXPECT_EQ(MapSingleFlightStatus::CANCELLED, first.status);
+    EXPECT_EQ(MapSingleFlightStatus::FETCHED, second.status);
+    EXPECT_EQ(9, second.value);
+    EXPECT_EQ(2, nFetches.load());
+}
+
+TEST(MapSingleFlight, WaiterCanBeCancelled)
+{
+    Flights flights;
+    Gate gate;
+    std::atomic<bool> bCancelWaiter(false);
+
+    Flights::Fetch fetch = [&](int& valueOut)
+    {
+        gate.Wait();
+        valueOut = 1;
+        return true;
+    };
+
+    Waiter first;
+    Waiter second;
+
+    StartWaiter(flights, MakeKey(L"Seattle"), fetch, nullptr, first);
+    std::this_thread::sleep_for(kSettle);
+    StartWaiter(flights, MakeKey(L"Seattle"), fetch, &bCancelWaiter, second);
+    std::this_thread::sleep_for(kSettle);
+
+    // the waiter gives up while the fetch it waits on carries on
+    auto start = std::chrono::steady_clock::now();
+
+    bCancelWaiter = true;
+    second.thread.join();
+
+    EXPECT_EQ(MapSingleFlightStatus::CANCELLED, second.status);
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(2));
+
+    gate.Open();
+    first.thread.join();
+
+    EXPECT_EQ(MapSingleFlightStatus::FETCHED, first.status);
+}
+
+TEST(MapSingleFlight, ThrowingFetchWakesItsWaiters)
+{
+    Flights flights;
+    Gate gate;
+    std::atomic<int> nFetches(0);
+
+    Flights::Fetch fetch = [&](int& valueOut)
+    {
+        if (1 == ++nFetches)
+        {
+            gate.Wait();
+            throw std::runtime_error("out of memory decoding the map");
+        }
+
+        valueOut = 5;
+        return true;
+    };
+
+    bool bThrew = false;
+
+    std::thread first([&]()
+    {
+        int value = 0;
+
+        try
+        {
+            flights.Run(MakeKey(L"Seattle"), nullptr, fetch, value);
+        }
+        catch (const std::runtime_error&)
+        {
+            bThrew = true;
+        }
+    });
+
+    std::this_thread::sleep_for(kSettle);
+
+    Waiter second;
+    StartWaiter(flights, MakeKey(L"Seattle"), fetch, nullptr, second);
+    std::this_thread::sleep_for(kSettle);
+
+    gate.Open();
+    first.join();
+    second.thread.join();
+
+    // the exception reached the thread that ran the fetch, and the waiter
+    // ran the fetch itself rather than waiting forever
+    EXPECT_TRUE(bThrew);
+    EXPECT_EQ(MapSingleFlightStatus::FETCHED, second.status);
+    EXPECT_EQ(5, second.value);
+    EXPECT_EQ(2, nFetches.load());
+
+    // and the key wasn't remembered as failed
+    int value = 0;
+
+    EXPECT_EQ(MapSingleFlightStatus::FETCHED, flights.Run(MakeKey(L"Seattle"), nullptr, fetch, value));
+    EXPECT_EQ(0u, flights.GetStats().nFailedRecently);
+}
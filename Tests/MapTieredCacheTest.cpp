@@ -0,0 +1,263 @@
+// MapTieredCacheTest.cpp : Unit tests of MapTieredCache and the
+// MapCompressedStore under it, with JpegDecoder on the fixture tiles.
+//
+// The decoded tier's budget here is a couple of 256x256 tiles, so the hot
+// set overflows after a few inserts, and the compressed tier's is a few
+// of the tiles' JPEGs.
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "ImageDecoder.h"
+#include "JpegDecoder.h"
+#include "MapImage.h"
+#include "MapTieredCache.h"
+
+#ifndef MAPBENCH_FIXTURES_DIR
+#define MAPBENCH_FIXTURES_DIR "Fixtures"
+#endif
+
+namespace
+{
+    // a 256x256 tile, 4 bytes a pixel once decoded
+    const size_t kTileBytes = 256 * 256 * 4;
+
+    std::vector<uint8_t> ReadFixture(const char* pszName)
+    {
+        std::ifstream file(std::string(MAPBENCH_FIXTURES_DIR) + "/" + pszName, std::ios::binary);
+
+        return std::vector<uint8_t>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+
+    MapRequestKey TileKey(int nTile)
+    {
+        std::wstring strLocation = L"Tile " + std::to_wstring(nTile);
+
+        return MapRequestKey(DEFAULT_IMAGERY_SET, strLocation.c_str(), 256, 256);
+    }
+
+    bool SamePixels(const MapImage& a, const MapImage& b)
+    {
+        if (a.Width() != b.Width() || a.Height() != b.Height())
+        {
+            return false;
+        }
+
+        for (int y = 0; y < a.Height(); y++)
+        {
+            if (0 != memcmp(a.Row(y), b.Row(y), (size_t)a.Width() * 4))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // a cache decoding with JpegDecoder, and the fixture tiles
+    class MapTieredCacheTest : public ::testing::Test
+    {
+    protected:
+        void SetUp() override
+        {
+            for (const char* pszName : { "seattle_tile0.jpg", "seattle_tile1.jpg", "seattle_tile2.jpg" })
+            {
+                m_tiles.push_back(ReadFixture(pszName));
+                ASSERT_FALSE(m_tiles.back().empty()) << pszName;
+            }
+        }
+
+        // a cache with room for nDecodedTiles decoded and nCompressedBytes of JPEGs
+        std::unique_ptr<MapTieredCache> MakeCache(size_t nDecodedTiles, size_t nCompressedBytes)
+        {
+            std::unique_ptr<MapTieredCache> pCache(new MapTieredCache(nDecodedTiles * kTileBytes, nCompressedBytes));
+
+            pCache->SetDecoder([this](const uint8_t* pData, size_t nSize, MapImageHandle& hImageOut)
+            {
+                return DecodeToMapImage(*m_pDecoder, pData, nSize, hImageOut);
+            });
+
+            return pCache;
+        }
+
+        MapImageHandle Decode(const std::vector<uint8_t>& jpeg)
+        {
+            MapImageHandle hImage;
+
+            EXPECT_TRUE(DecodeToMapImage(*m_pDecoder, jpeg.data(), jpeg.size(), hImage));
+
+            return hImage;
+        }
+
+        std::unique_ptr<ImageDecoder>       m_pDecoder = CreateJpegDecoder();
+        std::vector<std::vector<uint8_t>>   m_tiles;
+    };
+}
+
+TEST_F(MapTieredCacheTest, TheHotSetOverflowsIntoTheCompressedTier)
+{
+    std::unique_ptr<MapTieredCache> pCache = MakeCache(2, MapTieredCache::kDefaultCompressedBudgetBytes);
+    std::vector<MapImageHandle> images;
+
+    for (int i = 0; i < 3; i++)
+    {
+        images.push_back(Decode(m_tiles[i]));
+        ASSERT_EQ(kTileBytes, images.back()->ByteSize());
+
+        pCache->Insert(TileKey(i), m_tiles[i].data(), m_tiles[i].size(), images.back());
+    }
+
+    // the oldest decoded tile made way, but its JPEG is still there
+    EXPECT_EQ(2u, pCache->Decoded().Count());
+    EXPECT_EQ(3u, pCache->Compressed().Count());
+    EXPECT_FALSE(pCache->Decoded().Contains(TileKey(0)));
+    EXPECT_TRUE(pCache->Compressed().Contains(TileKey(0)));
+    EXPECT_EQ(1u, pCache->GetStats().decoded.nEvictions);
+
+    MapCacheTier tier = MapCacheTier::NONE;
+    MapImageHandle hImage = pCache->Find(TileKey(2), &tier);
+
+    EXPECT_EQ(MapCacheTier::DECODED, tier);
+    EXPECT_EQ(images[2], hImage);
+
+    // the evicted one comes back from its JPEG, the same pixels
+    hImage = pCache->Find(TileKey(0), &tier);
+
+    EXPECT_EQ(MapCacheTier::COMPRESSED, tier);
+    ASSERT_TRUE(hImage);
+    EXPECT_TRUE(SamePixels(*images[0], *hImage));
+
+    // and is hot again, pushing out the least recently used
+    EXPECT_TRUE(pCache->Decoded().Contains(TileKey(0)));
+    EXPECT_FALSE(pCache->Decoded().Contains(TileKey(1)));
+    EXPECT_LE(pCache->Decoded().TotalBytes(), 2 * kTileBytes);
+}
+
+TEST_F(MapTieredCacheTest, TheCompressedTierKeepsToItsBudget)
+{
+    size_t nBudget = m_tiles[0].size() * 3 + 100;
+    std::unique_ptr<MapTieredCache> pCache = MakeCache(2, nBudget);
+
+    // the same JPEG under five keys, no decoded maps
+    for (int i = 0; i < 5; i++)
+    {
+        pCache->Insert(TileKey(i), m_tiles[0].data(), m_tiles[0].size(), MapImageHandle());
+
+        EXPECT_LE(pCache->Compressed().TotalBytes(), nBudget) << "after insert " << i;
+
+        // the first stays the most recently used
+        pCache->Compressed().Find(TileKey(0));
+    }
+
+    MapStoreStats stats = pCache->GetStats().compressed;
+
+    EXPECT_EQ(3u, stats.nCount);
+    EXPECT_EQ(2u, stats.nEvictions);
+    EXPECT_EQ(nBudget, stats.nBudgetBytes);
+
+    EXPECT_TRUE(pCache->Compressed().Contains(TileKey(0)));
+    EXPECT_FALSE(pCache->Compressed().Contains(TileKey(1)));
+    EXPECT_FALSE(pCache->Compressed().Contains(TileKey(2)));
+    EXPECT_TRUE(pCache->Compressed().Contains(TileKey(4)));
+
+    // an evicted map is in neither tier
+    MapCacheTier tier = MapCacheTier::DECODED;
+
+    EXPECT_FALSE(pCache->Find(TileKey(1), &tier));
+    EXPECT_EQ(MapCacheTier::NONE, tier);
+
+    // a budget cut evicts straight away
+    pCache->Compressed().SetBudget(m_tiles[0].size());
+
+    EXPECT_EQ(1u, pCache->Compressed().Count());
+    EXPECT_LE(pCache->Compressed().TotalBytes(), m_tiles[0].size());
+}
+
+TEST_F(MapTieredCacheTest, DecodesAColdMapWhenItIsWanted)
+{
+    std::unique_ptr<MapTieredCache> pCache = MakeCache(2, MapTieredCache::kDefaultCompressedBudgetBytes);
+
+    pCache->Insert(TileKey(1), m_tiles[1].data(), m_tiles[1].size(), MapImageHandle());
+
+    // painting doesn't decode, so it doesn't find it
+    EXPECT_FALSE(pCache->Decoded().Find(TileKey(1)));
+
+    MapCacheTier tier = MapCacheTier::NONE;
+    MapImageHandle hImage = pCache->Find(TileKey(1), &tier);
+
+    EXPECT_EQ(MapCacheTier::COMPRESSED, tier);
+    ASSERT_TRUE(hImage);
+    EXPECT_EQ(256, hImage->Width());
+    EXPECT_EQ(256, hImage->Height());
+    EXPECT_TRUE(SamePixels(*Decode(m_tiles[1]), *hImage));
+
+    // once, and then it is hot
+    EXPECT_EQ(hImage, pCache->Find(TileKey(1), &tier));
+    EXPECT_EQ(MapCacheTier::DECODED, tier);
+    EXPECT_EQ(hImage, pCache->Decoded().Find(TileKey(1)));
+    EXPECT_EQ(1u, pCache->GetStats().decodeUs.nCount);
+}
+
+TEST_F(MapTieredCacheTest, AFileThatWontDecodeIsDropped)
+{
+    std::unique_ptr<MapTieredCache> pCache = MakeCache(2, MapTieredCache::kDefaultCompressedBudgetBytes);
+
+    // the first half of a JPEG
+    pCache->Insert(TileKey(0), m_tiles[0].data(), m_tiles[0].size() / 2, MapImageHandle());
+
+    MapCacheTier tier = MapCacheTier::DECODED;
+
+    EXPECT_FALSE(pCache->Find(TileKey(0), &tier));
+    EXPECT_EQ(MapCacheTier::NONE, tier);
+    EXPECT_FALSE(pCache->Compressed().Contains(TileKey(0)));
+
+    MapTieredCache::Stats stats = pCache->GetStats();
+
+    EXPECT_EQ(1u, stats.nDecodeFailures);
+    EXPECT_EQ(0u, stats.decodeUs.nCount);
+}
+
+TEST_F(MapTieredCacheTest, CountsHitsAndDecodesPerTier)
+{
+    std::unique_ptr<MapTieredCache> pCache = MakeCache(1, MapTieredCache::kDefaultCompressedBudgetBytes);
+
+    for (int i = 0; i < 2; i++)
+    {
+        pCache->Insert(TileKey(i), m_tiles[i].data(), m_tiles[i].size(), MapImageHandle());
+    }
+
+    pCache->Find(TileKey(0));       // decoded miss, compressed hit, a decode
+    pCache->Find(TileKey(0));       // decoded hit
+    pCache->Find(TileKey(1));       // decoded miss, compressed hit, a decode that evicts tile 0
+    pCache->Find(TileKey(0));       // decoded miss, compressed hit, a decode
+    pCache->Find(TileKey(7));       // a miss in both
+
+    MapTieredCache::Stats stats = pCache->GetStats();
+
+    EXPECT_EQ(1u, stats.decoded.nHits);
+    EXPECT_EQ(4u, stats.decoded.nMisses);
+    EXPECT_EQ(2u, stats.decoded.nEvictions);
+    EXPECT_EQ(1u, stats.decoded.nCount);
+    EXPECT_DOUBLE_EQ(0.2, stats.decoded.HitRate());
+
+    EXPECT_EQ(3u, stats.compressed.nHits);
+    EXPECT_EQ(1u, stats.compressed.nMisses);
+    EXPECT_EQ(0u, stats.compressed.nEvictions);
+    EXPECT_EQ(2u, stats.compressed.nCount);
+    EXPECT_EQ(m_tiles[0].size() + m_tiles[1].size(), stats.compressed.nTotalBytes);
+
+    EXPECT_EQ(3u, stats.decodeUs.nCount);
+    EXPECT_GT(stats.decodeUs.nMax, 0u);
+    EXPECT_EQ(0u, stats.nDecodeFailures);
+
+    std::string strJson = pCache->StatsToJson();
+
+    EXPECT_NE(std::string::npos, strJson.find("\"decoded\":{\"hits\":1,\"misses\":4,"));
+    EXPECT_NE(std::string::npos, strJson.find("\"compressed\":{\"hits\":3,\"misses\":1,"));
+    EXPECT_NE(std::string::npos, strJson.find("\"compressed_decode\":{\"count\":3,\"failures\":0,"));
+}
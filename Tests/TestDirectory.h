@@ -0,0 +1,48 @@
+// TestDirectory.h : A directory of its own for a test, removed afterwards.
+//
+// The caches keep their files in a directory they are given.  Each test
+// gets a fresh one under the system's temporary directory, named for the
+// process and the test, so tests run in parallel by ctest don't share one.
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <system_error>
+
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+class TestDirectory
+{
+public:
+    TestDirectory()
+    {
+        const ::testing::TestInfo* pTest = ::testing::UnitTest::GetInstance()->current_test_info();
+        std::string strName = "GraphicsTestWin32Tests." + std::to_string(getpid());
+
+        if (pTest)
+        {
+            strName += std::string(".") + pTest->test_suite_name() + "." + pTest->name();
+        }
+
+        std::error_code ec;
+
+        m_path = std::filesystem::temp_directory_path(ec) / strName;
+        std::filesystem::remove_all(m_path, ec);
+    }
+
+    ~TestDirectory()
+    {
+        std::error_code ec;
+        std::filesystem::remove_all(m_path, ec);
+    }
+
+    TestDirectory(const TestDirectory&) = delete;
+    TestDirectory& operator=(const TestDirectory&) = delete;
+
+    const std::filesystem::path& Path() const { return m_path; }
+
+private:
+    std::filesystem::path m_path;
+};
@@ -0,0 +1,386 @@
+// TileLayerTest.cpp : Unit tests of TileLayer.
+//
+// Composing the view from the tiles a MapBitmapStore has, listing the ones
+// it doesn't, drawing stand-ins from other levels, and finding where a
+// tile that has just arrived is on screen.  Each tile is one solid colour,
+// so a pixel says which tile was drawn there.
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "MapBitmapStore.h"
+#include "MapImage.h"
+#include "PixelBlit.h"
+#include "TileLayer.h"
+#include "TileSystem.h"
+
+namespace
+{
+    // a tile of one colour
+    MapImageHandle SolidTile(uint32_t color, int nSize = TileSystem::kTileSize)
+    {
+        std::shared_ptr<MapImage> pImage = MapImage::Create(nSize, nSize);
+
+        for (int y = 0; y < nSize; y++)
+        {
+            uint32_t* pRow = (uint32_t*)pImage->Row(y);
+            std::fill(pRow, pRow + nSize, color);
+        }
+
+        return pImage;
+    }
+
+    MapRequestKey TileKeyOf(int nTileX, int nTileY, int nLevel)
+    {
+        return MapRequestKey::ForTile(DEFAULT_IMAGERY_SET, TileSystem::TileXYToQuadKey(nTileX, nTileY, nLevel));
+    }
+
+    // somewhere for Compose to draw
+    class Screen
+    {
+    public:
+        Screen(int nWidth, int nHeight)
+            : m_pImage(MapImage::Create(nWidth, nHeight))
+        {
+            for (int y = 0; y < nHeight; y++)
+            {
+                memset(m_pImage->Row(y), 0, (size_t)nWidth * 4);
+            }
+        }
+
+        PixelBuffer Buffer() { return PixelBufferOf(*m_pImage); }
+        PixelRect Bounds() { return Buffer().Bounds(); }
+
+        uint32_t At(int x, int y) const { return ((const uint32_t*)m_pImage->Row(y))[x]; }
+
+    private:
+        std::shared_ptr<MapImage> m_pImage;
+    };
+}
+
+TEST(TileLayer, CenterOnAndResize)
+{
+    TileLayer layer;
+
+    layer.CenterOn(0, 0, 3);
+    layer.Resize(640, -5);
+
+    EXPECT_EQ(3, layer.Viewport().level);
+    EXPECT_DOUBLE_EQ(1024.5, layer.Viewport().centerPixelX);
+    EXPECT_DOUBLE_EQ(1024.5, layer.Viewport().centerPixelY);
+    EXPECT_EQ(640, layer.Viewport().width);
+    EXPECT_EQ(0, layer.Viewport().height);
+
+    // the level is kept within the tile system's
+    layer.CenterOn(0, 0, 99);
+    EXPECT_EQ(TileSystem::kMaxLevel, layer.Viewport().level);
+}
+
+TEST(TileLayer, TileKeyUsesTheImagerySet)
+{
+    TileLayer layer(L"Road");
+    VisibleTile tile = { 3, 5, 3, 0, 0 };
+
+    MapRequestKey key = layer.TileKey(tile);
+
+    EXPECT_TRUE(key.IsTile());
+    EXPECT_EQ(L"Road", key.imagerySet);
+    EXPECT_EQ(L"213", key.location);
+    EXPECT_EQ(3, key.zoomLevel);
+}
+
+TEST(TileLayer, ComposeDrawsStoredTilesAndListsMissingOnes)
+{
+    // level 1 is 2 x 2 tiles, which a 512 x 512 view shows exactly
+    TileLayer layer;
+    MapBitmapStore store;
+    Screen screen(512, 512);
+
+    layer.CenterOn(0, 0, 1);
+    layer.Resize(512, 512);
+
+    store.Insert(TileKeyOf(0, 0, 1), SolidTile(0x00111111));
+    store.Insert(TileKeyOf(1, 1, 1), SolidTile(0x00444444));
+
+    std::vector<MapRequestKey> missing;
+    layer.Compose(store, screen.Buffer(), screen.Bounds(), missing);
+
+    // the view is centered on pixel 256.5, so it starts at world pixel 0
+    EXPECT_EQ(0x00111111u, screen.At(0, 0));
+    EXPECT_EQ(0x00111111u, screen.At(255, 255));
+    EXPECT_EQ(0x00444444u, screen.At(256, 256));
+    EXPECT_EQ(0x00444444u, screen.At(511, 511));
+
+    // the missing tiles show the background until they arrive
+    EXPECT_EQ(TileLayer::kBackgroundColor, screen.At(300, 10));
+    EXPECT_EQ(TileLayer::kBackgroundColor, screen.At(10, 300));
+
+    ASSERT_EQ(2u, missing.size());
+    EXPECT_NE(missing.end(), std::find(missing.begin(), missing.end(), TileKeyOf(1, 0, 1)));
+    EXPECT_NE(missing.end(), std::find(missing.begin(), missing.end(), TileKeyOf(0, 1, 1)));
+}
+
+TEST(TileLayer, ComposeOnlyDrawsTheDirtyRect)
+{
+    TileLayer layer;
+    MapBitmapStore store;
+    Screen screen(512, 512);
+
+    layer.CenterOn(0, 0, 1);
+    layer.Resize(512, 512);
+
+    for (int i = 0; i < 4; i++)
+    {
+        store.Insert(TileKeyOf(i & 1, i >> 1, 1), SolidTile(0x00222222));
+    }
+
+    std::vector<MapRequestKey> missing;
+    PixelRect dirty = { 100, 100, 200, 200 };
+
+    layer.Compose(store, screen.Buffer(), dirty, missing);
+
+    EXPECT_EQ(0x00222222u, screen.At(100, 100));
+    EXPECT_EQ(0x00222222u, screen.At(199, 199));
+    EXPECT_EQ(0u, screen.At(99, 100));
+    EXPECT_EQ(0u, screen.At(200, 199));
+    EXPECT_EQ(0u, screen.At(400, 400));
+
+    EXPECT_TRUE(missing.empty());
+
+    // but tiles outside it are still listed if they're missing
+    store.Remove(TileKeyOf(1, 1, 1));
+    layer.Compose(store, screen.Buffer(), dirty, missing);
+
+    ASSERT_EQ(1u, missing.size());
+    EXPECT_EQ(TileKeyOf(1, 1, 1), missing[0]);
+}
+
+TEST(TileLayer, ComposeFillsAboveAndBelowTheMap)
+{
+    // a view taller than the level 1 map
+    TileLayer layer;
+    MapBitmapStore store;
+    Screen screen(512, 712);
+
+    layer.CenterOn(0, 0, 1);
+    layer.Resize(512, 712);
+
+    for (int i = 0; i < 4; i++)
+    {
+        store.Insert(TileKeyOf(i & 1, i >> 1, 1), SolidTile(0x00333333));
+    }
+
+    std::vector<MapRequestKey> missing;
+    layer.Compose(store, screen.Buffer(), screen.Bounds(), missing);
+
+    // the map starts 100 pixels down
+    EXPECT_EQ(TileLayer::kBackgroundColor, screen.At(0, 0));
+    EXPECT_EQ(TileLayer::kBackgroundColor, screen.At(511, 99));
+    EXPECT_EQ(0x00333333u, screen.At(0, 100));
+    EXPECT_EQ(0x00333333u, screen.At(511, 611));
+    EXPECT_EQ(TileLayer::kBackgroundColor, screen.At(0, 612));
+    EXPECT_EQ(TileLayer::kBackgroundColor, screen.At(511, 711));
+
+    EXPECT_TRUE(missing.empty());
+}
+
+TEST(TileLayer, StandInFromAnAncestor)
+{
+    // the view shows level 2 tile (1, 1); the store only has its level 1
+    // parent, which is one colour, so the stand-in is too
+    TileLayer layer;
+    MapBitmapStore store;
+    Screen screen(256, 256);
+
+    layer.CenterOn(0, 0, 2);
+    layer.Resize(256, 256);
+    layer.PanBy(-128, -128);
+
+    store.Insert(TileKeyOf(0, 0, 1), SolidTile(0x00555555));
+
+    std::vector<MapRequestKey> missing;
+    layer.Compose(store, screen.Buffer(), screen.Bounds(), missing);
+
+    EXPECT_EQ(0x00555555u, screen.At(0, 0));
+    EXPECT_EQ(0x00555555u, screen.At(128, 128));
+    EXPECT_EQ(0x00555555u, screen.At(255, 255));
+
+    // and the real tile is still wanted
+    ASSERT_EQ(1u, missing.size());
+    EXPECT_EQ(TileKeyOf(1, 1, 2), missing[0]);
+}
+
+TEST(TileLayer, StandInFromChildren)
+{
+    // the view shows level 1 tile (0, 0); the store has two of its four
+    // level 2 children, which fill their quarters, and the background
+    // fills the others
+    TileLayer layer;
+    MapBitmapStore store;
+    Screen screen(256, 256);
+
+    layer.CenterOn(0, 0, 1);
+    layer.Resize(256, 256);
+    layer.PanBy(-128, -128);
+
+    store.Insert(TileKeyOf(0, 0, 2), SolidTile(0x00666666));
+    store.Insert(TileKeyOf(1, 1, 2), SolidTile(0x00777777));
+
+    std::vector<MapRequestKey> missing;
+    layer.Compose(store, screen.Buffer(), screen.Bounds(), missing);
+
+    EXPECT_EQ(0x00666666u, screen.At(10, 10));
+    EXPECT_EQ(0x00777777u, screen.At(200, 200));
+    EXPECT_EQ(TileLayer::kBackgroundColor, screen.At(200, 10));
+    EXPECT_EQ(TileLayer::kBackgroundColor, screen.At(10, 200));
+
+    ASSERT_EQ(1u, missing.size());
+    EXPECT_EQ(TileKeyOf(0, 0, 1), missing[0]);
+}
+
+TEST(TileLayer, ComposeNearbyListsTheRingAroundTheView)
+{
+    // level 3 is 8 x 8 tiles.  A 512 x 512 view on the middle of the map
+    // shows 2 x 2 tiles, and the ring around it is 12 more.
+    TileLayer layer;
+    MapBitmapStore store;
+
+    layer.CenterOn(0, 0, 3);
+    layer.Resize(512, 512);
+
+    std::vector<MapRequestKey> nearby;
+    layer.ComposeNearby(store, nearby);
+
+    EXPECT_EQ(12u, nearby.size());
+
+    for (int x = 3; x <= 4; x++)
+    {
+        for (int y = 3; y <= 4; y++)
+        {
+            EXPECT_EQ(nearby.end(), std::find(nearby.begin(), nearby.end(), TileKeyOf(x, y, 3)));
+        }
+    }
+
+    // the ones the store has aren't wanted
+    store.Insert(TileKeyOf(2, 2, 3), SolidTile(0));
+    layer.ComposeNearby(store, nearby);
+
+    EXPECT_EQ(11u, nearby.size());
+    EXPECT_EQ(nearby.end(), std::find(nearby.begin(), nearby.end(), TileKeyOf(2, 2, 3)));
+}
+
+TEST(TileLayer, ScreenRectsFindsATile)
+{
+    TileLayer layer;
+
+    layer.CenterOn(0, 0, 1);
+    layer.Resize(512, 512);
+
+    std::vector<PixelRect> rects = layer.ScreenRects(TileKeyOf(1, 0, 1));
+
+    ASSERT_EQ(1u, rects.size());
+    EXPECT_EQ(256, rects[0].left);
+    EXPECT_EQ(0, rects[0].top);
+    EXPECT_EQ(512, rects[0].right);
+    EXPECT_EQ(256, rects[0].bottom);
+
+    // a tile at another level, or a static map, isn't on screen
+    EXPECT_TRUE(layer.ScreenRects(TileKeyOf(1, 0, 2)).empty());
+    EXPECT_TRUE(layer.ScreenRects(MapRequestKey(DEFAULT_IMAGERY_SET, L"Seattle", 512, 512)).empty());
+
+    // and in a view wider than the world, a tile is there more than once
+    layer.Resize(1400, 512);
+    EXPECT_GE(layer.ScreenRects(TileKeyOf(1, 0, 1)).size(), 2u);
+}
+
+TEST(TileLayer, PanByWrapsEastWestAndStopsNorthSouth)
+{
+    TileLayer layer;
+    int nMovedX = 0;
+    int nMovedY = 0;
+
+    layer.CenterOn(0, 0, 1);
+    layer.Resize(200, 200);
+
+    // across the date line and back into the map
+    layer.PanBy(-300, 0, &nMovedX, &nMovedY);
+
+    EXPECT_DOUBLE_EQ(468.5, layer.Viewport().centerPixelX);
+    EXPECT_EQ(-300, nMovedX);
+    EXPECT_EQ(0, nMovedY);
+
+    // past the top of the map, which stops at its edge
+    layer.PanBy(0, -1000, &nMovedX, &nMovedY);
+
+    EXPECT_DOUBLE_EQ(0, layer.Viewport().centerPixelY);
+    EXPECT_EQ(-256, nMovedY);
+
+    // and the bottom
+    layer.PanBy(0, 1000, &nMovedX, &nMovedY);
+
+    EXPECT_DOUBLE_EQ(511, layer.Viewport().centerPixelY);
+    EXPECT_EQ(511, nMovedY);
+}
+
+TEST(TileLayer, ZoomAtKeepsThePointUnderTheCursor)
+{
+    TileLayer layer;
+
+    layer.CenterOn(47.6062, -122.3321, 10);
+    layer.Resize(800, 600);
+
+    const int x = 610;
+    const int y = 150;
+
+    // the world pixel under x, y
+    auto UnderCursor = [&](double* pWorldX, double* pWorldY)
+    {
+        const TileViewport& viewport = layer.Viewport();
+
+        *pWorldX = floor(viewport.centerPixelX - viewport.width / 2.0) + x + 0.5;
+        *pWorldY = floor(viewport.centerPixelY - viewport.height / 2.0) + y + 0.5;
+    };
+
+    for (int nLevels : { 1, 3, -2, -1 })
+    {
+        int nLevel = layer.Viewport().level;
+
+        double worldX, worldY;
+        UnderCursor(&worldX, &worldY);
+
+        ASSERT_TRUE(layer.ZoomAt(x, y, nLevels));
+        EXPECT_EQ(nLevel + nLevels, layer.Viewport().level);
+
+        double zoomedX, zoomedY;
+        UnderCursor(&zoomedX, &zoomedY);
+
+        // the same place, to within a pixel of the coarser of the two
+        // levels, which is 2^nLevels pixels at the finer one
+        double factor = ldexp(1.0, nLevels);
+        double tolerance = std::max(factor, 1.0);
+
+        EXPECT_NEAR(worldX * factor, zoomedX, tolerance) << nLevels;
+        EXPECT_NEAR(worldY * factor, zoomedY, tolerance) << nLevels;
+    }
+}
+
+TEST(TileLayer, ZoomAtStopsAtTheEnds)
+{
+    TileLayer layer;
+
+    layer.CenterOn(0, 0, TileSystem::kMinLevel);
+    layer.Resize(400, 400);
+
+    EXPECT_FALSE(layer.ZoomAt(200, 200, -1));
+    EXPECT_EQ(TileSystem::kMinLevel, layer.Viewport().level);
+
+    // a big step in clamps to the deepest level
+    EXPECT_TRUE(layer.ZoomAt(200, 200, 100));
+    EXPECT_EQ(TileSystem::kMaxLevel, layer.Viewport().level);
+
+    EXPECT_FALSE(layer.ZoomAt(200, 200, 1));
+}
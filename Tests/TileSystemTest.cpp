@@ -0,0 +1,266 @@
+// TileSystemTest.cpp : Unit tests of TileSystem and ComputeVisibleTiles.
+//
+// The quadkey and pixel math against the examples in the Bing Maps tile
+// system documentation, and which tiles a viewport needs, including at the
+// date line and past the top and bottom of the map.
+#include <algorithm>
+#include <cmath>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "TileSystem.h"
+
+namespace
+{
+    TileViewport MakeViewport(double centerPixelX, double centerPixelY, int nLevel, int nWidth, int nHeight)
+    {
+        TileViewport viewport;
+        viewport.centerPixelX = centerPixelX;
+        viewport.centerPixelY = centerPixelY;
+        viewport.level = nLevel;
+        viewport.width = nWidth;
+        viewport.height = nHeight;
+
+        return viewport;
+    }
+
+    // the squared distance of a tile's middle from the viewport's middle
+    double DistanceFromCenter(const TileViewport& viewport, const VisibleTile& tile)
+    {
+        double dx = tile.screenX + TileSystem::kTileSize / 2.0 - viewport.width / 2.0;
+        double dy = tile.screenY + TileSystem::kTileSize / 2.0 - viewport.height / 2.0;
+
+        return dx * dx + dy * dy;
+    }
+}
+
+TEST(TileSystem, MapSizeDoublesEachLevel)
+{
+    EXPECT_EQ(512u, TileSystem::MapSize(1));
+    EXPECT_EQ(1024u, TileSystem::MapSize(2));
+    EXPECT_EQ(2147483648u, TileSystem::MapSize(TileSystem::kMaxLevel));
+}
+
+TEST(TileSystem, GroundResolution)
+{
+    // the equator at level 1 is 40075 km across 512 pixels
+    EXPECT_NEAR(78271.517, TileSystem::GroundResolution(0, 1), 0.001);
+
+    // and half that at 60 degrees
+    EXPECT_NEAR(78271.517 / 2, TileSystem::GroundResolution(60, 1), 0.001);
+}
+
+TEST(TileSystem, QuadKeyOfTheDocumentationExample)
+{
+    EXPECT_EQ("213", TileSystem::TileXYToQuadKey(3, 5, 3));
+
+    int nTileX, nTileY, nLevel;
+
+    ASSERT_TRUE(TileSystem::QuadKeyToTileXY("213", &nTileX, &nTileY, &nLevel));
+    EXPECT_EQ(3, nTileX);
+    EXPECT_EQ(5, nTileY);
+    EXPECT_EQ(3, nLevel);
+}
+
+TEST(TileSystem, QuadKeyRoundTripsAtEveryLevel)
+{
+    for (int nLevel = TileSystem::kMinLevel; nLevel <= TileSystem::kMaxLevel; nLevel++)
+    {
+        int nLast = (int)(TileSystem::MapSize(nLevel) / TileSystem::kTileSize) - 1;
+
+        for (std::pair<int, int> tile : { std::make_pair(0, 0), std::make_pair(nLast, nLast),
+            std::make_pair(nLast / 3, nLast / 2), std::make_pair(nLast, 0) })
+        {
+            std::string quadKey = TileSystem::TileXYToQuadKey(tile.first, tile.second, nLevel);
+
+            ASSERT_EQ((size_t)nLevel, quadKey.size());
+
+            int nTileX, nTileY, nKeyLevel;
+
+            ASSERT_TRUE(TileSystem::QuadKeyToTileXY(quadKey, &nTileX, &nTileY, &nKeyLevel)) << quadKey;
+            EXPECT_EQ(tile.first, nTileX) << quadKey;
+            EXPECT_EQ(tile.second, nTileY) << quadKey;
+            EXPECT_EQ(nLevel, nKeyLevel);
+        }
+    }
+}
+
+TEST(TileSystem, QuadKeyStartsWithItsParents)
+{
+    std::string child = TileSystem::TileXYToQuadKey(1234, 5678, 14);
+    std::string parent = TileSystem::TileXYToQuadKey(1234 >> 3, 5678 >> 3, 11);
+
+    EXPECT_EQ(parent, child.substr(0, 11));
+}
+
+TEST(TileSystem, RejectsBadQuadKeys)
+{
+    int nTileX = -1, nTileY = -1, nLevel = -1;
+
+    EXPECT_FALSE(TileSystem::QuadKeyToTileXY("", &nTileX, &nTileY, &nLevel));
+    EXPECT_FALSE(TileSystem::QuadKeyToTileXY("0124", &nTileX, &nTileY, &nLevel));
+    EXPECT_FALSE(TileSystem::QuadKeyToTileXY("21a", &nTileX, &nTileY, &nLevel));
+    EXPECT_FALSE(TileSystem::QuadKeyToTileXY(std::string(TileSystem::kMaxLevel + 1, '0'), &nTileX, &nTileY, &nLevel));
+
+    // and leaves the outputs alone
+    EXPECT_EQ(-1, nTileX);
+    EXPECT_EQ(-1, nTileY);
+    EXPECT_EQ(-1, nLevel);
+}
+
+TEST(TileSystem, LatLongToPixelXY)
+{
+    double pixelX, pixelY;
+
+    // null island is the middle of the map
+    TileSystem::LatLongToPixelXY(0, 0, 1, &pixelX, &pixelY);
+    EXPECT_DOUBLE_EQ(256.5, pixelX);
+    EXPECT_DOUBLE_EQ(256.5, pixelY);
+
+    // the corners clip to the map
+    TileSystem::LatLongToPixelXY(90, -180, 3, &pixelX, &pixelY);
+    EXPECT_DOUBLE_EQ(0.5, pixelX);
+    EXPECT_NEAR(0.5, pixelY, 0.01);
+
+    TileSystem::LatLongToPixelXY(-90, 180, 3, &pixelX, &pixelY);
+    EXPECT_DOUBLE_EQ(2047, pixelX);
+    EXPECT_DOUBLE_EQ(2047, pixelY);
+}
+
+TEST(TileSystem, LatLongRoundTrips)
+{
+    // Seattle, to within a pixel's worth of degrees at level 15
+    double pixelX, pixelY, latitude, longitude;
+
+    TileSystem::LatLongToPixelXY(47.6062, -122.3321, 15, &pixelX, &pixelY);
+    TileSystem::PixelXYToLatLong(pixelX, pixelY, 15, &latitude, &longitude);
+
+    EXPECT_NEAR(47.6062, latitude, 1e-4);
+    EXPECT_NEAR(-122.3321, longitude, 1e-4);
+}
+
+TEST(TileSystem, PixelXYToTileXYRoundsDown)
+{
+    int nTileX, nTileY;
+
+    TileSystem::PixelXYToTileXY(255, 256, &nTileX, &nTileY);
+    EXPECT_EQ(0, nTileX);
+    EXPECT_EQ(1, nTileY);
+
+    // west of the date line, which the viewport code relies on
+    TileSystem::PixelXYToTileXY(-1, -256, &nTileX, &nTileY);
+    EXPECT_EQ(-1, nTileX);
+    EXPECT_EQ(-1, nTileY);
+
+    TileSystem::PixelXYToTileXY(-257, 0, &nTileX, &nTileY);
+    EXPECT_EQ(-2, nTileX);
+
+    int64_t pixelX, pixelY;
+
+    TileSystem::TileXYToPixelXY(3, 5, &pixelX, &pixelY);
+    EXPECT_EQ(768, pixelX);
+    EXPECT_EQ(1280, pixelY);
+}
+
+TEST(ComputeVisibleTiles, CoversTheViewport)
+{
+    // level 3 is 8 x 8 tiles.  A 600 x 400 view centered on the middle of
+    // the map spans world pixels 724 to 1324 across and 824 to 1224 down.
+    TileViewport viewport = MakeViewport(1024, 1024, 3, 600, 400);
+    std::vector<VisibleTile> tiles = ComputeVisibleTiles(viewport);
+
+    std::set<std::pair<int, int>> seen;
+
+    for (const VisibleTile& tile : tiles)
+    {
+        EXPECT_EQ(3, tile.level);
+        EXPECT_TRUE(seen.insert(std::make_pair(tile.tileX, tile.tileY)).second);
+
+        // every tile overlaps the viewport, and is where its pixels are
+        EXPECT_LT(tile.screenX, viewport.width);
+        EXPECT_LT(tile.screenY, viewport.height);
+        EXPECT_GT(tile.screenX + TileSystem::kTileSize, 0);
+        EXPECT_GT(tile.screenY + TileSystem::kTileSize, 0);
+        EXPECT_EQ(tile.tileX * 256 - 724, tile.screenX);
+        EXPECT_EQ(tile.tileY * 256 - 824, tile.screenY);
+    }
+
+    // columns 2 to 5 and rows 3 to 4
+    EXPECT_EQ(8u, tiles.size());
+
+    for (int x = 2; x <= 5; x++)
+    {
+        for (int y = 3; y <= 4; y++)
+        {
+            EXPECT_EQ(1u, seen.count(std::make_pair(x, y))) << x << ", " << y;
+        }
+    }
+}
+
+TEST(ComputeVisibleTiles, NearestTheCenterFirst)
+{
+    TileViewport viewport = MakeViewport(5000.3, 7000.8, 8, 1280, 960);
+    std::vector<VisibleTile> tiles = ComputeVisibleTiles(viewport);
+
+    ASSERT_FALSE(tiles.empty());
+
+    for (size_t i = 1; i < tiles.size(); i++)
+    {
+        EXPECT_LE(DistanceFromCenter(viewport, tiles[i - 1]), DistanceFromCenter(viewport, tiles[i]));
+    }
+}
+
+TEST(ComputeVisibleTiles, WrapsAtTheDateLine)
+{
+    // the left half of the view is west of the date line, on the far
+    // right of the map
+    TileViewport viewport = MakeViewport(0, 1024, 3, 512, 256);
+    std::vector<VisibleTile> tiles = ComputeVisibleTiles(viewport);
+
+    std::set<int> columns;
+
+    for (const VisibleTile& tile : tiles)
+    {
+        EXPECT_GE(tile.tileX, 0);
+        EXPECT_LT(tile.tileX, 8);
+        columns.insert(tile.tileX);
+    }
+
+    EXPECT_EQ(std::set<int>({ 7, 0 }), columns);
+
+    // and a view wider than the world shows tiles more than once
+    TileViewport wide = MakeViewport(256, 256, 1, 1600, 512);
+    std::vector<VisibleTile> wideTiles = ComputeVisibleTiles(wide);
+
+    int nTopLeft = (int)std::count_if(wideTiles.begin(), wideTiles.end(),
+        [](const VisibleTile& tile) { return 0 == tile.tileX && 0 == tile.tileY; });
+
+    EXPECT_GE(nTopLeft, 2);
+}
+
+TEST(ComputeVisibleTiles, LeavesOutRowsOffTheMap)
+{
+    // a view taller than the level 1 map, centered on it
+    TileViewport viewport = MakeViewport(256, 256, 1, 512, 1000);
+    std::vector<VisibleTile> tiles = ComputeVisibleTiles(viewport);
+
+    EXPECT_EQ(4u, tiles.size());
+
+    for (const VisibleTile& tile : tiles)
+    {
+        EXPECT_GE(tile.tileY, 0);
+        EXPECT_LE(tile.tileY, 1);
+    }
+}
+
+TEST(ComputeVisibleTiles, NothingForAnEmptyOrBadViewport)
+{
+    EXPECT_TRUE(ComputeVisibleTiles(MakeViewport(256, 256, 1, 0, 100)).empty());
+    EXPECT_TRUE(ComputeVisibleTiles(MakeViewport(256, 256, 1, 100, -1)).empty());
+    EXPECT_TRUE(ComputeVisibleTiles(MakeViewport(256, 256, 0, 100, 100)).empty());
+    EXPECT_TRUE(ComputeVisibleTiles(MakeViewport(256, 256, TileSystem::kMaxLevel + 1, 100, 100)).empty());
+}
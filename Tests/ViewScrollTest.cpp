@@ -0,0 +1,223 @@
+// ViewScrollTest.cpp : Unit tests of ComputeScrollDamage and ScrollPixels.
+//
+// The damage from a scroll must cover exactly the pixels that didn't stay
+// in view, and scrolling the back buffer then composing only that damage
+// must give the same picture as composing the whole view again.
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "MapBitmapStore.h"
+#include "MapImage.h"
+#include "PixelBlit.h"
+#include "TileLayer.h"
+#include "TileSystem.h"
+#include "ViewScroll.h"
+
+namespace
+{
+    // a pixel value that says where in the buffer it started
+    uint32_t PixelFor(int x, int y)
+    {
+        return ((uint32_t)y << 16) | (uint32_t)x;
+    }
+
+    std::shared_ptr<MapImage> NumberedImage(int nWidth, int nHeight)
+    {
+        std::shared_ptr<MapImage> pImage = MapImage::Create(nWidth, nHeight);
+
+        for (int y = 0; y < nHeight; y++)
+        {
+            uint32_t* pRow = (uint32_t*)pImage->Row(y);
+
+            for (int x = 0; x < nWidth; x++)
+            {
+                pRow[x] = PixelFor(x, y);
+            }
+        }
+
+        return pImage;
+    }
+
+    uint32_t At(const MapImage& image, int x, int y)
+    {
+        return ((const uint32_t*)image.Row(y))[x];
+    }
+
+    bool Contains(const PixelRect& rc, int x, int y)
+    {
+        return x >= rc.left && x < rc.right && y >= rc.top && y < rc.bottom;
+    }
+
+    // how many of the damage's rectangles hold x, y
+    int TimesCovered(const ScrollDamage& damage, int x, int y)
+    {
+        int nCount = 0;
+
+        for (int i = 0; i < damage.nExposed; i++)
+        {
+            if (Contains(damage.exposed[i], x, y))
+            {
+                nCount++;
+            }
+        }
+
+        return nCount;
+    }
+
+    // a tile whose every pixel says which world pixel it is, so any tile
+    // drawn in the wrong place shows
+    MapImageHandle WorldTile(int nTileX, int nTileY)
+    {
+        std::shared_ptr<MapImage> pImage = MapImage::Create(TileSystem::kTileSize, TileSystem::kTileSize);
+
+        for (int y = 0; y < TileSystem::kTileSize; y++)
+        {
+            uint32_t* pRow = (uint32_t*)pImage->Row(y);
+
+            for (int x = 0; x < TileSystem::kTileSize; x++)
+            {
+                pRow[x] = PixelFor((nTileX * TileSystem::kTileSize + x) & 0xFFFF, nTileY * TileSystem::kTileSize + y);
+            }
+        }
+
+        return pImage;
+    }
+}
+
+TEST(ViewScroll, DamageCoversWhatScrolledIn)
+{
+    const int kWidth = 40;
+    const int kHeight = 30;
+
+    for (int dy = -35; dy <= 35; dy += 5)
+    {
+        for (int dx = -45; dx <= 45; dx += 5)
+        {
+            ScrollDamage damage = ComputeScrollDamage(kWidth, kHeight, dx, dy);
+
+            ASSERT_LE(damage.nExposed, 2);
+
+            // each pixel is either kept, having come from inside the view,
+            // or exposed, exactly once
+            for (int y = 0; y < kHeight; y++)
+            {
+                for (int x = 0; x < kWidth; x++)
+                {
+                    bool bFromView = Contains(PixelRect{ 0, 0, kWidth, kHeight }, x - dx, y - dy);
+
+                    EXPECT_EQ(bFromView, Contains(damage.kept, x, y)) << dx << ", " << dy << " at " << x << ", " << y;
+                    EXPECT_EQ(bFromView ? 0 : 1, TimesCovered(damage, x, y)) << dx << ", " << dy << " at " << x << ", " << y;
+                }
+            }
+        }
+    }
+}
+
+TEST(ViewScroll, NoDamageWithoutMoving)
+{
+    ScrollDamage damage = ComputeScrollDamage(100, 50, 0, 0);
+
+    EXPECT_EQ(0, damage.nExposed);
+    EXPECT_EQ(100, damage.kept.Width());
+    EXPECT_EQ(50, damage.kept.Height());
+
+    // and an empty view has nothing to draw however far it moves
+    damage = ComputeScrollDamage(0, 0, 10, 10);
+
+    EXPECT_EQ(0, damage.nExposed);
+    EXPECT_TRUE(damage.kept.IsEmpty());
+}
+
+TEST(ViewScroll, ScrollPixelsMovesEveryKeptPixel)
+{
+    const int kWidth = 37;
+    const int kHeight = 23;
+
+    for (int dy = -25; dy <= 25; dy += 3)
+    {
+        for (int dx = -40; dx <= 40; dx += 7)
+        {
+            std::shared_ptr<MapImage> pImage = NumberedImage(kWidth, kHeight);
+
+            ScrollPixels(PixelBufferOf(*pImage), dx, dy);
+
+            ScrollDamage damage = ComputeScrollDamage(kWidth, kHeight, dx, dy);
+
+            for (int y = 0; y < kHeight; y++)
+            {
+                for (int x = 0; x < kWidth; x++)
+                {
+                    // kept pixels came from dx, dy away; the rest are untouched
+                    uint32_t expected = Contains(damage.kept, x, y) ? PixelFor(x - dx, y - dy) : PixelFor(x, y);
+
+                    ASSERT_EQ(expected, At(*pImage, x, y)) << dx << ", " << dy << " at " << x << ", " << y;
+                }
+            }
+        }
+    }
+}
+
+TEST(ViewScroll, ScrollThenComposeMatchesAFullCompose)
+{
+    // level 3 is 8 x 8 tiles, all of them in the store
+    MapBitmapStore store;
+
+    for (int y = 0; y < 8; y++)
+    {
+        for (int x = 0; x < 8; x++)
+        {
+            store.Insert(MapRequestKey::ForTile(DEFAULT_IMAGERY_SET, TileSystem::TileXYToQuadKey(x, y, 3)),
+                WorldTile(x, y));
+        }
+    }
+
+    const int kWidth = 300;
+    const int kHeight = 200;
+
+    TileLayer layer;
+    layer.CenterOn(20, 10, 3);
+    layer.Resize(kWidth, kHeight);
+
+    std::shared_ptr<MapImage> pScrolled = MapImage::Create(kWidth, kHeight);
+    std::shared_ptr<MapImage> pComposed = MapImage::Create(kWidth, kHeight);
+    PixelRect view = { 0, 0, kWidth, kHeight };
+    std::vector<MapRequestKey> missing;
+
+    layer.Compose(store, PixelBufferOf(*pScrolled), view, missing);
+
+    // drags in every direction, one across the date line and one too far
+    // to keep anything
+    const int kDrags[][2] = { { 17, 0 }, { 0, -23 }, { -31, 44 }, { 250, 120 }, { -2000, 5 }, { 400, -300 } };
+
+    for (const auto& drag : kDrags)
+    {
+        int nMovedX = 0;
+        int nMovedY = 0;
+
+        // dragging the map east moves the view west
+        layer.PanBy(-drag[0], -drag[1], &nMovedX, &nMovedY);
+
+        ScrollPixels(PixelBufferOf(*pScrolled), -nMovedX, -nMovedY);
+
+        ScrollDamage damage = ComputeScrollDamage(kWidth, kHeight, -nMovedX, -nMovedY);
+
+        for (int i = 0; i < damage.nExposed; i++)
+        {
+            layer.Compose(store, PixelBufferOf(*pScrolled), damage.exposed[i], missing);
+        }
+
+        layer.Compose(store, PixelBufferOf(*pComposed), view, missing);
+
+        for (int y = 0; y < kHeight; y++)
+        {
+            for (int x = 0; x < kWidth; x++)
+            {
+                ASSERT_EQ(At(*pComposed, x, y), At(*pScrolled, x, y))
+                    << "drag " << drag[0] << ", " << drag[1] << " at " << x << ", " << y;
+            }
+        }
+    }
+}